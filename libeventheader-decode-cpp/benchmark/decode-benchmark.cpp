@@ -0,0 +1,932 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Measures decode throughput for EventEnumerator, EventFormatter, and
+PerfDataFile.
+
+Corpora:
+
+- EventHeaderInterceptorLE64.dat: the decode-dat-utest input (eventheader
+  events as written by the interceptor sample, all field types).
+- synthetic-<encoding>: events generated in memory, one corpus per group of
+  field encodings (integers, utf8, utf16, arrays, structs), so that a change in
+  one decode path shows up in its own row.
+- perf.data, pipe.data: the decode-perf-utest inputs.
+- synthetic-<encoding>.perf.data: the synthetic events written to perf.data
+  files (one per encoding) with PerfDataFileWriter.
+
+Benchmarks:
+
+- enumerate: EventEnumerator::StartEvent + MoveNext to the end of the event
+  (in-memory corpora only).
+- json: EventFormatter::AppendEventAsJsonAndMoveToEnd (in-memory corpora) or
+  AppendSampleAsJson (perf.data corpora), once per formatter flag set. The
+  "buffer" sink uses the non-allocating caller-provided buffer overload.
+- read: PerfDataFile::ReadEvent + GetSampleEventInfo (perf.data corpora only).
+  Time spent opening the file is not included.
+
+Each repetition processes the corpus as many times as needed to decode at
+least -e events. Results are written to stdout as JSON lines, e.g.:
+
+{"corpus":"synthetic-utf8","bench":"json","flags":"space","sink":"string",
+ "events":100000,"bytes":12800000,"repetitions":5,
+ "ns_min":250.1,"ns_median":255.3,"mb_per_sec":511.8}
+
+ns_min and ns_median are ns/event over the repetitions. mb_per_sec is input
+bytes (event data, or perf_event_header.size for perf.data corpora) per second
+at ns_min.
+*/
+
+#include <eventheader/EventEnumerator.h>
+#include <eventheader/EventFormatter.h>
+#include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfDataFileWriter.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <tracepoint/PerfEventInfo.h>
+#include <tracepoint/PerfEventMetadata.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <share.h>
+#define fopen(filename, mode) _fsopen(filename, mode, _SH_DENYWR)
+#endif // _WIN32
+
+#ifndef DECODE_BENCHMARK_DATA_DIR
+#define DECODE_BENCHMARK_DATA_DIR "."
+#endif
+
+using namespace std::string_view_literals;
+using namespace eventheader_decode;
+using namespace tracepoint_decode;
+
+static constexpr char SyntheticTracepointName[] = "DecodeBenchmark_L4K1";
+static constexpr uint32_t SyntheticTracepointId = 1234;
+static constexpr uint64_t SyntheticSampleId = 1;
+
+volatile size_t g_benchmarkSink;
+
+struct Options
+{
+    size_t MinEvents = 100000;
+    unsigned Repetitions = 5;
+    size_t SyntheticCount = 10000;
+    char const* DataDir = DECODE_BENCHMARK_DATA_DIR;
+    char const* Filter = nullptr;
+    bool KeepFiles = false;
+};
+
+struct FlagSet
+{
+    char const* Name;
+    EventFormatterJsonFlags JsonFlags;
+    EventFormatterMetaFlags MetaFlags;
+};
+
+static FlagSet const FlagSets[] = {
+    { "none", EventFormatterJsonFlags_None, EventFormatterMetaFlags_None },
+    { "space", EventFormatterJsonFlags_Space, EventFormatterMetaFlags_None },
+    { "name_space_tag",
+        static_cast<EventFormatterJsonFlags>(EventFormatterJsonFlags_Name | EventFormatterJsonFlags_Space | EventFormatterJsonFlags_FieldTag),
+        EventFormatterMetaFlags_None },
+    { "meta_default", EventFormatterJsonFlags_None, EventFormatterMetaFlags_Default },
+    { "meta_all", EventFormatterJsonFlags_Space, EventFormatterMetaFlags_All },
+};
+
+// The flag set used for the "buffer" sink.
+static FlagSet const& BufferFlagSet = FlagSets[3];
+
+struct MemoryEvent
+{
+    size_t NamePos;
+    size_t DataPos;
+    uint32_t NameSize;
+    uint32_t DataSize;
+};
+
+// Events stored in memory as (tracepoint name, eventheader data) pairs.
+struct MemoryCorpus
+{
+    std::string Name;
+    std::string Storage;
+    std::vector<MemoryEvent> Events;
+    size_t DataBytes = 0;
+
+    void
+    Add(size_t namePos, uint32_t nameSize, size_t dataPos, uint32_t dataSize)
+    {
+        Events.push_back({ namePos, dataPos, nameSize, dataSize });
+        DataBytes += dataSize;
+    }
+};
+
+struct PerfCorpus
+{
+    std::string Name;
+    std::string Path;
+    bool Mapped;
+    bool Remove;
+};
+
+/*
+Builds an eventheader event with a metadata extension, i.e. the data that
+follows the common fields of a user_events eventheader tracepoint.
+*/
+class SyntheticEventBuilder
+{
+    std::string m_meta;
+    std::string m_data;
+
+public:
+
+    explicit
+    SyntheticEventBuilder(char const* eventName)
+    {
+        m_meta.append(eventName, strlen(eventName) + 1);
+    }
+
+    // format == 0 means no format byte. carrayCount is used only if encoding
+    // has the carray flag.
+    void
+    AddField(char const* name, uint8_t encoding, uint8_t format = 0, uint16_t carrayCount = 0)
+    {
+        m_meta.append(name, strlen(name) + 1);
+        if (format == 0)
+        {
+            m_meta.push_back(static_cast<char>(encoding));
+        }
+        else
+        {
+            m_meta.push_back(static_cast<char>(encoding | event_field_encoding_chain_flag));
+            m_meta.push_back(static_cast<char>(format));
+        }
+
+        if (encoding & event_field_encoding_carray_flag)
+        {
+            AppendValue(m_meta, carrayCount);
+        }
+    }
+
+    template<class T>
+    void
+    AddValue(T value)
+    {
+        AppendValue(m_data, value);
+    }
+
+    void
+    AddString8(char const* value, bool counted)
+    {
+        auto const size = strlen(value);
+        if (counted)
+        {
+            AppendValue(m_data, static_cast<uint16_t>(size));
+            m_data.append(value, size);
+        }
+        else
+        {
+            m_data.append(value, size + 1);
+        }
+    }
+
+    void
+    AddString16(char16_t const* value, bool counted)
+    {
+        auto const size = std::char_traits<char16_t>::length(value);
+        if (counted)
+        {
+            AppendValue(m_data, static_cast<uint16_t>(size));
+            m_data.append(reinterpret_cast<char const*>(value), size * sizeof(char16_t));
+        }
+        else
+        {
+            m_data.append(reinterpret_cast<char const*>(value), (size + 1) * sizeof(char16_t));
+        }
+    }
+
+    std::string
+    Finish(uint16_t id) const
+    {
+        eventheader header = {};
+        header.flags = eventheader_flag_default_with_extension;
+        header.id = id;
+        header.level = 4;
+
+        eventheader_extension ext = {};
+        ext.size = static_cast<uint16_t>(m_meta.size());
+        ext.kind = eventheader_extension_kind_metadata;
+
+        std::string result;
+        result.append(reinterpret_cast<char const*>(&header), sizeof(header));
+        result.append(reinterpret_cast<char const*>(&ext), sizeof(ext));
+        result += m_meta;
+        result += m_data;
+        return result;
+    }
+
+private:
+
+    template<class T>
+    static void
+    AppendValue(std::string& dest, T value)
+    {
+        dest.append(reinterpret_cast<char const*>(&value), sizeof(value));
+    }
+};
+
+struct SyntheticEvent
+{
+    char const* Name; // Corpus name suffix, e.g. "utf8".
+    std::string Data; // eventheader event data.
+};
+
+static std::vector<SyntheticEvent>
+MakeSyntheticEvents()
+{
+    static char const* const Text8[] = {
+        "Hello, world",
+        "The quick brown fox jumps over the lazy dog",
+        "path/to/some/file.txt",
+        "Caf\xC3\xA9 \xE2\x82\xAC\"quoted\"\\slash\\",
+    };
+    static char16_t const* const Text16[] = {
+        u"Hello, world",
+        u"The quick brown fox jumps over the lazy dog",
+        u"path/to/some/file.txt",
+        u"Caf\u00E9 \u20AC\"quoted\"\\slash\\",
+    };
+
+    std::vector<SyntheticEvent> events;
+
+    {
+        SyntheticEventBuilder b("Integers");
+        b.AddField("i32", event_field_encoding_value32, event_field_format_signed_int);
+        b.AddField("u32", event_field_encoding_value32, event_field_format_unsigned_int);
+        b.AddField("x32", event_field_encoding_value32, event_field_format_hex_int);
+        b.AddField("b32", event_field_encoding_value32, event_field_format_boolean);
+        b.AddField("i64", event_field_encoding_value64, event_field_format_signed_int);
+        b.AddField("u64", event_field_encoding_value64, event_field_format_unsigned_int);
+        b.AddField("x64", event_field_encoding_value64, event_field_format_hex_int);
+        b.AddField("u8", event_field_encoding_value8);
+        b.AddValue(int32_t(-123456));
+        b.AddValue(uint32_t(3000000000u));
+        b.AddValue(uint32_t(0xDEADBEEF));
+        b.AddValue(uint32_t(1));
+        b.AddValue(int64_t(-1234567890123));
+        b.AddValue(uint64_t(18000000000000000000u));
+        b.AddValue(uint64_t(0x0123456789ABCDEF));
+        b.AddValue(uint8_t(200));
+        events.push_back({ "integers", b.Finish(1) });
+    }
+
+    {
+        SyntheticEventBuilder b("Utf8");
+        for (unsigned i = 0; i != 4; i += 1)
+        {
+            char name[] = "z0";
+            name[1] = static_cast<char>('0' + i);
+            b.AddField(name, event_field_encoding_zstring_char8, event_field_format_string_utf);
+        }
+        for (unsigned i = 0; i != 4; i += 1)
+        {
+            char name[] = "s0";
+            name[1] = static_cast<char>('0' + i);
+            b.AddField(name, event_field_encoding_string_length16_char8, event_field_format_string_utf);
+        }
+        for (auto const text : Text8) b.AddString8(text, false);
+        for (auto const text : Text8) b.AddString8(text, true);
+        events.push_back({ "utf8", b.Finish(2) });
+    }
+
+    {
+        SyntheticEventBuilder b("Utf16");
+        for (unsigned i = 0; i != 4; i += 1)
+        {
+            char name[] = "z0";
+            name[1] = static_cast<char>('0' + i);
+            b.AddField(name, event_field_encoding_zstring_char16);
+        }
+        for (unsigned i = 0; i != 4; i += 1)
+        {
+            char name[] = "s0";
+            name[1] = static_cast<char>('0' + i);
+            b.AddField(name, event_field_encoding_string_length16_char16);
+        }
+        for (auto const text : Text16) b.AddString16(text, false);
+        for (auto const text : Text16) b.AddString16(text, true);
+        events.push_back({ "utf16", b.Finish(3) });
+    }
+
+    {
+        SyntheticEventBuilder b("Arrays");
+        b.AddField("u32s", event_field_encoding_value32 | event_field_encoding_varray_flag);
+        b.AddField("x16s", event_field_encoding_value16 | event_field_encoding_carray_flag, event_field_format_hex_int, 16);
+        b.AddField("strs", event_field_encoding_string_length16_char8 | event_field_encoding_varray_flag);
+        b.AddValue(uint16_t(64));
+        for (uint32_t i = 0; i != 64; i += 1) b.AddValue(i * 1000003u);
+        for (uint16_t i = 0; i != 16; i += 1) b.AddValue(static_cast<uint16_t>(i * 0x1111u));
+        b.AddValue(uint16_t(8));
+        for (unsigned i = 0; i != 8; i += 1) b.AddString8(Text8[i % 4], true);
+        events.push_back({ "arrays", b.Finish(4) });
+    }
+
+    {
+        SyntheticEventBuilder b("Structs");
+        b.AddField("point", event_field_encoding_struct, 3);
+        b.AddField("x", event_field_encoding_value32, event_field_format_signed_int);
+        b.AddField("y", event_field_encoding_value32, event_field_format_signed_int);
+        b.AddField("label", event_field_encoding_zstring_char8, event_field_format_string_utf);
+        b.AddField("items", event_field_encoding_struct | event_field_encoding_varray_flag, 2);
+        b.AddField("key", event_field_encoding_string_length16_char8, event_field_format_string_utf);
+        b.AddField("inner", event_field_encoding_struct, 2);
+        b.AddField("id", event_field_encoding_value64, event_field_format_hex_int);
+        b.AddField("ok", event_field_encoding_value8, event_field_format_boolean);
+        b.AddValue(int32_t(-10));
+        b.AddValue(int32_t(20));
+        b.AddString8(Text8[0], false);
+        b.AddValue(uint16_t(8));
+        for (unsigned i = 0; i != 8; i += 1)
+        {
+            b.AddString8(Text8[i % 4], true);
+            b.AddValue(uint64_t(0x1000u + i));
+            b.AddValue(uint8_t(i & 1));
+        }
+        events.push_back({ "structs", b.Finish(5) });
+    }
+
+    return events;
+}
+
+static uint64_t
+NowNs() noexcept
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Returns true if the benchmark should run (the filter matches the corpus or bench name).
+static bool
+Selected(Options const& options, std::string const& corpusName, char const* bench) noexcept
+{
+    return options.Filter == nullptr ||
+        corpusName.find(options.Filter) != std::string::npos ||
+        strstr(bench, options.Filter) != nullptr;
+}
+
+/*
+Runs passFn (which processes the corpus once and returns the elapsed ns) enough
+times per repetition to process at least options.MinEvents events, and prints
+one JSON line with the results.
+*/
+template<class PassFn>
+static void
+RunBenchmark(
+    Options const& options,
+    std::string const& corpusName,
+    char const* bench,
+    char const* flags,
+    char const* sink,
+    size_t eventsPerPass,
+    size_t bytesPerPass,
+    PassFn&& passFn)
+{
+    if (eventsPerPass == 0)
+    {
+        return;
+    }
+
+    auto const passes = std::max<size_t>(1, (options.MinEvents + eventsPerPass - 1) / eventsPerPass);
+    auto const events = passes * eventsPerPass;
+
+    passFn(); // Warm up.
+
+    std::vector<double> nsPerEvent;
+    nsPerEvent.reserve(options.Repetitions);
+    for (unsigned rep = 0; rep != options.Repetitions; rep += 1)
+    {
+        uint64_t ns = 0;
+        for (size_t pass = 0; pass != passes; pass += 1)
+        {
+            ns += passFn();
+        }
+
+        nsPerEvent.push_back(static_cast<double>(ns) / static_cast<double>(events));
+    }
+
+    std::sort(nsPerEvent.begin(), nsPerEvent.end());
+    auto const nsMin = nsPerEvent.front();
+    auto const bytesPerEvent = static_cast<double>(bytesPerPass) / static_cast<double>(eventsPerPass);
+    printf("{\"corpus\":\"%s\",\"bench\":\"%s\",\"flags\":\"%s\",\"sink\":\"%s\","
+        "\"events\":%zu,\"bytes\":%zu,\"repetitions\":%u,"
+        "\"ns_min\":%.3f,\"ns_median\":%.3f,\"mb_per_sec\":%.1f}\n",
+        corpusName.c_str(), bench, flags, sink,
+        events, passes * bytesPerPass, options.Repetitions,
+        nsMin, nsPerEvent[nsPerEvent.size() / 2],
+        nsMin > 0 ? bytesPerEvent * 1000.0 / nsMin : 0.0);
+    fflush(stdout);
+}
+
+static void
+RunMemoryCorpus(Options const& options, MemoryCorpus const& corpus)
+{
+    EventEnumerator enumerator;
+    EventFormatter formatter;
+    EventFormatterCache formatterCache;
+    std::string dest;
+    std::vector<char> buffer(65536);
+    auto const storage = corpus.Storage.data();
+
+    if (Selected(options, corpus.Name, "enumerate"))
+    {
+        RunBenchmark(options, corpus.Name, "enumerate", "", "", corpus.Events.size(), corpus.DataBytes,
+            [&]()
+            {
+                size_t items = 0;
+                auto const start = NowNs();
+                for (auto const& e : corpus.Events)
+                {
+                    if (enumerator.StartEvent(storage + e.NamePos, e.NameSize, storage + e.DataPos, e.DataSize))
+                    {
+                        while (enumerator.MoveNext())
+                        {
+                            items += enumerator.GetItemInfo().ValueSize;
+                        }
+                    }
+                }
+                auto const stop = NowNs();
+                g_benchmarkSink = items;
+                return stop - start;
+            });
+    }
+
+    if (Selected(options, corpus.Name, "json"))
+    {
+        for (auto const& flagSet : FlagSets)
+        {
+            RunBenchmark(options, corpus.Name, "json", flagSet.Name, "string", corpus.Events.size(), corpus.DataBytes,
+                [&]()
+                {
+                    size_t chars = 0;
+                    auto const start = NowNs();
+                    for (auto const& e : corpus.Events)
+                    {
+                        if (enumerator.StartEvent(storage + e.NamePos, e.NameSize, storage + e.DataPos, e.DataSize))
+                        {
+                            dest.clear();
+                            formatter.AppendEventAsJsonAndMoveToEnd(dest, enumerator, flagSet.JsonFlags, flagSet.MetaFlags, &formatterCache);
+                            chars += dest.size();
+                        }
+                    }
+                    auto const stop = NowNs();
+                    g_benchmarkSink = chars;
+                    return stop - start;
+                });
+        }
+
+        RunBenchmark(options, corpus.Name, "json", BufferFlagSet.Name, "buffer", corpus.Events.size(), corpus.DataBytes,
+            [&]()
+            {
+                size_t chars = 0;
+                auto const start = NowNs();
+                for (auto const& e : corpus.Events)
+                {
+                    size_t used;
+                    if (enumerator.StartEvent(storage + e.NamePos, e.NameSize, storage + e.DataPos, e.DataSize) &&
+                        0 == formatter.AppendEventAsJsonAndMoveToEnd(buffer.data(), buffer.size(), &used,
+                            enumerator, BufferFlagSet.JsonFlags, BufferFlagSet.MetaFlags, &formatterCache))
+                    {
+                        chars += used;
+                    }
+                }
+                auto const stop = NowNs();
+                g_benchmarkSink = chars;
+                return stop - start;
+            });
+    }
+}
+
+/*
+Opens the file, then reads all events, calling sampleFn for each sample.
+Returns the ns spent reading (not opening). Sets *pEvents and *pBytes to the
+number of samples and the total size of all events read.
+*/
+template<class SampleFn>
+static uint64_t
+ReadPerfFile(
+    PerfDataFile& file,
+    PerfCorpus const& corpus,
+    size_t* pEvents,
+    size_t* pBytes,
+    SampleFn&& sampleFn)
+{
+    PerfSampleEventInfo info;
+    size_t events = 0;
+    size_t bytes = 0;
+
+    int err = corpus.Mapped ? file.OpenMapped(corpus.Path.c_str()) : file.Open(corpus.Path.c_str());
+    if (err != 0)
+    {
+        fprintf(stderr, "error: open(%s) failed: %d\n", corpus.Path.c_str(), err);
+        exit(1);
+    }
+
+    auto const fileBigEndian = file.FileBigEndian();
+    auto const start = NowNs();
+    for (;;)
+    {
+        perf_event_header const* header;
+        err = file.ReadEvent(&header);
+        if (header == nullptr)
+        {
+            break;
+        }
+
+        bytes += header->size;
+        if (header->type == PERF_RECORD_SAMPLE &&
+            0 == file.GetSampleEventInfo(header, &info))
+        {
+            events += 1;
+            sampleFn(info, fileBigEndian);
+        }
+    }
+    auto const stop = NowNs();
+
+    file.Close();
+    *pEvents = events;
+    *pBytes = bytes;
+    return stop - start;
+}
+
+static void
+RunPerfCorpus(Options const& options, PerfCorpus const& corpus)
+{
+    PerfDataFile file;
+    EventFormatter formatter;
+    EventFormatterCache formatterCache;
+    std::string dest;
+    size_t events, bytes;
+
+    ReadPerfFile(file, corpus, &events, &bytes, [](PerfSampleEventInfo const&, bool) {});
+
+    if (Selected(options, corpus.Name, "read"))
+    {
+        RunBenchmark(options, corpus.Name, "read", "", "", events, bytes,
+            [&]()
+            {
+                size_t sum = 0;
+                size_t passEvents, passBytes;
+                auto const ns = ReadPerfFile(file, corpus, &passEvents, &passBytes,
+                    [&](PerfSampleEventInfo const& info, bool)
+                    {
+                        sum += info.raw_data_size;
+                    });
+                g_benchmarkSink = sum;
+                return ns;
+            });
+    }
+
+    if (Selected(options, corpus.Name, "json"))
+    {
+        for (auto const& flagSet : FlagSets)
+        {
+            RunBenchmark(options, corpus.Name, "json", flagSet.Name, "string", events, bytes,
+                [&]()
+                {
+                    size_t chars = 0;
+                    size_t passEvents, passBytes;
+                    auto const ns = ReadPerfFile(file, corpus, &passEvents, &passBytes,
+                        [&](PerfSampleEventInfo const& info, bool fileBigEndian)
+                        {
+                            dest.clear();
+                            formatter.AppendSampleAsJson(dest, info, fileBigEndian, flagSet.JsonFlags, flagSet.MetaFlags, 4096, &formatterCache);
+                            chars += dest.size();
+                        });
+                    g_benchmarkSink = chars;
+                    return ns;
+                });
+        }
+    }
+}
+
+static bool
+LoadDatCorpus(char const* path, MemoryCorpus& corpus)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    char buf[4096];
+    size_t size;
+    while (0 != (size = fread(buf, 1, sizeof(buf), file)))
+    {
+        corpus.Storage.append(buf, size);
+    }
+    fclose(file);
+
+    // Records: uint32 recordSize (including itself), nul-terminated tracepoint name, event data.
+    // Assumes the file was written by a little-endian host (as in decode-dat-utest).
+    auto const& dat = corpus.Storage;
+    size_t pos = 0;
+    while (dat.size() - pos >= sizeof(uint32_t))
+    {
+        uint32_t recordSize;
+        memcpy(&recordSize, dat.data() + pos, sizeof(recordSize));
+        if (recordSize <= sizeof(recordSize) || dat.size() - pos < recordSize)
+        {
+            break;
+        }
+
+        auto const recordPos = pos + sizeof(recordSize);
+        auto const dataSize = recordSize - static_cast<uint32_t>(sizeof(recordSize));
+        auto const nameSize = static_cast<uint32_t>(strnlen(dat.data() + recordPos, dataSize));
+        if (nameSize != dataSize)
+        {
+            corpus.Add(recordPos, nameSize, recordPos + nameSize + 1, dataSize - nameSize - 1);
+        }
+
+        pos += recordSize;
+    }
+
+    return true;
+}
+
+/*
+Writes count copies of the synthetic event to a new perf.data file as samples
+of a user_events tracepoint. Returns 0 for success, errno for error.
+*/
+static int
+WriteSyntheticPerfFile(char const* path, std::string const& eventData, size_t count)
+{
+    // Common fields (8 bytes) followed by the eventheader fields.
+    static constexpr auto Format =
+        "name: DecodeBenchmark_L4K1\n"
+        "ID: 1234\n"
+        "format:\n"
+        "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+        "\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+        "\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+        "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+        "\n"
+        "\tfield:u8 eventheader_flags;\toffset:8;\tsize:1;\tsigned:0;\n"
+        "\tfield:u8 version;\toffset:9;\tsize:1;\tsigned:0;\n"
+        "\tfield:u16 id;\toffset:10;\tsize:2;\tsigned:0;\n"
+        "\tfield:u16 tag;\toffset:12;\tsize:2;\tsigned:0;\n"
+        "\tfield:u8 opcode;\toffset:14;\tsize:1;\tsigned:0;\n"
+        "\tfield:u8 level;\toffset:15;\tsize:1;\tsigned:0;\n"
+        "\n"
+        "print fmt: \"\"\n"sv;
+    static constexpr uint32_t CommonFieldsSize = 8;
+
+    int error;
+    PerfEventMetadata metadata;
+    PerfDataFileWriter writer;
+    std::string sample;
+
+    if (!metadata.Parse(sizeof(long) == 8, "user_events"sv, Format))
+    {
+        return EINVAL;
+    }
+
+    error = writer.Create(path);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    {
+        perf_event_attr attr = {};
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = static_cast<perf_event_attr_size>(sizeof(attr));
+        attr.config = SyntheticTracepointId;
+        attr.sample_period = 1;
+        attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_RAW;
+        attr.sample_id_all = 1;
+
+        PerfEventDesc desc = {};
+        desc.attr = &attr;
+        desc.name = "user_events:DecodeBenchmark_L4K1";
+        desc.metadata = &metadata;
+        desc.ids = &SyntheticSampleId;
+        desc.ids_count = 1;
+        error = writer.AddTracepointEventDesc(desc);
+        if (error != 0)
+        {
+            goto Done;
+        }
+    }
+
+    {
+        // perf_event_header, id, pid+tid, time, cpu+res, raw size, raw data, padding to 8 bytes.
+        auto const rawSize = static_cast<uint32_t>(CommonFieldsSize + eventData.size());
+        auto const sampleSize = (sizeof(perf_event_header) + 8 + 8 + 8 + 8 + 4 + rawSize + 7) & ~size_t(7);
+        if (sampleSize > 0xFFFF)
+        {
+            error = E2BIG;
+            goto Done;
+        }
+
+        perf_event_header header = {};
+        header.type = PERF_RECORD_SAMPLE;
+        header.size = static_cast<uint16_t>(sampleSize);
+
+        uint16_t const commonType = SyntheticTracepointId;
+        uint32_t const pidTid[2] = { 100, 101 };
+        uint32_t const cpu[2] = { 0, 0 };
+
+        for (size_t i = 0; i != count && error == 0; i += 1)
+        {
+            uint64_t const time = 1000000000u + i * 1000u;
+            sample.clear();
+            sample.append(reinterpret_cast<char const*>(&header), sizeof(header));
+            sample.append(reinterpret_cast<char const*>(&SyntheticSampleId), sizeof(SyntheticSampleId));
+            sample.append(reinterpret_cast<char const*>(pidTid), sizeof(pidTid));
+            sample.append(reinterpret_cast<char const*>(&time), sizeof(time));
+            sample.append(reinterpret_cast<char const*>(cpu), sizeof(cpu));
+            sample.append(reinterpret_cast<char const*>(&rawSize), sizeof(rawSize));
+            sample.append(reinterpret_cast<char const*>(&commonType), sizeof(commonType));
+            sample.append(2, '\0'); // common_flags, common_preempt_count.
+            sample.append(reinterpret_cast<char const*>(&pidTid[0]), sizeof(pidTid[0])); // common_pid.
+            sample += eventData;
+            sample.resize(sampleSize, '\0');
+            error = writer.WriteEventData(sample.data(), sample.size());
+        }
+    }
+
+    if (error == 0)
+    {
+        error = writer.SetSampleTimeHeader(1000000000u, 1000000000u + count * 1000u);
+    }
+
+Done:
+
+    if (error == 0)
+    {
+        error = writer.FinalizeAndClose();
+    }
+    else
+    {
+        writer.CloseNoFinalize();
+    }
+
+    return error;
+}
+
+static void
+Usage(char const* programName)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Measures decode throughput (ns/event, MB/s) of EventEnumerator,\n"
+        "EventFormatter, and PerfDataFile per corpus and formatter flag set.\n"
+        "Results are written to stdout as JSON lines.\n"
+        "Options:\n"
+        "  -e N       Minimum events per repetition (default 100000).\n"
+        "  -r N       Repetitions per benchmark (default 5).\n"
+        "  -n N       Events per synthetic corpus (default 10000).\n"
+        "  -d DIR     Directory with the test inputs (default: build directory).\n"
+        "             Synthetic perf.data files are also written here.\n"
+        "  -f TEXT    Only run benchmarks whose corpus or bench name contains TEXT.\n"
+        "  -k         Keep the synthetic perf.data files.\n",
+        programName);
+}
+
+int
+main(int argc, char* argv[])
+{
+    Options options;
+    for (int argi = 1; argi < argc; argi += 1)
+    {
+        auto const arg = argv[argi];
+        bool const hasValue = argi + 1 < argc;
+        if (0 == strcmp(arg, "-e") && hasValue)
+        {
+            argi += 1;
+            options.MinEvents = strtoul(argv[argi], nullptr, 0);
+        }
+        else if (0 == strcmp(arg, "-r") && hasValue)
+        {
+            argi += 1;
+            options.Repetitions = static_cast<unsigned>(strtoul(argv[argi], nullptr, 0));
+        }
+        else if (0 == strcmp(arg, "-n") && hasValue)
+        {
+            argi += 1;
+            options.SyntheticCount = strtoul(argv[argi], nullptr, 0);
+        }
+        else if (0 == strcmp(arg, "-d") && hasValue)
+        {
+            argi += 1;
+            options.DataDir = argv[argi];
+        }
+        else if (0 == strcmp(arg, "-f") && hasValue)
+        {
+            argi += 1;
+            options.Filter = argv[argi];
+        }
+        else if (0 == strcmp(arg, "-k"))
+        {
+            options.KeepFiles = true;
+        }
+        else
+        {
+            Usage(argv[0]);
+            return 0 == strcmp(arg, "-h") || 0 == strcmp(arg, "--help") ? 0 : 1;
+        }
+    }
+
+    if (options.Repetitions == 0 || options.SyntheticCount == 0)
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    std::string const dataDir = options.DataDir;
+    auto const syntheticEvents = MakeSyntheticEvents();
+    std::vector<PerfCorpus> perfCorpora;
+
+    // In-memory corpora.
+    {
+        MemoryCorpus corpus;
+        corpus.Name = "EventHeaderInterceptorLE64.dat";
+        if (!LoadDatCorpus((dataDir + "/" + corpus.Name).c_str(), corpus))
+        {
+            fprintf(stderr, "warning: %s/%s not found, skipping.\n", dataDir.c_str(), corpus.Name.c_str());
+        }
+        else
+        {
+            RunMemoryCorpus(options, corpus);
+        }
+    }
+
+    for (auto const& synthetic : syntheticEvents)
+    {
+        MemoryCorpus corpus;
+        corpus.Name = std::string("synthetic-") + synthetic.Name;
+        corpus.Storage.reserve(options.SyntheticCount * (sizeof(SyntheticTracepointName) + synthetic.Data.size()));
+        for (size_t i = 0; i != options.SyntheticCount; i += 1)
+        {
+            auto const namePos = corpus.Storage.size();
+            corpus.Storage.append(SyntheticTracepointName, sizeof(SyntheticTracepointName) - 1);
+            auto const dataPos = corpus.Storage.size();
+            corpus.Storage += synthetic.Data;
+            corpus.Add(namePos, sizeof(SyntheticTracepointName) - 1, dataPos, static_cast<uint32_t>(synthetic.Data.size()));
+        }
+
+        RunMemoryCorpus(options, corpus);
+    }
+
+    // perf.data corpora.
+    perfCorpora.push_back({ "perf.data", dataDir + "/perf.data", true, false });
+    perfCorpora.push_back({ "pipe.data", dataDir + "/pipe.data", false, false });
+    for (auto const& synthetic : syntheticEvents)
+    {
+        PerfCorpus corpus;
+        corpus.Name = std::string("synthetic-") + synthetic.Name + ".perf.data";
+        corpus.Path = dataDir + "/decode-benchmark-" + synthetic.Name + ".perf.data";
+        corpus.Mapped = true;
+        corpus.Remove = !options.KeepFiles;
+
+        auto const error = WriteSyntheticPerfFile(corpus.Path.c_str(), synthetic.Data, options.SyntheticCount);
+        if (error != 0)
+        {
+            fprintf(stderr, "error: failed writing %s: %d\n", corpus.Path.c_str(), error);
+            return 1;
+        }
+
+        perfCorpora.push_back(std::move(corpus));
+    }
+
+    for (auto const& corpus : perfCorpora)
+    {
+        FILE* file = fopen(corpus.Path.c_str(), "rb");
+        if (file == nullptr)
+        {
+            fprintf(stderr, "warning: %s not found, skipping.\n", corpus.Path.c_str());
+            continue;
+        }
+
+        fclose(file);
+        RunPerfCorpus(options, corpus);
+    }
+
+    for (auto const& corpus : perfCorpora)
+    {
+        if (corpus.Remove)
+        {
+            remove(corpus.Path.c_str());
+        }
+    }
+
+    return 0;
+}
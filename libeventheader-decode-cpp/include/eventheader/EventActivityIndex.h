@@ -0,0 +1,180 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef _included_EventActivityIndex_h
+#define _included_EventActivityIndex_h 1
+
+#if __cplusplus < 201100L && (!defined(_MSVC_LANG) || _MSVC_LANG < 201100L)
+#error EventActivityIndex.h requires C++11 or later.
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace tracepoint_decode
+{
+    // Forward declarations from libtracepoint-decode
+    class PerfDataFile;
+}
+
+namespace eventheader_decode
+{
+    /*
+    Index from eventheader activity ID to the positions of the events of that
+    activity in a perf.data file, plus the parent of each activity (from the
+    RelatedActivityId of its events). Build it once with one pass over the
+    file, save it as a sidecar file, and then find all of the events of an
+    activity tree without decoding the rest of the file:
+
+        EventActivityIndex index;
+        if (index.Load(indexPath, file) != 0)
+        {
+            index.Build(file); // file opened with OpenMapped.
+            index.Save(indexPath);
+        }
+
+        std::vector<uint64_t> positions;
+        index.FindActivityTree(activityId, positions);
+        PerfDataFileChunkReader reader;
+        for (auto pos : positions)
+        {
+            reader.Reset(file, { pos, file.DataEndFilePos() });
+            reader.ReadEvent(&header); // Then file.GetSampleEventInfo(header, ...).
+        }
+
+    Only EventHeader sample events with an activity ID are indexed. Activity
+    IDs are the 16 bytes from EventInfo::ActivityId (big-endian GUID).
+
+    Sidecar format (all integers in the byte order of the writing host; a
+    reader detects a byte order mismatch by checking Version):
+
+        Header:  char Magic[8] = "EHActIdx", uint32 Version = 1,
+                 uint32 Reserved = 0, uint64 DataBeginFilePos,
+                 uint64 DataEndFilePos, uint64 EventCount, uint64 LinkCount.
+        Event:   uint8 ActivityId[16], uint64 FilePos.
+                 EventCount entries sorted by ActivityId, then FilePos.
+        Link:    uint8 ActivityId[16], uint8 ParentActivityId[16].
+                 LinkCount entries sorted by ActivityId, then parent.
+    */
+    class EventActivityIndex
+    {
+    public:
+
+        struct ActivityEvent
+        {
+            uint8_t ActivityId[16];
+            uint64_t FilePos; // Position of the event's perf_event_header.
+        };
+
+        struct ActivityLink
+        {
+            uint8_t ActivityId[16];
+            uint8_t ParentActivityId[16]; // RelatedActivityId of an event of the activity.
+        };
+
+    private:
+
+        std::vector<ActivityEvent> m_events; // Sorted by ActivityId, then FilePos.
+        std::vector<ActivityLink> m_links; // Sorted by ActivityId, then ParentActivityId. Unique.
+        std::vector<uint32_t> m_linksByParent; // Indexes into m_links, sorted by ParentActivityId.
+        uint64_t m_dataBeginFilePos;
+        uint64_t m_dataEndFilePos;
+
+    public:
+
+        /*
+        Initializes an empty index.
+        */
+        EventActivityIndex() noexcept;
+
+        /*
+        Removes all entries.
+        */
+        void
+        Clear() noexcept;
+
+        /*
+        Replaces the contents of the index with the activities of the events
+        read from file, which must be a normal-mode (not pipe-mode) file that was
+        just opened. Reads (but does not decode) every remaining event. On
+        return, the file is at end-of-file or at the event that caused an error.
+
+        Returns 0 for success, ENOTSUP if the file is pipe-mode or compressed
+        (event positions would not be seekable), or the error from ReadEvent.
+        May throw bad_alloc.
+        */
+        int
+        Build(tracepoint_decode::PerfDataFile& file);
+
+        /*
+        Writes the index to the specified sidecar file.
+        Returns 0 for success, errno for error.
+        */
+        int
+        Save(char const* indexPath) const noexcept;
+
+        /*
+        Replaces the contents of the index with the contents of the specified
+        sidecar file. Returns 0 for success, ENOENT (or other errno) if the
+        file could not be read, EINVAL if the file is not a valid index, or
+        ESTALE if the index was built from a file whose data section differs
+        from file's. On error, the index is empty. May throw bad_alloc.
+        */
+        int
+        Load(char const* indexPath, tracepoint_decode::PerfDataFile const& file);
+
+        /*
+        Returns the indexed events, sorted by ActivityId, then FilePos.
+        */
+        std::vector<ActivityEvent> const&
+        Events() const noexcept;
+
+        /*
+        Returns the parent links, sorted by ActivityId, then ParentActivityId.
+        An activity usually has at most one parent.
+        */
+        std::vector<ActivityLink> const&
+        Links() const noexcept;
+
+        /*
+        Appends the positions of the events of the specified activity (16 bytes)
+        to filePositions, in file order. Returns the number appended.
+        May throw bad_alloc.
+        */
+        size_t
+        FindActivity(
+            uint8_t const* activityId,
+            std::vector<uint64_t>& filePositions) const;
+
+        /*
+        If the specified activity has a parent (other than itself), copies the
+        first parent's ID to parentActivityId and returns true. Otherwise
+        returns false.
+        */
+        bool
+        FindParent(
+            uint8_t const* activityId,
+            uint8_t* parentActivityId) const noexcept;
+
+        /*
+        Appends the positions of the events of the specified activity and of
+        all of its descendants (children, grandchildren, etc.) to
+        filePositions, in file order. Returns the number appended.
+        May throw bad_alloc.
+        */
+        size_t
+        FindActivityTree(
+            uint8_t const* rootActivityId,
+            std::vector<uint64_t>& filePositions) const;
+
+    private:
+
+        void
+        IndexLinksByParent();
+    };
+}
+// namespace eventheader_decode
+
+#endif // _included_EventActivityIndex_h
@@ -0,0 +1,161 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef _included_EventColumnarWriter_h
+#define _included_EventColumnarWriter_h 1
+
+#if __cplusplus < 201100L && (!defined(_MSVC_LANG) || _MSVC_LANG < 201100L)
+#error EventColumnarWriter.h requires C++11 or later.
+#endif
+
+#include "EventFormatter.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace eventheader_decode
+{
+    /*
+    Type of the values in a column of an EventColumnarWriter batch.
+    */
+    enum EventColumnType : uint8_t
+    {
+        EventColumnType_Invalid,
+        EventColumnType_Int8,    // RowCount int8 values.
+        EventColumnType_Int16,   // RowCount int16 values.
+        EventColumnType_Int32,   // RowCount int32 values.
+        EventColumnType_Int64,   // RowCount int64 values.
+        EventColumnType_UInt8,   // RowCount uint8 values.
+        EventColumnType_UInt16,  // RowCount uint16 values.
+        EventColumnType_UInt32,  // RowCount uint32 values.
+        EventColumnType_UInt64,  // RowCount uint64 values.
+        EventColumnType_Float32, // RowCount float values.
+        EventColumnType_Float64, // RowCount double values.
+        EventColumnType_Utf8,    // RowCount+1 uint32 offsets, then UTF-8 text.
+        EventColumnType_Json,    // RowCount+1 uint32 offsets, then UTF-8 JSON values.
+    };
+
+    /*
+    Converts perf.data sample events into typed columnar batches, one batch per
+    event schema.
+
+    A schema is the set of events with the same tracepoint name, eventheader
+    header (id, version, opcode, tag, flags), activity ID presence, and
+    top-level field names and types. Each schema's batch has columns "time",
+    "cpu", "pid", "tid" (UInt64, UInt32, UInt32, UInt32; 0 if not present in
+    the sample) followed by one column per top-level field:
+
+    - Value8..Value64 integers with default, unsigned_int, hex_int, or boolean
+      format become UIntN columns. With signed_int, errno, pid, or time format
+      they become IntN columns.
+    - Value32 or Value64 with float format become Float32 or Float64 columns.
+    - Other scalar values (strings, UUIDs, IP addresses, etc.) become Utf8
+      columns with the same text as EventFormatter::AppendValue.
+    - Arrays and structures become Json columns with the same text as
+      EventFormatter::AppendItemAsJsonAndMoveNextSibling.
+
+    Activity IDs, if present, are "activity" and "relatedActivity" Utf8
+    columns. Samples that are not EventHeader events use a schema keyed by
+    name with a single "fields" Json column (the EventFormatter JSON object).
+
+    Output format (all integers in the byte order of the writing host; a
+    reader detects a byte order mismatch by checking Version):
+
+        FileHeader:  char Magic[8] = "EHColumn", uint32 Version = 1,
+                     uint32 Reserved = 0.
+        Batch:       uint32 BatchSize (bytes after this field), uint32 RowCount,
+                     uint16 ColumnCount, Str TracepointName, Str EventName,
+                     uint8 Flags, uint8 Version, uint16 Id, uint16 Tag,
+                     uint8 Opcode, uint8 Level, uint64 Keyword,
+                     Column[ColumnCount].
+        Column:      Str Name, uint8 EventColumnType, uint8 Encoding,
+                     uint8 Format, uint16 FieldTag, uint32 DataSize,
+                     uint8 Data[DataSize].
+        Str:         uint16 Length, char Chars[Length] (not nul-terminated).
+
+    Column data is not aligned. Batches for different schemas are interleaved
+    in the order they fill up, and rows within a batch are in the order they
+    were added.
+    */
+    class EventColumnarWriter
+    {
+        struct Column
+        {
+            std::string Name;
+            std::string Data;
+            std::vector<uint32_t> Offsets; // For Utf8 and Json columns.
+            EventColumnType Type;
+            uint8_t Encoding;
+            uint8_t Format;
+            uint16_t FieldTag;
+        };
+
+        struct Batch
+        {
+            std::string TracepointName;
+            std::string EventName;
+            std::vector<Column> Columns;
+            eventheader Header;
+            uint64_t Keyword;
+            uint32_t RowCount;
+            size_t DataSize;
+        };
+
+        std::vector<Batch> m_batches; // In order of creation.
+        std::unordered_map<std::string, size_t> m_batchIndex; // key = schema.
+        std::string m_key; // Scratch buffer for schema key.
+        EventFormatter m_formatter;
+        uint32_t m_maxBatchRows;
+
+    public:
+
+        static uint32_t const MaxBatchRowsDefault = 65536;
+
+        /*
+        Initializes a writer with no pending rows. A batch is written when it
+        reaches maxBatchRows rows (minimum 1) or 64 MB of column data.
+        */
+        explicit
+        EventColumnarWriter(uint32_t maxBatchRows = MaxBatchRowsDefault) noexcept;
+
+        /*
+        Appends the FileHeader to dest. Call once at the start of the output.
+
+        May throw bad_alloc.
+        */
+        static void
+        AppendFileHeader(std::string& dest);
+
+        /*
+        Adds the specified sample as a row of the batch for its schema. If that
+        batch is full, appends it to dest and starts a new batch.
+
+        Returns 0 for success, errno for error (in which case no row is added).
+        May throw bad_alloc.
+        */
+        int
+        AddSample(
+            std::string& dest,
+            tracepoint_decode::PerfSampleEventInfo const& sampleEventInfo,
+            bool fileBigEndian,
+            uint32_t moveNextLimit = 4096);
+
+        /*
+        Appends all non-empty batches to dest (in the order their schemas were
+        first seen) and resets them to empty.
+
+        May throw bad_alloc.
+        */
+        void
+        Flush(std::string& dest);
+
+    private:
+
+        static void
+        AppendBatch(std::string& dest, Batch& batch);
+    };
+}
+// namespace eventheader_decode
+
+#endif // _included_EventColumnarWriter_h
@@ -19,6 +19,9 @@
 #ifndef _In_reads_bytes_
 #define _In_reads_bytes_(cb)
 #endif
+#ifndef _In_z_
+#define _In_z_
+#endif
 #ifndef _Out_
 #define _Out_
 #endif
@@ -36,6 +39,7 @@ namespace eventheader_decode
 {
     // Forward declarations:
     class EventEnumerator;
+    class EventShapeCache;
     enum EventEnumeratorState : uint8_t;
     enum EventEnumeratorError : uint8_t;
     struct EventInfo;
@@ -47,6 +51,8 @@ namespace eventheader_decode
     /// </summary>
     class EventEnumerator
     {
+        friend class EventShapeCache;
+
         static event_field_encoding const EncodingCountMask = static_cast<event_field_encoding>(
             event_field_encoding_carray_flag | event_field_encoding_varray_flag);
 
@@ -168,6 +174,13 @@ namespace eventheader_decode
         /// and unchanged while you are processing the data with this enumerator (i.e.
         /// do not deallocate or overwrite the name or data until you call Clear, make
         /// another call to StartEvent, or destroy this EventEnumerator instance).
+        /// </para><para>
+        /// StartEvent does not pre-parse the field metadata. Each field's metadata is
+        /// decoded in place, without allocation, when MoveNext reaches the field, so
+        /// the cost of enumerating an event is proportional to the items visited. Use
+        /// MoveNextSibling to skip a struct or a simple array without visiting its
+        /// elements. To look up fields by name in many events that share the same
+        /// metadata, use FindField with an EventShapeCache.
         /// </para>
         /// </summary>
         /// <param name="pchTracepointName">Set to tep_event->name, e.g. "MyProvider_L4K1".
@@ -369,6 +382,61 @@ namespace eventheader_decode
         bool
         MoveNextMetadata() noexcept;
 
+        /// <summary>
+        /// <para>
+        /// Positions the enumerator at the field with the specified path, e.g. "status"
+        /// or "req.status" (field "status" within struct field "req"). Returns true if
+        /// the field was found, false if not found or decoding error.
+        /// </para><para>
+        /// PRECONDITION: Can be called when State != None, i.e. at any time after a
+        /// successful call to StartEvent, until a call to Clear.
+        /// </para><para>
+        /// Enumeration restarts from the beginning of the event (as with
+        /// Reset(moveNextLimit)). Path segments are separated by '.' and are compared
+        /// with field names, ignoring field attributes (the part of the name starting at
+        /// ';'). If a struct has several fields with the same name, the first one is
+        /// used. A segment other than the last must name a struct that is not an array.
+        /// </para><para>
+        /// The lookup is a linear walk of the event: each field before the requested
+        /// field (at each level of the path) is visited and its name compared, so the
+        /// cost grows with the field's position. Fields that are not on the path are
+        /// skipped without decoding their values: structs and arrays of fixed-size
+        /// elements are skipped with MoveNextSibling, and names are compared in place
+        /// in the event metadata without allocation. To look up fields in many events
+        /// with the same metadata, use FindField(cache, path, moveNextLimit).
+        /// </para><para>
+        /// On success, State is Value, ArrayBegin, or StructBegin, GetItemInfo returns
+        /// the field, and enumeration may continue with MoveNext. If the field is not
+        /// found, State is AfterLastItem and LastError is Success. If a decoding error
+        /// occurs, State is Error.
+        /// </para>
+        /// </summary>
+        bool
+        FindField(
+            _In_z_ char const* path,
+            uint32_t moveNextLimit = MoveNextLimitDefault) noexcept;
+
+        /// <summary>
+        /// <para>
+        /// Same as FindField(path, moveNextLimit), but uses the field table that cache
+        /// holds for the event's metadata (building it on the first event with that
+        /// metadata). The path is looked up in the table's path index (a hash of the
+        /// path), not by walking the event. If every field before the requested field
+        /// has a fixed size, the enumerator is positioned at the field directly,
+        /// decoding only that field. Otherwise this falls back to
+        /// FindField(path, moveNextLimit).
+        /// </para><para>
+        /// Results are the same as FindField(path, moveNextLimit), except that a field
+        /// that is not in the event is reported as not found without checking the
+        /// event's data for errors. May throw bad_alloc.
+        /// </para>
+        /// </summary>
+        bool
+        FindField(
+            EventShapeCache& cache,
+            _In_z_ char const* path,
+            uint32_t moveNextLimit = MoveNextLimitDefault);
+
         /// <summary>
         /// <para>
         /// Gets information that applies to the current event, e.g. the event name,
@@ -12,10 +12,15 @@
 #include "EventEnumerator.h"
 #include <string>
 
+#ifndef _Out_writes_to_
+#define _Out_writes_to_(size, count)
+#endif
+
 namespace tracepoint_decode
 {
     // Forward declarations from libtracepoint-decode
     struct PerfSampleEventInfo;
+    struct PerfNonSampleEventInfo;
     class PerfFieldMetadata;
 }
 
@@ -25,6 +30,60 @@ namespace eventheader_decode
     enum EventFormatterJsonFlags : unsigned;
     enum EventFormatterMetaFlags : unsigned;
 
+    // Forward declaration from EventFormatter.cpp.
+    struct EventFormatterMetaCache;
+
+    /*
+    Optional cache for EventFormatter's JSON methods. Pass the same cache to a
+    series of calls to avoid re-rendering the parts of the output that repeat
+    from one event to the next:
+
+    - The "n" member and the event-constant parts of the "meta" object
+      (provider, event, id, version, level, keyword, opcode, tag, options,
+      flags) of recent eventheader events, keyed by tracepoint name, event
+      name, header, keyword, and flags.
+    - The formatted date and time of the most recent "time" value's second,
+      so consecutive events in the same second only format the nanoseconds.
+
+    The output is the same with or without a cache. The cache does not
+    allocate memory. A cache must not be used by more than one thread at a
+    time (use one cache per thread).
+    */
+    class EventFormatterCache
+    {
+        friend struct EventFormatterMetaCache;
+
+        static constexpr unsigned MetaCacheSize = 8; // Must be a power of 2.
+        static constexpr unsigned MetaCacheBufferSize = 480;
+
+        struct MetaCacheEntry
+        {
+            uint64_t Keyword;
+            eventheader Header;
+            unsigned Flags; // Cached metaFlags | Used | Space, or 0 if unused.
+            uint16_t TracepointNameLength;
+            uint16_t NameLength;
+            uint16_t NSize;
+            uint16_t MetaPrefixSize;
+            uint16_t MetaSuffixSize;
+
+            // TracepointName, Name, N, MetaPrefix, MetaSuffix.
+            char Buffer[MetaCacheBufferSize];
+        };
+
+        MetaCacheEntry m_metaCache[MetaCacheSize];
+        int64_t m_timeCacheSec; // Seconds since 1970 of m_timeCache.
+        uint8_t m_timeCacheSize; // 0 if m_timeCache is empty.
+        char m_timeCache[26]; // e.g. "2022-01-01T01:01:01".
+
+    public:
+
+        /*
+        Initializes an empty cache.
+        */
+        EventFormatterCache() noexcept;
+    };
+
     /*
     Helper for converting event fields to strings.
     */
@@ -43,6 +102,9 @@ namespace eventheader_decode
         If the Space flag is specified, the appended string will begin with a space
         and will have spaces between elements, e.g. after ',' and ':'.
 
+        If cache is not null, it is used to speed up formatting (see
+        EventFormatterCache).
+
         Returns 0 for success, errno for error. May throw bad_alloc.
         */
         int
@@ -52,7 +114,54 @@ namespace eventheader_decode
             bool fileBigEndian,
             EventFormatterJsonFlags jsonFlags = static_cast<EventFormatterJsonFlags>(0),
             EventFormatterMetaFlags metaFlags = static_cast<EventFormatterMetaFlags>(0xffff),
-            uint32_t moveNextLimit = 4096);
+            uint32_t moveNextLimit = 4096,
+            EventFormatterCache* cache = nullptr);
+
+        /*
+        Same as AppendSampleAsJson(std::string& dest, ...), but writes the result
+        to a caller-provided buffer instead of appending to a std::string. Does not
+        allocate memory.
+
+        On success, sets *pDestUsed to the number of chars written to dest (not
+        nul-terminated) and returns 0. If the result doesn't fit in destSize chars,
+        sets *pDestUsed to 0 and returns ENOBUFS. In that case, the contents of
+        dest are unspecified and the caller may retry with a larger buffer.
+        */
+        int
+        AppendSampleAsJson(
+            _Out_writes_to_(destSize, *pDestUsed) char* dest,
+            size_t destSize,
+            _Out_ size_t* pDestUsed,
+            tracepoint_decode::PerfSampleEventInfo const& sampleEventInfo,
+            bool fileBigEndian,
+            EventFormatterJsonFlags jsonFlags = static_cast<EventFormatterJsonFlags>(0),
+            EventFormatterMetaFlags metaFlags = static_cast<EventFormatterMetaFlags>(0xffff),
+            uint32_t moveNextLimit = 4096,
+            EventFormatterCache* cache = nullptr) noexcept;
+
+        /*
+        Formats the specified PERF_RECORD_LOST or PERF_RECORD_LOST_SAMPLES record
+        as a UTF-8 JSON string and appends the result to dest, e.g.
+        {"n":"PERF_RECORD_LOST","lost":12,"meta":{"time":"...","cpu":1}}.
+
+        - nonSampleEventInfo: from PerfDataFile::GetNonSampleEventInfo. The time
+          and cpu are included if its SampleType() has them (and metaFlags
+          includes them).
+        - lostCount: from PerfDataFile::GetLostEventCount.
+
+        jsonFlags and cache are the same as for AppendSampleAsJson. Only the n,
+        time, and cpu metaFlags are used.
+
+        Returns 0 for success, errno for error. May throw bad_alloc.
+        */
+        int
+        AppendLostAsJson(
+            std::string& dest,
+            tracepoint_decode::PerfNonSampleEventInfo const& nonSampleEventInfo,
+            uint64_t lostCount,
+            EventFormatterJsonFlags jsonFlags = static_cast<EventFormatterJsonFlags>(0),
+            EventFormatterMetaFlags metaFlags = static_cast<EventFormatterMetaFlags>(0xffff),
+            EventFormatterCache* cache = nullptr);
 
         /*
         Formats the specified sample field as a UTF-8 JSON string and appends the
@@ -87,6 +196,9 @@ namespace eventheader_decode
         If the Space flag is specified, the appended string will begin with a space
         and will have spaces between elements, e.g. after ',' and ':'.
 
+        If cache is not null, it is used to speed up formatting (see
+        EventFormatterCache).
+
         Returns 0 for success, errno for error. May throw bad_alloc.
 
         Requires: enumerator.State is BeforeFirstItem.
@@ -96,7 +208,32 @@ namespace eventheader_decode
             std::string& dest,
             EventEnumerator& enumerator,
             EventFormatterJsonFlags jsonFlags = static_cast<EventFormatterJsonFlags>(0),
-            EventFormatterMetaFlags metaFlags = static_cast<EventFormatterMetaFlags>(0xffff));
+            EventFormatterMetaFlags metaFlags = static_cast<EventFormatterMetaFlags>(0xffff),
+            EventFormatterCache* cache = nullptr);
+
+        /*
+        Same as AppendEventAsJsonAndMoveToEnd(std::string& dest, ...), but writes
+        the result to a caller-provided buffer instead of appending to a
+        std::string. Does not allocate memory.
+
+        On success, sets *pDestUsed to the number of chars written to dest (not
+        nul-terminated) and returns 0. If the result doesn't fit in destSize chars,
+        sets *pDestUsed to 0 and returns ENOBUFS. In that case, the contents of
+        dest are unspecified and the enumerator's position is unspecified. To
+        retry with a larger buffer, restart the enumerator (e.g. with a copy of
+        the enumerator saved before the call).
+
+        Requires: enumerator.State is BeforeFirstItem.
+        */
+        int
+        AppendEventAsJsonAndMoveToEnd(
+            _Out_writes_to_(destSize, *pDestUsed) char* dest,
+            size_t destSize,
+            _Out_ size_t* pDestUsed,
+            EventEnumerator& enumerator,
+            EventFormatterJsonFlags jsonFlags = static_cast<EventFormatterJsonFlags>(0),
+            EventFormatterMetaFlags metaFlags = static_cast<EventFormatterMetaFlags>(0xffff),
+            EventFormatterCache* cache = nullptr) noexcept;
 
         /*
         Formats the item at the enumerator's current position (a value, array
@@ -245,6 +382,7 @@ namespace eventheader_decode
         EventFormatterMetaFlags_options = 0x40000,  // eventheader provider options (string, omitted if none).
         EventFormatterMetaFlags_flags = 0x80000,    // eventheader flags (hexadecimal string).
         EventFormatterMetaFlags_common = 0x100000,  // Include the common_* fields before the user fields (only for sample events).
+        EventFormatterMetaFlags_callchain = 0x200000, // sample stack as an array of hexadecimal strings (only for sample events with PERF_SAMPLE_CALLCHAIN).
         EventFormatterMetaFlags_Default = 0xffff,   // Include n..relatedActivity.
         EventFormatterMetaFlags_All = ~0u
     };
@@ -0,0 +1,115 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef _included_EventShapeCache_h
+#define _included_EventShapeCache_h 1
+
+#if __cplusplus < 201100L && (!defined(_MSVC_LANG) || _MSVC_LANG < 201100L)
+#error EventShapeCache.h requires C++11 or later.
+#endif
+
+#include <eventheader/EventEnumerator.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace eventheader_decode
+{
+    /*
+    Optional cache of pre-parsed field tables for EventEnumerator, keyed by the
+    event's metadata bytes (its "shape"). Events of the same tracepoint name and
+    event tag almost always have the same metadata, so the table is built once
+    (with one full enumeration of the first event of the shape) and reused by
+    later events:
+
+        EventShapeCache cache; // Keep across events, e.g. one per decoding thread.
+        ...
+        if (e.StartEvent(name, nameSize, data, dataSize) &&
+            e.FindField(cache, "req.status"))
+        {
+            auto const item = e.GetItemInfo(); // Same as after an uncached FindField.
+        }
+
+    The table records, for each field that FindField can find (fields that are
+    not inside an array and are the first with their path), its enumerator
+    state and, if every field before it has a fixed size (no strings, no
+    variable-length arrays, no arrays of structs), its data offset. FindField
+    then jumps straight to such a field and decodes only that field. Fields
+    after a variable-size field fall back to the walk. Paths are found through a
+    hash index, so a lookup costs the same for every field of the event.
+
+    A lookup hashes and compares the event's metadata bytes, so an event with
+    changed metadata gets its own table. The cache is not thread-safe and is
+    never trimmed; call Clear if the number of distinct shapes can grow without
+    bound.
+    */
+    class EventShapeCache
+    {
+        friend class EventEnumerator;
+
+        static uint32_t const VariableOffset = ~0u;
+        static uint32_t const NoIndex = ~0u;
+
+        struct ShapeField
+        {
+            EventEnumerator::StackEntry Entry; // m_stackTop when positioned at the field.
+            uint32_t DataOffset; // Offset of the field's data, or VariableOffset.
+            uint32_t ParentIndex; // Index of the parent struct field, or NoIndex.
+            std::string Path; // e.g. "req.status".
+        };
+
+        struct Shape
+        {
+            std::vector<uint8_t> Key; // Metadata bytes followed by the byte-swap flag.
+            std::vector<ShapeField> Fields; // In metadata order.
+            std::unordered_multimap<uint64_t, uint32_t> FieldsByPathHash; // Hash of Path -> index into Fields.
+        };
+
+        std::unordered_multimap<uint64_t, Shape> m_shapes; // Keyed by hash of Shape::Key.
+
+    public:
+
+        /*
+        Initializes an empty cache.
+        */
+        EventShapeCache() noexcept;
+
+        /*
+        Removes all shapes.
+        */
+        void
+        Clear() noexcept;
+
+        /*
+        Returns the number of distinct shapes in the cache.
+        */
+        size_t
+        ShapeCount() const noexcept;
+
+    private:
+
+        // Returns the shape of the enumerator's current event, building it (by
+        // enumerating the event) if it is not in the cache. Returns nullptr if
+        // the event could not be enumerated. May throw bad_alloc.
+        Shape const*
+        GetShape(EventEnumerator& e, uint32_t moveNextLimit);
+
+        // Fills in shape.Fields. Returns false if the event could not be enumerated.
+        static bool
+        BuildShape(Shape& shape, EventEnumerator& e, uint32_t moveNextLimit);
+
+        // Returns the index of the field with the specified path, or NoIndex.
+        // Uses shape.FieldsByPathHash.
+        static uint32_t
+        FindPath(Shape const& shape, char const* path) noexcept;
+
+        static uint64_t
+        Hash(void const* data, size_t size, uint64_t hash = 0xcbf29ce484222325) noexcept;
+    };
+}
+// namespace eventheader_decode
+
+#endif // _included_EventShapeCache_h
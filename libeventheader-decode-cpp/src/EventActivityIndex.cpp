@@ -0,0 +1,425 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <eventheader/EventActivityIndex.h>
+#include <eventheader/EventEnumerator.h>
+#include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfEventMetadata.h>
+#include <tracepoint/PerfEventInfo.h>
+#include <tracepoint/PerfEventAbi.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <set>
+
+#ifdef _WIN32
+#include <share.h>
+#define fopen(filename, mode) _fsopen(filename, mode, _SH_DENYWR)
+#endif // _WIN32
+
+using namespace eventheader_decode;
+using namespace tracepoint_decode;
+
+static char const IndexMagic[8] = { 'E', 'H', 'A', 'c', 't', 'I', 'd', 'x' };
+static uint32_t const IndexVersion = 1;
+
+struct IndexFileHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t Reserved;
+    uint64_t DataBeginFilePos;
+    uint64_t DataEndFilePos;
+    uint64_t EventCount;
+    uint64_t LinkCount;
+};
+
+static_assert(sizeof(IndexFileHeader) == 48, "IndexFileHeader has padding");
+static_assert(sizeof(EventActivityIndex::ActivityEvent) == 24, "ActivityEvent has padding");
+static_assert(sizeof(EventActivityIndex::ActivityLink) == 32, "ActivityLink has padding");
+
+struct fcloseDelete
+{
+    void operator()(FILE* file) const noexcept
+    {
+        fclose(file);
+    }
+};
+
+using unique_file = std::unique_ptr<FILE, fcloseDelete>;
+
+static int
+CompareId(uint8_t const* a, uint8_t const* b) noexcept
+{
+    return memcmp(a, b, 16);
+}
+
+static bool
+EventLess(
+    EventActivityIndex::ActivityEvent const& a,
+    EventActivityIndex::ActivityEvent const& b) noexcept
+{
+    auto const cmp = CompareId(a.ActivityId, b.ActivityId);
+    return cmp != 0 ? cmp < 0 : a.FilePos < b.FilePos;
+}
+
+static bool
+LinkLess(
+    EventActivityIndex::ActivityLink const& a,
+    EventActivityIndex::ActivityLink const& b) noexcept
+{
+    auto const cmp = CompareId(a.ActivityId, b.ActivityId);
+    return cmp != 0 ? cmp < 0 : CompareId(a.ParentActivityId, b.ParentActivityId) < 0;
+}
+
+static bool
+LinkEqual(
+    EventActivityIndex::ActivityLink const& a,
+    EventActivityIndex::ActivityLink const& b) noexcept
+{
+    return 0 == memcmp(&a, &b, sizeof(a));
+}
+
+EventActivityIndex::EventActivityIndex() noexcept
+    : m_events()
+    , m_links()
+    , m_linksByParent()
+    , m_dataBeginFilePos(0)
+    , m_dataEndFilePos(0)
+{
+    return;
+}
+
+void
+EventActivityIndex::Clear() noexcept
+{
+    m_events.clear();
+    m_links.clear();
+    m_linksByParent.clear();
+    m_dataBeginFilePos = 0;
+    m_dataEndFilePos = 0;
+}
+
+int
+EventActivityIndex::Build(PerfDataFile& file)
+{
+    int err;
+    EventEnumerator enumerator;
+    PerfSampleEventInfo sampleEventInfo;
+
+    Clear();
+
+    if (file.DataEndFilePos() == UINT64_MAX ||
+        !file.Header(PERF_HEADER_COMPRESSED).empty())
+    {
+        // Positions of pipe-mode or decompressed events can't be seeked to.
+        return ENOTSUP;
+    }
+
+    for (;;)
+    {
+        auto const filePos = file.FilePos();
+        perf_event_header const* header;
+        err = file.ReadEvent(&header);
+        if (header == nullptr)
+        {
+            break;
+        }
+
+        if (header->type == PERF_RECORD_COMPRESSED)
+        {
+            err = ENOTSUP;
+            break;
+        }
+
+        if (header->type != PERF_RECORD_SAMPLE ||
+            0 != file.GetSampleEventInfo(header, &sampleEventInfo))
+        {
+            continue;
+        }
+
+        auto const meta = sampleEventInfo.Metadata();
+        if (!meta || meta->Kind() != PerfEventKind::EventHeader)
+        {
+            continue;
+        }
+
+        // StartEvent reads the header and extensions (including the activity
+        // IDs) but does not decode any fields.
+        auto const eventHeaderOffset = meta->Fields()[meta->CommonFieldCount()].Offset();
+        if (eventHeaderOffset > sampleEventInfo.raw_data_size ||
+            !enumerator.StartEvent(
+                meta->Name().data(),
+                meta->Name().size(),
+                static_cast<char const*>(sampleEventInfo.raw_data) + eventHeaderOffset,
+                sampleEventInfo.raw_data_size - eventHeaderOffset))
+        {
+            continue;
+        }
+
+        auto const eventInfo = enumerator.GetEventInfo();
+        if (eventInfo.ActivityId)
+        {
+            m_events.emplace_back();
+            auto& event = m_events.back();
+            memcpy(event.ActivityId, eventInfo.ActivityId, 16);
+            event.FilePos = filePos;
+
+            if (eventInfo.RelatedActivityId)
+            {
+                m_links.emplace_back();
+                auto& link = m_links.back();
+                memcpy(link.ActivityId, eventInfo.ActivityId, 16);
+                memcpy(link.ParentActivityId, eventInfo.RelatedActivityId, 16);
+            }
+        }
+    }
+
+    if (err != 0)
+    {
+        Clear();
+    }
+    else
+    {
+        m_dataBeginFilePos = file.DataBeginFilePos();
+        m_dataEndFilePos = file.DataEndFilePos();
+        std::sort(m_events.begin(), m_events.end(), EventLess);
+        std::sort(m_links.begin(), m_links.end(), LinkLess);
+        m_links.erase(std::unique(m_links.begin(), m_links.end(), LinkEqual), m_links.end());
+        IndexLinksByParent();
+    }
+
+    return err;
+}
+
+int
+EventActivityIndex::Save(char const* indexPath) const noexcept
+{
+    int err;
+
+    unique_file file(fopen(indexPath, "wb"));
+    if (!file)
+    {
+        err = errno;
+    }
+    else
+    {
+        IndexFileHeader fileHeader = {};
+        memcpy(fileHeader.Magic, IndexMagic, sizeof(IndexMagic));
+        fileHeader.Version = IndexVersion;
+        fileHeader.DataBeginFilePos = m_dataBeginFilePos;
+        fileHeader.DataEndFilePos = m_dataEndFilePos;
+        fileHeader.EventCount = m_events.size();
+        fileHeader.LinkCount = m_links.size();
+
+        if (1 != fwrite(&fileHeader, sizeof(fileHeader), 1, file.get()) ||
+            m_events.size() != fwrite(m_events.data(), sizeof(m_events[0]), m_events.size(), file.get()) ||
+            m_links.size() != fwrite(m_links.data(), sizeof(m_links[0]), m_links.size(), file.get()))
+        {
+            err = EIO;
+        }
+        else
+        {
+            err = 0 == fclose(file.release()) ? 0 : EIO;
+        }
+    }
+
+    return err;
+}
+
+int
+EventActivityIndex::Load(char const* indexPath, PerfDataFile const& file)
+{
+    int err;
+    IndexFileHeader fileHeader;
+
+    Clear();
+
+    unique_file indexFile(fopen(indexPath, "rb"));
+    if (!indexFile)
+    {
+        err = errno;
+    }
+    else if (
+        1 != fread(&fileHeader, sizeof(fileHeader), 1, indexFile.get()) ||
+        0 != memcmp(fileHeader.Magic, IndexMagic, sizeof(IndexMagic)) ||
+        fileHeader.Version != IndexVersion ||
+        fileHeader.EventCount > SIZE_MAX / sizeof(ActivityEvent) ||
+        fileHeader.LinkCount > UINT32_MAX)
+    {
+        err = EINVAL;
+    }
+    else if (
+        fileHeader.DataBeginFilePos != file.DataBeginFilePos() ||
+        fileHeader.DataEndFilePos != file.DataEndFilePos())
+    {
+        err = ESTALE;
+    }
+    else
+    {
+        m_events.resize(static_cast<size_t>(fileHeader.EventCount));
+        m_links.resize(static_cast<size_t>(fileHeader.LinkCount));
+        char extra;
+        if (m_events.size() != fread(m_events.data(), sizeof(m_events[0]), m_events.size(), indexFile.get()) ||
+            m_links.size() != fread(m_links.data(), sizeof(m_links[0]), m_links.size(), indexFile.get()) ||
+            0 != fread(&extra, 1, 1, indexFile.get()))
+        {
+            err = EINVAL;
+        }
+        else
+        {
+            // Lookups use binary search, so make sure the data is sorted and in range.
+            err = 0;
+            for (size_t i = 0; i != m_events.size(); i += 1)
+            {
+                if (m_events[i].FilePos < fileHeader.DataBeginFilePos ||
+                    m_events[i].FilePos >= fileHeader.DataEndFilePos ||
+                    (i != 0 && !EventLess(m_events[i - 1], m_events[i])))
+                {
+                    err = EINVAL;
+                    break;
+                }
+            }
+
+            for (size_t i = 1; err == 0 && i < m_links.size(); i += 1)
+            {
+                if (!LinkLess(m_links[i - 1], m_links[i]))
+                {
+                    err = EINVAL;
+                }
+            }
+        }
+
+        if (err == 0)
+        {
+            m_dataBeginFilePos = fileHeader.DataBeginFilePos;
+            m_dataEndFilePos = fileHeader.DataEndFilePos;
+            IndexLinksByParent();
+        }
+    }
+
+    if (err != 0)
+    {
+        Clear();
+    }
+
+    return err;
+}
+
+std::vector<EventActivityIndex::ActivityEvent> const&
+EventActivityIndex::Events() const noexcept
+{
+    return m_events;
+}
+
+std::vector<EventActivityIndex::ActivityLink> const&
+EventActivityIndex::Links() const noexcept
+{
+    return m_links;
+}
+
+size_t
+EventActivityIndex::FindActivity(
+    uint8_t const* activityId,
+    std::vector<uint64_t>& filePositions) const
+{
+    auto it = std::lower_bound(m_events.begin(), m_events.end(), activityId,
+        [](ActivityEvent const& event, uint8_t const* id) noexcept
+        {
+            return CompareId(event.ActivityId, id) < 0;
+        });
+
+    size_t count = 0;
+    for (; it != m_events.end() && 0 == CompareId(it->ActivityId, activityId); ++it)
+    {
+        filePositions.push_back(it->FilePos);
+        count += 1;
+    }
+
+    return count;
+}
+
+bool
+EventActivityIndex::FindParent(
+    uint8_t const* activityId,
+    uint8_t* parentActivityId) const noexcept
+{
+    auto it = std::lower_bound(m_links.begin(), m_links.end(), activityId,
+        [](ActivityLink const& link, uint8_t const* id) noexcept
+        {
+            return CompareId(link.ActivityId, id) < 0;
+        });
+    for (; it != m_links.end() && 0 == CompareId(it->ActivityId, activityId); ++it)
+    {
+        if (0 != CompareId(it->ParentActivityId, activityId))
+        {
+            memcpy(parentActivityId, it->ParentActivityId, 16);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t
+EventActivityIndex::FindActivityTree(
+    uint8_t const* rootActivityId,
+    std::vector<uint64_t>& filePositions) const
+{
+    using Id = std::array<uint8_t, 16>;
+
+    auto const firstNew = filePositions.size();
+    std::set<Id> visited;
+    std::vector<Id> pending;
+
+    pending.emplace_back();
+    memcpy(pending.back().data(), rootActivityId, 16);
+    visited.insert(pending.back());
+
+    while (!pending.empty())
+    {
+        auto const id = pending.back();
+        pending.pop_back();
+        FindActivity(id.data(), filePositions);
+
+        auto it = std::lower_bound(m_linksByParent.begin(), m_linksByParent.end(), id.data(),
+            [this](uint32_t linkIndex, uint8_t const* parentId) noexcept
+            {
+                return CompareId(m_links[linkIndex].ParentActivityId, parentId) < 0;
+            });
+        for (; it != m_linksByParent.end() && 0 == CompareId(m_links[*it].ParentActivityId, id.data()); ++it)
+        {
+            Id child;
+            memcpy(child.data(), m_links[*it].ActivityId, 16);
+            if (visited.insert(child).second) // Skip cycles, e.g. related == self.
+            {
+                pending.push_back(child);
+            }
+        }
+    }
+
+    std::sort(filePositions.begin() + firstNew, filePositions.end());
+    return filePositions.size() - firstNew;
+}
+
+void
+EventActivityIndex::IndexLinksByParent()
+{
+    assert(m_links.size() <= UINT32_MAX);
+    m_linksByParent.resize(m_links.size());
+    for (uint32_t i = 0; i != m_linksByParent.size(); i += 1)
+    {
+        m_linksByParent[i] = i;
+    }
+
+    std::sort(m_linksByParent.begin(), m_linksByParent.end(),
+        [this](uint32_t a, uint32_t b) noexcept
+        {
+            return CompareId(m_links[a].ParentActivityId, m_links[b].ParentActivityId) < 0;
+        });
+}
@@ -0,0 +1,464 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <eventheader/EventColumnarWriter.h>
+#include <tracepoint/PerfEventMetadata.h>
+#include <tracepoint/PerfEventInfo.h>
+#include <tracepoint/PerfEventAbi.h>
+
+#include <assert.h>
+#include <string.h>
+#include <string_view>
+
+using namespace eventheader_decode;
+using namespace tracepoint_decode;
+
+static size_t const BatchDataSizeMax = 64 * 1024 * 1024;
+
+// Returns the size of each value in a fixed-size column, or 0 for a
+// variable-size (offsets + data) column.
+static unsigned
+ColumnTypeValueSize(EventColumnType type) noexcept
+{
+    switch (type)
+    {
+    case EventColumnType_Int8:
+    case EventColumnType_UInt8:
+        return 1;
+    case EventColumnType_Int16:
+    case EventColumnType_UInt16:
+        return 2;
+    case EventColumnType_Int32:
+    case EventColumnType_UInt32:
+    case EventColumnType_Float32:
+        return 4;
+    case EventColumnType_Int64:
+    case EventColumnType_UInt64:
+    case EventColumnType_Float64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+// Returns the column type to use for a top-level item (Value, ArrayBegin, or
+// StructBegin).
+static EventColumnType
+ItemColumnType(EventEnumeratorState state, EventItemInfo const& item) noexcept
+{
+    if (state != EventEnumeratorState_Value)
+    {
+        return EventColumnType_Json;
+    }
+
+    unsigned sizeIndex;
+    switch (item.Encoding)
+    {
+    case event_field_encoding_value8:  sizeIndex = 0; break;
+    case event_field_encoding_value16: sizeIndex = 1; break;
+    case event_field_encoding_value32: sizeIndex = 2; break;
+    case event_field_encoding_value64: sizeIndex = 3; break;
+    default:
+        return EventColumnType_Utf8;
+    }
+
+    switch (item.Format)
+    {
+    case event_field_format_default:
+    case event_field_format_unsigned_int:
+    case event_field_format_hex_int:
+    case event_field_format_boolean:
+        return static_cast<EventColumnType>(EventColumnType_UInt8 + sizeIndex);
+    case event_field_format_signed_int:
+    case event_field_format_errno:
+    case event_field_format_pid:
+    case event_field_format_time:
+        return static_cast<EventColumnType>(EventColumnType_Int8 + sizeIndex);
+    case event_field_format_float:
+        return sizeIndex == 2 ? EventColumnType_Float32
+            : sizeIndex == 3 ? EventColumnType_Float64
+            : EventColumnType_Utf8;
+    default:
+        return EventColumnType_Utf8;
+    }
+}
+
+// Appends size bytes, reversing them if needByteSwap.
+static void
+AppendFixed(std::string& data, void const* value, unsigned size, bool needByteSwap)
+{
+    auto const p = static_cast<char const*>(value);
+    if (!needByteSwap)
+    {
+        data.append(p, size);
+    }
+    else
+    {
+        for (unsigned i = size; i != 0; i -= 1)
+        {
+            data.push_back(p[i - 1]);
+        }
+    }
+}
+
+template<class T>
+static void
+AppendInt(std::string& dest, T value)
+{
+    dest.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+static void
+AppendStr(std::string& dest, char const* chars, size_t length)
+{
+    auto const length16 = static_cast<uint16_t>(length < 0xFFFF ? length : 0xFFFF);
+    AppendInt<uint16_t>(dest, length16);
+    dest.append(chars, length16);
+}
+
+EventColumnarWriter::EventColumnarWriter(uint32_t maxBatchRows) noexcept
+    : m_maxBatchRows(maxBatchRows ? maxBatchRows : 1)
+{
+    return;
+}
+
+void
+EventColumnarWriter::AppendFileHeader(std::string& dest)
+{
+    dest.append("EHColumn", 8);
+    AppendInt<uint32_t>(dest, 1); // Version
+    AppendInt<uint32_t>(dest, 0); // Reserved
+}
+
+int
+EventColumnarWriter::AddSample(
+    std::string& dest,
+    PerfSampleEventInfo const& sampleEventInfo,
+    bool fileBigEndian,
+    uint32_t moveNextLimit)
+{
+    int err;
+    EventEnumerator enumerator;
+    EventInfo eventInfo = {};
+    bool isEventHeader = false;
+    std::string_view name;
+    auto const sampleType = sampleEventInfo.SampleType();
+    auto const meta = sampleEventInfo.Metadata();
+
+    if (meta && meta->Kind() == PerfEventKind::EventHeader)
+    {
+        auto const eventHeaderOffset = meta->Fields()[meta->CommonFieldCount()].Offset();
+        isEventHeader =
+            eventHeaderOffset <= sampleEventInfo.raw_data_size &&
+            enumerator.StartEvent(
+                meta->Name().data(),
+                meta->Name().size(),
+                static_cast<char const*>(sampleEventInfo.raw_data) + eventHeaderOffset,
+                sampleEventInfo.raw_data_size - eventHeaderOffset,
+                moveNextLimit);
+    }
+
+    // Build the schema key.
+
+    m_key.clear();
+    if (isEventHeader)
+    {
+        eventInfo = enumerator.GetEventInfo();
+        name = { eventInfo.TracepointName, eventInfo.TracepointNameLength };
+        m_key.push_back('E');
+        m_key.append(name.data(), name.size());
+        m_key.push_back('\0');
+        m_key.append(reinterpret_cast<char const*>(&eventInfo.Header), sizeof(eventInfo.Header));
+        m_key.push_back(static_cast<char>(
+            (eventInfo.ActivityId ? 1 : 0) | (eventInfo.RelatedActivityId ? 2 : 0)));
+
+        auto e = enumerator;
+        for (e.MoveNext(); e.State() > EventEnumeratorState_AfterLastItem; e.MoveNextSibling())
+        {
+            auto const item = e.GetItemInfo();
+            m_key.append(item.Name);
+            m_key.push_back('\0');
+            m_key.push_back(static_cast<char>(e.State()));
+            m_key.push_back(static_cast<char>(item.Encoding));
+            m_key.push_back(static_cast<char>(item.Format));
+            m_key.push_back(static_cast<char>(item.ArrayFlags));
+            AppendInt<uint16_t>(m_key, item.FieldTag);
+        }
+
+        if (e.State() == EventEnumeratorState_Error)
+        {
+            err = e.LastError();
+            goto Done;
+        }
+    }
+    else
+    {
+        name = sampleEventInfo.Name();
+        if (name.empty() && meta != nullptr)
+        {
+            name = meta->Name();
+        }
+
+        m_key.push_back('N');
+        m_key.append(name.data(), name.size());
+    }
+
+    {
+        // Find or create the batch.
+
+        auto indexIt = m_batchIndex.find(m_key);
+        if (indexIt == m_batchIndex.end())
+        {
+            Batch newBatch;
+            newBatch.TracepointName.assign(name.data(), name.size());
+            newBatch.Header = eventInfo.Header;
+            newBatch.Keyword = eventInfo.Keyword;
+            newBatch.RowCount = 0;
+            newBatch.DataSize = 0;
+
+            auto const addColumn = [&newBatch](
+                char const* columnName,
+                EventColumnType type,
+                uint8_t encoding = 0,
+                uint8_t format = 0,
+                uint16_t fieldTag = 0)
+                {
+                    newBatch.Columns.emplace_back();
+                    auto& column = newBatch.Columns.back();
+                    column.Name = columnName;
+                    column.Type = type;
+                    column.Encoding = encoding;
+                    column.Format = format;
+                    column.FieldTag = fieldTag;
+                    if (ColumnTypeValueSize(type) == 0)
+                    {
+                        column.Offsets.push_back(0);
+                    }
+                };
+
+            addColumn("time", EventColumnType_UInt64);
+            addColumn("cpu", EventColumnType_UInt32);
+            addColumn("pid", EventColumnType_UInt32);
+            addColumn("tid", EventColumnType_UInt32);
+
+            if (isEventHeader)
+            {
+                newBatch.EventName = eventInfo.Name;
+                if (eventInfo.ActivityId)
+                {
+                    addColumn("activity", EventColumnType_Utf8);
+                }
+
+                if (eventInfo.RelatedActivityId)
+                {
+                    addColumn("relatedActivity", EventColumnType_Utf8);
+                }
+
+                auto e = enumerator;
+                for (e.MoveNext(); e.State() > EventEnumeratorState_AfterLastItem; e.MoveNextSibling())
+                {
+                    auto const item = e.GetItemInfo();
+                    addColumn(item.Name, ItemColumnType(e.State(), item),
+                        item.Encoding | item.ArrayFlags, item.Format, item.FieldTag);
+                }
+            }
+            else
+            {
+                newBatch.EventName.assign(name.data(), name.size());
+                addColumn("fields", EventColumnType_Json);
+            }
+
+            auto const newIndex = m_batches.size();
+            m_batches.push_back(std::move(newBatch));
+            try
+            {
+                indexIt = m_batchIndex.emplace(m_key, newIndex).first;
+            }
+            catch (...)
+            {
+                m_batches.pop_back();
+                throw;
+            }
+        }
+
+        auto& batch = m_batches[indexIt->second];
+        auto columnIt = batch.Columns.begin();
+
+        // Add the row. On failure, truncate each column back to RowCount.
+
+        auto const truncateColumns = [&batch]() noexcept
+            {
+                for (auto& column : batch.Columns)
+                {
+                    auto const valueSize = ColumnTypeValueSize(column.Type);
+                    if (valueSize != 0)
+                    {
+                        column.Data.resize(batch.RowCount * size_t(valueSize));
+                    }
+                    else
+                    {
+                        column.Offsets.resize(batch.RowCount + 1u);
+                        column.Data.resize(column.Offsets.back());
+                    }
+                }
+            };
+
+        try
+        {
+            uint64_t const time = (sampleType & PERF_SAMPLE_TIME) ? sampleEventInfo.time : 0u;
+            uint32_t const cpu = (sampleType & PERF_SAMPLE_CPU) ? sampleEventInfo.cpu : 0u;
+            uint32_t const pid = (sampleType & PERF_SAMPLE_TID) ? sampleEventInfo.pid : 0u;
+            uint32_t const tid = (sampleType & PERF_SAMPLE_TID) ? sampleEventInfo.tid : 0u;
+            AppendInt(columnIt++->Data, time);
+            AppendInt(columnIt++->Data, cpu);
+            AppendInt(columnIt++->Data, pid);
+            AppendInt(columnIt++->Data, tid);
+
+            if (!isEventHeader)
+            {
+                err = m_formatter.AppendSampleAsJson(
+                    columnIt->Data, sampleEventInfo, fileBigEndian,
+                    EventFormatterJsonFlags_None, EventFormatterMetaFlags_None, moveNextLimit);
+                columnIt->Offsets.push_back(static_cast<uint32_t>(columnIt->Data.size()));
+                ++columnIt;
+            }
+            else
+            {
+                if (eventInfo.ActivityId)
+                {
+                    m_formatter.AppendUuid(columnIt->Data, eventInfo.ActivityId);
+                    columnIt->Offsets.push_back(static_cast<uint32_t>(columnIt->Data.size()));
+                    ++columnIt;
+                }
+
+                if (eventInfo.RelatedActivityId)
+                {
+                    m_formatter.AppendUuid(columnIt->Data, eventInfo.RelatedActivityId);
+                    columnIt->Offsets.push_back(static_cast<uint32_t>(columnIt->Data.size()));
+                    ++columnIt;
+                }
+
+                err = 0;
+                enumerator.MoveNext();
+                while (err == 0 && enumerator.State() > EventEnumeratorState_AfterLastItem)
+                {
+                    assert(columnIt != batch.Columns.end());
+                    auto& column = *columnIt++;
+                    if (column.Type == EventColumnType_Json)
+                    {
+                        err = m_formatter.AppendItemAsJsonAndMoveNextSibling(column.Data, enumerator);
+                    }
+                    else
+                    {
+                        auto const item = enumerator.GetItemInfo();
+                        if (column.Type == EventColumnType_Utf8)
+                        {
+                            err = m_formatter.AppendValue(column.Data, item);
+                        }
+                        else
+                        {
+                            assert(ColumnTypeValueSize(column.Type) == item.ValueSize);
+                            AppendFixed(column.Data, item.ValueData, item.ValueSize, item.NeedByteSwap);
+                        }
+
+                        enumerator.MoveNextSibling();
+                    }
+
+                    if (!column.Offsets.empty())
+                    {
+                        column.Offsets.push_back(static_cast<uint32_t>(column.Data.size()));
+                    }
+                }
+
+                if (err == 0 && enumerator.State() == EventEnumeratorState_Error)
+                {
+                    err = enumerator.LastError();
+                }
+            }
+        }
+        catch (...)
+        {
+            truncateColumns();
+            throw;
+        }
+
+        if (err != 0)
+        {
+            truncateColumns();
+            goto Done;
+        }
+
+        batch.RowCount += 1;
+        batch.DataSize = 0;
+        for (auto const& column : batch.Columns)
+        {
+            batch.DataSize += column.Data.size() + column.Offsets.size() * sizeof(uint32_t);
+        }
+
+        if (batch.RowCount >= m_maxBatchRows || batch.DataSize >= BatchDataSizeMax)
+        {
+            AppendBatch(dest, batch);
+        }
+    }
+
+    err = 0;
+
+Done:
+
+    return err;
+}
+
+void
+EventColumnarWriter::Flush(std::string& dest)
+{
+    for (auto& batch : m_batches)
+    {
+        if (batch.RowCount != 0)
+        {
+            AppendBatch(dest, batch);
+        }
+    }
+}
+
+void
+EventColumnarWriter::AppendBatch(std::string& dest, Batch& batch)
+{
+    auto const batchStart = dest.size();
+    AppendInt<uint32_t>(dest, 0); // BatchSize, filled in below.
+    AppendInt<uint32_t>(dest, batch.RowCount);
+    AppendInt<uint16_t>(dest, static_cast<uint16_t>(batch.Columns.size()));
+    AppendStr(dest, batch.TracepointName.data(), batch.TracepointName.size());
+    AppendStr(dest, batch.EventName.data(), batch.EventName.size());
+    AppendInt<uint8_t>(dest, batch.Header.flags);
+    AppendInt<uint8_t>(dest, batch.Header.version);
+    AppendInt<uint16_t>(dest, batch.Header.id);
+    AppendInt<uint16_t>(dest, batch.Header.tag);
+    AppendInt<uint8_t>(dest, batch.Header.opcode);
+    AppendInt<uint8_t>(dest, batch.Header.level);
+    AppendInt<uint64_t>(dest, batch.Keyword);
+
+    for (auto& column : batch.Columns)
+    {
+        auto const offsetsSize = column.Offsets.size() * sizeof(uint32_t);
+        AppendStr(dest, column.Name.data(), column.Name.size());
+        AppendInt<uint8_t>(dest, column.Type);
+        AppendInt<uint8_t>(dest, column.Encoding);
+        AppendInt<uint8_t>(dest, column.Format);
+        AppendInt<uint16_t>(dest, column.FieldTag);
+        AppendInt<uint32_t>(dest, static_cast<uint32_t>(offsetsSize + column.Data.size()));
+        dest.append(reinterpret_cast<char const*>(column.Offsets.data()), offsetsSize);
+        dest.append(column.Data);
+
+        column.Data.clear();
+        if (!column.Offsets.empty())
+        {
+            column.Offsets.resize(1);
+        }
+    }
+
+    auto const batchSize = static_cast<uint32_t>(dest.size() - batchStart - sizeof(uint32_t));
+    memcpy(&dest[batchStart], &batchSize, sizeof(batchSize));
+
+    batch.RowCount = 0;
+    batch.DataSize = 0;
+}
@@ -674,6 +674,68 @@ EventEnumerator::MoveNextMetadata() noexcept
     return movedToItem;
 }
 
+bool
+EventEnumerator::FindField(
+    _In_z_ char const* path,
+    uint32_t moveNextLimit) noexcept
+{
+    assert(m_state != EventEnumeratorState_None); // PRECONDITION
+
+    if (m_state == EventEnumeratorState_None)
+    {
+        m_lastError = EventEnumeratorError_InvalidState;
+        return false;
+    }
+
+    ResetImpl(moveNextLimit);
+
+    char const* segment = path;
+    size_t segmentSize = strcspn(segment, ".");
+    bool movedToItem = MoveNext();
+    while (movedToItem)
+    {
+        if (m_state == EventEnumeratorState_StructEnd)
+        {
+            // End of the struct named by the previous segment: not found.
+            break;
+        }
+
+        auto const name = reinterpret_cast<char const*>(m_metaBuf + m_stackTop.NameOffset);
+        if (segmentSize <= m_stackTop.NameSize &&
+            0 == memcmp(name, segment, segmentSize) &&
+            (segmentSize == m_stackTop.NameSize || name[segmentSize] == ';'))
+        {
+            if (segment[segmentSize] == 0)
+            {
+                return true; // Found.
+            }
+
+            if (m_state != EventEnumeratorState_StructBegin || m_stackTop.ArrayFlags != 0)
+            {
+                // Path continues, but this field is not a struct.
+                break;
+            }
+
+            // Search within the struct.
+            segment += segmentSize + 1;
+            segmentSize = strcspn(segment, ".");
+            movedToItem = MoveNext();
+        }
+        else
+        {
+            // Skip the field, including the content of a struct or array.
+            movedToItem = MoveNextSibling();
+        }
+    }
+
+    if (movedToItem)
+    {
+        SetEndState(EventEnumeratorState_AfterLastItem, SubState_AfterLastItem);
+    }
+
+    return false;
+}
+
 EventInfo
 EventEnumerator::GetEventInfo() const noexcept
 {
@@ -17,6 +17,7 @@
 #include <tracepoint/PerfEventAbi.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -27,6 +28,14 @@
 #include <charconv>
 #include <type_traits>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define EVENTFORMATTER_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define EVENTFORMATTER_NEON 1
+#endif
+
 #ifdef _WIN32
 
 #include <windows.h>
@@ -198,56 +207,319 @@ static std::string_view const ErrnoStrings[] = {
 };
 static constexpr unsigned ErrnoStringsCount = sizeof(ErrnoStrings) / sizeof(ErrnoStrings[0]);
 
-template<class T>
+using namespace std::string_view_literals;
+using namespace eventheader_decode;
+using namespace tracepoint_decode;
+
+struct SwapNo
+{
+    uint8_t operator()(uint8_t val) const { return val; }
+    uint16_t operator()(uint16_t val) const { return val; }
+    uint32_t operator()(uint32_t val) const { return val; }
+    uint64_t operator()(uint64_t val) const { return val; }
+};
+
+struct SwapYes
+{
+    uint8_t operator()(uint8_t val) const { return val; }
+    uint16_t operator()(uint16_t val) const { return bswap_16(val); }
+    uint32_t operator()(uint32_t val) const { return bswap_32(val); }
+    uint64_t operator()(uint64_t val) const { return bswap_64(val); }
+};
+
+template<class T, class Swapper>
 static T
-bswap16_if(bool needsByteSwap, void const* valData)
+bswap16_if(void const* valData)
 {
     static_assert(sizeof(T) == 2, "Expected 16-bit return type");
-    auto const val = *static_cast<uint16_t const UNALIGNED*>(valData);
-    return static_cast<T>(needsByteSwap ? bswap_16(val) : val);
+    return static_cast<T>(Swapper()(*static_cast<uint16_t const UNALIGNED*>(valData)));
 }
 
-template<class T>
+template<class T, class Swapper>
 static T
-bswap32_if(bool needsByteSwap, void const* valData)
+bswap32_if(void const* valData)
 {
     static_assert(sizeof(T) == 4, "Expected 32-bit return type");
-    auto const val = *static_cast<uint32_t const UNALIGNED*>(valData);
-    return static_cast<T>(needsByteSwap ? bswap_32(val) : val);
+    return static_cast<T>(Swapper()(*static_cast<uint32_t const UNALIGNED*>(valData)));
 }
 
-template<class T>
+template<class T, class Swapper>
 static T
-bswap64_if(bool needsByteSwap, void const* valData)
+bswap64_if(void const* valData)
 {
     static_assert(sizeof(T) == 8, "Expected 64-bit return type");
-    auto const val = *static_cast<uint64_t const UNALIGNED*>(valData);
-    return static_cast<T>(needsByteSwap ? bswap_64(val) : val);
+    return static_cast<T>(Swapper()(*static_cast<uint64_t const UNALIGNED*>(valData)));
 }
 
-using namespace std::string_view_literals;
-using namespace eventheader_decode;
-using namespace tracepoint_decode;
+// Returns true if ch can be copied to the output as a single byte without any
+// transformation, i.e. ch is ASCII and (if Json) ch is not a control char, '"',
+// or '\\'.
+template<bool Json>
+static constexpr bool
+IsPassThroughChar(uint32_t ch) noexcept
+{
+    return Json
+        ? (ch >= 0x20 && ch <= 0x7F && ch != '"' && ch != '\\')
+        : (ch <= 0x7F);
+}
 
-struct SwapNo
+#if defined(EVENTFORMATTER_SSE2)
+
+// Returns the index of the lowest set bit. Requires: mask != 0.
+static unsigned
+LowestBitIndex(unsigned mask) noexcept
 {
-    uint8_t operator()(uint8_t val) const { return val; }
-    uint16_t operator()(uint16_t val) const { return val; }
-    uint32_t operator()(uint32_t val) const { return val; }
-};
+    assert(mask != 0);
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
 
-struct SwapYes
+// Given 16 narrowed chars and a mask of which of them were ASCII before
+// narrowing, returns a bitmask of the chars that are not pass-through.
+template<bool Json>
+static unsigned
+StopMask(__m128i narrowed, __m128i asciiMask) noexcept
 {
-    uint16_t operator()(uint16_t val) const { return bswap_16(val); }
-    uint32_t operator()(uint32_t val) const { return bswap_32(val); }
-};
+    __m128i stop = _mm_andnot_si128(asciiMask, _mm_set1_epi8(-1));
+    if (Json)
+    {
+        // Signed compare: bytes >= 0x80 are negative, so this also catches
+        // non-ASCII bytes (already flagged via asciiMask for wide input).
+        stop = _mm_or_si128(stop, _mm_or_si128(
+            _mm_cmplt_epi8(narrowed, _mm_set1_epi8(0x20)),
+            _mm_or_si128(
+                _mm_cmpeq_epi8(narrowed, _mm_set1_epi8('"')),
+                _mm_cmpeq_epi8(narrowed, _mm_set1_epi8('\\')))));
+    }
+    return static_cast<unsigned>(_mm_movemask_epi8(stop));
+}
+
+template<class Swapper>
+static __m128i
+LoadSwap16(uint16_t const* p) noexcept
+{
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    if (!std::is_same_v<Swapper, SwapNo>)
+    {
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+    return v;
+}
+
+template<class Swapper>
+static __m128i
+LoadSwap32(uint32_t const* p) noexcept
+{
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    if (!std::is_same_v<Swapper, SwapNo>)
+    {
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+    }
+    return v;
+}
+
+#elif defined(EVENTFORMATTER_NEON)
+
+// Given a mask of 0xFF/0x00 bytes, returns the index of the first 0xFF byte.
+// Requires: mask has at least one 0xFF byte.
+static unsigned
+FirstSetByteIndex(uint8x16_t mask) noexcept
+{
+    // Narrow each 8-bit lane to 4 bits: one nibble per input byte.
+    uint64_t const nibbles = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+    return static_cast<unsigned>(__builtin_ctzll(nibbles)) / 4;
+}
+
+// Given 16 narrowed chars and a mask of which of them were ASCII before
+// narrowing, returns a mask of 0xFF for the chars that are not pass-through.
+template<bool Json>
+static uint8x16_t
+StopMask(uint8x16_t narrowed, uint8x16_t asciiMask) noexcept
+{
+    uint8x16_t stop = vorrq_u8(vmvnq_u8(asciiMask), vcgeq_u8(narrowed, vdupq_n_u8(0x80)));
+    if (Json)
+    {
+        stop = vorrq_u8(stop, vorrq_u8(
+            vcltq_u8(narrowed, vdupq_n_u8(0x20)),
+            vorrq_u8(
+                vceqq_u8(narrowed, vdupq_n_u8('"')),
+                vceqq_u8(narrowed, vdupq_n_u8('\\')))));
+    }
+    return stop;
+}
+
+template<class Swapper>
+static uint16x8_t
+LoadSwap16(uint16_t const* p) noexcept
+{
+    uint16x8_t v = vld1q_u16(p);
+    if (!std::is_same_v<Swapper, SwapNo>)
+    {
+        v = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(v)));
+    }
+    return v;
+}
+
+template<class Swapper>
+static uint32x4_t
+LoadSwap32(uint32_t const* p) noexcept
+{
+    uint32x4_t v = vld1q_u32(p);
+    if (!std::is_same_v<Swapper, SwapNo>)
+    {
+        v = vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(v)));
+    }
+    return v;
+}
+
+#endif // EVENTFORMATTER_SSE2
+
+// Copies (narrowing to 1 byte per char) the leading chars of [pch, pch + cch)
+// for which IsPassThroughChar is true, stopping at the first char that needs
+// escaping or multi-byte encoding. Returns the number of chars copied, which is
+// also the number of bytes written to dest.
+// Requires: dest has room for cch bytes (bytes past the returned count may be
+// overwritten with garbage).
+// Processes 16 chars at a time using SSE2 or NEON when available.
+template<bool Json, class Swapper, class CH>
+static size_t
+NarrowPassThroughPrefix(CH const* pch, size_t cch, char* dest) noexcept
+{
+    static_assert(sizeof(CH) == 1 || sizeof(CH) == 2 || sizeof(CH) == 4, "Bad CH");
+    size_t i = 0;
+
+#if defined(EVENTFORMATTER_SSE2)
+
+    for (; cch - i >= 16; i += 16)
+    {
+        __m128i narrowed;
+        __m128i asciiMask;
+        if constexpr (sizeof(CH) == 1)
+        {
+            narrowed = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pch + i));
+            asciiMask = _mm_cmpgt_epi8(narrowed, _mm_set1_epi8(-1));
+        }
+        else if constexpr (sizeof(CH) == 2)
+        {
+            auto const p16 = reinterpret_cast<uint16_t const*>(pch + i);
+            __m128i const v0 = LoadSwap16<Swapper>(p16);
+            __m128i const v1 = LoadSwap16<Swapper>(p16 + 8);
+            __m128i const high = _mm_set1_epi16(static_cast<short>(0xFF80));
+            __m128i const zero = _mm_setzero_si128();
+            narrowed = _mm_packus_epi16(v0, v1); // Exact for ASCII chars.
+            asciiMask = _mm_packs_epi16(
+                _mm_cmpeq_epi16(_mm_and_si128(v0, high), zero),
+                _mm_cmpeq_epi16(_mm_and_si128(v1, high), zero));
+        }
+        else
+        {
+            auto const p32 = reinterpret_cast<uint32_t const*>(pch + i);
+            __m128i const v0 = LoadSwap32<Swapper>(p32);
+            __m128i const v1 = LoadSwap32<Swapper>(p32 + 4);
+            __m128i const v2 = LoadSwap32<Swapper>(p32 + 8);
+            __m128i const v3 = LoadSwap32<Swapper>(p32 + 12);
+            __m128i const high = _mm_set1_epi32(static_cast<int>(0xFFFFFF80));
+            __m128i const zero = _mm_setzero_si128();
+            narrowed = _mm_packus_epi16( // Exact for ASCII chars.
+                _mm_packs_epi32(v0, v1),
+                _mm_packs_epi32(v2, v3));
+            asciiMask = _mm_packs_epi16(
+                _mm_packs_epi32(
+                    _mm_cmpeq_epi32(_mm_and_si128(v0, high), zero),
+                    _mm_cmpeq_epi32(_mm_and_si128(v1, high), zero)),
+                _mm_packs_epi32(
+                    _mm_cmpeq_epi32(_mm_and_si128(v2, high), zero),
+                    _mm_cmpeq_epi32(_mm_and_si128(v3, high), zero)));
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), narrowed);
+        unsigned const stop = StopMask<Json>(narrowed, asciiMask);
+        if (stop != 0)
+        {
+            return i + LowestBitIndex(stop);
+        }
+    }
+
+#elif defined(EVENTFORMATTER_NEON)
+
+    for (; cch - i >= 16; i += 16)
+    {
+        uint8x16_t narrowed;
+        uint8x16_t asciiMask;
+        if constexpr (sizeof(CH) == 1)
+        {
+            narrowed = vld1q_u8(reinterpret_cast<uint8_t const*>(pch + i));
+            asciiMask = vcltq_u8(narrowed, vdupq_n_u8(0x80));
+        }
+        else if constexpr (sizeof(CH) == 2)
+        {
+            auto const p16 = reinterpret_cast<uint16_t const*>(pch + i);
+            uint16x8_t const v0 = LoadSwap16<Swapper>(p16);
+            uint16x8_t const v1 = LoadSwap16<Swapper>(p16 + 8);
+            uint16x8_t const limit = vdupq_n_u16(0x80);
+            narrowed = vcombine_u8(vmovn_u16(v0), vmovn_u16(v1));
+            asciiMask = vcombine_u8(
+                vmovn_u16(vcltq_u16(v0, limit)),
+                vmovn_u16(vcltq_u16(v1, limit)));
+        }
+        else
+        {
+            auto const p32 = reinterpret_cast<uint32_t const*>(pch + i);
+            uint32x4_t const v0 = LoadSwap32<Swapper>(p32);
+            uint32x4_t const v1 = LoadSwap32<Swapper>(p32 + 4);
+            uint32x4_t const v2 = LoadSwap32<Swapper>(p32 + 8);
+            uint32x4_t const v3 = LoadSwap32<Swapper>(p32 + 12);
+            uint32x4_t const limit = vdupq_n_u32(0x80);
+            narrowed = vcombine_u8(
+                vmovn_u16(vcombine_u16(vmovn_u32(v0), vmovn_u32(v1))),
+                vmovn_u16(vcombine_u16(vmovn_u32(v2), vmovn_u32(v3))));
+            asciiMask = vcombine_u8(
+                vmovn_u16(vcombine_u16(vmovn_u32(vcltq_u32(v0, limit)), vmovn_u32(vcltq_u32(v1, limit)))),
+                vmovn_u16(vcombine_u16(vmovn_u32(vcltq_u32(v2, limit)), vmovn_u32(vcltq_u32(v3, limit)))));
+        }
+
+        vst1q_u8(reinterpret_cast<uint8_t*>(dest + i), narrowed);
+        uint8x16_t const stop = StopMask<Json>(narrowed, asciiMask);
+        if (vmaxvq_u8(stop) != 0)
+        {
+            return i + FirstSetByteIndex(stop);
+        }
+    }
+
+#endif // EVENTFORMATTER_SSE2
+
+    Swapper swapper;
+    for (; i != cch; i += 1)
+    {
+        uint32_t const ch = swapper(pch[i]);
+        if (!IsPassThroughChar<Json>(ch))
+        {
+            break;
+        }
+
+        dest[i] = static_cast<char>(ch);
+    }
+
+    return i;
+}
+
+// Thrown by StringBuilder when a fixed-size buffer is too small.
+struct StringBuilderFull {};
 
 class StringBuilder
 {
     char* m_pDest;
     char const* m_pDestEnd;
-    std::string& m_dest;
-    size_t m_destCommitSize;
+    std::string* const m_destString; // NULL if writing to a fixed-size buffer.
+    char* m_destBegin; // Changes if m_destString grows.
+    size_t m_destCommitSize; // Relative to m_destBegin.
     bool const m_wantJsonSpace;
     bool const m_wantFieldTag;
     bool m_needJsonComma;
@@ -277,13 +549,17 @@ public:
     ~StringBuilder()
     {
         AssertInvariants();
-        m_dest.erase(m_destCommitSize);
+        if (m_destString)
+        {
+            m_destString->erase(m_destCommitSize);
+        }
     }
 
     StringBuilder(std::string& dest, EventFormatterJsonFlags jsonFlags) noexcept
         : m_pDest(dest.data() + dest.size())
         , m_pDestEnd(dest.data() + dest.size())
-        , m_dest(dest)
+        , m_destString(&dest)
+        , m_destBegin(dest.data())
         , m_destCommitSize(dest.size())
         , m_wantJsonSpace(jsonFlags & EventFormatterJsonFlags_Space)
         , m_wantFieldTag(jsonFlags & EventFormatterJsonFlags_FieldTag)
@@ -292,6 +568,29 @@ public:
         AssertInvariants();
     }
 
+    // Writes to a fixed-size buffer. If the buffer runs out of room, EnsureRoom
+    // throws StringBuilderFull.
+    StringBuilder(char* dest, size_t destSize, EventFormatterJsonFlags jsonFlags) noexcept
+        : m_pDest(dest)
+        , m_pDestEnd(dest + destSize)
+        , m_destString(nullptr)
+        , m_destBegin(dest)
+        , m_destCommitSize(0)
+        , m_wantJsonSpace(jsonFlags & EventFormatterJsonFlags_Space)
+        , m_wantFieldTag(jsonFlags & EventFormatterJsonFlags_FieldTag)
+        , m_needJsonComma(false)
+    {
+        AssertInvariants();
+    }
+
+    // Returns the number of chars committed (relative to the start of a fixed-size
+    // buffer, or to the start of the string).
+    size_t
+    CommitSize() const noexcept
+    {
+        return m_destCommitSize;
+    }
+
     bool
     WantFieldTag() const noexcept
     {
@@ -316,7 +615,7 @@ public:
     Commit() noexcept
     {
         AssertInvariants();
-        m_destCommitSize = m_pDest - m_dest.data();
+        m_destCommitSize = m_pDest - m_destBegin;
     }
 
     // Requires: there is room for utf8.size() chars.
@@ -330,6 +629,20 @@ public:
         WriteEnd();
     }
 
+    // Requires: there is room for cch chars.
+    // Writes the leading chars of [pch, pch + cch) that are IsPassThroughChar,
+    // one byte each. Returns the number of chars consumed (== bytes written).
+    template<bool Json, class Swapper, class CH>
+    size_t
+    WritePassThroughPrefixUnchecked(CH const* pch, size_t cch) noexcept
+    {
+        WriteBegin(cch);
+        auto const count = NarrowPassThroughPrefix<Json, Swapper>(pch, cch, m_pDest);
+        m_pDest += count;
+        WriteEnd();
+        return count;
+    }
+
     // Requires: there is room for 1 char.
     // Assumes: utf8Byte is part of a valid UTF-8 sequence.
     void
@@ -447,6 +760,53 @@ public:
         WriteEnd();
     }
 
+    // Requires: there is room for 2 + sizeof(T) * 2 chars.
+    // Writes 3..18 chars, e.g. [0x0] or [0xFFFFFFFF]. Same as printf("0x%X").
+    template<class T>
+    void
+    WriteHexInt(T val) noexcept
+    {
+        static_assert(std::is_unsigned<T>::value, "WriteHexInt requires unsigned");
+        WriteBegin(2 + sizeof(T) * 2);
+        static char const* const digits = "0123456789ABCDEF";
+
+        *m_pDest++ = '0';
+        *m_pDest++ = 'x';
+
+        char buf[sizeof(T) * 2];
+        unsigned cch = 0;
+        do
+        {
+            buf[cch++] = digits[val & 0xf];
+            val = static_cast<T>(val >> 4);
+        } while (val != 0);
+
+        do
+        {
+            *m_pDest++ = buf[--cch];
+        } while (cch != 0);
+
+        WriteEnd();
+    }
+
+    // Requires: there is room for cchWidth chars.
+    // Requires: val < 10^cchWidth.
+    // Writes cchWidth decimal digits with leading zeros, e.g. printf("%09u").
+    void
+    WriteDecimalZeroPadded(uint32_t val, unsigned cchWidth) noexcept
+    {
+        WriteBegin(cchWidth);
+        for (unsigned i = cchWidth; i != 0; i -= 1)
+        {
+            m_pDest[i - 1] = static_cast<char>('0' + val % 10);
+            val /= 10;
+        }
+
+        assert(val == 0);
+        m_pDest += cchWidth;
+        WriteEnd();
+    }
+
     // Requires: there is room for cchWorstCase chars.
     // Requires: the printf format can generate no more than cchWorstCase chars.
     // Writes up to cchWorstCase plus NUL.
@@ -642,9 +1002,28 @@ public:
         struct tm tm;
         if (gmtime_r(&val, &tm))
         {
-            WritePrintf(DestWriteMax, "%04d-%02u-%02uT%02u:%02u:%02u",
-                1900 + tm.tm_year, 1 + tm.tm_mon, tm.tm_mday,
-                tm.tm_hour, tm.tm_min, tm.tm_sec);
+            int const year = 1900 + tm.tm_year;
+            if (0 <= year && year <= 9999)
+            {
+                // Common case: avoid printf.
+                WriteDecimalZeroPadded(year, 4);
+                *m_pDest++ = '-';
+                WriteDecimalZeroPadded(1 + tm.tm_mon, 2);
+                *m_pDest++ = '-';
+                WriteDecimalZeroPadded(tm.tm_mday, 2);
+                *m_pDest++ = 'T';
+                WriteDecimalZeroPadded(tm.tm_hour, 2);
+                *m_pDest++ = ':';
+                WriteDecimalZeroPadded(tm.tm_min, 2);
+                *m_pDest++ = ':';
+                WriteDecimalZeroPadded(tm.tm_sec, 2);
+            }
+            else
+            {
+                WritePrintf(DestWriteMax, "%04d-%02u-%02uT%02u:%02u:%02u",
+                    year, 1 + tm.tm_mon, tm.tm_mday,
+                    tm.tm_hour, tm.tm_min, tm.tm_sec);
+            }
         }
 #endif // _WIN32
         else
@@ -853,25 +1232,32 @@ private:
     void
     AssertInvariants() noexcept
     {
-        assert(m_pDest >= m_dest.data() + m_destCommitSize);
-        assert(m_pDest <= m_dest.data() + m_dest.size());
-        assert(m_pDestEnd == m_dest.data() + m_dest.size());
-        assert(m_destCommitSize <= m_dest.size());
+        assert(m_pDest >= m_destBegin + m_destCommitSize);
+        assert(m_pDest <= m_pDestEnd);
+        assert(m_destString == nullptr || m_destBegin == m_destString->data());
+        assert(m_destString == nullptr || m_pDestEnd == m_destBegin + m_destString->size());
     }
 
     void
     GrowRoom(size_t roomNeeded)
     {
         AssertInvariants();
-        size_t const curSize = m_pDest - m_dest.data();
+        if (m_destString == nullptr)
+        {
+            throw StringBuilderFull();
+        }
+
+        auto& dest = *m_destString;
+        size_t const curSize = m_pDest - m_destBegin;
         size_t const totalSize = curSize + roomNeeded;
         size_t const newSize = totalSize < roomNeeded // Did it overflow?
             ? ~static_cast<size_t>(0) // Yes: trigger exception from resize.
             : totalSize;
-        assert(m_dest.size() < newSize);
-        m_dest.resize(newSize);
-        m_pDest = m_dest.data() + curSize;
-        m_pDestEnd = m_dest.data() + m_dest.size();
+        assert(dest.size() < newSize);
+        dest.resize(newSize);
+        m_destBegin = dest.data();
+        m_pDest = m_destBegin + curSize;
+        m_pDestEnd = m_destBegin + dest.size();
         AssertInvariants();
     }
 };
@@ -995,6 +1381,16 @@ AppendUtf8WithRoomReserved(
     {
         uint8_t const b0 = pb[ib];
 
+        if (IsPassThroughChar<Json>(b0))
+        {
+            // Copy the whole run of pass-through bytes at once.
+            auto const run = sb.WritePassThroughPrefixUnchecked<Json, SwapNo>(
+                reinterpret_cast<uint8_t const*>(pb + ib), cb - ib);
+            assert(run != 0);
+            ib += run - 1;
+            continue;
+        }
+
         if (Json)
         {
             if (b0 <= 0x1F)
@@ -1163,14 +1559,16 @@ AppendUcs(
     for (auto pch = pchUcs; pch != pchEnd; pch += 1)
     {
         uint32_t ucs4 = swapper(*pch);
-        if (ucs4 >= 0x80)
+        if (ucs4 < 0x80)
         {
-            sb.EnsureRoom(pchEnd - pch + 6);
-            sb.WriteUcsNonAsciiChar(ucs4);
+            auto const run = sb.WritePassThroughPrefixUnchecked<false, Swapper>(pch, pchEnd - pch);
+            assert(run != 0);
+            pch += run - 1;
         }
         else
         {
-            sb.WriteUtf8ByteUnchecked(static_cast<uint8_t>(ucs4));
+            sb.EnsureRoom(pchEnd - pch + 6);
+            sb.WriteUcsNonAsciiChar(ucs4);
         }
     }
 }
@@ -1190,20 +1588,22 @@ AppendUcsJsonEscaped(
     for (auto pch = pchUcs; pch != pchEnd; pch += 1)
     {
         uint32_t ucs4 = swapper(*pch);
-        if (ucs4 >= 0x80)
+        if (IsPassThroughChar<true>(ucs4))
         {
-            sb.EnsureRoom(pchEnd - pch + extraRoomNeeded + 6);
-            sb.WriteUcsNonAsciiChar(ucs4);
+            auto const run = sb.WritePassThroughPrefixUnchecked<true, Swapper>(pch, pchEnd - pch);
+            assert(run != 0);
+            pch += run - 1;
         }
-        else if (auto const ascii = static_cast<uint8_t>(ucs4);
-            sb.NeedsJsonEscape(ascii))
+        else if (ucs4 >= 0x80)
         {
-            sb.EnsureRoom(pchEnd - pch + extraRoomNeeded + 5);
-            sb.WriteJsonEscapeChar(ascii);
+            sb.EnsureRoom(pchEnd - pch + extraRoomNeeded + 6);
+            sb.WriteUcsNonAsciiChar(ucs4);
         }
         else
         {
-            sb.WriteUtf8ByteUnchecked(ascii);
+            // ASCII that needs escaping.
+            sb.EnsureRoom(pchEnd - pch + extraRoomNeeded + 5);
+            sb.WriteJsonEscapeChar(static_cast<uint8_t>(ucs4));
         }
     }
 }
@@ -1257,20 +1657,20 @@ AppendUtf16ValImpl(
     for (size_t ich = 0; ich != cchUtf; ich += 1)
     {
         uint16_t const w0 = swapper(pchUtf[ich]);
-        if (w0 <= 0x7F)
+        if (IsPassThroughChar<Json>(w0))
         {
-            auto const ascii = static_cast<uint8_t>(w0);
-            if (Json)
-            {
-                if (sb.NeedsJsonEscape(ascii))
-                {
-                    sb.EnsureRoom(cchUtf - ich + 6);
-                    sb.WriteJsonEscapeChar(ascii);
-                    continue;
-                }
-            }
-
-            sb.WriteUtf8ByteUnchecked(ascii);
+            // Copy the whole run of pass-through chars at once.
+            auto const run = sb.WritePassThroughPrefixUnchecked<Json, Swapper>(
+                pchUtf + ich, cchUtf - ich);
+            assert(run != 0);
+            ich += run - 1;
+            continue;
+        }
+        else if (w0 <= 0x7F)
+        {
+            // ASCII that needs escaping (only reached if Json).
+            sb.EnsureRoom(cchUtf - ich + 6);
+            sb.WriteJsonEscapeChar(static_cast<uint8_t>(w0));
             continue;
         }
 
@@ -1401,7 +1801,7 @@ AppendHexBytesVal(
     size_t valSize,
     bool json)
 {
-    size_t const roomNeeded = (valSize * 3) + (json * 2u);
+    size_t const roomNeeded = (valSize * 3) + 2u; // WriteQuoteIf needs room even if !json.
     sb.EnsureRoom(roomNeeded);
 
     sb.WriteQuoteIf(json);
@@ -1441,7 +1841,8 @@ AppendJsonMemberBegin(
 
     if (fieldTag != 0 && sb.WantFieldTag())
     {
-        sb.WritePrintf(11, ";tag=0x%X", fieldTag);
+        sb.WriteUtf8Unchecked(";tag="sv);
+        sb.WriteHexInt(fieldTag);
     }
 
     sb.WriteUtf8ByteUnchecked('"');
@@ -1451,6 +1852,7 @@ AppendJsonMemberBegin(
     assert(sb.Room() >= extraRoomNeeded);
 }
 
+template<class Swapper>
 [[nodiscard]] static int
 AppendValueImpl(
     StringBuilder& sb,
@@ -1458,7 +1860,6 @@ AppendValueImpl(
     size_t valSize,
     event_field_encoding encoding,
     event_field_format format,
-    bool needsByteSwap,
     bool json)
 {
     int err;
@@ -1495,7 +1896,7 @@ AppendValueImpl(
             case event_field_format_hex_int:
                 // ["0xFF"] = 6
                 sb.WriteQuoteIf(json);
-                sb.WritePrintf(RoomNeeded - 2, "0x%X", *static_cast<uint8_t const*>(valData));
+                sb.WriteHexInt(*static_cast<uint8_t const*>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case event_field_format_boolean:
@@ -1531,21 +1932,21 @@ AppendValueImpl(
             default:
             case event_field_format_unsigned_int:
                 // [65535] = 5
-                sb.WriteNumber(RoomNeeded, bswap16_if<uint16_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap16_if<uint16_t, Swapper>(valData));
                 break;
             case event_field_format_signed_int:
                 // [-32768] = 6
-                sb.WriteNumber(RoomNeeded, bswap16_if<int16_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap16_if<int16_t, Swapper>(valData));
                 break;
             case event_field_format_hex_int:
                 // ["0xFFFF"] = 8
                 sb.WriteQuoteIf(json);
-                sb.WritePrintf(RoomNeeded - 2, "0x%X", bswap16_if<uint16_t>(needsByteSwap, valData));
+                sb.WriteHexInt(bswap16_if<uint16_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case event_field_format_boolean:
                 // [-32768] = 6
-                sb.WriteBoolean(bswap16_if<uint16_t>(needsByteSwap, valData));
+                sb.WriteBoolean(bswap16_if<uint16_t, Swapper>(valData));
                 break;
             case event_field_format_hex_bytes:
                 // ["00 00"] = 7
@@ -1555,7 +1956,7 @@ AppendValueImpl(
                 break;
             case event_field_format_string_utf:
                 // ["\u0000"] = 9
-                WriteUcsVal(sb, bswap16_if<uint16_t>(needsByteSwap, valData), json); // UCS2
+                WriteUcsVal(sb, bswap16_if<uint16_t, Swapper>(valData), json); // UCS2
                 break;
             case event_field_format_port:
                 // [65535] = 5
@@ -1580,38 +1981,38 @@ AppendValueImpl(
             default:
             case event_field_format_unsigned_int:
                 // [4000000000] = 10
-                sb.WriteNumber(RoomNeeded, bswap32_if<uint32_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap32_if<uint32_t, Swapper>(valData));
                 break;
             case event_field_format_signed_int:
             case event_field_format_pid:
                 // [-2000000000] = 11
-                sb.WriteNumber(RoomNeeded, bswap32_if<int32_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap32_if<int32_t, Swapper>(valData));
                 break;
             case event_field_format_hex_int:
                 // ["0xFFFFFFFF"] = 12
                 sb.WriteQuoteIf(json);
-                sb.WritePrintf(RoomNeeded - 2, "0x%X", bswap32_if<uint32_t>(needsByteSwap, valData));
+                sb.WriteHexInt(bswap32_if<uint32_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case event_field_format_errno:
                 // ["ENOTRECOVERABLE[131]"] = 22
                 sb.WriteQuoteIf(json);
-                sb.WriteErrno(bswap32_if<uint32_t>(needsByteSwap, valData));
+                sb.WriteErrno(bswap32_if<uint32_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case event_field_format_time:
                 // ["TIME(18000000000000000000)"] = 28
                 sb.WriteQuoteIf(json);
-                sb.WriteDateTime(bswap32_if<int32_t>(needsByteSwap, valData));
+                sb.WriteDateTime(bswap32_if<int32_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case event_field_format_boolean:
                 // [-2000000000] = 11
-                sb.WriteBoolean(bswap32_if<uint32_t>(needsByteSwap, valData));
+                sb.WriteBoolean(bswap32_if<uint32_t, Swapper>(valData));
                 break;
             case event_field_format_float:
                 // ["-1.000000001e+38"] = 18
-                WriteFloat32(sb, bswap32_if<uint32_t>(needsByteSwap, valData), json);
+                WriteFloat32(sb, bswap32_if<uint32_t, Swapper>(valData), json);
                 break;
             case event_field_format_hex_bytes:
                 // ["00 00 00 00"] = 13
@@ -1621,7 +2022,7 @@ AppendValueImpl(
                 break;
             case event_field_format_string_utf:
                 // ["nnnnnnn"] = 9 (up to 7 utf-8 bytes)
-                WriteUcsVal(sb, bswap32_if<uint32_t>(needsByteSwap, valData), json); // UCS4
+                WriteUcsVal(sb, bswap32_if<uint32_t, Swapper>(valData), json); // UCS4
                 break;
             case event_field_format_ip_address:
             case event_field_format_ip_address_obsolete:
@@ -1649,28 +2050,28 @@ AppendValueImpl(
             default:
             case event_field_format_unsigned_int:
                 // [18000000000000000000] = 20
-                sb.WriteNumber(RoomNeeded, bswap64_if<uint64_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap64_if<uint64_t, Swapper>(valData));
                 break;
             case event_field_format_signed_int:
                 // [-9000000000000000000] = 20
-                sb.WriteNumber(RoomNeeded, bswap64_if<int64_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap64_if<int64_t, Swapper>(valData));
                 break;
             case event_field_format_hex_int:
                 // ["0xFFFFFFFFFFFFFFFF"] = 20
                 sb.WriteQuoteIf(json);
-                sb.WritePrintf(RoomNeeded - 2, "0x%" PRIX64, bswap64_if<uint64_t>(needsByteSwap, valData));
+                sb.WriteHexInt(bswap64_if<uint64_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case event_field_format_time:
                 // ["TIME(18000000000000000000)"] = 28
                 sb.WriteQuoteIf(json);
-                sb.WriteDateTime(bswap64_if<int64_t>(needsByteSwap, valData));
+                sb.WriteDateTime(bswap64_if<int64_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case event_field_format_float:
             {
                 // ["-1.00000000000000001e+123"] = 27
-                WriteFloat64(sb, bswap64_if<uint64_t>(needsByteSwap, valData), json);
+                WriteFloat64(sb, bswap64_if<uint64_t, Swapper>(valData), json);
                 break;
             }
             case event_field_format_hex_bytes:
@@ -1766,15 +2167,15 @@ AppendValueImpl(
                 break;
             case 2:
                 // [65535] = 5
-                sb.WriteNumber(RoomNeeded, bswap16_if<uint16_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap16_if<uint16_t, Swapper>(valData));
                 break;
             case 4:
                 // [4000000000] = 10
-                sb.WriteNumber(RoomNeeded, bswap32_if<uint32_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap32_if<uint32_t, Swapper>(valData));
                 break;
             case 8:
                 // [18000000000000000000] = 20
-                sb.WriteNumber(RoomNeeded, bswap64_if<uint64_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap64_if<uint64_t, Swapper>(valData));
                 break;
             default:
                 goto Char8Default;
@@ -1796,15 +2197,15 @@ AppendValueImpl(
                 break;
             case 2:
                 // [-32768] = 6
-                sb.WriteNumber(RoomNeeded, bswap16_if<int16_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap16_if<int16_t, Swapper>(valData));
                 break;
             case 4:
                 // [-2000000000] = 11
-                sb.WriteNumber(RoomNeeded, bswap32_if<int32_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap32_if<int32_t, Swapper>(valData));
                 break;
             case 8:
                 // [-9000000000000000000] = 20
-                sb.WriteNumber(RoomNeeded, bswap64_if<int64_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap64_if<int64_t, Swapper>(valData));
                 break;
             default:
                 goto Char8Default;
@@ -1823,25 +2224,25 @@ AppendValueImpl(
             case 1:
                 // ["0xFF"] = 6
                 sb.WriteQuoteIf(json);
-                sb.WritePrintf(RoomNeeded - 2, "0x%X", *static_cast<uint8_t const*>(valData));
+                sb.WriteHexInt(*static_cast<uint8_t const*>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case 2:
                 // ["0xFFFF"] = 8
                 sb.WriteQuoteIf(json);
-                sb.WritePrintf(RoomNeeded - 2, "0x%X", bswap16_if<uint16_t>(needsByteSwap, valData));
+                sb.WriteHexInt(bswap16_if<uint16_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case 4:
                 // ["0xFFFFFFFF"] = 12
                 sb.WriteQuoteIf(json);
-                sb.WritePrintf(RoomNeeded - 2, "0x%X", bswap32_if<uint32_t>(needsByteSwap, valData));
+                sb.WriteHexInt(bswap32_if<uint32_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case 8:
                 // ["0xFFFFFFFFFFFFFFFF"] = 20
                 sb.WriteQuoteIf(json);
-                sb.WritePrintf(RoomNeeded - 2, "0x%" PRIX64, bswap64_if<uint64_t>(needsByteSwap, valData));
+                sb.WriteHexInt(bswap64_if<uint64_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             default:
@@ -1861,7 +2262,7 @@ AppendValueImpl(
             case 4:
                 // ["ENOTRECOVERABLE[131]"] = 22
                 sb.WriteQuoteIf(json);
-                sb.WriteErrno(bswap32_if<uint32_t>(needsByteSwap, valData));
+                sb.WriteErrno(bswap32_if<uint32_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             default:
@@ -1880,7 +2281,7 @@ AppendValueImpl(
                 break;
             case 4:
                 // [-2000000000] = 11
-                sb.WriteNumber(RoomNeeded, bswap32_if<int32_t>(needsByteSwap, valData));
+                sb.WriteNumber(RoomNeeded, bswap32_if<int32_t, Swapper>(valData));
                 break;
             default:
                 goto Char8Default;
@@ -1899,13 +2300,13 @@ AppendValueImpl(
             case 4:
                 // ["TIME(18000000000000000000)"] = 28
                 sb.WriteQuoteIf(json);
-                sb.WriteDateTime(bswap32_if<int32_t>(needsByteSwap, valData));
+                sb.WriteDateTime(bswap32_if<int32_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             case 8:
                 // ["TIME(18000000000000000000)"] = 28
                 sb.WriteQuoteIf(json);
-                sb.WriteDateTime(bswap64_if<int64_t>(needsByteSwap, valData));
+                sb.WriteDateTime(bswap64_if<int64_t, Swapper>(valData));
                 sb.WriteQuoteIf(json);
                 break;
             default:
@@ -1928,11 +2329,11 @@ AppendValueImpl(
                 break;
             case 2:
                 // [-32768] = 6
-                sb.WriteBoolean(bswap16_if<uint16_t>(needsByteSwap, valData));
+                sb.WriteBoolean(bswap16_if<uint16_t, Swapper>(valData));
                 break;
             case 4:
                 // [-2000000000] = 11
-                sb.WriteBoolean(bswap32_if<uint32_t>(needsByteSwap, valData));
+                sb.WriteBoolean(bswap32_if<uint32_t, Swapper>(valData));
                 break;
             default:
                 goto Char8Default;
@@ -1950,11 +2351,11 @@ AppendValueImpl(
                 break;
             case 4:
                 // ["-1.000000001e+38"] = 18
-                WriteFloat32(sb, bswap32_if<uint32_t>(needsByteSwap, valData), json);
+                WriteFloat32(sb, bswap32_if<uint32_t, Swapper>(valData), json);
                 break;
             case 8:
                 // ["-1.00000000000000001e+123"] = 27
-                WriteFloat64(sb, bswap64_if<uint64_t>(needsByteSwap, valData), json);
+                WriteFloat64(sb, bswap64_if<uint64_t, Swapper>(valData), json);
                 break;
             default:
                 goto Char8Default;
@@ -2086,18 +2487,9 @@ AppendValueImpl(
                 __fallthrough;
             default:
             case event_field_format_string_utf:
-                if (needsByteSwap)
-                {
-                    AppendUtf16Val<SwapYes>(sb,
-                        static_cast<uint16_t const*>(valData), valSize / sizeof(uint16_t),
-                        json);
-                }
-                else
-                {
-                    AppendUtf16Val<SwapNo>(sb,
-                        static_cast<uint16_t const*>(valData), valSize / sizeof(uint16_t),
-                        json);
-                }
+                AppendUtf16Val<Swapper>(sb,
+                    static_cast<uint16_t const*>(valData), valSize / sizeof(uint16_t),
+                    json);
                 break;
             }
 
@@ -2127,18 +2519,9 @@ AppendValueImpl(
                 __fallthrough;
             default:
             case event_field_format_string_utf:
-                if (needsByteSwap)
-                {
-                    AppendUcsVal<SwapYes>(sb,
-                        static_cast<uint32_t const*>(valData), valSize / sizeof(uint32_t),
-                        json);
-                }
-                else
-                {
-                    AppendUcsVal<SwapNo>(sb,
-                        static_cast<uint32_t const*>(valData), valSize / sizeof(uint32_t),
-                        json);
-                }
+                AppendUcsVal<Swapper>(sb,
+                    static_cast<uint32_t const*>(valData), valSize / sizeof(uint32_t),
+                    json);
                 break;
             }
 
@@ -2151,40 +2534,226 @@ AppendValueImpl(
 }
 
 [[nodiscard]] static int
-AppendItemAsJsonImpl(
+AppendValueImpl(
     StringBuilder& sb,
-    EventEnumerator& enumerator,
-    bool wantName)
+    void const* valData,
+    size_t valSize,
+    event_field_encoding encoding,
+    event_field_format format,
+    bool needsByteSwap,
+    bool json)
 {
-    int err;
-    int depth = 0;
+    return needsByteSwap
+        ? AppendValueImpl<SwapYes>(sb, valData, valSize, encoding, format, json)
+        : AppendValueImpl<SwapNo>(sb, valData, valSize, encoding, format, json);
+}
 
-    do
+// Appends the elements of a simple array as comma-separated JSON values, e.g.
+// [ 1, 2, 3] (brackets not included). Common integer and float formats are
+// handled by a loop specialized for the element type; other formats fall back
+// to AppendValueImpl for each element.
+template<class U, class Swapper, class WriteElement>
+static void
+AppendSimpleArrayLoop(
+    StringBuilder& sb,
+    void const* arrayData,
+    size_t arrayCount,
+    unsigned roomNeeded,
+    WriteElement writeElement)
+{
+    Swapper swapper;
+    auto const pbArray = static_cast<uint8_t const*>(arrayData);
+    for (size_t i = 0; i != arrayCount; i += 1)
     {
-        EventItemInfo itemInfo;
+        U val;
+        memcpy(&val, pbArray + i * sizeof(U), sizeof(U));
+        sb.EnsureRoom(roomNeeded + 2);
+        sb.WriteJsonCommaSpaceAsNeeded();
+        writeElement(swapper(val));
+    }
+}
 
-        switch (enumerator.State())
+template<class Swapper>
+[[nodiscard]] static int
+AppendSimpleArrayElementsAsJsonImpl(
+    StringBuilder& sb,
+    void const* arrayData,
+    size_t arrayCount,
+    unsigned elementSize,
+    event_field_encoding encoding,
+    event_field_format format)
+{
+    int err = 0;
+
+    switch (encoding)
+    {
+    case event_field_encoding_value8:
+        switch (format)
         {
+        case event_field_format_default:
+        case event_field_format_unsigned_int:
+            AppendSimpleArrayLoop<uint8_t, Swapper>(sb, arrayData, arrayCount, 3,
+                [&sb](uint8_t val) { sb.WriteNumber(3, val); });
+            return 0;
+        case event_field_format_signed_int:
+            AppendSimpleArrayLoop<uint8_t, Swapper>(sb, arrayData, arrayCount, 4,
+                [&sb](uint8_t val) { sb.WriteNumber(4, static_cast<int8_t>(val)); });
+            return 0;
+        case event_field_format_hex_int:
+            AppendSimpleArrayLoop<uint8_t, Swapper>(sb, arrayData, arrayCount, 6,
+                [&sb](uint8_t val) { sb.WriteUtf8ByteUnchecked('"'); sb.WriteHexInt(val); sb.WriteUtf8ByteUnchecked('"'); });
+            return 0;
         default:
-            assert(!"Enumerator in invalid state.");
-            err = EINVAL;
-            goto Done;
-
-        case EventEnumeratorState_BeforeFirstItem:
-            depth += 1;
             break;
-
-        case EventEnumeratorState_Value:
-
-            itemInfo = enumerator.GetItemInfo();
-            wantName && !itemInfo.ArrayFlags
-                ? AppendJsonMemberBegin(sb, itemInfo.FieldTag, itemInfo.Name, 0)
-                : AppendJsonValueBegin(sb, 0);
-            err = AppendValueImpl(
-                sb, itemInfo.ValueData, itemInfo.ValueSize,
-                itemInfo.Encoding, itemInfo.Format, itemInfo.NeedByteSwap,
-                true);
-            if (err != 0)
+        }
+        break;
+    case event_field_encoding_value16:
+        switch (format)
+        {
+        case event_field_format_default:
+        case event_field_format_unsigned_int:
+            AppendSimpleArrayLoop<uint16_t, Swapper>(sb, arrayData, arrayCount, 5,
+                [&sb](uint16_t val) { sb.WriteNumber(5, val); });
+            return 0;
+        case event_field_format_signed_int:
+            AppendSimpleArrayLoop<uint16_t, Swapper>(sb, arrayData, arrayCount, 6,
+                [&sb](uint16_t val) { sb.WriteNumber(6, static_cast<int16_t>(val)); });
+            return 0;
+        case event_field_format_hex_int:
+            AppendSimpleArrayLoop<uint16_t, Swapper>(sb, arrayData, arrayCount, 8,
+                [&sb](uint16_t val) { sb.WriteUtf8ByteUnchecked('"'); sb.WriteHexInt(val); sb.WriteUtf8ByteUnchecked('"'); });
+            return 0;
+        default:
+            break;
+        }
+        break;
+    case event_field_encoding_value32:
+        switch (format)
+        {
+        case event_field_format_default:
+        case event_field_format_unsigned_int:
+            AppendSimpleArrayLoop<uint32_t, Swapper>(sb, arrayData, arrayCount, 10,
+                [&sb](uint32_t val) { sb.WriteNumber(10, val); });
+            return 0;
+        case event_field_format_signed_int:
+        case event_field_format_pid:
+            AppendSimpleArrayLoop<uint32_t, Swapper>(sb, arrayData, arrayCount, 11,
+                [&sb](uint32_t val) { sb.WriteNumber(11, static_cast<int32_t>(val)); });
+            return 0;
+        case event_field_format_hex_int:
+            AppendSimpleArrayLoop<uint32_t, Swapper>(sb, arrayData, arrayCount, 12,
+                [&sb](uint32_t val) { sb.WriteUtf8ByteUnchecked('"'); sb.WriteHexInt(val); sb.WriteUtf8ByteUnchecked('"'); });
+            return 0;
+        case event_field_format_float:
+            AppendSimpleArrayLoop<uint32_t, Swapper>(sb, arrayData, arrayCount, 18,
+                [&sb](uint32_t val) { WriteFloat32(sb, val, true); });
+            return 0;
+        default:
+            break;
+        }
+        break;
+    case event_field_encoding_value64:
+        switch (format)
+        {
+        case event_field_format_default:
+        case event_field_format_unsigned_int:
+            AppendSimpleArrayLoop<uint64_t, Swapper>(sb, arrayData, arrayCount, 20,
+                [&sb](uint64_t val) { sb.WriteNumber(20, val); });
+            return 0;
+        case event_field_format_signed_int:
+            AppendSimpleArrayLoop<uint64_t, Swapper>(sb, arrayData, arrayCount, 20,
+                [&sb](uint64_t val) { sb.WriteNumber(20, static_cast<int64_t>(val)); });
+            return 0;
+        case event_field_format_hex_int:
+            AppendSimpleArrayLoop<uint64_t, Swapper>(sb, arrayData, arrayCount, 20,
+                [&sb](uint64_t val) { sb.WriteUtf8ByteUnchecked('"'); sb.WriteHexInt(val); sb.WriteUtf8ByteUnchecked('"'); });
+            return 0;
+        case event_field_format_float:
+            AppendSimpleArrayLoop<uint64_t, Swapper>(sb, arrayData, arrayCount, 27,
+                [&sb](uint64_t val) { WriteFloat64(sb, val, true); });
+            return 0;
+        default:
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+
+    // Generic path.
+    auto const pbArray = static_cast<uint8_t const*>(arrayData);
+    for (size_t i = 0; i != arrayCount; i += 1)
+    {
+        AppendJsonValueBegin(sb, 0);
+        err = AppendValueImpl<Swapper>(
+            sb, pbArray + i * elementSize, elementSize,
+            encoding, format,
+            true);
+        if (err != 0)
+        {
+            break;
+        }
+    }
+
+    return err;
+}
+
+// Requires: arrayBegin is the ArrayBegin item of a simple array (ElementSize != 0).
+template<class Swapper>
+[[nodiscard]] static int
+AppendSimpleArrayElementsAsJson(
+    StringBuilder& sb,
+    EventItemInfo const& arrayBegin)
+{
+    assert(arrayBegin.ElementSize != 0);
+    assert(arrayBegin.ValueSize == arrayBegin.ArrayCount * arrayBegin.ElementSize);
+    assert(arrayBegin.NeedByteSwap == (!std::is_same_v<Swapper, SwapNo>));
+    return AppendSimpleArrayElementsAsJsonImpl<Swapper>(
+        sb, arrayBegin.ValueData, arrayBegin.ArrayCount, arrayBegin.ElementSize,
+        arrayBegin.Encoding, arrayBegin.Format);
+}
+
+// Swapper must match the byte order of the enumerator's event (all of an
+// event's items have the same NeedByteSwap).
+template<class Swapper>
+[[nodiscard]] static int
+AppendItemAsJsonImpl(
+    StringBuilder& sb,
+    EventEnumerator& enumerator,
+    bool wantName)
+{
+    int err;
+    int depth = 0;
+    bool skipChildren;
+
+    do
+    {
+        EventItemInfo itemInfo;
+        skipChildren = false;
+
+        switch (enumerator.State())
+        {
+        default:
+            assert(!"Enumerator in invalid state.");
+            err = EINVAL;
+            goto Done;
+
+        case EventEnumeratorState_BeforeFirstItem:
+            depth += 1;
+            break;
+
+        case EventEnumeratorState_Value:
+
+            itemInfo = enumerator.GetItemInfo();
+            wantName && !itemInfo.ArrayFlags
+                ? AppendJsonMemberBegin(sb, itemInfo.FieldTag, itemInfo.Name, 0)
+                : AppendJsonValueBegin(sb, 0);
+            assert(itemInfo.NeedByteSwap == (!std::is_same_v<Swapper, SwapNo>));
+            err = AppendValueImpl<Swapper>(
+                sb, itemInfo.ValueData, itemInfo.ValueSize,
+                itemInfo.Encoding, itemInfo.Format,
+                true);
+            if (err != 0)
             {
                 goto Done;
             }
@@ -2198,7 +2767,25 @@ AppendItemAsJsonImpl(
                 : AppendJsonValueBegin(sb, 1);
             sb.WriteJsonArrayBegin(); // 1 extra byte reserved above.
 
-            depth += 1;
+            if (itemInfo.ElementSize != 0)
+            {
+                // Simple array: format all elements from the array's data in one
+                // pass, then skip the per-element items.
+                err = AppendSimpleArrayElementsAsJson<Swapper>(sb, itemInfo);
+                if (err != 0)
+                {
+                    goto Done;
+                }
+
+                sb.EnsureRoom(2);
+                sb.WriteJsonSpaceIfWanted();
+                sb.WriteJsonArrayEnd();
+                skipChildren = true;
+            }
+            else
+            {
+                depth += 1;
+            }
             break;
 
         case EventEnumeratorState_ArrayEnd:
@@ -2232,7 +2819,7 @@ AppendItemAsJsonImpl(
         }
 
         wantName = true;
-    } while (enumerator.MoveNext() && depth > 0);
+    } while ((skipChildren ? enumerator.MoveNextSibling() : enumerator.MoveNext()) && depth > 0);
 
     err = enumerator.LastError();
 
@@ -2241,6 +2828,24 @@ Done:
     return err;
 }
 
+// Chooses the byte order once per event, then formats the item.
+[[nodiscard]] static int
+AppendItemAsJsonImpl(
+    StringBuilder& sb,
+    EventEnumerator& enumerator,
+    bool wantName)
+{
+    static auto constexpr HostEndianFlag =
+        EVENTHEADER_LITTLE_ENDIAN
+        ? eventheader_flag_little_endian
+        : eventheader_flag_none;
+    auto const eventFlags = enumerator.GetEventInfo().Header.flags;
+    return HostEndianFlag != (eventFlags & eventheader_flag_little_endian)
+        ? AppendItemAsJsonImpl<SwapYes>(sb, enumerator, wantName)
+        : AppendItemAsJsonImpl<SwapNo>(sb, enumerator, wantName);
+}
+
+// e.g. [, "time": "DATETIME.nnnnnnnnnZ"].
 static void
 AppendMetaN(
     StringBuilder& sb,
@@ -2260,8 +2865,9 @@ AppendMetaN(
     sb.WriteUtf8ByteUnchecked('"'); // 1 extra byte reserved above.
 }
 
+// Provider through tag (the parts of AppendMetaEventInfo before the activity IDs).
 static void
-AppendMetaEventInfo(
+AppendMetaEventInfoPrefix(
     StringBuilder& sb,
     EventFormatterMetaFlags metaFlags,
     EventInfo const& ei)
@@ -2303,7 +2909,9 @@ AppendMetaEventInfo(
     if ((metaFlags & EventFormatterMetaFlags_keyword) && ei.Keyword != 0)
     {
         AppendJsonMemberBegin(sb, 0, "keyword"sv, 20);
-        sb.WritePrintf(20, "\"0x%" PRIX64 "\"", ei.Keyword);
+        sb.WriteUtf8ByteUnchecked('"');
+        sb.WriteHexInt(ei.Keyword);
+        sb.WriteUtf8ByteUnchecked('"');
     }
 
     if ((metaFlags & EventFormatterMetaFlags_opcode) && ei.Header.opcode != 0)
@@ -2315,9 +2923,19 @@ AppendMetaEventInfo(
     if ((metaFlags & EventFormatterMetaFlags_tag) && ei.Header.tag != 0)
     {
         AppendJsonMemberBegin(sb, 0, "tag"sv, 8);
-        sb.WritePrintf(8, "\"0x%X\"", ei.Header.tag);
+        sb.WriteUtf8ByteUnchecked('"');
+        sb.WriteHexInt(ei.Header.tag);
+        sb.WriteUtf8ByteUnchecked('"');
     }
+}
 
+// Activity IDs: the only parts of AppendMetaEventInfo that vary per event.
+static void
+AppendMetaEventInfoActivity(
+    StringBuilder& sb,
+    EventFormatterMetaFlags metaFlags,
+    EventInfo const& ei)
+{
     if ((metaFlags & EventFormatterMetaFlags_activity) && ei.ActivityId != nullptr)
     {
         AppendJsonMemberBegin(sb, 0, "activity"sv, 38);
@@ -2333,7 +2951,15 @@ AppendMetaEventInfo(
         sb.WriteUuid(ei.RelatedActivityId);
         sb.WriteUtf8ByteUnchecked('"');
     }
+}
 
+// Options and flags (after the activity IDs).
+static void
+AppendMetaEventInfoSuffix(
+    StringBuilder& sb,
+    EventFormatterMetaFlags metaFlags,
+    EventInfo const& ei)
+{
     if ((metaFlags & EventFormatterMetaFlags_options) && ei.OptionsIndex < ei.TracepointNameLength)
     {
         AppendJsonMemberBegin(sb, 0, "options"sv, 1);
@@ -2348,19 +2974,332 @@ AppendMetaEventInfo(
     if (metaFlags & EventFormatterMetaFlags_flags)
     {
         AppendJsonMemberBegin(sb, 0, "flags"sv, 6);
-        sb.WritePrintf(6, "\"0x%X\"", ei.Header.flags);
+        sb.WriteUtf8ByteUnchecked('"');
+        sb.WriteHexInt(ei.Header.flags);
+        sb.WriteUtf8ByteUnchecked('"');
+    }
+}
+
+// JSON fragments from EventFormatterMetaCache. Each fragment is a sequence of
+// members, rendered as if no comma were needed before the first member.
+struct MetaFragments
+{
+    std::string_view N;
+    std::string_view MetaPrefix;
+    std::string_view MetaSuffix;
+    bool Valid;
+};
+
+// Appends a fragment from MetaFragments.
+static void
+AppendMetaFragment(
+    StringBuilder& sb,
+    std::string_view fragment)
+{
+    if (!fragment.empty())
+    {
+        sb.EnsureRoom(1 + fragment.size());
+        if (sb.NeedJsonComma())
+        {
+            sb.WriteUtf8ByteUnchecked(',');
+        }
+
+        sb.WriteUtf8Unchecked(fragment);
+        sb.SetNeedJsonComma(true);
+    }
+}
+
+static void
+AppendMetaN(
+    StringBuilder& sb,
+    EventInfo const& ei,
+    MetaFragments const& fragments)
+{
+    if (fragments.Valid)
+    {
+        AppendMetaFragment(sb, fragments.N);
+    }
+    else
+    {
+        AppendMetaN(sb, ei);
+    }
+}
+
+static void
+AppendMetaEventInfo(
+    StringBuilder& sb,
+    EventFormatterMetaFlags metaFlags,
+    EventInfo const& ei,
+    MetaFragments const& fragments)
+{
+    if (fragments.Valid)
+    {
+        AppendMetaFragment(sb, fragments.MetaPrefix);
+        AppendMetaEventInfoActivity(sb, metaFlags, ei);
+        AppendMetaFragment(sb, fragments.MetaSuffix);
+    }
+    else
+    {
+        AppendMetaEventInfoPrefix(sb, metaFlags, ei);
+        AppendMetaEventInfoActivity(sb, metaFlags, ei);
+        AppendMetaEventInfoSuffix(sb, metaFlags, ei);
+    }
+}
+
+namespace eventheader_decode
+{
+    struct EventFormatterMetaCache
+    {
+        // metaFlags that affect the cached fragments.
+        static constexpr unsigned FlagsMask =
+            EventFormatterMetaFlags_n |
+            EventFormatterMetaFlags_id |
+            EventFormatterMetaFlags_version |
+            EventFormatterMetaFlags_level |
+            EventFormatterMetaFlags_keyword |
+            EventFormatterMetaFlags_opcode |
+            EventFormatterMetaFlags_tag |
+            EventFormatterMetaFlags_provider |
+            EventFormatterMetaFlags_event |
+            EventFormatterMetaFlags_options |
+            EventFormatterMetaFlags_flags;
+        static constexpr unsigned FlagUsed = 0x80000000;
+        static constexpr unsigned FlagSpace = 0x40000000;
+        static_assert(0 == (FlagsMask & (FlagUsed | FlagSpace)), "FlagsMask overlap");
+
+        // Returns the fragments for the event, rendering them if they are not
+        // in the cache. Returns Valid = false if cache is null or if the
+        // fragments do not fit in a cache entry.
+        static MetaFragments
+        Lookup(
+            EventFormatterCache* cache,
+            EventInfo const& ei,
+            EventFormatterJsonFlags jsonFlags,
+            EventFormatterMetaFlags metaFlags) noexcept
+        {
+            MetaFragments fragments = {};
+            if (!cache)
+            {
+                return fragments;
+            }
+
+            // FNV-1a of the event name, also computing its length.
+            uint32_t hash = 2166136261u;
+            size_t nameLength = 0;
+            for (; ei.Name[nameLength] != 0; nameLength += 1)
+            {
+                hash = (hash ^ static_cast<uint8_t>(ei.Name[nameLength])) * 16777619u;
+            }
+
+            if (nameLength + ei.TracepointNameLength > EventFormatterCache::MetaCacheBufferSize / 2)
+            {
+                return fragments;
+            }
+
+            hash ^= ei.TracepointNameLength ^ (ei.Header.id << 8) ^ (ei.Header.level << 24);
+            hash ^= hash >> 16;
+
+            unsigned const flags = FlagUsed |
+                ((jsonFlags & EventFormatterJsonFlags_Space) ? FlagSpace : 0u) |
+                (metaFlags & FlagsMask);
+            auto& entry = cache->m_metaCache[hash & (EventFormatterCache::MetaCacheSize - 1)];
+            auto const keySize = ei.TracepointNameLength + nameLength;
+            if (entry.Flags != flags ||
+                entry.Keyword != ei.Keyword ||
+                0 != memcmp(&entry.Header, &ei.Header, sizeof(entry.Header)) ||
+                entry.TracepointNameLength != ei.TracepointNameLength ||
+                entry.NameLength != nameLength ||
+                0 != memcmp(entry.Buffer, ei.TracepointName, ei.TracepointNameLength) ||
+                0 != memcmp(entry.Buffer + ei.TracepointNameLength, ei.Name, nameLength))
+            {
+                entry.Flags = 0;
+                try
+                {
+                    Render(entry, ei, static_cast<EventFormatterJsonFlags>(jsonFlags & EventFormatterJsonFlags_Space),
+                        static_cast<EventFormatterMetaFlags>(metaFlags & FlagsMask), keySize);
+                }
+                catch (StringBuilderFull const&)
+                {
+                    return fragments;
+                }
+
+                entry.Keyword = ei.Keyword;
+                entry.Header = ei.Header;
+                entry.TracepointNameLength = ei.TracepointNameLength;
+                entry.NameLength = static_cast<uint16_t>(nameLength);
+                memcpy(entry.Buffer, ei.TracepointName, ei.TracepointNameLength);
+                memcpy(entry.Buffer + ei.TracepointNameLength, ei.Name, nameLength);
+                entry.Flags = flags;
+            }
+
+            auto const p = entry.Buffer + keySize;
+            fragments.N = { p, entry.NSize };
+            fragments.MetaPrefix = { p + entry.NSize, entry.MetaPrefixSize };
+            fragments.MetaSuffix = { p + entry.NSize + entry.MetaPrefixSize, entry.MetaSuffixSize };
+            fragments.Valid = true;
+            return fragments;
+        }
+
+        // Requires: there is room for 26 chars.
+        // Same as sb.WriteDateTime(val), but reuses the cache's result for
+        // the previous val if it is the same second.
+        static void
+        WriteDateTime(
+            StringBuilder& sb,
+            EventFormatterCache* cache,
+            int64_t val) noexcept
+        {
+            if (!cache)
+            {
+                sb.WriteDateTime(val);
+                return;
+            }
+
+            if (cache->m_timeCacheSize == 0 || cache->m_timeCacheSec != val)
+            {
+                StringBuilder timeSb(cache->m_timeCache, sizeof(cache->m_timeCache),
+                    static_cast<EventFormatterJsonFlags>(0));
+                timeSb.WriteDateTime(val);
+                timeSb.Commit();
+                cache->m_timeCacheSec = val;
+                cache->m_timeCacheSize = static_cast<uint8_t>(timeSb.CommitSize());
+            }
+
+            sb.WriteUtf8Unchecked({ cache->m_timeCache, cache->m_timeCacheSize });
+        }
+
+    private:
+
+        // Renders the fragments into entry.Buffer after the key.
+        // Throws StringBuilderFull if they do not fit.
+        static void
+        Render(
+            EventFormatterCache::MetaCacheEntry& entry,
+            EventInfo const& ei,
+            EventFormatterJsonFlags jsonFlags,
+            EventFormatterMetaFlags metaFlags,
+            size_t keySize) noexcept(false)
+        {
+            StringBuilder sb(entry.Buffer + keySize, sizeof(entry.Buffer) - keySize, jsonFlags);
+
+            if (metaFlags & EventFormatterMetaFlags_n)
+            {
+                AppendMetaN(sb, ei);
+            }
+
+            sb.Commit();
+            auto const nEnd = sb.CommitSize();
+
+            sb.SetNeedJsonComma(false);
+            AppendMetaEventInfoPrefix(sb, metaFlags, ei);
+            sb.Commit();
+            auto const prefixEnd = sb.CommitSize();
+
+            sb.SetNeedJsonComma(false);
+            AppendMetaEventInfoSuffix(sb, metaFlags, ei);
+            sb.Commit();
+            auto const suffixEnd = sb.CommitSize();
+
+            entry.NSize = static_cast<uint16_t>(nEnd);
+            entry.MetaPrefixSize = static_cast<uint16_t>(prefixEnd - nEnd);
+            entry.MetaSuffixSize = static_cast<uint16_t>(suffixEnd - prefixEnd);
+        }
+    };
+}
+// namespace eventheader_decode
+
+static void
+AppendMetaTime(
+    StringBuilder& sb,
+    EventFormatterCache* cache,
+    PerfEventSessionInfo const& sessionInfo,
+    uint64_t time)
+{
+    AppendJsonMemberBegin(sb, 0, "time"sv, 39); // "DATETIME.nnnnnnnnnZ" = 1 + 26 + 12
+    if (sessionInfo.ClockOffsetKnown())
+    {
+        auto timeSpec = sessionInfo.TimeToRealTime(time);
+        sb.WriteUtf8ByteUnchecked('\"');
+        EventFormatterMetaCache::WriteDateTime(sb, cache, timeSpec.tv_sec);
+        sb.WriteUtf8ByteUnchecked('.');
+        sb.WriteDecimalZeroPadded(timeSpec.tv_nsec, 9);
+        sb.WriteUtf8Unchecked("Z\""sv);
+    }
+    else
+    {
+        sb.WriteNumber(20, time / 1000000000);
+        sb.WriteUtf8ByteUnchecked('.');
+        sb.WriteDecimalZeroPadded(static_cast<unsigned>(time % 1000000000), 9);
+    }
+}
+
+// Writes "callchain":["0x...", ...]. Context markers (e.g. PERF_CONTEXT_USER)
+// are included as-is.
+static void
+AppendMetaCallchain(
+    StringBuilder& sb,
+    _In_ uint64_t const* callchain,
+    bool fileBigEndian)
+{
+    PerfByteReader const byteReader(fileBigEndian);
+    auto const nr = byteReader.Read(callchain);
+
+    AppendJsonMemberBegin(sb, 0, "callchain"sv, 1);
+    sb.WriteJsonArrayBegin(); // 1 extra byte reserved above.
+    for (uint64_t i = 1; i <= nr; i += 1)
+    {
+        unsigned const RoomNeeded = 20; // ["0xFFFFFFFFFFFFFFFF"]
+        sb.EnsureRoom(RoomNeeded + 2);
+        sb.WriteJsonCommaSpaceAsNeeded();
+        sb.WriteUtf8ByteUnchecked('"');
+        sb.WriteHexInt(byteReader.Read(&callchain[i]));
+        sb.WriteUtf8ByteUnchecked('"');
+    }
+
+    sb.EnsureRoom(2);
+    sb.WriteJsonSpaceIfWanted();
+    sb.WriteJsonArrayEnd();
+}
+
+// Requires: there is room for roomNeeded chars.
+// Writes val as a quoted hex string, unsigned decimal, or signed decimal.
+// For compatibility with previous (printf-based) output, 8-bit and 16-bit
+// signed values are not sign-extended.
+template<class T>
+static void
+WriteIntegerSampleFieldValue(
+    StringBuilder& sb,
+    unsigned roomNeeded,
+    T val,
+    PerfFieldFormat format) noexcept
+{
+    using SignedT = std::conditional_t<(sizeof(T) < sizeof(int32_t)), int32_t, std::make_signed_t<T>>;
+    switch (format)
+    {
+    case PerfFieldFormatHex:
+        assert(roomNeeded >= 4 + sizeof(T) * 2);
+        sb.WriteUtf8ByteUnchecked('"');
+        sb.WriteHexInt(val);
+        sb.WriteUtf8ByteUnchecked('"');
+        break;
+    case PerfFieldFormatSigned:
+        sb.WriteNumber(roomNeeded, static_cast<SignedT>(val));
+        break;
+    default:
+        sb.WriteNumber(roomNeeded, val);
+        break;
     }
 }
 
 // Assumes that there is room for '[' when called.
+// Requires: format is PerfFieldFormatHex, PerfFieldFormatUnsigned, or PerfFieldFormatSigned.
 static void
 AppendIntegerSampleFieldAsJsonImpl(
     StringBuilder& sb,
     std::string_view fieldRawData,
     PerfFieldMetadata const& fieldMetadata,
     bool fileBigEndian,
-    char const* format32,
-    char const* format64)
+    PerfFieldFormat format)
 {
     assert(sb.Room() > 0);
     PerfByteReader const byteReader(fileBigEndian);
@@ -2379,7 +3318,7 @@ AppendIntegerSampleFieldAsJsonImpl(
                 unsigned const RoomNeeded = 6; // ["0xFF"]
                 sb.EnsureRoom(RoomNeeded);
                 auto val = byteReader.ReadAsU8(fieldRawData.data());
-                sb.WritePrintf(RoomNeeded, format32, val);
+                WriteIntegerSampleFieldValue(sb, RoomNeeded, val, format);
             }
             break;
         case PerfFieldElementSize16:
@@ -2392,7 +3331,7 @@ AppendIntegerSampleFieldAsJsonImpl(
                 unsigned const RoomNeeded = 8; // ["0xFFFF"]
                 sb.EnsureRoom(RoomNeeded);
                 auto val = byteReader.ReadAsU16(fieldRawData.data());
-                sb.WritePrintf(RoomNeeded, format32, val);
+                WriteIntegerSampleFieldValue(sb, RoomNeeded, val, format);
             }
             break;
         case PerfFieldElementSize32:
@@ -2405,7 +3344,7 @@ AppendIntegerSampleFieldAsJsonImpl(
                 unsigned const RoomNeeded = 12; // ["0xFFFFFFFF"]
                 sb.EnsureRoom(RoomNeeded);
                 auto val = byteReader.ReadAsU32(fieldRawData.data());
-                sb.WritePrintf(RoomNeeded, format32, val);
+                WriteIntegerSampleFieldValue(sb, RoomNeeded, val, format);
             }
             break;
         case PerfFieldElementSize64:
@@ -2418,7 +3357,7 @@ AppendIntegerSampleFieldAsJsonImpl(
                 unsigned const RoomNeeded = 20; // ["0xFFFFFFFFFFFFFFFF"]
                 sb.EnsureRoom(RoomNeeded);
                 auto val = byteReader.ReadAsU64(fieldRawData.data());
-                sb.WritePrintf(RoomNeeded, format64, val);
+                WriteIntegerSampleFieldValue(sb, RoomNeeded, val, format);
             }
             break;
         }
@@ -2437,7 +3376,7 @@ AppendIntegerSampleFieldAsJsonImpl(
                 unsigned const RoomNeeded = 6; // ["0xFF"]
                 sb.EnsureRoom(RoomNeeded + 2);
                 sb.WriteJsonCommaSpaceAsNeeded();
-                sb.WritePrintf(RoomNeeded, format32, byteReader.Read(p));
+                WriteIntegerSampleFieldValue(sb, RoomNeeded, byteReader.Read(p), format);
             }
             break;
         case PerfFieldElementSize16:
@@ -2446,7 +3385,7 @@ AppendIntegerSampleFieldAsJsonImpl(
                 unsigned const RoomNeeded = 8; // ["0xFFFF"]
                 sb.EnsureRoom(RoomNeeded + 2);
                 sb.WriteJsonCommaSpaceAsNeeded();
-                sb.WritePrintf(RoomNeeded, format32, byteReader.Read(p));
+                WriteIntegerSampleFieldValue(sb, RoomNeeded, byteReader.Read(p), format);
             }
             break;
         case PerfFieldElementSize32:
@@ -2455,7 +3394,7 @@ AppendIntegerSampleFieldAsJsonImpl(
                 unsigned const RoomNeeded = 12; // ["0xFFFFFFFF"]
                 sb.EnsureRoom(RoomNeeded + 2);
                 sb.WriteJsonCommaSpaceAsNeeded();
-                sb.WritePrintf(RoomNeeded, format32, byteReader.Read(p));
+                WriteIntegerSampleFieldValue(sb, RoomNeeded, byteReader.Read(p), format);
             }
             break;
         case PerfFieldElementSize64:
@@ -2464,7 +3403,7 @@ AppendIntegerSampleFieldAsJsonImpl(
                 unsigned const RoomNeeded = 20; // ["0xFFFFFFFFFFFFFFFF"]
                 sb.EnsureRoom(RoomNeeded + 2);
                 sb.WriteJsonCommaSpaceAsNeeded();
-                sb.WritePrintf(RoomNeeded, format64, byteReader.Read(p));
+                WriteIntegerSampleFieldValue(sb, RoomNeeded, byteReader.Read(p), format);
             }
             break;
         }
@@ -2475,22 +3414,17 @@ AppendIntegerSampleFieldAsJsonImpl(
     }
 }
 
+// Assumes that there is room for '[' when called.
 static void
-AppendSampleFieldAsJsonImpl(
+AppendSampleFieldValueAsJsonImpl(
     StringBuilder& sb,
     _In_reads_bytes_(fieldRawDataSize) void const* fieldRawData,
     size_t fieldRawDataSize,
     PerfFieldMetadata const& fieldMetadata,
-    bool fileBigEndian,
-    bool wantName)
+    bool fileBigEndian)
 {
-    PerfByteReader const byteReader(fileBigEndian);
     auto const fieldRawDataChars = static_cast<char const*>(fieldRawData);
 
-    // Note: AppendIntegerSampleFieldAsJsonImpl expects 1 byte reserved for '['.
-    wantName
-        ? AppendJsonMemberBegin(sb, 0, fieldMetadata.Name(), 1)
-        : AppendJsonValueBegin(sb, 1);
     switch (fieldMetadata.Format())
     {
     default:
@@ -2506,15 +3440,15 @@ AppendSampleFieldAsJsonImpl(
         [[fallthrough]];
     case PerfFieldFormatHex:
         AppendIntegerSampleFieldAsJsonImpl(sb, { fieldRawDataChars, fieldRawDataSize },
-            fieldMetadata, fileBigEndian, "\"0x%" PRIX32 "\"", "\"0x%" PRIX64 "\"");
+            fieldMetadata, fileBigEndian, PerfFieldFormatHex);
         break;
     case PerfFieldFormatUnsigned:
         AppendIntegerSampleFieldAsJsonImpl(sb, { fieldRawDataChars, fieldRawDataSize },
-            fieldMetadata, fileBigEndian, "%" PRIu32, "%" PRIu64);
+            fieldMetadata, fileBigEndian, PerfFieldFormatUnsigned);
         break;
     case PerfFieldFormatSigned:
         AppendIntegerSampleFieldAsJsonImpl(sb, { fieldRawDataChars, fieldRawDataSize },
-            fieldMetadata, fileBigEndian, "%" PRId32, "%" PRId64);
+            fieldMetadata, fileBigEndian, PerfFieldFormatSigned);
         break;
     case PerfFieldFormatString:
         AppendUcsVal<SwapNo>(sb,
@@ -2525,20 +3459,123 @@ AppendSampleFieldAsJsonImpl(
     }
 }
 
-int
-EventFormatter::AppendSampleAsJson(
-    std::string& dest,
+static void
+AppendSampleFieldAsJsonImpl(
+    StringBuilder& sb,
+    _In_reads_bytes_(fieldRawDataSize) void const* fieldRawData,
+    size_t fieldRawDataSize,
+    PerfFieldMetadata const& fieldMetadata,
+    bool fileBigEndian,
+    bool wantName)
+{
+    // Note: AppendSampleFieldValueAsJsonImpl expects 1 byte reserved for '['.
+    wantName
+        ? AppendJsonMemberBegin(sb, 0, fieldMetadata.Name(), 1)
+        : AppendJsonValueBegin(sb, 1);
+    AppendSampleFieldValueAsJsonImpl(sb, fieldRawData, fieldRawDataSize, fieldMetadata, fileBigEndian);
+}
+
+// Formats fields[firstField..lastField) as JSON members.
+// This is the hot path for non-eventheader tracepoints (e.g. sched_switch), so
+// it works directly from the values precomputed by PerfEventMetadata::Parse:
+// names are written without escaping and scalar integers are read in place
+// with the byte order fixed at compile time.
+template<bool ByteSwap>
+static void
+AppendSampleFieldsAsJsonImpl(
+    StringBuilder& sb,
+    PerfEventMetadata const& meta,
+    size_t firstField,
+    size_t lastField,
+    _In_reads_bytes_(rawDataSize) void const* rawData,
+    size_t rawDataSize,
+    bool fileBigEndian)
+{
+    PerfByteReaderT<ByteSwap> const byteReader;
+    auto const rawDataChars = static_cast<char const*>(rawData);
+    auto const fields = meta.Fields().data();
+
+    assert(firstField <= lastField);
+    assert(lastField <= meta.Fields().size());
+    for (size_t iField = firstField; iField != lastField; iField += 1)
+    {
+        auto const& fieldMeta = fields[iField];
+        auto const name = fieldMeta.Name();
+        auto const format = fieldMeta.Format();
+        auto const fieldSize = fieldMeta.Size();
+        auto const elementSize = fieldMeta.ElementSize();
+
+        // [, "name": ] + room for the largest scalar value ["0xFFFFFFFFFFFFFFFF"].
+        sb.EnsureRoom(6 + name.size() + 20);
+        sb.WriteJsonCommaSpaceAsNeeded();
+        sb.WriteUtf8ByteUnchecked('"');
+        sb.WriteUtf8Unchecked(name); // Always a C identifier, never needs escaping.
+        sb.WriteUtf8ByteUnchecked('"');
+        sb.WriteUtf8ByteUnchecked(':');
+        sb.WriteJsonSpaceIfWanted();
+
+        if (fieldMeta.Array() != PerfFieldArrayNone ||
+            format == PerfFieldFormatNone ||
+            format == PerfFieldFormatString ||
+            fieldSize < (1u << elementSize) ||
+            static_cast<size_t>(fieldMeta.Offset()) + fieldSize > rawDataSize)
+        {
+            // Uncommon case: use the general-purpose path.
+            auto const fieldData = fieldMeta.GetFieldBytes(rawData, rawDataSize, fileBigEndian);
+            AppendSampleFieldValueAsJsonImpl(sb, fieldData.data(), fieldData.size(), fieldMeta, fileBigEndian);
+            continue;
+        }
+
+        // Common case: scalar integer that is fully present. Room already reserved.
+        auto const pField = rawDataChars + fieldMeta.Offset();
+        switch (elementSize)
+        {
+        case PerfFieldElementSize8:
+            WriteIntegerSampleFieldValue(sb, 6, byteReader.ReadAsU8(pField), format);
+            break;
+        case PerfFieldElementSize16:
+            WriteIntegerSampleFieldValue(sb, 8, byteReader.ReadAsU16(pField), format);
+            break;
+        case PerfFieldElementSize32:
+            WriteIntegerSampleFieldValue(sb, 12, byteReader.ReadAsU32(pField), format);
+            break;
+        case PerfFieldElementSize64:
+            WriteIntegerSampleFieldValue(sb, 20, byteReader.ReadAsU64(pField), format);
+            break;
+        }
+    }
+}
+
+static void
+AppendSampleFieldsAsJsonImpl(
+    StringBuilder& sb,
+    PerfEventMetadata const& meta,
+    size_t firstField,
+    size_t lastField,
+    _In_reads_bytes_(rawDataSize) void const* rawData,
+    size_t rawDataSize,
+    bool fileBigEndian)
+{
+    PerfByteReader(fileBigEndian).ByteSwapNeeded()
+        ? AppendSampleFieldsAsJsonImpl<true>(sb, meta, firstField, lastField, rawData, rawDataSize, fileBigEndian)
+        : AppendSampleFieldsAsJsonImpl<false>(sb, meta, firstField, lastField, rawData, rawDataSize, fileBigEndian);
+}
+
+static int
+AppendSampleAsJsonImpl(
+    StringBuilder& sb,
     PerfSampleEventInfo const& sampleEventInfo,
     bool fileBigEndian,
     EventFormatterJsonFlags jsonFlags,
     EventFormatterMetaFlags metaFlags,
-    uint32_t moveNextLimit)
+    uint32_t moveNextLimit,
+    EventFormatterCache* cache)
 {
-    StringBuilder sb(dest, jsonFlags);
     int err = 0;
 
     EventEnumerator enumerator;
     EventInfo eventInfo;
+    MetaFragments fragments = {};
     bool eventInfoValid;
     std::string_view sampleEventName;
     std::string_view sampleProviderName;
@@ -2566,6 +3603,11 @@ EventFormatter::AppendSampleAsJson(
         eventInfo = enumerator.GetEventInfo();
         eventInfoValid = true;
 
+        if (metaFlags & EventFormatterMetaCache::FlagsMask)
+        {
+            fragments = EventFormatterMetaCache::Lookup(cache, eventInfo, jsonFlags, metaFlags);
+        }
+
         (jsonFlags & EventFormatterJsonFlags_Name)
             ? AppendJsonMemberBegin(sb, 0, eventInfo.Name, 1)
             : AppendJsonValueBegin(sb, 1);
@@ -2573,20 +3615,13 @@ EventFormatter::AppendSampleAsJson(
 
         if (metaFlags & EventFormatterMetaFlags_n)
         {
-            AppendMetaN(sb, eventInfo);
+            AppendMetaN(sb, eventInfo, fragments);
         }
 
         if (metaFlags & EventFormatterMetaFlags_common)
         {
-            for (size_t iField = 0; iField != meta.CommonFieldCount(); iField += 1)
-            {
-                auto const fieldMeta = meta.Fields()[iField];
-                auto const fieldData = fieldMeta.GetFieldBytes(
-                    sampleEventInfo.raw_data,
-                    sampleEventInfo.raw_data_size,
-                    fileBigEndian);
-                AppendSampleFieldAsJsonImpl(sb, fieldData.data(), fieldData.size(), fieldMeta, fileBigEndian, true);
-            }
+            AppendSampleFieldsAsJsonImpl(sb, meta, 0, meta.CommonFieldCount(),
+                sampleEventInfo.raw_data, sampleEventInfo.raw_data_size, fileBigEndian);
         }
 
         err = AppendItemAsJsonImpl(sb, enumerator, true);
@@ -2656,15 +3691,8 @@ EventFormatter::AppendSampleAsJson(
             size_t const firstField = (metaFlags & EventFormatterMetaFlags_common)
                 ? 0u
                 : meta.CommonFieldCount();
-            for (size_t iField = firstField; iField < meta.Fields().size(); iField += 1)
-            {
-                auto const fieldMeta = meta.Fields()[iField];
-                auto const fieldData = fieldMeta.GetFieldBytes(
-                    sampleEventInfo.raw_data,
-                    sampleEventInfo.raw_data_size,
-                    fileBigEndian);
-                AppendSampleFieldAsJsonImpl(sb, fieldData.data(), fieldData.size(), fieldMeta, fileBigEndian, true);
-            }
+            AppendSampleFieldsAsJsonImpl(sb, meta, firstField, meta.Fields().size(),
+                sampleEventInfo.raw_data, sampleEventInfo.raw_data_size, fileBigEndian);
         }
         else if (sampleEventInfoSampleType & PERF_SAMPLE_RAW)
         {
@@ -2682,20 +3710,7 @@ EventFormatter::AppendSampleAsJson(
 
         if ((metaFlags & EventFormatterMetaFlags_time) && (sampleEventInfoSampleType & PERF_SAMPLE_TIME))
         {
-            AppendJsonMemberBegin(sb, 0, "time"sv, 39); // "DATETIME.nnnnnnnnnZ" = 1 + 26 + 12
-            if (sampleEventInfo.session_info->ClockOffsetKnown())
-            {
-                auto timeSpec = sampleEventInfo.session_info->TimeToRealTime(sampleEventInfo.time);
-                sb.WriteUtf8ByteUnchecked('\"');
-                sb.WriteDateTime(timeSpec.tv_sec);
-                sb.WritePrintf(12, ".%09uZ\"", timeSpec.tv_nsec);
-            }
-            else
-            {
-                sb.WritePrintf(22, "%" PRIu64 ".%09u",
-                    sampleEventInfo.time / 1000000000,
-                    static_cast<unsigned>(sampleEventInfo.time % 1000000000));
-            }
+            AppendMetaTime(sb, cache, *sampleEventInfo.session_info, sampleEventInfo.time);
         }
 
         if ((metaFlags & EventFormatterMetaFlags_cpu) && (sampleEventInfoSampleType & PERF_SAMPLE_CPU))
@@ -2716,9 +3731,14 @@ EventFormatter::AppendSampleAsJson(
             sb.WriteNumber(10, sampleEventInfo.tid);
         }
 
+        if ((metaFlags & EventFormatterMetaFlags_callchain) && (sampleEventInfoSampleType & PERF_SAMPLE_CALLCHAIN))
+        {
+            AppendMetaCallchain(sb, sampleEventInfo.callchain, fileBigEndian);
+        }
+
         if (eventInfoValid)
         {
-            AppendMetaEventInfo(sb, metaFlags, eventInfo);
+            AppendMetaEventInfo(sb, metaFlags, eventInfo, fragments);
         }
         else
         {
@@ -2753,6 +3773,95 @@ EventFormatter::AppendSampleAsJson(
 
 Done:
 
+    return err;
+}
+
+EventFormatterCache::EventFormatterCache() noexcept
+    : m_timeCacheSec(0)
+    , m_timeCacheSize(0)
+{
+    for (auto& entry : m_metaCache)
+    {
+        entry.Flags = 0;
+    }
+}
+
+int
+EventFormatter::AppendLostAsJson(
+    std::string& dest,
+    PerfNonSampleEventInfo const& nonSampleEventInfo,
+    uint64_t lostCount,
+    EventFormatterJsonFlags jsonFlags,
+    EventFormatterMetaFlags metaFlags,
+    EventFormatterCache* cache)
+{
+    auto const recordName = nonSampleEventInfo.header->type == PERF_RECORD_LOST_SAMPLES
+        ? "PERF_RECORD_LOST_SAMPLES"sv
+        : "PERF_RECORD_LOST"sv;
+    auto const sampleType = nonSampleEventInfo.SampleType();
+    StringBuilder sb(dest, jsonFlags);
+
+    (jsonFlags & EventFormatterJsonFlags_Name)
+        ? AppendJsonMemberBegin(sb, 0, recordName, 1)
+        : AppendJsonValueBegin(sb, 1);
+    sb.WriteJsonStructBegin(); // top-level
+
+    if (metaFlags & EventFormatterMetaFlags_n)
+    {
+        AppendJsonMemberBegin(sb, 0, "n"sv, recordName.size() + 2);
+        sb.WriteUtf8ByteUnchecked('"');
+        sb.WriteUtf8Unchecked(recordName);
+        sb.WriteUtf8ByteUnchecked('"');
+    }
+
+    AppendJsonMemberBegin(sb, 0, "lost"sv, 20);
+    sb.WriteNumber(20, lostCount);
+
+    bool const wantTime = (metaFlags & EventFormatterMetaFlags_time) && (sampleType & PERF_SAMPLE_TIME);
+    bool const wantCpu = (metaFlags & EventFormatterMetaFlags_cpu) && (sampleType & PERF_SAMPLE_CPU);
+    if (wantTime || wantCpu)
+    {
+        AppendJsonMemberBegin(sb, 0, "meta"sv, 1);
+        sb.WriteJsonStructBegin(); // meta
+
+        if (wantTime)
+        {
+            AppendMetaTime(sb, cache, *nonSampleEventInfo.session_info, nonSampleEventInfo.time);
+        }
+
+        if (wantCpu)
+        {
+            AppendJsonMemberBegin(sb, 0, "cpu"sv, 10);
+            sb.WriteNumber(10, nonSampleEventInfo.cpu);
+        }
+
+        sb.EnsureRoom(4); // Room to end meta and top-level.
+        sb.WriteJsonSpaceIfWanted();
+        sb.WriteJsonStructEnd(); // meta
+    }
+    else
+    {
+        sb.EnsureRoom(2); // Room to end top-level.
+    }
+
+    sb.WriteJsonSpaceIfWanted();
+    sb.WriteJsonStructEnd(); // top-level
+    sb.Commit();
+    return 0;
+}
+
+int
+EventFormatter::AppendSampleAsJson(
+    std::string& dest,
+    PerfSampleEventInfo const& sampleEventInfo,
+    bool fileBigEndian,
+    EventFormatterJsonFlags jsonFlags,
+    EventFormatterMetaFlags metaFlags,
+    uint32_t moveNextLimit,
+    EventFormatterCache* cache)
+{
+    StringBuilder sb(dest, jsonFlags);
+    int const err = AppendSampleAsJsonImpl(sb, sampleEventInfo, fileBigEndian, jsonFlags, metaFlags, moveNextLimit, cache);
     if (err == 0)
     {
         sb.Commit();
@@ -2761,6 +3870,40 @@ Done:
     return err;
 }
 
+int
+EventFormatter::AppendSampleAsJson(
+    _Out_writes_to_(destSize, *pDestUsed) char* dest,
+    size_t destSize,
+    _Out_ size_t* pDestUsed,
+    PerfSampleEventInfo const& sampleEventInfo,
+    bool fileBigEndian,
+    EventFormatterJsonFlags jsonFlags,
+    EventFormatterMetaFlags metaFlags,
+    uint32_t moveNextLimit,
+    EventFormatterCache* cache) noexcept
+{
+    int err;
+    size_t destUsed = 0;
+
+    try
+    {
+        StringBuilder sb(dest, destSize, jsonFlags);
+        err = AppendSampleAsJsonImpl(sb, sampleEventInfo, fileBigEndian, jsonFlags, metaFlags, moveNextLimit, cache);
+        if (err == 0)
+        {
+            sb.Commit();
+            destUsed = sb.CommitSize();
+        }
+    }
+    catch (StringBuilderFull const&)
+    {
+        err = ENOBUFS;
+    }
+
+    *pDestUsed = destUsed;
+    return err;
+}
+
 int
 EventFormatter::AppendSampleFieldAsJson(
     std::string& dest,
@@ -2777,17 +3920,20 @@ EventFormatter::AppendSampleFieldAsJson(
     return 0;
 }
 
-int
-EventFormatter::AppendEventAsJsonAndMoveToEnd(
-    std::string& dest,
+static int
+AppendEventAsJsonAndMoveToEndImpl(
+    StringBuilder& sb,
     EventEnumerator& enumerator,
     EventFormatterJsonFlags jsonFlags,
-    EventFormatterMetaFlags metaFlags)
+    EventFormatterMetaFlags metaFlags,
+    EventFormatterCache* cache)
 {
     assert(EventEnumeratorState_BeforeFirstItem == enumerator.State());
 
-    StringBuilder sb(dest, jsonFlags);
     auto const ei = enumerator.GetEventInfo();
+    auto const fragments = (metaFlags & EventFormatterMetaCache::FlagsMask)
+        ? EventFormatterMetaCache::Lookup(cache, ei, jsonFlags, metaFlags)
+        : MetaFragments();
 
     int err;
 
@@ -2798,7 +3944,7 @@ EventFormatter::AppendEventAsJsonAndMoveToEnd(
 
     if (metaFlags & EventFormatterMetaFlags_n)
     {
-        AppendMetaN(sb, ei);
+        AppendMetaN(sb, ei, fragments);
     }
 
     err = AppendItemAsJsonImpl(sb, enumerator, true);
@@ -2809,7 +3955,7 @@ EventFormatter::AppendEventAsJsonAndMoveToEnd(
             AppendJsonMemberBegin(sb, 0, "meta"sv, 1);
             sb.WriteJsonStructBegin(); // meta.
 
-            AppendMetaEventInfo(sb, metaFlags, ei);
+            AppendMetaEventInfo(sb, metaFlags, ei, fragments);
 
             sb.EnsureRoom(4); // Room to end meta and top-level.
             sb.WriteJsonSpaceIfWanted();
@@ -2824,6 +3970,19 @@ EventFormatter::AppendEventAsJsonAndMoveToEnd(
         sb.WriteJsonStructEnd(); // top-level
     }
 
+    return err;
+}
+
+int
+EventFormatter::AppendEventAsJsonAndMoveToEnd(
+    std::string& dest,
+    EventEnumerator& enumerator,
+    EventFormatterJsonFlags jsonFlags,
+    EventFormatterMetaFlags metaFlags,
+    EventFormatterCache* cache)
+{
+    StringBuilder sb(dest, jsonFlags);
+    int const err = AppendEventAsJsonAndMoveToEndImpl(sb, enumerator, jsonFlags, metaFlags, cache);
     if (err == 0)
     {
         sb.Commit();
@@ -2832,6 +3991,38 @@ EventFormatter::AppendEventAsJsonAndMoveToEnd(
     return err;
 }
 
+int
+EventFormatter::AppendEventAsJsonAndMoveToEnd(
+    _Out_writes_to_(destSize, *pDestUsed) char* dest,
+    size_t destSize,
+    _Out_ size_t* pDestUsed,
+    EventEnumerator& enumerator,
+    EventFormatterJsonFlags jsonFlags,
+    EventFormatterMetaFlags metaFlags,
+    EventFormatterCache* cache) noexcept
+{
+    int err;
+    size_t destUsed = 0;
+
+    try
+    {
+        StringBuilder sb(dest, destSize, jsonFlags);
+        err = AppendEventAsJsonAndMoveToEndImpl(sb, enumerator, jsonFlags, metaFlags, cache);
+        if (err == 0)
+        {
+            sb.Commit();
+            destUsed = sb.CommitSize();
+        }
+    }
+    catch (StringBuilderFull const&)
+    {
+        err = ENOBUFS;
+    }
+
+    *pDestUsed = destUsed;
+    return err;
+}
+
 int
 EventFormatter::AppendItemAsJsonAndMoveNextSibling(
     std::string& dest,
@@ -0,0 +1,255 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <eventheader/EventShapeCache.h>
+#include <assert.h>
+#include <string.h>
+#include <utility>
+
+using namespace eventheader_decode;
+
+EventShapeCache::EventShapeCache() noexcept = default;
+
+void
+EventShapeCache::Clear() noexcept
+{
+    m_shapes.clear();
+}
+
+size_t
+EventShapeCache::ShapeCount() const noexcept
+{
+    return m_shapes.size();
+}
+
+EventShapeCache::Shape const*
+EventShapeCache::GetShape(EventEnumerator& e, uint32_t moveNextLimit)
+{
+    auto const meta = e.m_metaBuf;
+    auto const metaSize = e.m_metaEnd;
+    uint8_t const swapByte = e.m_needByteSwap;
+    auto const hash = Hash(&swapByte, 1, Hash(meta, metaSize));
+
+    auto const range = m_shapes.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        auto const& key = it->second.Key;
+        if (key.size() == metaSize + 1u &&
+            key[metaSize] == swapByte &&
+            0 == memcmp(key.data(), meta, metaSize))
+        {
+            return &it->second;
+        }
+    }
+
+    Shape shape;
+    if (!BuildShape(shape, e, moveNextLimit))
+    {
+        // Not cached, so a later event with the same metadata tries again.
+        return nullptr;
+    }
+
+    shape.Key.reserve(metaSize + 1u);
+    shape.Key.assign(meta, meta + metaSize);
+    shape.Key.push_back(swapByte);
+    return &m_shapes.emplace(hash, std::move(shape))->second;
+}
+
+/*
+Enumerates the event, recording each field that FindField can find. Does not
+enter arrays (FindField does not search them).
+*/
+bool
+EventShapeCache::BuildShape(Shape& shape, EventEnumerator& e, uint32_t moveNextLimit)
+{
+    struct Level
+    {
+        size_t PathSize; // Size of the struct's path (prefix of the children's paths).
+        uint32_t FieldIndex; // Index of the struct's field, or NoIndex.
+        bool Indexed; // False if FindField cannot reach the struct's children.
+    };
+
+    Level levels[sizeof(e.m_stack) / sizeof(e.m_stack[0]) + 1];
+    unsigned depth = 0;
+    levels[0] = { 0, NoIndex, true };
+
+    std::string path;
+    bool fixed = true; // True while all fields so far have a fixed size.
+
+    e.ResetImpl(moveNextLimit);
+    bool movedToItem = e.MoveNext();
+    while (movedToItem)
+    {
+        auto const state = e.m_state;
+        if (state == EventEnumeratorState_StructEnd)
+        {
+            assert(depth != 0);
+            depth -= 1;
+            movedToItem = e.MoveNext();
+            continue;
+        }
+
+        auto const& top = e.m_stackTop;
+        auto const name = reinterpret_cast<char const*>(e.m_metaBuf + top.NameOffset);
+        auto const nameEnd = static_cast<char const*>(memchr(name, ';', top.NameSize));
+        size_t const nameSize = nameEnd ? static_cast<size_t>(nameEnd - name) : top.NameSize;
+        auto const& level = levels[depth];
+
+        // FindField splits the path at '.', so it never matches a name containing '.'.
+        bool indexed = level.Indexed && nullptr == memchr(name, '.', nameSize);
+        uint32_t fieldIndex = NoIndex;
+        if (indexed)
+        {
+            path.resize(level.PathSize);
+            if (depth != 0)
+            {
+                path += '.';
+            }
+
+            path.append(name, nameSize);
+
+            if (NoIndex != FindPath(shape, path.c_str()))
+            {
+                // FindField stops at the first field with this path.
+                indexed = false;
+            }
+            else
+            {
+                fieldIndex = static_cast<uint32_t>(shape.Fields.size());
+
+                shape.FieldsByPathHash.emplace(Hash(path.data(), path.size()), fieldIndex);
+
+                ShapeField field;
+                field.Entry = top;
+                field.DataOffset = !fixed
+                    ? VariableOffset
+                    : top.ArrayFlags == event_field_encoding_varray_flag
+                    ? e.m_dataPosRaw - 2 // NextProperty has consumed the array length.
+                    : e.m_dataPosRaw;
+                field.ParentIndex = level.FieldIndex;
+                field.Path = path;
+                shape.Fields.push_back(std::move(field));
+            }
+        }
+
+        switch (state)
+        {
+        case EventEnumeratorState_StructBegin:
+            depth += 1;
+            levels[depth] = { path.size(), fieldIndex, indexed };
+            movedToItem = e.MoveNext();
+            break;
+
+        case EventEnumeratorState_ArrayBegin:
+            if (top.ArrayFlags == event_field_encoding_varray_flag || e.m_elementSize == 0)
+            {
+                fixed = false; // Variable length or variable-size elements.
+            }
+
+            movedToItem = e.MoveNextSibling();
+            break;
+
+        default:
+            assert(state == EventEnumeratorState_Value);
+            if (e.m_elementSize == 0)
+            {
+                fixed = false; // String.
+            }
+
+            movedToItem = e.MoveNext();
+            break;
+        }
+    }
+
+    return e.m_state == EventEnumeratorState_AfterLastItem;
+}
+
+uint32_t
+EventShapeCache::FindPath(Shape const& shape, char const* path) noexcept
+{
+    auto const range = shape.FieldsByPathHash.equal_range(Hash(path, strlen(path)));
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (shape.Fields[it->second].Path == path)
+        {
+            return it->second;
+        }
+    }
+
+    return NoIndex;
+}
+
+uint64_t
+EventShapeCache::Hash(void const* data, size_t size, uint64_t hash) noexcept
+{
+    // FNV-1a.
+    auto const bytes = static_cast<uint8_t const*>(data);
+    for (size_t i = 0; i != size; i += 1)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+bool
+EventEnumerator::FindField(
+    EventShapeCache& cache,
+    _In_z_ char const* path,
+    uint32_t moveNextLimit)
+{
+    assert(m_state != EventEnumeratorState_None); // PRECONDITION
+
+    if (m_state == EventEnumeratorState_None)
+    {
+        m_lastError = EventEnumeratorError_InvalidState;
+        return false;
+    }
+
+    auto const shape = cache.GetShape(*this, moveNextLimit);
+    if (shape == nullptr)
+    {
+        return FindField(path, moveNextLimit);
+    }
+
+    auto const fieldIndex = EventShapeCache::FindPath(*shape, path);
+    if (fieldIndex == EventShapeCache::NoIndex)
+    {
+        ResetImpl(moveNextLimit);
+        SetEndState(EventEnumeratorState_AfterLastItem, SubState_AfterLastItem);
+        return false;
+    }
+
+    auto const& field = shape->Fields[fieldIndex];
+    if (field.DataOffset == EventShapeCache::VariableOffset)
+    {
+        return FindField(path, moveNextLimit);
+    }
+
+    ResetImpl(moveNextLimit);
+    if (field.DataOffset > m_dataEnd)
+    {
+        return SetErrorState(EventEnumeratorError_InvalidData);
+    }
+
+    // Restore the stack of enclosing structs (outermost at m_stack[0]), then
+    // decode the field as NextProperty would have during the walk.
+    uint8_t depth = 0;
+    for (auto i = field.ParentIndex; i != EventShapeCache::NoIndex; i = shape->Fields[i].ParentIndex)
+    {
+        depth += 1;
+    }
+
+    m_stackIndex = depth;
+    for (auto i = field.ParentIndex; i != EventShapeCache::NoIndex; i = shape->Fields[i].ParentIndex)
+    {
+        depth -= 1;
+        m_stack[depth] = shape->Fields[i].Entry;
+    }
+
+    m_stackTop = field.Entry;
+    m_stackTop.NextOffset = field.Entry.NameOffset;
+    m_stackTop.RemainingFieldCount += 1;
+    m_dataPosRaw = field.DataOffset;
+    return NextProperty();
+}
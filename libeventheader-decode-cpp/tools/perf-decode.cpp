@@ -2,13 +2,24 @@
 // Licensed under the MIT License.
 
 #include <tracepoint/PerfEventInfo.h>
+#include <tracepoint/PerfCallchainTable.h>
 #include <tracepoint/PerfDataFile.h>
 #include <tracepoint/PerfEventAbi.h>
+#include <tracepoint/PerfEventFilter.h>
+#include <eventheader/EventColumnarWriter.h>
 #include <eventheader/EventFormatter.h>
 
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #ifdef _WIN32
@@ -41,13 +52,74 @@ Try ")" PROGRAM_NAME R"( --help" for more information.
 
 // -h or --help: stdout += UsageCommon + UsageLong.
 static char const* const UsageLong = R"(
-Converts perf.data files to JSON.
+Converts perf.data files to JSON. Events are written in timestamp order. Output
+is streamed: an event is written as soon as the FINISHED_ROUND records in the
+file guarantee that no older event can follow it. Use "-" as a filename to read
+a pipe-format stream from stdin, e.g. "perf-collect -o - ... | perf-decode -".
 
 Options:
 
 -o, --output <file> Set the output filename. The default is stdout.
 
+-f, --format <fmt>  Set the output format:
+                    json: JSON text (default).
+                    columnar: binary batches of typed columns, one batch per
+                    event schema, as described in EventColumnarWriter.h.
+                    Events are written in file order (use the "time" column
+                    to sort). Files are decoded one at a time (--jobs is
+                    ignored).
+
+-j, --jobs <count>  Use up to <count> threads. The default is 1. Output is the
+                    same as with 1 job. With multiple input files, decode up
+                    to <count> files concurrently: each file's events are
+                    decoded into a temporary file, and the temporary files are
+                    copied to the output in the order the input files were
+                    specified. With one input file, split the file into
+                    chunks at FINISHED_ROUND records and format the chunks
+                    concurrently (normal-mode, uncompressed files only).
+
 -h, --help          Show this help message and exit.
+
+Filter options (checked before an event is decoded; lost-event records are
+always written):
+
+-e, --event <glob>  Only decode events whose full name matches <glob>, e.g.
+                    "user_events:MyProvider_*" or "sched:*". '*' matches any
+                    run of chars and '?' matches any one char. May be repeated
+                    (an event matches if it matches any of the globs).
+
+-p, --provider <glob> Only decode events whose provider name matches <glob>.
+                    For EventHeader events the provider name is the part of
+                    the event name before the "_L<level>K<keyword>" suffix.
+                    For other events it is the system name (e.g. "sched").
+                    May be repeated.
+
+--level <max>       Only decode EventHeader events with level <= <max>, e.g.
+                    4 to skip verbose (5) events.
+
+--keyword <mask>    Only decode EventHeader events whose keyword has any of
+                    the bits in <mask> set, e.g. 0x3.
+
+--keyword-all <mask> Only decode EventHeader events whose keyword has all of
+                    the bits in <mask> set.
+
+--pid <pid>         Only decode events from the specified process. May be
+                    repeated.
+
+--tid <tid>         Only decode events from the specified thread. May be
+                    repeated.
+
+--time-min <ns>     Only decode events with timestamp >= <ns>, using the raw
+                    session timestamp (not the wall-clock time in the output).
+
+--time-max <ns>     Only decode events with timestamp <= <ns>.
+
+Callchain options:
+
+--callchain         Include the sample stack (PERF_SAMPLE_CALLCHAIN) in each
+                    event's meta as "callchain". If "<file>.stacks" exists
+                    (written by "perf-filter --dedup-callchains"), stack
+                    references in the file are expanded using it.
 )";
 
 struct fclose_deleter
@@ -61,23 +133,951 @@ struct fclose_deleter
     }
 };
 
+using EventMap = std::multimap<uint64_t, std::string>;
+
+// Writes and removes the events with time <= maxTime. The removed nodes are
+// saved in freeNodes so they (and their string buffers) can be reused.
 static bool
 FlushEvents(
     FILE* output,
-    std::multimap<uint64_t, std::string>& events,
-    bool comma) noexcept
+    EventMap& events,
+    std::vector<EventMap::node_type>& freeNodes,
+    uint64_t maxTime,
+    bool comma)
 {
-    for (auto const& pair : events)
+    while (!events.empty() && events.begin()->first <= maxTime)
     {
+        auto node = events.extract(events.begin());
         fputs(comma ? ",\n " : "\n ", output);
         comma = true;
-        fputs(pair.second.c_str(), output);
+        fputs(node.mapped().c_str(), output);
+        freeNodes.push_back(std::move(node));
     }
 
-    events.clear();
     return comma;
 }
 
+// Output of DecodeChunk: the records of one chunk, in file order.
+struct ChunkRecord
+{
+    enum Kind : uint8_t
+    {
+        Sample,     // Formatted sample event.
+        Lost,       // Formatted lost-events record.
+        TimeOnly,   // Max time of samples that were not formatted (filtered).
+        Round,      // PERF_RECORD_FINISHED_ROUND.
+    };
+
+    uint64_t time;
+    Kind kind;
+    std::string json;
+};
+
+// Decodes perf.data files. Holds the state that is reused from file to file.
+struct Decoder
+{
+    std::string filenameJson;
+    EventMap events;
+    std::vector<EventMap::node_type> freeNodes;
+    EventFormatter formatter;
+    EventFormatterCache formatterCache;
+    PerfDataFile file;
+    PerfEventFilter filter;
+    PerfCallchainTable stacks;
+    EventFormatterMetaFlags metaFlags;
+    bool callchains;
+
+    Decoder(PerfEventFilter const& filter, bool callchains)
+        : filter(filter)
+        , metaFlags(static_cast<EventFormatterMetaFlags>(callchains
+            ? EventFormatterMetaFlags_Default | EventFormatterMetaFlags_callchain
+            : EventFormatterMetaFlags_Default))
+        , callchains(callchains)
+    {
+        return;
+    }
+
+    // If callchains are wanted, loads "<inputName>.stacks" (if present) and
+    // uses it to expand the stack references in the file's samples.
+    // inputName == "" means stdin (no stacks file).
+    void
+    LoadStacks(char const* inputName)
+    {
+        if (!callchains || inputName[0] == '\0')
+        {
+            return;
+        }
+
+        auto const err = stacks.Load((std::string(inputName) + ".stacks").c_str());
+        if (err != 0 && err != ENOENT)
+        {
+            char errBuf[80];
+            fprintf(stderr, "\n- Load(\"%s.stacks\") error %d: \"%s\"\n",
+                inputName,
+                err,
+                strerror_r(err, errBuf, sizeof(errBuf)));
+        }
+
+        file.SetCallchainTable(err == 0 ? &stacks : nullptr);
+    }
+
+    // Writes the JSON section for the specified input file, i.e.
+    // `"filename": [ events... ]`, preceded by ",\n" if not first.
+    // inputName == "" means stdin.
+    void
+    DecodeFile(FILE* output, char const* inputName, bool first)
+    {
+        bool const isStdin = inputName[0] == '\0';
+        char const* const filename = isStdin ? "stdin" : inputName;
+
+        filenameJson.clear();
+        formatter.AppendValueAsJson(
+            filenameJson,
+            filename,
+            static_cast<unsigned>(strlen(filename)),
+            event_field_encoding_zstring_char8,
+            event_field_format_default, false);
+
+        fprintf(output, "%s%s: [",
+            first ? "" : ",\n",
+            filenameJson.c_str());
+        bool comma = false;
+
+        // Events are returned out-of-order and need to be sorted. Events that
+        // arrive after a FINISHED_ROUND may be older than events from the
+        // round before it, but not older than any event from two rounds ago.
+        // At each FINISHED_ROUND, write the events that are no newer than the
+        // newest event seen before the previous FINISHED_ROUND. This keeps
+        // memory bounded by the size of two rounds.
+        uint64_t roundFlushTime = 0;
+        uint64_t maxTimeSeen = 0;
+
+        LoadStacks(inputName);
+
+        // CodeQL [SM01937] Users should be able to specify the output file path.
+        auto err = isStdin ? file.OpenStdin() : file.OpenMapped(filename);
+        if (err != 0)
+        {
+            char errBuf[80];
+            fprintf(stderr, "\n- Open(\"%s\") error %d: \"%s\"\n",
+                filename,
+                err,
+                strerror_r(err, errBuf, sizeof(errBuf)));
+        }
+        else for (filter.ClearCache();;)
+        {
+            perf_event_header const* pHeader;
+            err = file.ReadEvent(&pHeader);
+            if (!pHeader)
+            {
+                if (err)
+                {
+                    fprintf(stderr, "\n- ReadEvent error %d.\n", err);
+                }
+                break;
+            }
+
+            if (pHeader->type != PERF_RECORD_SAMPLE)
+            {
+                if (pHeader->type == PERF_RECORD_FINISHED_ROUND)
+                {
+                    comma = FlushEvents(output, events, freeNodes, roundFlushTime, comma);
+                    roundFlushTime = maxTimeSeen;
+                }
+                else if (pHeader->type == PERF_RECORD_LOST ||
+                    pHeader->type == PERF_RECORD_LOST_SAMPLES)
+                {
+                    DecodeLost(pHeader);
+                }
+
+                continue; // Otherwise only interested in sample events for now.
+            }
+
+            PerfSampleEventInfo sampleEventInfo;
+            err = file.GetSampleEventInfo(pHeader, &sampleEventInfo);
+            if (err)
+            {
+                fprintf(stderr, "\n- GetSampleEventInfo error %d.\n", err);
+                continue;
+            }
+
+            auto const time = (sampleEventInfo.SampleType() & PERF_SAMPLE_TIME)
+                ? sampleEventInfo.time
+                : 0u;
+            if (time > maxTimeSeen)
+            {
+                maxTimeSeen = time;
+            }
+
+            if (!filter.Matches(sampleEventInfo))
+            {
+                continue;
+            }
+
+            EventMap::iterator it;
+            if (freeNodes.empty())
+            {
+                it = events.emplace(time, std::string());
+            }
+            else
+            {
+                auto node = std::move(freeNodes.back());
+                freeNodes.pop_back();
+                node.key() = time;
+                node.mapped().clear();
+                it = events.insert(std::move(node));
+            }
+
+            err = formatter.AppendSampleAsJson(
+                it->second,
+                sampleEventInfo,
+                file.FileBigEndian(),
+                static_cast<EventFormatterJsonFlags>(
+                    EventFormatterJsonFlags_Space |
+                    EventFormatterJsonFlags_FieldTag),
+                metaFlags,
+                4096,
+                &formatterCache);
+            if (err)
+            {
+                fprintf(stderr, "\n- Format error %d.\n", err);
+            }
+        }
+
+        FlushEvents(output, events, freeNodes, UINT64_MAX, comma);
+
+        fputs(" ]", output);
+    }
+
+    // Same output as DecodeFile, but the file is split into chunks that are
+    // formatted by up to jobs threads. The formatted chunks are then replayed in
+    // file order through the same sorting logic that DecodeFile uses.
+    // Returns false without writing anything if the file cannot be decoded in
+    // chunks (stdin, not mapped, compressed, or open error), in which case the
+    // caller should use DecodeFile.
+    bool
+    DecodeFileChunked(FILE* output, char const* inputName, bool first, unsigned jobs)
+    {
+        if (inputName[0] == '\0' || jobs <= 1)
+        {
+            return false;
+        }
+
+        // CodeQL [SM01937] Users should be able to specify the output file path.
+        if (0 != file.OpenMapped(inputName) || !file.Mapped())
+        {
+            return false;
+        }
+
+        LoadStacks(inputName);
+
+        uint64_t const ChunkSizeMin = 0x100000;
+        uint64_t const ChunkSizeMax = 0x4000000;
+        auto const dataSize = file.DataEndFilePos() - file.DataBeginFilePos();
+        auto const chunkSize = std::clamp<uint64_t>(dataSize / (jobs * 4u), ChunkSizeMin, ChunkSizeMax);
+        std::vector<PerfDataFileChunk> chunks;
+        if (0 != file.GetDataChunks(chunkSize, &chunks))
+        {
+            return false;
+        }
+
+        filenameJson.clear();
+        formatter.AppendValueAsJson(
+            filenameJson,
+            inputName,
+            static_cast<unsigned>(strlen(inputName)),
+            event_field_encoding_zstring_char8,
+            event_field_format_default, false);
+
+        fprintf(output, "%s%s: [",
+            first ? "" : ",\n",
+            filenameJson.c_str());
+        bool comma = false;
+        uint64_t roundFlushTime = 0;
+        uint64_t maxTimeSeen = 0;
+
+        struct ChunkResult
+        {
+            std::vector<ChunkRecord> records;
+            std::exception_ptr exception;
+            bool done = false;
+        };
+
+        auto const chunkCount = chunks.size();
+        auto const inFlightMax = static_cast<size_t>(jobs) * 2u; // Bounds memory use.
+        std::vector<ChunkResult> results(chunkCount);
+        std::vector<std::thread> threads;
+        std::atomic<size_t> nextChunk(0);
+        size_t consumedCount = 0; // Protected by mutex.
+        bool stopping = false; // Protected by mutex.
+        std::mutex mutex;
+        std::condition_variable chunkDone;
+        std::condition_variable chunkConsumed;
+
+        auto const threadProc = [&]() noexcept
+            {
+                std::unique_ptr<EventFormatterCache> chunkCache;
+                std::unique_ptr<PerfEventFilter> chunkFilter;
+                PerfDataFileChunkReader reader;
+                for (;;)
+                {
+                    auto const i = nextChunk.fetch_add(1, std::memory_order_relaxed);
+                    if (i >= chunkCount)
+                    {
+                        break;
+                    }
+
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        chunkConsumed.wait(lock, [&]() { return stopping || i < consumedCount + inFlightMax; });
+                        if (stopping)
+                        {
+                            break;
+                        }
+                    }
+
+                    std::vector<ChunkRecord> records;
+                    std::exception_ptr exception;
+                    try
+                    {
+                        if (!chunkCache)
+                        {
+                            chunkCache = std::make_unique<EventFormatterCache>();
+                            chunkFilter = std::make_unique<PerfEventFilter>(filter);
+                        }
+
+                        reader.Reset(file, chunks[i]);
+                        DecodeChunk(reader, *chunkCache, *chunkFilter, records);
+                    }
+                    catch (...)
+                    {
+                        exception = std::current_exception();
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    results[i].records = std::move(records);
+                    results[i].exception = std::move(exception);
+                    results[i].done = true;
+                    chunkDone.notify_all();
+                }
+            };
+
+        std::exception_ptr exception;
+        try
+        {
+            auto const threadCount = jobs < chunkCount ? jobs : static_cast<unsigned>(chunkCount);
+            threads.reserve(threadCount);
+            for (unsigned i = 0; i != threadCount; i += 1)
+            {
+                threads.emplace_back(threadProc);
+            }
+
+            for (size_t i = 0; i != chunkCount; i += 1)
+            {
+                auto& result = results[i];
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    chunkDone.wait(lock, [&result]() { return result.done; });
+                }
+
+                if (result.exception)
+                {
+                    std::rethrow_exception(result.exception);
+                }
+
+                for (auto& record : result.records)
+                {
+                    switch (record.kind)
+                    {
+                    case ChunkRecord::Round:
+                        comma = FlushEvents(output, events, freeNodes, roundFlushTime, comma);
+                        roundFlushTime = maxTimeSeen;
+                        break;
+                    case ChunkRecord::TimeOnly:
+                        if (record.time > maxTimeSeen)
+                        {
+                            maxTimeSeen = record.time;
+                        }
+                        break;
+                    case ChunkRecord::Sample:
+                        if (record.time > maxTimeSeen)
+                        {
+                            maxTimeSeen = record.time;
+                        }
+
+                        if (freeNodes.empty())
+                        {
+                            events.emplace(record.time, std::move(record.json));
+                        }
+                        else
+                        {
+                            auto node = std::move(freeNodes.back());
+                            freeNodes.pop_back();
+                            node.key() = record.time;
+                            node.mapped().swap(record.json);
+                            events.insert(std::move(node));
+                        }
+                        break;
+                    case ChunkRecord::Lost:
+                        events.emplace(record.time, std::move(record.json));
+                        break;
+                    }
+                }
+
+                std::vector<ChunkRecord>().swap(result.records); // Free memory.
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    consumedCount = i + 1;
+                }
+                chunkConsumed.notify_all();
+            }
+        }
+        catch (...)
+        {
+            exception = std::current_exception();
+            nextChunk.store(chunkCount, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            chunkConsumed.notify_all();
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+
+        FlushEvents(output, events, freeNodes, UINT64_MAX, comma);
+
+        fputs(" ]", output);
+        return true;
+    }
+
+private:
+
+    // Formats the events of one chunk (runs on a worker thread). Uses only
+    // const methods of file.
+    void
+    DecodeChunk(
+        PerfDataFileChunkReader& reader,
+        EventFormatterCache& chunkCache,
+        PerfEventFilter& chunkFilter,
+        std::vector<ChunkRecord>& records) const
+    {
+        EventFormatter chunkFormatter;
+        auto const jsonFlags = static_cast<EventFormatterJsonFlags>(
+            EventFormatterJsonFlags_Space |
+            EventFormatterJsonFlags_FieldTag);
+        uint64_t filteredMaxTime = 0;
+        bool haveFiltered = false;
+
+        for (;;)
+        {
+            perf_event_header const* pHeader;
+            auto err = reader.ReadEvent(&pHeader);
+            if (!pHeader)
+            {
+                if (err)
+                {
+                    fprintf(stderr, "\n- ReadEvent error %d.\n", err);
+                }
+                break;
+            }
+
+            if (pHeader->type != PERF_RECORD_SAMPLE)
+            {
+                if (pHeader->type == PERF_RECORD_FINISHED_ROUND)
+                {
+                    if (haveFiltered)
+                    {
+                        records.push_back({ filteredMaxTime, ChunkRecord::TimeOnly, {} });
+                        filteredMaxTime = 0;
+                        haveFiltered = false;
+                    }
+
+                    records.push_back({ 0, ChunkRecord::Round, {} });
+                }
+                else if (pHeader->type == PERF_RECORD_LOST ||
+                    pHeader->type == PERF_RECORD_LOST_SAMPLES)
+                {
+                    uint64_t time;
+                    std::string json;
+                    if (FormatLost(chunkCache, pHeader, &time, json))
+                    {
+                        records.push_back({ time, ChunkRecord::Lost, std::move(json) });
+                    }
+                }
+
+                continue;
+            }
+
+            PerfSampleEventInfo sampleEventInfo;
+            err = file.GetSampleEventInfo(pHeader, &sampleEventInfo);
+            if (err)
+            {
+                fprintf(stderr, "\n- GetSampleEventInfo error %d.\n", err);
+                continue;
+            }
+
+            auto const time = (sampleEventInfo.SampleType() & PERF_SAMPLE_TIME)
+                ? sampleEventInfo.time
+                : 0u;
+
+            if (!chunkFilter.Matches(sampleEventInfo))
+            {
+                filteredMaxTime = std::max(filteredMaxTime, time);
+                haveFiltered = true;
+                continue;
+            }
+
+            records.push_back({ time, ChunkRecord::Sample, {} });
+            err = chunkFormatter.AppendSampleAsJson(
+                records.back().json,
+                sampleEventInfo,
+                file.FileBigEndian(),
+                jsonFlags,
+                metaFlags,
+                4096,
+                &chunkCache);
+            if (err)
+            {
+                fprintf(stderr, "\n- Format error %d.\n", err);
+            }
+        }
+
+        if (haveFiltered)
+        {
+            records.push_back({ filteredMaxTime, ChunkRecord::TimeOnly, {} });
+        }
+    }
+
+    // Formats a PERF_RECORD_LOST or PERF_RECORD_LOST_SAMPLES record. Returns
+    // false if the record should not be added to the output.
+    bool
+    FormatLost(
+        EventFormatterCache& lostCache,
+        perf_event_header const* pHeader,
+        uint64_t* pTime,
+        std::string& json) const
+    {
+        uint64_t lostCount;
+        auto err = file.GetLostEventCount(pHeader, &lostCount);
+        if (err)
+        {
+            fprintf(stderr, "\n- GetLostEventCount error %d.\n", err);
+            return false;
+        }
+
+        PerfNonSampleEventInfo nonSampleEventInfo;
+        err = file.GetNonSampleEventInfo(pHeader, &nonSampleEventInfo);
+        if (err)
+        {
+            // No sample_id suffix, so we don't know when the events were lost.
+            fprintf(stderr, "\n- %llu events lost (no timestamp).\n",
+                static_cast<unsigned long long>(lostCount));
+            return false;
+        }
+
+        *pTime = (nonSampleEventInfo.SampleType() & PERF_SAMPLE_TIME)
+            ? nonSampleEventInfo.time
+            : 0u;
+        err = EventFormatter().AppendLostAsJson(
+            json,
+            nonSampleEventInfo,
+            lostCount,
+            static_cast<EventFormatterJsonFlags>(
+                EventFormatterJsonFlags_Space |
+                EventFormatterJsonFlags_FieldTag),
+            EventFormatterMetaFlags_Default,
+            &lostCache);
+        if (err)
+        {
+            fprintf(stderr, "\n- Format error %d.\n", err);
+        }
+
+        return true;
+    }
+
+    // Adds a PERF_RECORD_LOST or PERF_RECORD_LOST_SAMPLES record to events so
+    // that gaps in the trace show up in the output.
+    void
+    DecodeLost(perf_event_header const* pHeader)
+    {
+        uint64_t time;
+        std::string json;
+        if (FormatLost(formatterCache, pHeader, &time, json))
+        {
+            events.emplace(time, std::move(json));
+        }
+    }
+};
+
+// Writes the samples from each input file to a columnar writer.
+struct ColumnarDecoder
+{
+    std::string buffer;
+    EventColumnarWriter writer;
+    PerfDataFile file;
+    PerfEventFilter filter;
+
+    explicit
+    ColumnarDecoder(PerfEventFilter const& filter)
+        : filter(filter)
+    {
+        return;
+    }
+
+    // Writes buffer to output and clears it.
+    void
+    WriteBuffer(FILE* output) noexcept
+    {
+        fwrite(buffer.data(), 1, buffer.size(), output);
+        buffer.clear();
+    }
+
+    // inputName == "" means stdin.
+    void
+    DecodeFile(FILE* output, char const* inputName)
+    {
+        bool const isStdin = inputName[0] == '\0';
+        char const* const filename = isStdin ? "stdin" : inputName;
+
+        // CodeQL [SM01937] Users should be able to specify the output file path.
+        auto err = isStdin ? file.OpenStdin() : file.OpenMapped(filename);
+        if (err != 0)
+        {
+            char errBuf[80];
+            fprintf(stderr, "\n- Open(\"%s\") error %d: \"%s\"\n",
+                filename,
+                err,
+                strerror_r(err, errBuf, sizeof(errBuf)));
+            return;
+        }
+
+        filter.ClearCache();
+        for (;;)
+        {
+            perf_event_header const* pHeader;
+            err = file.ReadEvent(&pHeader);
+            if (!pHeader)
+            {
+                if (err)
+                {
+                    fprintf(stderr, "\n- ReadEvent error %d.\n", err);
+                }
+                break;
+            }
+
+            if (pHeader->type != PERF_RECORD_SAMPLE)
+            {
+                continue;
+            }
+
+            PerfSampleEventInfo sampleEventInfo;
+            err = file.GetSampleEventInfo(pHeader, &sampleEventInfo);
+            if (err)
+            {
+                fprintf(stderr, "\n- GetSampleEventInfo error %d.\n", err);
+                continue;
+            }
+
+            if (!filter.Matches(sampleEventInfo))
+            {
+                continue;
+            }
+
+            err = writer.AddSample(buffer, sampleEventInfo, file.FileBigEndian());
+            if (err)
+            {
+                fprintf(stderr, "\n- Columnar error %d.\n", err);
+            }
+
+            if (!buffer.empty())
+            {
+                WriteBuffer(output);
+            }
+        }
+    }
+};
+
+struct fclose_temp_deleter
+{
+    void operator()(FILE* f) const noexcept
+    {
+        fclose(f);
+    }
+};
+
+using unique_temp_file = std::unique_ptr<FILE, fclose_temp_deleter>;
+
+// Copies the contents of temp (from the beginning) to output.
+static void
+CopyTempFile(FILE* output, FILE* temp) noexcept
+{
+    char buffer[65536];
+    rewind(temp);
+    for (;;)
+    {
+        auto const cb = fread(buffer, 1, sizeof(buffer), temp);
+        if (cb == 0)
+        {
+            break;
+        }
+
+        fwrite(buffer, 1, cb, output);
+    }
+}
+
+// Decodes the input files using up to jobs threads. Each file is decoded into
+// a temporary file. The temporary files are copied to output in input order, so
+// the output is the same as if the files were decoded sequentially.
+static void
+DecodeFilesParallel(
+    FILE* output,
+    std::vector<char const*> const& inputNames,
+    unsigned jobs,
+    PerfEventFilter const& filter,
+    bool callchains)
+{
+    struct Section
+    {
+        unique_temp_file temp;
+        std::exception_ptr exception;
+        bool done = false;
+    };
+
+    auto const sectionCount = inputNames.size();
+    std::vector<Section> sections(sectionCount);
+    std::vector<std::thread> threads;
+    std::atomic<size_t> nextSection(0);
+    std::mutex mutex;
+    std::condition_variable sectionDone;
+
+    auto const threadProc = [&]() noexcept
+        {
+            std::unique_ptr<Decoder> decoder;
+            for (;;)
+            {
+                auto const i = nextSection.fetch_add(1, std::memory_order_relaxed);
+                if (i >= sectionCount)
+                {
+                    break;
+                }
+
+                unique_temp_file temp(tmpfile());
+                std::exception_ptr exception;
+                if (temp != nullptr) try
+                {
+                    if (!decoder)
+                    {
+                        decoder = std::make_unique<Decoder>(filter, callchains);
+                    }
+
+                    decoder->DecodeFile(temp.get(), inputNames[i], i == 0);
+                }
+                catch (...)
+                {
+                    exception = std::current_exception();
+                    decoder.reset(); // Might be in an inconsistent state.
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                sections[i].temp = std::move(temp);
+                sections[i].exception = std::move(exception);
+                sections[i].done = true;
+                sectionDone.notify_all();
+            }
+        };
+
+    std::exception_ptr exception;
+    try
+    {
+        auto const threadCount = jobs < sectionCount ? jobs : static_cast<unsigned>(sectionCount);
+        threads.reserve(threadCount);
+        for (unsigned i = 0; i != threadCount; i += 1)
+        {
+            threads.emplace_back(threadProc);
+        }
+
+        std::unique_ptr<Decoder> fallbackDecoder;
+        for (size_t i = 0; i != sectionCount; i += 1)
+        {
+            auto& section = sections[i];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                sectionDone.wait(lock, [&section]() { return section.done; });
+            }
+
+            if (section.temp == nullptr)
+            {
+                // tmpfile failed. Decode directly to output.
+                if (!fallbackDecoder)
+                {
+                    fallbackDecoder = std::make_unique<Decoder>(filter, callchains);
+                }
+
+                fallbackDecoder->DecodeFile(output, inputNames[i], i == 0);
+            }
+            else
+            {
+                CopyTempFile(output, section.temp.get());
+                section.temp.reset();
+            }
+
+            if (section.exception)
+            {
+                std::rethrow_exception(section.exception);
+            }
+        }
+    }
+    catch (...)
+    {
+        // Stop handing out work, then wait for the threads to exit.
+        nextSection.store(sectionCount, std::memory_order_relaxed);
+        exception = std::current_exception();
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (exception)
+    {
+        std::rethrow_exception(exception);
+    }
+}
+
+static void
+ArgJobs(
+    char const* flagName,
+    int argi,
+    int argc,
+    char* argv[],
+    bool* usageError,
+    unsigned* jobs) noexcept
+{
+    unsigned const jobsMax = 1024;
+    if (argi >= argc)
+    {
+        fprintf(stderr, "error: missing value for flag %s.\n",
+            flagName);
+        *usageError = true;
+    }
+    else
+    {
+        auto const value = strtoul(argv[argi], nullptr, 0);
+        if (value == 0 || value > jobsMax)
+        {
+            fprintf(stderr, "error: invalid value \"%s\" for flag %s, must be 1..%u.\n",
+                argv[argi], flagName, jobsMax);
+            *usageError = true;
+        }
+        else
+        {
+            *jobs = static_cast<unsigned>(value);
+        }
+    }
+}
+
+// Parses an unsigned integer flag value (decimal, or hex with 0x prefix).
+// Returns true and sets *value on success.
+static bool
+ArgUInt(
+    char const* flagName,
+    int argi,
+    int argc,
+    char* argv[],
+    bool* usageError,
+    uint64_t valueMax,
+    uint64_t* value) noexcept
+{
+    if (argi >= argc)
+    {
+        fprintf(stderr, "error: missing value for flag %s.\n",
+            flagName);
+        *usageError = true;
+        return false;
+    }
+
+    char* end;
+    errno = 0;
+    auto const parsed = strtoull(argv[argi], &end, 0);
+    if (end == argv[argi] || *end != '\0' || errno != 0 || parsed > valueMax)
+    {
+        fprintf(stderr, "error: invalid value \"%s\" for flag %s.\n",
+            argv[argi], flagName);
+        *usageError = true;
+        return false;
+    }
+
+    *value = parsed;
+    return true;
+}
+
+static void
+ArgGlob(
+    char const* flagName,
+    int argi,
+    int argc,
+    char* argv[],
+    bool* usageError,
+    PerfEventFilter& filter,
+    bool provider)
+{
+    if (argi >= argc)
+    {
+        fprintf(stderr, "error: missing value for flag %s.\n",
+            flagName);
+        *usageError = true;
+    }
+    else if (provider)
+    {
+        filter.AddProviderNameGlob(argv[argi]);
+    }
+    else
+    {
+        filter.AddEventNameGlob(argv[argi]);
+    }
+}
+
+static void
+ArgFormat(
+    char const* flagName,
+    int argi,
+    int argc,
+    char* argv[],
+    bool* usageError,
+    bool* columnar) noexcept
+{
+    if (argi >= argc)
+    {
+        fprintf(stderr, "error: missing value for flag %s.\n",
+            flagName);
+        *usageError = true;
+    }
+    else if (0 == strcmp(argv[argi], "json"))
+    {
+        *columnar = false;
+    }
+    else if (0 == strcmp(argv[argi], "columnar"))
+    {
+        *columnar = true;
+    }
+    else
+    {
+        fprintf(stderr, "error: invalid value \"%s\" for flag %s, must be json or columnar.\n",
+            argv[argi], flagName);
+        *usageError = true;
+    }
+}
+
 int main(int argc, char* argv[])
 {
     int err;
@@ -87,6 +1087,15 @@ int main(int argc, char* argv[])
         std::unique_ptr<FILE, fclose_deleter> output;
         std::vector<char const*> inputNames;
         char const* outputName = nullptr;
+        PerfEventFilter filter;
+        uint64_t keywordAny = 0;
+        uint64_t keywordAll = 0;
+        uint64_t timeMin = 0;
+        uint64_t timeMax = UINT64_MAX;
+        uint64_t value;
+        unsigned jobs = 1;
+        bool columnar = false;
+        bool callchains = false;
         bool showHelp = false;
         bool usageError = false;
 
@@ -97,6 +1106,10 @@ int main(int argc, char* argv[])
             {
                 inputNames.push_back(arg);
             }
+            else if (arg[1] == '\0')
+            {
+                inputNames.push_back(""); // "-" means stdin.
+            }
             else if (arg[1] != '-')
             {
                 auto const flags = &arg[1];
@@ -117,6 +1130,22 @@ int main(int argc, char* argv[])
                             usageError = true;
                         }
                         break;
+                    case 'f':
+                        argi += 1;
+                        ArgFormat("-f", argi, argc, argv, &usageError, &columnar);
+                        break;
+                    case 'j':
+                        argi += 1;
+                        ArgJobs("-j", argi, argc, argv, &usageError, &jobs);
+                        break;
+                    case 'e':
+                        argi += 1;
+                        ArgGlob("-e", argi, argc, argv, &usageError, filter, false);
+                        break;
+                    case 'p':
+                        argi += 1;
+                        ArgGlob("-p", argi, argc, argv, &usageError, filter, true);
+                        break;
                     case 'h':
                         showHelp = true;
                         break;
@@ -144,6 +1173,74 @@ int main(int argc, char* argv[])
                         usageError = true;
                     }
                 }
+                else if (0 == strcmp(flag, "format"))
+                {
+                    argi += 1;
+                    ArgFormat("--format", argi, argc, argv, &usageError, &columnar);
+                }
+                else if (0 == strcmp(flag, "jobs"))
+                {
+                    argi += 1;
+                    ArgJobs("--jobs", argi, argc, argv, &usageError, &jobs);
+                }
+                else if (0 == strcmp(flag, "event"))
+                {
+                    argi += 1;
+                    ArgGlob("--event", argi, argc, argv, &usageError, filter, false);
+                }
+                else if (0 == strcmp(flag, "provider"))
+                {
+                    argi += 1;
+                    ArgGlob("--provider", argi, argc, argv, &usageError, filter, true);
+                }
+                else if (0 == strcmp(flag, "level"))
+                {
+                    argi += 1;
+                    if (ArgUInt("--level", argi, argc, argv, &usageError, 0xFF, &value))
+                    {
+                        filter.SetLevelMax(static_cast<uint8_t>(value));
+                    }
+                }
+                else if (0 == strcmp(flag, "keyword"))
+                {
+                    argi += 1;
+                    ArgUInt("--keyword", argi, argc, argv, &usageError, UINT64_MAX, &keywordAny);
+                }
+                else if (0 == strcmp(flag, "keyword-all"))
+                {
+                    argi += 1;
+                    ArgUInt("--keyword-all", argi, argc, argv, &usageError, UINT64_MAX, &keywordAll);
+                }
+                else if (0 == strcmp(flag, "pid"))
+                {
+                    argi += 1;
+                    if (ArgUInt("--pid", argi, argc, argv, &usageError, UINT32_MAX, &value))
+                    {
+                        filter.AddPid(static_cast<uint32_t>(value));
+                    }
+                }
+                else if (0 == strcmp(flag, "tid"))
+                {
+                    argi += 1;
+                    if (ArgUInt("--tid", argi, argc, argv, &usageError, UINT32_MAX, &value))
+                    {
+                        filter.AddTid(static_cast<uint32_t>(value));
+                    }
+                }
+                else if (0 == strcmp(flag, "time-min"))
+                {
+                    argi += 1;
+                    ArgUInt("--time-min", argi, argc, argv, &usageError, UINT64_MAX, &timeMin);
+                }
+                else if (0 == strcmp(flag, "time-max"))
+                {
+                    argi += 1;
+                    ArgUInt("--time-max", argi, argc, argv, &usageError, UINT64_MAX, &timeMax);
+                }
+                else if (0 == strcmp(flag, "callchain"))
+                {
+                    callchains = true;
+                }
                 else if (0 == strcmp(flag, "help"))
                 {
                     showHelp = true;
@@ -172,6 +1269,13 @@ int main(int argc, char* argv[])
             goto Done;
         }
 
+        if (keywordAny != 0 || keywordAll != 0)
+        {
+            filter.SetKeywordMask(keywordAny, keywordAll);
+        }
+
+        filter.SetTimeRange(timeMin, timeMax);
+
         if (outputName == nullptr)
         {
             output.reset(stdout);
@@ -179,7 +1283,7 @@ int main(int argc, char* argv[])
         else
         {
             errno = 0;
-            output.reset(fopen(outputName, "w"));
+            output.reset(fopen(outputName, columnar ? "wb" : "w"));
             if (output == nullptr)
             {
                 err = errno;
@@ -192,6 +1296,21 @@ int main(int argc, char* argv[])
             }
         }
 
+        if (columnar)
+        {
+            auto decoder = std::make_unique<ColumnarDecoder>(filter);
+            EventColumnarWriter::AppendFileHeader(decoder->buffer);
+            for (auto inputName : inputNames)
+            {
+                decoder->DecodeFile(output.get(), inputName);
+            }
+
+            decoder->writer.Flush(decoder->buffer);
+            decoder->WriteBuffer(output.get());
+            err = 0;
+            goto Done;
+        }
+
         if (!isatty(fileno(output.get())))
         {
             // Output is UTF-8. Emit a BOM.
@@ -200,93 +1319,23 @@ int main(int argc, char* argv[])
 
         fputs("{\n", output.get());
 
-        std::string filenameJson;
-        std::multimap<uint64_t, std::string> events;
-        EventFormatter formatter;
-        PerfDataFile file;
-        bool comma = false;
-
-        for (auto inputName : inputNames)
+        if (jobs > 1 && inputNames.size() > 1)
         {
-            bool const isStdin = inputName[0] == '\0';
-            char const* const filename = isStdin ? "stdin" : inputName;
-
-            filenameJson.clear();
-            formatter.AppendValueAsJson(
-                filenameJson,
-                filename,
-                static_cast<unsigned>(strlen(filename)),
-                event_field_encoding_zstring_char8,
-                event_field_format_default, false);
-
-            fprintf(output.get(), "%s%s: [",
-                comma ? ",\n" : "",
-                filenameJson.c_str());
-            comma = false;
-
-            // CodeQL [SM01937] Users should be able to specify the output file path.
-            err = isStdin ? file.OpenStdin() : file.Open(filename);
-            if (err != 0)
-            {
-                char errBuf[80];
-                fprintf(stderr, "\n- Open(\"%s\") error %d: \"%s\"\n",
-                    filename,
-                    err,
-                    strerror_r(err, errBuf, sizeof(errBuf)));
-            }
-            else for (;;)
+            DecodeFilesParallel(output.get(), inputNames, jobs, filter, callchains);
+        }
+        else
+        {
+            Decoder decoder(filter, callchains);
+            bool first = true;
+            for (auto inputName : inputNames)
             {
-                perf_event_header const* pHeader;
-                err = file.ReadEvent(&pHeader);
-                if (!pHeader)
-                {
-                    if (err)
-                    {
-                        fprintf(stderr, "\n- ReadEvent error %d.\n", err);
-                    }
-                    break;
-                }
-
-                if (pHeader->type != PERF_RECORD_SAMPLE)
+                if (!decoder.DecodeFileChunked(output.get(), inputName, first, jobs))
                 {
-                    if (pHeader->type == PERF_RECORD_FINISHED_ROUND)
-                    {
-                        comma = FlushEvents(output.get(), events, comma);
-                    }
-
-                    continue; // Only interested in sample events for now.
+                    decoder.DecodeFile(output.get(), inputName, first);
                 }
 
-                PerfSampleEventInfo sampleEventInfo;
-                err = file.GetSampleEventInfo(pHeader, &sampleEventInfo);
-                if (err)
-                {
-                    fprintf(stderr, "\n- GetSampleEventInfo error %d.\n", err);
-                    continue;
-                }
-
-                // Events are returned out-of-order and need to be sorted. Use a map to
-                // put them into timestamp order. Flush the map at the end of each round.
-                auto it = events.emplace(
-                    (sampleEventInfo.SampleType() & PERF_SAMPLE_TIME) ? sampleEventInfo.time : 0u,
-                    std::string());
-                err = formatter.AppendSampleAsJson(
-                    it->second,
-                    sampleEventInfo,
-                    file.FileBigEndian(),
-                    static_cast<EventFormatterJsonFlags>(
-                        EventFormatterJsonFlags_Space |
-                        EventFormatterJsonFlags_FieldTag));
-                if (err)
-                {
-                    fprintf(stderr, "\n- Format error %d.\n", err);
-                }
+                first = false;
             }
-
-            comma = FlushEvents(output.get(), events, comma);
-
-            fputs(" ]", output.get());
-            comma = true;
         }
 
         fprintf(output.get(), "\n}\n");
@@ -4,15 +4,22 @@
 /*
 Generates a .json.actual file for the .dat file.
 Verifies that the resulting .json.actual file is the same as the .json.expected file.
+Verifies that FindField with an EventShapeCache finds the same items as FindField
+without a cache.
+Verifies that a byte-swapped copy of each event (the same event as written by a
+host of the other byte order) formats to the same JSON.
 */
 
 #include <eventheader/EventEnumerator.h>
 #include <eventheader/EventFormatter.h>
+#include <eventheader/EventShapeCache.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 #include <exception>
 #include <memory>
 #include <string>
+#include <vector>
 
 #ifdef _WIN32
 #include <share.h>
@@ -35,6 +42,22 @@ struct fcloseDelete
 
 using unique_file = std::unique_ptr<FILE, fcloseDelete>;
 
+static void
+Swap16(char* p) noexcept
+{
+    std::swap(p[0], p[1]);
+}
+
+// Reverses each size-byte element of the count bytes at p. No-op if size < 2.
+static void
+SwapElements(char* p, size_t count, unsigned size) noexcept
+{
+    for (size_t i = 0; size > 1 && i + size <= count; i += size)
+    {
+        std::reverse(p + i, p + i + size);
+    }
+}
+
 static std::string
 LoadFile(char const* filename)
 {
@@ -74,6 +97,249 @@ MakeJsonName(char const* baseDir, char const* suffix)
     return result;
 }
 
+// Returns true if the enumerators are at the same item of the same event.
+// After the last item, the data position is not compared (a cached FindField
+// that does not find the field does not move through the data).
+static bool
+SameItem(EventEnumerator const& a, EventEnumerator const& b)
+{
+    if (a.State() != b.State())
+    {
+        return false;
+    }
+
+    if (a.State() <= EventEnumeratorState_BeforeFirstItem)
+    {
+        return a.LastError() == b.LastError();
+    }
+
+    if (a.GetRawDataPosition().Data != b.GetRawDataPosition().Data)
+    {
+        return false;
+    }
+
+    auto const x = a.GetItemInfo();
+    auto const y = b.GetItemInfo();
+    return x.Name == y.Name &&
+        x.ValueData == y.ValueData &&
+        x.ValueSize == y.ValueSize &&
+        x.ArrayIndex == y.ArrayIndex &&
+        x.ArrayCount == y.ArrayCount &&
+        x.ElementSize == y.ElementSize &&
+        x.Encoding == y.Encoding &&
+        x.Format == y.Format &&
+        x.ArrayFlags == y.ArrayFlags &&
+        x.FieldTag == y.FieldTag;
+}
+
+// Looks up every field of the enumerator's event (and a few missing fields) with
+// and without the cache. Both lookups and the next MoveNext should give the same
+// item.
+static void
+VerifyCachedFindField(EventEnumerator& enumerator, EventShapeCache& cache)
+{
+    std::vector<std::string> paths = { "", "NoSuchField", "NoSuchField.x" };
+    std::vector<size_t> structPathSizes;
+    std::string path;
+
+    enumerator.Reset();
+    bool movedToItem = enumerator.MoveNext();
+    while (movedToItem)
+    {
+        auto const state = enumerator.State();
+        if (state == EventEnumeratorState_StructEnd)
+        {
+            path.resize(structPathSizes.back());
+            structPathSizes.pop_back();
+            movedToItem = enumerator.MoveNext();
+            continue;
+        }
+
+        auto const item = enumerator.GetItemInfo();
+        auto const prefixSize = path.size();
+        if (!structPathSizes.empty())
+        {
+            path += '.';
+        }
+
+        path.append(item.Name, strcspn(item.Name, ";"));
+        paths.push_back(path);
+
+        if (state == EventEnumeratorState_StructBegin)
+        {
+            paths.push_back(path + ".NoSuchField");
+            structPathSizes.push_back(prefixSize);
+            movedToItem = enumerator.MoveNext();
+        }
+        else
+        {
+            path.resize(prefixSize);
+            movedToItem = enumerator.MoveNextSibling();
+        }
+    }
+
+    EventEnumerator uncached = enumerator;
+    for (auto const& fieldPath : paths)
+    {
+        bool const found = uncached.FindField(fieldPath.c_str());
+        if (found != enumerator.FindField(cache, fieldPath.c_str()) ||
+            !SameItem(enumerator, uncached) ||
+            (found && (uncached.MoveNext() != enumerator.MoveNext() || !SameItem(enumerator, uncached))))
+        {
+            fprintf(stdout, "\n- Cached FindField(\"%s\") mismatch.", fieldPath.c_str());
+            throw std::exception();
+        }
+    }
+
+    enumerator.Reset();
+}
+
+// Returns true if EventFormatter decodes a length16 char8 string or binary
+// value with the specified format and size as a number in event byte order.
+static bool
+Char8IsNumber(event_field_format format, uint32_t size) noexcept
+{
+    switch (format)
+    {
+    case event_field_format_unsigned_int:
+    case event_field_format_signed_int:
+    case event_field_format_hex_int:
+        return size == 2 || size == 4 || size == 8;
+    case event_field_format_errno:
+    case event_field_format_pid:
+        return size == 4;
+    case event_field_format_time:
+    case event_field_format_float:
+        return size == 4 || size == 8;
+    case event_field_format_boolean:
+        return size == 2 || size == 4;
+    default:
+        return false;
+    }
+}
+
+// Sets swapped to a copy of the enumerator's event (data) in the other byte
+// order: header, extension headers, metadata tags and array counts, length
+// prefixes, and values. Values that EventFormatter decodes as bytes (UUIDs,
+// ports, IP addresses, hex_bytes, char8 strings) are not swapped.
+static void
+SwapEvent(
+    EventEnumerator& enumerator,
+    char const* data,
+    size_t dataSize,
+    std::string& swapped)
+{
+    swapped.assign(data, dataSize);
+    auto const p = &swapped[0];
+
+    auto const flags = static_cast<uint8_t>(p[0]);
+    p[0] = static_cast<char>(flags ^ eventheader_flag_little_endian);
+    Swap16(p + 2); // id
+    Swap16(p + 4); // tag
+
+    size_t pos = sizeof(eventheader);
+    bool chain = 0 != (flags & eventheader_flag_extension);
+    while (chain)
+    {
+        eventheader_extension ext;
+        memcpy(&ext, p + pos, sizeof(ext));
+        Swap16(p + pos);
+        Swap16(p + pos + 2);
+        pos += sizeof(ext);
+
+        if ((ext.kind & eventheader_extension_kind_value_mask) == eventheader_extension_kind_metadata)
+        {
+            // Event name, then fields: name, encoding, [format, [tag]], [carray count].
+            size_t metaPos = pos + strnlen(p + pos, ext.size) + 1;
+            while (metaPos < pos + ext.size)
+            {
+                metaPos += strnlen(p + metaPos, pos + ext.size - metaPos) + 1;
+                auto const encoding = static_cast<uint8_t>(p[metaPos++]);
+                if (0 != (encoding & event_field_encoding_chain_flag))
+                {
+                    auto const format = static_cast<uint8_t>(p[metaPos++]);
+                    if (0 != (format & event_field_format_chain_flag))
+                    {
+                        Swap16(p + metaPos);
+                        metaPos += 2;
+                    }
+                }
+
+                if ((encoding & (event_field_encoding_carray_flag | event_field_encoding_varray_flag)) ==
+                    event_field_encoding_carray_flag)
+                {
+                    Swap16(p + metaPos);
+                    metaPos += 2;
+                }
+            }
+        }
+
+        pos += ext.size;
+        chain = 0 != (ext.kind & eventheader_extension_kind_chain_flag);
+    }
+
+    enumerator.Reset();
+    while (enumerator.MoveNext())
+    {
+        auto const state = enumerator.State();
+        auto const item = enumerator.GetItemInfo();
+        if (state == EventEnumeratorState_ArrayBegin &&
+            item.ArrayFlags == event_field_encoding_varray_flag)
+        {
+            // Array count precedes the array.
+            auto const raw = static_cast<char const*>(enumerator.GetRawDataPosition().Data);
+            Swap16(p + (raw - data) - 2);
+        }
+        else if (state == EventEnumeratorState_Value)
+        {
+            auto const value = p + (static_cast<char const*>(item.ValueData) - data);
+            auto const format = item.Format;
+            switch (item.Encoding)
+            {
+            default:
+                break;
+            case event_field_encoding_value16:
+            case event_field_encoding_value32:
+            case event_field_encoding_value64:
+                if (format != event_field_format_hex_bytes &&
+                    format != event_field_format_port &&
+                    format != event_field_format_ip_address &&
+                    format != event_field_format_ip_address_obsolete)
+                {
+                    SwapElements(value, item.ValueSize, item.ElementSize);
+                }
+                break;
+            case event_field_encoding_zstring_char16:
+            case event_field_encoding_zstring_char32:
+            case event_field_encoding_string_length16_char16:
+            case event_field_encoding_string_length16_char32:
+                if (item.Encoding >= event_field_encoding_string_length16_char8)
+                {
+                    Swap16(value - 2);
+                }
+
+                if (format != event_field_format_hex_bytes)
+                {
+                    SwapElements(value, item.ValueSize,
+                        item.Encoding == event_field_encoding_zstring_char16 ||
+                        item.Encoding == event_field_encoding_string_length16_char16 ? 2 : 4);
+                }
+                break;
+            case event_field_encoding_string_length16_char8:
+            case event_field_encoding_binary_length16_char8:
+                Swap16(value - 2);
+                if (Char8IsNumber(format, item.ValueSize))
+                {
+                    SwapElements(value, item.ValueSize, item.ValueSize);
+                }
+                break;
+            }
+        }
+    }
+
+    enumerator.Reset();
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -90,7 +356,12 @@ main(int argc, char* argv[])
         size_t datPos = 0;
 
         EventEnumerator enumerator;
+        EventEnumerator swappedEnumerator;
         EventFormatter formatter;
+        EventFormatterCache formatterCache;
+        std::string swappedEvent;
+        std::string swappedJson;
+        EventShapeCache cache;
         bool comma = false;
 
         std::string actualJson;
@@ -151,14 +422,37 @@ main(int argc, char* argv[])
             }
             else
             {
+                auto const jsonFlags = static_cast<EventFormatterJsonFlags>(
+                    EventFormatterJsonFlags_Space |
+                    EventFormatterJsonFlags_FieldTag);
+                auto const eventData = dat.data() + datPos + nameSize + 1;
+                auto const eventDataSize = recordSize - nameSize - 1;
+                auto const jsonBegin = actualJson.size();
+
+                SwapEvent(enumerator, eventData, eventDataSize, swappedEvent);
+
                 int err = formatter.AppendEventAsJsonAndMoveToEnd(
-                    actualJson, enumerator, static_cast<EventFormatterJsonFlags>(
-                        EventFormatterJsonFlags_Space |
-                        EventFormatterJsonFlags_FieldTag));
+                    actualJson, enumerator, jsonFlags);
                 if (err != 0)
                 {
                     fprintf(stdout, "\n- AppendEvent error.");
                 }
+
+                swappedJson.clear();
+                if (!swappedEnumerator.StartEvent(
+                        dat.data() + datPos,
+                        nameSize,
+                        swappedEvent.data(),
+                        eventDataSize) ||
+                    0 != formatter.AppendEventAsJsonAndMoveToEnd(swappedJson, swappedEnumerator, jsonFlags,
+                        EventFormatterMetaFlags_Default, &formatterCache) ||
+                    0 != actualJson.compare(jsonBegin, std::string::npos, swappedJson))
+                {
+                    fprintf(stdout, "\n- Byte-swapped event mismatch: %s\n  %s", dat.data() + datPos, swappedJson.c_str());
+                    throw std::exception();
+                }
+
+                VerifyCachedFindField(enumerator, cache);
             }
 
             datPos += recordSize;
@@ -4,18 +4,23 @@
 /*
 Generates a .json.actual file for the .perf file.
 Verifies that the resulting .json.actual file is the same as the .json.expected file.
+If the "mapped" option is given, opens the file with OpenMapped and generates a
+.json.mapped.actual file instead.
 */
 
 #include <tracepoint/PerfDataFile.h>
 #include <tracepoint/PerfEventAbi.h>
 #include <tracepoint/PerfEventInfo.h>
+#include <eventheader/EventColumnarWriter.h>
 #include <eventheader/EventEnumerator.h>
 #include <eventheader/EventFormatter.h>
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <exception>
 #include <memory>
 #include <string>
+#include <string_view>
 
 #ifdef _WIN32
 #include <share.h>
@@ -83,7 +88,7 @@ main(int argc, char* argv[])
 {
     if (argc <= 1)
     {
-        fprintf(stdout, "Usage: %s <perf-file>\n", argv[0]);
+        fprintf(stdout, "Usage: %s <perf-file> [mapped]\n", argv[0]);
         return 1;
     }
 
@@ -92,13 +97,14 @@ main(int argc, char* argv[])
         int err;
 
         auto const perfName = argv[1];
-        std::string const actualName = MakeJsonName(perfName, ".actual");
+        bool const mapped = argc > 2 && 0 == strcmp(argv[2], "mapped");
+        std::string const actualName = MakeJsonName(perfName, mapped ? ".mapped.actual" : ".actual");
         std::string const expectedName = MakeJsonName(perfName, ".expected");
 
         PerfDataFile reader;
         PerfSampleEventInfo sampleEventInfo;
 
-        err = reader.Open(perfName);
+        err = mapped ? reader.OpenMapped(perfName) : reader.Open(perfName);
         if (err != 0)
         {
             fprintf(stdout, "Failed to open file %u: %s\n", err, perfName);
@@ -107,9 +113,14 @@ main(int argc, char* argv[])
 
         EventEnumerator enumerator;
         EventFormatter formatter;
+        EventFormatterCache formatterCache;
+        EventColumnarWriter columnarWriter(64);
+        std::string columnar;
+        uint32_t sampleCount = 0;
         bool comma = false;
 
         std::string actualJson;
+        char buffer[65536];
         actualJson += "\xEF\xBB\xBF\n\"" PERF_NAME "\": [";
 
         for (;;)
@@ -141,16 +152,71 @@ main(int argc, char* argv[])
             actualJson += comma ? ",\n " : "\n ";
             comma = true;
 
+            sampleCount += 1;
+            err = columnarWriter.AddSample(columnar, sampleEventInfo, reader.FileBigEndian());
+            if (err != 0)
+            {
+                fprintf(stdout, "\n- AddSample error %d.", err);
+                throw std::exception();
+            }
+
+            auto const jsonStart = actualJson.size();
             err = formatter.AppendSampleAsJson(actualJson, sampleEventInfo, reader.FileBigEndian());
             if (err != 0)
             {
                 fprintf(stdout, "\n- AppendSampleAsJson error %d.", err);
                 throw std::exception();
             }
+
+            // The fixed-buffer overload (here with a cache) should produce the
+            // same result, or ENOBUFS.
+            std::string_view const json(actualJson.data() + jsonStart, actualJson.size() - jsonStart);
+            size_t bufferUsed;
+            err = formatter.AppendSampleAsJson(buffer, sizeof(buffer), &bufferUsed, sampleEventInfo, reader.FileBigEndian(),
+                EventFormatterJsonFlags_None, EventFormatterMetaFlags_Default, 4096, &formatterCache);
+            if (err != 0 || json != std::string_view(buffer, bufferUsed))
+            {
+                fprintf(stdout, "\n- AppendSampleAsJson(buffer) error %d or mismatch.", err);
+                throw std::exception();
+            }
+
+            err = formatter.AppendSampleAsJson(buffer, json.size() - 1, &bufferUsed, sampleEventInfo, reader.FileBigEndian());
+            if (err != ENOBUFS || bufferUsed != 0)
+            {
+                fprintf(stdout, "\n- AppendSampleAsJson(small buffer) returned %d.", err);
+                throw std::exception();
+            }
         }
 
         actualJson += " ]\n";
 
+        // Every sample should be in exactly one columnar batch.
+        {
+            columnarWriter.Flush(columnar);
+            uint32_t rowCount = 0;
+            size_t pos = 0;
+            while (pos + 8 <= columnar.size())
+            {
+                uint32_t batchSize, batchRowCount;
+                memcpy(&batchSize, &columnar[pos], sizeof(batchSize));
+                memcpy(&batchRowCount, &columnar[pos + 4], sizeof(batchRowCount));
+                if (batchRowCount == 0 || batchRowCount > 64)
+                {
+                    break;
+                }
+
+                rowCount += batchRowCount;
+                pos += 4 + batchSize;
+            }
+
+            if (pos != columnar.size() || rowCount != sampleCount)
+            {
+                fprintf(stdout, "\n- Columnar batches invalid: %u/%u rows, %u/%u bytes.",
+                    rowCount, sampleCount, (unsigned)pos, (unsigned)columnar.size());
+                throw std::exception();
+            }
+        }
+
         {
             unique_file actualFile{ fopen(actualName.c_str(), "w") };
             if (!actualFile)
@@ -0,0 +1,579 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for libeventheader-decode classes that work on perf.data files, using the
+files in TestOutput. Usage: eventheader-decode-utest <dataDir> <testName>
+*/
+
+#include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <tracepoint/PerfEventInfo.h>
+#include <tracepoint/PerfEventMetadata.h>
+#include <eventheader/EventActivityIndex.h>
+#include <eventheader/EventColumnarWriter.h>
+#include <eventheader/EventEnumerator.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+
+using namespace eventheader_decode;
+using namespace tracepoint_decode;
+
+// Reports a failed check and aborts the test.
+static void
+Verify(bool condition, char const* what)
+{
+    if (!condition)
+    {
+        fprintf(stdout, "\n- Check failed: %s", what);
+        throw std::exception();
+    }
+}
+
+// Starts enumerator on the sample. Returns false if the sample is not an
+// EventHeader event.
+static bool
+StartSample(EventEnumerator& enumerator, PerfSampleEventInfo const& info)
+{
+    auto const meta = info.Metadata();
+    if (!meta || meta->Kind() != PerfEventKind::EventHeader)
+    {
+        return false;
+    }
+
+    auto const eventHeaderOffset = meta->Fields()[meta->CommonFieldCount()].Offset();
+    Verify(eventHeaderOffset <= info.raw_data_size, "EventHeader offset");
+    Verify(enumerator.StartEvent(
+        meta->Name().data(),
+        meta->Name().size(),
+        static_cast<char const*>(info.raw_data) + eventHeaderOffset,
+        info.raw_data_size - eventHeaderOffset), "StartEvent");
+    return true;
+}
+
+// Returns "ProviderName:EventName" for the enumerator's event.
+static std::string
+ProviderAndEventName(EventEnumerator const& enumerator)
+{
+    auto const eventInfo = enumerator.GetEventInfo();
+    std::string result(eventInfo.TracepointName, eventInfo.ProviderNameLength);
+    result += ':';
+    result += eventInfo.Name;
+    return result;
+}
+
+// In perf.data, the only events with an activity ID are TestProviderC and
+// TestProviderCpp Transfer10 (activity only) and Transfer11 (activity, and
+// related activity = same ID). Transfer00 has no activity ID.
+static void
+TestActivityIndex(std::string const& dataDir)
+{
+    static uint8_t const ActivityId[16] = {
+        1, 2, 3, 4, 5, 6, 7, 8, 1, 2, 3, 4, 5, 6, 7, 8 };
+    static uint8_t const OtherId[16] = {
+        1, 2, 3, 4, 5, 6, 7, 8, 1, 2, 3, 4, 5, 6, 7, 9 };
+    static char const* const ActivityEventNames[] = {
+        "TestProviderC:Transfer10",
+        "TestProviderC:Transfer11",
+        "TestProviderCpp:Transfer10",
+        "TestProviderCpp:Transfer11",
+    };
+
+    auto const path = dataDir + "/perf.data";
+    EventEnumerator enumerator;
+    PerfSampleEventInfo info;
+
+    // Serial pass: positions of the Transfer events.
+    std::vector<uint64_t> transferPositions;
+    std::vector<uint64_t> noActivityPositions;
+    {
+        PerfDataFile file;
+        Verify(0 == file.Open(path.c_str()), "Open");
+        for (;;)
+        {
+            auto const filePos = file.FilePos();
+            perf_event_header const* header;
+            Verify(0 == file.ReadEvent(&header), "ReadEvent");
+            if (header == nullptr)
+            {
+                break;
+            }
+
+            if (header->type != PERF_RECORD_SAMPLE)
+            {
+                continue;
+            }
+
+            Verify(0 == file.GetSampleEventInfo(header, &info), "GetSampleEventInfo");
+            if (!StartSample(enumerator, info))
+            {
+                continue;
+            }
+
+            auto const name = ProviderAndEventName(enumerator);
+            for (auto expectedName : ActivityEventNames)
+            {
+                if (name == expectedName)
+                {
+                    transferPositions.push_back(filePos);
+                }
+            }
+
+            if (name == "TestProviderC:Transfer00" || name == "TestProviderCpp:Transfer00")
+            {
+                noActivityPositions.push_back(filePos);
+            }
+        }
+
+        Verify(transferPositions.size() == 4, "perf.data has 4 Transfer1x events");
+        Verify(noActivityPositions.size() == 2, "perf.data has 2 Transfer00 events");
+    }
+
+    PerfDataFile file;
+    Verify(0 == file.OpenMapped(path.c_str()), "OpenMapped");
+
+    EventActivityIndex index;
+    Verify(0 == index.Build(file), "Build");
+    Verify(index.Events().size() == 4, "4 indexed events");
+    Verify(index.Links().size() == 1, "1 unique link");
+    Verify(0 == memcmp(index.Links()[0].ActivityId, ActivityId, 16) &&
+        0 == memcmp(index.Links()[0].ParentActivityId, ActivityId, 16),
+        "link is the activity's self-reference");
+
+    std::vector<uint64_t> positions;
+    Verify(4 == index.FindActivity(ActivityId, positions), "FindActivity count");
+    Verify(positions == transferPositions, "FindActivity positions");
+    for (auto pos : noActivityPositions)
+    {
+        Verify(std::find(positions.begin(), positions.end(), pos) == positions.end(),
+            "event without activity is not indexed");
+    }
+
+    // Reading at each position returns the expected event with the activity ID.
+    PerfDataFileChunkReader chunkReader;
+    for (size_t i = 0; i != positions.size(); i += 1)
+    {
+        perf_event_header const* header;
+        chunkReader.Reset(file, { positions[i], file.DataEndFilePos() });
+        Verify(0 == chunkReader.ReadEvent(&header) && header != nullptr, "ReadEvent at position");
+        Verify(header->type == PERF_RECORD_SAMPLE, "event at position is a sample");
+        Verify(0 == file.GetSampleEventInfo(header, &info), "GetSampleEventInfo at position");
+        Verify(StartSample(enumerator, info), "event at position is EventHeader");
+        Verify(ProviderAndEventName(enumerator) == ActivityEventNames[i], "event name at position");
+
+        auto const eventInfo = enumerator.GetEventInfo();
+        Verify(eventInfo.ActivityId && 0 == memcmp(eventInfo.ActivityId, ActivityId, 16),
+            "activity ID at position");
+        Verify((eventInfo.RelatedActivityId != nullptr) == (0 != (i & 1)),
+            "related activity ID only on Transfer11");
+    }
+
+    // A self-reference is not a parent, so the tree is just the activity.
+    uint8_t parent[16];
+    Verify(!index.FindParent(ActivityId, parent), "FindParent self");
+    positions.clear();
+    Verify(4 == index.FindActivityTree(ActivityId, positions), "FindActivityTree count");
+    Verify(positions == transferPositions, "FindActivityTree positions");
+
+    positions.clear();
+    Verify(0 == index.FindActivity(OtherId, positions), "FindActivity unknown");
+    Verify(0 == index.FindActivityTree(OtherId, positions), "FindActivityTree unknown");
+    Verify(positions.empty(), "unknown activity has no positions");
+
+    // Save and Load.
+    auto const indexPath = dataDir + "/activity-index.actidx";
+    EventActivityIndex loaded;
+    Verify(0 == index.Save(indexPath.c_str()), "Save");
+    Verify(0 == loaded.Load(indexPath.c_str(), file), "Load");
+    Verify(0 == loaded.FindActivity(OtherId, positions), "loaded FindActivity unknown");
+    Verify(4 == loaded.FindActivity(ActivityId, positions) && positions == transferPositions,
+        "loaded FindActivity");
+
+    // Pipe-mode files can't be indexed, and the index doesn't match them.
+    PerfDataFile pipe;
+    auto const pipePath = dataDir + "/pipe.data";
+    Verify(0 == pipe.OpenMapped(pipePath.c_str()), "OpenMapped pipe");
+    Verify(ENOTSUP == loaded.Build(pipe), "Build pipe");
+    Verify(loaded.Events().empty(), "Build pipe clears the index");
+    Verify(ESTALE == loaded.Load(indexPath.c_str(), pipe), "Load for a different file");
+    Verify(ENOENT == loaded.Load((indexPath + ".missing").c_str(), file), "Load missing");
+}
+
+// A sample's values as decoded from the row (with EventEnumerator), for
+// comparison with the columnar output.
+struct ExpectedRow
+{
+    // A field value and the index of its column.
+    template<class T>
+    struct Field
+    {
+        unsigned columnIndex;
+        std::string name;
+        T value;
+    };
+
+    std::string tracepointName;
+    uint64_t time;
+    uint32_t cpu;
+    uint32_t pid;
+    uint32_t tid;
+    std::vector<Field<uint64_t>> ints; // Integer fields, zero-extended.
+    std::vector<Field<std::string>> texts; // Activity IDs and ASCII char8 strings.
+    bool matched;
+};
+
+// Returns the activity ID in the usual UUID text form.
+static std::string
+UuidText(uint8_t const* uuid)
+{
+    char text[37];
+    snprintf(text, sizeof(text),
+        "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
+        uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+    return text;
+}
+
+// Decodes the sample's time, cpu, pid, tid, activity IDs, and the top-level
+// fields that have an obvious expected column value.
+static ExpectedRow
+DecodeExpectedRow(EventEnumerator& enumerator, PerfSampleEventInfo const& info)
+{
+    auto const sampleType = info.SampleType();
+    ExpectedRow row = {};
+    row.time = (sampleType & PERF_SAMPLE_TIME) ? info.time : 0u;
+    row.cpu = (sampleType & PERF_SAMPLE_CPU) ? info.cpu : 0u;
+    row.pid = (sampleType & PERF_SAMPLE_TID) ? info.pid : 0u;
+    row.tid = (sampleType & PERF_SAMPLE_TID) ? info.tid : 0u;
+
+    if (!StartSample(enumerator, info))
+    {
+        row.tracepointName = info.Name();
+        return row;
+    }
+
+    auto const eventInfo = enumerator.GetEventInfo();
+    row.tracepointName.assign(eventInfo.TracepointName, eventInfo.TracepointNameLength);
+
+    unsigned columnIndex = 4; // After time, cpu, pid, tid.
+    if (eventInfo.ActivityId)
+    {
+        row.texts.push_back({ columnIndex++, "activity", UuidText(eventInfo.ActivityId) });
+    }
+
+    if (eventInfo.RelatedActivityId)
+    {
+        row.texts.push_back({ columnIndex++, "relatedActivity", UuidText(eventInfo.RelatedActivityId) });
+    }
+
+    for (enumerator.MoveNext();
+        enumerator.State() > EventEnumeratorState_AfterLastItem;
+        enumerator.MoveNextSibling(), columnIndex += 1)
+    {
+        if (enumerator.State() != EventEnumeratorState_Value)
+        {
+            continue;
+        }
+
+        auto const item = enumerator.GetItemInfo();
+        Verify(!item.NeedByteSwap, "test expects host byte order");
+        switch (item.Encoding)
+        {
+        default:
+            break;
+
+        case event_field_encoding_value8:
+        case event_field_encoding_value16:
+        case event_field_encoding_value32:
+        case event_field_encoding_value64:
+            switch (item.Format)
+            {
+            default:
+                break;
+            case event_field_format_default:
+            case event_field_format_unsigned_int:
+            case event_field_format_signed_int:
+            case event_field_format_hex_int:
+            case event_field_format_errno:
+            case event_field_format_pid:
+            case event_field_format_time:
+            case event_field_format_boolean:
+                uint64_t value = 0;
+                memcpy(&value, item.ValueData, item.ValueSize);
+                row.ints.push_back({ columnIndex, item.Name, value });
+                break;
+            }
+            break;
+
+        case event_field_encoding_zstring_char8:
+        case event_field_encoding_string_length16_char8:
+            if (item.Format == event_field_format_default ||
+                item.Format == event_field_format_string8 ||
+                item.Format == event_field_format_string_utf)
+            {
+                auto const chars = static_cast<char const*>(item.ValueData);
+                if (std::all_of(chars, chars + item.ValueSize, [](char ch) { return ch >= 0x20 && ch < 0x7F; }))
+                {
+                    row.texts.push_back({ columnIndex, item.Name, std::string(chars, item.ValueSize) });
+                }
+            }
+            break;
+        }
+    }
+
+    Verify(enumerator.State() == EventEnumeratorState_AfterLastItem, "enumerate sample");
+    return row;
+}
+
+// Reads values from columnar output, checking bounds.
+class ColumnarReader
+{
+    std::string const& m_data;
+    size_t m_pos;
+    size_t m_end;
+
+public:
+
+    ColumnarReader(std::string const& data, size_t pos, size_t end)
+        : m_data(data)
+        , m_pos(pos)
+        , m_end(end)
+    {
+        Verify(pos <= end && end <= data.size(), "columnar range");
+    }
+
+    size_t
+    Pos() const noexcept
+    {
+        return m_pos;
+    }
+
+    std::string
+    ReadBytes(size_t size)
+    {
+        Verify(m_end - m_pos >= size, "columnar data truncated");
+        auto const pos = m_pos;
+        m_pos += size;
+        return m_data.substr(pos, size);
+    }
+
+    template<class T>
+    T
+    Read()
+    {
+        T value;
+        auto const bytes = ReadBytes(sizeof(value));
+        memcpy(&value, bytes.data(), sizeof(value));
+        return value;
+    }
+
+    std::string
+    ReadStr()
+    {
+        return ReadBytes(Read<uint16_t>());
+    }
+};
+
+// A column of a batch read from columnar output.
+struct ParsedColumn
+{
+    std::string name;
+    EventColumnType type;
+    std::string data;
+
+    // Returns the value size of a fixed-size column, or 0.
+    unsigned
+    ValueSize() const noexcept
+    {
+        switch (type)
+        {
+        case EventColumnType_Int8: case EventColumnType_UInt8: return 1;
+        case EventColumnType_Int16: case EventColumnType_UInt16: return 2;
+        case EventColumnType_Int32: case EventColumnType_UInt32: case EventColumnType_Float32: return 4;
+        case EventColumnType_Int64: case EventColumnType_UInt64: case EventColumnType_Float64: return 8;
+        default: return 0;
+        }
+    }
+
+    // Returns the row's value of an integer column, zero-extended.
+    uint64_t
+    IntValue(uint32_t row) const
+    {
+        auto const size = ValueSize();
+        Verify(type >= EventColumnType_Int8 && type <= EventColumnType_UInt64, "integer column");
+        Verify(data.size() >= (row + 1u) * size_t(size), "integer column size");
+        uint64_t value = 0;
+        memcpy(&value, data.data() + row * size_t(size), size);
+        return value;
+    }
+
+    // Returns the row's value of a Utf8 or Json column.
+    std::string
+    TextValue(uint32_t rowCount, uint32_t row) const
+    {
+        Verify(type == EventColumnType_Utf8 || type == EventColumnType_Json, "text column");
+        auto const offsetsSize = (rowCount + 1u) * sizeof(uint32_t);
+        Verify(data.size() >= offsetsSize, "text column offsets");
+        uint32_t offsets[2];
+        memcpy(offsets, data.data() + row * sizeof(uint32_t), sizeof(offsets));
+        Verify(offsets[0] <= offsets[1] && offsets[1] <= data.size() - offsetsSize, "text column offset range");
+        return data.substr(offsetsSize + offsets[0], offsets[1] - offsets[0]);
+    }
+};
+
+// The columnar output for perf.data has the same values as decoding each sample.
+static void
+TestColumnar(std::string const& dataDir)
+{
+    auto const path = dataDir + "/perf.data";
+    PerfDataFile file;
+    Verify(0 == file.Open(path.c_str()), "Open");
+
+    EventEnumerator enumerator;
+    EventColumnarWriter writer;
+    PerfSampleEventInfo info;
+    std::vector<ExpectedRow> expectedRows;
+    std::string columnar;
+    EventColumnarWriter::AppendFileHeader(columnar);
+
+    for (;;)
+    {
+        perf_event_header const* header;
+        Verify(0 == file.ReadEvent(&header), "ReadEvent");
+        if (header == nullptr)
+        {
+            break;
+        }
+
+        if (header->type == PERF_RECORD_SAMPLE)
+        {
+            Verify(0 == file.GetSampleEventInfo(header, &info), "GetSampleEventInfo");
+            Verify(0 == writer.AddSample(columnar, info, file.FileBigEndian()), "AddSample");
+            expectedRows.push_back(DecodeExpectedRow(enumerator, info));
+        }
+    }
+
+    writer.Flush(columnar);
+
+    unsigned multiRowBatches = 0;
+    unsigned comparedInts = 0;
+    unsigned comparedTexts = 0;
+    ColumnarReader reader(columnar, 0, columnar.size());
+    Verify(reader.ReadBytes(8) == "EHColumn", "Magic");
+    Verify(reader.Read<uint32_t>() == 1, "Version");
+    Verify(reader.Read<uint32_t>() == 0, "Reserved");
+    while (reader.Pos() != columnar.size())
+    {
+        auto const batchSize = reader.Read<uint32_t>();
+        ColumnarReader batch(columnar, reader.Pos(), reader.Pos() + batchSize);
+        reader.ReadBytes(batchSize);
+
+        auto const rowCount = batch.Read<uint32_t>();
+        auto const columnCount = batch.Read<uint16_t>();
+        auto const tracepointName = batch.ReadStr();
+        batch.ReadStr(); // EventName
+        batch.ReadBytes(16); // Flags, Version, Id, Tag, Opcode, Level, Keyword
+
+        std::vector<ParsedColumn> columns(columnCount);
+        for (auto& column : columns)
+        {
+            column.name = batch.ReadStr();
+            column.type = static_cast<EventColumnType>(batch.Read<uint8_t>());
+            batch.ReadBytes(4); // Encoding, Format, FieldTag
+            column.data = batch.ReadBytes(batch.Read<uint32_t>());
+        }
+
+        Verify(batch.Pos() == reader.Pos(), "batch size");
+        Verify(columnCount >= 4 &&
+            columns[0].name == "time" && columns[1].name == "cpu" &&
+            columns[2].name == "pid" && columns[3].name == "tid", "standard columns");
+        multiRowBatches += rowCount > 1;
+
+        for (uint32_t row = 0; row != rowCount; row += 1)
+        {
+            // Rows are matched to samples by name, time, cpu, pid, and tid.
+            auto const expected = std::find_if(expectedRows.begin(), expectedRows.end(),
+                [&](ExpectedRow const& e)
+                {
+                    return !e.matched &&
+                        e.tracepointName == tracepointName &&
+                        e.time == columns[0].IntValue(row) &&
+                        e.cpu == columns[1].IntValue(row) &&
+                        e.pid == columns[2].IntValue(row) &&
+                        e.tid == columns[3].IntValue(row);
+                });
+            Verify(expected != expectedRows.end(), "row matches a sample");
+            expected->matched = true;
+
+            for (auto const& field : expected->ints)
+            {
+                Verify(field.columnIndex < columnCount, "integer column index");
+                auto const& column = columns[field.columnIndex];
+                Verify(column.name == field.name, "integer column name");
+                Verify(column.IntValue(row) == field.value, "integer column value");
+                comparedInts += 1;
+            }
+
+            for (auto const& field : expected->texts)
+            {
+                Verify(field.columnIndex < columnCount, "text column index");
+                auto const& column = columns[field.columnIndex];
+                Verify(column.name == field.name, "text column name");
+                Verify(column.TextValue(rowCount, row) == field.value, "text column value");
+                comparedTexts += 1;
+            }
+        }
+    }
+
+    Verify(std::all_of(expectedRows.begin(), expectedRows.end(),
+        [](ExpectedRow const& e) { return e.matched; }), "every sample has a row");
+    Verify(multiRowBatches != 0, "some batches have several rows");
+    Verify(comparedInts >= 100, "integer fields compared");
+    Verify(comparedTexts >= 10, "text fields compared");
+}
+
+struct TestEntry
+{
+    char const* name;
+    void (*fn)(std::string const& dataDir);
+};
+
+static TestEntry const Tests[] = {
+    { "activity-index", TestActivityIndex },
+    { "columnar", TestColumnar },
+};
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stdout, "Usage: %s <dataDir> <testName>\n", argv[0]);
+        return 1;
+    }
+
+    for (auto const& test : Tests)
+    {
+        if (0 == strcmp(test.name, argv[2]))
+        {
+            try
+            {
+                test.fn(argv[1]);
+                return 0;
+            }
+            catch (std::exception const& ex)
+            {
+                fprintf(stdout, "\nERROR: %s: %s\n", test.name, ex.what());
+                return 1;
+            }
+        }
+    }
+
+    fprintf(stdout, "Unknown test: %s\n", argv[2]);
+    return 1;
+}
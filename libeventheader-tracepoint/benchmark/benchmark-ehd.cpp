@@ -0,0 +1,112 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Benchmarks for the EventHeaderDynamic.h API (ehd::EventBuilder).
+*/
+
+#include "benchmark.h"
+#include <eventheader/EventHeaderDynamic.h>
+#include <memory>
+
+// All events use level 4 (information), keyword 1 => "BenchEhd_L4K1".
+static std::unique_ptr<ehd::Provider> s_provider;
+static std::shared_ptr<ehd::EventSet const> s_eventSet;
+static ehd::EventBuilder s_builder; // Reused, as recommended for performance.
+
+static void
+Register()
+{
+    s_provider = std::make_unique<ehd::Provider>("BenchEhd");
+    s_eventSet = s_provider->RegisterSet(event_level_information, 1);
+}
+
+static void
+Unregister()
+{
+    s_eventSet.reset();
+    s_provider.reset();
+}
+
+static void
+Run0(size_t iterations)
+{
+    auto const& eventSet = s_eventSet;
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        if (Enabled(eventSet))
+        {
+            s_builder.Reset("Fields0")
+                .Write(*eventSet);
+        }
+    }
+}
+
+static void
+Run1(size_t iterations)
+{
+    auto const& eventSet = s_eventSet;
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        if (Enabled(eventSet))
+        {
+            s_builder.Reset("Fields1")
+                .AddValue("f0", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .Write(*eventSet);
+        }
+    }
+}
+
+static void
+Run4(size_t iterations)
+{
+    auto const& eventSet = s_eventSet;
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        if (Enabled(eventSet))
+        {
+            s_builder.Reset("Fields4")
+                .AddValue("f0", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddValue("f1", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddValue("f2", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddValue("f3", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .Write(*eventSet);
+        }
+    }
+}
+
+static void
+Run8(size_t iterations)
+{
+    auto const& eventSet = s_eventSet;
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        if (Enabled(eventSet))
+        {
+            s_builder.Reset("Fields8")
+                .AddValue("f0", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddValue("f1", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddValue("f2", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddValue("f3", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddValue("f4", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddValue("f5", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddValue("f6", static_cast<uint32_t>(g_benchmarkValue), event_field_format_default)
+                .AddNulTerminatedString("f7", std::string_view("string"), event_field_format_default)
+                .Write(*eventSet);
+        }
+    }
+}
+
+static BenchmarkCase const s_cases[] = {
+    { "ehd::EventBuilder", 0, "BenchEhd_L4K1", Run0 },
+    { "ehd::EventBuilder", 1, "BenchEhd_L4K1", Run1 },
+    { "ehd::EventBuilder", 4, "BenchEhd_L4K1", Run4 },
+    { "ehd::EventBuilder", 8, "BenchEhd_L4K1", Run8 },
+};
+
+BenchmarkGroup const g_ehdBenchmarks = {
+    Register,
+    Unregister,
+    s_cases,
+    sizeof(s_cases) / sizeof(s_cases[0]),
+};
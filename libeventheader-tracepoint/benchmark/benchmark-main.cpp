@@ -0,0 +1,289 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Measures ns/event and allocations/event for the provider APIs.
+
+Built twice from the same sources:
+
+- eventheader-provider-benchmark links against libtracepoint. It measures each
+  event disabled (the enabled-check path) and then, if it can enable the
+  user_events tracepoints through tracefs (usually requires root), enabled
+  (the full path including the user_events write).
+- eventheader-provider-benchmark-null links against tracepoint-null.cpp, where
+  every event is enabled and writes are discarded. It measures the enabled
+  path without the system call.
+
+Results are written to stdout as JSON lines, one object per benchmark, e.g.:
+
+{"api":"TraceLoggingWrite","fields":4,"sink":"user_events","state":"disabled",
+ "iterations":1000000,"repetitions":5,"ns_min":0.9,"ns_median":1.0,"allocs":0}
+
+Allocations are counted by replacing the global operator new, so malloc calls
+from C code are not included.
+*/
+
+#include "benchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef BENCHMARK_SINK
+#define BENCHMARK_SINK "user_events"
+#endif
+#ifndef BENCHMARK_ALWAYS_ENABLED
+#define BENCHMARK_ALWAYS_ENABLED 0
+#endif
+
+volatile uint32_t g_benchmarkValue = 1;
+
+static std::atomic<size_t> s_allocCount(0);
+
+void*
+operator new(size_t size)
+{
+    s_allocCount.fetch_add(1, std::memory_order_relaxed);
+    auto const p = malloc(size ? size : 1);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void*
+operator new(size_t size, std::nothrow_t const&) noexcept
+{
+    s_allocCount.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+void
+operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void
+operator delete(void* p, std::nothrow_t const&) noexcept
+{
+    free(p);
+}
+
+static BenchmarkGroup const* const Groups[] = {
+    &g_tracepointBenchmarks,
+    &g_tppBenchmarks,
+    &g_traceLoggingBenchmarks,
+    &g_ehdBenchmarks,
+};
+
+struct Options
+{
+    size_t Iterations = 1000000;
+    unsigned Repetitions = 5;
+    char const* Filter = nullptr;
+    bool Enable = true;
+};
+
+static uint64_t
+NowNs() noexcept
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// Sets the tracefs "enable" file for user_events:tracepointName.
+// Returns 0 for success, errno for error.
+static int
+SetTracefsEnable(char const* tracepointName, bool enable) noexcept
+{
+    static char const* const TracingDirs[] = {
+        "/sys/kernel/tracing",
+        "/sys/kernel/debug/tracing",
+    };
+
+    int error = ENOENT;
+    for (auto const dir : TracingDirs)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/events/user_events/%s/enable", dir, tracepointName);
+        auto const file = open(path, O_WRONLY | O_CLOEXEC);
+        if (file < 0)
+        {
+            error = errno;
+            continue;
+        }
+
+        error = 1 == write(file, enable ? "1" : "0", 1) ? 0 : errno;
+        close(file);
+        break;
+    }
+
+    return error;
+}
+
+static void
+RunCase(
+    Options const& options,
+    BenchmarkCase const& c,
+    char const* state)
+{
+    std::vector<double> nsPerEvent;
+    nsPerEvent.reserve(options.Repetitions);
+
+    c.Run(options.Iterations / 10 + 1); // Warm up (also performs any first-use allocations).
+
+    auto const allocsBefore = s_allocCount.load(std::memory_order_relaxed);
+    for (unsigned rep = 0; rep != options.Repetitions; rep += 1)
+    {
+        auto const start = NowNs();
+        c.Run(options.Iterations);
+        auto const stop = NowNs();
+        nsPerEvent.push_back(static_cast<double>(stop - start) / static_cast<double>(options.Iterations));
+    }
+    auto const allocs = s_allocCount.load(std::memory_order_relaxed) - allocsBefore;
+
+    std::sort(nsPerEvent.begin(), nsPerEvent.end());
+    printf("{\"api\":\"%s\",\"fields\":%u,\"sink\":\"%s\",\"state\":\"%s\","
+        "\"iterations\":%zu,\"repetitions\":%u,"
+        "\"ns_min\":%.3f,\"ns_median\":%.3f,\"allocs\":%.3f}\n",
+        c.Api, c.FieldCount, BENCHMARK_SINK, state,
+        options.Iterations, options.Repetitions,
+        nsPerEvent.front(), nsPerEvent[nsPerEvent.size() / 2],
+        static_cast<double>(allocs) / (static_cast<double>(options.Iterations) * options.Repetitions));
+    fflush(stdout);
+}
+
+static void
+PrintSkipped(
+    BenchmarkCase const& c,
+    char const* state,
+    int error)
+{
+    printf("{\"api\":\"%s\",\"fields\":%u,\"sink\":\"%s\",\"state\":\"%s\","
+        "\"skipped\":\"%s\"}\n",
+        c.Api, c.FieldCount, BENCHMARK_SINK, state,
+        strerror(error));
+    fflush(stdout);
+}
+
+static void
+Usage(char const* programName)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Measures ns/event and allocations/event for the provider APIs.\n"
+        "Results are written to stdout as JSON lines.\n"
+        "Options:\n"
+        "  -i N       Events per repetition (default 1000000).\n"
+        "  -r N       Repetitions per benchmark (default 5).\n"
+        "  -f TEXT    Only run benchmarks whose API name contains TEXT.\n"
+        "  -n         Do not try to enable the tracepoints through tracefs.\n",
+        programName);
+}
+
+int
+main(int argc, char* argv[])
+{
+    Options options;
+    for (int argi = 1; argi < argc; argi += 1)
+    {
+        auto const arg = argv[argi];
+        bool const hasValue = argi + 1 < argc;
+        if (0 == strcmp(arg, "-i") && hasValue)
+        {
+            argi += 1;
+            options.Iterations = strtoul(argv[argi], nullptr, 0);
+        }
+        else if (0 == strcmp(arg, "-r") && hasValue)
+        {
+            argi += 1;
+            options.Repetitions = static_cast<unsigned>(strtoul(argv[argi], nullptr, 0));
+        }
+        else if (0 == strcmp(arg, "-f") && hasValue)
+        {
+            argi += 1;
+            options.Filter = argv[argi];
+        }
+        else if (0 == strcmp(arg, "-n"))
+        {
+            options.Enable = false;
+        }
+        else
+        {
+            Usage(argv[0]);
+            return 0 == strcmp(arg, "-h") || 0 == strcmp(arg, "--help") ? 0 : 1;
+        }
+    }
+
+    if (options.Iterations == 0 || options.Repetitions == 0)
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    for (auto const group : Groups)
+    {
+        group->Register();
+    }
+
+    for (auto const group : Groups)
+    {
+        for (size_t i = 0; i != group->CaseCount; i += 1)
+        {
+            auto const& c = group->Cases[i];
+            if (options.Filter != nullptr && nullptr == strstr(c.Api, options.Filter))
+            {
+                continue;
+            }
+
+            if (BENCHMARK_ALWAYS_ENABLED)
+            {
+                RunCase(options, c, "enabled");
+                continue;
+            }
+
+            RunCase(options, c, "disabled");
+
+            if (options.Enable)
+            {
+                auto const error = SetTracefsEnable(c.TracepointName, true);
+                if (error != 0)
+                {
+                    PrintSkipped(c, "enabled", error);
+                }
+                else
+                {
+                    RunCase(options, c, "enabled");
+                    SetTracefsEnable(c.TracepointName, false);
+                }
+            }
+        }
+    }
+
+    for (auto const group : Groups)
+    {
+        group->Unregister();
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Benchmarks for the tracepoint-provider.h API (TPP_FUNCTION).
+*/
+
+#include "benchmark.h"
+#include <tracepoint/tracepoint-ext.h>
+#include <tracepoint/tracepoint-provider.h>
+
+TPP_DEFINE_PROVIDER(BenchTppProvider);
+
+TPP_FUNCTION(BenchTppProvider, "BenchTpp_f0", BenchTpp_f0);
+TPP_FUNCTION(BenchTppProvider, "BenchTpp_f1", BenchTpp_f1,
+    TPP_UINT32("f0", f0));
+TPP_FUNCTION(BenchTppProvider, "BenchTpp_f4", BenchTpp_f4,
+    TPP_UINT32("f0", f0),
+    TPP_UINT32("f1", f1),
+    TPP_UINT32("f2", f2),
+    TPP_UINT32("f3", f3));
+TPP_FUNCTION(BenchTppProvider, "BenchTpp_f8", BenchTpp_f8,
+    TPP_UINT32("f0", f0),
+    TPP_UINT32("f1", f1),
+    TPP_UINT32("f2", f2),
+    TPP_UINT32("f3", f3),
+    TPP_UINT32("f4", f4),
+    TPP_UINT32("f5", f5),
+    TPP_UINT32("f6", f6),
+    TPP_STRING("f7", f7));
+TPP_FUNCTION_PACKED(BenchTppProvider, "BenchTppPacked_f1", BenchTppPacked_f1,
+    TPP_UINT32("f0", f0));
+TPP_FUNCTION_PACKED(BenchTppProvider, "BenchTppPacked_f4", BenchTppPacked_f4,
+    TPP_UINT32("f0", f0),
+    TPP_UINT32("f1", f1),
+    TPP_UINT32("f2", f2),
+    TPP_UINT32("f3", f3));
+
+static void
+Register()
+{
+    TPP_REGISTER_PROVIDER(BenchTppProvider);
+}
+
+static void
+Unregister()
+{
+    TPP_UNREGISTER_PROVIDER(BenchTppProvider);
+}
+
+static void
+Run0(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        BenchTpp_f0();
+    }
+}
+
+static void
+Run1(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        BenchTpp_f1(g_benchmarkValue);
+    }
+}
+
+static void
+Run4(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        BenchTpp_f4(g_benchmarkValue, g_benchmarkValue, g_benchmarkValue, g_benchmarkValue);
+    }
+}
+
+static void
+Run8(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        BenchTpp_f8(g_benchmarkValue, g_benchmarkValue, g_benchmarkValue, g_benchmarkValue,
+            g_benchmarkValue, g_benchmarkValue, g_benchmarkValue, "string");
+    }
+}
+
+static void
+RunPacked1(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        BenchTppPacked_f1(g_benchmarkValue);
+    }
+}
+
+static void
+RunPacked4(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        BenchTppPacked_f4(g_benchmarkValue, g_benchmarkValue, g_benchmarkValue, g_benchmarkValue);
+    }
+}
+
+static BenchmarkCase const s_cases[] = {
+    { "TPP_FUNCTION", 0, "BenchTpp_f0", Run0 },
+    { "TPP_FUNCTION", 1, "BenchTpp_f1", Run1 },
+    { "TPP_FUNCTION", 4, "BenchTpp_f4", Run4 },
+    { "TPP_FUNCTION", 8, "BenchTpp_f8", Run8 },
+    { "TPP_FUNCTION_PACKED", 1, "BenchTppPacked_f1", RunPacked1 },
+    { "TPP_FUNCTION_PACKED", 4, "BenchTppPacked_f4", RunPacked4 },
+};
+
+BenchmarkGroup const g_tppBenchmarks = {
+    Register,
+    Unregister,
+    s_cases,
+    sizeof(s_cases) / sizeof(s_cases[0]),
+};
@@ -0,0 +1,99 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Benchmarks for the TraceLoggingProvider.h API (TraceLoggingWrite).
+*/
+
+#include "benchmark.h"
+#include <eventheader/TraceLoggingProvider.h>
+
+// All events use level 4 (information), keyword 1 => "BenchTlg_L4K1".
+TRACELOGGING_DEFINE_PROVIDER(
+    BenchTlgProvider,
+    "BenchTlg",
+    // {a5b3c1f7-9d2e-4f60-8b1a-3c4d5e6f7081}
+    (0xa5b3c1f7, 0x9d2e, 0x4f60, 0x8b, 0x1a, 0x3c, 0x4d, 0x5e, 0x6f, 0x70, 0x81));
+
+static void
+Register()
+{
+    TraceLoggingRegister(BenchTlgProvider);
+}
+
+static void
+Unregister()
+{
+    TraceLoggingUnregister(BenchTlgProvider);
+}
+
+static void
+Run0(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        TraceLoggingWrite(BenchTlgProvider, "Fields0",
+            TraceLoggingLevel(event_level_information),
+            TraceLoggingKeyword(1));
+    }
+}
+
+static void
+Run1(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        TraceLoggingWrite(BenchTlgProvider, "Fields1",
+            TraceLoggingLevel(event_level_information),
+            TraceLoggingKeyword(1),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f0"));
+    }
+}
+
+static void
+Run4(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        TraceLoggingWrite(BenchTlgProvider, "Fields4",
+            TraceLoggingLevel(event_level_information),
+            TraceLoggingKeyword(1),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f0"),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f1"),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f2"),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f3"));
+    }
+}
+
+static void
+Run8(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        TraceLoggingWrite(BenchTlgProvider, "Fields8",
+            TraceLoggingLevel(event_level_information),
+            TraceLoggingKeyword(1),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f0"),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f1"),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f2"),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f3"),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f4"),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f5"),
+            TraceLoggingUInt32(static_cast<uint32_t>(g_benchmarkValue), "f6"),
+            TraceLoggingString("string", "f7"));
+    }
+}
+
+static BenchmarkCase const s_cases[] = {
+    { "TraceLoggingWrite", 0, "BenchTlg_L4K1", Run0 },
+    { "TraceLoggingWrite", 1, "BenchTlg_L4K1", Run1 },
+    { "TraceLoggingWrite", 4, "BenchTlg_L4K1", Run4 },
+    { "TraceLoggingWrite", 8, "BenchTlg_L4K1", Run8 },
+};
+
+BenchmarkGroup const g_traceLoggingBenchmarks = {
+    Register,
+    Unregister,
+    s_cases,
+    sizeof(s_cases) / sizeof(s_cases[0]),
+};
@@ -0,0 +1,75 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Benchmarks for the low-level tracepoint.h API (TRACEPOINT_ENABLED +
+tracepoint_write).
+*/
+
+#include "benchmark.h"
+#include <tracepoint/tracepoint.h>
+
+static tracepoint_provider_state s_provider = TRACEPOINT_PROVIDER_STATE_INIT;
+static tracepoint_state s_event1 = TRACEPOINT_STATE_INIT;
+static tracepoint_state s_event4 = TRACEPOINT_STATE_INIT;
+
+static void
+Register()
+{
+    tracepoint_open_provider(&s_provider);
+    tracepoint_connect(&s_event1, &s_provider, "BenchRaw_f1 u32 f0");
+    tracepoint_connect(&s_event4, &s_provider, "BenchRaw_f4 u32 f0; u32 f1; u32 f2; u32 f3");
+}
+
+static void
+Unregister()
+{
+    tracepoint_close_provider(&s_provider);
+}
+
+static void
+Run1(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        if (TRACEPOINT_ENABLED(&s_event1))
+        {
+            uint32_t f0 = g_benchmarkValue;
+            struct iovec vecs[2] = {
+                { nullptr, 0 },
+                { &f0, sizeof(f0) } };
+            tracepoint_write(&s_event1, 2, vecs);
+        }
+    }
+}
+
+static void
+Run4(size_t iterations)
+{
+    for (size_t i = 0; i != iterations; i += 1)
+    {
+        if (TRACEPOINT_ENABLED(&s_event4))
+        {
+            uint32_t f[4] = { g_benchmarkValue, g_benchmarkValue, g_benchmarkValue, g_benchmarkValue };
+            struct iovec vecs[5] = {
+                { nullptr, 0 },
+                { &f[0], sizeof(f[0]) },
+                { &f[1], sizeof(f[1]) },
+                { &f[2], sizeof(f[2]) },
+                { &f[3], sizeof(f[3]) } };
+            tracepoint_write(&s_event4, 5, vecs);
+        }
+    }
+}
+
+static BenchmarkCase const s_cases[] = {
+    { "tracepoint_write", 1, "BenchRaw_f1", Run1 },
+    { "tracepoint_write", 4, "BenchRaw_f4", Run4 },
+};
+
+BenchmarkGroup const g_tracepointBenchmarks = {
+    Register,
+    Unregister,
+    s_cases,
+    sizeof(s_cases) / sizeof(s_cases[0]),
+};
@@ -0,0 +1,48 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Declarations shared by the eventheader-provider-benchmark sources.
+
+Each provider API (tracepoint.h, tracepoint-provider.h, TraceLoggingProvider.h,
+EventHeaderDynamic.h) is benchmarked in its own source file so that the
+provider macros of the different APIs do not interact. Each source file
+provides a BenchmarkGroup with functions to register and unregister its
+providers and a list of BenchmarkCase items.
+*/
+
+#pragma once
+#ifndef _included_benchmark_h
+#define _included_benchmark_h 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct BenchmarkCase
+{
+    char const* Api;            // e.g. "TraceLoggingWrite"
+    unsigned FieldCount;        // Number of fields in the event.
+    char const* TracepointName; // user_events tracepoint name (without "user_events:").
+    void (*Run)(size_t iterations); // Writes the event iterations times.
+};
+
+struct BenchmarkGroup
+{
+    void (*Register)();
+    void (*Unregister)();
+    BenchmarkCase const* Cases;
+    size_t CaseCount;
+};
+
+/*
+Values used as event field values. Volatile so that the compiler cannot
+precompute the event payload.
+*/
+extern volatile uint32_t g_benchmarkValue;
+
+extern BenchmarkGroup const g_tracepointBenchmarks;  // benchmark-tracepoint.cpp
+extern BenchmarkGroup const g_tppBenchmarks;         // benchmark-tpp.cpp
+extern BenchmarkGroup const g_traceLoggingBenchmarks; // benchmark-tracelogging.cpp
+extern BenchmarkGroup const g_ehdBenchmarks;         // benchmark-ehd.cpp
+
+#endif // _included_benchmark_h
@@ -0,0 +1,236 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+tracepoint-null is an implementation of the tracepoint.h interface in which
+every connected tracepoint is enabled and tracepoint_write discards the event
+without a system call. This is part of the eventheader-provider-benchmark-null
+program, which uses it to measure the cost of the provider APIs' enabled
+paths (argument packing, header construction) separately from the cost of
+the user_events write.
+*/
+
+#include <tracepoint/tracepoint.h>
+#include <tracepoint/tracepoint-ext.h>
+#include <tracepoint/tracepoint-impl.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <mutex>
+
+static std::mutex s_mutex; // Guards access to any tracepoint_provider_state.
+static int s_nullFile = -1;
+static unsigned s_nullFileRefCount = 0;
+static int s_nextWriteIndex = 0;
+
+// Total bytes "written". Keeps the compiler from discarding the payload.
+static size_t volatile s_bytesWritten = 0;
+
+void
+tracepoint_close_provider(tracepoint_provider_state* providerState)
+{
+    int fileToClose = -1;
+
+    // Scope for lock.
+    {
+        auto lock = std::lock_guard<std::mutex>(s_mutex);
+
+        if (providerState->data_file != -1)
+        {
+            assert(s_nullFileRefCount != 0);
+            s_nullFileRefCount -= 1;
+            if (s_nullFileRefCount == 0)
+            {
+                fileToClose = s_nullFile;
+                s_nullFile = -1;
+            }
+        }
+
+        tracepoint_close_provider_impl(providerState);
+    }
+
+    if (fileToClose != -1)
+    {
+        close(fileToClose);
+    }
+}
+
+int
+tracepoint_open_provider(tracepoint_provider_state* providerState)
+{
+    int err;
+    auto lock = std::lock_guard<std::mutex>(s_mutex);
+
+    if (providerState->data_file != -1)
+    {
+        assert(providerState->data_file == -1); // PRECONDITION
+        abort(); // PRECONDITION
+    }
+
+    if (s_nullFile == -1)
+    {
+        // Never written. Gives providers a real file descriptor.
+        s_nullFile = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (s_nullFile == -1)
+        {
+            err = errno;
+            goto Done;
+        }
+    }
+
+    s_nullFileRefCount += 1;
+    tracepoint_open_provider_impl(providerState, s_nullFile);
+    err = 0;
+
+Done:
+
+    return err;
+}
+
+int
+tracepoint_connect(
+    tracepoint_state* eventState,
+    tracepoint_provider_state* providerState,
+    char const* /*eventNameArgs*/)
+{
+    auto lock = std::lock_guard<std::mutex>(s_mutex);
+
+    if (providerState == NULL)
+    {
+        tracepoint_connect_impl(eventState, NULL, -1);
+    }
+    else
+    {
+        tracepoint_connect_impl(eventState, providerState, s_nextWriteIndex);
+        s_nextWriteIndex += 1;
+
+        // Events are always enabled.
+        __atomic_store_n(&eventState->status_word, 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+int
+tracepoint_open_provider_with_tracepoints(
+    tracepoint_provider_state* provider_state,
+    tracepoint_definition const** tp_definition_start,
+    tracepoint_definition const** tp_definition_stop)
+{
+    return tracepoint_open_provider_with_tracepoints_impl(
+        provider_state,
+        tp_definition_start,
+        tp_definition_stop);
+}
+
+int
+tracepoint_write(
+    tracepoint_state const* eventState,
+    unsigned dataCount,
+    struct iovec* dataVecs)
+{
+    assert((int)dataCount >= 1);
+    assert(dataVecs[0].iov_len == 0);
+
+    if (!TRACEPOINT_ENABLED(eventState))
+    {
+        return EBADF;
+    }
+
+    size_t size = sizeof(uint32_t); // write_index
+    for (unsigned i = 1; i < dataCount; i += 1)
+    {
+        size += dataVecs[i].iov_len;
+    }
+
+    s_bytesWritten = s_bytesWritten + size;
+    return 0;
+}
+
+int
+tracepoint_write_packed(
+    tracepoint_state const* eventState,
+    void* data,
+    unsigned dataSize)
+{
+    assert(dataSize >= sizeof(int32_t));
+
+    if (!TRACEPOINT_ENABLED(eventState))
+    {
+        return EBADF;
+    }
+
+    (void)data;
+    s_bytesWritten = s_bytesWritten + dataSize;
+    return 0;
+}
+
+int
+tracepoint_async_start(
+    unsigned /*queueDepth*/,
+    unsigned /*slotSize*/)
+{
+    return ENOTSUP;
+}
+
+void
+tracepoint_async_stop()
+{
+    return;
+}
+
+uint64_t
+tracepoint_async_dropped()
+{
+    return 0;
+}
+
+int
+tracepoint_lazy_connect(int enable)
+{
+    return enable ? ENOTSUP : 0;
+}
+
+void
+tracepoint_lazy_connect_wait()
+{
+    return;
+}
+
+int
+tracepoint_register_enable_bit(
+    tracepoint_provider_state const* providerState,
+    char const* /*eventNameArgs*/,
+    unsigned* enableWord,
+    unsigned enableBit)
+{
+    if (enableBit >= sizeof(*enableWord) * 8)
+    {
+        return EINVAL;
+    }
+
+    auto lock = std::lock_guard<std::mutex>(s_mutex);
+
+    if (providerState->data_file == -1)
+    {
+        return EBADF;
+    }
+
+    // Events are always enabled.
+    __atomic_or_fetch(enableWord, 1u << enableBit, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void
+tracepoint_unregister_enable_bit(
+    unsigned* enableWord,
+    unsigned enableBit)
+{
+    if (enableBit < sizeof(*enableWord) * 8)
+    {
+        __atomic_and_fetch(enableWord, ~(1u << enableBit), __ATOMIC_RELAXED);
+    }
+}
@@ -39,17 +39,12 @@ Notes:
   kernel will ignore any event that is larger than 64KB.
 - All event sets for a provider will become disabled when the provider is
   destroyed or when you call provider.Unregister().
-- The Provider object is not thread-safe, but the EventSet object is
-  thread-safe. Possible strategies for multi-threaded programs might include:
-  - Have a reader-writer lock for the provider. Take an exclusive lock for
-    non-const operations like RegisterSet() and Unregister(). Take a shared
-    lock for other provider operations like FindSet().
-  - Create the provider and do all of the necessary RegisterSet() calls
-    before any other threads start using it. Then you can call the const
-    methods like FindSet() as needed on any thread without any lock as long
-    as nobody is calling any non-const methods.
-  - Use your own thread-safe data structure to keep track of all of the
-    EventSets you need. Take a lock if you ever need to register a new set.
+- The EventSet object is thread-safe. The Provider's RegisterSet(),
+  CreateUnregistered(), FindSet(), and FindSetPtr() methods may be called
+  concurrently from any thread. FindSetPtr() is wait-free and does not
+  touch any reference count, so it is suitable for per-event lookups.
+  Unregister() and the destructor must not run concurrently with any other
+  use of the provider.
 - Each event set maps to one tracepoint name, e.g. if the provider name is
   "MyCompany_MyComponent", level is verbose (5), and keyword is 0x1f, the
   event set will correspond to a tracepont named
@@ -71,7 +66,9 @@ Notes:
 #include "eventheader-tracepoint.h"
 #include <assert.h>
 #include <string.h>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string_view>
 #include <type_traits>
 #include <unordered_map>
@@ -116,6 +113,7 @@ namespace ehd
     eventBuilder.Write(eventSet, ...);
     */
     class EventSet
+        : public std::enable_shared_from_this<EventSet>
     {
         friend class Provider; // Forward declaration
         friend class EventBuilder; // Forward declaration
@@ -183,19 +181,22 @@ namespace ehd
     - Call provider.Unregister() if you want to disconnect the provider before
       it goes out of scope.
 
-    Note that Provider is not thread-safe, but the shared_ptr<EventSet> objects
-    returned by RegisterSet() and FindSet() are thread-safe. Possible ways to
-    safely use a provider in a multi-threaded program:
-
-    - Have a reader-writer lock for the provider. Take an exclusive lock for
-      non-const operations like RegisterSet() and Unregister(). Take a shared
-      lock for other provider operations like FindSet().
-    - Create the provider and do all of the necessary RegisterSet() calls
-      before any other threads start using it. Then you can call the const
-      methods like FindSet() on any thread as needed without any lock as long
-      as nobody is calling any non-const methods.
-    - Use your own thread-safe data structure to keep track of all of the
-      EventSets you need. Take a lock if you ever need to register a new set.
+    - Call provider.FindSetPtr(level, keyword) to get a raw pointer to a
+      previously-registered EventSet, e.g. for a lookup on every event.
+
+    Thread safety: RegisterSet(), CreateUnregistered(), FindSet(), and
+    FindSetPtr() may be called concurrently from any thread. Registration is
+    serialized by an internal mutex. Lookups do not take the mutex: they read
+    a copy-on-write table that registration publishes with release
+    semantics, so FindSetPtr() is wait-free and does no atomic
+    read-modify-write. Unregister() and the destructor must not run
+    concurrently with any other use of the provider.
+
+    The lookup table has a dense array for levels 0..7 with keywords 0..15
+    (one acquire load per lookup) and an open-addressed hash table for other
+    level/keyword combinations. Retired hash tables are kept until
+    Unregister() or destruction so that concurrent readers never see freed
+    memory (the retired tables together are no larger than the current one).
     */
     class Provider
     {
@@ -239,6 +240,29 @@ namespace ehd
 
         using EventSetMap = std::unordered_map<EventKey, std::shared_ptr<EventSet const>, EventKeyOps, EventKeyOps>;
 
+        static unsigned constexpr DenseLevels = 8;
+        static unsigned constexpr DenseKeywords = 16;
+
+        struct LookupEntry
+        {
+            std::atomic<EventSet const*> Set; // nullptr if the entry is empty.
+            uint64_t Keyword; // Written before Set is published.
+            uint8_t Level; // Written before Set is published.
+        };
+
+        // Open-addressed table, at most half full. Entries are only added,
+        // never changed or removed, so readers need no lock.
+        struct LookupTable
+        {
+            size_t Mask; // Entry count - 1. Entry count is a power of 2.
+            size_t Count; // Number of non-empty entries.
+            std::unique_ptr<LookupEntry[]> Entries;
+            std::unique_ptr<LookupTable> Retired; // Previous (smaller) table.
+        };
+
+        std::atomic<EventSet const*> m_denseSets[DenseLevels][DenseKeywords];
+        std::atomic<LookupTable*> m_lookupTable; // Owned. nullptr if no sets outside the dense range.
+        std::mutex m_registerMutex;
         EventSetMap m_eventSets;
         tracepoint_provider_state m_providerState;
         eventheader_provider m_provider;
@@ -253,6 +277,7 @@ namespace ehd
         ~Provider()
         {
             eventheader_close_provider(&m_provider);
+            ClearLookup();
         }
 
         /*
@@ -283,7 +308,10 @@ namespace ehd
         Provider(
             std::string_view providerName,
             std::string_view groupName = std::string_view()) noexcept
-            : m_eventSets()
+            : m_denseSets()
+            , m_lookupTable(nullptr)
+            , m_registerMutex()
+            , m_eventSets()
             , m_providerState(TRACEPOINT_PROVIDER_STATE_INIT)
             , m_provider()
             , m_errno()
@@ -392,11 +420,15 @@ namespace ehd
         Use provider.Unregister() if you want to unregister the provider before it goes
         out of scope. The provider automatically unregisters when it is destroyed so
         most users do not need to call Unregister() directly.
+
+        Must not be called concurrently with any other use of the provider.
+        Pointers returned by FindSetPtr() are invalid after this call.
         */
         void
         Unregister() noexcept
         {
             eventheader_close_provider(&m_provider);
+            ClearLookup();
             m_eventSets.clear();
         }
 
@@ -407,9 +439,48 @@ namespace ehd
         std::shared_ptr<EventSet const>
         FindSet(event_level level, uint64_t keyword) const noexcept
         {
-            EventKey const k = { keyword, static_cast<uint8_t>(level) };
-            auto const it = m_eventSets.find(k);
-            return it == m_eventSets.end() ? std::shared_ptr<EventSet const>() : it->second;
+            auto const set = FindSetPtr(level, keyword);
+            return set ? set->shared_from_this() : std::shared_ptr<EventSet const>();
+        }
+
+        /*
+        If an event set with the specified level and keyword is in the list of
+        already-created sets, returns a pointer to it. Otherwise, returns nullptr.
+
+        Same as FindSet(), but wait-free and without reference counting, for use
+        on hot paths (e.g. once per event from many threads). The returned
+        pointer remains valid until the provider is unregistered or destroyed.
+        */
+        EventSet const*
+        FindSetPtr(event_level level, uint64_t keyword) const noexcept
+        {
+            auto const levelIndex = static_cast<uint8_t>(level);
+            if (levelIndex < DenseLevels && keyword < DenseKeywords)
+            {
+                return m_denseSets[levelIndex][keyword].load(std::memory_order_acquire);
+            }
+
+            auto const table = m_lookupTable.load(std::memory_order_acquire);
+            if (table != nullptr)
+            {
+                EventKey const k = { keyword, levelIndex };
+                for (auto i = EventKeyOps()(k) & table->Mask;; i = (i + 1) & table->Mask)
+                {
+                    auto& entry = table->Entries[i];
+                    auto const set = entry.Set.load(std::memory_order_acquire);
+                    if (set == nullptr)
+                    {
+                        break;
+                    }
+
+                    if (entry.Keyword == keyword && entry.Level == levelIndex)
+                    {
+                        return set;
+                    }
+                }
+            }
+
+            return nullptr;
         }
 
         /*
@@ -426,6 +497,7 @@ namespace ehd
         {
             std::shared_ptr<EventSet const> result;
 
+            std::lock_guard<std::mutex> const lock(m_registerMutex);
             EventKey const k = { keyword, static_cast<uint8_t>(level) };
             std::pair<EventSetMap::iterator, bool> emplace_result;
             try
@@ -459,6 +531,7 @@ namespace ehd
                     created->m_errno = eventheader_connect(&tp, &m_provider);
                 }
 
+                PublishSet(k, created.get()); // May throw bad_alloc.
                 emplace_result.first->second = std::move(created);
                 result = emplace_result.first->second;
             }
@@ -485,6 +558,7 @@ namespace ehd
         {
             std::shared_ptr<EventSet const> result;
 
+            std::lock_guard<std::mutex> const lock(m_registerMutex);
             EventKey const k = { keyword, static_cast<uint8_t>(level) };
             std::pair<EventSetMap::iterator, bool> emplace_result;
             try
@@ -507,6 +581,7 @@ namespace ehd
                 created->m_errno = 0;
                 created->m_tracepointState.status_word = enabled;
 
+                PublishSet(k, created.get()); // May throw bad_alloc.
                 emplace_result.first->second = std::move(created);
                 result = emplace_result.first->second;
             }
@@ -517,6 +592,82 @@ namespace ehd
 
             return result;
         }
+
+    private:
+
+        // Makes set visible to FindSetPtr. Either succeeds or throws bad_alloc
+        // without changing the lookup table.
+        // Requires: m_registerMutex is held, k is not already published.
+        void
+        PublishSet(EventKey const& k, EventSet const* set) noexcept(false)
+        {
+            if (k.Level < DenseLevels && k.Keyword < DenseKeywords)
+            {
+                m_denseSets[k.Level][k.Keyword].store(set, std::memory_order_release);
+                return;
+            }
+
+            auto table = m_lookupTable.load(std::memory_order_relaxed);
+            if (table == nullptr || (table->Count + 1) * 2 > table->Mask + 1)
+            {
+                // Copy into a table with twice as many entries, then publish it.
+                size_t const newSize = table == nullptr ? 16 : (table->Mask + 1) * 2;
+                auto newTable = std::make_unique<LookupTable>(); // May throw bad_alloc.
+                newTable->Mask = newSize - 1;
+                newTable->Count = 0;
+                newTable->Entries = std::make_unique<LookupEntry[]>(newSize); // May throw bad_alloc.
+                if (table != nullptr)
+                {
+                    for (size_t i = 0; i <= table->Mask; i += 1)
+                    {
+                        auto const& entry = table->Entries[i];
+                        auto const entrySet = entry.Set.load(std::memory_order_relaxed);
+                        if (entrySet != nullptr)
+                        {
+                            InsertEntry(*newTable, { entry.Keyword, entry.Level }, entrySet);
+                        }
+                    }
+                }
+
+                newTable->Retired.reset(table);
+                table = newTable.release();
+                m_lookupTable.store(table, std::memory_order_release);
+            }
+
+            InsertEntry(*table, k, set);
+        }
+
+        // Requires: table has an empty entry; k is not in table.
+        static void
+        InsertEntry(LookupTable& table, EventKey const& k, EventSet const* set) noexcept
+        {
+            auto i = EventKeyOps()(k) & table.Mask;
+            while (table.Entries[i].Set.load(std::memory_order_relaxed) != nullptr)
+            {
+                i = (i + 1) & table.Mask;
+            }
+
+            auto& entry = table.Entries[i];
+            entry.Keyword = k.Keyword;
+            entry.Level = k.Level;
+            entry.Set.store(set, std::memory_order_release); // Publish Keyword and Level.
+            table.Count += 1;
+        }
+
+        // Requires: no concurrent use of the provider.
+        void
+        ClearLookup() noexcept
+        {
+            for (auto& levelSets : m_denseSets)
+            {
+                for (auto& set : levelSets)
+                {
+                    set.store(nullptr, std::memory_order_relaxed);
+                }
+            }
+
+            delete m_lookupTable.exchange(nullptr, std::memory_order_relaxed);
+        }
     };
 
     /*
@@ -531,6 +682,12 @@ namespace ehd
     - Call eventBuilder.Reset(name, ...) to start building an event.
     - Call other methods on eventBuilder to set attributes or add fields.
     - Call eventBuilder.Write(eventSet, ...) to write the event.
+
+    A builder keeps its buffers between events, so reusing one builder (e.g. a
+    thread_local builder) avoids allocations after the first few events. If
+    the next event has the same name and fields as the previous one, call
+    eventBuilder.ResetData() instead of Reset(...) to reuse the previous
+    event's metadata and only add new field values.
     */
     class EventBuilder
     {
@@ -697,6 +854,10 @@ namespace ehd
 
         Buffer m_meta;
         Buffer m_data;
+        size_t m_frozenMetaPos; // If m_metaFrozen, next field's offset in m_meta.
+        size_t m_fieldsMetaPos; // Offset of first field in m_meta.
+        bool m_metaFrozen; // True if Add methods should skip metadata (ResetData).
+        bool m_metaError;
         bool m_error;
         uint8_t m_version;
         uint16_t m_id;
@@ -715,6 +876,10 @@ namespace ehd
         EventBuilder(uint16_t metaCapacity = 256, uint16_t dataCapacity = 256) noexcept
             : m_meta()
             , m_data()
+            , m_frozenMetaPos()
+            , m_fieldsMetaPos()
+            , m_metaFrozen(false)
+            , m_metaError(true)
             , m_error(true)
             , m_version()
             , m_id()
@@ -742,6 +907,8 @@ namespace ehd
 
             m_meta.clear();
             m_data.clear();
+            m_metaFrozen = false;
+            m_metaError = false;
             m_error = false;
             m_version = 0;
             m_id = 0;
@@ -751,6 +918,7 @@ namespace ehd
             uint8_t* pMeta;
             if (!m_meta.ensure_space_for(name.size() + 1, &pMeta))
             {
+                m_metaError = true;
                 m_error = true;
             }
             else
@@ -760,6 +928,36 @@ namespace ehd
                 m_meta.advance(name.size() + 1);
             }
 
+            m_fieldsMetaPos = m_meta.size();
+            return *this;
+        }
+
+        /*
+        Clears the field values of the previous event from the builder and starts
+        building a new event with the same name, tag, id, version, opcode, and
+        fields as the previous event. The previous event's metadata is reused
+        as-is, so the Add methods only append field values.
+
+        Use this when writing many events with the same layout, e.g.:
+
+            builder.Reset("MyEvent").AddValue("a", a1, fmt).AddString<char>("b", b1);
+            builder.Write(eventSet);
+            builder.ResetData().AddValue("a", a2, fmt).AddString<char>("b", b2);
+            builder.Write(eventSet);
+
+        Requires: since the last call to Reset(...), a complete event has been
+        built, and after ResetData the same sequence of Add calls will be made
+        (same methods, field names, types, formats, and tags). Only the values,
+        including string and array lengths, may differ. Debug builds assert if the
+        fields do not match. Call Reset(...) to change the event layout.
+        */
+        EventBuilder&
+        ResetData() noexcept
+        {
+            m_data.clear();
+            m_metaFrozen = true;
+            m_frozenMetaPos = m_fieldsMetaPos;
+            m_error = m_metaError;
             return *this;
         }
 
@@ -795,6 +993,10 @@ namespace ehd
             _In_reads_bytes_opt_(16) void const* relatedId = nullptr) const noexcept
         {
             assert(relatedId == nullptr || activityId != nullptr);
+
+            // Precondition violation: fewer fields added after ResetData than before.
+            assert(!m_metaFrozen || m_error || m_frozenMetaPos == m_meta.size());
+
             if (m_error)
             {
                 return 12; // ENOMEM
@@ -1523,8 +1725,30 @@ namespace ehd
             assert(fieldName.find('\0') == fieldName.npos);
 
             uint8_t* pMeta;
-            if (!m_meta.ensure_space_for(fieldName.size() + 7, &pMeta))
+            if (m_metaFrozen)
+            {
+                // Metadata is already present: just find the format byte and skip.
+                size_t const pos = m_frozenMetaPos;
+                size_t const cMeta = fieldName.size() + 2 +
+                    (fieldTag != 0 ? 1 + sizeof(fieldTag) : format != 0 ? 1 : 0);
+
+                // Precondition violation: fields added after ResetData do not match.
+                assert(pos + cMeta <= m_meta.size());
+                assert(0 == memcmp(m_meta.data() + pos, fieldName.data(), fieldName.size()));
+                assert(m_meta.data()[pos + fieldName.size()] == '\0');
+                assert(m_meta.data()[pos + fieldName.size() + 1] ==
+                    ((fieldTag != 0 || format != 0) ? (encoding | 0x80) : encoding));
+
+                if (fieldTag != 0 || format != 0)
+                {
+                    formatOffset = pos + fieldName.size() + 2;
+                }
+
+                m_frozenMetaPos = pos + cMeta;
+            }
+            else if (!m_meta.ensure_space_for(fieldName.size() + 7, &pMeta))
             {
+                m_metaError = true;
                 m_error = true;
             }
             else
@@ -147,6 +147,7 @@ A symbol declared by TRACELOGGING_DECLARE_PROVIDER must later be defined in a
     _tlg_EXTERN_C eventheader_tracepoint const* _tlg_PASTE2(__start__tlgEventPtrs_, providerSymbol)[] __attribute__((weak, visibility("hidden"))); \
     _tlg_EXTERN_C eventheader_tracepoint const* _tlg_PASTE2(__stop__tlgEventPtrs_, providerSymbol)[] __attribute__((weak, visibility("hidden"))); \
     _tlg_EXTERN_C struct TraceLoggingProviderSymbol providerSymbol __attribute__((visibility("hidden"))); /* Empty provider variable to help with code navigation. */ \
+    _tlg_EXTERN_C unsigned _tlg_PASTE2(_tlgProvSummary_, providerSymbol) __attribute__((visibility("hidden"))); /* Enable summary, see TraceLoggingProviderAnyEnabled. */ \
     _tlg_EXTERN_C eventheader_provider const _tlg_PASTE2(_tlgProv_, providerSymbol) __attribute__((visibility("hidden")))  /* Actual provider variable is hidden behind prefix. */
 
 /*
@@ -200,6 +201,7 @@ TraceLoggingRegister to register the provider.
         "TRACELOGGING_DEFINE_PROVIDER providerName + options is too long"); \
     _tlgParseProviderId(providerId) \
     static tracepoint_provider_state _tlg_PASTE2(_tlgProvState_, providerSymbol) = TRACEPOINT_PROVIDER_STATE_INIT; \
+    unsigned _tlg_PASTE2(_tlgProvSummary_, providerSymbol) = 0; \
     _tlg_EXTERN_C_CONST eventheader_provider _tlg_PASTE2(_tlgProv_, providerSymbol) = { \
         &_tlg_PASTE2(_tlgProvState_, providerSymbol), \
         _tlgProviderOptions(__VA_ARGS__), \
@@ -255,9 +257,16 @@ object that might be dynamically unloaded before the process ends. Failure to
 unregister may cause process memory corruption as the kernel tries to update
 the enabled/disabled states of tracepoint variables that no longer exist.
 */
+#ifdef TRACEPOINT_EXT
+#define TraceLoggingUnregister(providerSymbol) \
+    (eventheader_close_provider_with_summary( \
+        &_tlg_PASTE2(_tlgProv_, providerSymbol), \
+        &_tlg_PASTE2(_tlgProvSummary_, providerSymbol) ))
+#else // TRACEPOINT_EXT
 #define TraceLoggingUnregister(providerSymbol) \
     (eventheader_close_provider( \
         &_tlg_PASTE2(_tlgProv_, providerSymbol) ))
+#endif // TRACEPOINT_EXT
 
 /*
 Macro TraceLoggingRegister(providerSymbol):
@@ -277,11 +286,20 @@ in progress on another thread.
 The provider must be in the "unregistered" state. It is an error to call
 TraceLoggingRegister on a provider that is already registered.
 */
+#ifdef TRACEPOINT_EXT
+#define TraceLoggingRegister(providerSymbol) \
+    (eventheader_open_provider_with_summary( \
+        &_tlg_PASTE2(_tlgProv_, providerSymbol), \
+        _tlg_PASTE2(__start__tlgEventPtrs_, providerSymbol), \
+        _tlg_PASTE2(__stop__tlgEventPtrs_, providerSymbol), \
+        &_tlg_PASTE2(_tlgProvSummary_, providerSymbol) ))
+#else // TRACEPOINT_EXT
 #define TraceLoggingRegister(providerSymbol) \
     (eventheader_open_provider_with_events( \
         &_tlg_PASTE2(_tlgProv_, providerSymbol), \
         _tlg_PASTE2(__start__tlgEventPtrs_, providerSymbol), \
         _tlg_PASTE2(__stop__tlgEventPtrs_, providerSymbol) ))
+#endif // TRACEPOINT_EXT
 
 /*
 Macro TraceLoggingProviderEnabled(providerSymbol, eventLevel, eventKeyword):
@@ -343,6 +361,40 @@ enabled.
         = &_tlgEvt; \
     TRACEPOINT_ENABLED(&_tlgEvtState); })
 
+/*
+Macro TraceLoggingProviderAnyEnabled(providerSymbol):
+Returns true (non-zero) if any TraceLoggingWrite or TraceLoggingProviderEnabled
+for the specified provider might be enabled, i.e. if any of the provider's
+level+keyword combinations is being collected. Returns false if all of them
+are disabled or if the provider is unregistered.
+
+This is a single relaxed load, so it is suitable for hot-path checks that
+guard work shared by several events, e.g.
+
+    if (TraceLoggingProviderAnyEnabled(MyProvider))
+    {
+        GatherStatistics(&stats);
+        TraceLoggingWrite(MyProvider, "Stats", ...);
+        TraceLoggingWrite(MyProvider, "StatsDetail", ...);
+    }
+
+Implementation details: If <tracepoint/tracepoint-ext.h> was included before
+this header, TraceLoggingRegister gives each distinct level+keyword used by the
+provider a bit in a provider-level summary word, and the kernel sets the bit
+while any session collects that level+keyword. If the provider uses more than
+31 distinct level+keyword combinations, the summary conservatively returns true
+while the provider is registered. Otherwise (tracepoint.h interface only), this
+conservatively returns true while the provider is registered. All code that
+uses a provider must agree on whether tracepoint-ext.h is included.
+*/
+#ifdef TRACEPOINT_EXT
+#define TraceLoggingProviderAnyEnabled(providerSymbol) \
+    (0 != __atomic_load_n(&_tlg_PASTE2(_tlgProvSummary_, providerSymbol), __ATOMIC_RELAXED))
+#else // TRACEPOINT_EXT
+#define TraceLoggingProviderAnyEnabled(providerSymbol) \
+    (-1 != __atomic_load_n(&_tlg_PASTE2(_tlgProv_, providerSymbol).state->data_file, __ATOMIC_RELAXED))
+#endif // TRACEPOINT_EXT
+
 /*
 Macro TraceLoggingProviderName(providerSymbol):
 Returns the provider's name as a nul-terminated const char*.
@@ -1450,6 +1502,35 @@ extern "C" {
         pVec[0].iov_len = cb * sizeof(char);
     }
 
+    /*
+    Copies a fixed-size field value into the next cbValue bytes of pVals and
+    describes it with an iovec. If the previous payload iovec ends where this
+    value begins (i.e. the previous field was also a fixed-size value), extends
+    that iovec instead of using a new one, so each run of fixed-size fields
+    costs one iovec. When inlined, the merge decision is a compile-time
+    constant.
+    */
+    static inline void
+    _tlgAppendVal(struct iovec* pVecs, unsigned* pIdx, char* pVals, unsigned* pValsPos, void const* pValue, size_t cbValue) _tlg_NOEXCEPT _tlg_INLINE_ATTRIBUTES;
+    static inline void
+    _tlgAppendVal(struct iovec* pVecs, unsigned* pIdx, char* pVals, unsigned* pValsPos, void const* pValue, size_t cbValue) _tlg_NOEXCEPT
+    {
+        char* const pb = pVals + *pValsPos;
+        struct iovec* const pPrev = &pVecs[*pIdx - 1];
+        memcpy(pb, pValue, cbValue);
+        *pValsPos += (unsigned)cbValue;
+        if (*pIdx > EVENTHEADER_PREFIX_DATAVEC_COUNT &&
+            (char*)pPrev->iov_base + pPrev->iov_len == pb)
+        {
+            pPrev->iov_len += cbValue;
+        }
+        else
+        {
+            _tlgCreate1Vec(&pVecs[*pIdx], pb, cbValue);
+            *pIdx += 1;
+        }
+    }
+
 #ifndef __cplusplus
 
     static inline void
@@ -1506,11 +1587,11 @@ extern "C" {
 } // extern "C"
 
 template<class ctype>
-inline void _tlgCppCreate1Val(struct iovec* pVec, ctype const& value) _tlg_NOEXCEPT _tlg_INLINE_ATTRIBUTES;
+inline void _tlgCppAppendVal(struct iovec* pVecs, unsigned* pIdx, char* pVals, unsigned* pValsPos, ctype const& value) _tlg_NOEXCEPT _tlg_INLINE_ATTRIBUTES;
 template<class ctype>
-inline void _tlgCppCreate1Val(struct iovec* pVec, ctype const& value) _tlg_NOEXCEPT
+inline void _tlgCppAppendVal(struct iovec* pVecs, unsigned* pIdx, char* pVals, unsigned* pValsPos, ctype const& value) _tlg_NOEXCEPT
 {
-    _tlgCreate1Vec(&pVec[0], &value, sizeof(ctype));
+    _tlgAppendVal(pVecs, pIdx, pVals, pValsPos, &value, sizeof(ctype));
 }
 
 template<class ctype>
@@ -2022,6 +2103,27 @@ _tlgApplyArgsN(macro, n, (handler, ...)) --> macro##handler(n, ...)
 #define _tlgDataDescCount_tlgPackedData( ctype, pValue,   cbValue                                ) +1
 #define _tlgDataDescCount_tlgStruct(            fieldCount,         encoding,                 ndt)
 
+// Count the bytes of scratch buffer needed for fixed-size field values.
+// Adjacent fixed-size values are packed contiguously so they share an iovec.
+#define _tlgValsSize(n, args) _tlgApplyArgs(_tlgValsSize, args)
+#define _tlgValsSize_tlgIgnored(    ...                                                     )
+#define _tlgValsSize_tlgKeyword(    eventKeyword                                            )
+#define _tlgValsSize_tlgOpcode(     eventOpcode                                             )
+#define _tlgValsSize_tlgEventTag(   eventTag                                                )
+#define _tlgValsSize_tlgIdVersion(  eventId, eventVersion                                   )
+#define _tlgValsSize_tlgLevel(      eventLevel                                              )
+#define _tlgValsSize_tlgAuto(              value,                                        ndt)
+#define _tlgValsSize_tlgValue(      ctype, value,              encoding, format, hasFmt, ndt) +sizeof(ctype)
+#define _tlgValsSize_tlgStrNul(     ctype, pszValue,           encoding, format, hasFmt, ndt)
+#define _tlgValsSize_tlgStrCch(     ctype, pchValue, cchValue, encoding, format, hasFmt, ndt)
+#define _tlgValsSize_tlgBin(        ctype, pValue,   cbValue,  encoding, format, hasFmt, ndt)
+#define _tlgValsSize_tlgVArray(     ctype, pValues,  cValues,  encoding, format, hasFmt, ndt)
+#define _tlgValsSize_tlgCArray(     ctype, pValues,  cValues,  encoding, format, hasFmt, ndt)
+#define _tlgValsSize_tlgPackedField(ctype, pValue,   cbValue,  encoding, format, hasFmt, ndt)
+#define _tlgValsSize_tlgPackedMeta(                            encoding, format, hasFmt, ndt)
+#define _tlgValsSize_tlgPackedData( ctype, pValue,   cbValue                                )
+#define _tlgValsSize_tlgStruct(            fieldCount,         encoding,                 ndt)
+
 // Populate the iovecs needed for event field data.
 #ifdef __cplusplus
 
@@ -2042,7 +2144,7 @@ _tlgApplyArgsN(macro, n, (handler, ...)) --> macro##handler(n, ...)
 #define _tlgDataDescCreate_tlgAuto(       n,       value,                                         ndt) \
     _tlgCppCreate1Auto(&_tlgVecs[_tlgIdx++], (value)),
 #define _tlgDataDescCreate_tlgValue(      n, ctype, value,              encoding, format, hasFmt, ndt) \
-    _tlgCppCreate1Val<ctype>(&_tlgVecs[_tlgIdx++], (value)),
+    _tlgCppAppendVal<ctype>(_tlgVecs, &_tlgIdx, _tlgVals, &_tlgValsPos, (value)),
 #define _tlgDataDescCreate_tlgStrNul(     n, ctype, pszValue,           encoding, format, hasFmt, ndt) \
     _tlgCppCreate1ValsNul<ctype>(&_tlgVecs[_tlgIdx++], (pszValue)),
 #define _tlgDataDescCreate_tlgStrCch(     n, ctype, pchValue, cchValue, encoding, format, hasFmt, ndt) \
@@ -2083,8 +2185,7 @@ _tlgApplyArgsN(macro, n, (handler, ...)) --> macro##handler(n, ...)
 #define _tlgDataDescCreate_tlgLevel(      n, eventLevel                                              )
 #define _tlgDataDescCreate_tlgValue(      n, ctype, value,              encoding, format, hasFmt, ndt) \
     ctype const _tlgTemp##n = (value); \
-    _tlgCreate1Vec(&_tlgVecs[_tlgIdx], &_tlgTemp##n, sizeof(ctype)); \
-    _tlgIdx += 1;
+    _tlgAppendVal(_tlgVecs, &_tlgIdx, _tlgVals, &_tlgValsPos, &_tlgTemp##n, sizeof(ctype));
 #define _tlgDataDescCreate_tlgStrNul(     n, ctype, pszValue,           encoding, format, hasFmt, ndt) \
     ctype const* const _tlgTemp##n = (pszValue); \
     _tlgCreate1Sz_##ctype(&_tlgVecs[_tlgIdx], _tlgTemp##n); \
@@ -2172,6 +2273,8 @@ _tlgApplyArgsN(macro, n, (handler, ...)) --> macro##handler(n, ...)
     if (TRACEPOINT_ENABLED(&_tlgEvtState)) { \
         struct iovec _tlgVecs[EVENTHEADER_PREFIX_DATAVEC_COUNT _tlg_FOREACH(_tlgDataDescCount, __VA_ARGS__)]; \
         unsigned _tlgIdx = EVENTHEADER_PREFIX_DATAVEC_COUNT; \
+        char _tlgVals[1 _tlg_FOREACH(_tlgValsSize, __VA_ARGS__)] __attribute__((unused)); \
+        unsigned _tlgValsPos __attribute__((unused)) = 0; \
         _tlgBeginCppEval /* For C++, ensure no semicolons until after Write. */ \
         _tlg_FOREACH(_tlgDataDescCreate, __VA_ARGS__) \
         _tlgWriteErr = eventheader_write( \
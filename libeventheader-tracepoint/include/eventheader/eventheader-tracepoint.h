@@ -127,6 +127,55 @@ extern "C" {
         eventheader_tracepoint const** pEventsStart,
         eventheader_tracepoint const** pEventsStop);
 
+#ifdef TRACEPOINT_EXT
+
+    /*
+    The *_with_summary functions use the tracepoint-ext.h extensions. They are
+    declared only if <tracepoint/tracepoint-ext.h> was included before this
+    header.
+    */
+
+    /*
+    Closes a provider that was opened by
+    eventheader_open_provider_with_summary. Unregisters the bits of
+    *pSummary and sets it to 0, then closes the provider. Calling Close on an
+    already-closed provider is a safe no-op.
+    */
+    void
+    eventheader_close_provider_with_summary(
+        eventheader_provider const* pProvider,
+        unsigned* pSummary);
+
+    /*
+    Same as eventheader_open_provider_with_events, and also maintains
+    *pSummary, a provider-level enable summary: *pSummary is non-zero if any
+    of the provider's level+keyword combinations might be enabled, so
+    "is anything enabled?" is a single relaxed load of *pSummary.
+
+    Each distinct level+keyword in the event list gets a bit of *pSummary that
+    the kernel sets while any session collects that combination. If there are
+    more than 31 distinct combinations (or a bit cannot be registered), bit 31
+    is set for as long as the provider is open (i.e. the summary conservatively
+    reports "might be enabled").
+
+    - Returns 0 for success, errno otherwise. Result is primarily for
+      debugging/diagnostics and is usually ignored for production code.
+    - Close the provider with eventheader_close_provider_with_summary.
+
+    PRECONDITION:
+
+    - Same as eventheader_open_provider_with_events.
+    - *pSummary is 0 and must remain valid until the provider is closed.
+    */
+    int
+    eventheader_open_provider_with_summary(
+        eventheader_provider const* pProvider,
+        eventheader_tracepoint const** pEventsStart,
+        eventheader_tracepoint const** pEventsStop,
+        unsigned* pSummary);
+
+#endif // TRACEPOINT_EXT
+
     /*
     Opens the specified event and associates it with the specified provider.
     Returns 0 for success, errno for failure. In case of failure, the event
@@ -34,18 +34,10 @@ int main()
     provider to create an EventSet or look up an existing EventSet, and then
     you use the EventSet to write the events.
 
-    The EventSet is thread-safe, but the provider is not thread-safe. Possible
-    multi-threaded usage patterns for the provider would include the following:
-
-    - Have a reader-writer lock for the provider. Take an exclusive lock for
-      non-const operations like RegisterSet() and Unregister(). Take a shared
-      lock for other provider operations like FindSet().
-    - Create the provider and do all of the necessary RegisterSet() calls
-      before any other threads start using it. Then you can call the const
-      methods like FindSet() on any thread as needed without any lock as long
-      as nobody is calling any non-const methods.
-    - Use your own thread-safe data structure to keep track of all of the
-      EventSets you need. Take a lock if you ever need to register a new set.
+    The EventSet is thread-safe. The provider's RegisterSet(), FindSet(), and
+    FindSetPtr() methods may be called concurrently from any thread, and
+    FindSetPtr() is wait-free. Unregister() and the provider's destructor must
+    not run concurrently with any other use of the provider.
     */
     ehd::Provider provider1("EhdProv1");
     printf("provider1: Name=\"%.*s\" Options=\"%.*s\"\n",
@@ -72,13 +64,13 @@ int main()
       success or nullptr if out of memory.
     - Get a previously-created event set by calling provider.FindSet(),
       which returns shared_ptr<EventSet>, or nullptr if not found.
+    - For a lookup on every event, call provider.FindSetPtr(), which returns
+      EventSet const* (or nullptr) without touching a reference count. The
+      pointer is valid until the provider is unregistered or destroyed.
 
     The shared_ptr<EventSet> will stop working if the provider is closed,
     but nothing bad will happen if you use it after the provider closes.
 
-    Note that provider.RegisterSet() is not thread-safe, but the returned
-    shared_ptr<EventSet> is thread-safe.
-
     If RegisterSet() hits an out-of-memory error, it returns nullptr.
 
     If RegisterSet() hits any other error, it returns an inactive EventSet.
@@ -8,6 +8,7 @@ events to a file. This is part of the eventheader-interceptor-sample program.
 
 #include "tracepoint-file.h"
 #include <tracepoint/tracepoint.h>
+#include <tracepoint/tracepoint-ext.h>
 #include <tracepoint/tracepoint-impl.h>
 #include <eventheader/eventheader.h>
 
@@ -283,3 +284,86 @@ tracepoint_write(
         ? 0
         : errno;
 }
+
+int
+tracepoint_write_packed(
+    tracepoint_state const* eventState,
+    void* data,
+    unsigned dataSize)
+{
+    assert(dataSize >= sizeof(int32_t));
+
+    // The record header replaces the write_index.
+    struct iovec dataVecs[2] = {
+        { nullptr, 0 },
+        { static_cast<char*>(data) + sizeof(int32_t), dataSize - sizeof(int32_t) },
+    };
+    return tracepoint_write(eventState, 2, dataVecs);
+}
+
+int
+tracepoint_async_start(
+    unsigned /*queueDepth*/,
+    unsigned /*slotSize*/)
+{
+    return ENOTSUP;
+}
+
+void
+tracepoint_async_stop()
+{
+    return;
+}
+
+uint64_t
+tracepoint_async_dropped()
+{
+    return 0;
+}
+
+int
+tracepoint_lazy_connect(int enable)
+{
+    return enable ? ENOTSUP : 0;
+}
+
+void
+tracepoint_lazy_connect_wait()
+{
+    return;
+}
+
+int
+tracepoint_register_enable_bit(
+    tracepoint_provider_state const* providerState,
+    char const* /*eventNameArgs*/,
+    unsigned* enableWord,
+    unsigned enableBit)
+{
+    if (enableBit >= sizeof(*enableWord) * 8)
+    {
+        return EINVAL;
+    }
+
+    auto lock = std::lock_guard(s_eventsMutex);
+
+    if (providerState->data_file == -1)
+    {
+        return EBADF;
+    }
+
+    // Events are always enabled.
+    __atomic_or_fetch(enableWord, 1u << enableBit, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void
+tracepoint_unregister_enable_bit(
+    unsigned* enableWord,
+    unsigned enableBit)
+{
+    if (enableBit < sizeof(*enableWord) * 8)
+    {
+        __atomic_and_fetch(enableWord, ~(1u << enableBit), __ATOMIC_RELAXED);
+    }
+}
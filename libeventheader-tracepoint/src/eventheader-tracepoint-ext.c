@@ -0,0 +1,136 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+eventheader functions that use the tracepoint-ext.h extensions. These are in a
+separate file so that programs that do not use them can link against an
+implementation of tracepoint.h that does not provide the extensions.
+*/
+
+#include <tracepoint/tracepoint-ext.h>
+#include <eventheader/eventheader-tracepoint.h>
+#include <tracepoint/tracepoint-impl.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef _uehp_FUNC_ATTRIBUTES
+#define _uehp_FUNC_ATTRIBUTES //__attribute__((weak, visibility("hidden")))
+#endif // _uehp_FUNC_ATTRIBUTES
+
+// Summary bit that is set (not kernel-managed) if some level+keyword
+// combination could not get a bit of its own.
+#define SUMMARY_OVERFLOW_BIT 31u
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+    void
+    eventheader_close_provider_with_summary(
+        eventheader_provider const* pProvider,
+        unsigned* pSummary) _uehp_FUNC_ATTRIBUTES;
+    void
+    eventheader_close_provider_with_summary(
+        eventheader_provider const* pProvider,
+        unsigned* pSummary)
+    {
+        // Bits that were never registered are safe no-ops.
+        unsigned bit;
+        for (bit = 0; bit != SUMMARY_OVERFLOW_BIT; bit += 1)
+        {
+            tracepoint_unregister_enable_bit(pSummary, bit);
+        }
+
+        __atomic_store_n(pSummary, 0, __ATOMIC_RELAXED);
+        tracepoint_close_provider(pProvider->state);
+    }
+
+    int
+    eventheader_open_provider_with_summary(
+        eventheader_provider const* pProvider,
+        eventheader_tracepoint const** pEventsStart,
+        eventheader_tracepoint const** pEventsStop,
+        unsigned* pSummary) _uehp_FUNC_ATTRIBUTES;
+    int
+    eventheader_open_provider_with_summary(
+        eventheader_provider const* pProvider,
+        eventheader_tracepoint const** pEventsStart,
+        eventheader_tracepoint const** pEventsStop,
+        unsigned* pSummary)
+    {
+        assert(0 == __atomic_load_n(pSummary, __ATOMIC_RELAXED));
+
+        int err = eventheader_open_provider_with_events(pProvider, pEventsStart, pEventsStop);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        // Already sorted and de-duplicated, so this just finds the end.
+        eventheader_tracepoint const** adjustedEventPtrsStop =
+            tracepoint_fix_array((void const**)pEventsStart, (void const**)pEventsStop);
+
+        // Many events share a level+keyword (i.e. a tracepoint name), and one
+        // kernel enabler per name is enough for the summary.
+        struct {
+            uint64_t keyword;
+            uint8_t level;
+        } combos[SUMMARY_OVERFLOW_BIT];
+        unsigned comboCount = 0;
+        unsigned overflow = 0;
+
+        int const eventCount = (int)(adjustedEventPtrsStop - pEventsStart);
+        int i;
+        for (i = 0; i < eventCount; i += 1)
+        {
+            eventheader_tracepoint const* const pEvent = pEventsStart[i];
+
+            unsigned iCombo;
+            for (iCombo = 0; iCombo != comboCount; iCombo += 1)
+            {
+                if (combos[iCombo].level == pEvent->header.level &&
+                    combos[iCombo].keyword == pEvent->keyword)
+                {
+                    break;
+                }
+            }
+
+            if (iCombo != comboCount)
+            {
+                continue;
+            }
+            else if (comboCount == SUMMARY_OVERFLOW_BIT)
+            {
+                overflow = 1;
+                continue;
+            }
+
+            combos[comboCount].level = pEvent->header.level;
+            combos[comboCount].keyword = pEvent->keyword;
+
+            char command[EVENTHEADER_COMMAND_MAX];
+            if (EVENTHEADER_COMMAND_MAX <= (unsigned)EVENTHEADER_FORMAT_COMMAND(
+                command, sizeof(command),
+                pProvider->name, pEvent->header.level, pEvent->keyword, pProvider->options) ||
+                0 != tracepoint_register_enable_bit(pProvider->state, command, pSummary, comboCount))
+            {
+                overflow = 1;
+            }
+
+            comboCount += 1;
+        }
+
+        if (overflow)
+        {
+            __atomic_or_fetch(pSummary, 1u << SUMMARY_OVERFLOW_BIT, __ATOMIC_RELAXED);
+        }
+
+        return 0;
+    }
+
+#ifdef __cplusplus
+} // extern "C"
+#endif // __cplusplus
@@ -42,6 +42,9 @@ static bool TestCommon(void)
         TraceLoggingUnregister(TestProviderCG);
         TraceLoggingUnregister(TestProviderCppG);
 
+        ok = !TraceLoggingProviderAnyEnabled(TestProviderCG) && ok;
+        ok = !TraceLoggingProviderAnyEnabled(TestProviderCppG) && ok;
+
         enabled = TraceLoggingProviderEnabled(TestProviderCG, 5, 0);
         TraceLoggingWrite(TestProviderCG, "EventCG", TraceLoggingBoolean(enabled));
 
@@ -0,0 +1,745 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+End-to-end collection/decode throughput benchmark.
+
+For each configuration (mode x buffer size x wakeup watermark x drain method):
+
+- Starts a TracepointSession and enables the benchmark tracepoint.
+- Starts N producer threads, each writing events at a fixed rate.
+- Drains the session while the producers run (realtime) or once after they
+  stop (circular), using FlushToWriter (to a perf.data file) or
+  EnumerateSampleEvents (counting only). Each drain call is timed.
+- For FlushToWriter, decodes the resulting perf.data file with PerfDataFile +
+  EventFormatter::AppendSampleAsJson.
+
+The producers write TraceLogging events through user_events. If the user_events
+tracepoint cannot be registered or enabled (e.g. user_events is not available
+or the program is not running as root), the producers instead call getppid()
+and the session collects the syscalls:sys_enter_getppid tracepoint so that the
+collection and decode paths can still be measured.
+
+Results are written to stdout as JSON lines, one object per configuration:
+
+{"source":"user_events","mode":"realtime","drain":"flush","buffer_kb":64,
+ "watermark_pct":50,"threads":2,"rate":100000,"duration_ms":1000,
+ "written":200000,"collected":199000,"lost":1000,"lost_pct":0.500,
+ "drain_calls":120,"drain_ns_per_event":85.2,"drain_mb_per_sec":410.0,
+ "drain_us_log2_hist":[0,3,50,60,7],
+ "decoded":199000,"decode_ns_per_event":310.4,"decode_mb_per_sec":150.2}
+
+drain_us_log2_hist[i] is the number of drain calls that took between 2^i and
+2^(i+1) microseconds (bucket 0 also includes calls that took less than 1us).
+In circular mode, "lost" is written - collected, i.e. events that were
+overwritten or dropped before the final drain.
+*/
+
+#include <tracepoint/TracepointSession.h>
+#include <tracepoint/TracepointCache.h>
+#include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfDataFileWriter.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <eventheader/EventFormatter.h>
+#include <eventheader/TraceLoggingProvider.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std::string_view_literals;
+using namespace tracepoint_control;
+using namespace tracepoint_decode;
+using namespace eventheader_decode;
+
+// Level 4 (information), keyword 1 => "BenchSession_L4K1".
+TRACELOGGING_DEFINE_PROVIDER(
+    BenchSessionProvider,
+    "BenchSession",
+    // {3f1e6a2c-7b5d-4c08-9e31-d2a4b6c8e0f5}
+    (0x3f1e6a2c, 0x7b5d, 0x4c08, 0x9e, 0x31, 0xd2, 0xa4, 0xb6, 0xc8, 0xe0, 0xf5));
+
+static constexpr auto UserEventsTracepoint = "user_events:BenchSession_L4K1"sv;
+static constexpr auto SyscallTracepoint = "syscalls:sys_enter_getppid"sv;
+static constexpr unsigned HistBuckets = 24;
+
+enum class Source
+{
+    UserEvents,
+    Syscalls,
+};
+
+enum class Drain
+{
+    Flush,
+    Enumerate,
+};
+
+struct Options
+{
+    unsigned Threads = 2;
+    unsigned Rate = 100000; // Events per second per thread. 0 = unlimited.
+    unsigned DurationMs = 1000;
+    std::vector<unsigned> BufferKb = { 64, 256, 1024 };
+    std::vector<unsigned> WatermarkPct = { 0, 50 };
+    bool Realtime = true;
+    bool Circular = true;
+    bool Flush = true;
+    bool Enumerate = true;
+    bool Decode = true;
+    bool ForceSyscalls = false;
+    char const* OutputPath = "/tmp/tracepoint-session-benchmark.perf.data";
+};
+
+struct Result
+{
+    uint64_t Written = 0;
+    uint64_t Collected = 0;
+    uint64_t Lost = 0;
+    uint64_t DrainCalls = 0;
+    uint64_t DrainNs = 0;
+    uint64_t DrainBytes = 0;
+    uint64_t DrainHist[HistBuckets] = {};
+    uint64_t Decoded = 0;
+    uint64_t DecodeNs = 0;
+    uint64_t DecodeBytes = 0;
+    int DecodeError = 0;
+};
+
+static uint64_t
+NowNs() noexcept
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+static void
+SleepNs(uint64_t ns) noexcept
+{
+    timespec ts;
+    ts.tv_sec = static_cast<time_t>(ns / 1000000000u);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000u);
+    nanosleep(&ts, nullptr);
+}
+
+// Returns true if the event was written (i.e. was enabled and accepted).
+static bool
+WriteOne(Source source, unsigned threadIndex, uint64_t sequence) noexcept
+{
+    if (source == Source::Syscalls)
+    {
+        (void)getppid();
+        return true;
+    }
+
+    return 0 == TraceLoggingWrite(BenchSessionProvider, "Sample",
+        TraceLoggingLevel(event_level_information),
+        TraceLoggingKeyword(1),
+        TraceLoggingUInt32(threadIndex, "thread"),
+        TraceLoggingUInt64(sequence, "sequence"),
+        TraceLoggingString("payload", "text"));
+}
+
+// Writes events at the configured rate until stop is set.
+static void
+Producer(
+    Options const& o,
+    Source source,
+    unsigned threadIndex,
+    std::atomic<bool> const& stop,
+    std::atomic<uint64_t>& written) noexcept
+{
+    // Catch up at most every 50us so the rate stays smooth at high rates.
+    constexpr uint64_t PollNs = 50000;
+    uint64_t count = 0;
+    uint64_t sequence = 0;
+    auto const start = NowNs();
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        uint64_t target;
+        if (o.Rate == 0)
+        {
+            target = sequence + 1024;
+        }
+        else
+        {
+            auto const elapsed = NowNs() - start;
+            target = static_cast<uint64_t>(
+                static_cast<double>(elapsed) * o.Rate / 1000000000.0);
+            if (target <= sequence)
+            {
+                SleepNs(PollNs);
+                continue;
+            }
+        }
+
+        for (; sequence != target; sequence += 1)
+        {
+            count += WriteOne(source, threadIndex, sequence);
+        }
+    }
+
+    written.fetch_add(count, std::memory_order_relaxed);
+}
+
+static void
+RecordDrain(Result& r, uint64_t ns) noexcept
+{
+    unsigned bucket = 0;
+    for (auto us = ns / 1000; us > 1 && bucket != HistBuckets - 1; us >>= 1)
+    {
+        bucket += 1;
+    }
+
+    r.DrainCalls += 1;
+    r.DrainNs += ns;
+    r.DrainHist[bucket] += 1;
+}
+
+// One drain call. Returns 0 for success, errno for error.
+static int
+DrainOnce(
+    TracepointSession& session,
+    Drain drain,
+    PerfDataFileWriter& writer,
+    TracepointTimestampRange& writtenRange,
+    Result& r) noexcept
+{
+    int error;
+    auto const bytesBefore = writer.EventDataBytes();
+    auto const start = NowNs();
+    if (drain == Drain::Flush)
+    {
+        error = session.FlushToWriter(writer, &writtenRange);
+        if (error == 0 && writer.EventDataBytes() != bytesBefore)
+        {
+            error = writer.WriteFinishedRound();
+        }
+    }
+    else
+    {
+        error = session.EnumerateSampleEvents(
+            [&r](PerfSampleEventInfo const& info) noexcept
+            {
+                r.DrainBytes += info.header->size;
+                return 0;
+            });
+    }
+
+    RecordDrain(r, NowNs() - start);
+    if (drain == Drain::Flush)
+    {
+        r.DrainBytes += writer.EventDataBytes() - bytesBefore;
+    }
+
+    return error;
+}
+
+// Decodes every sample in the file to JSON. Returns 0 for success, errno for error.
+static int
+DecodeFile(char const* path, Result& r) noexcept
+{
+    int error;
+    PerfDataFile file;
+    EventFormatter formatter;
+    std::string json;
+
+    try
+    {
+        json.reserve(4096);
+    }
+    catch (...)
+    {
+        return ENOMEM;
+    }
+
+    error = file.OpenMapped(path);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    auto const start = NowNs();
+    for (;;)
+    {
+        perf_event_header const* pHeader;
+        error = file.ReadEvent(&pHeader);
+        if (pHeader == nullptr)
+        {
+            break;
+        }
+
+        if (pHeader->type != PERF_RECORD_SAMPLE)
+        {
+            continue;
+        }
+
+        PerfSampleEventInfo info;
+        error = file.GetSampleEventInfo(pHeader, &info);
+        if (error != 0)
+        {
+            continue;
+        }
+
+        json.clear();
+        error = formatter.AppendSampleAsJson(json, info, file.FileBigEndian(),
+            EventFormatterJsonFlags_Name);
+        if (error != 0)
+        {
+            continue;
+        }
+
+        r.Decoded += 1;
+        r.DecodeBytes += pHeader->size;
+    }
+
+    r.DecodeNs = NowNs() - start;
+    return error;
+}
+
+// Runs one configuration. Returns 0 for success, errno for error.
+static int
+RunConfig(
+    Options const& o,
+    Source source,
+    TracepointSessionMode mode,
+    Drain drain,
+    unsigned bufferKb,
+    unsigned watermarkPct,
+    Result& r) noexcept
+{
+    int error;
+    TracepointCache cache;
+    auto const bufferSize = bufferKb * 1024u;
+    TracepointSession session(
+        cache,
+        TracepointSessionOptions(mode, bufferSize)
+            .WakeupWatermark(static_cast<uint32_t>(uint64_t(bufferSize) * watermarkPct / 100u)));
+    PerfDataFileWriter writer;
+    TracepointTimestampRange writtenRange;
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> written(0);
+    std::vector<std::thread> producers;
+
+    error = session.EnableTracepoint(TracepointName(
+        source == Source::UserEvents ? UserEventsTracepoint : SyscallTracepoint));
+    if (error != 0)
+    {
+        return error;
+    }
+
+    if (drain == Drain::Flush)
+    {
+        error = writer.Create(o.OutputPath);
+        if (error != 0)
+        {
+            return error;
+        }
+
+        error = writer.WriteFinishedInit();
+        if (error != 0)
+        {
+            goto Done;
+        }
+    }
+
+    try
+    {
+        producers.reserve(o.Threads);
+        for (unsigned i = 0; i != o.Threads; i += 1)
+        {
+            producers.emplace_back(Producer, std::cref(o), source, i, std::cref(stop), std::ref(written));
+        }
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+        stop.store(true);
+        for (auto& producer : producers)
+        {
+            producer.join();
+        }
+        goto Done;
+    }
+
+    {
+        auto const endTime = NowNs() + uint64_t(o.DurationMs) * 1000000u;
+        if (mode == TracepointSessionMode::RealTime)
+        {
+            for (;;)
+            {
+                auto const now = NowNs();
+                if (now >= endTime)
+                {
+                    break;
+                }
+
+                // Wake at least every 100ms so the run ends on time.
+                auto const remaining = endTime - now < 100000000u ? endTime - now : 100000000u;
+                timespec timeout;
+                timeout.tv_sec = 0;
+                timeout.tv_nsec = static_cast<long>(remaining);
+                error = session.WaitForWakeup(&timeout);
+                if (error == 0)
+                {
+                    error = DrainOnce(session, drain, writer, writtenRange, r);
+                }
+
+                if (error != 0)
+                {
+                    break;
+                }
+            }
+        }
+        else
+        {
+            SleepNs(uint64_t(o.DurationMs) * 1000000u);
+        }
+
+        stop.store(true);
+        for (auto& producer : producers)
+        {
+            producer.join();
+        }
+
+        if (error == 0)
+        {
+            // Final drain picks up whatever arrived after the last wakeup.
+            error = DrainOnce(session, drain, writer, writtenRange, r);
+        }
+    }
+
+    r.Written = written.load();
+    r.Collected = session.SampleEventCount();
+    r.Lost = mode == TracepointSessionMode::RealTime
+        ? session.LostEventCount()
+        : r.Written > r.Collected ? r.Written - r.Collected : 0;
+
+Done:
+
+    if (drain == Drain::Flush)
+    {
+        if (error == 0)
+        {
+            error = session.SetWriterHeaders(writer, &writtenRange);
+        }
+
+        auto const closeError = writer.FinalizeAndClose();
+        if (error == 0)
+        {
+            error = closeError;
+        }
+
+        if (error == 0 && o.Decode)
+        {
+            r.DecodeError = DecodeFile(o.OutputPath, r);
+        }
+
+        unlink(o.OutputPath);
+    }
+
+    return error;
+}
+
+static double
+PerEvent(uint64_t ns, uint64_t events) noexcept
+{
+    return events == 0 ? 0.0 : static_cast<double>(ns) / static_cast<double>(events);
+}
+
+static double
+MbPerSec(uint64_t bytes, uint64_t ns) noexcept
+{
+    return ns == 0 ? 0.0 : static_cast<double>(bytes) * 1000.0 / static_cast<double>(ns);
+}
+
+static void
+PrintConfig(
+    Options const& o,
+    Source source,
+    TracepointSessionMode mode,
+    Drain drain,
+    unsigned bufferKb,
+    unsigned watermarkPct)
+{
+    printf("{\"source\":\"%s\",\"mode\":\"%s\",\"drain\":\"%s\",\"buffer_kb\":%u,"
+        "\"watermark_pct\":%u,\"threads\":%u,\"rate\":%u,\"duration_ms\":%u,",
+        source == Source::UserEvents ? "user_events" : "syscalls",
+        mode == TracepointSessionMode::RealTime ? "realtime" : "circular",
+        drain == Drain::Flush ? "flush" : "enumerate",
+        bufferKb, watermarkPct, o.Threads, o.Rate, o.DurationMs);
+}
+
+static void
+PrintResult(Result const& r, Drain drain, bool decode)
+{
+    printf("\"written\":%llu,\"collected\":%llu,\"lost\":%llu,\"lost_pct\":%.3f,"
+        "\"drain_calls\":%llu,\"drain_ns_per_event\":%.1f,\"drain_mb_per_sec\":%.1f,"
+        "\"drain_us_log2_hist\":[",
+        static_cast<unsigned long long>(r.Written),
+        static_cast<unsigned long long>(r.Collected),
+        static_cast<unsigned long long>(r.Lost),
+        r.Written == 0 ? 0.0 : 100.0 * static_cast<double>(r.Lost) / static_cast<double>(r.Written),
+        static_cast<unsigned long long>(r.DrainCalls),
+        PerEvent(r.DrainNs, r.Collected),
+        MbPerSec(r.DrainBytes, r.DrainNs));
+
+    unsigned histCount = HistBuckets;
+    while (histCount != 0 && r.DrainHist[histCount - 1] == 0)
+    {
+        histCount -= 1;
+    }
+
+    for (unsigned i = 0; i != histCount; i += 1)
+    {
+        printf("%s%llu", i == 0 ? "" : ",", static_cast<unsigned long long>(r.DrainHist[i]));
+    }
+
+    printf("]");
+
+    if (drain == Drain::Flush && decode)
+    {
+        if (r.DecodeError != 0)
+        {
+            printf(",\"decode_error\":\"%s\"", strerror(r.DecodeError));
+        }
+        else
+        {
+            printf(",\"decoded\":%llu,\"decode_ns_per_event\":%.1f,\"decode_mb_per_sec\":%.1f",
+                static_cast<unsigned long long>(r.Decoded),
+                PerEvent(r.DecodeNs, r.Decoded),
+                MbPerSec(r.DecodeBytes, r.DecodeNs));
+        }
+    }
+
+    printf("}\n");
+    fflush(stdout);
+}
+
+static bool
+ParseList(char const* text, std::vector<unsigned>& values)
+{
+    values.clear();
+    for (;;)
+    {
+        char* end;
+        auto const value = strtoul(text, &end, 0);
+        if (end == text)
+        {
+            return false;
+        }
+
+        values.push_back(static_cast<unsigned>(value));
+        if (*end == '\0')
+        {
+            return true;
+        }
+        else if (*end != ',')
+        {
+            return false;
+        }
+
+        text = end + 1;
+    }
+}
+
+static void
+Usage(char const* programName)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Measures end-to-end tracepoint collection and decode throughput.\n"
+        "Results are written to stdout as JSON lines. Usually requires root.\n"
+        "Options:\n"
+        "  -t N       Producer threads (default 2).\n"
+        "  -r N       Events per second per producer thread, 0 = unlimited\n"
+        "             (default 100000).\n"
+        "  -d MS      Duration of each configuration in milliseconds (default 1000).\n"
+        "  -b LIST    Comma-separated per-CPU buffer sizes in KB (default 64,256,1024).\n"
+        "  -w LIST    Comma-separated realtime wakeup watermarks as percent of the\n"
+        "             buffer size (default 0,50).\n"
+        "  -m MODE    realtime, circular, or both (default both).\n"
+        "  -D DRAIN   flush, enumerate, or both (default both).\n"
+        "  -o FILE    Temporary perf.data path for flush\n"
+        "             (default /tmp/tracepoint-session-benchmark.perf.data).\n"
+        "  -n         Do not decode the perf.data file.\n"
+        "  -s         Use the getppid syscall tracepoint instead of user_events.\n",
+        programName);
+}
+
+int
+main(int argc, char* argv[])
+{
+    Options o;
+    for (int argi = 1; argi < argc; argi += 1)
+    {
+        auto const arg = argv[argi];
+        bool const hasValue = argi + 1 < argc;
+        bool ok = true;
+        if (0 == strcmp(arg, "-t") && hasValue)
+        {
+            argi += 1;
+            o.Threads = static_cast<unsigned>(strtoul(argv[argi], nullptr, 0));
+        }
+        else if (0 == strcmp(arg, "-r") && hasValue)
+        {
+            argi += 1;
+            o.Rate = static_cast<unsigned>(strtoul(argv[argi], nullptr, 0));
+        }
+        else if (0 == strcmp(arg, "-d") && hasValue)
+        {
+            argi += 1;
+            o.DurationMs = static_cast<unsigned>(strtoul(argv[argi], nullptr, 0));
+        }
+        else if (0 == strcmp(arg, "-b") && hasValue)
+        {
+            argi += 1;
+            ok = ParseList(argv[argi], o.BufferKb);
+        }
+        else if (0 == strcmp(arg, "-w") && hasValue)
+        {
+            argi += 1;
+            ok = ParseList(argv[argi], o.WatermarkPct);
+        }
+        else if (0 == strcmp(arg, "-m") && hasValue)
+        {
+            argi += 1;
+            o.Realtime = 0 == strcmp(argv[argi], "realtime") || 0 == strcmp(argv[argi], "both");
+            o.Circular = 0 == strcmp(argv[argi], "circular") || 0 == strcmp(argv[argi], "both");
+            ok = o.Realtime || o.Circular;
+        }
+        else if (0 == strcmp(arg, "-D") && hasValue)
+        {
+            argi += 1;
+            o.Flush = 0 == strcmp(argv[argi], "flush") || 0 == strcmp(argv[argi], "both");
+            o.Enumerate = 0 == strcmp(argv[argi], "enumerate") || 0 == strcmp(argv[argi], "both");
+            ok = o.Flush || o.Enumerate;
+        }
+        else if (0 == strcmp(arg, "-o") && hasValue)
+        {
+            argi += 1;
+            o.OutputPath = argv[argi];
+        }
+        else if (0 == strcmp(arg, "-n"))
+        {
+            o.Decode = false;
+        }
+        else if (0 == strcmp(arg, "-s"))
+        {
+            o.ForceSyscalls = true;
+        }
+        else
+        {
+            Usage(argv[0]);
+            return 0 == strcmp(arg, "-h") || 0 == strcmp(arg, "--help") ? 0 : 1;
+        }
+
+        if (!ok)
+        {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (auto const watermarkPct : o.WatermarkPct)
+    {
+        if (watermarkPct > 100)
+        {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (o.Threads == 0 || o.DurationMs == 0 || o.BufferKb.empty() || o.WatermarkPct.empty())
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    auto source = Source::Syscalls;
+    if (!o.ForceSyscalls)
+    {
+        auto error = TraceLoggingRegister(BenchSessionProvider);
+        if (error == 0)
+        {
+            TracepointCache cache;
+            PerfEventMetadata const* metadata;
+            error = cache.FindOrAddFromSystem(TracepointName(UserEventsTracepoint), &metadata);
+        }
+
+        if (error == 0)
+        {
+            source = Source::UserEvents;
+        }
+        else
+        {
+            fprintf(stderr,
+                "info: user_events tracepoint unavailable (%s), using %.*s.\n",
+                strerror(error),
+                static_cast<int>(SyscallTracepoint.size()), SyscallTracepoint.data());
+        }
+    }
+
+    int exitCode = 0;
+    static TracepointSessionMode const Modes[] = {
+        TracepointSessionMode::RealTime,
+        TracepointSessionMode::Circular,
+    };
+    static Drain const Drains[] = {
+        Drain::Flush,
+        Drain::Enumerate,
+    };
+    static unsigned const NoWatermark[] = { 0 };
+
+    for (auto const mode : Modes)
+    {
+        bool const realtime = mode == TracepointSessionMode::RealTime;
+        if (realtime ? !o.Realtime : !o.Circular)
+        {
+            continue;
+        }
+
+        for (auto const drain : Drains)
+        {
+            if (drain == Drain::Flush ? !o.Flush : !o.Enumerate)
+            {
+                continue;
+            }
+
+            for (auto const bufferKb : o.BufferKb)
+            {
+                // Watermark only affects realtime wakeups.
+                auto const watermarks = realtime ? o.WatermarkPct.data() : NoWatermark;
+                auto const watermarkCount = realtime ? o.WatermarkPct.size() : 1u;
+                for (size_t i = 0; i != watermarkCount; i += 1)
+                {
+                    Result r;
+                    auto const error = RunConfig(o, source, mode, drain, bufferKb, watermarks[i], r);
+                    PrintConfig(o, source, mode, drain, bufferKb, watermarks[i]);
+                    if (error != 0)
+                    {
+                        printf("\"error\":\"%s\"}\n", strerror(error));
+                        fflush(stdout);
+                        exitCode = 1;
+                    }
+                    else
+                    {
+                        PrintResult(r, drain, o.Decode);
+                    }
+                }
+            }
+        }
+    }
+
+    TraceLoggingUnregister(BenchSessionProvider);
+    return exitCode;
+}
@@ -0,0 +1,345 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+TracepointAggregator: computes counts, sums, min/max, and histograms of sample
+events, grouped by tracepoint, pid, tid, cpu, time, and/or a field, without
+storing the events.
+*/
+
+#pragma once
+#ifndef _included_TracepointAggregator_h
+#define _included_TracepointAggregator_h 1
+
+#include <tracepoint/PerfEventInfo.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _Success_
+#define _Success_(condition)
+#endif
+#ifndef _In_z_
+#define _In_z_
+#endif
+
+namespace tracepoint_control
+{
+    /*
+    Group-by key of a TracepointAggregate. Members that are not group-by keys
+    of the aggregator are 0.
+    */
+    struct TracepointAggregateKey
+    {
+        uint32_t TracepointId; // PerfEventMetadata::Id(), i.e. common_type.
+        uint32_t Pid;
+        uint32_t Tid;
+        uint32_t Cpu;
+        uint64_t Time;  // Start of the event's time interval.
+        uint64_t Field; // Value of the group-by field.
+    };
+
+    /*
+    Result of aggregating the events that have the same key.
+    */
+    struct TracepointAggregate
+    {
+        TracepointAggregateKey Key;
+        uint64_t Count; // Number of events.
+        uint64_t Sum;   // Sum of the events' values (wraps on overflow).
+        uint64_t Min;   // Smallest value (unsigned comparison).
+        uint64_t Max;   // Largest value (unsigned comparison).
+
+        // NULL unless the aggregator was created with Histogram(true). Otherwise,
+        // TracepointAggregator::HistogramBucketCount counts: Histogram[0] is the
+        // count of events with value 0, Histogram[N] is the count of events with
+        // value in [2^(N-1), 2^N).
+        uint64_t const* Histogram;
+    };
+
+    /*
+    Configuration settings for a TracepointAggregator.
+
+    Example:
+
+        // Count of events per tracepoint per pid per second:
+        TracepointAggregator aggregator(TracepointAggregatorOptions()
+            .GroupByTracepoint()
+            .GroupByPid()
+            .GroupByTime(1000000000));
+
+        // Latency histogram of field "latency_ns" per CPU:
+        TracepointAggregator aggregator(TracepointAggregatorOptions()
+            .GroupByCpu()
+            .ValueField("latency_ns")
+            .Histogram());
+    */
+    class TracepointAggregatorOptions
+    {
+        friend class TracepointAggregator;
+
+    public:
+
+        /*
+        Initializes options with no group-by keys (all events are aggregated
+        together), value = 1 for each event, no histogram, and one partial.
+        */
+        constexpr
+        TracepointAggregatorOptions() noexcept
+            : m_groupByFieldName(nullptr)
+            , m_valueFieldName(nullptr)
+            , m_groupByTimeNs(0)
+            , m_partialCount(1)
+            , m_groupByTracepoint(false)
+            , m_groupByPid(false)
+            , m_groupByTid(false)
+            , m_groupByCpu(false)
+            , m_histogram(false)
+        {
+            return;
+        }
+
+        /*
+        Group events by tracepoint (the common_type of the event's metadata).
+        */
+        constexpr TracepointAggregatorOptions&
+        GroupByTracepoint(bool enable = true) noexcept
+        {
+            m_groupByTracepoint = enable;
+            return *this;
+        }
+
+        /*
+        Group events by process ID (requires PERF_SAMPLE_TID).
+        */
+        constexpr TracepointAggregatorOptions&
+        GroupByPid(bool enable = true) noexcept
+        {
+            m_groupByPid = enable;
+            return *this;
+        }
+
+        /*
+        Group events by thread ID (requires PERF_SAMPLE_TID).
+        */
+        constexpr TracepointAggregatorOptions&
+        GroupByTid(bool enable = true) noexcept
+        {
+            m_groupByTid = enable;
+            return *this;
+        }
+
+        /*
+        Group events by CPU (requires PERF_SAMPLE_CPU).
+        */
+        constexpr TracepointAggregatorOptions&
+        GroupByCpu(bool enable = true) noexcept
+        {
+            m_groupByCpu = enable;
+            return *this;
+        }
+
+        /*
+        Group events by time interval (requires PERF_SAMPLE_TIME): events with
+        time in [N * intervalNs, (N + 1) * intervalNs) have Key.Time =
+        N * intervalNs. 0 (the default) means do not group by time.
+        */
+        constexpr TracepointAggregatorOptions&
+        GroupByTime(uint64_t intervalNs) noexcept
+        {
+            m_groupByTimeNs = intervalNs;
+            return *this;
+        }
+
+        /*
+        Group events by the value of the named field (from the tracepoint's
+        format), e.g. "prev_pid". The field must be an integer of size 1, 2, 4,
+        or 8 (signed values are sign-extended). Events of tracepoints without
+        such a field are skipped. nullptr (the default) means do not group by a
+        field. The string is copied when the aggregator is created.
+        */
+        constexpr TracepointAggregatorOptions&
+        GroupByField(_In_z_ char const* fieldName) noexcept
+        {
+            m_groupByFieldName = fieldName;
+            return *this;
+        }
+
+        /*
+        Use the value of the named field (same requirements as GroupByField) as
+        each event's value for Sum, Min, Max, and Histogram. Events of
+        tracepoints without such a field are skipped. nullptr (the default)
+        means each event's value is 1.
+        */
+        constexpr TracepointAggregatorOptions&
+        ValueField(_In_z_ char const* fieldName) noexcept
+        {
+            m_valueFieldName = fieldName;
+            return *this;
+        }
+
+        /*
+        Keep a log2 histogram of the values of each aggregate.
+        */
+        constexpr TracepointAggregatorOptions&
+        Histogram(bool enable = true) noexcept
+        {
+            m_histogram = enable;
+            return *this;
+        }
+
+        /*
+        Number of partial aggregates, e.g. one per drain thread or per buffer.
+        Each partial may be updated by a different thread without locks. The
+        default is 1. Values less than 1 are treated as 1.
+        */
+        constexpr TracepointAggregatorOptions&
+        PartialCount(uint32_t count) noexcept
+        {
+            m_partialCount = count;
+            return *this;
+        }
+
+    private:
+
+        char const* m_groupByFieldName;
+        char const* m_valueFieldName;
+        uint64_t m_groupByTimeNs;
+        uint32_t m_partialCount;
+        bool m_groupByTracepoint;
+        bool m_groupByPid;
+        bool m_groupByTid;
+        bool m_groupByCpu;
+        bool m_histogram;
+    };
+
+    /*
+    Aggregates sample events without storing them. Plugs into the session's
+    enumeration methods, e.g.:
+
+        error = session.EnumerateSampleEventsUnordered(
+            [&](PerfSampleEventInfo const& event)
+            {
+                return aggregator.Add(event);
+            });
+
+    Each event's group-by fields are read from the PerfSampleEventInfo, and
+    the group-by and value fields are read from the event's raw data at an
+    offset that is looked up once per tracepoint.
+
+    For parallel drains, create the aggregator with PartialCount(N) and have
+    drain thread i call Add(i, event). Each partial is only written by its own
+    thread, so no locks or atomics are needed on the hot path. Collect merges
+    the partials. Collect must not run at the same time as Add or AddValue
+    (e.g. call it after the drain threads finish a round).
+
+    Fields are located with the tracepoint's format, so they are available for
+    kernel tracepoints and for user_events tracepoints with a typed
+    definition. The fields of an EventHeader event are in its payload: decode
+    them (e.g. with EventEnumerator) and pass them to AddValue.
+    */
+    class TracepointAggregator
+    {
+        struct Partial; // Defined in TracepointAggregator.cpp.
+
+        std::string const m_groupByFieldName; // Empty if not grouping by a field.
+        std::string const m_valueFieldName; // Empty if value is 1.
+        uint64_t const m_groupByTimeNs;
+        uint32_t const m_partialCount;
+        bool const m_groupByTracepoint;
+        bool const m_groupByPid;
+        bool const m_groupByTid;
+        bool const m_groupByCpu;
+        bool const m_histogram;
+        std::unique_ptr<Partial[]> const m_partials;
+        std::unique_ptr<Partial> const m_merged;
+
+    public:
+
+        /*
+        Number of buckets in TracepointAggregate::Histogram.
+        */
+        static constexpr unsigned HistogramBucketCount = 65;
+
+        TracepointAggregator(TracepointAggregator const&) = delete;
+        void operator=(TracepointAggregator const&) = delete;
+        ~TracepointAggregator();
+
+        /*
+        May throw std::bad_alloc.
+        */
+        explicit
+        TracepointAggregator(TracepointAggregatorOptions const& options) noexcept(false);
+
+        /*
+        Returns the number of partials (at least 1).
+        */
+        uint32_t
+        PartialCount() const noexcept;
+
+        /*
+        Same as Add(0, event).
+        */
+        _Success_(return == 0) int
+        Add(tracepoint_decode::PerfSampleEventInfo const& event) noexcept;
+
+        /*
+        Adds the event to the specified partial. Returns 0 if the event was
+        aggregated or skipped (see SkippedEventCount), ENOMEM if the aggregate
+        could not be allocated (the event is counted as skipped).
+
+        Requires: partialIndex < PartialCount().
+        */
+        _Success_(return == 0) int
+        Add(
+            uint32_t partialIndex,
+            tracepoint_decode::PerfSampleEventInfo const& event) noexcept;
+
+        /*
+        Same as Add(partialIndex, event), except that the caller provides the
+        group-by field value (used only if GroupByField was set) and the value
+        instead of reading them from the event's raw data, e.g. after decoding
+        an EventHeader event.
+        */
+        _Success_(return == 0) int
+        AddValue(
+            uint32_t partialIndex,
+            tracepoint_decode::PerfSampleEventInfo const& event,
+            uint64_t fieldKey,
+            uint64_t value) noexcept;
+
+        /*
+        Returns the number of events that were not aggregated because they did
+        not have a required field or because of ENOMEM, summed over the
+        partials. Not reset by Collect.
+        */
+        uint64_t
+        SkippedEventCount() const noexcept;
+
+        /*
+        Merges the partials and stores the results in results (replacing its
+        contents), in unspecified order. If reset is true, clears the partials
+        (e.g. to report per-interval results). The Histogram pointers remain
+        valid until the next call to Collect.
+
+        Returns 0 for success, ENOMEM if memory could not be allocated (in which
+        case results is empty and the partials are not reset).
+        */
+        _Success_(return == 0) int
+        Collect(
+            std::vector<TracepointAggregate>& results,
+            bool reset = true) noexcept;
+
+    private:
+
+        _Success_(return == 0) int
+        AddImpl(
+            Partial& partial,
+            tracepoint_decode::PerfSampleEventInfo const& event,
+            uint64_t fieldKey,
+            uint64_t value) noexcept;
+    };
+}
+// namespace tracepoint_control
+
+#endif // _included_TracepointAggregator_h
@@ -17,7 +17,9 @@ for its tracepoints.
 #include <tracepoint/PerfEventMetadata.h>
 #include <unordered_map>
 #include <string_view>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #ifndef _Success_
@@ -29,6 +31,12 @@ for its tracepoints.
 #ifndef _Out_
 #define _Out_
 #endif
+#ifndef _In_reads_
+#define _In_reads_(size)
+#endif
+#ifndef _Out_writes_opt_
+#define _Out_writes_opt_(size)
+#endif
 
 namespace tracepoint_control
 {
@@ -36,6 +44,18 @@ namespace tracepoint_control
 
     /*
     Loads, parses, and caches the metadata (format) information for tracepoints.
+
+    TracepointCache is thread-safe, so one cache can be shared by several
+    TracepointSession objects and decoder threads:
+
+    - Lookups (FindById, FindByName, FindByRawData, CommonTypeOffset,
+      CommonTypeSize) do not take a lock and may run concurrently with each
+      other and with methods that add to the cache.
+    - Methods that add to the cache or use the format cache file (Add...,
+      FindOrAddFromSystem when the event is not yet cached, Preregister...,
+      LoadFormatCacheFile, SaveFormatCacheFile) are serialized by a lock.
+    - Metadata is never removed, so a returned PerfEventMetadata pointer
+      remains valid until the cache is destroyed.
     */
     class TracepointCache
     {
@@ -114,6 +134,28 @@ namespace tracepoint_control
         _Success_(return == 0) int
         AddFromSystem(TracepointName const& name) noexcept;
 
+        /*
+        Equivalent to calling AddFromSystem(names[i]) for each name, but reads
+        and parses the "format" files concurrently on up to readThreadCount
+        threads (including the calling thread). This is significantly faster
+        than calling AddFromSystem in a loop when loading hundreds of
+        tracepoints.
+
+        - If pErrors is not NULL, pErrors[i] receives the result for names[i]
+          (0, EEXIST, EINVAL, ENOMEM, or the error from reading the file).
+        - If readThreadCount is 0, a thread count is chosen based on nameCount
+          and the number of CPUs (at most 8).
+
+        Returns 0 if every name was added or was already cached (EEXIST).
+        Otherwise, returns the first error other than EEXIST.
+        */
+        _Success_(return == 0) int
+        AddManyFromSystem(
+            _In_reads_(nameCount) TracepointName const* names,
+            size_t nameCount,
+            _Out_writes_opt_(nameCount) int* pErrors = nullptr,
+            unsigned readThreadCount = 0) noexcept;
+
         /*
         If metadata for an event with the specified name is cached, return it.
         Otherwise, return AddFromSystem(name).
@@ -182,6 +224,35 @@ namespace tracepoint_control
         _Success_(return == 0) int
         PreregisterTracepoint(_In_z_ char const* registerCommand) noexcept;
 
+        /*
+        Loads a format cache file previously written by SaveFormatCacheFile.
+        Returns 0 for success, EINVAL if the file is not a valid format cache, or
+        another errno if the file could not be read. On error, any previously
+        loaded format cache data is kept.
+
+        The loaded data is used by AddFromSystem, AddManyFromSystem,
+        FindOrAddFromSystem, and the Preregister methods: if the cache file has
+        the format for a tracepoint and the tracepoint's current tracefs ID
+        (from the small "id" file) matches the ID recorded with the format, the
+        recorded format is used instead of reading the tracepoint's "format"
+        file. If the ID does not match (e.g. the event was deleted and
+        re-registered), the "format" file is read as usual.
+        */
+        _Success_(return == 0) int
+        LoadFormatCacheFile(_In_z_ char const* path) noexcept;
+
+        /*
+        Writes the formats of the tracepoints that were loaded from the system
+        (not those added with AddFromFormat), plus any loaded format cache data
+        that was not used, to a format cache file that can be loaded by
+        LoadFormatCacheFile in a later process. The file is written to
+        "path.tmp" and then renamed to path.
+
+        Returns 0 for success, errno for error.
+        */
+        _Success_(return == 0) int
+        SaveFormatCacheFile(_In_z_ char const* path) const noexcept;
+
     private:
 
         struct TracepointRegistration
@@ -198,18 +269,24 @@ namespace tracepoint_control
 
         struct CacheVal
         {
-            std::vector<char> SystemAndFormat; // = "SystemName\nFormatFileContents"
-            tracepoint_decode::PerfEventMetadata Metadata; // Points into SystemAndFormat
+            tracepoint_decode::PerfEventMetadata const& Metadata; // Stored in m_metadataStore.
             std::unique_ptr<TracepointRegistration> Registration;
+            bool FromSystem; // true if format came from tracefs (may be saved to a format cache file).
 
             CacheVal(CacheVal const&) = delete;
             void operator=(CacheVal const&) = delete;
             ~CacheVal();
 
             CacheVal(
-                std::vector<char>&& systemAndFormat,
-                tracepoint_decode::PerfEventMetadata&& metadata,
-                std::unique_ptr<TracepointRegistration> registration) noexcept;
+                tracepoint_decode::PerfEventMetadata const& metadata,
+                std::unique_ptr<TracepointRegistration> registration,
+                bool fromSystem) noexcept;
+        };
+
+        struct SavedFormat
+        {
+            std::string_view FormatFileContents; // Points into m_savedFormatData.
+            uint32_t Id;
         };
 
         struct NameHashOps
@@ -218,22 +295,88 @@ namespace tracepoint_control
             size_t operator()(TracepointName const&, TracepointName const&) const noexcept; // Equal
         };
 
+        /*
+        Open-addressing (linear probing) index of cached values, used by
+        FindById and FindByName without taking a lock. A slot only changes from
+        NULL to non-NULL. When the index grows, the old table is kept (in
+        Retired) until the cache is destroyed since readers may still be using
+        it.
+        */
+        struct LookupTable
+        {
+            std::unique_ptr<std::atomic<CacheVal const*>[]> Slots;
+            std::unique_ptr<LookupTable> Retired;
+            uint32_t Mask; // Slot count - 1.
+
+            LookupTable(LookupTable const&) = delete;
+            void operator=(LookupTable const&) = delete;
+            ~LookupTable();
+            explicit LookupTable(uint32_t slotCount) noexcept(false);
+        };
+
+        /*
+        Appends the format for the specified tracepoint to format,
+        using the loaded format cache data if it is still current, otherwise
+        reading the tracepoint's "format" file. Requires m_mutex to be held by
+        the calling thread or by the thread that started the calling thread.
+        Does not modify the cache.
+        */
+        _Success_(return == 0) int
+        AppendFormat(
+            std::vector<char>& format,
+            TracepointName const& name) const noexcept;
+
         _Success_(return == 0) int
         PreregisterTracepointImpl(_In_z_ char const* registerCommand, unsigned eventNameSize) noexcept;
 
         /*
-        systemAndFormat = "SystemName\nFormatFileContents".
+        Parses the format and adds it to the cache (copying the strings).
+        Requires m_mutex to be held.
         */
         _Success_(return == 0) int
-        Add(std::vector<char>&& systemAndFormat,
-            size_t systemNameSize,
+        Add(std::string_view systemName,
+            std::string_view formatFileContents,
             bool longSize64,
-            std::unique_ptr<TracepointRegistration> registration) noexcept;
+            std::unique_ptr<TracepointRegistration> registration,
+            bool fromSystem) noexcept;
 
+        /*
+        Adds a copy of parsed metadata to the cache.
+        Requires m_mutex to be held.
+        */
+        _Success_(return == 0) int
+        Insert(
+            tracepoint_decode::PerfEventMetadata const& metadata,
+            std::unique_ptr<TracepointRegistration> registration,
+            bool fromSystem) noexcept;
+
+        /*
+        Makes sure the lookup tables can hold valCount values.
+        Requires m_mutex to be held. May throw std::bad_alloc.
+        */
+        void
+        ReserveLookup(size_t valCount) noexcept(false);
+
+        /*
+        Stores val in the first empty slot of the probe sequence for hash.
+        Requires m_mutex to be held and the table to have an empty slot.
+        */
+        static void
+        LookupAdd(LookupTable const& table, size_t hash, CacheVal const* val) noexcept;
+
+        mutable std::mutex m_mutex; // Serializes changes to the cache.
+        std::unique_ptr<LookupTable> m_idTableOwner;
+        std::unique_ptr<LookupTable> m_nameTableOwner;
+        std::atomic<LookupTable const*> m_idTable; // Published m_idTableOwner.
+        std::atomic<LookupTable const*> m_nameTable; // Published m_nameTableOwner.
+        tracepoint_decode::PerfEventMetadataStore m_metadataStore; // Text and fields of cached events.
+        tracepoint_decode::PerfEventMetadata m_parseScratch; // Reused by Add.
         std::unordered_map<uint32_t, CacheVal> m_byId;
         std::unordered_map<TracepointName, CacheVal const&, NameHashOps, NameHashOps> m_byName;
-        int8_t m_commonTypeOffset; // -1 = unset
-        uint8_t m_commonTypeSize; // 0 = unset
+        std::unordered_map<TracepointName, SavedFormat, NameHashOps, NameHashOps> m_savedFormats;
+        std::vector<char> m_savedFormatData; // Contents of the loaded format cache file.
+        std::atomic<int8_t> m_commonTypeOffset; // -1 = unset. Set after m_commonTypeSize.
+        std::atomic<uint8_t> m_commonTypeSize; // 0 = unset
     };
 }
 // namespace tracepoint_control
@@ -0,0 +1,136 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+TracepointEventQueue: single-producer, single-consumer queue that hands
+sample events from a thread that drains a TracepointSession to a thread that
+processes them.
+*/
+
+#pragma once
+#ifndef _included_TracepointEventQueue_h
+#define _included_TracepointEventQueue_h 1
+
+#include <tracepoint/PerfEventInfo.h>
+#include <atomic>
+#include <memory>
+
+#ifndef _Success_
+#define _Success_(condition)
+#endif
+#ifndef _Ret_opt_
+#define _Ret_opt_
+#endif
+
+namespace tracepoint_control
+{
+    /*
+    Lock-free single-producer, single-consumer queue of sample events.
+
+    The producer (usually the thread that drains a TracepointSession) calls
+    Push from its enumeration callback. Push copies the event's record into
+    the queue's arena and stores a PerfSampleEventInfo whose pointers
+    (header, raw_data, callchain, read_values) refer to the copy, so the event
+    remains valid after the enumeration returns. The consumer calls Front to
+    get the oldest event and Release when it is done with it. Neither side
+    allocates memory or takes a lock.
+
+    The event_desc and session_info pointers are not copied. They remain
+    valid as long as the tracepoint remains in the session (i.e. until the
+    session is cleared or destroyed).
+
+    For parallel processing, use one queue per buffer (e.g. per CPU), drain
+    each buffer with EnumerateBufferSampleEventsUnordered, and give each queue
+    to a different consumer thread.
+
+    Example:
+
+        // Drain thread:
+        session.EnumerateBufferSampleEventsUnordered(bufferIndex,
+            [&](PerfSampleEventInfo const& event)
+            {
+                if (queue.Push(event) != 0) dropped += 1; // Queue full.
+                return 0;
+            });
+
+        // Consumer thread:
+        while (auto event = queue.Front())
+        {
+            ...; // e.g. decode with EventEnumerator.
+            queue.Release();
+        }
+    */
+    class TracepointEventQueue
+    {
+        struct Slot
+        {
+            tracepoint_decode::PerfSampleEventInfo Info;
+            uint64_t ArenaEnd; // Arena position after this event's record.
+        };
+
+        static constexpr unsigned CacheLineSize = 64;
+
+        std::unique_ptr<Slot[]> const m_slots;
+        std::unique_ptr<uint64_t[]> const m_arena;
+        uint32_t const m_slotMask; // Slot count - 1.
+        uint32_t const m_arenaSize; // Bytes, multiple of 8.
+
+        // Positions are 64-bit counters that never wrap: slot = pos & m_slotMask,
+        // arena offset = pos % m_arenaSize.
+
+        // Written by consumer.
+        alignas(CacheLineSize) std::atomic<uint64_t> m_tail;
+        std::atomic<uint64_t> m_arenaTail;
+
+        // Written by producer.
+        alignas(CacheLineSize) std::atomic<uint64_t> m_head;
+        uint64_t m_arenaHead;
+        uint64_t m_cachedTail; // Producer's most recent copy of m_tail.
+        uint64_t m_cachedArenaTail; // Producer's most recent copy of m_arenaTail.
+
+    public:
+
+        TracepointEventQueue(TracepointEventQueue const&) = delete;
+        void operator=(TracepointEventQueue const&) = delete;
+        ~TracepointEventQueue();
+
+        /*
+        Creates a queue that holds up to maxEventCount events (rounded up to a
+        power of 2, minimum 2) using up to arenaSize bytes (rounded up to a
+        multiple of 8, minimum 65536) for the event records.
+
+        May throw std::bad_alloc.
+        */
+        TracepointEventQueue(
+            uint32_t maxEventCount,
+            uint32_t arenaSize) noexcept(false);
+
+        /*
+        Producer: copies the event into the queue.
+
+        Returns 0 for success, errno for error. Errors include:
+        - EAGAIN: the queue or its arena is full (try again after the consumer
+          releases some events, or drop the event).
+        - EINVAL: eventInfo.header is NULL.
+        */
+        _Success_(return == 0) int
+        Push(tracepoint_decode::PerfSampleEventInfo const& eventInfo) noexcept;
+
+        /*
+        Consumer: returns the oldest event in the queue, or NULL if the queue is
+        empty. The event remains valid until Release is called.
+        */
+        _Ret_opt_ tracepoint_decode::PerfSampleEventInfo const*
+        Front() const noexcept;
+
+        /*
+        Consumer: removes the oldest event from the queue.
+        Requires: Front() != NULL.
+        */
+        void
+        Release() noexcept;
+    };
+}
+// namespace tracepoint_control
+
+#endif // _included_TracepointEventQueue_h
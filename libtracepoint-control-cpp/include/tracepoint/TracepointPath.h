@@ -15,6 +15,7 @@ information.
 
 #include <string_view>
 #include <vector>
+#include <stdint.h>
 
 #ifndef _In_z_
 #define _In_z_
@@ -22,6 +23,9 @@ information.
 #ifndef _Ret_z_
 #define _Ret_z_
 #endif
+#ifndef _Out_
+#define _Out_
+#endif
 #ifndef _Success_
 #define _Success_(condition)
 #endif
@@ -85,6 +89,20 @@ namespace tracepoint_control
         std::vector<char>& dest,
         std::string_view systemName,
         std::string_view eventName) noexcept;
+
+    /*
+    Given systemName and eventName, reads the corresponding event's ID (the
+    contents of "$(tracingDirectory)/events/$(systemName)/$(eventName)/id").
+    This is much cheaper than reading the event's format file, so it can be
+    used to check whether previously-loaded format data is still current.
+
+    Returns 0 for success, errno for error.
+    */
+    _Success_(return == 0) int
+    ReadTracingEventId(
+        std::string_view systemName,
+        std::string_view eventName,
+        _Out_ uint32_t* pId) noexcept;
 }
 // namespace tracepoint_control
 
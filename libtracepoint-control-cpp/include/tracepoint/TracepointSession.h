@@ -43,9 +43,13 @@ TracepointSession class that manages a tracepoint collection session.
 #ifndef _Out_writes_
 #define _Out_writes_(size)
 #endif
+#ifndef _Out_writes_opt_
+#define _Out_writes_opt_(size)
+#endif
 
 // Forward declarations:
 struct pollfd; // From poll.h
+struct epoll_event; // From sys/epoll.h
 struct timespec; // From time.h
 namespace tracepoint_decode
 {
@@ -54,6 +58,8 @@ namespace tracepoint_decode
 
 namespace tracepoint_control
 {
+    class TimestampIndex; // Internal.
+
     /*
     Mode to use for a tracepoint collection session:
 
@@ -120,6 +126,25 @@ namespace tracepoint_control
         Disabled,
     };
 
+    /*
+    Settings for an additional buffer group of a tracepoint collection session.
+    Used with TracepointSessionOptions::BufferGroups.
+    */
+    struct TracepointBufferGroup
+    {
+        /*
+        Controls whether the group's buffers are managed as Circular or RealTime.
+        */
+        TracepointSessionMode Mode;
+
+        /*
+        The size of each of the group's buffers in bytes. This value will be
+        rounded up to a power of 2 that is equal to or greater than the page size.
+        Size may not exceed 2GB.
+        */
+        uint32_t PerCpuBufferSize;
+    };
+
     /*
     Configuration settings for a tracepoint collection session.
 
@@ -191,6 +216,22 @@ namespace tracepoint_control
             , m_wakeupUseWatermark(true)
             , m_wakeupValue(0)
             , m_sampleType(SampleTypeDefault)
+            , m_drainThreadCount(1)
+            , m_drainNumaAffinity(false)
+            , m_circularStandbyBuffer(false)
+            , m_bufferGroups(nullptr)
+            , m_bufferGroupsCount(0)
+            , m_metrics(false)
+            , m_adaptiveMinBufferSize(0)
+            , m_adaptiveMaxBufferSize(0)
+            , m_adaptiveBufferBudget(0)
+            , m_targetCgroupFile(-1)
+            , m_targetPid(-1)
+            , m_targetInherit(false)
+            , m_cpuHotplug(false)
+            , m_callchainMaxStack(0)
+            , m_callchainExcludeKernel(false)
+            , m_callchainExcludeUser(false)
         {
             return;
         }
@@ -222,6 +263,22 @@ namespace tracepoint_control
             , m_wakeupUseWatermark(true)
             , m_wakeupValue(0)
             , m_sampleType(SampleTypeDefault)
+            , m_drainThreadCount(1)
+            , m_drainNumaAffinity(false)
+            , m_circularStandbyBuffer(false)
+            , m_bufferGroups(nullptr)
+            , m_bufferGroupsCount(0)
+            , m_metrics(false)
+            , m_adaptiveMinBufferSize(0)
+            , m_adaptiveMaxBufferSize(0)
+            , m_adaptiveBufferBudget(0)
+            , m_targetCgroupFile(-1)
+            , m_targetPid(-1)
+            , m_targetInherit(false)
+            , m_cpuHotplug(false)
+            , m_callchainMaxStack(0)
+            , m_callchainExcludeKernel(false)
+            , m_callchainExcludeUser(false)
         {
             return;
         }
@@ -283,6 +340,284 @@ namespace tracepoint_control
             return *this;
         }
 
+        /*
+        Sets the number of threads that FlushToWriter will use to drain the buffers.
+
+        The default value is DrainThreadCount(1), i.e. FlushToWriter drains all
+        buffers on the calling thread.
+
+        If drainThreadCount > 1, the buffers are divided into drainThreadCount
+        groups of consecutive buffers (e.g. CPUs 0..3, 4..7, etc.). The calling
+        thread drains the first group and a pool of drainThreadCount - 1 worker
+        threads (created on the first call to FlushToWriter) drains the other
+        groups. Each thread copies its buffers' data into a private staging
+        chunk, releasing the buffer space as soon as the data is copied. After
+        all threads finish, the chunks are written to the writer in buffer order
+        on the calling thread. The caller should call WriteFinishedRound after
+        each FlushToWriter, as usual, so the events within the round do not need
+        to be in timestamp order.
+
+        This is useful for sessions with many busy CPUs, where a single thread
+        cannot keep up with the event rate. The value is limited to the number of
+        buffers.
+        */
+        constexpr TracepointSessionOptions&
+        DrainThreadCount(uint32_t drainThreadCount) noexcept
+        {
+            m_drainThreadCount = drainThreadCount ? drainThreadCount : 1u;
+            return *this;
+        }
+
+        /*
+        For systems with more than one NUMA node: makes FlushToWriter drain each
+        buffer on a thread that runs on the buffer's NUMA node.
+
+        The default value is DrainNumaAffinity(false), i.e. buffers are divided
+        among the DrainThreadCount threads by CPU number, and the threads run on
+        any CPU.
+
+        If enabled and the system has more than one NUMA node (as reported by
+        /sys/devices/system/node), FlushToWriter uses the parallel drain even if
+        DrainThreadCount is 1. Each NUMA node that has buffers gets
+        max(1, DrainThreadCount / nodeCount) worker threads, each bound to the
+        node's CPUs, and each worker drains only buffers of CPUs on its node.
+        Each worker's staging chunk is allocated by the worker's thread, so it
+        is normally placed in the node's memory (first-touch policy). The
+        calling thread waits for the workers and then writes all of the chunks
+        to the writer, in node order. If the system has only one NUMA node,
+        this option has no effect.
+        */
+        constexpr TracepointSessionOptions&
+        DrainNumaAffinity(bool enable = true) noexcept
+        {
+            m_drainNumaAffinity = enable;
+            return *this;
+        }
+
+        /*
+        For circular sessions only: allocates a second (standby) buffer for each
+        CPU so that enumeration and flush never pause collection.
+
+        The default value is CircularStandbyBuffer(false), i.e. enumerating or
+        flushing a buffer pauses collection into the buffer (events that arrive
+        while the buffer is paused are lost).
+
+        If enabled, the session uses two buffers per CPU, each owned by a dummy
+        software event, and redirects the CPU's tracepoints to one of them.
+        Enumerating or flushing a CPU's buffer first redirects the CPU's
+        tracepoints to the standby buffer (PERF_EVENT_IOC_SET_OUTPUT), then reads
+        the previous buffer, which is no longer being written. The previous
+        buffer becomes the standby buffer.
+
+        As a result, each enumeration or flush returns only the events that
+        arrived since the previous enumeration or flush (up to the buffer size),
+        not the full contents of the buffer. This uses twice as much memory, and
+        the cost of switching buffers is one ioctl per tracepoint per CPU.
+        */
+        constexpr TracepointSessionOptions&
+        CircularStandbyBuffer(bool enable = true) noexcept
+        {
+            m_circularStandbyBuffer = enable;
+            return *this;
+        }
+
+        /*
+        Adds buffer groups to the session. Each group has its own set of
+        buffers (one per CPU) with its own mode and size, so that a busy
+        tracepoint in one group cannot overwrite (circular) or fill up
+        (realtime) the buffers used by the tracepoints in another group, e.g. a
+        small realtime group for important events and a large circular group for
+        verbose events.
+
+        The default value is BufferGroups(nullptr, 0), i.e. the session has only
+        buffer group 0, which uses the mode and buffer sizes specified in the
+        constructor. groups[i] configures buffer group i + 1. Buffer groups use
+        the same CPUs as group 0 (if group 0 has a buffer size of 0 for a CPU,
+        no group collects on that CPU). The groups array is not copied and must
+        remain valid until the session is constructed.
+
+        Tracepoints are added to group 0 unless they are assigned to a group
+        with TracepointSession::SetTracepointBufferGroup. All groups are
+        enumerated together. If the session has more than one group, each buffer
+        is owned by a dummy software event, so the session uses one additional
+        file per buffer.
+        */
+        constexpr TracepointSessionOptions&
+        BufferGroups(
+            _In_reads_(groupsCount) TracepointBufferGroup const* groups,
+            uint32_t groupsCount) noexcept
+        {
+            m_bufferGroups = groupsCount ? groups : nullptr;
+            m_bufferGroupsCount = groups ? groupsCount : 0u;
+            return *this;
+        }
+
+        /*
+        Enables collection of the session's internal metrics (see
+        TracepointSession::GetMetrics).
+
+        The default value is Metrics(false). When enabled, the session reads
+        the clock at the start and end of each FlushToWriter call, each buffer
+        drain, and each write to the PerfDataFileWriter, and adds the durations
+        to histograms. When disabled, the only cost is a null check.
+        */
+        constexpr TracepointSessionOptions&
+        Metrics(bool enable = true) noexcept
+        {
+            m_metrics = enable;
+            return *this;
+        }
+
+        /*
+        For realtime buffers only: lets the session resize each buffer between
+        minBufferSize and maxBufferSize (each rounded up to a power of 2 that is
+        equal to or greater than the page size) based on how full the buffer
+        gets, so that busy CPUs get large buffers and idle CPUs keep small ones.
+
+        The default value is AdaptiveBufferSize(0, 0), i.e. buffer sizes do not
+        change. The initial size of each buffer comes from the constructor and
+        is clamped to [minBufferSize, maxBufferSize].
+
+        When a realtime buffer is drained, the session checks how much data was
+        pending. If the buffer lost events since the last check or was more than
+        3/4 full, the buffer's size is doubled (up to maxBufferSize). If the
+        buffer stayed less than 1/8 full and lost no events for 256 drains, its
+        size is halved (down to minBufferSize). A buffer only grows if the total
+        size of all realtime buffers would not exceed totalBufferBudget bytes
+        (0 = no limit).
+
+        To resize a buffer, the session creates a new buffer and redirects the
+        CPU's tracepoints to it (PERF_EVENT_IOC_SET_OUTPUT, as with
+        CircularStandbyBuffer), then drains and frees the old buffer. Events are
+        not lost by the switch, but an unreported loss in the old buffer (i.e.
+        events lost after the last PERF_RECORD_LOST and before the switch) will
+        not be counted. If the new buffer cannot be created, the buffer keeps
+        its current size. As with BufferGroups, each buffer is owned by a dummy
+        software event, so the session uses one additional file per buffer. The
+        minimum size should be larger than the WakeupWatermark.
+        */
+        constexpr TracepointSessionOptions&
+        AdaptiveBufferSize(
+            uint32_t minBufferSize,
+            uint32_t maxBufferSize,
+            uint64_t totalBufferBudget = 0) noexcept
+        {
+            m_adaptiveMinBufferSize = minBufferSize;
+            m_adaptiveMaxBufferSize = maxBufferSize;
+            m_adaptiveBufferBudget = totalBufferBudget;
+            return *this;
+        }
+
+        /*
+        Limits collection to events generated by tasks in the specified cgroup
+        (perf_event_open with PERF_FLAG_PID_CGROUP), e.g. a single container.
+
+        The default is system-wide collection (events from all tasks).
+
+        - cgroupFile: a file descriptor for the cgroup's directory in the
+          cgroup filesystem, e.g. open("/sys/fs/cgroup/my.slice", O_RDONLY).
+          The session uses a duplicate of the descriptor, so the caller may
+          close it after the session is constructed.
+
+        The kernel requires one file per tracepoint per CPU for cgroup events.
+        If the cgroup has a cpuset (cgroup v2 "cpuset.cpus.effective"), the
+        session only creates buffers and files for the CPUs in the cpuset (as
+        if the other CPUs had a buffer size of 0), so a container pinned to a
+        few CPUs of a large host uses a few buffers. Events on CPUs that are
+        added to the cpuset later are not collected. Since only the cgroup's
+        events are collected, the buffers can usually be much smaller than for
+        a system-wide session.
+        */
+        constexpr TracepointSessionOptions&
+        TargetCgroup(int cgroupFile) noexcept
+        {
+            m_targetCgroupFile = cgroupFile;
+            m_targetPid = -1;
+            m_targetInherit = false;
+            return *this;
+        }
+
+        /*
+        Limits collection to events generated by the specified process
+        (perf_event_open with pid).
+
+        The default is system-wide collection (events from all tasks).
+
+        - pid: the process (or thread) to collect.
+        - inherit: if true, also collects events from threads and child
+          processes that the target creates after the tracepoint is enabled
+          (perf_event_attr.inherit).
+
+        If inherit is false, the session uses a single buffer for all CPUs and
+        one file per tracepoint, regardless of the number of CPUs. The buffer
+        size is the size specified for the first CPU. Events that the process
+        generates while its buffer is full are lost (realtime) or overwrite
+        older events (circular), as with a per-CPU buffer.
+
+        If inherit is true, the kernel requires one buffer per CPU (inherited
+        events cannot share a single buffer). The session only creates buffers
+        and files for the CPUs in the target's CPU affinity mask
+        (sched_getaffinity) at the time the session is constructed. Events on
+        other CPUs are not collected, e.g. if the target's affinity is widened
+        later.
+        */
+        constexpr TracepointSessionOptions&
+        TargetProcess(pid_t pid, bool inherit = true) noexcept
+        {
+            m_targetCgroupFile = -1;
+            m_targetPid = pid;
+            m_targetInherit = inherit;
+            return *this;
+        }
+
+        /*
+        Lets the session follow CPU hotplug (CPUs that are added or brought
+        online after the session starts, e.g. vCPUs hot-added to a VM).
+
+        The default value is CpuHotplug(false), i.e. the session has one buffer
+        per group for each CPU that was online when the session was
+        constructed, and the set of buffers never changes.
+
+        If enabled, the session has a buffer slot for each possible CPU
+        (/sys/devices/system/cpu/possible) but only creates buffers and files
+        for the CPUs that are online. Call TracepointSession::UpdateOnlineCpus
+        periodically (e.g. after each flush) to create the buffers and files of
+        CPUs that came online and to free those of CPUs that went offline.
+        Buffer indexes do not change. No effect with TargetProcess(pid, false),
+        which uses a single buffer for all CPUs.
+        */
+        constexpr TracepointSessionOptions&
+        CpuHotplug(bool enable = true) noexcept
+        {
+            m_cpuHotplug = enable;
+            return *this;
+        }
+
+        /*
+        Limits the stacks captured for each sample when SampleType includes
+        PERF_SAMPLE_CALLCHAIN. Default is (0, true, true).
+
+        - maxStack: maximum number of frames per sample (sets
+          perf_event_attr.sample_max_stack). 0 means the system default
+          (/proc/sys/kernel/perf_event_max_stack).
+        - kernel: include kernel frames. For user_events tracepoints these are
+          the frames of the write system call, which rarely identify the
+          code that logged the event.
+        - user: include user-mode frames.
+
+        Each frame is 8 bytes in the ring buffer and in the output file, so
+        limiting the stack reduces the bandwidth used by each sample. (Use
+        PerfCallchainTable to store each distinct stack only once in a file.)
+        */
+        constexpr TracepointSessionOptions&
+        CallchainLimits(uint16_t maxStack, bool kernel = true, bool user = true) noexcept
+        {
+            m_callchainMaxStack = maxStack;
+            m_callchainExcludeKernel = !kernel;
+            m_callchainExcludeUser = !user;
+            return *this;
+        }
+
     private:
 
         uint32_t const* m_cpuBufferSizes;
@@ -292,6 +627,22 @@ namespace tracepoint_control
         bool m_wakeupUseWatermark;
         uint32_t m_wakeupValue;
         uint32_t m_sampleType;
+        uint32_t m_drainThreadCount;
+        bool m_drainNumaAffinity;
+        bool m_circularStandbyBuffer;
+        TracepointBufferGroup const* m_bufferGroups;
+        uint32_t m_bufferGroupsCount;
+        bool m_metrics;
+        uint32_t m_adaptiveMinBufferSize;
+        uint32_t m_adaptiveMaxBufferSize;
+        uint64_t m_adaptiveBufferBudget;
+        int m_targetCgroupFile;
+        pid_t m_targetPid;
+        bool m_targetInherit;
+        bool m_cpuHotplug;
+        uint16_t m_callchainMaxStack;
+        bool m_callchainExcludeKernel;
+        bool m_callchainExcludeUser;
     };
 
     /*
@@ -304,6 +655,122 @@ namespace tracepoint_control
         uint64_t Last = 0;
     };
 
+    /*
+    Log-linear histogram of durations in nanoseconds, used by
+    TracepointSessionMetrics. Values below 4ns each have their own bucket.
+    Above that, each power of 2 is divided into 4 equal buckets, so a
+    bucket's upper bound is at most 25% above its lower bound. Values of
+    7 * 2^38ns (about 32 minutes) or more are counted in the last bucket.
+    */
+    struct TracepointLatencyHistogram
+    {
+        static constexpr unsigned BucketCount = 160;
+
+        uint64_t Count;   // Number of values recorded.
+        uint64_t TotalNs; // Sum of values recorded.
+        uint64_t MaxNs;   // Largest value recorded.
+        uint64_t Buckets[BucketCount];
+
+        /*
+        Returns the index of the bucket that counts the specified value.
+        */
+        static unsigned
+        BucketIndex(uint64_t ns) noexcept;
+
+        /*
+        Returns the smallest value counted by the specified bucket.
+        Requires: bucketIndex < BucketCount.
+        */
+        static uint64_t
+        BucketLowerBound(unsigned bucketIndex) noexcept;
+
+        /*
+        Returns the lower bound of the bucket containing the value at the
+        specified percentile (0..100), e.g. Percentile(99) for p99.
+        Returns 0 if Count == 0.
+        */
+        uint64_t
+        Percentile(double percent) const noexcept;
+    };
+
+    /*
+    Event loss for one of a session's buffers, returned by
+    TracepointSession::GetBufferLostInfo.
+
+    The kernel reports lost events by writing a PERF_RECORD_LOST record into the
+    buffer when it is next able to write to the buffer, so the loss is seen when
+    the record is enumerated or flushed. Tracepoints are opened with
+    sample_id_all, so the record includes the time at which the loss was
+    reported (the end of the gap). FlushToWriter writes these records to the
+    output file (see PerfDataFile::GetLostEventCount).
+    */
+    struct TracepointBufferLostInfo
+    {
+        /*
+        Total number of events lost from this buffer. This is included in
+        TracepointSession::LostEventCount().
+        */
+        uint64_t LostEventCount;
+
+        /*
+        Total number of PERF_RECORD_LOST records seen in this buffer, i.e. the
+        number of gaps.
+        */
+        uint64_t LostRecordCount;
+
+        /*
+        Number of events lost since the last call to ResetLostWindows.
+        */
+        uint64_t WindowLostEventCount;
+
+        /*
+        Range of the timestamps of the PERF_RECORD_LOST records seen since the
+        last call to ResetLostWindows. Invalid (First > Last) if there were no
+        such records or if the session's SampleType does not include
+        PERF_SAMPLE_TIME.
+        */
+        TracepointTimestampRange WindowRange;
+    };
+
+    /*
+    Snapshot of a session's internal metrics, returned by
+    TracepointSession::GetMetrics. Values are cumulative since the session was
+    constructed. All values are 0 unless the session was created with
+    TracepointSessionOptions::Metrics(true).
+    */
+    struct TracepointSessionMetrics
+    {
+        /*
+        Total bytes consumed from the session's buffers (sum of
+        TracepointSession::BufferBytesDrained for all buffers).
+        */
+        uint64_t BytesDrained;
+
+        /*
+        Total bytes passed to the PerfDataFileWriter by FlushToWriter.
+        */
+        uint64_t WriterBytes;
+
+        /*
+        Duration of each FlushToWriter or FlushBuffersToWriter call.
+        */
+        TracepointLatencyHistogram FlushNs;
+
+        /*
+        Duration of each buffer drain, from EnumeratorBegin (pausing the buffer
+        in circular mode) to EnumeratorEnd (releasing the buffer space in
+        realtime mode, or resuming the buffer in circular mode). Recorded for
+        all enumeration and flush methods.
+        */
+        TracepointLatencyHistogram BufferHoldNs;
+
+        /*
+        Duration of each write to the PerfDataFileWriter during FlushToWriter,
+        i.e. the writev/write system call latency.
+        */
+        TracepointLatencyHistogram WriterWriteNs;
+    };
+
     /*
     Configuration settings for TracepointSession::SavePerfDataFile.
 
@@ -316,6 +783,7 @@ namespace tracepoint_control
     class TracepointSavePerfDataFileOptions
     {
         friend class TracepointSession;
+        friend class TracepointSnapshot;
 
     public:
 
@@ -324,13 +792,17 @@ namespace tracepoint_control
 
         - OpenMode = -1 (use default file permissions based on process umask).
         - TimestampFilter = 0..MAX_UINT64 (no timestamp filtering).
+        - TimestampFilterSlack = UINT64_MAX (check the timestamp of every sample).
         - TimestampWrittenRange = nullptr (do not return timestamp range).
+        - CompressionLevel = 0 (do not compress).
         */
         constexpr
         TracepointSavePerfDataFileOptions() noexcept
             : m_openMode(-1)
             , m_filterRange{ 0, UINT64_MAX }
+            , m_filterSlackNs(UINT64_MAX)
             , m_timestampWrittenRange(nullptr)
+            , m_compressionLevel(0)
         {
             return;
         }
@@ -386,6 +858,27 @@ namespace tracepoint_control
             return *this;
         }
 
+        /*
+        Advanced: Sets how far (in timestamp units, normally nanoseconds) a sample
+        may be beyond the TimestampFilter window before the rest of its buffer's
+        samples are skipped without reading their timestamps.
+
+        Each buffer's events are mostly in timestamp order (circular buffers are
+        read newest-to-oldest), but a buffer written from several CPUs may have
+        small inversions. With a slack, once a buffer yields a sample that is more
+        than slackNs beyond the far edge of the window, the buffer's remaining
+        samples are not written, even if they are in the window. Non-sample
+        events are still written.
+
+        Default value is UINT64_MAX (check the timestamp of every sample).
+        */
+        constexpr TracepointSavePerfDataFileOptions&
+        TimestampFilterSlack(uint64_t slackNs) noexcept
+        {
+            m_filterSlackNs = slackNs;
+            return *this;
+        }
+
         /*
         Sets the variable that will receive the timestamp range of the events that were
         written to the file.
@@ -399,11 +892,28 @@ namespace tracepoint_control
             return *this;
         }
 
+        /*
+        Sets the zstd compression level for the event data, or 0 for no
+        compression. If non-zero, SavePerfDataFile uses
+        PerfDataFileWriter::EnableCompression(level), which fails with ENOTSUP
+        if the library was built without zstd.
+
+        Default value is 0 (do not compress).
+        */
+        constexpr TracepointSavePerfDataFileOptions&
+        CompressionLevel(int level) noexcept
+        {
+            m_compressionLevel = level;
+            return *this;
+        }
+
     private:
 
         int m_openMode;
         TracepointTimestampRange m_filterRange;
+        uint64_t m_filterSlackNs;
         TracepointTimestampRange* m_timestampWrittenRange;
+        int m_compressionLevel;
     };
 
     /*
@@ -439,6 +949,129 @@ namespace tracepoint_control
 
         _Success_(return == 0) int
         GetEventCount(_Out_ uint64_t* value) const noexcept;
+
+        /*
+        Returns the number of this tracepoint's events that were read from the
+        session's buffers but discarded by the rate limit set with
+        TracepointSession::SetTracepointRateLimit. (GetEventCount counts all
+        occurrences of the tracepoint, including events skipped by the sample
+        period and events discarded by the rate limit.)
+        */
+        uint64_t
+        RateLimitDroppedCount() const noexcept;
+
+        /*
+        Returns the index of the buffer group that collects this tracepoint's
+        events (see TracepointSession::SetTracepointBufferGroup).
+        */
+        uint32_t
+        BufferGroup() const noexcept;
+    };
+
+    /*
+    A copy of the contents of a session's circular buffers, taken by
+    TracepointSession::SnapshotBuffers and saved to a perf.data file later,
+    e.g. on another thread. This keeps the time that the buffers are paused
+    short: each buffer is paused only while its contents are copied, not while
+    the file is formatted and written.
+
+    A snapshot keeps its memory when it is cleared or re-used, so a caller that
+    takes snapshots regularly can keep a pool of them to avoid allocations.
+
+    The snapshot references the session's tracepoint information, so the
+    session must not be destroyed until the snapshot has been saved. Saving a
+    snapshot does not access the session's buffers, so it can run at the same
+    time as other operations on the session.
+    */
+    class TracepointSnapshot
+    {
+        friend class TracepointSession;
+
+    public:
+
+        TracepointSnapshot(TracepointSnapshot const&) = delete;
+        void operator=(TracepointSnapshot const&) = delete;
+        ~TracepointSnapshot();
+
+        TracepointSnapshot(TracepointSnapshot&&) noexcept;
+        TracepointSnapshot& operator=(TracepointSnapshot&&) noexcept;
+
+        /*
+        Creates an empty snapshot.
+        */
+        TracepointSnapshot() noexcept;
+
+        /*
+        Discards the snapshot's data but keeps its memory for re-use.
+        */
+        void
+        Clear() noexcept;
+
+        /*
+        Returns true if the snapshot has no data.
+        */
+        bool
+        Empty() const noexcept;
+
+        /*
+        Returns the number of bytes of buffer data in the snapshot.
+        */
+        size_t
+        DataSize() const noexcept;
+
+        /*
+        Same as TracepointSession::SavePerfDataFile, but writes the snapshot's
+        data instead of the session's buffers.
+        */
+        _Success_(return == 0) int
+        SavePerfDataFile(
+            _In_z_ char const* perfDataFileName,
+            TracepointSavePerfDataFileOptions const& options = TracepointSavePerfDataFileOptions()) const noexcept;
+
+        /*
+        Same as TracepointSession::FlushToWriter, but writes the snapshot's data
+        instead of the session's buffers, and adds EventDesc records for all of
+        the session's tracepoints (not just the ones that have events). The
+        snapshot is not changed, so it can be written more than once.
+        */
+        _Success_(return == 0) int
+        WriteToWriter(
+            tracepoint_decode::PerfDataFileWriter& writer,
+            _Inout_ TracepointTimestampRange* writtenRange,
+            TracepointTimestampRange filterRange = { 0, UINT64_MAX }) const noexcept;
+
+        /*
+        Same as TracepointSession::SetWriterHeaders, using the session
+        information captured with the snapshot.
+        */
+        _Success_(return == 0) int
+        SetWriterHeaders(
+            tracepoint_decode::PerfDataFileWriter& writer,
+            _In_opt_ TracepointTimestampRange const* writtenRange) const noexcept;
+
+    private:
+
+        _Success_(return == 0) int
+        WriteToWriterImpl(
+            tracepoint_decode::PerfDataFileWriter& writer,
+            _Inout_ TracepointTimestampRange* writtenRange,
+            TracepointTimestampRange filterRange,
+            uint64_t filterSlackNs) const noexcept;
+
+        struct SnapshotBuffer
+        {
+            size_t DataOffset; // Offset of the buffer's data in m_data.
+            size_t DataSize;
+            uint32_t BufferIndex;
+        };
+
+        std::unique_ptr<uint8_t[]> m_data; // Not initialized, so growing it does not touch the memory.
+        size_t m_dataCapacity;
+        size_t m_dataSize;
+        std::vector<SnapshotBuffer> m_buffers;
+        std::vector<tracepoint_decode::PerfEventDesc> m_eventDescs;
+        tracepoint_decode::PerfEventSessionInfo m_sessionInfo;
+        uint32_t m_sampleType;
     };
 
     /*
@@ -512,13 +1145,26 @@ namespace tracepoint_control
             size_t get_size() const noexcept;
         };
 
+        struct RateLimitBucket
+        {
+            uint64_t Tokens; // 1 event = 1000000000 tokens.
+            uint64_t LastTime;
+            uint64_t DroppedCount;
+        };
+
         struct TracepointInfoImpl : TracepointInfo
         {
-            tracepoint_decode::PerfEventDesc const m_eventDesc;
+            tracepoint_decode::PerfEventDesc m_eventDesc; // ids_count grows as CPUs come online (CpuHotplug).
             std::unique_ptr<char unsigned[]> const m_eventDescStorage;
             std::unique_ptr<unique_fd[]> const m_bufferFiles; // size is BufferFilesCount
             unsigned const m_bufferFilesCount;
+            uint32_t m_bufferGroup;
             TracepointEnableState m_enableState;
+            uint32_t m_rateLimitPerSecond; // 0 = no rate limit.
+            uint64_t m_rateLimitCapacity; // Tokens, = burstSize * 1000000000.
+            std::unique_ptr<RateLimitBucket[]> m_rateLimitBuckets; // NULL or size is BufferFilesCount.
+            std::unique_ptr<char[]> m_filter; // Last SetTracepointFilter, for files opened later (CpuHotplug).
+            unique_fd m_bpfProgramFile; // Last SetTracepointBpfProgram, for files opened later (CpuHotplug).
 
             TracepointInfoImpl(TracepointInfoImpl const&) = delete;
             void operator=(TracepointInfoImpl const&) = delete;
@@ -536,16 +1182,58 @@ namespace tracepoint_control
             // Calls read() on each file, returns sum of the value fields.
             _Success_(return == 0) int
             GetEventCountImpl(_Out_ uint64_t* value) const noexcept;
+
+            // Returns true if the event at the specified time is within the
+            // rate limit for the specified buffer. Precondition: m_rateLimitPerSecond != 0.
+            bool
+            RateLimitAllows(unsigned bufferIndex, uint64_t time) const noexcept;
         };
 
         struct BufferInfo
         {
             unique_mmap Mmap; // When non-empty: Mmap.get_size() = Size + PAGE_SIZE
             uint32_t Size; // Set whether or not Mmap is empty.
+            uint32_t OnlineSize; // Initial Size, used when the CPU comes online (CpuHotplug). 0 = not collected.
             uint8_t const* Data; // NULL if Mmap is empty, else Mmap.ptr + PAGE_SIZE.
             size_t DataPos;
             size_t DataTail;
             uint64_t DataHead64;
+            bool Realtime; // Mode of the buffer's group.
+            bool Standby; // Circular with CircularStandbyBuffer(true).
+
+            // Standby mode only: the inactive buffer, and the data_head of each
+            // buffer when it was last drained (older data was already returned).
+            unique_mmap StandbyMmap;
+            uint8_t const* StandbyData;
+            uint64_t DrainedHead64;
+            uint64_t StandbyDrainedHead64;
+
+            // Statistics, tracked per-buffer so that buffers can be drained in parallel.
+            uint64_t LostEventCount;
+            uint64_t CorruptBufferCount;
+            uint64_t LostRecordCount;
+            uint64_t WindowLostEventCount;
+            TracepointTimestampRange WindowLostRange;
+
+            // Metrics (only when m_metrics != nullptr).
+            uint64_t EnumBeginNs; // When EnumeratorBegin was called.
+            uint64_t BytesDrained; // Atomic: may be read by GetMetrics on another thread.
+
+            // Circular buffers only (not standby): timestamp checkpoints of the
+            // records that were read, and whether the current enumeration is
+            // updating them. See IndexBegin.
+            std::unique_ptr<TimestampIndex> Index;
+            bool Indexing;
+
+            // Adaptive mode only. While a resize is in progress, ResizeMmap is the
+            // new buffer (already receiving events), Mmap is the old buffer (being
+            // drained), and ResizeRetiredOwner is the old buffer's owner.
+            unique_mmap ResizeMmap;
+            unique_fd ResizeRetiredOwner;
+            uint32_t ResizeSize;
+            uint32_t AdaptiveDrainCount; // Drains since the last resize decision.
+            size_t AdaptivePeakBytes; // Most pending data seen since the last decision.
+            uint64_t AdaptiveLostBase; // LostEventCount at the last decision.
 
             BufferInfo(BufferInfo const&) = delete;
             void operator=(BufferInfo const&) = delete;
@@ -556,17 +1244,57 @@ namespace tracepoint_control
         struct TracepointBookmark
         {
             uint64_t Timestamp;
-            uint16_t BufferIndex;
-            uint16_t RecordSize;
             uint32_t RecordBufferPos;
+            uint16_t RecordSize;
+
+            TracepointBookmark() noexcept = default;
 
             TracepointBookmark(
                 uint64_t timestamp,
-                uint16_t bufferIndex,
                 uint16_t recordSize,
                 uint32_t recordBufferPos) noexcept;
         };
 
+        /*
+        The SAMPLE records of one buffer that have not yet been returned by
+        OrderedEnumerator, which merges one run per buffer using a min-heap.
+        - Realtime: The buffer is read as the run advances. Pending holds the
+          next records in buffer order (up to WindowSize of them), sorted by
+          timestamp, and the run's next record is Pending[0]. Records that are
+          out of order by fewer than WindowSize positions are returned in order.
+        - Circular: The buffer's records are bookmarked up front (the buffer
+          can only be scanned newest-to-oldest) and sorted by timestamp.
+          Pos/EndPos are indexes into m_enumeratorBookmarks.
+        */
+        struct TracepointRun
+        {
+            static constexpr unsigned WindowSize = 16;
+
+            uint64_t Timestamp;    // Timestamp of the run's next record.
+            size_t Pos;            // Circular: index of the run's next record.
+            size_t EndPos;         // Circular: index just after the run's last record.
+            uint32_t BufferIndex;
+            uint32_t PendingCount; // Realtime: number of records in Pending.
+            TracepointBookmark Pending[WindowSize]; // Realtime: sorted by timestamp.
+
+            explicit
+            TracepointRun(uint32_t bufferIndex) noexcept;
+        };
+
+        struct SampleIdSlot
+        {
+            uint64_t SampleId;
+            TracepointInfoImpl const* Tpi; // NULL = empty slot.
+        };
+
+        using ParseSampleFn = bool (TracepointSession::*)(
+            BufferInfo const& buffer,
+            uint16_t recordSize,
+            uint32_t recordBufferPos) noexcept;
+
+        struct FlushWorker; // Forward declaration
+        class FlushWorkerPool; // Forward declaration
+
         class UnorderedEnumerator
         {
             TracepointSession& m_session;
@@ -590,7 +1318,7 @@ namespace tracepoint_control
         {
             TracepointSession& m_session;
             bool m_needsCleanup;
-            size_t m_index;
+            unsigned const m_bytesBeforeTime;
 
         public:
 
@@ -601,11 +1329,28 @@ namespace tracepoint_control
             explicit
             OrderedEnumerator(TracepointSession& session) noexcept;
 
+            // Starts a run for each buffer and builds the merge heap. Reads only
+            // the first few records of each realtime buffer. Records are not
+            // parsed until they are returned by MoveNext.
             _Success_(return == 0) int
             LoadAndSort() noexcept;
 
             bool
             MoveNext() noexcept;
+
+        private:
+
+            static bool
+            RunGreater(TracepointRun const* runs, uint32_t a, uint32_t b) noexcept;
+
+            // Reads realtime records into run.Pending until it is full or the
+            // buffer has no more records.
+            void
+            FillRun(TracepointRun& run) noexcept;
+
+            // Moves run to its next SAMPLE record. Returns false if run is done.
+            bool
+            AdvanceRun(TracepointRun& run) noexcept;
         };
 
     public:
@@ -716,7 +1461,8 @@ namespace tracepoint_control
         Cache() const noexcept;
 
         /*
-        Returns the mode that was specified at construction.
+        Returns the mode that was specified at construction, i.e. the mode of
+        buffer group 0.
         */
         TracepointSessionMode
         Mode() const noexcept;
@@ -743,24 +1489,82 @@ namespace tracepoint_control
         uint32_t
         BufferSize(unsigned bufferIndex = 0) const noexcept;
 
+        /*
+        Returns the total size (in bytes) of all of the session's buffers, not
+        including standby buffers. With AdaptiveBufferSize, this changes as
+        buffers are resized.
+        */
+        uint64_t
+        TotalBufferSize() const noexcept;
+
+        /*
+        Returns the number of times a buffer has been resized by
+        AdaptiveBufferSize. May be called from any thread.
+        */
+        uint64_t
+        BufferResizeCount() const noexcept;
+
         /*
         Returns the number of buffers used for the session.
-        Usually this is the number of CPUs.
+        Usually this is the number of CPUs times BufferGroupCount(). The buffers
+        of group G are at indexes [G * N, (G + 1) * N), where
+        N = BufferCount() / BufferGroupCount(), in order of CPU.
         */
         uint32_t
         BufferCount() const noexcept;
 
         /*
-        Returns the number of SAMPLE events that have been enumerated by this
-        session.
+        For sessions with CpuHotplug(true): updates the session's buffers to
+        match the CPUs that are currently online
+        (/sys/devices/system/cpu/online).
+
+        - For each CPU that came online, creates the CPU's buffers (one per
+          group, using the size that was configured for the CPU) and opens the
+          CPU's file for each session tracepoint, with the tracepoint's current
+          enable state, filter, BPF program, and sample period.
+        - For each CPU that went offline, closes the CPU's files and frees its
+          buffers once they are empty, i.e. after their events have been
+          flushed or enumerated. Until then (and always for circular buffers,
+          which hold the trace history) the buffers are kept and this function
+          tries again on the next call.
+
+        Other buffers are not affected, so collection continues during the
+        update. This is inexpensive if nothing changed (it reads one sysfs
+        file). Sample IDs of removed files remain valid for previously
+        collected events.
+
+        Returns 0 for success, ENOTSUP if the session does not have
+        CpuHotplug(true), or an errno if a buffer or file could not be created
+        (the CPU is retried on the next call).
         */
-        uint64_t
-        SampleEventCount() const noexcept;
+        _Success_(return == 0) int
+        UpdateOnlineCpus() noexcept;
 
         /*
-        Returns the number of lost events that have been enumerated by this
-        session. Events can be lost due to:
-
+        Returns the number of buffer groups, i.e. 1 + the number of groups
+        specified by TracepointSessionOptions::BufferGroups.
+        */
+        uint32_t
+        BufferGroupCount() const noexcept;
+
+        /*
+        Returns the mode of the specified buffer group.
+        Requires: group < BufferGroupCount().
+        */
+        TracepointSessionMode
+        BufferGroupMode(uint32_t group) const noexcept;
+
+        /*
+        Returns the number of SAMPLE events that have been enumerated by this
+        session.
+        */
+        uint64_t
+        SampleEventCount() const noexcept;
+
+        /*
+        Returns the number of lost events that have been enumerated by this
+        session. Events can be lost due to:
+
         - Memory allocation failure during buffer enumeration.
         - Event received while session is paused (circular mode only).
         - Event received while buffer is full (realtime mode only).
@@ -790,6 +1594,48 @@ namespace tracepoint_control
         uint64_t
         CorruptBufferCount() const noexcept;
 
+        /*
+        Returns true if the session was created with
+        TracepointSessionOptions::Metrics(true).
+        */
+        bool
+        MetricsEnabled() const noexcept;
+
+        /*
+        Copies the session's internal metrics into *metrics. Sets *metrics to
+        all zeros if MetricsEnabled() is false. This does not take any locks and
+        may be called from any thread; each value is read atomically, but values
+        are not guaranteed to be consistent with each other if a drain is in
+        progress.
+        */
+        void
+        GetMetrics(_Out_ TracepointSessionMetrics* metrics) const noexcept;
+
+        /*
+        Returns the number of bytes consumed from the specified buffer, or 0 if
+        MetricsEnabled() is false.
+        Requires: bufferIndex < BufferCount().
+        */
+        uint64_t
+        BufferBytesDrained(unsigned bufferIndex) const noexcept;
+
+        /*
+        Gets the event loss information for the specified buffer. Use this
+        with ResetLostWindows to track loss per buffer per time window, e.g. to
+        find the buffers that need to be larger.
+        Requires: bufferIndex < BufferCount().
+        */
+        void
+        GetBufferLostInfo(unsigned bufferIndex, _Out_ TracepointBufferLostInfo* info) const noexcept;
+
+        /*
+        Starts a new loss window for all buffers, i.e. sets WindowLostEventCount
+        to 0 and WindowRange to an invalid range. Does not change the
+        cumulative counts.
+        */
+        void
+        ResetLostWindows() noexcept;
+
         /*
         Clears the list of tracepoints we are listening to.
         Frees all buffers.
@@ -884,6 +1730,187 @@ namespace tracepoint_control
         _Success_(return == 0) int
         EnableTracepoint(TracepointName name) noexcept;
 
+        /*
+        Equivalent to calling EnableTracepoint(names[i]) for each name, but
+        opens the new tracepoints' per-CPU perf_event files, attaches them to
+        the session buffers, and reads their sample IDs concurrently on up to
+        threadCount threads (including the calling thread). This is
+        significantly faster than calling EnableTracepoint in a loop when
+        enabling hundreds of tracepoints on a machine with many CPUs.
+
+        - If pErrors is not NULL, pErrors[i] receives the result for names[i].
+        - If threadCount is 0, a thread count is chosen based on nameCount and
+          the number of CPUs (at most 16).
+        - A tracepoint that fails is removed from the session (its files are
+          closed); the other tracepoints are still enabled.
+
+        Returns 0 if every tracepoint was enabled. Otherwise, returns the first
+        error.
+        */
+        _Success_(return == 0) int
+        EnableManyTracepoints(
+            _In_reads_(nameCount) TracepointName const* names,
+            size_t nameCount,
+            _Out_writes_opt_(nameCount) int* pErrors = nullptr,
+            unsigned threadCount = 0) noexcept;
+
+        /*
+        Sets a kernel event filter for the specified tracepoint
+        (PERF_EVENT_IOC_SET_FILTER on each buffer's event). Events that do not
+        match the filter are discarded by the kernel and are never written to the
+        session's buffers.
+
+        The filter uses the tracefs event filter syntax, e.g.
+        "prev_pid == 0 && next_prio < 100". See
+        https://docs.kernel.org/trace/events.html#event-filtering for details.
+
+        - Uses Cache().FindById(id) to look up the specified tracepoint.
+        - If the tracepoint is not in the list of session tracepoints, adds it to
+          the list in the "disabled" state, so a filter can be set before any
+          events are collected. Use EnableTracepoint to start collection.
+
+        Returns 0 for success, errno for error.
+        Errors include but are not limited to:
+        - ENOENT: tracefs metadata not found (tracepoint may not be registered yet).
+        - EINVAL: filter is invalid for this tracepoint.
+        - ENOMEM: memory allocation failed.
+        */
+        _Success_(return == 0) int
+        SetTracepointFilter(unsigned id, _In_z_ char const* filter) noexcept;
+
+        /*
+        Sets a kernel event filter for the specified tracepoint. Same as
+        SetTracepointFilter(id, filter) except that it uses
+        Cache().FindOrAddFromSystem(name) to look up the specified tracepoint.
+        */
+        _Success_(return == 0) int
+        SetTracepointFilter(TracepointName name, _In_z_ char const* filter) noexcept;
+
+        /*
+        Attaches a BPF program to the specified tracepoint
+        (PERF_EVENT_IOC_SET_BPF on each buffer's event). The program must be a
+        loaded BPF_PROG_TYPE_TRACEPOINT program. It runs for each event, and if
+        it returns 0 the event is not written to the session's buffers. The
+        session does not take ownership of bpfProgramFile.
+
+        - Uses Cache().FindById(id) to look up the specified tracepoint.
+        - If the tracepoint is not in the list of session tracepoints, adds it to
+          the list in the "disabled" state. Use EnableTracepoint to start
+          collection.
+
+        Returns 0 for success, errno for error.
+        Errors include but are not limited to:
+        - ENOENT: tracefs metadata not found (tracepoint may not be registered yet).
+        - EINVAL: bpfProgramFile is not a valid tracepoint program.
+        - EEXIST: a program is already attached to the tracepoint's events.
+        - ENOMEM: memory allocation failed.
+        */
+        _Success_(return == 0) int
+        SetTracepointBpfProgram(unsigned id, int bpfProgramFile) noexcept;
+
+        /*
+        Attaches a BPF program to the specified tracepoint. Same as
+        SetTracepointBpfProgram(id, bpfProgramFile) except that it uses
+        Cache().FindOrAddFromSystem(name) to look up the specified tracepoint.
+        */
+        _Success_(return == 0) int
+        SetTracepointBpfProgram(TracepointName name, int bpfProgramFile) noexcept;
+
+        /*
+        Sets the sample period for the specified tracepoint
+        (PERF_EVENT_IOC_PERIOD on each buffer's event): the kernel writes only
+        every samplePeriod'th occurrence of the tracepoint on each CPU to the
+        session's buffers. The default is 1 (every occurrence).
+
+        - Uses Cache().FindById(id) to look up the specified tracepoint.
+        - If the tracepoint is not in the list of session tracepoints, adds it to
+          the list in the "disabled" state. Use EnableTracepoint to start
+          collection.
+
+        Returns 0 for success, errno for error.
+        Errors include but are not limited to:
+        - ENOENT: tracefs metadata not found (tracepoint may not be registered yet).
+        - EINVAL: samplePeriod is 0.
+        - ENOMEM: memory allocation failed.
+        */
+        _Success_(return == 0) int
+        SetTracepointSamplePeriod(unsigned id, uint64_t samplePeriod) noexcept;
+
+        /*
+        Sets the sample period for the specified tracepoint. Same as
+        SetTracepointSamplePeriod(id, samplePeriod) except that it uses
+        Cache().FindOrAddFromSystem(name) to look up the specified tracepoint.
+        */
+        _Success_(return == 0) int
+        SetTracepointSamplePeriod(TracepointName name, uint64_t samplePeriod) noexcept;
+
+        /*
+        Sets a rate limit for the specified tracepoint, applied as events are
+        read from the session's buffers (i.e. by the EnumerateSampleEvents
+        methods, the enumerators, and the FlushToWriter methods). Events that
+        exceed the limit are skipped (not returned or written) and are counted by
+        TracepointInfo::RateLimitDroppedCount.
+
+        The limit is a token bucket per buffer (i.e. per CPU): up to
+        eventsPerSecond events per second on average, with bursts of up to
+        burstSize events (minimum 1). Time is measured using the event
+        timestamps, so the limit does not depend on when the buffers are read.
+        The limit has no effect if the session's sample type does not include
+        PERF_SAMPLE_TIME. Set eventsPerSecond to 0 to remove the limit.
+
+        Note that events discarded by the rate limit still use buffer space. To
+        reduce buffer usage, use SetTracepointSamplePeriod or SetTracepointFilter.
+        While any rate limit is set, FlushToWriter drains all buffers on the
+        calling thread (DrainThreadCount is ignored).
+
+        - Uses Cache().FindById(id) to look up the specified tracepoint.
+        - The tracepoint must already be in the list of session tracepoints.
+
+        Returns 0 for success, errno for error.
+        Errors include but are not limited to:
+        - ENOENT: tracepoint not found, or not in the list of session tracepoints.
+        - ENOMEM: memory allocation failed.
+        */
+        _Success_(return == 0) int
+        SetTracepointRateLimit(unsigned id, uint32_t eventsPerSecond, uint32_t burstSize) noexcept;
+
+        /*
+        Sets a rate limit for the specified tracepoint. Same as
+        SetTracepointRateLimit(id, eventsPerSecond, burstSize) except that it
+        uses Cache().FindByName(name) to look up the specified tracepoint.
+        */
+        _Success_(return == 0) int
+        SetTracepointRateLimit(TracepointName name, uint32_t eventsPerSecond, uint32_t burstSize) noexcept;
+
+        /*
+        Assigns the specified tracepoint to a buffer group (see
+        TracepointSessionOptions::BufferGroups). Tracepoints are in group 0 by
+        default. A tracepoint's group cannot be changed after the tracepoint is
+        added to the session, so call this before enabling the tracepoint.
+
+        - Uses Cache().FindById(id) to look up the specified tracepoint.
+        - If the specified tracepoint is not in the list of session tracepoints,
+          adds it to the session (in the "disabled" state) using the specified
+          group.
+
+        Returns 0 for success, errno for error.
+        Errors include but are not limited to:
+        - EINVAL: group >= BufferGroupCount().
+        - EBUSY: tracepoint was already added to the session in another group.
+        - ENOENT: tracefs metadata not found (tracepoint may not be registered yet).
+        - ENOMEM: memory allocation failed.
+        */
+        _Success_(return == 0) int
+        SetTracepointBufferGroup(unsigned id, uint32_t group) noexcept;
+
+        /*
+        Assigns the specified tracepoint to a buffer group. Same as
+        SetTracepointBufferGroup(id, group) except that it uses
+        Cache().FindOrAddFromSystem(name) to look up the specified tracepoint.
+        */
+        _Success_(return == 0) int
+        SetTracepointBufferGroup(TracepointName name, uint32_t group) noexcept;
+
         /*
         Returns a range for enumerating the tracepoints in the session (includes
         both enabled and disabled tracepoints). Returned range is equivalent to
@@ -968,6 +1995,59 @@ namespace tracepoint_control
         GetBufferFiles(
             _Out_writes_(BufferCount()) int* pBufferFiles) const noexcept;
 
+        /*
+        For realtime sessions only: Waits for the wakeup condition, then returns the
+        indexes of the buffers that meet the wakeup condition. This is similar to
+        WaitForWakeup, but it uses epoll_pwait so the cost of the wait depends on the
+        number of buffers that are ready rather than on the total number of buffers,
+        and it tells the caller which buffers need to be drained. Use this with
+        FlushBuffersToWriter or EnumerateBufferSampleEventsUnordered to drain only the
+        buffers that are ready, leaving mostly-idle buffers alone.
+
+        - readyBufferIndexes: Receives the indexes of the buffers that meet the wakeup
+          condition. Must have room for BufferCount() values.
+        - pReadyCount: Receives the number of indexes written to readyBufferIndexes, or
+          0 if wait ended due to a timeout or a signal.
+        - timeout: Maximum time to wait (rounded up to milliseconds). NULL means wait
+          forever.
+        - sigmask: Signal mask to apply before waiting. NULL means don't mask.
+
+        Returns EPERM if the session is not realtime.
+
+        Returns EPERM if the session is inactive. After construction and after
+        Clear(), the session will be inactive until a tracepoint is added.
+        */
+        _Success_(return == 0) int
+        WaitForReadyBuffers(
+            _Out_writes_(BufferCount()) uint32_t* readyBufferIndexes,
+            _Out_ uint32_t* pReadyCount,
+            timespec const* timeout = nullptr,
+            sigset_t const* sigmask = nullptr) noexcept;
+
+        /*
+        For realtime sessions only: Gets a file descriptor that can be registered
+        with an external event loop (e.g. epoll, io_uring poll, asio
+        posix::stream_descriptor) to learn when events are available, so that the
+        session can be drained without a dedicated thread. The file is readable
+        (POLLIN, level-triggered) while any realtime buffer meets the wakeup
+        condition. When it becomes readable, call
+        EnumerateReadySampleEventsUnordered (or WaitForReadyBuffers with a zero
+        timeout, then drain the returned buffers).
+
+        The file is owned by the session: do not read, write, or close it. It is
+        an epoll file, so the same file is used by WaitForReadyBuffers. It is
+        replaced by Clear() and may be replaced when buffers are added for a CPU
+        that comes online, so call GetReadyFile again after each drain (it is
+        cheap) and re-register if the value changed.
+
+        Returns EPERM if the session is not realtime.
+
+        Returns EPERM if the session is inactive. After construction and after
+        Clear(), the session will be inactive until a tracepoint is added.
+        */
+        _Success_(return == 0) int
+        GetReadyFile(_Out_ int* pReadyFile) noexcept;
+
         /*
         Creates a perf.data-format file and writes all pending data from the
         current session's buffers to the file. This can be done for all session
@@ -1024,9 +2104,152 @@ namespace tracepoint_control
             _In_z_ char const* perfDataFileName,
             TracepointSavePerfDataFileOptions const& options = TracepointSavePerfDataFileOptions()) noexcept;
 
+        /*
+        Copies the contents of the session's circular buffers into snapshot,
+        replacing the snapshot's previous contents. Each buffer is paused only
+        while its contents are copied. Use snapshot.SavePerfDataFile(...) later
+        (e.g. on another thread) to write the file. Realtime buffers are not
+        included (use FlushToWriter).
+
+        Returns ENOMEM if the snapshot's memory could not be allocated, in which
+        case no buffers are paused and the snapshot is empty.
+
+        The snapshot's events are not parsed, so they are not counted by
+        SampleEventCount(), CorruptEventCount(), or the lost-event counts.
+        */
+        _Success_(return == 0) int
+        SnapshotBuffers(TracepointSnapshot& snapshot) noexcept;
+
+        /*
+        Sets up a trigger for flight-recorder capture: when the specified
+        tracepoint fires, WaitForTrigger waits postTriggerNs, then takes a snapshot
+        of the session's circular buffers, and reports the window
+        [triggerTime - preTriggerNs, triggerTime + postTriggerNs].
+
+        The tracepoint must already be in the session (e.g. EnableTracepoint), and
+        the session must record PERF_SAMPLE_TIME. The trigger uses a separate
+        small realtime buffer per CPU that only receives the trigger tracepoint's
+        events (with the tracepoint's current filter), so the session's circular
+        buffers are not scanned while waiting. The trigger fires whether or not
+        the tracepoint is currently enabled for collection. CPUs that come online
+        after SetTrigger (CpuHotplug) do not fire the trigger.
+
+        The circular buffers must be large enough to hold preTriggerNs +
+        postTriggerNs of events; older events in the window may have been
+        overwritten.
+
+        Replaces any previous trigger. Returns ENOENT if the tracepoint is not in
+        the session, EPERM if the session does not record PERF_SAMPLE_TIME.
+        */
+        _Success_(return == 0) int
+        SetTrigger(
+            unsigned id,
+            uint64_t preTriggerNs,
+            uint64_t postTriggerNs) noexcept;
+
+        /*
+        Sets up a trigger: same as SetTrigger(id, preTriggerNs, postTriggerNs)
+        except that it uses TracepointCache::FindOrAddFromSystem(name) to look up
+        the id of the tracepoint.
+        */
+        _Success_(return == 0) int
+        SetTrigger(
+            TracepointName name,
+            uint64_t preTriggerNs,
+            uint64_t postTriggerNs) noexcept;
+
+        /*
+        Removes the trigger set by SetTrigger, if any.
+        */
+        void
+        ClearTrigger() noexcept;
+
+        /*
+        Waits for the trigger tracepoint (see SetTrigger) to fire with an event for
+        which predicate(eventInfo) returns true. Then waits until the session
+        clock reaches triggerTime + postTriggerNs, takes a snapshot of the
+        session's circular buffers (SnapshotBuffers), and sets *window (if not
+        NULL) to the trigger's window.
+
+        - predicate: Callable object invoked for each of the trigger tracepoint's
+          events. Returns bool: true to fire the trigger. For example, it can use
+          EventHeaderEnumerator to check a field of an eventheader event. Only
+          the trigger tracepoint's events are passed to the predicate.
+        - timeout, sigmask: as with WaitForWakeup. The timeout applies to each
+          wait for trigger events, not to the post-trigger wait.
+
+        Returns 0 if the snapshot was taken, ETIMEDOUT if no event fired the
+        trigger before the timeout, EPERM if there is no trigger, or another
+        error (e.g. EINTR from the wait, or an error from SnapshotBuffers).
+        Trigger events that arrive before the snapshot is taken are discarded.
+
+        Typical usage:
+
+            TracepointTimestampRange window;
+            error = session.WaitForTrigger(snapshot, predicate, &window);
+            if (error == 0)
+            {
+                error = snapshot.SavePerfDataFile("perf.data", TracepointSavePerfDataFileOptions()
+                    .TimestampFilter(window.First, window.Last));
+            }
+
+        Note that this method does not throw any of its own exceptions, but it may
+        exit via exception if your predicate(...) throws an exception.
+        */
+        template<class TriggerPredicateTy>
+        _Success_(return == 0) int
+        WaitForTrigger(
+            TracepointSnapshot& snapshot,
+            TriggerPredicateTy&& predicate, // bool predicate(PerfSampleEventInfo const&)
+            _Out_opt_ TracepointTimestampRange* window = nullptr,
+            timespec const* timeout = nullptr,
+            sigset_t const* sigmask = nullptr
+        ) noexcept(noexcept(predicate( // Throws exceptions if and only if predicate throws.
+            std::declval<tracepoint_decode::PerfSampleEventInfo const&>())))
+        {
+            int error;
+
+            for (;;)
+            {
+                error = WaitForTriggerEvents(timeout, sigmask);
+                if (error != 0)
+                {
+                    break;
+                }
+
+                bool fired = false;
+                while (!fired && NextTriggerEvent())
+                {
+                    fired = predicate(m_triggerEventInfo);
+                }
+
+                if (fired)
+                {
+                    error = CaptureTrigger(snapshot, window);
+                    break;
+                }
+            }
+
+            return error;
+        }
+
+        /*
+        Same as WaitForTrigger(snapshot, predicate, window, timeout, sigmask) with a
+        predicate that always returns true, i.e. every event of the trigger
+        tracepoint fires the trigger.
+        */
+        _Success_(return == 0) int
+        WaitForTrigger(
+            TracepointSnapshot& snapshot,
+            _Out_opt_ TracepointTimestampRange* window = nullptr,
+            timespec const* timeout = nullptr,
+            sigset_t const* sigmask = nullptr) noexcept;
+
         /*
         Writes all pending data from the current session's buffers to the specified
         writer. Expands writtenRange to reflect the range of the timestamps seen.
+        Only writes sample events in filterRange; see
+        TracepointSavePerfDataFileOptions::TimestampFilter.
 
         This can be done for all session types but is normally only used with realtime
         sessions.
@@ -1062,6 +2285,13 @@ namespace tracepoint_control
         the count of events that were lost due to the current enumeration's pause (those
         will show up after a subsequent enumeration).
 
+        As it reads a buffer, FlushToWriter records the range of sample timestamps
+        in each 64 KB of the buffer. On later calls with a filterRange, the parts of
+        the buffer that were read before and that have only samples outside
+        filterRange are skipped without reading them, so the cost of the call
+        depends on the amount of new data and the size of the window rather than
+        on the size of the buffer. (The first call reads the whole buffer.)
+
         *** Realtime session behavior ***
 
         For each buffer (usually one per CPU):
@@ -1074,6 +2304,18 @@ namespace tracepoint_control
         the buffer was full. It does not include the count of events that were lost
         due to the buffer being full at the start of the current enumeration (those will
         show up after a subsequent enumeration).
+
+        *** Parallel drain ***
+
+        If the session was created with DrainThreadCount(N) for N > 1 (or with
+        DrainNumaAffinity(true) on a multi-node system), the buffers are drained by
+        worker threads into staging chunks, then the chunks are written to
+        the writer. In this mode, FlushToWriter adds EventDesc records for all of the
+        session's tracepoints (not just the ones that have events), and the events
+        are not parsed (only the timestamp is read), so CorruptEventCount() only
+        counts events that are too small to contain a timestamp. If writing a chunk
+        fails, the data in the remaining chunks is lost (it has already been consumed
+        from the buffers).
         */
         _Success_(return == 0) int
         FlushToWriter(
@@ -1081,6 +2323,25 @@ namespace tracepoint_control
             _Inout_ TracepointTimestampRange* writtenRange,
             TracepointTimestampRange filterRange = { 0, UINT64_MAX }) noexcept;
 
+        /*
+        Advanced scenarios: Same as FlushToWriter, but only flushes the specified
+        buffers (on the calling thread, regardless of DrainThreadCount). This is
+        normally used with the indexes returned by WaitForReadyBuffers.
+
+        Note that if you do not flush all buffers, events from the buffers that were
+        not flushed may be older than events that were flushed, so you should not call
+        writer.WriteFinishedRound() after a partial flush.
+
+        Returns EINVAL if any of the specified indexes is >= BufferCount().
+        */
+        _Success_(return == 0) int
+        FlushBuffersToWriter(
+            _In_reads_(bufferIndexesCount) uint32_t const* bufferIndexes,
+            uint32_t bufferIndexesCount,
+            tracepoint_decode::PerfDataFileWriter& writer,
+            _Inout_ TracepointTimestampRange* writtenRange,
+            TracepointTimestampRange filterRange = { 0, UINT64_MAX }) noexcept;
+
         /*
         Sets the headers in the specified writer based on the session's configuration.
         At present, this sets the following headers:
@@ -1095,6 +2356,17 @@ namespace tracepoint_control
             tracepoint_decode::PerfDataFileWriter& writer,
             _In_opt_ TracepointTimestampRange const* writtenRange) noexcept;
 
+        /*
+        Calls writer.AddTracepointEventDesc() for each tracepoint in the session
+        (skipping tracepoints that the writer already has). FlushToWriter adds
+        the EventDesc for each tracepoint as its events are written, so this is
+        only needed when the writer needs all of them up-front, e.g. before
+        WriteFinishedInit() on a pipe-mode writer (PerfDataFileWriter::CreatePipe).
+        */
+        _Success_(return == 0) int
+        AddWriterEventDescs(
+            tracepoint_decode::PerfDataFileWriter& writer) noexcept;
+
         /*
         For each PERF_RECORD_SAMPLE record in the session's buffers, in timestamp
         order, invoke:
@@ -1140,9 +2412,26 @@ namespace tracepoint_control
         callback does not need events to be sorted based on timestamp, use
         EnumerateSampleEventsUnordered to avoid the sorting overhead.
 
+        Sorting is done by merging: the events of each buffer are merged with the
+        events of the other buffers using a min-heap with one entry per buffer.
+        Events are parsed as they are merged. Ties are returned in buffer order.
+
+        For realtime sessions, each buffer is read as the merge needs its next
+        event, so the first events are returned without scanning the buffers, and
+        memory usage is proportional to the number of buffers, not to the number of
+        events. A buffer's events are expected to be nearly in timestamp order: the
+        merge takes the earliest of the buffer's next 16 events, so an event that is
+        out of order by more than that within its buffer is returned late.
+
+        For circular sessions, a bookmark is recorded for each event because the
+        buffers can only be scanned newest-to-oldest, and each buffer's bookmarks
+        are sorted (if not already in order) before the merge. The resulting order
+        is the same as a stable sort by timestamp.
+
         Note that the eventInfo provided to eventInfoCallback will contain pointers
-        into the trace buffers. The pointers will become invalid after eventInfoCallback
-        returns. Any data that you need to use after that point must be copied.
+        into the trace buffers. The pointers remain valid until this method returns,
+        i.e. a callback may keep pointers to earlier events while it processes later
+        events. Any data that you need to use after that point must be copied.
 
         Note that this method does not throw any of its own exceptions, but it may
         exit via exception if your eventInfoCallback(...) throws an exception.
@@ -1151,7 +2440,7 @@ namespace tracepoint_control
 
         - Pause collection into all buffers.
         - Scan all buffers to find events.
-        - Sort the events based on timestamp.
+        - Merge the events based on timestamp.
         - Invoke eventInfoCallback(...) for each event.
         - Unpause all buffers.
 
@@ -1163,10 +2452,9 @@ namespace tracepoint_control
 
         *** Realtime session behavior ***
 
-        - Scan all buffers to find events.
-        - Sort the events based on timestamp.
+        - Read the buffers' events as they are needed by the merge.
         - Invoke eventInfoCallback for each event.
-        - Mark the enumerated events as consumed, making room for subsequent events.
+        - Mark the events that were read as consumed, making room for subsequent events.
 
         Note that events are lost if they arrive while the buffer is full. The lost
         event count indicates how many events were lost during previous periods when
@@ -1174,8 +2462,9 @@ namespace tracepoint_control
         due to the buffer being full at the start of the current enumeration (those will
         show up after a subsequent enumeration).
 
-        Note that if eventInfoCallback throws or returns a nonzero value, all events will
-        be marked as consumed.
+        Note that if eventInfoCallback throws or returns a nonzero value, the events that
+        were read (the returned events and up to 16 more per buffer) will be marked as
+        consumed. Events that were not read remain for a subsequent enumeration.
         */
         template<class EventInfoCallbackTy, class... ArgTys>
         _Success_(return == 0) int
@@ -1243,8 +2532,10 @@ namespace tracepoint_control
         timestamp order, use EnumerateSampleEvents.
 
         Note that the eventInfo provided to eventInfoCallback will contain pointers
-        into the trace buffers. The pointers will become invalid after eventInfoCallback
-        returns. Any data that you need to use after that point must be copied.
+        into the trace buffers. The pointers remain valid until the enumeration of
+        the event's buffer completes (i.e. until eventInfoCallback is invoked for an
+        event from a different buffer or this method returns). Any data that you
+        need to use after that point must be copied.
 
         Note that this method does not throw any of its own exceptions, but it may
         exit via exception if your eventInfoCallback(...) throws an exception.
@@ -1291,11 +2582,147 @@ namespace tracepoint_control
         {
             int error = 0;
 
+            for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+            {
+                error = EnumerateBufferSampleEventsUnordered(bufferIndex, eventInfoCallback, args...);
+                if (error != 0)
+                {
+                    break;
+                }
+            }
+
+            return error;
+        }
+
+        /*
+        Advanced scenarios: Same as EnumerateSampleEventsUnordered, but only
+        enumerates the events in the specified buffer. This is normally used with the
+        indexes returned by WaitForReadyBuffers.
+
+        Does nothing (returns 0) if bufferIndex >= BufferCount(), if the specified
+        buffer is disabled (size 0), or if the session is inactive.
+        */
+        template<class EventInfoCallbackTy, class... ArgTys>
+        _Success_(return == 0) int
+        EnumerateBufferSampleEventsUnordered(
+            uint32_t bufferIndex,
+            EventInfoCallbackTy&& eventInfoCallback, // int eventInfoCallback(PerfSampleEventInfo const&, args...)
+            ArgTys&&... args // optional parameters to be passed to eventInfoCallback
+        ) noexcept(noexcept(eventInfoCallback( // Throws exceptions if and only if eventInfoCallback throws.
+            std::declval<tracepoint_decode::PerfSampleEventInfo const&>(),
+            args...)))
+        {
+            int error = 0;
+
+            if (m_bufferLeaderFiles != nullptr &&
+                bufferIndex < m_bufferCount &&
+                m_buffers[bufferIndex].Size != 0)
+            {
+                UnorderedEnumerator enumerator(*this, bufferIndex);
+                while (enumerator.MoveNext())
+                {
+                    error = eventInfoCallback(m_enumEventInfo, args...);
+                    if (error != 0)
+                    {
+                        break;
+                    }
+                }
+            }
+
+            return error;
+        }
+
+        /*
+        For realtime sessions only: Without waiting, finds the buffers that meet
+        the wakeup condition and enumerates the events in each of them (same as
+        EnumerateBufferSampleEventsUnordered for each ready buffer). This is
+        intended to be called from an event loop when the file from
+        GetReadyFile becomes readable. Does nothing (returns 0) if no buffers
+        are ready.
+
+        - pReadyCount: optional. Receives the number of buffers that were ready.
+
+        Returns EPERM if the session is not realtime or is inactive. If
+        eventInfoCallback returns a nonzero value, enumeration stops and that
+        value is returned.
+        */
+        template<class EventInfoCallbackTy, class... ArgTys>
+        _Success_(return == 0) int
+        EnumerateReadySampleEventsUnordered(
+            _Out_opt_ uint32_t* pReadyCount,
+            EventInfoCallbackTy&& eventInfoCallback, // int eventInfoCallback(PerfSampleEventInfo const&, args...)
+            ArgTys&&... args // optional parameters to be passed to eventInfoCallback
+        ) noexcept(noexcept(eventInfoCallback( // Throws exceptions if and only if eventInfoCallback throws.
+            std::declval<tracepoint_decode::PerfSampleEventInfo const&>(),
+            args...)))
+        {
+            uint32_t readyCount = 0;
+            int error = PollReadyBuffers(&readyCount);
+            for (uint32_t i = 0; error == 0 && i != readyCount; i += 1)
+            {
+                error = EnumerateBufferSampleEventsUnordered(
+                    m_readyBufferIndexes[i],
+                    eventInfoCallback,
+                    args...);
+            }
+
+            if (pReadyCount)
+            {
+                *pReadyCount = readyCount;
+            }
+
+            return error;
+        }
+
+        /*
+        Realtime buffers only: invokes eventInfoCallback for up to maxEventCount
+        events from the session's realtime buffers or until maxNanoseconds have
+        elapsed, whichever comes first, then stops. Events that were provided to
+        eventInfoCallback are marked consumed, and the next call resumes with the
+        remaining events, starting with the buffer where this call stopped. This
+        allows a consumer to drain the buffers in slices of bounded cost.
+
+        - maxEventCount: maximum number of events to provide (minimum 1).
+        - maxNanoseconds: time budget in nanoseconds (CLOCK_MONOTONIC), or
+          UINT64_MAX for none. The time is checked after every 16 events, so the
+          slice may run slightly longer than the budget.
+        - pBudgetReached: optional. Receives true if enumeration stopped because
+          of maxEventCount or maxNanoseconds (i.e. buffers may still contain
+          events), false if all realtime buffers were drained or on error.
+        - eventInfoCallback, args...: as for EnumerateSampleEventsUnordered.
+
+        Circular buffers are not consumed by enumeration, so they are skipped.
+        Otherwise, event order and behavior are the same as for
+        EnumerateSampleEventsUnordered. If eventInfoCallback returns a nonzero
+        value, enumeration stops and the event is marked consumed.
+        */
+        template<class EventInfoCallbackTy, class... ArgTys>
+        _Success_(return == 0) int
+        EnumerateSampleEventsSlice(
+            uint32_t maxEventCount,
+            uint64_t maxNanoseconds,
+            _Out_opt_ bool* pBudgetReached,
+            EventInfoCallbackTy&& eventInfoCallback, // int eventInfoCallback(PerfSampleEventInfo const&, args...)
+            ArgTys&&... args // optional parameters to be passed to eventInfoCallback
+        ) noexcept(noexcept(eventInfoCallback( // Throws exceptions if and only if eventInfoCallback throws.
+            std::declval<tracepoint_decode::PerfSampleEventInfo const&>(),
+            args...)))
+        {
+            int error = 0;
+            bool budgetReached = false;
+
             if (m_bufferLeaderFiles != nullptr)
             {
-                for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+                auto const deadline = maxNanoseconds == UINT64_MAX
+                    ? UINT64_MAX
+                    : MonotonicTimeNs() + maxNanoseconds;
+                uint32_t eventCount = 0;
+                maxEventCount = maxEventCount ? maxEventCount : 1u;
+
+                for (uint32_t i = 0; i != m_bufferCount && !budgetReached && error == 0; i += 1)
                 {
-                    if (m_buffers[bufferIndex].Size == 0)
+                    auto const bufferIndex = (m_sliceBufferIndex + i) % m_bufferCount;
+                    if (m_buffers[bufferIndex].Size == 0 || !m_buffers[bufferIndex].Realtime)
                     {
                         continue;
                     }
@@ -1304,15 +2731,137 @@ namespace tracepoint_control
                     while (enumerator.MoveNext())
                     {
                         error = eventInfoCallback(m_enumEventInfo, args...);
+                        eventCount += 1;
                         if (error != 0)
                         {
                             break;
                         }
+
+                        if (eventCount == maxEventCount ||
+                            (deadline != UINT64_MAX && 0 == (eventCount & 15) && MonotonicTimeNs() >= deadline))
+                        {
+                            // Resume with this buffer. The enumerator's destructor
+                            // commits data_tail for the events consumed so far.
+                            m_sliceBufferIndex = bufferIndex;
+                            budgetReached = true;
+                            break;
+                        }
                     }
+                }
+            }
 
-                    if (error != 0)
+            if (pBudgetReached)
+            {
+                *pBudgetReached = budgetReached;
+            }
+
+            return error;
+        }
+
+        /*
+        Same as EnumerateSampleEventsUnordered, but invokes the callback once for
+        each batch of up to maxBatchSize events instead of once per event:
+
+            int error = batchCallback(events, eventCount, args...);
+
+        - maxBatchSize: the maximum number of events per batch (minimum 1).
+        - batchCallback: Callable object to invoke for each batch. The first
+          parameter is a PerfSampleEventInfo const* pointing at eventCount
+          (1..maxBatchSize) parsed events, the second parameter is the uint32_t
+          eventCount. Return 0 for success or errno to stop enumeration.
+
+        Each batch contains events from a single buffer, in the same order that
+        EnumerateSampleEventsUnordered would provide them. The events (and the
+        event data they point into) remain valid until batchCallback returns.
+        If batchCallback throws or returns a nonzero value, realtime buffers will
+        be marked consumed up to and including the last event of the batch.
+
+        Returns ENOMEM if the batch array cannot be allocated.
+        */
+        template<class EventBatchCallbackTy, class... ArgTys>
+        _Success_(return == 0) int
+        EnumerateSampleEventBatchesUnordered(
+            uint32_t maxBatchSize,
+            EventBatchCallbackTy&& batchCallback, // int batchCallback(PerfSampleEventInfo const*, uint32_t, args...)
+            ArgTys&&... args // optional parameters to be passed to batchCallback
+        ) noexcept(noexcept(batchCallback( // Throws exceptions if and only if batchCallback throws.
+            std::declval<tracepoint_decode::PerfSampleEventInfo const*>(),
+            0u,
+            args...)))
+        {
+            int error = 0;
+
+            for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+            {
+                error = EnumerateBufferSampleEventBatchesUnordered(bufferIndex, maxBatchSize, batchCallback, args...);
+                if (error != 0)
+                {
+                    break;
+                }
+            }
+
+            return error;
+        }
+
+        /*
+        Advanced scenarios: Same as EnumerateSampleEventBatchesUnordered, but only
+        enumerates the events in the specified buffer.
+
+        Does nothing (returns 0) if bufferIndex >= BufferCount(), if the specified
+        buffer is disabled (size 0), or if the session is inactive.
+        */
+        template<class EventBatchCallbackTy, class... ArgTys>
+        _Success_(return == 0) int
+        EnumerateBufferSampleEventBatchesUnordered(
+            uint32_t bufferIndex,
+            uint32_t maxBatchSize,
+            EventBatchCallbackTy&& batchCallback, // int batchCallback(PerfSampleEventInfo const*, uint32_t, args...)
+            ArgTys&&... args // optional parameters to be passed to batchCallback
+        ) noexcept(noexcept(batchCallback( // Throws exceptions if and only if batchCallback throws.
+            std::declval<tracepoint_decode::PerfSampleEventInfo const*>(),
+            0u,
+            args...)))
+        {
+            int error = 0;
+
+            if (m_bufferLeaderFiles != nullptr &&
+                bufferIndex < m_bufferCount &&
+                m_buffers[bufferIndex].Size != 0)
+            {
+                maxBatchSize = maxBatchSize ? maxBatchSize : 1u;
+                error = ReserveEventBatch(maxBatchSize);
+                if (error == 0)
+                {
+                    auto const batch = m_enumEventBatch.get();
+                    uint32_t batchCount = 0;
+                    UnorderedEnumerator enumerator(*this, bufferIndex);
+                    for (;;)
                     {
-                        break;
+                        bool const moved = enumerator.MoveNext();
+                        if (moved)
+                        {
+                            batch[batchCount] = m_enumEventInfo;
+                            batchCount += 1;
+                            if (batchCount != maxBatchSize)
+                            {
+                                continue;
+                            }
+                        }
+
+                        if (batchCount != 0)
+                        {
+                            error = batchCallback(static_cast<tracepoint_decode::PerfSampleEventInfo const*>(batch), batchCount, args...);
+                            batchCount = 0;
+                            if (error != 0)
+                            {
+                                break;
+                            }
+                        }
+
+                        if (!moved)
+                        {
+                            break;
+                        }
                     }
                 }
             }
@@ -1320,14 +2869,71 @@ namespace tracepoint_control
             return error;
         }
 
+        /*
+        Advanced scenarios: Sets the optional PerfSampleEventInfo fields that the
+        enumeration methods fill in. Fields that the consumer does not use are
+        skipped while parsing each event and are left as 0.
+
+        sampleTypes uses the perf_event_sample_format values. The following
+        flags control the correspondingly-named fields: PERF_SAMPLE_IP (ip),
+        PERF_SAMPLE_TID (pid, tid), PERF_SAMPLE_ADDR (addr),
+        PERF_SAMPLE_STREAM_ID (stream_id), PERF_SAMPLE_CPU (cpu, cpu_reserved),
+        PERF_SAMPLE_PERIOD (period), PERF_SAMPLE_CALLCHAIN (callchain). The
+        event_desc, id, time, raw_data, and raw_data_size fields are always
+        filled in. The default is ParsedSampleTypes(UINT32_MAX), i.e. all of the
+        fields that are present in the session's SampleType.
+
+        This does not change what is collected. Unused fields still use buffer
+        space, so if a field is never needed, remove it from the session's
+        SampleType instead. FlushToWriter is not affected.
+        */
+        void
+        SetParsedSampleTypes(uint32_t sampleTypes) noexcept;
+
     private:
 
+        static uint64_t
+        MonotonicTimeNs() noexcept;
+
+        // Adds ns to histogram. Atomic: workers record concurrently.
+        static void
+        RecordLatency(TracepointLatencyHistogram& histogram, uint64_t ns) noexcept;
+
+        _Success_(return == 0) int
+        ReserveEventBatch(uint32_t maxBatchSize) noexcept;
+
+        // Creates m_epollFile (if needed) with all realtime buffers registered.
+        // Requires an active realtime session.
+        _Success_(return == 0) int
+        EnsureEpollFile() noexcept;
+
+        // WaitForReadyBuffers(m_readyBufferIndexes, pReadyCount) with a zero timeout.
+        _Success_(return == 0) int
+        PollReadyBuffers(_Out_ uint32_t* pReadyCount) noexcept;
+
         _Success_(return == 0) int
         DisableTracepointImpl(tracepoint_decode::PerfEventMetadata const& metadata) noexcept;
 
         _Success_(return == 0) int
         EnableTracepointImpl(tracepoint_decode::PerfEventMetadata const& metadata) noexcept;
 
+        _Success_(return == 0) int
+        SetTracepointRateLimitImpl(
+            tracepoint_decode::PerfEventMetadata const& metadata,
+            uint32_t eventsPerSecond,
+            uint32_t burstSize) noexcept;
+
+        _Success_(return == 0) int
+        SetTracepointBufferGroupImpl(
+            tracepoint_decode::PerfEventMetadata const& metadata,
+            uint32_t group) noexcept;
+
+        _Success_(return == 0) int
+        IoctlTracepointImpl(
+            tracepoint_decode::PerfEventMetadata const& metadata,
+            unsigned long request,
+            unsigned long arg) noexcept;
+
         _Success_(return == 0) static int
         IoctlForEachFile(
             _In_reads_(filesCount) unique_fd const* files,
@@ -1335,24 +2941,120 @@ namespace tracepoint_control
             unsigned long request,
             _In_reads_opt_(filesCount) unique_fd const* values) noexcept;
 
+        _Success_(return == 0) static int
+        IoctlForEachFile(
+            _In_reads_(filesCount) unique_fd const* files,
+            unsigned filesCount,
+            unsigned long request,
+            unsigned long arg) noexcept;
+
+        // perf_event_open for buffer bufferIndex, using the session's target
+        // (system-wide, cgroup, or process). Owners are the dummy events that
+        // own the buffers in standby, multi-group, or adaptive mode.
+        // Returns the new file descriptor or -1 (errno).
+        int
+        PerfEventOpenForBuffer(
+            struct perf_event_attr* attr,
+            uint32_t bufferIndex,
+            bool owner) const noexcept;
+
+        // Calls m_parseSample.
         bool
         ParseSample(
             BufferInfo const& buffer,
             uint16_t recordSize,
             uint32_t recordBufferPos) noexcept;
 
+        // Returns the ParseSampleImpl specialization for the sample type.
+        static ParseSampleFn
+        SelectParseSample(uint32_t sampleType) noexcept;
+
+        // SampleTypeConst = 0: generic. Otherwise requires m_sampleType == SampleTypeConst.
+        template<uint32_t SampleTypeConst>
+        bool
+        ParseSampleImpl(
+            BufferInfo const& buffer,
+            uint16_t recordSize,
+            uint32_t recordBufferPos) noexcept;
+
+        // Standby, multi-group, or adaptive mode: creates the dummy events that own the
+        // buffers and maps the buffers (both buffers for each CPU in standby mode).
+        _Success_(return == 0) int
+        CreateBufferOwners() noexcept;
+
+        // Creates the owner(s) and mmap(s) of one buffer, storing the owner
+        // files in ownerFiles[bufferIndex] (and ownerFiles[m_bufferCount +
+        // bufferIndex] for the standby buffer).
+        _Success_(return == 0) int
+        CreateBufferOwner(uint32_t bufferIndex, unique_fd* ownerFiles) noexcept;
+
+        // Standby mode: redirects the CPU's tracepoints to the standby buffer.
+        // The previously-active buffer (m_buffers[bufferIndex].Mmap) is no longer
+        // written and can be read.
+        void
+        SwitchToStandbyBuffer(uint32_t bufferIndex) noexcept;
+
+        // Adaptive mode: updates the buffer's fill statistics and returns the size
+        // the buffer should switch to, or 0 to keep the current size. If it
+        // returns a larger size, the growth has been reserved from the budget.
+        uint32_t
+        AdaptiveBufferTarget(BufferInfo& buffer) noexcept;
+
+        // Adaptive mode: creates a buffer of newSize bytes and redirects the CPU's
+        // tracepoints to it. The previously-active buffer is no longer written
+        // and will be freed by EnumeratorEnd once it has been fully drained.
+        _Success_(return == 0) int
+        SwitchToResizedBuffer(uint32_t bufferIndex, uint32_t newSize) noexcept;
+
         void
         EnumeratorEnd(uint32_t bufferIndex) const noexcept;
 
         void
         EnumeratorBegin(uint32_t bufferIndex) noexcept;
 
+        // Circular buffers: after EnumeratorBegin, starts updating the buffer's
+        // timestamp index and skipping the indexed records that have no samples
+        // in filterRange. EnumeratorEnd finishes the update.
+        void
+        IndexBegin(uint32_t bufferIndex, TracepointTimestampRange filterRange) noexcept;
+
+        _Success_(return == 0) int
+        FlushToWriterImpl(
+            tracepoint_decode::PerfDataFileWriter& writer,
+            _Inout_ TracepointTimestampRange* writtenRange,
+            TracepointTimestampRange filterRange,
+            uint64_t filterSlackNs) noexcept;
+
         template<class RecordFn>
         bool
         EnumeratorMoveNext(
             uint32_t bufferIndex,
             RecordFn&& recordFn) noexcept(noexcept(recordFn(std::declval<BufferInfo>(), 0u, 0u)));
 
+        _Success_(return == 0) int
+        FlushBuffersToWriterImpl(
+            _In_reads_opt_(bufferIndexesCount) uint32_t const* bufferIndexes, // NULL means "all buffers".
+            uint32_t bufferIndexesCount,
+            tracepoint_decode::PerfDataFileWriter& writer,
+            _Inout_ TracepointTimestampRange* writtenRange,
+            TracepointTimestampRange filterRange,
+            uint64_t filterSlackNs) noexcept;
+
+        _Success_(return == 0) int
+        FlushToWriterParallel(
+            tracepoint_decode::PerfDataFileWriter& writer,
+            _Inout_ TracepointTimestampRange* writtenRange,
+            TracepointTimestampRange filterRange,
+            uint64_t filterSlackNs) noexcept;
+
+        // Called on a drain thread. Copies data from the worker's buffers into the
+        // worker's Chunk.
+        void
+        FlushBuffersToChunk(
+            FlushWorker& worker,
+            TracepointTimestampRange filterRange,
+            uint64_t filterSlackNs) noexcept;
+
         _Success_(return == 0) int
         SetTracepointEnableState(
             TracepointInfoImpl& tpi,
@@ -1361,11 +3063,119 @@ namespace tracepoint_control
         _Success_(return == 0) int
         AddTracepoint(
             tracepoint_decode::PerfEventMetadata const& metadata,
-            TracepointEnableState enableState) noexcept(false);
+            TracepointEnableState enableState,
+            uint32_t group = 0) noexcept(false);
+
+        // AddTracepoint, step 1: creates the tpi for metadata (no files yet)
+        // and adds it to m_tracepointInfoByCommonType.
+        _Success_(return == 0) int
+        AddTracepointInfo(
+            tracepoint_decode::PerfEventMetadata const& metadata,
+            TracepointEnableState enableState,
+            uint32_t group,
+            _Out_ TracepointInfoImpl** ppTpi) noexcept;
+
+        // AddTracepoint, step 2: opens tpi's perf_event files, attaches them to
+        // m_bufferLeaderFiles (if set), and fills in tpi's sample IDs. Changes
+        // only tpi, so it may run concurrently for different tpi.
+        _Success_(return == 0) int
+        OpenTracepointFiles(TracepointInfoImpl& tpi) const noexcept;
+
+        // AddTracepoint, step 3: adds tpi to the sample ID lookups and makes
+        // its files the leader if there is no leader yet.
+        _Success_(return == 0) int
+        CommitTracepointInfo(TracepointInfoImpl& tpi) noexcept;
+
+        // Undoes AddTracepointInfo (closes tpi's files). tpi must not be
+        // committed.
+        void
+        RemoveTracepointInfo(TracepointInfoImpl& tpi) noexcept;
+
+        // CpuHotplug: opens tpi's file for bufferIndex (a CPU that came online)
+        // with tpi's current settings, attaches it to the buffer, and adds its
+        // sample ID to the lookups (the index must have room for it).
+        _Success_(return == 0) int
+        OpenTracepointCpuFile(TracepointInfoImpl& tpi, uint32_t bufferIndex) noexcept;
+
+        _Success_(return == 0) int
+        SetTriggerImpl(
+            tracepoint_decode::PerfEventMetadata const& metadata,
+            uint64_t preTriggerNs,
+            uint64_t postTriggerNs) noexcept;
+
+        // SetTrigger: returns 0 if a trigger event is pending (or when one
+        // arrives), ETIMEDOUT on timeout.
+        _Success_(return == 0) int
+        WaitForTriggerEvents(
+            timespec const* timeout,
+            sigset_t const* sigmask) noexcept;
+
+        // SetTrigger: consumes the next pending trigger event and stores it in
+        // m_triggerEventInfo. Returns false if there are no more events.
+        bool
+        NextTriggerEvent() noexcept;
+
+        // SetTrigger: parses the sample in m_triggerEventData into
+        // m_triggerEventInfo.
+        bool
+        ParseTriggerSample() noexcept;
+
+        // SetTrigger: discards pending trigger events, waits for the end of the
+        // post-trigger window (based on m_triggerEventInfo.time), and snapshots.
+        _Success_(return == 0) int
+        CaptureTrigger(
+            TracepointSnapshot& snapshot,
+            _Out_opt_ TracepointTimestampRange* window) noexcept;
+
+        // CpuHotplug: creates the buffers and files of a CPU that came online.
+        // Sets m_onlineCpus[cpu] unless the buffers could not be created.
+        _Success_(return == 0) int
+        AddCpuBuffers(uint32_t cpu) noexcept;
+
+        // CpuHotplug: if the buffers of a CPU that went offline are empty,
+        // closes the CPU's files, frees its buffers, and returns true.
+        bool
+        RemoveCpuBuffers(uint32_t cpu) noexcept;
+
+        // Adds tpi (which must already be in m_tracepointInfoByCommonType and
+        // m_tracepointInfoBySampleId) to the ParseSample lookup indexes. Either
+        // succeeds or throws bad_alloc with no change.
+        void
+        IndexTracepointInfo(TracepointInfoImpl const& tpi) noexcept(false);
+
+        // Rebuilds m_tracepointInfoBySampleIdIndex from m_tracepointInfoBySampleId,
+        // sized so that it is at most half full with idCount IDs.
+        // Either succeeds or throws bad_alloc with no change.
+        void
+        RebuildSampleIdIndex(size_t idCount) noexcept(false);
+
+        static void
+        SampleIdIndexAdd(
+            std::vector<SampleIdSlot>& index,
+            uint64_t sampleId,
+            TracepointInfoImpl const* tpi) noexcept;
 
         static uint32_t
         CalculateBufferCount(TracepointSessionOptions const& options) noexcept;
 
+        // Parses /sys/devices/system/cpu/online. Empty if unavailable.
+        static std::vector<bool>
+        ReadOnlineCpus(uint32_t cpuCount) noexcept(false);
+
+        static uint32_t
+        CountCircularBufferGroups(TracepointSessionOptions const& options) noexcept;
+
+        static uint32_t
+        AdaptiveMinBufferSize(uint32_t pageSize, TracepointSessionOptions const& options) noexcept;
+
+        static uint32_t
+        AdaptiveMaxBufferSize(uint32_t pageSize, TracepointSessionOptions const& options) noexcept;
+
+        static std::vector<bool>
+        ReadTargetCpus(
+            uint32_t cpuCount,
+            TracepointSessionOptions const& options) noexcept(false);
+
         static std::unique_ptr<BufferInfo[]>
         MakeBufferInfos(
             uint32_t bufferCount,
@@ -1382,29 +3192,77 @@ namespace tracepoint_control
         bool const m_wakeupUseWatermark;
         uint32_t const m_wakeupValue;
         uint32_t const m_sampleType;
-        uint32_t const m_bufferCount;
+        uint16_t const m_callchainMaxStack;
+        bool const m_callchainExcludeKernel;
+        bool const m_callchainExcludeUser;
+        ParseSampleFn const m_parseSample; // ParseSampleImpl specialized for m_sampleType.
+        uint32_t const m_groupBufferCount; // Buffers per group (usually the number of CPUs).
+        uint32_t const m_bufferGroupCount;
+        uint32_t const m_bufferCount; // m_groupBufferCount * m_bufferGroupCount.
         uint32_t const m_pageSize;
+        uint32_t const m_drainThreadCount;
+        std::vector<uint32_t> const m_drainCpuNodes; // NUMA node of each CPU if DrainNumaAffinity(true) and more than one node, else empty.
+        uint32_t const m_circularGroupCount;
+        bool const m_standbyBuffers; // Some group is Circular and CircularStandbyBuffer(true).
+        uint32_t const m_adaptiveMinSize;
+        uint32_t const m_adaptiveMaxSize; // 0 unless AdaptiveBufferSize was set and some group is RealTime.
+        uint64_t const m_adaptiveBudget; // 0 = no limit.
+        bool const m_targetCgroup; // TargetCgroup was set.
+        unique_fd const m_targetCgroupFile; // TargetCgroup: duplicate of the cgroup file (-1 if dup failed).
+        pid_t const m_targetPid; // TargetProcess: the target pid, else -1.
+        bool const m_targetInherit; // TargetProcess: inherit.
+        bool const m_targetSingleBuffer; // TargetProcess without inherit: events use cpu -1 and one buffer per group.
+        bool const m_cpuHotplug; // CpuHotplug(true) and buffers are per-CPU.
 
         // State
 
         std::unique_ptr<BufferInfo[]> const m_buffers; // size is m_bufferCount
         std::unordered_map<unsigned, TracepointInfoImpl> m_tracepointInfoByCommonType;
         std::unordered_map<uint64_t, TracepointInfoImpl const*> m_tracepointInfoBySampleId;
-        unique_fd const* m_bufferLeaderFiles; // == m_tracepointInfoByCommonType[N].BufferFiles.get() for some N, size is m_bufferCount
+        std::vector<TracepointInfoImpl const*> m_tracepointInfoByCommonTypeIndex; // [commonType] for commonType < CommonTypeIndexMax, NULL if not in session.
+        std::vector<SampleIdSlot> m_tracepointInfoBySampleIdIndex; // Open-addressing copy of m_tracepointInfoBySampleId. Size is 0 or a power of 2, at most half full.
+        TracepointInfoImpl const* m_lastSampleIdTpi; // Most recent m_tracepointInfoBySampleIdIndex hit, or NULL.
+        uint64_t m_lastSampleId; // Sample ID of m_lastSampleIdTpi.
+        unique_fd const* m_bufferLeaderFiles; // == m_tracepointInfoByCommonType[N].BufferFiles.get() for some N (or m_bufferOwnerFiles.get()), size is m_bufferCount
+        std::unique_ptr<unique_fd[]> m_bufferOwnerFiles; // Standby, multi-group, or adaptive mode: [0, count) own the active buffers, [count, 2 * count) own the standby buffers.
+        uint64_t m_adaptiveBufferBytes; // Atomic: total size of realtime buffers (adaptive mode only).
+        uint32_t m_rateLimitCount; // Number of tracepoints with m_rateLimitPerSecond != 0.
+        uint32_t m_sliceBufferIndex; // Buffer where the next EnumerateSampleEventsSlice starts.
+        std::vector<bool> m_onlineCpus; // CpuHotplug: CPUs whose buffers exist (size is m_groupBufferCount).
+        TracepointInfoImpl const* m_triggerTpi; // SetTrigger: the trigger tracepoint, or NULL.
+        uint64_t m_triggerPreNs;
+        uint64_t m_triggerPostNs;
+        uint32_t m_triggerNextCpu; // Trigger buffer that NextTriggerEvent reads next.
+        std::unique_ptr<unique_fd[]> m_triggerFiles; // SetTrigger: size is m_groupBufferCount.
+        std::unique_ptr<unique_mmap[]> m_triggerMmaps; // SetTrigger: size is m_groupBufferCount, Mmap.get_size() = PAGE_SIZE + data size.
 
         // Statistics
 
         uint64_t m_sampleEventCount;
         uint64_t m_lostEventCount;
         uint64_t m_corruptEventCount;
-        uint64_t m_corruptBufferCount;
+        uint64_t m_bufferResizeCount; // Atomic: buffers may be resized in parallel.
+        std::unique_ptr<TracepointSessionMetrics> const m_metrics; // NULL unless Metrics(true).
 
         // Transient
 
-        std::vector<uint8_t> m_eventDataBuffer; // Double-buffer for events that wrap.
-        std::vector<TracepointBookmark> m_enumeratorBookmarks;
+        std::unique_ptr<std::vector<uint8_t>[]> const m_eventDataBuffers; // Double-buffer for events that wrap, size is m_bufferCount.
+        std::vector<TracepointBookmark> m_enumeratorBookmarks; // Circular only.
+        std::vector<TracepointRun> m_enumeratorRuns; // One per buffer with records.
+        std::vector<uint32_t> m_enumeratorHeap; // Min-heap of indexes into m_enumeratorRuns.
         std::unique_ptr<pollfd[]> m_pollfd;
+        unique_fd m_epollFile; // Created on demand, reset by Clear().
+        std::unique_ptr<epoll_event[]> m_epollEvents; // size is m_bufferCount
+        std::unique_ptr<uint32_t[]> m_readyBufferIndexes; // size is m_bufferCount, used by EnumerateReadySampleEventsUnordered.
+        std::unique_ptr<FlushWorkerPool> m_flushWorkerPool; // Created on demand.
+        std::unique_ptr<tracepoint_decode::PerfSampleEventInfo[]> m_enumEventBatch; // size is m_enumEventBatchSize
+        uint32_t m_enumEventBatchSize;
+        uint32_t m_parsedSampleTypes; // Fields that ParseSample stores in m_enumEventInfo.
         tracepoint_decode::PerfSampleEventInfo m_enumEventInfo;
+        bool m_enumEventDropped; // Set by ParseSample if the event was dropped by a rate limit.
+        tracepoint_decode::PerfSampleEventInfo m_triggerEventInfo;
+        std::vector<uint8_t> m_triggerEventData; // Copy of the event in m_triggerEventInfo.
+        std::unique_ptr<pollfd[]> m_triggerPollfd; // SetTrigger: size is m_groupBufferCount.
     };
 
     using TracepointInfoRange = TracepointSession::TracepointInfoRange;
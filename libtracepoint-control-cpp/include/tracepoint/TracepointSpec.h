@@ -38,6 +38,7 @@ namespace tracepoint_control
         ErrorDefinitionSystemNameEmpty, // Unreachable via specString.
         ErrorIdentifierSystemNameInvalid,
         ErrorDefinitionSystemNameInvalid,
+        ErrorFilterEmpty,
     };
 
     /*
@@ -58,6 +59,7 @@ namespace tracepoint_control
         std::string_view EventName = {};  // e.g. "MyEvent" or "MyProvider_L2K1Gmygroup".
         std::string_view Flags = {};      // e.g. "" or "flag1,flag2".
         std::string_view Fields = {};     // e.g. "" or "u32 Field1; u16 Field2".
+        std::string_view Filter = {};     // e.g. "" or "Field1 > 10 && Field2 == 3".
         TracepointSpecKind Kind = {};     // Empty, Identifier, Definition, EventHeaderDefinition, or Error.
 
         /*
@@ -89,6 +91,15 @@ namespace tracepoint_control
         * No leading colon, no fields present --> Kind = EventHeaderDefinition.
 
           Examples: "ProviderName_L1K1", or "SystemName:ProviderName_L1KffGgroup:Flags".
+
+        * Any of the above (except Empty) may be followed by whitespace, "if",
+          whitespace, and a kernel event filter expression, which is stored in
+          Filter (the spec is parsed as if the filter were not present). If
+          "if" is not followed by a filter, Kind = ErrorFilterEmpty.
+
+          Examples: ":sched:sched_switch if prev_pid == 0",
+          "MyEvent u32 Field1 if Field1 > 10". (A definition therefore cannot
+          have a field named "if".)
         */
         explicit
         TracepointSpec(std::string_view const specString) noexcept;
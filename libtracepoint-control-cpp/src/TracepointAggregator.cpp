@@ -0,0 +1,491 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <tracepoint/TracepointAggregator.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <tracepoint/PerfEventMetadata.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef _Out_
+#define _Out_
+#endif
+
+using namespace tracepoint_control;
+using namespace tracepoint_decode;
+
+static constexpr unsigned BucketCount = TracepointAggregator::HistogramBucketCount;
+
+// Location of a field in an event's raw data.
+struct FieldRef
+{
+    uint16_t Offset;
+    uint8_t Size; // 0 if the field was not found.
+    bool Signed;
+};
+
+// Per-partial state. Aligned so that partials used by different threads do
+// not share cache lines.
+struct alignas(64) TracepointAggregator::Partial
+{
+    struct MetadataFields
+    {
+        PerfEventMetadata const* Metadata;
+        FieldRef GroupBy;
+        FieldRef Value;
+    };
+
+    std::vector<TracepointAggregate> Aggregates; // Histogram member unused.
+    std::vector<uint64_t> Histograms; // BucketCount per aggregate, or empty.
+    std::vector<uint32_t> Slots; // Open addressing: index + 1, or 0 if empty.
+    std::vector<MetadataFields> FieldCache;
+    MetadataFields LastFields;
+    uint64_t SkippedCount;
+
+    Partial() noexcept
+        : LastFields()
+        , SkippedCount(0)
+    {
+        return;
+    }
+
+    void
+    Clear() noexcept
+    {
+        Aggregates.clear();
+        Histograms.clear();
+        memset(Slots.data(), 0, Slots.size() * sizeof(Slots[0]));
+    }
+};
+
+static uint64_t
+HashKey(TracepointAggregateKey const& key) noexcept
+{
+    // 64-bit multiply-xorshift mix of each member.
+    uint64_t hash = 0;
+    uint64_t const values[] = {
+        key.TracepointId | (uint64_t(key.Cpu) << 32),
+        key.Pid | (uint64_t(key.Tid) << 32),
+        key.Time,
+        key.Field };
+    for (auto value : values)
+    {
+        hash = (hash ^ value) * 0x9E3779B97F4A7C15u;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+static bool
+KeysEqual(TracepointAggregateKey const& a, TracepointAggregateKey const& b) noexcept
+{
+    return a.TracepointId == b.TracepointId
+        && a.Pid == b.Pid
+        && a.Tid == b.Tid
+        && a.Cpu == b.Cpu
+        && a.Time == b.Time
+        && a.Field == b.Field;
+}
+
+static unsigned
+HistogramBucket(uint64_t value) noexcept
+{
+    return value == 0 ? 0u : 64u - static_cast<unsigned>(__builtin_clzll(value));
+}
+
+// Returns the aggregate for key, adding it if necessary.
+// May throw bad_alloc.
+static TracepointAggregate&
+FindOrAdd(
+    std::vector<TracepointAggregate>& aggregates,
+    std::vector<uint64_t>& histograms,
+    std::vector<uint32_t>& slots,
+    bool histogram,
+    TracepointAggregateKey const& key,
+    _Out_ size_t* pIndex) noexcept(false)
+{
+    // Keep slots at most half full.
+    if (slots.size() < (aggregates.size() + 1) * 2)
+    {
+        size_t newSize = slots.empty() ? 64 : slots.size() * 2;
+        std::vector<uint32_t> newSlots(newSize); // May throw bad_alloc.
+        size_t const newMask = newSize - 1;
+        for (size_t i = 0; i != aggregates.size(); i += 1)
+        {
+            size_t slot = HashKey(aggregates[i].Key) & newMask;
+            while (newSlots[slot] != 0)
+            {
+                slot = (slot + 1) & newMask;
+            }
+
+            newSlots[slot] = static_cast<uint32_t>(i + 1);
+        }
+
+        slots.swap(newSlots);
+    }
+
+    size_t const mask = slots.size() - 1;
+    size_t slot = HashKey(key) & mask;
+    for (;;)
+    {
+        auto const slotValue = slots[slot];
+        if (slotValue == 0)
+        {
+            break;
+        }
+
+        auto& existing = aggregates[slotValue - 1];
+        if (KeysEqual(existing.Key, key))
+        {
+            *pIndex = slotValue - 1;
+            return existing;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    aggregates.reserve(aggregates.size() + 1); // May throw bad_alloc.
+    if (histogram)
+    {
+        histograms.resize(histograms.size() + BucketCount); // May throw bad_alloc.
+    }
+
+    TracepointAggregate newAggregate = {};
+    newAggregate.Key = key;
+    newAggregate.Min = UINT64_MAX;
+    aggregates.push_back(newAggregate); // Does not throw (reserved).
+
+    *pIndex = aggregates.size() - 1;
+    slots[slot] = static_cast<uint32_t>(aggregates.size());
+    return aggregates.back();
+}
+
+static FieldRef
+FindField(PerfEventMetadata const& metadata, std::string const& name) noexcept
+{
+    FieldRef ref = {};
+    if (!name.empty())
+    {
+        for (auto& field : metadata.Fields())
+        {
+            if (field.Name() != name)
+            {
+                continue;
+            }
+
+            auto const size = field.Size();
+            if (field.Array() == PerfFieldArrayNone &&
+                (size == 1 || size == 2 || size == 4 || size == 8))
+            {
+                ref.Offset = field.Offset();
+                ref.Size = static_cast<uint8_t>(size);
+                ref.Signed = field.Format() == PerfFieldFormatSigned;
+            }
+
+            break;
+        }
+    }
+
+    return ref;
+}
+
+// Returns true and sets *pValue if the field is present in the event.
+static bool
+ReadField(
+    PerfSampleEventInfo const& event,
+    FieldRef const& ref,
+    _Out_ uint64_t* pValue) noexcept
+{
+    if (ref.Size == 0 ||
+        event.raw_data_size < static_cast<uintptr_t>(ref.Offset) + ref.Size)
+    {
+        *pValue = 0;
+        return false;
+    }
+
+    auto const p = static_cast<uint8_t const*>(event.raw_data) + ref.Offset;
+    switch (ref.Size)
+    {
+    case 1:
+    {
+        uint8_t v;
+        memcpy(&v, p, sizeof(v));
+        *pValue = ref.Signed ? static_cast<uint64_t>(static_cast<int8_t>(v)) : v;
+        break;
+    }
+    case 2:
+    {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        *pValue = ref.Signed ? static_cast<uint64_t>(static_cast<int16_t>(v)) : v;
+        break;
+    }
+    case 4:
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        *pValue = ref.Signed ? static_cast<uint64_t>(static_cast<int32_t>(v)) : v;
+        break;
+    }
+    default:
+        memcpy(pValue, p, sizeof(*pValue));
+        break;
+    }
+
+    return true;
+}
+
+TracepointAggregator::~TracepointAggregator()
+{
+    return;
+}
+
+TracepointAggregator::TracepointAggregator(
+    TracepointAggregatorOptions const& options) noexcept(false)
+    : m_groupByFieldName(options.m_groupByFieldName ? options.m_groupByFieldName : "") // may throw bad_alloc.
+    , m_valueFieldName(options.m_valueFieldName ? options.m_valueFieldName : "") // may throw bad_alloc.
+    , m_groupByTimeNs(options.m_groupByTimeNs)
+    , m_partialCount(options.m_partialCount < 1 ? 1u : options.m_partialCount)
+    , m_groupByTracepoint(options.m_groupByTracepoint)
+    , m_groupByPid(options.m_groupByPid)
+    , m_groupByTid(options.m_groupByTid)
+    , m_groupByCpu(options.m_groupByCpu)
+    , m_histogram(options.m_histogram)
+    , m_partials(std::make_unique<Partial[]>(m_partialCount)) // may throw bad_alloc.
+    , m_merged(std::make_unique<Partial>()) // may throw bad_alloc.
+{
+    return;
+}
+
+uint32_t
+TracepointAggregator::PartialCount() const noexcept
+{
+    return m_partialCount;
+}
+
+_Success_(return == 0) int
+TracepointAggregator::Add(PerfSampleEventInfo const& event) noexcept
+{
+    return Add(0, event);
+}
+
+_Success_(return == 0) int
+TracepointAggregator::Add(
+    uint32_t partialIndex,
+    PerfSampleEventInfo const& event) noexcept
+{
+    assert(partialIndex < m_partialCount);
+    auto& partial = m_partials[partialIndex];
+
+    uint64_t fieldKey = 0;
+    uint64_t value = 1;
+    if (!m_groupByFieldName.empty() || !m_valueFieldName.empty())
+    {
+        auto const metadata = (event.SampleType() & PERF_SAMPLE_RAW)
+            ? event.Metadata()
+            : nullptr;
+        if (metadata == nullptr)
+        {
+            partial.SkippedCount += 1;
+            return 0;
+        }
+
+        if (partial.LastFields.Metadata != metadata)
+        {
+            Partial::MetadataFields const* found = nullptr;
+            for (auto& cached : partial.FieldCache)
+            {
+                if (cached.Metadata == metadata)
+                {
+                    found = &cached;
+                    break;
+                }
+            }
+
+            if (found == nullptr)
+            {
+                Partial::MetadataFields newFields;
+                newFields.Metadata = metadata;
+                newFields.GroupBy = FindField(*metadata, m_groupByFieldName);
+                newFields.Value = FindField(*metadata, m_valueFieldName);
+                try
+                {
+                    partial.FieldCache.push_back(newFields);
+                }
+                catch (...)
+                {
+                    partial.SkippedCount += 1;
+                    return ENOMEM;
+                }
+
+                found = &partial.FieldCache.back();
+            }
+
+            partial.LastFields = *found;
+        }
+
+        if ((!m_groupByFieldName.empty() && !ReadField(event, partial.LastFields.GroupBy, &fieldKey)) ||
+            (!m_valueFieldName.empty() && !ReadField(event, partial.LastFields.Value, &value)))
+        {
+            partial.SkippedCount += 1;
+            return 0;
+        }
+    }
+
+    return AddImpl(partial, event, fieldKey, value);
+}
+
+_Success_(return == 0) int
+TracepointAggregator::AddValue(
+    uint32_t partialIndex,
+    PerfSampleEventInfo const& event,
+    uint64_t fieldKey,
+    uint64_t value) noexcept
+{
+    assert(partialIndex < m_partialCount);
+    return AddImpl(m_partials[partialIndex], event, fieldKey, value);
+}
+
+uint64_t
+TracepointAggregator::SkippedEventCount() const noexcept
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i != m_partialCount; i += 1)
+    {
+        total += m_partials[i].SkippedCount;
+    }
+
+    return total;
+}
+
+_Success_(return == 0) int
+TracepointAggregator::Collect(
+    std::vector<TracepointAggregate>& results,
+    bool reset) noexcept
+{
+    int error;
+    auto& merged = *m_merged;
+    merged.Clear();
+
+    try
+    {
+        for (uint32_t partialIndex = 0; partialIndex != m_partialCount; partialIndex += 1)
+        {
+            auto const& partial = m_partials[partialIndex];
+            for (size_t i = 0; i != partial.Aggregates.size(); i += 1)
+            {
+                auto const& src = partial.Aggregates[i];
+                size_t index;
+                auto& dst = FindOrAdd(merged.Aggregates, merged.Histograms, merged.Slots,
+                    m_histogram, src.Key, &index); // May throw bad_alloc.
+                dst.Count += src.Count;
+                dst.Sum += src.Sum;
+                dst.Min = src.Min < dst.Min ? src.Min : dst.Min;
+                dst.Max = src.Max > dst.Max ? src.Max : dst.Max;
+                if (m_histogram)
+                {
+                    auto const srcHist = &partial.Histograms[i * BucketCount];
+                    auto const dstHist = &merged.Histograms[index * BucketCount];
+                    for (unsigned bucket = 0; bucket != BucketCount; bucket += 1)
+                    {
+                        dstHist[bucket] += srcHist[bucket];
+                    }
+                }
+            }
+        }
+
+        results.assign(merged.Aggregates.begin(), merged.Aggregates.end()); // May throw bad_alloc.
+    }
+    catch (...)
+    {
+        merged.Clear();
+        results.clear();
+        error = ENOMEM;
+        goto Done;
+    }
+
+    if (m_histogram)
+    {
+        for (size_t i = 0; i != results.size(); i += 1)
+        {
+            results[i].Histogram = &merged.Histograms[i * BucketCount];
+        }
+    }
+
+    if (reset)
+    {
+        for (uint32_t partialIndex = 0; partialIndex != m_partialCount; partialIndex += 1)
+        {
+            m_partials[partialIndex].Clear();
+        }
+    }
+
+    error = 0;
+
+Done:
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointAggregator::AddImpl(
+    Partial& partial,
+    PerfSampleEventInfo const& event,
+    uint64_t fieldKey,
+    uint64_t value) noexcept
+{
+    auto const sampleType = event.SampleType();
+
+    TracepointAggregateKey key = {};
+    if (m_groupByTracepoint)
+    {
+        auto const metadata = (sampleType & PERF_SAMPLE_RAW)
+            ? event.Metadata()
+            : nullptr;
+        key.TracepointId = metadata ? metadata->Id() : 0;
+    }
+
+    if (sampleType & PERF_SAMPLE_TID)
+    {
+        key.Pid = m_groupByPid ? event.pid : 0;
+        key.Tid = m_groupByTid ? event.tid : 0;
+    }
+
+    if (m_groupByCpu && (sampleType & PERF_SAMPLE_CPU))
+    {
+        key.Cpu = event.cpu;
+    }
+
+    if (m_groupByTimeNs != 0 && (sampleType & PERF_SAMPLE_TIME))
+    {
+        key.Time = event.time - event.time % m_groupByTimeNs;
+    }
+
+    key.Field = m_groupByFieldName.empty() ? 0 : fieldKey;
+
+    size_t index;
+    TracepointAggregate* pAggregate;
+    try
+    {
+        pAggregate = &FindOrAdd(partial.Aggregates, partial.Histograms, partial.Slots,
+            m_histogram, key, &index); // May throw bad_alloc.
+    }
+    catch (...)
+    {
+        partial.SkippedCount += 1;
+        return ENOMEM;
+    }
+
+    pAggregate->Count += 1;
+    pAggregate->Sum += value;
+    pAggregate->Min = value < pAggregate->Min ? value : pAggregate->Min;
+    pAggregate->Max = value > pAggregate->Max ? value : pAggregate->Max;
+    if (m_histogram)
+    {
+        partial.Histograms[index * BucketCount + HistogramBucket(value)] += 1;
+    }
+
+    return 0;
+}
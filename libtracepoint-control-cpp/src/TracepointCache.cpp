@@ -4,10 +4,15 @@
 #include <tracepoint/TracepointCache.h>
 #include <tracepoint/TracepointSpec.h>
 #include <tracepoint/TracepointPath.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <linux/types.h>
 #include <sys/ioctl.h>
@@ -80,6 +85,64 @@ using namespace tracepoint_decode;
 static constexpr int8_t CommonTypeOffsetInit = -1;
 static constexpr uint8_t CommonTypeSizeInit = 0;
 
+/*
+Format cache file: FormatCacheMagic, then a sequence of records. Each record
+is a FormatCacheRecordHeader (host byte order, unaligned) followed by
+SystemName, EventName, and FormatFileContents (no nul-termination).
+*/
+static constexpr char FormatCacheMagic[8] = { 'T', 'P', 'F', 'm', 't', 'C', 0, 1 };
+
+struct FormatCacheRecordHeader
+{
+    uint32_t Id;
+    uint32_t FormatSize;
+    uint64_t FormatHash; // FNV-1a of FormatFileContents.
+    uint16_t SystemNameSize;
+    uint16_t EventNameSize;
+    uint32_t Reserved;
+};
+
+static uint64_t
+FormatHash(std::string_view text) noexcept
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (auto ch : text)
+    {
+        hash = (hash ^ static_cast<uint8_t>(ch)) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+static size_t
+IdHash(uint32_t id) noexcept
+{
+    // Fibonacci hashing: use the high bits of the product.
+    return static_cast<size_t>((id * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+}
+
+static void
+AppendFormatCacheRecord(
+    std::vector<char>& dest,
+    std::string_view systemName,
+    std::string_view eventName,
+    uint32_t id,
+    std::string_view formatFileContents) noexcept(false)
+{
+    FormatCacheRecordHeader header = {};
+    header.Id = id;
+    header.FormatSize = static_cast<uint32_t>(formatFileContents.size());
+    header.FormatHash = FormatHash(formatFileContents);
+    header.SystemNameSize = static_cast<uint16_t>(systemName.size());
+    header.EventNameSize = static_cast<uint16_t>(eventName.size());
+
+    auto const headerBytes = reinterpret_cast<char const*>(&header);
+    dest.insert(dest.end(), headerBytes, headerBytes + sizeof(header));
+    dest.insert(dest.end(), systemName.begin(), systemName.end());
+    dest.insert(dest.end(), eventName.begin(), eventName.end());
+    dest.insert(dest.end(), formatFileContents.begin(), formatFileContents.end());
+}
+
 TracepointCache::TracepointRegistration::~TracepointRegistration()
 {
     if (WriteIndex >= 0)
@@ -106,12 +169,12 @@ TracepointCache::CacheVal::~CacheVal()
 }
 
 TracepointCache::CacheVal::CacheVal(
-    std::vector<char>&& systemAndFormat,
-    PerfEventMetadata&& metadata,
-    std::unique_ptr<TracepointRegistration> registration) noexcept
-    : SystemAndFormat(std::move(systemAndFormat))
-    , Metadata(metadata)
+    PerfEventMetadata const& metadata,
+    std::unique_ptr<TracepointRegistration> registration,
+    bool fromSystem) noexcept
+    : Metadata(metadata)
     , Registration(std::move(registration))
+    , FromSystem(fromSystem)
 {
     return;
 }
@@ -132,14 +195,40 @@ TracepointCache::NameHashOps::operator()(
     return a.EventName == b.EventName && a.SystemName == b.SystemName;
 }
 
+TracepointCache::LookupTable::~LookupTable()
+{
+    return;
+}
+
+TracepointCache::LookupTable::LookupTable(uint32_t slotCount) noexcept(false)
+    : Slots(std::make_unique<std::atomic<CacheVal const*>[]>(slotCount)) // may throw bad_alloc.
+    , Retired()
+    , Mask(slotCount - 1)
+{
+    assert(0 == (slotCount & Mask)); // slotCount must be a power of 2.
+    for (uint32_t i = 0; i != slotCount; i += 1)
+    {
+        Slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
 TracepointCache::~TracepointCache() noexcept
 {
     return;
 }
 
 TracepointCache::TracepointCache() noexcept(false)
-    : m_byId() // may throw bad_alloc (but probably doesn't).
+    : m_mutex()
+    , m_idTableOwner()
+    , m_nameTableOwner()
+    , m_idTable(nullptr)
+    , m_nameTable(nullptr)
+    , m_metadataStore()
+    , m_parseScratch()
+    , m_byId() // may throw bad_alloc (but probably doesn't).
     , m_byName() // may throw bad_alloc (but probably doesn't).
+    , m_savedFormats() // may throw bad_alloc (but probably doesn't).
+    , m_savedFormatData()
     , m_commonTypeOffset(CommonTypeOffsetInit)
     , m_commonTypeSize(CommonTypeSizeInit)
 {
@@ -149,31 +238,70 @@ TracepointCache::TracepointCache() noexcept(false)
 int8_t
 TracepointCache::CommonTypeOffset() const noexcept
 {
-    return m_commonTypeOffset;
+    return m_commonTypeOffset.load(std::memory_order_acquire);
 }
 
 uint8_t
 TracepointCache::CommonTypeSize() const noexcept
 {
-    return m_commonTypeSize;
+    return m_commonTypeOffset.load(std::memory_order_acquire) == CommonTypeOffsetInit
+        ? CommonTypeSizeInit
+        : m_commonTypeSize.load(std::memory_order_relaxed);
 }
 
 PerfEventMetadata const*
 TracepointCache::FindById(uint32_t id) const noexcept
 {
-    auto it = m_byId.find(id);
-    return it == m_byId.end()
-        ? nullptr
-        : &it->second.Metadata;
+    PerfEventMetadata const* metadata = nullptr;
+
+    auto const table = m_idTable.load(std::memory_order_acquire);
+    if (table != nullptr)
+    {
+        for (size_t i = IdHash(id);; i += 1)
+        {
+            auto const val = table->Slots[i & table->Mask].load(std::memory_order_acquire);
+            if (val == nullptr)
+            {
+                break;
+            }
+
+            if (val->Metadata.Id() == id)
+            {
+                metadata = &val->Metadata;
+                break;
+            }
+        }
+    }
+
+    return metadata;
 }
 
 PerfEventMetadata const*
 TracepointCache::FindByName(TracepointName const& name) const noexcept
 {
-    auto it = m_byName.find(name);
-    return it == m_byName.end()
-        ? nullptr
-        : &it->second.Metadata;
+    PerfEventMetadata const* metadata = nullptr;
+
+    auto const table = m_nameTable.load(std::memory_order_acquire);
+    if (table != nullptr)
+    {
+        for (size_t i = NameHashOps()(name);; i += 1)
+        {
+            auto const val = table->Slots[i & table->Mask].load(std::memory_order_acquire);
+            if (val == nullptr)
+            {
+                break;
+            }
+
+            if (val->Metadata.Name() == name.EventName &&
+                val->Metadata.SystemName() == name.SystemName)
+            {
+                metadata = &val->Metadata;
+                break;
+            }
+        }
+    }
+
+    return metadata;
 }
 
 PerfEventMetadata const*
@@ -181,8 +309,9 @@ TracepointCache::FindByRawData(std::string_view rawData) const noexcept
 {
     PerfEventMetadata const* metadata;
 
-    auto const offset = static_cast<size_t>(m_commonTypeOffset);
-    auto const commonTypeSize = m_commonTypeSize;
+    // ACQUIRE: m_commonTypeSize is set before m_commonTypeOffset.
+    auto const offset = static_cast<size_t>(m_commonTypeOffset.load(std::memory_order_acquire));
+    auto const commonTypeSize = m_commonTypeSize.load(std::memory_order_relaxed);
     auto const rawDataSize = rawData.size();
     if (rawDataSize <= offset ||
         rawDataSize - offset <= commonTypeSize)
@@ -222,12 +351,8 @@ TracepointCache::AddFromFormat(
 
     try
     {
-        std::vector<char> systemAndFormat;
-        systemAndFormat.reserve(systemName.size() + 1 + formatFileContents.size()); // may throw
-        systemAndFormat.assign(systemName.begin(), systemName.end());
-        systemAndFormat.push_back('\n'); // For readability when debugging.
-        systemAndFormat.insert(systemAndFormat.end(), formatFileContents.begin(), formatFileContents.end());
-        error = Add(std::move(systemAndFormat), systemName.size(), longSize64, nullptr);
+        std::lock_guard<std::mutex> lock(m_mutex); // may throw system_error.
+        error = Add(systemName, formatFileContents, longSize64, nullptr, false);
     }
     catch (...)
     {
@@ -248,14 +373,13 @@ TracepointCache::AddFromSystem(TracepointName const& name) noexcept
     }
     else try
     {
-        std::vector<char> systemAndFormat;
-        systemAndFormat.reserve(name.SystemName.size() + 512); // may throw
-        systemAndFormat.assign(name.SystemName.begin(), name.SystemName.end());
-        systemAndFormat.push_back('\n'); // For readability when debugging.
-        error = AppendTracingFormatFile(systemAndFormat, name.SystemName, name.EventName);
+        std::lock_guard<std::mutex> lock(m_mutex); // may throw system_error.
+        std::vector<char> format;
+        format.reserve(512); // may throw
+        error = AppendFormat(format, name);
         if (error == 0)
         {
-            error = Add(std::move(systemAndFormat), name.SystemName.size(), sizeof(long) == 8, nullptr);
+            error = Add(name.SystemName, { format.data(), format.size() }, sizeof(long) == 8, nullptr, true);
         }
     }
     catch (...)
@@ -266,6 +390,152 @@ TracepointCache::AddFromSystem(TracepointName const& name) noexcept
     return error;
 }
 
+_Success_(return == 0) int
+TracepointCache::AddManyFromSystem(
+    _In_reads_(nameCount) TracepointName const* names,
+    size_t nameCount,
+    _Out_writes_opt_(nameCount) int* pErrors,
+    unsigned readThreadCount) noexcept
+{
+    struct Loaded
+    {
+        std::vector<char> Format;
+        PerfEventMetadata Metadata; // Points into Format and names[i].SystemName.
+        int Error;
+    };
+
+    int error;
+
+    try
+    {
+        // Workers only read the cache (m_savedFormats), so holding the lock on
+        // this thread protects them too.
+        std::lock_guard<std::mutex> lock(m_mutex); // may throw system_error.
+        std::vector<Loaded> loaded(nameCount);
+
+        // Don't re-read files for names we already have.
+        size_t pendingCount = 0;
+        for (size_t i = 0; i != nameCount; i += 1)
+        {
+            if (!names[i].IsValid())
+            {
+                loaded[i].Error = EINVAL;
+            }
+            else if (m_byName.end() != m_byName.find(names[i]))
+            {
+                loaded[i].Error = EEXIST;
+            }
+            else
+            {
+                loaded[i].Error = EAGAIN; // Pending.
+                pendingCount += 1;
+            }
+        }
+
+        // Read and parse on worker threads. The cache is not touched until the
+        // workers are done.
+        std::atomic<size_t> nextIndex(0);
+        auto const work = [this, names, nameCount, &loaded, &nextIndex]() noexcept
+            {
+                for (;;)
+                {
+                    auto const i = nextIndex.fetch_add(1, std::memory_order_relaxed);
+                    if (i >= nameCount)
+                    {
+                        break;
+                    }
+
+                    auto& item = loaded[i];
+                    if (item.Error != EAGAIN)
+                    {
+                        continue;
+                    }
+
+                    auto const& name = names[i];
+                    try
+                    {
+                        item.Format.reserve(512); // may throw
+                        item.Error = AppendFormat(item.Format, name);
+                        if (item.Error == 0)
+                        {
+                            if (!item.Metadata.Parse(
+                                sizeof(long) == 8,
+                                name.SystemName,
+                                { item.Format.data(), item.Format.size() }))
+                            {
+                                item.Error = EINVAL;
+                            }
+                        }
+                    }
+                    catch (...)
+                    {
+                        item.Error = ENOMEM;
+                    }
+                }
+            };
+
+        if (readThreadCount == 0)
+        {
+            readThreadCount = std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+        }
+
+        // Roughly 16 files per thread is enough to cover the thread startup cost.
+        auto const threadsWanted = std::min<size_t>(readThreadCount, (pendingCount + 15) / 16);
+
+        std::vector<std::thread> threads;
+        try
+        {
+            threads.reserve(threadsWanted);
+            for (size_t i = 1; i < threadsWanted; i += 1)
+            {
+                threads.emplace_back(work);
+            }
+        }
+        catch (...)
+        {
+            // Continue with the threads we have.
+        }
+
+        work();
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        // Add to the cache in order so that results match AddFromSystem.
+        error = 0;
+        for (size_t i = 0; i != nameCount; i += 1)
+        {
+            auto& item = loaded[i];
+            if (item.Error == 0)
+            {
+                item.Error = Insert(item.Metadata, nullptr, true);
+            }
+
+            if (pErrors)
+            {
+                pErrors[i] = item.Error;
+            }
+
+            if (error == 0 && item.Error != EEXIST)
+            {
+                error = item.Error;
+            }
+        }
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+        if (pErrors)
+        {
+            std::fill_n(pErrors, nameCount, ENOMEM);
+        }
+    }
+
+    return error;
+}
+
 _Success_(return == 0) int
 TracepointCache::FindOrAddFromSystem(
     TracepointName const& name,
@@ -274,16 +544,20 @@ TracepointCache::FindOrAddFromSystem(
     int error;
     PerfEventMetadata const* metadata;
 
-    auto it = m_byName.find(name);
-    if (it != m_byName.end())
+    metadata = FindByName(name);
+    if (metadata != nullptr)
     {
         error = 0;
-        metadata = &it->second.Metadata;
     }
     else
     {
+        // EEXIST: another thread added it after our FindByName.
         error = AddFromSystem(name);
-        metadata = error ? nullptr : FindByName(name);
+        metadata = error == 0 || error == EEXIST ? FindByName(name) : nullptr;
+        if (metadata != nullptr)
+        {
+            error = 0;
+        }
     }
 
     *ppMetadata = metadata;
@@ -436,20 +710,204 @@ Done:
     return error;
 }
 
+_Success_(return == 0) int
+TracepointCache::LoadFormatCacheFile(_In_z_ char const* path) noexcept
+{
+    int error;
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(m_mutex); // may throw system_error.
+        std::vector<char> data;
+        error = AppendTracingFile(data, path);
+        if (error != 0)
+        {
+            goto Done;
+        }
+
+        if (data.size() < sizeof(FormatCacheMagic) ||
+            0 != memcmp(data.data(), FormatCacheMagic, sizeof(FormatCacheMagic)))
+        {
+            error = EINVAL;
+            goto Done;
+        }
+
+        decltype(m_savedFormats) savedFormats;
+        auto const dataSize = data.size();
+        size_t pos = sizeof(FormatCacheMagic);
+        while (pos != dataSize)
+        {
+            FormatCacheRecordHeader header;
+            if (dataSize - pos < sizeof(header))
+            {
+                error = EINVAL;
+                goto Done;
+            }
+
+            memcpy(&header, data.data() + pos, sizeof(header));
+            pos += sizeof(header);
+
+            size_t const stringsSize = size_t(header.SystemNameSize) + header.EventNameSize + header.FormatSize;
+            if (dataSize - pos < stringsSize)
+            {
+                error = EINVAL;
+                goto Done;
+            }
+
+            auto const systemName = std::string_view(data.data() + pos, header.SystemNameSize);
+            pos += header.SystemNameSize;
+            auto const eventName = std::string_view(data.data() + pos, header.EventNameSize);
+            pos += header.EventNameSize;
+            auto const formatFileContents = std::string_view(data.data() + pos, header.FormatSize);
+            pos += header.FormatSize;
+
+            auto const name = TracepointName(systemName, eventName);
+            if (!name.IsValid() ||
+                header.FormatHash != FormatHash(formatFileContents))
+            {
+                error = EINVAL;
+                goto Done;
+            }
+
+            savedFormats.try_emplace(name, SavedFormat{ formatFileContents, header.Id });
+        }
+
+        // Views in savedFormats point into data, and swap does not move the
+        // vector's buffer.
+        m_savedFormats.swap(savedFormats);
+        m_savedFormatData.swap(data);
+        error = 0;
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+    }
+
+Done:
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointCache::SaveFormatCacheFile(_In_z_ char const* path) const noexcept
+{
+    int error;
+
+    try
+    {
+        std::unique_lock<std::mutex> lock(m_mutex); // may throw system_error.
+        std::vector<char> data;
+        data.assign(FormatCacheMagic, FormatCacheMagic + sizeof(FormatCacheMagic));
+
+        for (auto const& pair : m_byId)
+        {
+            auto const& val = pair.second;
+            if (val.FromSystem)
+            {
+                AppendFormatCacheRecord(data,
+                    val.Metadata.SystemName(),
+                    val.Metadata.Name(),
+                    val.Metadata.Id(),
+                    val.Metadata.FormatFileContents());
+            }
+        }
+
+        for (auto const& pair : m_savedFormats)
+        {
+            if (m_byName.end() == m_byName.find(pair.first))
+            {
+                AppendFormatCacheRecord(data,
+                    pair.first.SystemName,
+                    pair.first.EventName,
+                    pair.second.Id,
+                    pair.second.FormatFileContents);
+            }
+        }
+
+        lock.unlock();
+
+        auto const tempPath = std::string(path) + ".tmp";
+        auto const file = fopen(tempPath.c_str(), "wb");
+        if (file == nullptr)
+        {
+            error = errno;
+        }
+        else
+        {
+            auto const written = fwrite(data.data(), 1, data.size(), file);
+            error = written != data.size() ? EIO : 0;
+            if (0 != fclose(file) && error == 0)
+            {
+                error = EIO;
+            }
+
+            if (error == 0 && 0 != rename(tempPath.c_str(), path))
+            {
+                error = errno;
+            }
+
+            if (error != 0)
+            {
+                unlink(tempPath.c_str());
+            }
+        }
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointCache::AppendFormat(
+    std::vector<char>& format,
+    TracepointName const& name) const noexcept
+{
+    int error;
+
+    auto const it = m_savedFormats.find(name);
+    uint32_t currentId;
+    if (it != m_savedFormats.end() &&
+        0 == ReadTracingEventId(name.SystemName, name.EventName, &currentId) &&
+        currentId == it->second.Id)
+    {
+        try
+        {
+            auto const saved = it->second.FormatFileContents;
+            format.insert(format.end(), saved.begin(), saved.end());
+            error = 0;
+        }
+        catch (...)
+        {
+            error = ENOMEM;
+        }
+    }
+    else
+    {
+        error = AppendTracingFormatFile(format, name.SystemName, name.EventName);
+    }
+
+    return error;
+}
+
 _Success_(return == 0) int
 TracepointCache::PreregisterTracepointImpl(_In_z_ char const* registerCommand, unsigned eventNameSize) noexcept
 {
     int error;
     auto const name = TracepointName(UserEventsSystemName, { registerCommand, eventNameSize });
     assert(EventNameIsValid(name.EventName)); // Precondition ensured by caller.
-    if (m_byName.find(name) != m_byName.end())
-    {
-        error = EALREADY;
-        goto Done;
-    }
 
     try
     {
+        std::lock_guard<std::mutex> lock(m_mutex); // may throw system_error.
+        if (m_byName.find(name) != m_byName.end())
+        {
+            error = EALREADY;
+            goto Done;
+        }
+
         auto registration = std::make_unique<TracepointRegistration>();
 
         auto const dataFile = GetUserEventsDataFile();
@@ -476,18 +934,17 @@ TracepointCache::PreregisterTracepointImpl(_In_z_ char const* registerCommand, u
         registration->DataFile = dataFile;
         registration->WriteIndex = static_cast<int>(reg.write_index);
 
-        std::vector<char> systemAndFormat;
-        systemAndFormat.reserve(name.SystemName.size() + 512); // may throw
-        systemAndFormat.assign(name.SystemName.begin(), name.SystemName.end());
-        systemAndFormat.push_back('\n'); // For readability when debugging.
-        error = AppendTracingFormatFile(systemAndFormat, name.SystemName, name.EventName);
+        std::vector<char> format;
+        format.reserve(512); // may throw
+        error = AppendFormat(format, name);
         if (error == 0)
         {
             error = Add(
-                std::move(systemAndFormat),
-                name.SystemName.size(),
+                name.SystemName,
+                { format.data(), format.size() },
                 sizeof(long) == 8,
-                std::move(registration));
+                std::move(registration),
+                true);
         }
     }
     catch (...)
@@ -502,29 +959,46 @@ Done:
 
 _Success_(return == 0) int
 TracepointCache::Add(
-    std::vector<char>&& systemAndFormat,
-    size_t systemNameSize,
+    std::string_view systemName,
+    std::string_view formatFileContents,
     bool longSize64,
-    std::unique_ptr<TracepointRegistration> registration) noexcept
+    std::unique_ptr<TracepointRegistration> registration,
+    bool fromSystem) noexcept
 {
     int error;
-    uint32_t id = 0;
-    bool idAdded = false;
 
     try
     {
-        assert(systemNameSize < systemAndFormat.size());
-        auto systemName = std::string_view(systemAndFormat.data(), systemNameSize);
-        auto formatFile = std::string_view(
-            systemAndFormat.data() + systemNameSize + 1,
-            systemAndFormat.size() - systemNameSize - 1);
-
-        PerfEventMetadata metadata;
-        if (!metadata.Parse(longSize64, systemName, formatFile))
+        if (!m_parseScratch.Parse(longSize64, systemName, formatFileContents))
         {
             error = EINVAL;
         }
-        else if (auto name = TracepointName(metadata.SystemName(), metadata.Name());
+        else
+        {
+            error = Insert(m_parseScratch, std::move(registration), fromSystem);
+        }
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointCache::Insert(
+    PerfEventMetadata const& metadata,
+    std::unique_ptr<TracepointRegistration> registration,
+    bool fromSystem) noexcept
+{
+    int error;
+    uint32_t id = 0;
+    bool idAdded = false;
+
+    try
+    {
+        if (auto name = TracepointName(metadata.SystemName(), metadata.Name());
             !name.IsValid())
         {
             error = EINVAL;
@@ -551,12 +1025,13 @@ TracepointCache::Add(
                         commonTypeOffset = static_cast<int8_t>(field.Offset());
                         commonTypeSize = static_cast<uint8_t>(field.Size());
 
-                        if (m_commonTypeOffset == CommonTypeOffsetInit)
+                        if (m_commonTypeOffset.load(std::memory_order_relaxed) == CommonTypeOffsetInit)
                         {
                             // First event to be parsed. Use its "common_type" field.
-                            assert(m_commonTypeSize == CommonTypeSizeInit);
-                            m_commonTypeOffset = commonTypeOffset;
-                            m_commonTypeSize = commonTypeSize;
+                            // RELEASE: lock-free readers check offset before size.
+                            assert(m_commonTypeSize.load(std::memory_order_relaxed) == CommonTypeSizeInit);
+                            m_commonTypeSize.store(commonTypeSize, std::memory_order_relaxed);
+                            m_commonTypeOffset.store(commonTypeOffset, std::memory_order_release);
                         }
                     }
                     break;
@@ -569,8 +1044,8 @@ TracepointCache::Add(
                 error = EINVAL;
             }
             else if (
-                m_commonTypeOffset != commonTypeOffset ||
-                m_commonTypeSize != commonTypeSize)
+                m_commonTypeOffset.load(std::memory_order_relaxed) != commonTypeOffset ||
+                m_commonTypeSize.load(std::memory_order_relaxed) != commonTypeSize)
             {
                 // Unexpected: found a different "common_type" field.
                 error = EINVAL;
@@ -578,16 +1053,26 @@ TracepointCache::Add(
             else
             {
                 id = metadata.Id();
+                ReserveLookup(m_byId.size() + 1); // may throw bad_alloc.
+
+                // Stored metadata is never removed, even if a later step fails.
+                auto const& stored = m_metadataStore.Add(metadata); // may throw bad_alloc.
+                name = TracepointName(stored.SystemName(), stored.Name()); // Point into the store.
 
                 auto er = m_byId.try_emplace(
                     id,
-                    std::move(systemAndFormat),
-                    std::move(metadata),
-                    std::move(registration));
+                    stored,
+                    std::move(registration),
+                    fromSystem);
                 assert(er.second);
                 idAdded = er.second;
                 m_byName.try_emplace(name, er.first->second);
 
+                // Publish to lock-free readers.
+                auto const val = &er.first->second;
+                LookupAdd(*m_idTableOwner, IdHash(id), val);
+                LookupAdd(*m_nameTableOwner, NameHashOps()(name), val);
+
                 error = 0;
             }
         }
@@ -604,3 +1089,51 @@ TracepointCache::Add(
 
     return error;
 }
+
+void
+TracepointCache::ReserveLookup(size_t valCount) noexcept(false)
+{
+    // Keep the load factor at or below 1/2 so that probe sequences stay short
+    // and always end at an empty slot.
+    uint32_t const slotCount = m_idTableOwner ? m_idTableOwner->Mask + 1 : 0;
+    if (valCount > slotCount / 2)
+    {
+        uint32_t newSlotCount = slotCount ? slotCount * 2 : 64;
+        while (valCount > newSlotCount / 2)
+        {
+            newSlotCount *= 2;
+        }
+
+        auto idTable = std::make_unique<LookupTable>(newSlotCount); // may throw bad_alloc.
+        auto nameTable = std::make_unique<LookupTable>(newSlotCount); // may throw bad_alloc.
+        for (auto const& pair : m_byName)
+        {
+            auto const val = &pair.second;
+            LookupAdd(*idTable, IdHash(val->Metadata.Id()), val);
+            LookupAdd(*nameTable, NameHashOps()(pair.first), val);
+        }
+
+        // Readers may still be using the old tables, so keep them.
+        idTable->Retired = std::move(m_idTableOwner);
+        nameTable->Retired = std::move(m_nameTableOwner);
+        m_idTableOwner = std::move(idTable);
+        m_nameTableOwner = std::move(nameTable);
+        m_idTable.store(m_idTableOwner.get(), std::memory_order_release);
+        m_nameTable.store(m_nameTableOwner.get(), std::memory_order_release);
+    }
+}
+
+void
+TracepointCache::LookupAdd(LookupTable const& table, size_t hash, CacheVal const* val) noexcept
+{
+    for (size_t i = hash;; i += 1)
+    {
+        auto& slot = table.Slots[i & table.Mask];
+        if (slot.load(std::memory_order_relaxed) == nullptr)
+        {
+            // RELEASE: val is fully constructed before readers can see it.
+            slot.store(val, std::memory_order_release);
+            break;
+        }
+    }
+}
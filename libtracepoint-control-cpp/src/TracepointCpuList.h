@@ -0,0 +1,49 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Internal: cpulist parsing used by TracepointSession (sysfs online CPUs, NUMA
+nodes, cpusets). Not installed.
+*/
+
+#pragma once
+#ifndef _included_TracepointCpuList_h
+#define _included_TracepointCpuList_h 1
+
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace tracepoint_control
+{
+    // Parses a cpulist, e.g. "0-3,8-11". Calls setCpu(cpu) for each listed cpu
+    // less than cpuCount. Returns true if the list is not empty.
+    template<class SetCpuFn>
+    inline bool
+    ParseCpuList(char const* list, uint32_t cpuCount, SetCpuFn&& setCpu)
+    {
+        bool hasCpus = false;
+        for (char const* p = list; *p >= '0' && *p <= '9';)
+        {
+            char* end;
+            auto const first = strtoul(p, &end, 10);
+            auto last = first;
+            if (*end == '-')
+            {
+                last = strtoul(end + 1, &end, 10);
+            }
+
+            for (auto cpu = first; cpu <= last && cpu < cpuCount; cpu += 1)
+            {
+                setCpu(static_cast<uint32_t>(cpu));
+            }
+
+            hasCpus = true;
+            p = *end == ',' ? end + 1 : end;
+        }
+
+        return hasCpus;
+    }
+}
+// namespace tracepoint_control
+
+#endif // _included_TracepointCpuList_h
@@ -0,0 +1,145 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <tracepoint/TracepointEventQueue.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+using namespace tracepoint_control;
+using namespace tracepoint_decode;
+
+static uint32_t
+RoundUpPowerOf2(uint32_t value) noexcept
+{
+    uint32_t result = 2;
+    while (result < value && result < 0x80000000)
+    {
+        result *= 2;
+    }
+
+    return result;
+}
+
+// Returns ptr relative to newBase, assuming ptr is either NULL or within the
+// record that starts at oldBase.
+template<class T>
+static T*
+Rebase(T* ptr, void const* oldBase, void const* newBase) noexcept
+{
+    return ptr == nullptr
+        ? nullptr
+        : reinterpret_cast<T*>(
+            static_cast<char const*>(newBase) +
+            (reinterpret_cast<char const*>(ptr) - static_cast<char const*>(oldBase)));
+}
+
+TracepointEventQueue::~TracepointEventQueue()
+{
+    return;
+}
+
+TracepointEventQueue::TracepointEventQueue(
+    uint32_t maxEventCount,
+    uint32_t arenaSize) noexcept(false)
+    : m_slots(std::make_unique<Slot[]>(RoundUpPowerOf2(maxEventCount))) // may throw bad_alloc.
+    , m_arena(std::make_unique<uint64_t[]>((arenaSize < 65536 ? 65536 : (arenaSize + 7ull) & ~7ull) / sizeof(uint64_t))) // may throw bad_alloc.
+    , m_slotMask(RoundUpPowerOf2(maxEventCount) - 1)
+    , m_arenaSize(arenaSize < 65536 ? 65536 : static_cast<uint32_t>((arenaSize + 7ull) & ~7ull))
+    , m_tail(0)
+    , m_arenaTail(0)
+    , m_head(0)
+    , m_arenaHead(0)
+    , m_cachedTail(0)
+    , m_cachedArenaTail(0)
+{
+    return;
+}
+
+_Success_(return == 0) int
+TracepointEventQueue::Push(PerfSampleEventInfo const& eventInfo) noexcept
+{
+    int error;
+
+    auto const header = eventInfo.header;
+    if (header == nullptr)
+    {
+        error = EINVAL;
+        goto Done;
+    }
+    else
+    {
+        assert(0 == (header->size & 7)); // Records in perf buffers are 8-byte aligned.
+        auto const recordSize = static_cast<uint32_t>(header->size);
+
+        // Check for a free slot.
+        auto const head = m_head.load(std::memory_order_relaxed);
+        if (head - m_cachedTail > m_slotMask)
+        {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head - m_cachedTail > m_slotMask)
+            {
+                error = EAGAIN;
+                goto Done;
+            }
+        }
+
+        // Check for arena space. Records are contiguous, so if the record does
+        // not fit before the end of the arena, skip to the start of the arena.
+        auto const arenaOffset = static_cast<uint32_t>(m_arenaHead % m_arenaSize);
+        auto const padding = m_arenaSize - arenaOffset < recordSize
+            ? m_arenaSize - arenaOffset
+            : 0u;
+        auto const arenaEnd = m_arenaHead + padding + recordSize;
+        if (arenaEnd - m_cachedArenaTail > m_arenaSize)
+        {
+            m_cachedArenaTail = m_arenaTail.load(std::memory_order_acquire);
+            if (arenaEnd - m_cachedArenaTail > m_arenaSize)
+            {
+                error = EAGAIN;
+                goto Done;
+            }
+        }
+
+        auto const copy = reinterpret_cast<char*>(m_arena.get()) + (arenaOffset + padding) % m_arenaSize;
+        memcpy(copy, header, recordSize);
+
+        auto& slot = m_slots[head & m_slotMask];
+        slot.Info = eventInfo;
+        slot.Info.header = reinterpret_cast<perf_event_header const*>(copy);
+        slot.Info.read_values = Rebase(eventInfo.read_values, header, copy);
+        slot.Info.callchain = Rebase(eventInfo.callchain, header, copy);
+        slot.Info.raw_data = Rebase(eventInfo.raw_data, header, copy);
+        slot.ArenaEnd = arenaEnd;
+        m_arenaHead = arenaEnd;
+
+        // RELEASE: publish the slot and the record to the consumer.
+        m_head.store(head + 1, std::memory_order_release);
+        error = 0;
+    }
+
+Done:
+
+    return error;
+}
+
+_Ret_opt_ PerfSampleEventInfo const*
+TracepointEventQueue::Front() const noexcept
+{
+    auto const tail = m_tail.load(std::memory_order_relaxed);
+    return tail == m_head.load(std::memory_order_acquire)
+        ? nullptr
+        : &m_slots[tail & m_slotMask].Info;
+}
+
+void
+TracepointEventQueue::Release() noexcept
+{
+    auto const tail = m_tail.load(std::memory_order_relaxed);
+    assert(tail != m_head.load(std::memory_order_relaxed));
+
+    // RELEASE: the producer may reuse the slot and the record's arena space.
+    m_arenaTail.store(m_slots[tail & m_slotMask].ArenaEnd, std::memory_order_release);
+    m_tail.store(tail + 1, std::memory_order_release);
+}
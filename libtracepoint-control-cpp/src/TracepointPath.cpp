@@ -304,11 +304,13 @@ tracepoint_control::AppendTracingFile(
     return error;
 }
 
-_Success_(return == 0) int
-tracepoint_control::AppendTracingFormatFile(
-    std::vector<char>& dest,
+// Formats "$(tracingDirectory)/events/$(systemName)/$(eventName)/$(fileName)".
+static _Success_(return == 0) int
+FormatTracingEventPath(
+    char (&path)[TRACING_DIR_MAX + 256],
     std::string_view systemName,
-    std::string_view eventName) noexcept
+    std::string_view eventName,
+    _In_z_ char const* fileName) noexcept
 {
     int error;
 
@@ -321,7 +323,7 @@ tracepoint_control::AppendTracingFormatFile(
         error = EINVAL;
     }
     else if (
-        auto const tracingDir = GetTracingDirectory();
+        auto const tracingDir = tracepoint_control::GetTracingDirectory();
         tracingDir[0] == 0)
     {
         // Unable to find the "/.../tracing" directory.
@@ -329,21 +331,84 @@ tracepoint_control::AppendTracingFormatFile(
     }
     else
     {
-        char fileName[TRACING_DIR_MAX + 256];
-        unsigned const pathLen = snprintf(fileName, sizeof(fileName), "%s/events/%.*s/%.*s/format",
+        unsigned const pathLen = snprintf(path, sizeof(path), "%s/events/%.*s/%.*s/%s",
             tracingDir,
             (unsigned)systemName.size(), systemName.data(),
-            (unsigned)eventName.size(), eventName.data());
-        if (pathLen >= sizeof(fileName))
+            (unsigned)eventName.size(), eventName.data(),
+            fileName);
+        if (pathLen >= sizeof(path))
         {
             // tracingDirectory + systemName + eventName too long.
             error = E2BIG;
         }
         else
         {
-            error = AppendTracingFile(dest, fileName);
+            error = 0;
+        }
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+tracepoint_control::AppendTracingFormatFile(
+    std::vector<char>& dest,
+    std::string_view systemName,
+    std::string_view eventName) noexcept
+{
+    char fileName[TRACING_DIR_MAX + 256];
+    int error = FormatTracingEventPath(fileName, systemName, eventName, "format");
+    if (error == 0)
+    {
+        error = AppendTracingFile(dest, fileName);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+tracepoint_control::ReadTracingEventId(
+    std::string_view systemName,
+    std::string_view eventName,
+    _Out_ uint32_t* pId) noexcept
+{
+    uint32_t id = 0;
+    char fileName[TRACING_DIR_MAX + 256];
+    int error = FormatTracingEventPath(fileName, systemName, eventName, "id");
+    if (error == 0)
+    {
+        int const file = open(fileName, O_RDONLY | O_CLOEXEC);
+        if (file < 0)
+        {
+            error = GetFailureErrno();
+        }
+        else
+        {
+            char buf[24];
+            auto const readSize = read(file, buf, sizeof(buf) - 1);
+            if (readSize < 0)
+            {
+                error = GetFailureErrno();
+            }
+            else
+            {
+                buf[readSize] = 0;
+                char* end;
+                auto const value = strtoul(buf, &end, 10);
+                if (end == buf || value > 0xFFFFFFFF || (*end != 0 && *end != '\n'))
+                {
+                    error = EINVAL;
+                }
+                else
+                {
+                    id = static_cast<uint32_t>(value);
+                }
+            }
+
+            close(file);
         }
     }
 
+    *pId = id;
     return error;
 }
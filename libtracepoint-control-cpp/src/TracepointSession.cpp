@@ -3,14 +3,28 @@
 
 #include <tracepoint/TracepointSession.h>
 #include <tracepoint/PerfDataFileWriter.h>
+#include "TracepointCpuList.h"
+#include "TracepointTimestampFilter.h"
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <assert.h>
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
@@ -21,7 +35,6 @@
 #ifdef NDEBUG
 #define DEBUG_PRINTF(...) ((void)0)
 #else // NDEBUG
-#include <stdio.h>
 #define DEBUG_PRINTF(...) printf(__VA_ARGS__)
 #endif // NDEBUG
 
@@ -51,6 +64,49 @@ BufferDataPosToHeader(
     return reinterpret_cast<perf_event_header const*>(bufferData + recordBufferPos);
 }
 
+// Returns the offset of the PERF_SAMPLE_TIME field within a non-SAMPLE record's
+// sample_id suffix, measured back from the end of the record, or 0 if not present.
+static unsigned
+NonSampleBytesFromTimeToEnd(uint32_t sampleType) noexcept
+{
+    if (0 == (sampleType & PERF_SAMPLE_TIME))
+    {
+        return 0;
+    }
+
+    return sizeof(uint64_t) * (
+        1u + // time
+        (0 != (sampleType & PERF_SAMPLE_ID)) +
+        (0 != (sampleType & PERF_SAMPLE_STREAM_ID)) +
+        (0 != (sampleType & PERF_SAMPLE_CPU)) +
+        (0 != (sampleType & PERF_SAMPLE_IDENTIFIER)));
+}
+
+// Returns the minimum size of the fields of a SAMPLE record (not including the
+// perf_event_header), i.e. 8 bytes per field, counting CALLCHAIN and RAW as 8.
+static constexpr unsigned
+SampleFixedSize(uint32_t sampleType) noexcept
+{
+    unsigned size = 0;
+    for (uint32_t bits = sampleType & TracepointSessionOptions::SampleTypeSupported; bits != 0; bits &= bits - 1)
+    {
+        size += sizeof(uint64_t);
+    }
+
+    return size;
+}
+
+// Tracepoint IDs (common_type) below this value are looked up in a dense
+// array. tracefs assigns IDs sequentially, so they are normally small.
+static constexpr uint32_t CommonTypeIndexMax = 0x10000;
+
+// Hash for open-addressing lookup of sample IDs (Fibonacci hashing).
+static size_t
+SampleIdHash(uint64_t sampleId) noexcept
+{
+    return static_cast<size_t>((sampleId * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+}
+
 // Return the smallest power of 2 that is >= pageSize and >= bufferSize.
 // Assumes pageSize is a power of 2.
 static uint32_t
@@ -73,6 +129,83 @@ RoundUpBufferSize(uint32_t pageSize, uint32_t bufferSize) noexcept
     return BufferSizeMax;
 }
 
+// Reads a cpulist file, e.g. /sys/devices/system/cpu/online, and calls
+// ParseCpuList. Returns false if the file could not be read or is empty.
+template<class SetCpuFn>
+static bool
+ReadCpuListFile(char const* path, uint32_t cpuCount, SetCpuFn&& setCpu)
+{
+    auto const file = fopen(path, "re");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    char list[4096];
+    auto const listLen = fread(list, 1, sizeof(list) - 1, file);
+    fclose(file);
+    list[listLen] = '\0';
+    return ParseCpuList(list, cpuCount, setCpu);
+}
+
+// Returns the NUMA node of each of the first cpuCount CPUs, or an empty vector
+// if the system has only one node or the topology cannot be read. Parses
+// /sys/devices/system/node/nodeN/cpulist, e.g. "0-3,8-11".
+static std::vector<uint32_t>
+ReadCpuNumaNodes(uint32_t cpuCount) noexcept(false)
+{
+    std::vector<uint32_t> cpuNodes(cpuCount, 0); // may throw bad_alloc.
+    uint32_t nodeCount = 0;
+
+    auto const dir = opendir("/sys/devices/system/node");
+    if (dir == nullptr)
+    {
+        return {};
+    }
+
+    while (auto const ent = readdir(dir))
+    {
+        char* end;
+        if (0 != strncmp(ent->d_name, "node", 4) ||
+            ent->d_name[4] < '0' || ent->d_name[4] > '9')
+        {
+            continue;
+        }
+
+        auto const node = strtoul(ent->d_name + 4, &end, 10);
+        if (*end != '\0')
+        {
+            continue;
+        }
+
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%lu/cpulist", node);
+        auto const file = fopen(path, "re");
+        if (file == nullptr)
+        {
+            continue;
+        }
+
+        char list[4096];
+        auto const listLen = fread(list, 1, sizeof(list) - 1, file);
+        fclose(file);
+        list[listLen] = '\0';
+
+        auto const hasCpus = ParseCpuList(list, cpuCount,
+            [&cpuNodes, node](uint32_t cpu) { cpuNodes[cpu] = static_cast<uint32_t>(node); });
+        nodeCount += hasCpus;
+    }
+
+    closedir(dir);
+
+    if (nodeCount < 2)
+    {
+        cpuNodes.clear();
+    }
+
+    return cpuNodes;
+}
+
 static tracepoint_decode::PerfEventSessionInfo
 MakeSessionInfo(uint32_t clockid) noexcept
 {
@@ -129,6 +262,18 @@ namespace
             return Max - m_used;
         }
 
+        size_t
+        Bytes() const noexcept
+        {
+            size_t cb = 0;
+            for (unsigned i = 0; i != m_used; i += 1)
+            {
+                cb += m_vecs[i].iov_len;
+            }
+
+            return cb;
+        }
+
         void
         Add(uint8_t const* p, size_t c) noexcept
         {
@@ -212,6 +357,62 @@ namespace
     };
 }
 
+// TracepointLatencyHistogram
+
+unsigned
+TracepointLatencyHistogram::BucketIndex(uint64_t ns) noexcept
+{
+    // Buckets 0..3 hold 0..3. After that, 4 buckets per power of 2:
+    // [4 << (e - 2), 5 << (e - 2)), ..., [7 << (e - 2), 8 << (e - 2)) for e >= 2.
+    if (ns < 4)
+    {
+        return static_cast<unsigned>(ns);
+    }
+
+    unsigned const e = 63u - static_cast<unsigned>(__builtin_clzll(ns));
+    unsigned const index = (e - 1) * 4 + static_cast<unsigned>((ns >> (e - 2)) & 3);
+    return index < BucketCount ? index : BucketCount - 1;
+}
+
+uint64_t
+TracepointLatencyHistogram::BucketLowerBound(unsigned bucketIndex) noexcept
+{
+    assert(bucketIndex < BucketCount);
+    if (bucketIndex < 4)
+    {
+        return bucketIndex;
+    }
+
+    unsigned const e = bucketIndex / 4 + 1;
+    return static_cast<uint64_t>(4 + bucketIndex % 4) << (e - 2);
+}
+
+uint64_t
+TracepointLatencyHistogram::Percentile(double percent) const noexcept
+{
+    if (Count == 0)
+    {
+        return 0;
+    }
+
+    auto const target = percent <= 0.0
+        ? 1u
+        : percent >= 100.0
+        ? Count
+        : static_cast<uint64_t>(static_cast<double>(Count) * percent / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i != BucketCount; i += 1)
+    {
+        seen += Buckets[i];
+        if (seen >= target && seen != 0)
+        {
+            return BucketLowerBound(i);
+        }
+    }
+
+    return BucketLowerBound(BucketCount - 1);
+}
+
 // TracepointInfo
 
 TracepointInfo::~TracepointInfo()
@@ -252,385 +453,1135 @@ TracepointInfo::GetEventCount(_Out_ uint64_t* value) const noexcept
     return self.GetEventCountImpl(value);
 }
 
-// ReadFormat
-
-struct TracepointSession::ReadFormat
+uint64_t
+TracepointInfo::RateLimitDroppedCount() const noexcept
 {
-    // This needs to match the attr.read_format used for tracepoints.
-    uint64_t value;
-    uint64_t id;
-};
-
-// TracepointInfoImpl
+    auto& self = *static_cast<TracepointSession::TracepointInfoImpl const*>(this);
+    uint64_t count = 0;
+    if (self.m_rateLimitBuckets)
+    {
+        for (unsigned i = 0; i != self.m_bufferFilesCount; i += 1)
+        {
+            count += self.m_rateLimitBuckets[i].DroppedCount;
+        }
+    }
 
-TracepointSession::TracepointInfoImpl::~TracepointInfoImpl()
-{
-    return;
+    return count;
 }
 
-TracepointSession::TracepointInfoImpl::TracepointInfoImpl(
-    tracepoint_decode::PerfEventDesc const& eventDesc,
-    std::unique_ptr<char unsigned[]> eventDescStorage,
-    std::unique_ptr<unique_fd[]> bufferFiles,
-    unsigned bufferFilesCount
-    ) noexcept
-    : m_eventDesc(eventDesc)
-    , m_eventDescStorage(std::move(eventDescStorage))
-    , m_bufferFiles(std::move(bufferFiles))
-    , m_bufferFilesCount(bufferFilesCount)
-    , m_enableState(TracepointEnableState::Unknown)
+uint32_t
+TracepointInfo::BufferGroup() const noexcept
 {
-    return;
+    auto& self = *static_cast<TracepointSession::TracepointInfoImpl const*>(this);
+    return self.m_bufferGroup;
 }
 
-_Success_(return == 0) int
-TracepointSession::TracepointInfoImpl::Read(unsigned index, _Out_ ReadFormat* data) const noexcept
-{
-    assert(index < m_bufferFilesCount);
-    auto const size = read(m_bufferFiles[index].get(), data, sizeof(data[0]));
-    int const error = size == sizeof(data[0])
-        ? 0
-        : size < 0
-        ? errno
-        : EPIPE;
-    return error;
-}
+// TracepointSnapshot
 
-_Success_(return == 0) int
-TracepointSession::TracepointInfoImpl::GetEventCountImpl(_Out_ uint64_t* value) const noexcept
+// Shared by TracepointSession::SetWriterHeaders and TracepointSnapshot::SetWriterHeaders.
+static int
+SetWriterHeadersImpl(
+    tracepoint_decode::PerfDataFileWriter& writer,
+    PerfEventSessionInfo const& sessionInfo,
+    _In_opt_ TracepointTimestampRange const* writtenRange) noexcept
 {
-    int error = 0;
-    uint64_t total = 0;
+    int error;
 
-    for (unsigned i = 0; i != m_bufferFilesCount; i += 1)
+    utsname uts;
+    if (0 == uname(&uts))
     {
-        if (!m_bufferFiles[i])
+        // HOSTNAME, OSRELEASE, ARCH
+        error = writer.SetUtsNameHeaders(uts);
+        if (error != 0)
         {
-            continue;
+            goto Done;
         }
+    }
 
-        ReadFormat data;
-        error = Read(i, &data);
-        if (error != 0)
+    {
+        auto const conf = sysconf(_SC_NPROCESSORS_CONF);
+        auto const onln = sysconf(_SC_NPROCESSORS_ONLN);
+        if (conf > 0 && onln > 0)
         {
-            break;
+            // NRCPUS
+            error = writer.SetNrCpusHeader(static_cast<uint32_t>(conf), static_cast<uint32_t>(onln));
+            if (error != 0)
+            {
+                goto Done;
+            }
         }
+    }
 
-        total += data.value;
+    // CLOCKID, CLOCK_DATA
+    error = writer.SetSessionInfoHeaders(sessionInfo);
+    if (error != 0)
+    {
+        goto Done;
     }
 
-    *value = total;
+    if (writtenRange != nullptr)
+    {
+        // SAMPLE_TIME
+        error = writer.SetSampleTimeHeader(writtenRange->First, writtenRange->Last);
+        if (error != 0)
+        {
+            goto Done;
+        }
+    }
+
+Done:
+
     return error;
 }
 
-// BufferInfo
+TracepointSnapshot::~TracepointSnapshot() = default;
 
-TracepointSession::BufferInfo::~BufferInfo()
-{
-    return;
-}
+TracepointSnapshot::TracepointSnapshot(TracepointSnapshot&&) noexcept = default;
 
-TracepointSession::BufferInfo::BufferInfo() noexcept
-    : Mmap()
-    , Size()
-    , Data()
-    , DataPos()
-    , DataTail()
-    , DataHead64()
+TracepointSnapshot&
+TracepointSnapshot::operator=(TracepointSnapshot&&) noexcept = default;
+
+TracepointSnapshot::TracepointSnapshot() noexcept
+    : m_data()
+    , m_dataCapacity(0)
+    , m_dataSize(0)
+    , m_buffers()
+    , m_eventDescs()
+    , m_sessionInfo()
+    , m_sampleType(0)
 {
     return;
 }
 
-// TracepointBookmark
-
-TracepointSession::TracepointBookmark::TracepointBookmark(
-    uint64_t timestamp,
-    uint16_t bufferIndex,
-    uint16_t recordSize,
-    uint32_t recordBufferPos) noexcept
-    : Timestamp(timestamp)
-    , BufferIndex(bufferIndex)
-    , RecordSize(recordSize)
-    , RecordBufferPos(recordBufferPos)
+void
+TracepointSnapshot::Clear() noexcept
 {
-    return;
+    m_dataSize = 0;
+    m_buffers.clear();
+    m_eventDescs.clear();
 }
 
-// UnorderedEnumerator
-
-TracepointSession::UnorderedEnumerator::~UnorderedEnumerator()
+bool
+TracepointSnapshot::Empty() const noexcept
 {
-    m_session.EnumeratorEnd(m_bufferIndex);
+    return m_dataSize == 0;
 }
 
-TracepointSession::UnorderedEnumerator::UnorderedEnumerator(
-    TracepointSession& session,
-    uint32_t bufferIndex) noexcept
-    : m_session(session)
-    , m_bufferIndex(bufferIndex)
+size_t
+TracepointSnapshot::DataSize() const noexcept
 {
-    m_session.EnumeratorBegin(bufferIndex);
+    return m_dataSize;
 }
 
-bool
-TracepointSession::UnorderedEnumerator::MoveNext() noexcept
+_Success_(return == 0) int
+TracepointSnapshot::SavePerfDataFile(
+    _In_z_ char const* perfDataFileName,
+    TracepointSavePerfDataFileOptions const& options) const noexcept
 {
-    auto& session = m_session;
-    return session.EnumeratorMoveNext(
-        m_bufferIndex,
-        [&session](
-            BufferInfo const& buffer,
-            uint16_t recordSize,
-            uint32_t recordBufferPos)
-        {
-            auto const headerType = BufferDataPosToHeader(buffer.Data, recordBufferPos)->type;
-            return headerType == PERF_RECORD_SAMPLE &&
-                session.ParseSample(buffer, recordSize, recordBufferPos);
-        });
-}
+    int error = 0;
+    PerfDataFileWriter writer;
+    TracepointTimestampRange writtenRange{}; // Start with an invalid range.
+    bool timesValid;
 
-//  OrderedEnumerator
+    if (options.m_timestampWrittenRange)
+    {
+        *options.m_timestampWrittenRange = writtenRange;
+    }
 
-TracepointSession::OrderedEnumerator::~OrderedEnumerator()
-{
-    if (m_needsCleanup)
+    error = writer.Create(perfDataFileName, options.m_openMode);
+    if (error != 0)
     {
-        for (unsigned bufferIndex = 0; bufferIndex != m_session.m_bufferCount; bufferIndex += 1)
+        goto Done;
+    }
+
+    if (options.m_compressionLevel != 0)
+    {
+        error = writer.EnableCompression(options.m_compressionLevel);
+        if (error != 0)
         {
-            if (m_session.m_buffers[bufferIndex].Size != 0)
-            {
-                m_session.EnumeratorEnd(bufferIndex);
-            }
+            goto Done;
         }
     }
-}
 
-TracepointSession::OrderedEnumerator::OrderedEnumerator(TracepointSession& session) noexcept
-    : m_session(session)
-    , m_needsCleanup(false)
-    , m_index(0)
-{
-    return;
-}
-
-_Success_(return == 0) int
-TracepointSession::OrderedEnumerator::LoadAndSort() noexcept
-{
-    int error;
-    auto& session = m_session;
-
-    if (0 == (session.m_sampleType & PERF_SAMPLE_TIME))
+    error = writer.WriteFinishedInit();
+    if (error != 0)
     {
-        error = EPERM;
+        goto Done;
     }
-    else try
+
+    error = WriteToWriterImpl(writer, &writtenRange, options.m_filterRange, options.m_filterSlackNs);
+    if (error != 0)
     {
-        auto const sampleType = session.m_sampleType;
-        unsigned const bytesBeforeTime = sizeof(uint64_t) * (
-            1u + // perf_event_header
-            (0 != (sampleType & PERF_SAMPLE_IDENTIFIER)) +
-            (0 != (sampleType & PERF_SAMPLE_IP)) +
-            (0 != (sampleType & PERF_SAMPLE_TID)));
+        goto Done;
+    }
 
-        for (uint32_t bufferIndex = 0; bufferIndex != session.m_bufferCount; bufferIndex += 1)
-        {
-            if (session.m_buffers[bufferIndex].Size != 0)
-            {
-                session.EnumeratorBegin(bufferIndex);
-            }
-        }
+    timesValid = (m_sampleType & PERF_SAMPLE_TIME) && writtenRange.First <= writtenRange.Last;
 
-        // Circular: If we throw an exception, we need to unpause during cleanup.
-        // Realtime: If we throw an exception, we don't update tail pointers during cleanup.
-        m_needsCleanup = !session.IsRealtime();
+    error = SetWriterHeaders(writer, timesValid ? &writtenRange : nullptr);
+    if (error != 0)
+    {
+        goto Done;
+    }
 
-        session.m_enumeratorBookmarks.clear();
-        for (uint32_t bufferIndex = 0; bufferIndex != session.m_bufferCount; bufferIndex += 1)
-        {
-            if (session.m_buffers[bufferIndex].Size == 0)
-            {
-                continue;
-            }
+    error = writer.FinalizeAndClose();
+    if (error != 0)
+    {
+        goto Done;
+    }
 
-            auto const startSize = session.m_enumeratorBookmarks.size();
+    if (timesValid && options.m_timestampWrittenRange)
+    {
+        *options.m_timestampWrittenRange = writtenRange;
+    }
 
-            // Only need to call EnumeratorMoveNext once per buffer - it will loop until a callback
-            // returns true or it reaches end of buffer, and our callback never returns true.
-            session.EnumeratorMoveNext(
-                bufferIndex,
-                [bufferIndex, bytesBeforeTime, &session](
-                    BufferInfo const& buffer,
-                    uint16_t recordSize,
-                    uint32_t recordBufferPos)
-                {
-                    assert(0 == (recordSize & 7));
-                    assert(0 == (recordBufferPos & 7));
+Done:
 
-                    if (PERF_RECORD_SAMPLE != BufferDataPosToHeader(buffer.Data, recordBufferPos)->type)
-                    {
-                        return false; // Keep going.
-                    }
+    return error;
+}
 
-                    if (recordSize <= bytesBeforeTime)
-                    {
-                        session.m_corruptEventCount += 1;
-                        return false;
-                    }
+_Success_(return == 0) int
+TracepointSnapshot::WriteToWriter(
+    tracepoint_decode::PerfDataFileWriter& writer,
+    _Inout_ TracepointTimestampRange* writtenRange,
+    TracepointTimestampRange filterRange) const noexcept
+{
+    return WriteToWriterImpl(writer, writtenRange, filterRange, UINT64_MAX);
+}
 
-                    auto const timePos = (recordBufferPos + bytesBeforeTime) & (buffer.Size - 1);
-                    auto const timestamp = *reinterpret_cast<uint64_t const*>(buffer.Data + timePos);
-                    session.m_enumeratorBookmarks.emplace_back( // May throw bad_alloc.
-                        timestamp,
-                        bufferIndex,
-                        recordSize,
-                        recordBufferPos);
-                    return false; // Keep going.
-                });
+_Success_(return == 0) int
+TracepointSnapshot::WriteToWriterImpl(
+    tracepoint_decode::PerfDataFileWriter& writer,
+    _Inout_ TracepointTimestampRange* writtenRange,
+    TracepointTimestampRange filterRange,
+    uint64_t filterSlackNs) const noexcept
+{
+    int error = 0;
+    TimestampFilter filter(filterRange, filterSlackNs);
 
-            if (!session.IsRealtime())
-            {
-                // Circular buffers enumerate in reverse order. Fix that.
-                auto const endSize = session.m_enumeratorBookmarks.size();
-                auto const bookmarksData = session.m_enumeratorBookmarks.data();
-                std::reverse(bookmarksData + startSize, bookmarksData + endSize);
-            }
+    // Events are not parsed, so add all of the EventDescs up-front.
+    for (auto const& eventDesc : m_eventDescs)
+    {
+        error = writer.AddTracepointEventDesc(eventDesc);
+        if (error != EEXIST && error != 0)
+        {
+            goto Done;
         }
+    }
 
-        auto const bookmarksData = session.m_enumeratorBookmarks.data();
-        std::stable_sort(
-            bookmarksData,
-            bookmarksData + session.m_enumeratorBookmarks.size(),
-            [](TracepointBookmark const& a, TracepointBookmark const& b) noexcept
-            {
-                return a.Timestamp < b.Timestamp;
-            });
+    error = 0;
 
-        // From here on, do full cleanup.
-        m_needsCleanup = true;
-        error = 0;
-    }
-    catch (...)
+    for (auto const& snapshotBuffer : m_buffers)
     {
-        error = ENOMEM;
+        // Same format as the circular buffer: records from newest to oldest,
+        // possibly followed by unused space or a partially-overwritten record.
+        auto const data = m_data.get() + snapshotBuffer.DataOffset;
+        error = FilterSnapshotRecords(
+            data,
+            snapshotBuffer.DataSize,
+            m_sampleType,
+            filter,
+            writtenRange,
+            [&writer, data](size_t pos, size_t size) noexcept
+            {
+                return writer.WriteEventData(data + pos, size);
+            });
+        if (error != 0)
+        {
+            goto Done;
+        }
     }
 
+Done:
+
     return error;
 }
 
-bool
-TracepointSession::OrderedEnumerator::MoveNext() noexcept
+_Success_(return == 0) int
+TracepointSnapshot::SetWriterHeaders(
+    tracepoint_decode::PerfDataFileWriter& writer,
+    _In_opt_ TracepointTimestampRange const* writtenRange) const noexcept
 {
-    auto& session = m_session;
-    auto const buffers = session.m_buffers.get();
-    auto const enumeratorBookmarksData = session.m_enumeratorBookmarks.data();
-    auto const enumeratorBookmarksSize = session.m_enumeratorBookmarks.size();
-    while (m_index < enumeratorBookmarksSize)
-    {
-        auto const& item = enumeratorBookmarksData[m_index];
-        m_index += 1;
+    return SetWriterHeadersImpl(writer, m_sessionInfo, writtenRange);
+}
 
-        if (session.ParseSample(
-            buffers[item.BufferIndex],
-            item.RecordSize,
-            item.RecordBufferPos))
-        {
-            return true;
-        }
-    }
+// ReadFormat
 
-    return false;
-}
+struct TracepointSession::ReadFormat
+{
+    // This needs to match the attr.read_format used for tracepoints.
+    uint64_t value;
+    uint64_t id;
+};
 
-// TracepointInfoIterator
+// TracepointInfoImpl
 
-TracepointInfoIterator::TracepointInfoIterator(InnerItTy it) noexcept
-    : m_it(it)
+TracepointSession::TracepointInfoImpl::~TracepointInfoImpl()
 {
     return;
 }
 
-TracepointInfoIterator::TracepointInfoIterator() noexcept
-    : m_it()
+TracepointSession::TracepointInfoImpl::TracepointInfoImpl(
+    tracepoint_decode::PerfEventDesc const& eventDesc,
+    std::unique_ptr<char unsigned[]> eventDescStorage,
+    std::unique_ptr<unique_fd[]> bufferFiles,
+    unsigned bufferFilesCount
+    ) noexcept
+    : m_eventDesc(eventDesc)
+    , m_eventDescStorage(std::move(eventDescStorage))
+    , m_bufferFiles(std::move(bufferFiles))
+    , m_bufferFilesCount(bufferFilesCount)
+    , m_bufferGroup(0)
+    , m_enableState(TracepointEnableState::Unknown)
+    , m_rateLimitPerSecond(0)
+    , m_rateLimitCapacity(0)
+    , m_rateLimitBuckets()
 {
     return;
 }
 
-TracepointInfoIterator&
-TracepointInfoIterator::operator++() noexcept
+_Success_(return == 0) int
+TracepointSession::TracepointInfoImpl::Read(unsigned index, _Out_ ReadFormat* data) const noexcept
 {
-    ++m_it;
-    return *this;
+    assert(index < m_bufferFilesCount);
+    auto const size = read(m_bufferFiles[index].get(), data, sizeof(data[0]));
+    int const error = size == sizeof(data[0])
+        ? 0
+        : size < 0
+        ? errno
+        : EPIPE;
+    return error;
 }
 
-TracepointInfoIterator
-TracepointInfoIterator::operator++(int) noexcept
+_Success_(return == 0) int
+TracepointSession::TracepointInfoImpl::GetEventCountImpl(_Out_ uint64_t* value) const noexcept
 {
-    TracepointInfoIterator old(m_it);
-    ++m_it;
-    return old;
-}
+    int error = 0;
+    uint64_t total = 0;
 
-TracepointInfoIterator::pointer
-TracepointInfoIterator::operator->() const noexcept
-{
-    return &m_it->second;
-}
+    for (unsigned i = 0; i != m_bufferFilesCount; i += 1)
+    {
+        if (!m_bufferFiles[i])
+        {
+            continue;
+        }
 
-TracepointInfoIterator::reference
-TracepointInfoIterator::operator*() const noexcept
-{
-    return m_it->second;
-}
+        ReadFormat data;
+        error = Read(i, &data);
+        if (error != 0)
+        {
+            break;
+        }
 
-bool
-TracepointInfoIterator::operator==(TracepointInfoIterator other) const noexcept
-{
-    return m_it == other.m_it;
+        total += data.value;
+    }
+
+    *value = total;
+    return error;
 }
 
 bool
-TracepointInfoIterator::operator!=(TracepointInfoIterator other) const noexcept
+TracepointSession::TracepointInfoImpl::RateLimitAllows(
+    unsigned bufferIndex,
+    uint64_t time) const noexcept
 {
-    return m_it != other.m_it;
-}
+    static constexpr uint64_t TokensPerEvent = 1000000000; // 1 event per second = 1 token per ns.
 
-// TracepointInfoRange
+    assert(m_rateLimitPerSecond != 0);
+    assert(bufferIndex < m_bufferFilesCount);
+    auto& bucket = m_rateLimitBuckets[bufferIndex];
 
-TracepointInfoRange::TracepointInfoRange(RangeTy const& range) noexcept
-    : m_range(range)
-{
-    return;
-}
+    if (time > bucket.LastTime)
+    {
+        auto const elapsed = time - bucket.LastTime;
+        auto const room = m_rateLimitCapacity - bucket.Tokens;
+        bucket.Tokens = elapsed < room / m_rateLimitPerSecond
+            ? bucket.Tokens + elapsed * m_rateLimitPerSecond
+            : m_rateLimitCapacity;
+        bucket.LastTime = time;
+    }
+    else if (time < bucket.LastTime)
+    {
+        // Events within a buffer are in time order, so this is a new pass over
+        // a circular buffer. Start over.
+        bucket.Tokens = m_rateLimitCapacity;
+        bucket.LastTime = time;
+    }
 
-TracepointInfoIterator
-TracepointInfoRange::begin() const noexcept
-{
-    return TracepointInfoIterator(m_range.begin());
+    if (bucket.Tokens < TokensPerEvent)
+    {
+        bucket.DroppedCount += 1;
+        return false;
+    }
+
+    bucket.Tokens -= TokensPerEvent;
+    return true;
 }
 
-TracepointInfoIterator
-TracepointInfoRange::end() const noexcept
+// BufferInfo
+
+TracepointSession::BufferInfo::~BufferInfo()
 {
-    return TracepointInfoIterator(m_range.end());
+    return;
 }
 
-// TracepointSession
-
-TracepointSession::~TracepointSession()
+TracepointSession::BufferInfo::BufferInfo() noexcept
+    : Mmap()
+    , Size()
+    , OnlineSize()
+    , Data()
+    , DataPos()
+    , DataTail()
+    , DataHead64()
+    , Realtime()
+    , Standby()
+    , StandbyMmap()
+    , StandbyData()
+    , DrainedHead64()
+    , StandbyDrainedHead64()
+    , LostEventCount()
+    , CorruptBufferCount()
+    , LostRecordCount()
+    , WindowLostEventCount()
+    , WindowLostRange()
+    , EnumBeginNs()
+    , BytesDrained()
+    , Index()
+    , Indexing()
+    , ResizeMmap()
+    , ResizeRetiredOwner()
+    , ResizeSize()
+    , AdaptiveDrainCount()
+    , AdaptivePeakBytes()
+    , AdaptiveLostBase()
 {
     return;
 }
 
-TracepointSession::TracepointSession(
-    TracepointCache& cache,
-    TracepointSessionMode mode,
-    uint32_t perCpuBufferSize) noexcept(false)
-    : TracepointSession(cache, TracepointSessionOptions(mode, perCpuBufferSize))
+// TracepointBookmark
+
+TracepointSession::TracepointBookmark::TracepointBookmark(
+    uint64_t timestamp,
+    uint16_t recordSize,
+    uint32_t recordBufferPos) noexcept
+    : Timestamp(timestamp)
+    , RecordBufferPos(recordBufferPos)
+    , RecordSize(recordSize)
 {
     return;
 }
 
-TracepointSession::TracepointSession(
+// FlushWorker
+
+struct TracepointSession::FlushWorker
+{
+    std::vector<uint8_t> Chunk; // Staged event data. Capacity is reused.
+    std::vector<uint32_t> Buffers; // Indexes of the buffers this worker drains.
+    std::vector<uint32_t> AffinityCpus; // If not empty, the worker's thread runs on these CPUs.
+    TracepointTimestampRange WrittenRange;
+    uint64_t SampleEventCount = 0;
+    uint64_t CorruptEventCount = 0;
+    int Error = 0;
+};
+
+// FlushWorkerPool
+
+/*
+Worker threads for FlushToWriter when DrainThreadCount > 1. Worker 0 runs on
+the thread that calls Run(). Workers 1..N-1 each have a dedicated thread that
+sleeps until Run() starts a new generation.
+
+With DrainNumaAffinity, the buffers are grouped by NUMA node, every worker has
+a dedicated thread bound to its node's CPUs, and Run() only waits.
+*/
+class TracepointSession::FlushWorkerPool
+{
+    TracepointSession& m_session;
+    uint32_t const m_workerCount;
+    std::unique_ptr<FlushWorker[]> const m_workers;
+    uint32_t const m_firstThreadWorker; // 0 if all workers have threads, else 1.
+    std::mutex m_mutex;
+    std::condition_variable m_startCond;
+    std::condition_variable m_doneCond;
+    uint64_t m_generation = 0;
+    uint32_t m_pendingCount = 0;
+    bool m_exiting = false;
+    TracepointTimestampRange m_filterRange;
+    uint64_t m_filterSlackNs = UINT64_MAX;
+    std::vector<std::thread> m_threads;
+
+public:
+
+    FlushWorkerPool(FlushWorkerPool const&) = delete;
+    void operator=(FlushWorkerPool const&) = delete;
+
+    ~FlushWorkerPool()
+    {
+        Stop();
+    }
+
+    // May throw bad_alloc or system_error.
+    FlushWorkerPool(TracepointSession& session, uint32_t threadCount) noexcept(false)
+        : m_session(session)
+        , m_workerCount(CountWorkers(session, threadCount))
+        , m_workers(std::make_unique<FlushWorker[]>(m_workerCount)) // may throw bad_alloc.
+        , m_firstThreadWorker(session.m_drainCpuNodes.empty() ? 1u : 0u)
+    {
+        assert(threadCount > 0);
+        assert(threadCount <= session.m_bufferCount);
+
+        auto const bufferCount = session.m_bufferCount;
+        auto const& cpuNodes = session.m_drainCpuNodes;
+        if (cpuNodes.empty())
+        {
+            for (uint32_t i = 0; i != m_workerCount; i += 1)
+            {
+                auto const begin = static_cast<uint32_t>(uint64_t(bufferCount) * i / m_workerCount);
+                auto const end = static_cast<uint32_t>(uint64_t(bufferCount) * (i + 1) / m_workerCount);
+                for (uint32_t bufferIndex = begin; bufferIndex != end; bufferIndex += 1)
+                {
+                    m_workers[i].Buffers.push_back(bufferIndex);
+                }
+            }
+        }
+        else
+        {
+            // Each node gets workersPerNode consecutive workers. Each worker gets a
+            // share of the node's buffers and runs on the node's CPUs.
+            auto const nodes = SortedNodes(cpuNodes);
+            auto const workersPerNode = m_workerCount / static_cast<uint32_t>(nodes.size());
+            std::vector<uint32_t> nodeBuffers;
+            for (uint32_t nodePos = 0; nodePos != nodes.size(); nodePos += 1)
+            {
+                nodeBuffers.clear();
+                for (uint32_t bufferIndex = 0; bufferIndex != bufferCount; bufferIndex += 1)
+                {
+                    if (cpuNodes[bufferIndex % session.m_groupBufferCount] == nodes[nodePos])
+                    {
+                        nodeBuffers.push_back(bufferIndex);
+                    }
+                }
+
+                auto const nodeWorkers = m_workers.get() + nodePos * workersPerNode;
+                for (uint32_t i = 0; i != nodeBuffers.size(); i += 1)
+                {
+                    nodeWorkers[uint64_t(i) * workersPerNode / nodeBuffers.size()].Buffers.push_back(nodeBuffers[i]);
+                }
+
+                for (uint32_t i = 0; i != workersPerNode; i += 1)
+                {
+                    for (uint32_t cpu = 0; cpu != cpuNodes.size(); cpu += 1)
+                    {
+                        if (cpuNodes[cpu] == nodes[nodePos])
+                        {
+                            nodeWorkers[i].AffinityCpus.push_back(cpu);
+                        }
+                    }
+                }
+            }
+        }
+
+        try
+        {
+            m_threads.reserve(m_workerCount - m_firstThreadWorker);
+            for (uint32_t i = m_firstThreadWorker; i != m_workerCount; i += 1)
+            {
+                m_threads.emplace_back(&FlushWorkerPool::ThreadProc, this, i);
+            }
+        }
+        catch (...)
+        {
+            Stop();
+            throw;
+        }
+    }
+
+    uint32_t
+    WorkerCount() const noexcept
+    {
+        return m_workerCount;
+    }
+
+    FlushWorker&
+    Worker(uint32_t index) const noexcept
+    {
+        assert(index < m_workerCount);
+        return m_workers[index];
+    }
+
+    // Drains all buffers, returning after all workers have finished.
+    void
+    Run(TracepointTimestampRange filterRange, uint64_t filterSlackNs) noexcept
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_filterRange = filterRange;
+            m_filterSlackNs = filterSlackNs;
+            m_pendingCount = m_workerCount - m_firstThreadWorker;
+            m_generation += 1;
+        }
+        m_startCond.notify_all();
+
+        if (m_firstThreadWorker != 0)
+        {
+            m_session.FlushBuffersToChunk(m_workers[0], filterRange, filterSlackNs);
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_doneCond.wait(lock, [this]() { return m_pendingCount == 0; });
+    }
+
+private:
+
+    // Returns the sorted list of distinct node numbers in cpuNodes.
+    static std::vector<uint32_t>
+    SortedNodes(std::vector<uint32_t> const& cpuNodes) noexcept(false)
+    {
+        std::vector<uint32_t> nodes(cpuNodes); // may throw bad_alloc.
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        return nodes;
+    }
+
+    static uint32_t
+    CountWorkers(TracepointSession const& session, uint32_t threadCount) noexcept(false)
+    {
+        if (session.m_drainCpuNodes.empty())
+        {
+            return threadCount;
+        }
+
+        auto const nodeCount = static_cast<uint32_t>(SortedNodes(session.m_drainCpuNodes).size());
+        auto const workersPerNode = threadCount > nodeCount ? threadCount / nodeCount : 1u;
+        return nodeCount * workersPerNode;
+    }
+
+    // Binds the calling thread to the specified CPUs. Failure is not an error
+    // (the worker still works, just without the affinity).
+    static void
+    SetThreadAffinity(std::vector<uint32_t> const& cpus) noexcept
+    {
+        auto const cpuCount = cpus.back() + 1;
+        auto const cpuSet = CPU_ALLOC(cpuCount);
+        if (cpuSet != nullptr)
+        {
+            auto const cpuSetSize = CPU_ALLOC_SIZE(cpuCount);
+            CPU_ZERO_S(cpuSetSize, cpuSet);
+            for (auto const cpu : cpus)
+            {
+                CPU_SET_S(cpu, cpuSetSize, cpuSet);
+            }
+
+            auto const error = pthread_setaffinity_np(pthread_self(), cpuSetSize, cpuSet);
+            if (error != 0)
+            {
+                DEBUG_PRINTF("drain thread affinity error %u\n", error);
+            }
+
+            CPU_FREE(cpuSet);
+        }
+    }
+
+    void
+    Stop() noexcept
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exiting = true;
+        }
+        m_startCond.notify_all();
+
+        for (auto& thread : m_threads)
+        {
+            thread.join();
+        }
+
+        m_threads.clear();
+    }
+
+    void
+    ThreadProc(uint32_t workerIndex) noexcept
+    {
+        if (!m_workers[workerIndex].AffinityCpus.empty())
+        {
+            SetThreadAffinity(m_workers[workerIndex].AffinityCpus);
+        }
+
+        uint64_t generation = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_startCond.wait(lock, [this, generation]() { return m_exiting || m_generation != generation; });
+            if (m_exiting)
+            {
+                break;
+            }
+
+            generation = m_generation;
+            auto const filterRange = m_filterRange;
+            auto const filterSlackNs = m_filterSlackNs;
+
+            lock.unlock();
+            m_session.FlushBuffersToChunk(m_workers[workerIndex], filterRange, filterSlackNs);
+            lock.lock();
+
+            m_pendingCount -= 1;
+            if (m_pendingCount == 0)
+            {
+                m_doneCond.notify_one();
+            }
+        }
+    }
+};
+
+// UnorderedEnumerator
+
+TracepointSession::UnorderedEnumerator::~UnorderedEnumerator()
+{
+    m_session.EnumeratorEnd(m_bufferIndex);
+}
+
+TracepointSession::UnorderedEnumerator::UnorderedEnumerator(
+    TracepointSession& session,
+    uint32_t bufferIndex) noexcept
+    : m_session(session)
+    , m_bufferIndex(bufferIndex)
+{
+    m_session.EnumeratorBegin(bufferIndex);
+}
+
+bool
+TracepointSession::UnorderedEnumerator::MoveNext() noexcept
+{
+    auto& session = m_session;
+    return session.EnumeratorMoveNext(
+        m_bufferIndex,
+        [&session](
+            BufferInfo const& buffer,
+            uint16_t recordSize,
+            uint32_t recordBufferPos)
+        {
+            auto const headerType = BufferDataPosToHeader(buffer.Data, recordBufferPos)->type;
+            return headerType == PERF_RECORD_SAMPLE &&
+                session.ParseSample(buffer, recordSize, recordBufferPos);
+        });
+}
+
+// TracepointRun
+
+TracepointSession::TracepointRun::TracepointRun(uint32_t bufferIndex) noexcept
+    : Timestamp()
+    , Pos()
+    , EndPos()
+    , BufferIndex(bufferIndex)
+    , PendingCount()
+{
+    return;
+}
+
+//  OrderedEnumerator
+
+TracepointSession::OrderedEnumerator::~OrderedEnumerator()
+{
+    if (m_needsCleanup)
+    {
+        for (unsigned bufferIndex = 0; bufferIndex != m_session.m_bufferCount; bufferIndex += 1)
+        {
+            if (m_session.m_buffers[bufferIndex].Size != 0)
+            {
+                m_session.EnumeratorEnd(bufferIndex);
+            }
+        }
+    }
+}
+
+TracepointSession::OrderedEnumerator::OrderedEnumerator(TracepointSession& session) noexcept
+    : m_session(session)
+    , m_needsCleanup(false)
+    , m_bytesBeforeTime(SampleBytesBeforeTime(session.m_sampleType))
+{
+    return;
+}
+
+_Success_(return == 0) int
+TracepointSession::OrderedEnumerator::LoadAndSort() noexcept
+{
+    int error;
+    auto& session = m_session;
+
+    if (0 == (session.m_sampleType & PERF_SAMPLE_TIME))
+    {
+        error = EPERM;
+    }
+    else try
+    {
+        auto const bytesBeforeTime = m_bytesBeforeTime;
+
+        for (uint32_t bufferIndex = 0; bufferIndex != session.m_bufferCount; bufferIndex += 1)
+        {
+            if (session.m_buffers[bufferIndex].Size != 0)
+            {
+                session.EnumeratorBegin(bufferIndex);
+            }
+        }
+
+        // Circular: If we throw an exception, we need to unpause during cleanup.
+        // Realtime: If we throw an exception, we don't update tail pointers during
+        // cleanup (the catch block resets DataPos so EnumeratorEnd does nothing).
+        m_needsCleanup = true;
+
+        auto& runs = session.m_enumeratorRuns;
+        auto& heap = session.m_enumeratorHeap;
+        auto& bookmarks = session.m_enumeratorBookmarks;
+        runs.clear();
+        heap.clear();
+        bookmarks.clear();
+
+        for (uint32_t bufferIndex = 0; bufferIndex != session.m_bufferCount; bufferIndex += 1)
+        {
+            auto const& buffer = session.m_buffers[bufferIndex];
+            if (buffer.Size == 0)
+            {
+                continue;
+            }
+
+            if (buffer.Realtime)
+            {
+                // Realtime: oldest-to-newest. Read just enough to fill the window.
+                runs.emplace_back(bufferIndex); // May throw bad_alloc.
+                auto& run = runs.back();
+                FillRun(run);
+                if (run.PendingCount == 0)
+                {
+                    runs.pop_back();
+                }
+                else
+                {
+                    run.Timestamp = run.Pending[0].Timestamp;
+                }
+
+                continue;
+            }
+
+            // Circular: newest-to-oldest, so bookmark every record.
+            auto const startSize = bookmarks.size();
+
+            // Only need to call EnumeratorMoveNext once per buffer - it will loop until a callback
+            // returns true or it reaches end of buffer, and our callback never returns true.
+            session.EnumeratorMoveNext(
+                bufferIndex,
+                [bytesBeforeTime, &session, &bookmarks](
+                    BufferInfo const& buffer,
+                    uint16_t recordSize,
+                    uint32_t recordBufferPos)
+                {
+                    assert(0 == (recordSize & 7));
+                    assert(0 == (recordBufferPos & 7));
+
+                    if (PERF_RECORD_SAMPLE != BufferDataPosToHeader(buffer.Data, recordBufferPos)->type)
+                    {
+                        return false; // Keep going.
+                    }
+
+                    if (recordSize <= bytesBeforeTime)
+                    {
+                        session.m_corruptEventCount += 1;
+                        return false;
+                    }
+
+                    auto const timePos = (recordBufferPos + bytesBeforeTime) & (buffer.Size - 1);
+                    bookmarks.emplace_back( // May throw bad_alloc.
+                        *reinterpret_cast<uint64_t const*>(buffer.Data + timePos),
+                        recordSize,
+                        recordBufferPos);
+                    return false; // Keep going.
+                });
+
+            auto const endSize = bookmarks.size();
+            if (startSize == endSize)
+            {
+                continue;
+            }
+
+            // Put the buffer's bookmarks in timestamp order. They are usually
+            // already in order once reversed, so check before sorting.
+            auto const bookmarksData = bookmarks.data();
+            std::reverse(bookmarksData + startSize, bookmarksData + endSize);
+            auto const timestampLess = [](TracepointBookmark const& a, TracepointBookmark const& b)
+                {
+                    return a.Timestamp < b.Timestamp;
+                };
+            if (!std::is_sorted(bookmarksData + startSize, bookmarksData + endSize, timestampLess))
+            {
+                std::stable_sort(bookmarksData + startSize, bookmarksData + endSize, timestampLess); // May throw bad_alloc.
+            }
+
+            runs.emplace_back(bufferIndex); // May throw bad_alloc.
+            auto& run = runs.back();
+            run.Timestamp = bookmarksData[startSize].Timestamp;
+            run.Pos = startSize;
+            run.EndPos = endSize;
+        }
+
+        // Runs are in buffer order, so the run index breaks timestamp ties.
+        heap.reserve(runs.size()); // May throw bad_alloc.
+        for (uint32_t i = 0; i != runs.size(); i += 1)
+        {
+            heap.push_back(i);
+        }
+
+        auto const runsData = runs.data();
+        std::make_heap(heap.begin(), heap.end(),
+            [runsData](uint32_t a, uint32_t b) { return RunGreater(runsData, a, b); });
+
+        error = 0;
+    }
+    catch (...)
+    {
+        if (m_needsCleanup)
+        {
+            for (uint32_t bufferIndex = 0; bufferIndex != session.m_bufferCount; bufferIndex += 1)
+            {
+                auto& buffer = session.m_buffers[bufferIndex];
+                if (buffer.Size != 0 && buffer.Realtime)
+                {
+                    buffer.DataPos = buffer.DataTail;
+                }
+            }
+        }
+
+        session.m_enumeratorRuns.clear();
+        session.m_enumeratorHeap.clear();
+        error = ENOMEM;
+    }
+
+    return error;
+}
+
+bool
+TracepointSession::OrderedEnumerator::MoveNext() noexcept
+{
+    auto& session = m_session;
+    auto const buffers = session.m_buffers.get();
+    auto const runsData = session.m_enumeratorRuns.data();
+    auto const runGreater = [runsData](uint32_t a, uint32_t b) { return RunGreater(runsData, a, b); };
+    auto& heap = session.m_enumeratorHeap;
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), runGreater);
+        auto& run = runsData[heap.back()];
+        auto const& buffer = buffers[run.BufferIndex];
+        auto const& next = buffer.Realtime
+            ? run.Pending[0]
+            : session.m_enumeratorBookmarks[run.Pos];
+
+        bool const parsed = session.ParseSample(
+            buffer,
+            next.RecordSize,
+            next.RecordBufferPos);
+
+        // The run's new position (if any) does not affect m_enumEventInfo.
+        if (AdvanceRun(run))
+        {
+            std::push_heap(heap.begin(), heap.end(), runGreater);
+        }
+        else
+        {
+            heap.pop_back(); // Does not free memory. Will not throw.
+        }
+
+        if (parsed)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Comparator for std::push_heap/pop_heap: makes m_enumeratorHeap a min-heap
+// ordered by (Timestamp, run index). Runs are in buffer order, so ties are
+// returned in buffer order.
+bool
+TracepointSession::OrderedEnumerator::RunGreater(
+    TracepointRun const* runs,
+    uint32_t a,
+    uint32_t b) noexcept
+{
+    return runs[a].Timestamp > runs[b].Timestamp ||
+        (runs[a].Timestamp == runs[b].Timestamp && a > b);
+}
+
+void
+TracepointSession::OrderedEnumerator::FillRun(TracepointRun& run) noexcept
+{
+    auto& session = m_session;
+    auto const bytesBeforeTime = m_bytesBeforeTime;
+
+    // EnumeratorMoveNext returns true after the callback returns true (one
+    // SAMPLE record read), false at the end of the buffer.
+    while (run.PendingCount != TracepointRun::WindowSize &&
+        session.EnumeratorMoveNext(
+            run.BufferIndex,
+            [bytesBeforeTime, &session, &run](
+                BufferInfo const& buffer,
+                uint16_t recordSize,
+                uint32_t recordBufferPos) noexcept
+            {
+                assert(0 == (recordSize & 7));
+                assert(0 == (recordBufferPos & 7));
+
+                if (PERF_RECORD_SAMPLE != BufferDataPosToHeader(buffer.Data, recordBufferPos)->type)
+                {
+                    return false; // Keep going.
+                }
+
+                if (recordSize <= bytesBeforeTime)
+                {
+                    session.m_corruptEventCount += 1;
+                    return false;
+                }
+
+                auto const timePos = (recordBufferPos + bytesBeforeTime) & (buffer.Size - 1);
+                auto const timestamp = *reinterpret_cast<uint64_t const*>(buffer.Data + timePos);
+
+                // Insert after any pending records with the same timestamp so
+                // that ties stay in buffer order.
+                auto i = run.PendingCount;
+                for (; i != 0 && run.Pending[i - 1].Timestamp > timestamp; i -= 1)
+                {
+                    run.Pending[i] = run.Pending[i - 1];
+                }
+
+                run.Pending[i] = TracepointBookmark(timestamp, recordSize, recordBufferPos);
+                run.PendingCount += 1;
+                return true; // Stop.
+            }))
+    {
+        // Keep filling.
+    }
+}
+
+bool
+TracepointSession::OrderedEnumerator::AdvanceRun(TracepointRun& run) noexcept
+{
+    auto& session = m_session;
+
+    if (!session.m_buffers[run.BufferIndex].Realtime)
+    {
+        run.Pos += 1;
+        if (run.Pos == run.EndPos)
+        {
+            return false;
+        }
+
+        run.Timestamp = session.m_enumeratorBookmarks[run.Pos].Timestamp;
+        return true;
+    }
+
+    // Realtime: drop the returned record and read the next one.
+    assert(run.PendingCount != 0);
+    run.PendingCount -= 1;
+    memmove(run.Pending, run.Pending + 1, run.PendingCount * sizeof(run.Pending[0]));
+    FillRun(run);
+    if (run.PendingCount == 0)
+    {
+        return false;
+    }
+
+    run.Timestamp = run.Pending[0].Timestamp;
+    return true;
+}
+
+// TracepointInfoIterator
+
+TracepointInfoIterator::TracepointInfoIterator(InnerItTy it) noexcept
+    : m_it(it)
+{
+    return;
+}
+
+TracepointInfoIterator::TracepointInfoIterator() noexcept
+    : m_it()
+{
+    return;
+}
+
+TracepointInfoIterator&
+TracepointInfoIterator::operator++() noexcept
+{
+    ++m_it;
+    return *this;
+}
+
+TracepointInfoIterator
+TracepointInfoIterator::operator++(int) noexcept
+{
+    TracepointInfoIterator old(m_it);
+    ++m_it;
+    return old;
+}
+
+TracepointInfoIterator::pointer
+TracepointInfoIterator::operator->() const noexcept
+{
+    return &m_it->second;
+}
+
+TracepointInfoIterator::reference
+TracepointInfoIterator::operator*() const noexcept
+{
+    return m_it->second;
+}
+
+bool
+TracepointInfoIterator::operator==(TracepointInfoIterator other) const noexcept
+{
+    return m_it == other.m_it;
+}
+
+bool
+TracepointInfoIterator::operator!=(TracepointInfoIterator other) const noexcept
+{
+    return m_it != other.m_it;
+}
+
+// TracepointInfoRange
+
+TracepointInfoRange::TracepointInfoRange(RangeTy const& range) noexcept
+    : m_range(range)
+{
+    return;
+}
+
+TracepointInfoIterator
+TracepointInfoRange::begin() const noexcept
+{
+    return TracepointInfoIterator(m_range.begin());
+}
+
+TracepointInfoIterator
+TracepointInfoRange::end() const noexcept
+{
+    return TracepointInfoIterator(m_range.end());
+}
+
+// TracepointSession
+
+TracepointSession::~TracepointSession()
+{
+    return;
+}
+
+TracepointSession::TracepointSession(
+    TracepointCache& cache,
+    TracepointSessionMode mode,
+    uint32_t perCpuBufferSize) noexcept(false)
+    : TracepointSession(cache, TracepointSessionOptions(mode, perCpuBufferSize))
+{
+    return;
+}
+
+TracepointSession::TracepointSession(
     TracepointCache& cache,
     TracepointSessionOptions const& options) noexcept(false)
     : m_sessionInfo(MakeSessionInfo(CLOCK_MONOTONIC_RAW))
@@ -639,1315 +1590,4129 @@ TracepointSession::TracepointSession(
     , m_wakeupUseWatermark(options.m_wakeupUseWatermark)
     , m_wakeupValue(options.m_wakeupValue)
     , m_sampleType(options.m_sampleType)
-    , m_bufferCount(CalculateBufferCount(options))
+    , m_callchainMaxStack(options.m_callchainMaxStack)
+    , m_callchainExcludeKernel(options.m_callchainExcludeKernel)
+    , m_callchainExcludeUser(options.m_callchainExcludeUser)
+    , m_parseSample(SelectParseSample(options.m_sampleType))
+    , m_groupBufferCount(CalculateBufferCount(options))
+    , m_bufferGroupCount(1 + options.m_bufferGroupsCount)
+    , m_bufferCount(m_groupBufferCount * m_bufferGroupCount)
     , m_pageSize(sysconf(_SC_PAGESIZE))
-    , m_buffers(MakeBufferInfos(m_bufferCount, m_pageSize, options)) // may throw bad_alloc.
+    , m_drainThreadCount(options.m_drainThreadCount)
+    , m_drainCpuNodes(options.m_drainNumaAffinity ? ReadCpuNumaNodes(m_groupBufferCount) : std::vector<uint32_t>()) // may throw bad_alloc.
+    , m_circularGroupCount(CountCircularBufferGroups(options))
+    , m_standbyBuffers(options.m_circularStandbyBuffer && m_circularGroupCount != 0)
+    , m_adaptiveMinSize(AdaptiveMinBufferSize(m_pageSize, options))
+    , m_adaptiveMaxSize(m_circularGroupCount != m_bufferGroupCount ? AdaptiveMaxBufferSize(m_pageSize, options) : 0u)
+    , m_adaptiveBudget(options.m_adaptiveBufferBudget)
+    , m_targetCgroup(options.m_targetCgroupFile >= 0)
+    , m_targetCgroupFile(m_targetCgroup ? fcntl(options.m_targetCgroupFile, F_DUPFD_CLOEXEC, 0) : -1)
+    , m_targetPid(m_targetCgroup ? -1 : options.m_targetPid)
+    , m_targetInherit(m_targetPid >= 0 && options.m_targetInherit)
+    , m_targetSingleBuffer(m_targetPid >= 0 && !options.m_targetInherit)
+    , m_cpuHotplug(options.m_cpuHotplug && !m_targetSingleBuffer)
+    , m_buffers(MakeBufferInfos(m_groupBufferCount, m_pageSize, options)) // may throw bad_alloc.
     , m_tracepointInfoByCommonType() // may throw bad_alloc (but probably doesn't).
     , m_tracepointInfoBySampleId() // may throw bad_alloc (but probably doesn't).
+    , m_tracepointInfoByCommonTypeIndex()
+    , m_tracepointInfoBySampleIdIndex()
+    , m_lastSampleIdTpi()
+    , m_lastSampleId()
     , m_bufferLeaderFiles(nullptr)
+    , m_bufferOwnerFiles()
+    , m_adaptiveBufferBytes(0)
+    , m_rateLimitCount(0)
+    , m_sliceBufferIndex(0)
+    , m_onlineCpus(m_cpuHotplug ? ReadOnlineCpus(m_groupBufferCount) : std::vector<bool>()) // may throw bad_alloc.
+    , m_triggerTpi()
+    , m_triggerPreNs(0)
+    , m_triggerPostNs(0)
+    , m_triggerNextCpu(0)
+    , m_triggerFiles()
+    , m_triggerMmaps()
     , m_sampleEventCount(0)
     , m_lostEventCount(0)
     , m_corruptEventCount(0)
-    , m_corruptBufferCount(0)
-    , m_eventDataBuffer()
+    , m_bufferResizeCount(0)
+    , m_metrics(options.m_metrics ? std::make_unique<TracepointSessionMetrics>() : nullptr) // may throw bad_alloc.
+    , m_eventDataBuffers(std::make_unique<std::vector<uint8_t>[]>(m_bufferCount)) // may throw bad_alloc.
     , m_enumeratorBookmarks()
+    , m_enumeratorRuns()
+    , m_enumeratorHeap()
     , m_pollfd(nullptr)
+    , m_epollFile()
+    , m_epollEvents(nullptr)
+    , m_readyBufferIndexes(nullptr)
+    , m_flushWorkerPool(nullptr)
+    , m_enumEventBatch()
+    , m_enumEventBatchSize(0)
+    , m_parsedSampleTypes(UINT32_MAX)
     , m_enumEventInfo()
+    , m_enumEventDropped(false)
+    , m_triggerEventInfo()
+    , m_triggerEventData()
+    , m_triggerPollfd()
+{
+    assert(options.m_mode <= TracepointSessionMode::RealTime);
+    assert(m_bufferGroupCount > 0 && m_bufferGroupCount <= 0x10000);
+    assert(m_bufferCount > 0 && m_bufferCount <= 0x10000);
+    assert(m_pageSize >= sizeof(perf_event_mmap_page) && m_pageSize < 0x10000000);
+    assert((m_pageSize & (m_pageSize - 1)) == 0); // power of 2
+
+    if (m_cpuHotplug)
+    {
+        if (m_onlineCpus.empty())
+        {
+            m_onlineCpus.assign(m_groupBufferCount, true); // may throw bad_alloc.
+        }
+
+        // Only online CPUs get buffers. UpdateOnlineCpus adds the others.
+        for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+        {
+            if (!m_onlineCpus[bufferIndex % m_groupBufferCount])
+            {
+                m_buffers[bufferIndex].Size = 0;
+            }
+        }
+    }
+}
+
+TracepointCache&
+TracepointSession::Cache() const noexcept
+{
+    return m_cache;
+}
+
+TracepointSessionMode
+TracepointSession::Mode() const noexcept
+{
+    return m_mode;
+}
+
+PerfEventSessionInfo const&
+TracepointSession::SessionInfo() const noexcept
+{
+    return m_sessionInfo;
+}
+
+bool
+TracepointSession::IsRealtime() const noexcept
+{
+    return m_mode != TracepointSessionMode::Circular;
+}
+
+uint32_t
+TracepointSession::BufferSize(unsigned bufferIndex) const noexcept
+{
+    assert(bufferIndex < BufferCount());
+    return m_buffers[bufferIndex].Size;
+}
+
+uint64_t
+TracepointSession::TotalBufferSize() const noexcept
+{
+    uint64_t total = 0;
+    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    {
+        total += m_buffers[bufferIndex].Size;
+    }
+
+    return total;
+}
+
+uint64_t
+TracepointSession::BufferResizeCount() const noexcept
+{
+    return __atomic_load_n(&m_bufferResizeCount, __ATOMIC_RELAXED);
+}
+
+uint32_t
+TracepointSession::BufferCount() const noexcept
+{
+    return m_bufferCount;
+}
+
+_Success_(return == 0) int
+TracepointSession::UpdateOnlineCpus() noexcept
+{
+    int error = 0;
+
+    if (!m_cpuHotplug)
+    {
+        return ENOTSUP;
+    }
+
+    std::vector<bool> onlineCpus;
+    try
+    {
+        onlineCpus = ReadOnlineCpus(m_groupBufferCount);
+    }
+    catch (...)
+    {
+        return ENOMEM;
+    }
+
+    if (onlineCpus.empty())
+    {
+        return ENOENT;
+    }
+
+    for (uint32_t cpu = 0; cpu != m_groupBufferCount; cpu += 1)
+    {
+        if (onlineCpus[cpu] && !m_onlineCpus[cpu])
+        {
+            auto const cpuError = AddCpuBuffers(cpu);
+            if (error == 0)
+            {
+                error = cpuError;
+            }
+        }
+        else if (!onlineCpus[cpu] && m_onlineCpus[cpu])
+        {
+            if (RemoveCpuBuffers(cpu))
+            {
+                m_onlineCpus[cpu] = false;
+            }
+        }
+    }
+
+    return error;
+}
+
+uint32_t
+TracepointSession::BufferGroupCount() const noexcept
+{
+    return m_bufferGroupCount;
+}
+
+TracepointSessionMode
+TracepointSession::BufferGroupMode(uint32_t group) const noexcept
+{
+    assert(group < m_bufferGroupCount);
+    return m_buffers[group * m_groupBufferCount].Realtime
+        ? TracepointSessionMode::RealTime
+        : TracepointSessionMode::Circular;
+}
+
+uint64_t
+TracepointSession::SampleEventCount() const noexcept
+{
+    return m_sampleEventCount;
+}
+
+uint64_t
+TracepointSession::LostEventCount() const noexcept
+{
+    auto count = m_lostEventCount;
+    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    {
+        count += m_buffers[bufferIndex].LostEventCount;
+    }
+
+    return count;
+}
+
+uint64_t
+TracepointSession::CorruptEventCount() const noexcept
+{
+    return m_corruptEventCount;
+}
+
+uint64_t
+TracepointSession::CorruptBufferCount() const noexcept
+{
+    uint64_t count = 0;
+    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    {
+        count += m_buffers[bufferIndex].CorruptBufferCount;
+    }
+
+    return count;
+}
+
+bool
+TracepointSession::MetricsEnabled() const noexcept
+{
+    return m_metrics != nullptr;
+}
+
+void
+TracepointSession::GetMetrics(_Out_ TracepointSessionMetrics* metrics) const noexcept
+{
+    memset(metrics, 0, sizeof(*metrics));
+    if (m_metrics == nullptr)
+    {
+        return;
+    }
+
+    auto const copyHistogram = [](TracepointLatencyHistogram& dest, TracepointLatencyHistogram const& src) noexcept
+        {
+            dest.Count = __atomic_load_n(&src.Count, __ATOMIC_RELAXED);
+            dest.TotalNs = __atomic_load_n(&src.TotalNs, __ATOMIC_RELAXED);
+            dest.MaxNs = __atomic_load_n(&src.MaxNs, __ATOMIC_RELAXED);
+            for (unsigned i = 0; i != TracepointLatencyHistogram::BucketCount; i += 1)
+            {
+                dest.Buckets[i] = __atomic_load_n(&src.Buckets[i], __ATOMIC_RELAXED);
+            }
+        };
+
+    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    {
+        metrics->BytesDrained += __atomic_load_n(&m_buffers[bufferIndex].BytesDrained, __ATOMIC_RELAXED);
+    }
+
+    metrics->WriterBytes = __atomic_load_n(&m_metrics->WriterBytes, __ATOMIC_RELAXED);
+    copyHistogram(metrics->FlushNs, m_metrics->FlushNs);
+    copyHistogram(metrics->BufferHoldNs, m_metrics->BufferHoldNs);
+    copyHistogram(metrics->WriterWriteNs, m_metrics->WriterWriteNs);
+}
+
+uint64_t
+TracepointSession::BufferBytesDrained(unsigned bufferIndex) const noexcept
+{
+    assert(bufferIndex < m_bufferCount);
+    return __atomic_load_n(&m_buffers[bufferIndex].BytesDrained, __ATOMIC_RELAXED);
+}
+
+void
+TracepointSession::GetBufferLostInfo(unsigned bufferIndex, _Out_ TracepointBufferLostInfo* info) const noexcept
+{
+    assert(bufferIndex < m_bufferCount);
+    auto const& buffer = m_buffers[bufferIndex];
+    info->LostEventCount = buffer.LostEventCount;
+    info->LostRecordCount = buffer.LostRecordCount;
+    info->WindowLostEventCount = buffer.WindowLostEventCount;
+    info->WindowRange = buffer.WindowLostRange;
+}
+
+void
+TracepointSession::ResetLostWindows() noexcept
+{
+    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    {
+        m_buffers[bufferIndex].WindowLostEventCount = 0;
+        m_buffers[bufferIndex].WindowLostRange = TracepointTimestampRange();
+    }
+}
+
+void
+TracepointSession::Clear() noexcept
+{
+    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    {
+        m_buffers[bufferIndex].Mmap.reset();
+        m_buffers[bufferIndex].Data = nullptr;
+        m_buffers[bufferIndex].StandbyMmap.reset();
+        m_buffers[bufferIndex].StandbyData = nullptr;
+        m_buffers[bufferIndex].DrainedHead64 = 0;
+        m_buffers[bufferIndex].StandbyDrainedHead64 = 0;
+        m_buffers[bufferIndex].LostEventCount = 0;
+        m_buffers[bufferIndex].CorruptBufferCount = 0;
+        m_buffers[bufferIndex].LostRecordCount = 0;
+        m_buffers[bufferIndex].WindowLostEventCount = 0;
+        m_buffers[bufferIndex].WindowLostRange = TracepointTimestampRange();
+        m_buffers[bufferIndex].ResizeMmap.reset();
+        m_buffers[bufferIndex].ResizeRetiredOwner.reset();
+        m_buffers[bufferIndex].AdaptiveDrainCount = 0;
+        m_buffers[bufferIndex].AdaptivePeakBytes = 0;
+        m_buffers[bufferIndex].AdaptiveLostBase = 0;
+    }
+
+    m_tracepointInfoByCommonType.clear();
+    m_tracepointInfoBySampleId.clear();
+    m_tracepointInfoByCommonTypeIndex.clear();
+    m_tracepointInfoBySampleIdIndex.clear();
+    m_lastSampleIdTpi = nullptr;
+    m_lastSampleId = 0;
+    m_bufferLeaderFiles = nullptr;
+    m_bufferOwnerFiles.reset();
+    m_rateLimitCount = 0;
+    m_sliceBufferIndex = 0;
+    m_epollFile.reset(); // Registered files are closed, so we need a new epoll.
+
+    m_sampleEventCount = 0;
+    m_lostEventCount = 0;
+    m_corruptEventCount = 0;
+}
+
+_Success_(return == 0) int
+TracepointSession::DisableTracepoint(unsigned id) noexcept
+{
+    auto const metadata = m_cache.FindById(id);
+    auto const error = metadata == nullptr
+        ? ENOENT
+        : DisableTracepointImpl(*metadata);
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::DisableTracepoint(TracepointName name) noexcept
+{
+    int error;
+
+    PerfEventMetadata const* metadata;
+    error = m_cache.FindOrAddFromSystem(name, &metadata);
+    if (error == 0)
+    {
+        error = DisableTracepointImpl(*metadata);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::EnableTracepoint(unsigned id) noexcept
+{
+    auto const metadata = m_cache.FindById(id);
+    auto const error = metadata == nullptr
+        ? ENOENT
+        : EnableTracepointImpl(*metadata);
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::EnableTracepoint(TracepointName name) noexcept
+{
+    int error;
+
+    PerfEventMetadata const* metadata;
+    error = m_cache.FindOrAddFromSystem(name, &metadata);
+    if (error == 0)
+    {
+        error = EnableTracepointImpl(*metadata);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointFilter(unsigned id, _In_z_ char const* filter) noexcept
+{
+    auto const metadata = m_cache.FindById(id);
+    auto const error = metadata == nullptr
+        ? ENOENT
+        : IoctlTracepointImpl(*metadata, PERF_EVENT_IOC_SET_FILTER, reinterpret_cast<uintptr_t>(filter));
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointFilter(TracepointName name, _In_z_ char const* filter) noexcept
+{
+    int error;
+
+    PerfEventMetadata const* metadata;
+    error = m_cache.FindOrAddFromSystem(name, &metadata);
+    if (error == 0)
+    {
+        error = IoctlTracepointImpl(*metadata, PERF_EVENT_IOC_SET_FILTER, reinterpret_cast<uintptr_t>(filter));
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointBpfProgram(unsigned id, int bpfProgramFile) noexcept
+{
+    auto const metadata = m_cache.FindById(id);
+    auto const error = metadata == nullptr
+        ? ENOENT
+        : IoctlTracepointImpl(*metadata, PERF_EVENT_IOC_SET_BPF, static_cast<unsigned>(bpfProgramFile));
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointBpfProgram(TracepointName name, int bpfProgramFile) noexcept
+{
+    int error;
+
+    PerfEventMetadata const* metadata;
+    error = m_cache.FindOrAddFromSystem(name, &metadata);
+    if (error == 0)
+    {
+        error = IoctlTracepointImpl(*metadata, PERF_EVENT_IOC_SET_BPF, static_cast<unsigned>(bpfProgramFile));
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointSamplePeriod(unsigned id, uint64_t samplePeriod) noexcept
+{
+    auto const metadata = m_cache.FindById(id);
+    auto const error = metadata == nullptr
+        ? ENOENT
+        : samplePeriod == 0
+        ? EINVAL
+        : IoctlTracepointImpl(*metadata, PERF_EVENT_IOC_PERIOD, reinterpret_cast<uintptr_t>(&samplePeriod));
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointSamplePeriod(TracepointName name, uint64_t samplePeriod) noexcept
+{
+    int error;
+
+    PerfEventMetadata const* metadata;
+    if (samplePeriod == 0)
+    {
+        error = EINVAL;
+    }
+    else
+    {
+        error = m_cache.FindOrAddFromSystem(name, &metadata);
+        if (error == 0)
+        {
+            error = IoctlTracepointImpl(*metadata, PERF_EVENT_IOC_PERIOD, reinterpret_cast<uintptr_t>(&samplePeriod));
+        }
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointRateLimit(unsigned id, uint32_t eventsPerSecond, uint32_t burstSize) noexcept
+{
+    auto const metadata = m_cache.FindById(id);
+    auto const error = metadata == nullptr
+        ? ENOENT
+        : SetTracepointRateLimitImpl(*metadata, eventsPerSecond, burstSize);
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointRateLimit(TracepointName name, uint32_t eventsPerSecond, uint32_t burstSize) noexcept
+{
+    auto const metadata = m_cache.FindByName(name);
+    auto const error = metadata == nullptr
+        ? ENOENT
+        : SetTracepointRateLimitImpl(*metadata, eventsPerSecond, burstSize);
+
+    return error;
+}
+
+TracepointInfoRange
+TracepointSession::TracepointInfos() const noexcept
+{
+    return TracepointInfoRange(m_tracepointInfoByCommonType);
+}
+
+TracepointInfoIterator
+TracepointSession::TracepointInfosBegin() const noexcept
+{
+    return TracepointInfoIterator(m_tracepointInfoByCommonType.begin());
+}
+
+TracepointInfoIterator
+TracepointSession::TracepointInfosEnd() const noexcept
+{
+    return TracepointInfoIterator(m_tracepointInfoByCommonType.end());
+}
+
+TracepointInfoIterator
+TracepointSession::FindTracepointInfo(unsigned id) const noexcept
+{
+    return TracepointInfoIterator(m_tracepointInfoByCommonType.find(id));
+}
+
+TracepointInfoIterator
+TracepointSession::FindTracepointInfo(TracepointName name) const noexcept
+{
+    auto metadata = m_cache.FindByName(name);
+    return TracepointInfoIterator(metadata
+        ? m_tracepointInfoByCommonType.find(metadata->Id())
+        : m_tracepointInfoByCommonType.end());
+}
+
+_Success_(return == 0) int
+TracepointSession::WaitForWakeup(
+    timespec const* timeout,
+    sigset_t const* sigmask,
+    _Out_opt_ int* pActiveCount) noexcept
+{
+    int error;
+    int activeCount;
+
+    if (m_circularGroupCount == m_bufferGroupCount || m_bufferLeaderFiles == nullptr)
+    {
+        activeCount = 0;
+        error = EPERM;
+    }
+    else try
+    {
+        if (m_pollfd == nullptr)
+        {
+            m_pollfd = std::make_unique<pollfd[]>(m_bufferCount);
+        }
+
+        unsigned pollfdCount = 0;
+        for (unsigned i = 0; i != m_bufferCount; i += 1)
+        {
+            if (m_buffers[i].Size != 0 && m_buffers[i].Realtime)
+            {
+                m_pollfd[pollfdCount] = { m_bufferLeaderFiles[i].get(), POLLIN, 0 };
+                pollfdCount += 1;
+            }
+        }
+
+        activeCount = ppoll(m_pollfd.get(), pollfdCount, timeout, sigmask);
+        if (activeCount < 0)
+        {
+            activeCount = 0;
+            error = errno;
+        }
+        else
+        {
+            error = 0;
+        }
+    }
+    catch (...)
+    {
+        activeCount = 0;
+        error = ENOMEM;
+    }
+
+    if (pActiveCount)
+    {
+        *pActiveCount = activeCount;
+    }
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::GetBufferFiles(
+    _Out_writes_(BufferCount()) int* pBufferFiles) const noexcept
+{
+    int error;
+
+    if (m_bufferLeaderFiles == nullptr)
+    {
+        memset(pBufferFiles, 0, m_bufferCount * sizeof(pBufferFiles[0]));
+        error = EPERM;
+    }
+    else
+    {
+        for (unsigned i = 0; i != m_bufferCount; i += 1)
+        {
+            pBufferFiles[i] = m_bufferLeaderFiles[i].get();
+        }
+
+        error = 0;
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::WaitForReadyBuffers(
+    _Out_writes_(BufferCount()) uint32_t* readyBufferIndexes,
+    _Out_ uint32_t* pReadyCount,
+    timespec const* timeout,
+    sigset_t const* sigmask) noexcept
+{
+    int error;
+    uint32_t readyCount = 0;
+
+    if (m_circularGroupCount == m_bufferGroupCount || m_bufferLeaderFiles == nullptr)
+    {
+        error = EPERM;
+    }
+    else try
+    {
+        if (m_epollEvents == nullptr)
+        {
+            m_epollEvents = std::make_unique<epoll_event[]>(m_bufferCount);
+        }
+
+        error = EnsureEpollFile();
+
+        if (error == 0)
+        {
+            int timeoutMs;
+            if (timeout == nullptr)
+            {
+                timeoutMs = -1;
+            }
+            else
+            {
+                // Round up so that a short timeout doesn't turn into a busy-wait.
+                auto const ms = static_cast<uint64_t>(timeout->tv_sec) * 1000u +
+                    (static_cast<uint64_t>(timeout->tv_nsec) + 999999u) / 1000000u;
+                timeoutMs = ms > INT32_MAX ? INT32_MAX : static_cast<int>(ms);
+            }
+
+            auto const activeCount = epoll_pwait(
+                m_epollFile.get(),
+                m_epollEvents.get(),
+                static_cast<int>(m_bufferCount),
+                timeoutMs,
+                sigmask);
+            if (activeCount < 0)
+            {
+                error = errno;
+            }
+            else
+            {
+                for (int i = 0; i != activeCount; i += 1)
+                {
+                    assert(m_epollEvents[i].data.u32 < m_bufferCount);
+                    readyBufferIndexes[readyCount] = m_epollEvents[i].data.u32;
+                    readyCount += 1;
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+    }
+
+    *pReadyCount = readyCount;
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::GetReadyFile(_Out_ int* pReadyFile) noexcept
+{
+    int error;
+
+    if (m_circularGroupCount == m_bufferGroupCount || m_bufferLeaderFiles == nullptr)
+    {
+        error = EPERM;
+    }
+    else
+    {
+        error = EnsureEpollFile();
+    }
+
+    *pReadyFile = error ? -1 : m_epollFile.get();
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::PollReadyBuffers(_Out_ uint32_t* pReadyCount) noexcept
+{
+    int error;
+
+    if (m_readyBufferIndexes == nullptr)
+    {
+        m_readyBufferIndexes.reset(new(std::nothrow) uint32_t[m_bufferCount]);
+    }
+
+    if (m_readyBufferIndexes == nullptr)
+    {
+        *pReadyCount = 0;
+        error = ENOMEM;
+    }
+    else
+    {
+        static constexpr timespec zeroTimeout = {};
+        error = WaitForReadyBuffers(m_readyBufferIndexes.get(), pReadyCount, &zeroTimeout);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::EnsureEpollFile() noexcept
+{
+    int error = 0;
+
+    if (!m_epollFile)
+    {
+        // Register each buffer's leader once. The kernel then tracks
+        // readiness, so each wait costs O(ready) instead of O(buffers).
+        unique_fd epollFile(epoll_create1(EPOLL_CLOEXEC));
+        if (!epollFile)
+        {
+            error = errno;
+        }
+        else
+        {
+            for (uint32_t i = 0; i != m_bufferCount; i += 1)
+            {
+                if (m_buffers[i].Size != 0 && m_buffers[i].Realtime)
+                {
+                    epoll_event ev = {};
+                    ev.events = EPOLLIN;
+                    ev.data.u32 = i;
+                    if (0 != epoll_ctl(epollFile.get(), EPOLL_CTL_ADD, m_bufferLeaderFiles[i].get(), &ev))
+                    {
+                        error = errno;
+                        break;
+                    }
+                }
+            }
+
+            if (error == 0)
+            {
+                m_epollFile = std::move(epollFile);
+            }
+        }
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SavePerfDataFile(
+    _In_z_ char const* perfDataFileName,
+    TracepointSavePerfDataFileOptions const& options) noexcept
+{
+    int error = 0;
+    PerfDataFileWriter writer;
+    TracepointTimestampRange writtenRange{}; // Start with an invalid range.
+    bool timesValid;
+
+    if (options.m_timestampWrittenRange)
+    {
+        *options.m_timestampWrittenRange = writtenRange;
+    }
+
+    error = writer.Create(perfDataFileName, options.m_openMode);
+    if (error != 0)
+    {
+        goto Done;
+    }
+
+    if (options.m_compressionLevel != 0)
+    {
+        error = writer.EnableCompression(options.m_compressionLevel);
+        if (error != 0)
+        {
+            goto Done;
+        }
+    }
+
+    // Mark the end of the "synthetic events" section (currently empty).
+
+    error = writer.WriteFinishedInit();
+    if (error != 0)
+    {
+        goto Done;
+    }
+
+    // Write event data:
+
+    error = FlushToWriterImpl(writer, &writtenRange, options.m_filterRange, options.m_filterSlackNs);
+    if (error != 0)
+    {
+        goto Done;
+    }
+
+    timesValid = (m_sampleType & PERF_SAMPLE_TIME) && writtenRange.First <= writtenRange.Last;
+
+    // Write system information headers:
+
+    error = SetWriterHeaders(writer, timesValid ? &writtenRange : nullptr);
+    if (error != 0)
+    {
+        goto Done;
+    }
+
+    // Flush to disk:
+
+    error = writer.FinalizeAndClose();
+    if (error != 0)
+    {
+        goto Done;
+    }
+
+    // Update output parameters:
+
+    if (timesValid && options.m_timestampWrittenRange)
+    {
+        *options.m_timestampWrittenRange = writtenRange;
+    }
+
+Done:
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SnapshotBuffers(TracepointSnapshot& snapshot) noexcept
+{
+    snapshot.Clear();
+
+    // Allocate everything before pausing any buffers.
+    size_t dataCapacity = 0;
+    uint32_t snapshotBufferCount = 0;
+    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    {
+        auto const& buffer = m_buffers[bufferIndex];
+        if (buffer.Size != 0 && !buffer.Realtime)
+        {
+            dataCapacity += buffer.Size;
+            snapshotBufferCount += 1;
+        }
+    }
+
+    if (snapshot.m_dataCapacity < dataCapacity)
+    {
+        snapshot.m_data.reset(new(std::nothrow) uint8_t[dataCapacity]);
+        snapshot.m_dataCapacity = snapshot.m_data ? dataCapacity : 0;
+        if (!snapshot.m_data)
+        {
+            return ENOMEM;
+        }
+    }
+
+    try
+    {
+        snapshot.m_buffers.reserve(snapshotBufferCount);
+        snapshot.m_eventDescs.reserve(m_tracepointInfoByCommonType.size());
+    }
+    catch (...)
+    {
+        return ENOMEM;
+    }
+
+    for (auto const& pair : m_tracepointInfoByCommonType)
+    {
+        snapshot.m_eventDescs.push_back(pair.second.m_eventDesc); // Will not throw.
+    }
+
+    snapshot.m_sessionInfo = m_sessionInfo;
+    snapshot.m_sampleType = m_sampleType;
+
+    if (m_bufferLeaderFiles == nullptr)
+    {
+        return 0; // No tracepoints, so no buffers.
+    }
+
+    // Pause one buffer at a time, only long enough to copy it.
+    size_t dataSize = 0;
+    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    {
+        auto& buffer = m_buffers[bufferIndex];
+        if (buffer.Size == 0 || buffer.Realtime)
+        {
+            continue;
+        }
+
+        EnumeratorBegin(bufferIndex);
+
+        auto const size = static_cast<size_t>(buffer.DataHead64) - buffer.DataPos;
+        assert(size <= buffer.Size);
+        auto const startPos = buffer.DataPos & (buffer.Size - 1);
+        auto const beforeWrap = std::min(size, buffer.Size - startPos);
+        auto const dest = snapshot.m_data.get() + dataSize;
+        memcpy(dest, buffer.Data + startPos, beforeWrap);
+        memcpy(dest + beforeWrap, buffer.Data, size - beforeWrap);
+        buffer.DataPos = static_cast<size_t>(buffer.DataHead64);
+
+        EnumeratorEnd(bufferIndex);
+
+        snapshot.m_buffers.push_back({ dataSize, size, bufferIndex }); // Will not throw.
+        dataSize += size;
+    }
+
+    snapshot.m_dataSize = dataSize;
+    return 0;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTrigger(
+    unsigned id,
+    uint64_t preTriggerNs,
+    uint64_t postTriggerNs) noexcept
+{
+    auto const metadata = m_cache.FindById(id);
+    auto const error = metadata == nullptr
+        ? ENOENT
+        : SetTriggerImpl(*metadata, preTriggerNs, postTriggerNs);
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTrigger(
+    TracepointName name,
+    uint64_t preTriggerNs,
+    uint64_t postTriggerNs) noexcept
+{
+    int error;
+
+    PerfEventMetadata const* metadata;
+    error = m_cache.FindOrAddFromSystem(name, &metadata);
+    if (error == 0)
+    {
+        error = SetTriggerImpl(*metadata, preTriggerNs, postTriggerNs);
+    }
+
+    return error;
+}
+
+void
+TracepointSession::ClearTrigger() noexcept
+{
+    m_triggerTpi = nullptr;
+    m_triggerMmaps.reset();
+    m_triggerFiles.reset();
+}
+
+_Success_(return == 0) int
+TracepointSession::WaitForTrigger(
+    TracepointSnapshot& snapshot,
+    _Out_opt_ TracepointTimestampRange* window,
+    timespec const* timeout,
+    sigset_t const* sigmask) noexcept
+{
+    return WaitForTrigger(
+        snapshot,
+        [](PerfSampleEventInfo const&) noexcept { return true; },
+        window,
+        timeout,
+        sigmask);
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTriggerImpl(
+    PerfEventMetadata const& metadata,
+    uint64_t preTriggerNs,
+    uint64_t postTriggerNs) noexcept
+{
+    // Small: only needs to hold the trigger events that arrive between polls.
+    static constexpr uint32_t TriggerBufferSize = 16384;
+
+    int error = 0;
+    std::unique_ptr<unique_fd[]> files;
+    std::unique_ptr<unique_mmap[]> mmaps;
+    perf_event_attr attr;
+    uint32_t groupBegin;
+    uint32_t mmapSize;
+
+    ClearTrigger();
+
+    auto const existingIt = m_tracepointInfoByCommonType.find(metadata.Id());
+    if (existingIt == m_tracepointInfoByCommonType.end())
+    {
+        error = ENOENT;
+        goto Done;
+    }
+
+    if (0 == (m_sampleType & PERF_SAMPLE_TIME))
+    {
+        error = EPERM;
+        goto Done;
+    }
+
+    try
+    {
+        files = std::make_unique<unique_fd[]>(m_groupBufferCount);
+        mmaps = std::make_unique<unique_mmap[]>(m_groupBufferCount);
+        if (m_triggerPollfd == nullptr)
+        {
+            m_triggerPollfd = std::make_unique<pollfd[]>(m_groupBufferCount);
+        }
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+        goto Done;
+    }
+
+    {
+        auto const& tpi = existingIt->second;
+
+        // Same event as the tracepoint's files, but always enabled, written
+        // forward, and with a wakeup for every event.
+        attr = *tpi.m_eventDesc.attr;
+        attr.disabled = 0;
+        attr.write_backward = 0;
+        attr.watermark = 0;
+        attr.wakeup_events = 1;
+
+        groupBegin = tpi.m_bufferGroup * m_groupBufferCount;
+        mmapSize = m_pageSize + RoundUpBufferSize(m_pageSize, TriggerBufferSize);
+        for (uint32_t cpu = 0; cpu != m_groupBufferCount; cpu += 1)
+        {
+            if (!tpi.m_bufferFiles[groupBegin + cpu])
+            {
+                continue; // Tracepoint not collected on this CPU.
+            }
+
+            errno = 0;
+            auto& file = files[cpu];
+            file.reset(PerfEventOpenForBuffer(&attr, groupBegin + cpu, false));
+            if (!file ||
+                (tpi.m_filter && -1 == ioctl(file.get(), PERF_EVENT_IOC_SET_FILTER, tpi.m_filter.get())) ||
+                (tpi.m_bpfProgramFile && -1 == ioctl(file.get(), PERF_EVENT_IOC_SET_BPF, tpi.m_bpfProgramFile.get())))
+            {
+                error = errno ? errno : ENODEV;
+                goto Done;
+            }
+
+            errno = 0;
+            auto const cpuMap = mmap(nullptr, mmapSize, PROT_READ | PROT_WRITE, MAP_SHARED, file.get(), 0);
+            if (MAP_FAILED == cpuMap)
+            {
+                error = errno ? errno : ENODEV;
+                goto Done;
+            }
+
+            mmaps[cpu].reset(cpuMap, mmapSize);
+        }
+
+        m_triggerTpi = &tpi;
+        m_triggerPreNs = preTriggerNs;
+        m_triggerPostNs = postTriggerNs;
+        m_triggerNextCpu = 0;
+        m_triggerFiles = std::move(files);
+        m_triggerMmaps = std::move(mmaps);
+    }
+
+Done:
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::WaitForTriggerEvents(
+    timespec const* timeout,
+    sigset_t const* sigmask) noexcept
+{
+    int error;
+
+    if (m_triggerTpi == nullptr)
+    {
+        error = EPERM;
+        goto Done;
+    }
+
+    // The trigger files only signal POLLIN once per wakeup, so check for
+    // events that were not consumed by the previous wait.
+    for (uint32_t cpu = 0; cpu != m_groupBufferCount; cpu += 1)
+    {
+        auto const bufferHeader = static_cast<perf_event_mmap_page const*>(m_triggerMmaps[cpu].get());
+        if (bufferHeader != nullptr &&
+            __atomic_load_n(&bufferHeader->data_head, __ATOMIC_ACQUIRE) != bufferHeader->data_tail)
+        {
+            error = 0;
+            goto Done;
+        }
+    }
+
+    {
+        unsigned pollfdCount = 0;
+        for (uint32_t cpu = 0; cpu != m_groupBufferCount; cpu += 1)
+        {
+            if (m_triggerFiles[cpu])
+            {
+                m_triggerPollfd[pollfdCount] = { m_triggerFiles[cpu].get(), POLLIN, 0 };
+                pollfdCount += 1;
+            }
+        }
+
+        auto const activeCount = ppoll(m_triggerPollfd.get(), pollfdCount, timeout, sigmask);
+        error = activeCount < 0
+            ? errno
+            : activeCount == 0
+            ? ETIMEDOUT
+            : 0;
+    }
+
+Done:
+
+    return error;
+}
+
+bool
+TracepointSession::NextTriggerEvent() noexcept
+{
+    assert(m_triggerTpi != nullptr);
+
+    for (uint32_t checked = 0; checked != m_groupBufferCount; checked += 1)
+    {
+        auto const cpu = m_triggerNextCpu;
+        auto const& cpuMmap = m_triggerMmaps[cpu];
+        if (!cpuMmap)
+        {
+            m_triggerNextCpu = (cpu + 1) % m_groupBufferCount;
+            continue;
+        }
+
+        auto const bufferHeader = static_cast<perf_event_mmap_page*>(cpuMmap.get());
+        auto const bufferData = static_cast<uint8_t const*>(cpuMmap.get()) + m_pageSize;
+        auto const bufferSize = cpuMmap.get_size() - m_pageSize;
+
+        // ATOMIC_ACQUIRE: perf_events.h recommends smp_rmb() here.
+        auto const head = __atomic_load_n(&bufferHeader->data_head, __ATOMIC_ACQUIRE);
+        auto tail = bufferHeader->data_tail;
+        while (head != tail)
+        {
+            auto const tailPos = static_cast<size_t>(tail) & (bufferSize - 1);
+            auto const eventHeader = *BufferDataPosToHeader(bufferData, static_cast<uint32_t>(tailPos));
+            if (eventHeader.size < sizeof(perf_event_header) ||
+                eventHeader.size > head - tail ||
+                0 != (eventHeader.size & 7))
+            {
+                // Unexpected - corrupt trigger buffer. Discard its contents.
+                tail = head;
+                break;
+            }
+
+            bool parsed = false;
+            if (eventHeader.type == PERF_RECORD_SAMPLE)
+            {
+                try
+                {
+                    // Copy the event so that it is contiguous and so that it stays
+                    // valid after it is consumed.
+                    m_triggerEventData.resize(eventHeader.size);
+                    auto const beforeWrap = std::min<size_t>(eventHeader.size, bufferSize - tailPos);
+                    memcpy(m_triggerEventData.data(), bufferData + tailPos, beforeWrap);
+                    memcpy(m_triggerEventData.data() + beforeWrap, bufferData, eventHeader.size - beforeWrap);
+                    parsed = ParseTriggerSample();
+                }
+                catch (...)
+                {
+                    // Out of memory: skip the event.
+                }
+            }
+
+            tail += eventHeader.size;
+            if (parsed)
+            {
+                __atomic_store_n(&bufferHeader->data_tail, tail, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+
+        __atomic_store_n(&bufferHeader->data_tail, tail, __ATOMIC_RELEASE);
+        m_triggerNextCpu = (cpu + 1) % m_groupBufferCount;
+    }
+
+    return false;
+}
+
+bool
+TracepointSession::ParseTriggerSample() noexcept
+{
+    auto p = m_triggerEventData.data();
+    auto const pEnd = p + m_triggerEventData.size();
+    auto& info = m_triggerEventInfo;
+    info = PerfSampleEventInfo();
+
+    info.header = reinterpret_cast<perf_event_header const*>(p);
+    p += sizeof(perf_event_header);
+
+    // Fields are in the order of their PERF_SAMPLE bits.
+    auto const sampleType = m_sampleType;
+    auto readU64 = [&p, pEnd](uint32_t sampleBit, uint32_t sampleTypes, uint64_t* value) noexcept
+        {
+            if (0 == (sampleTypes & sampleBit))
+            {
+                return true;
+            }
+
+            if (p == pEnd)
+            {
+                return false;
+            }
+
+            if (value != nullptr)
+            {
+                memcpy(value, p, sizeof(uint64_t));
+            }
+
+            p += sizeof(uint64_t);
+            return true;
+        };
+
+    uint64_t tid = 0;
+    uint64_t cpu = 0;
+    if (!readU64(PERF_SAMPLE_IDENTIFIER, sampleType, &info.id) ||
+        !readU64(PERF_SAMPLE_IP, sampleType, &info.ip) ||
+        !readU64(PERF_SAMPLE_TID, sampleType, &tid) ||
+        !readU64(PERF_SAMPLE_TIME, sampleType, &info.time) ||
+        !readU64(PERF_SAMPLE_ADDR, sampleType, &info.addr) ||
+        !readU64(PERF_SAMPLE_ID, sampleType, &info.id) ||
+        !readU64(PERF_SAMPLE_STREAM_ID, sampleType, &info.stream_id) ||
+        !readU64(PERF_SAMPLE_CPU, sampleType, &cpu) ||
+        !readU64(PERF_SAMPLE_PERIOD, sampleType, &info.period))
+    {
+        return false;
+    }
+
+    info.pid = static_cast<uint32_t>(tid);
+    info.tid = static_cast<uint32_t>(tid >> 32);
+    info.cpu = static_cast<uint32_t>(cpu);
+    info.cpu_reserved = static_cast<uint32_t>(cpu >> 32);
+
+    if (sampleType & PERF_SAMPLE_CALLCHAIN)
+    {
+        if (p == pEnd)
+        {
+            return false;
+        }
+
+        info.callchain = reinterpret_cast<uint64_t const*>(p);
+        auto const count = *info.callchain;
+        p += sizeof(uint64_t);
+        if (static_cast<size_t>(pEnd - p) / sizeof(uint64_t) < count)
+        {
+            return false;
+        }
+
+        p += count * sizeof(uint64_t);
+    }
+
+    if (sampleType & PERF_SAMPLE_RAW)
+    {
+        if (pEnd - p < static_cast<ptrdiff_t>(sizeof(uint32_t)))
+        {
+            return false;
+        }
+
+        auto const rawSize = *reinterpret_cast<uint32_t const*>(p);
+        if (static_cast<size_t>(pEnd - p) - sizeof(uint32_t) < rawSize)
+        {
+            return false;
+        }
+
+        info.raw_data = p + sizeof(uint32_t);
+        info.raw_data_size = rawSize;
+    }
+
+    info.event_desc = &m_triggerTpi->m_eventDesc;
+    info.session_info = &m_sessionInfo;
+    return true;
+}
+
+_Success_(return == 0) int
+TracepointSession::CaptureTrigger(
+    TracepointSnapshot& snapshot,
+    _Out_opt_ TracepointTimestampRange* window) noexcept
+{
+    int error;
+    auto const triggerTime = m_triggerEventInfo.time;
+    auto const windowLast = UINT64_MAX - triggerTime < m_triggerPostNs
+        ? UINT64_MAX
+        : triggerTime + m_triggerPostNs;
+
+    // Keep collecting until the session clock reaches the end of the window.
+    // (clock_nanosleep does not support the session's CLOCK_MONOTONIC_RAW.)
+    for (;;)
+    {
+        timespec now;
+        if (0 != clock_gettime(m_sessionInfo.Clockid(), &now))
+        {
+            break;
+        }
+
+        auto const nowNs = static_cast<uint64_t>(now.tv_sec) * 1000000000u + static_cast<uint64_t>(now.tv_nsec);
+        if (nowNs >= windowLast)
+        {
+            break;
+        }
+
+        auto const remaining = windowLast - nowNs;
+        timespec const delay = {
+            static_cast<time_t>(remaining / 1000000000u),
+            static_cast<long>(remaining % 1000000000u) };
+        nanosleep(&delay, nullptr); // Re-checked by the loop if interrupted.
+    }
+
+    // Discard the trigger events that arrived during the window.
+    while (NextTriggerEvent())
+    {
+        continue;
+    }
+
+    error = SnapshotBuffers(snapshot);
+    if (error == 0 && window != nullptr)
+    {
+        window->First = triggerTime > m_triggerPreNs ? triggerTime - m_triggerPreNs : 0;
+        window->Last = windowLast;
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::FlushToWriter(
+    tracepoint_decode::PerfDataFileWriter& writer,
+    _Inout_ TracepointTimestampRange* writtenRange,
+    TracepointTimestampRange filterRange) noexcept
+{
+    return FlushToWriterImpl(writer, writtenRange, filterRange, UINT64_MAX);
+}
+
+_Success_(return == 0) int
+TracepointSession::FlushToWriterImpl(
+    tracepoint_decode::PerfDataFileWriter& writer,
+    _Inout_ TracepointTimestampRange* writtenRange,
+    TracepointTimestampRange filterRange,
+    uint64_t filterSlackNs) noexcept
+{
+    int error;
+    auto const startNs = m_metrics ? MonotonicTimeNs() : 0u;
+
+    if (m_bufferLeaderFiles != nullptr && (m_drainThreadCount > 1 || !m_drainCpuNodes.empty()) && m_bufferCount > 1 && m_rateLimitCount == 0)
+    {
+        error = FlushToWriterParallel(writer, writtenRange, filterRange, filterSlackNs);
+    }
+    else
+    {
+        error = FlushBuffersToWriterImpl(nullptr, m_bufferCount, writer, writtenRange, filterRange, filterSlackNs);
+    }
+
+    if (m_metrics)
+    {
+        RecordLatency(m_metrics->FlushNs, MonotonicTimeNs() - startNs);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::FlushBuffersToWriter(
+    _In_reads_(bufferIndexesCount) uint32_t const* bufferIndexes,
+    uint32_t bufferIndexesCount,
+    tracepoint_decode::PerfDataFileWriter& writer,
+    _Inout_ TracepointTimestampRange* writtenRange,
+    TracepointTimestampRange filterRange) noexcept
+{
+    for (uint32_t i = 0; i != bufferIndexesCount; i += 1)
+    {
+        if (bufferIndexes[i] >= m_bufferCount)
+        {
+            return EINVAL;
+        }
+    }
+
+    auto const startNs = m_metrics ? MonotonicTimeNs() : 0u;
+    auto const error = FlushBuffersToWriterImpl(bufferIndexes, bufferIndexesCount, writer, writtenRange, filterRange, UINT64_MAX);
+    if (m_metrics)
+    {
+        RecordLatency(m_metrics->FlushNs, MonotonicTimeNs() - startNs);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::FlushBuffersToWriterImpl(
+    _In_reads_opt_(bufferIndexesCount) uint32_t const* bufferIndexes,
+    uint32_t bufferIndexesCount,
+    tracepoint_decode::PerfDataFileWriter& writer,
+    _Inout_ TracepointTimestampRange* writtenRange,
+    TracepointTimestampRange filterRange,
+    uint64_t filterSlackNs) noexcept
+{
+    int error = 0;
+    IovecList vecList;
+
+    auto flushVecList = [this, &vecList, &writer]() noexcept
+        {
+            if (m_metrics == nullptr)
+            {
+                return vecList.Flush(writer);
+            }
+
+            auto const bytes = vecList.Bytes();
+            auto const startNs = MonotonicTimeNs();
+            auto const flushError = vecList.Flush(writer);
+            RecordLatency(m_metrics->WriterWriteNs, MonotonicTimeNs() - startNs);
+            if (flushError == 0)
+            {
+                __atomic_fetch_add(&m_metrics->WriterBytes, bytes, __ATOMIC_RELAXED);
+            }
+
+            return flushError;
+        };
+
+    if (m_bufferLeaderFiles != nullptr)
+    {
+        // With a filter, check each sample's time before parsing it, so that
+        // skipping events outside the window is cheap.
+        TimestampFilter filter(filterRange, filterSlackNs);
+        auto const bytesBeforeTime = SampleBytesBeforeTime(m_sampleType);
+        bool const checkTime = 0 != (m_sampleType & PERF_SAMPLE_TIME) &&
+            !filter.AcceptsAll();
+
+        auto recordFn = [this, &vecList, &filter, writtenRange, filterRange, bytesBeforeTime, checkTime](
+            BufferInfo const& buffer,
+            uint16_t recordSize,
+            uint32_t recordBufferPos) noexcept
+            {
+                // Look up the correct value for m_enumEventInfo.event_desc.
+
+                m_enumEventInfo.event_desc = nullptr;
+                if (PERF_RECORD_SAMPLE == BufferDataPosToHeader(buffer.Data, recordBufferPos)->type)
+                {
+                    if (checkTime && recordSize > bytesBeforeTime)
+                    {
+                        if (filter.PastWindow())
+                        {
+                            return false; // Skip this event without reading it.
+                        }
+
+                        auto const timePos = (recordBufferPos + bytesBeforeTime) & (buffer.Size - 1);
+                        auto const time = *reinterpret_cast<uint64_t const*>(buffer.Data + timePos);
+                        if (!filter.KeepSample(!buffer.Realtime, time))
+                        {
+                            return false; // Skip this event.
+                        }
+                    }
+
+                    // TODO: We don't need a full parse here. Could potentially
+                    // save a few cycles by inlining ParseSample and removing the
+                    // parts we don't need.
+
+                    // If this succeeds it will set m_enumEventInfo.
+                    if (ParseSample(buffer, recordSize, recordBufferPos))
+                    {
+                        if (filterRange.First > m_enumEventInfo.time ||
+                            filterRange.Last < m_enumEventInfo.time)
+                        {
+                            return false; // Skip this event.
+                        }
+
+                        if (m_enumEventInfo.time < writtenRange->First)
+                        {
+                            writtenRange->First = m_enumEventInfo.time;
+                        }
+
+                        if (m_enumEventInfo.time > writtenRange->Last)
+                        {
+                            writtenRange->Last = m_enumEventInfo.time;
+                        }
+                    }
+                    else if (m_enumEventDropped)
+                    {
+                        return false; // Skip this event (rate limit).
+                    }
+                }
+
+                // Add event data to vecList.
+
+                auto const unmaskedPosEnd = recordBufferPos + recordSize;
+                if (unmaskedPosEnd <= buffer.Size)
+                {
+                    // Event does not wrap.
+                    vecList.Add(buffer.Data + recordBufferPos, recordSize);
+                }
+                else
+                {
+                    // Event wraps.
+                    vecList.Add(buffer.Data + recordBufferPos, buffer.Size - recordBufferPos);
+                    vecList.Add(buffer.Data, unmaskedPosEnd - buffer.Size);
+                }
+
+                return true;
+            };
+
+        // Pause one buffer at a time.
+        for (uint32_t i = 0; i != bufferIndexesCount; i += 1)
+        {
+            auto const bufferIndex = bufferIndexes ? bufferIndexes[i] : i;
+            assert(bufferIndex < m_bufferCount);
+            if (m_buffers[bufferIndex].Size == 0)
+            {
+                continue;
+            }
+
+            EnumeratorBegin(bufferIndex);
+            IndexBegin(bufferIndex, filterRange);
+            filter.Reset();
+
+            while (EnumeratorMoveNext(bufferIndex, recordFn))
+            {
+                if (m_enumEventInfo.event_desc)
+                {
+                    error = writer.AddTracepointEventDesc(*m_enumEventInfo.event_desc);
+                    if (error != EEXIST && error != 0)
+                    {
+                        EnumeratorEnd(bufferIndex);
+                        goto Done;
+                    }
+                }
+
+                if (vecList.RoomLeft() < 2) // Next recordFn may need up to 2 calls to Add().
+                {
+                    error = flushVecList();
+                    if (error != 0)
+                    {
+                        EnumeratorEnd(bufferIndex);
+                        goto Done;
+                    }
+                }
+            }
+
+            error = flushVecList();
+
+            EnumeratorEnd(bufferIndex);
+
+            if (error != 0)
+            {
+                goto Done;
+            }
+        }
+    }
+
+Done:
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::FlushToWriterParallel(
+    tracepoint_decode::PerfDataFileWriter& writer,
+    _Inout_ TracepointTimestampRange* writtenRange,
+    TracepointTimestampRange filterRange,
+    uint64_t filterSlackNs) noexcept
+{
+    int error = 0;
+
+    if (m_flushWorkerPool == nullptr)
+    {
+        try
+        {
+            m_flushWorkerPool = std::make_unique<FlushWorkerPool>(
+                *this,
+                std::min(m_drainThreadCount, m_bufferCount));
+        }
+        catch (...)
+        {
+            error = ENOMEM;
+            goto Done;
+        }
+    }
+
+    // Workers don't look up each event's EventDesc, so add all of them up-front.
+    error = AddWriterEventDescs(writer);
+    if (error != 0)
+    {
+        goto Done;
+    }
+
+    m_flushWorkerPool->Run(filterRange, filterSlackNs);
+
+    // Commit the staged chunks in buffer order.
+    for (uint32_t i = 0; i != m_flushWorkerPool->WorkerCount(); i += 1)
+    {
+        auto& worker = m_flushWorkerPool->Worker(i);
+
+        m_sampleEventCount += worker.SampleEventCount;
+        m_corruptEventCount += worker.CorruptEventCount;
+
+        if (worker.WrittenRange.First < writtenRange->First)
+        {
+            writtenRange->First = worker.WrittenRange.First;
+        }
+
+        if (worker.WrittenRange.Last > writtenRange->Last)
+        {
+            writtenRange->Last = worker.WrittenRange.Last;
+        }
+
+        if (error == 0 && !worker.Chunk.empty())
+        {
+            auto const startNs = m_metrics ? MonotonicTimeNs() : 0u;
+            error = writer.WriteEventData(worker.Chunk.data(), worker.Chunk.size());
+            if (m_metrics)
+            {
+                RecordLatency(m_metrics->WriterWriteNs, MonotonicTimeNs() - startNs);
+                if (error == 0)
+                {
+                    __atomic_fetch_add(&m_metrics->WriterBytes, worker.Chunk.size(), __ATOMIC_RELAXED);
+                }
+            }
+        }
+
+        if (error == 0)
+        {
+            error = worker.Error;
+        }
+
+        worker.Chunk.clear();
+    }
+
+Done:
+
+    return error;
+}
+
+void
+TracepointSession::FlushBuffersToChunk(
+    FlushWorker& worker,
+    TracepointTimestampRange filterRange,
+    uint64_t filterSlackNs) noexcept
+{
+    auto const bytesBeforeTime = SampleBytesBeforeTime(m_sampleType);
+    bool const sampleHasTime = 0 != (m_sampleType & PERF_SAMPLE_TIME);
+    TimestampFilter filter(filterRange, filterSlackNs);
+
+    worker.WrittenRange = TracepointTimestampRange();
+    worker.SampleEventCount = 0;
+    worker.CorruptEventCount = 0;
+    worker.Error = 0;
+
+    for (auto const bufferIndex : worker.Buffers)
+    {
+        auto const& buffer = m_buffers[bufferIndex];
+        if (buffer.Size == 0)
+        {
+            continue;
+        }
+
+        EnumeratorBegin(bufferIndex);
+        IndexBegin(bufferIndex, filterRange);
+
+        // Reserve room for everything in the buffer so that the copy can't fail.
+        // If we can't get the memory, leave the buffer's events unconsumed.
+        size_t chunkUsed = worker.Chunk.size();
+        try
+        {
+            worker.Chunk.resize(chunkUsed + (static_cast<size_t>(buffer.DataHead64) - buffer.DataPos));
+        }
+        catch (...)
+        {
+            worker.Error = ENOMEM;
+            EnumeratorEnd(bufferIndex);
+            continue;
+        }
+
+        auto const chunkData = worker.Chunk.data();
+        filter.Reset();
+        EnumeratorMoveNext(
+            bufferIndex,
+            [&worker, &chunkUsed, &filter, chunkData, bytesBeforeTime, sampleHasTime](
+                BufferInfo const& buffer,
+                uint16_t recordSize,
+                uint32_t recordBufferPos) noexcept
+            {
+                if (PERF_RECORD_SAMPLE == BufferDataPosToHeader(buffer.Data, recordBufferPos)->type)
+                {
+                    if (!sampleHasTime)
+                    {
+                        worker.SampleEventCount += 1;
+                    }
+                    else if (recordSize <= bytesBeforeTime)
+                    {
+                        worker.CorruptEventCount += 1;
+                    }
+                    else if (filter.PastWindow())
+                    {
+                        return false; // Skip this event without reading it.
+                    }
+                    else
+                    {
+                        auto const timePos = (recordBufferPos + bytesBeforeTime) & (buffer.Size - 1);
+                        auto const time = *reinterpret_cast<uint64_t const*>(buffer.Data + timePos);
+                        if (!filter.KeepSample(!buffer.Realtime, time))
+                        {
+                            return false; // Skip this event.
+                        }
+
+                        if (time < worker.WrittenRange.First)
+                        {
+                            worker.WrittenRange.First = time;
+                        }
+
+                        if (time > worker.WrittenRange.Last)
+                        {
+                            worker.WrittenRange.Last = time;
+                        }
+
+                        worker.SampleEventCount += 1;
+                    }
+                }
+
+                // Copy event data to chunk.
+
+                auto const unmaskedPosEnd = recordBufferPos + recordSize;
+                if (unmaskedPosEnd <= buffer.Size)
+                {
+                    // Event does not wrap.
+                    memcpy(chunkData + chunkUsed, buffer.Data + recordBufferPos, recordSize);
+                }
+                else
+                {
+                    // Event wraps.
+                    auto const beforeWrap = buffer.Size - recordBufferPos;
+                    memcpy(chunkData + chunkUsed, buffer.Data + recordBufferPos, beforeWrap);
+                    memcpy(chunkData + chunkUsed + beforeWrap, buffer.Data, unmaskedPosEnd - buffer.Size);
+                }
+
+                chunkUsed += recordSize;
+                return false; // Keep going.
+            });
+
+        worker.Chunk.resize(chunkUsed); // Shrink. Will not throw.
+        EnumeratorEnd(bufferIndex);
+    }
+}
+
+_Success_(return == 0) int
+TracepointSession::AddWriterEventDescs(
+    tracepoint_decode::PerfDataFileWriter& writer) noexcept
+{
+    for (auto const& pair : m_tracepointInfoByCommonType)
+    {
+        auto const error = writer.AddTracepointEventDesc(pair.second.m_eventDesc);
+        if (error != EEXIST && error != 0)
+        {
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetWriterHeaders(
+    tracepoint_decode::PerfDataFileWriter& writer,
+    _In_opt_ TracepointTimestampRange const* writtenRange) noexcept
+{
+    return SetWriterHeadersImpl(writer, m_sessionInfo, writtenRange);
+}
+
+_Success_(return == 0) int
+TracepointSession::DisableTracepointImpl(PerfEventMetadata const& metadata) noexcept
+{
+    int error;
+
+    auto const existingIt = m_tracepointInfoByCommonType.find(metadata.Id());
+    if (existingIt == m_tracepointInfoByCommonType.end())
+    {
+        error = ENOENT;
+    }
+    else
+    {
+        error = SetTracepointEnableState(existingIt->second, false);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::EnableTracepointImpl(PerfEventMetadata const& metadata) noexcept
+{
+    int error;
+
+    auto const existingIt = m_tracepointInfoByCommonType.find(metadata.Id());
+    if (existingIt == m_tracepointInfoByCommonType.end())
+    {
+        error = AddTracepoint(metadata, TracepointEnableState::Enabled);
+    }
+    else
+    {
+        error = SetTracepointEnableState(existingIt->second, true);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointBufferGroup(unsigned id, uint32_t group) noexcept
+{
+    auto const metadata = m_cache.FindById(id);
+    auto const error = metadata == nullptr
+        ? ENOENT
+        : SetTracepointBufferGroupImpl(*metadata, group);
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointBufferGroup(TracepointName name, uint32_t group) noexcept
+{
+    int error;
+
+    PerfEventMetadata const* metadata;
+    error = m_cache.FindOrAddFromSystem(name, &metadata);
+    if (error == 0)
+    {
+        error = SetTracepointBufferGroupImpl(*metadata, group);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointBufferGroupImpl(
+    PerfEventMetadata const& metadata,
+    uint32_t group) noexcept
+{
+    int error;
+
+    auto const existingIt = m_tracepointInfoByCommonType.find(metadata.Id());
+    if (group >= m_bufferGroupCount)
+    {
+        error = EINVAL;
+    }
+    else if (existingIt != m_tracepointInfoByCommonType.end())
+    {
+        error = existingIt->second.m_bufferGroup == group ? 0 : EBUSY;
+    }
+    else
+    {
+        error = AddTracepoint(metadata, TracepointEnableState::Disabled, group);
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointRateLimitImpl(
+    PerfEventMetadata const& metadata,
+    uint32_t eventsPerSecond,
+    uint32_t burstSize) noexcept
+{
+    int error;
+
+    auto const existingIt = m_tracepointInfoByCommonType.find(metadata.Id());
+    if (existingIt == m_tracepointInfoByCommonType.end())
+    {
+        error = ENOENT;
+        goto Done;
+    }
+    else
+    {
+        auto& tpi = existingIt->second;
+        if (eventsPerSecond != 0 && !tpi.m_rateLimitBuckets)
+        {
+            try
+            {
+                tpi.m_rateLimitBuckets = std::make_unique<RateLimitBucket[]>(tpi.m_bufferFilesCount);
+            }
+            catch (...)
+            {
+                error = ENOMEM;
+                goto Done;
+            }
+        }
+
+        m_rateLimitCount -= tpi.m_rateLimitPerSecond != 0;
+        m_rateLimitCount += eventsPerSecond != 0;
+
+        tpi.m_rateLimitPerSecond = eventsPerSecond;
+        tpi.m_rateLimitCapacity = (burstSize ? burstSize : 1u) * uint64_t(1000000000);
+        if (tpi.m_rateLimitBuckets)
+        {
+            // Keep DroppedCount, start with a full bucket.
+            for (unsigned i = 0; i != tpi.m_bufferFilesCount; i += 1)
+            {
+                tpi.m_rateLimitBuckets[i].Tokens = tpi.m_rateLimitCapacity;
+                tpi.m_rateLimitBuckets[i].LastTime = 0;
+            }
+        }
+
+        error = 0;
+    }
+
+Done:
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::IoctlTracepointImpl(
+    PerfEventMetadata const& metadata,
+    unsigned long request,
+    unsigned long arg) noexcept
+{
+    int error;
+
+    auto existingIt = m_tracepointInfoByCommonType.find(metadata.Id());
+    if (existingIt == m_tracepointInfoByCommonType.end())
+    {
+        // Add it disabled so that no events are collected before the ioctl.
+        error = AddTracepoint(metadata, TracepointEnableState::Disabled);
+        if (error != 0)
+        {
+            goto Done;
+        }
+
+        existingIt = m_tracepointInfoByCommonType.find(metadata.Id());
+        assert(existingIt != m_tracepointInfoByCommonType.end());
+    }
+
+    error = IoctlForEachFile(
+        existingIt->second.m_bufferFiles.get(),
+        existingIt->second.m_bufferFilesCount,
+        request,
+        arg);
+    if (error == 0)
+    {
+        // Remember the setting for files that are opened later (CpuHotplug).
+        auto& tpi = existingIt->second;
+        switch (request)
+        {
+        case PERF_EVENT_IOC_SET_FILTER:
+        {
+            auto const filter = reinterpret_cast<char const*>(arg);
+            auto const filterSize = strlen(filter) + 1;
+            tpi.m_filter.reset(new(std::nothrow) char[filterSize]);
+            if (!tpi.m_filter)
+            {
+                error = ENOMEM;
+                break;
+            }
+
+            memcpy(tpi.m_filter.get(), filter, filterSize);
+            break;
+        }
+        case PERF_EVENT_IOC_SET_BPF:
+            tpi.m_bpfProgramFile.reset(fcntl(static_cast<int>(arg), F_DUPFD_CLOEXEC, 0));
+            break;
+        case PERF_EVENT_IOC_PERIOD:
+            // The attr is part of tpi.m_eventDescStorage.
+            const_cast<perf_event_attr*>(tpi.m_eventDesc.attr)->sample_period = *reinterpret_cast<uint64_t const*>(arg);
+            break;
+        }
+    }
+
+Done:
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::IoctlForEachFile(
+    _In_reads_(filesCount) unique_fd const* files,
+    unsigned filesCount,
+    unsigned long request,
+    unsigned long arg) noexcept
+{
+    int error = 0;
+
+    for (unsigned i = 0; i != filesCount; i += 1)
+    {
+        if (!files[i])
+        {
+            continue;
+        }
+
+        errno = 0;
+        if (-1 == ioctl(files[i].get(), request, arg))
+        {
+            error = errno;
+            if (error == 0)
+            {
+                error = ENODEV;
+            }
+        }
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::IoctlForEachFile(
+    _In_reads_(filesCount) unique_fd const* files,
+    unsigned filesCount,
+    unsigned long request,
+    _In_reads_opt_(filesCount) unique_fd const* values) noexcept
+{
+    int error = 0;
+
+    for (unsigned i = 0; i != filesCount; i += 1)
+    {
+        if (!files[i])
+        {
+            continue;
+        }
+
+        errno = 0;
+        auto const value = values ? values[i].get() : 0;
+        if (-1 == ioctl(files[i].get(), request, value))
+        {
+            error = errno;
+            if (error == 0)
+            {
+                error = ENODEV;
+            }
+        }
+    }
+
+    return error;
+}
+
+int
+TracepointSession::PerfEventOpenForBuffer(
+    struct perf_event_attr* attr,
+    uint32_t bufferIndex,
+    bool owner) const noexcept
+{
+    long file;
+    auto const cpu = static_cast<int>(bufferIndex % m_groupBufferCount);
+
+    if (m_targetSingleBuffer)
+    {
+        // A cpu -1 buffer can only be shared by events of the same task, so the
+        // owner targets the process too.
+        file = perf_event_open(attr, m_targetPid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    else if (owner)
+    {
+        file = perf_event_open(attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    else if (m_targetCgroup)
+    {
+        // If the dup failed, the kernel rejects the -1 cgroup file (EBADF or EINVAL).
+        file = perf_event_open(attr, m_targetCgroupFile.get(), cpu, -1, PERF_FLAG_FD_CLOEXEC | PERF_FLAG_PID_CGROUP);
+    }
+    else
+    {
+        file = perf_event_open(attr, m_targetPid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+
+    return static_cast<int>(file);
+}
+
+void
+TracepointSession::SetParsedSampleTypes(uint32_t sampleTypes) noexcept
 {
-    assert(options.m_mode <= TracepointSessionMode::RealTime);
-    assert(m_bufferCount > 0 && m_bufferCount < 0x10000000);
-    assert(m_pageSize >= sizeof(perf_event_mmap_page) && m_pageSize < 0x10000000);
-    assert((m_pageSize & (m_pageSize - 1)) == 0); // power of 2
+    m_parsedSampleTypes = sampleTypes;
+
+    // Skipped fields are left as 0.
+    if (!(sampleTypes & PERF_SAMPLE_IP))
+    {
+        m_enumEventInfo.ip = 0;
+    }
+
+    if (!(sampleTypes & PERF_SAMPLE_TID))
+    {
+        m_enumEventInfo.pid = 0;
+        m_enumEventInfo.tid = 0;
+    }
+
+    if (!(sampleTypes & PERF_SAMPLE_ADDR))
+    {
+        m_enumEventInfo.addr = 0;
+    }
+
+    if (!(sampleTypes & PERF_SAMPLE_STREAM_ID))
+    {
+        m_enumEventInfo.stream_id = 0;
+    }
+
+    if (!(sampleTypes & PERF_SAMPLE_CPU))
+    {
+        m_enumEventInfo.cpu = 0;
+        m_enumEventInfo.cpu_reserved = 0;
+    }
+
+    if (!(sampleTypes & PERF_SAMPLE_PERIOD))
+    {
+        m_enumEventInfo.period = 0;
+    }
+
+    if (!(sampleTypes & PERF_SAMPLE_CALLCHAIN))
+    {
+        m_enumEventInfo.callchain = nullptr;
+    }
+}
+
+uint64_t
+TracepointSession::MonotonicTimeNs() noexcept
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000u + static_cast<uint64_t>(now.tv_nsec);
+}
+
+void
+TracepointSession::RecordLatency(TracepointLatencyHistogram& histogram, uint64_t ns) noexcept
+{
+    __atomic_fetch_add(&histogram.Count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram.TotalNs, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram.Buckets[TracepointLatencyHistogram::BucketIndex(ns)], 1, __ATOMIC_RELAXED);
+
+    auto maxNs = __atomic_load_n(&histogram.MaxNs, __ATOMIC_RELAXED);
+    while (ns > maxNs &&
+        !__atomic_compare_exchange_n(&histogram.MaxNs, &maxNs, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        // maxNs was updated by the failed exchange. Try again.
+    }
+}
+
+_Success_(return == 0) int
+TracepointSession::ReserveEventBatch(uint32_t maxBatchSize) noexcept
+{
+    int error;
+
+    if (m_enumEventBatchSize >= maxBatchSize)
+    {
+        error = 0;
+    }
+    else try
+    {
+        m_enumEventBatch = std::make_unique<PerfSampleEventInfo[]>(maxBatchSize);
+        m_enumEventBatchSize = maxBatchSize;
+        error = 0;
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+    }
+
+    return error;
+}
+
+bool
+TracepointSession::ParseSample(
+    BufferInfo const& buffer,
+    uint16_t recordSize,
+    uint32_t recordBufferPos) noexcept
+{
+    return (this->*m_parseSample)(buffer, recordSize, recordBufferPos);
+}
+
+TracepointSession::ParseSampleFn
+TracepointSession::SelectParseSample(uint32_t sampleType) noexcept
+{
+    static constexpr auto Default = TracepointSessionOptions::SampleTypeDefault;
+    static constexpr auto Minimal = 0u | PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TIME | PERF_SAMPLE_RAW;
+
+    switch (sampleType)
+    {
+    case Default:
+        return &TracepointSession::ParseSampleImpl<Default>;
+    case Default | PERF_SAMPLE_CALLCHAIN:
+        return &TracepointSession::ParseSampleImpl<Default | PERF_SAMPLE_CALLCHAIN>;
+    case Minimal:
+        return &TracepointSession::ParseSampleImpl<Minimal>;
+    default:
+        return &TracepointSession::ParseSampleImpl<0>;
+    }
 }
 
-TracepointCache&
-TracepointSession::Cache() const noexcept
-{
-    return m_cache;
-}
+template<uint32_t SampleTypeConst>
+bool
+TracepointSession::ParseSampleImpl(
+    BufferInfo const& buffer,
+    uint16_t recordSize,
+    uint32_t recordBufferPos) noexcept
+{
+    // SampleTypeConst == 0: generic, uses m_sampleType and checks each field.
+    // Otherwise: specialized for m_sampleType == SampleTypeConst, checks the
+    // size of the fixed-size fields once.
+    static constexpr bool Specialized = SampleTypeConst != 0;
+
+    assert(buffer.Mmap);
+    assert(buffer.Mmap.get() == buffer.Data - m_pageSize);
+    assert(buffer.Mmap.get_size() == buffer.Size + m_pageSize);
+    assert(0 == (recordSize & 7));
+    assert(0 == (recordBufferPos & 7));
+    assert(recordSize <= buffer.Size);
+    assert(recordBufferPos < buffer.Size);
+
+    uint8_t const* p;
+    m_enumEventDropped = false;
+
+    if (recordBufferPos + recordSize <= buffer.Size)
+    {
+        // Event does not wrap.
+        p = buffer.Data + recordBufferPos;
+    }
+    else
+    {
+        // Event wraps. We need to double-buffer it. Each buffer has its own
+        // double-buffer, and at most one event per buffer wraps in each pass
+        // over the buffer, so the copy remains valid until the enumeration ends.
+        // (The perf mmap cannot be mapped a second time directly after itself,
+        // so a mirrored mapping that makes all events contiguous is not possible.)
+
+        auto& eventDataBuffer = m_eventDataBuffers[&buffer - m_buffers.get()];
+        if (eventDataBuffer.size() < recordSize)
+        {
+            try
+            {
+                eventDataBuffer.resize(recordSize);
+            }
+            catch (...)
+            {
+                m_lostEventCount += 1;
+                return false; // out of memory
+            }
+        }
+
+        auto const afterWrap = recordBufferPos + recordSize - buffer.Size;
+        auto const beforeWrap = buffer.Size - recordBufferPos;
+        auto const eventData = eventDataBuffer.data();
+        memcpy(eventData, buffer.Data + recordBufferPos, beforeWrap);
+        memcpy(eventData + beforeWrap, buffer.Data, afterWrap);
+        p = eventData;
+    }
+
+    auto const pEnd = p + recordSize;
+    auto const infoSampleTypes = Specialized ? SampleTypeConst : m_sampleType;
+    assert(infoSampleTypes == m_sampleType);
+    auto const parsedSampleTypes = m_parsedSampleTypes;
+    uint64_t infoId = 0;
+    TracepointInfoImpl const* infoTpi;
+    PerfEventDesc const* infoEventDesc;
+    char const* infoRawData = nullptr;
+    uint32_t infoRawDataSize = 0;
+
+    perf_event_header const* const infoHeader = reinterpret_cast<perf_event_header const*>(p);
+    p += sizeof(perf_event_header);
+
+    auto const SampleTypeSupported = 0u
+        | PERF_SAMPLE_IDENTIFIER
+        | PERF_SAMPLE_IP
+        | PERF_SAMPLE_TID
+        | PERF_SAMPLE_TIME
+        | PERF_SAMPLE_ADDR
+        | PERF_SAMPLE_ID
+        | PERF_SAMPLE_STREAM_ID
+        | PERF_SAMPLE_CPU
+        | PERF_SAMPLE_PERIOD
+        | PERF_SAMPLE_CALLCHAIN
+        | PERF_SAMPLE_RAW;
+    static_assert(
+        SampleTypeSupported == TracepointSessionOptions::SampleTypeSupported,
+        "SampleTypeSupported out of sync");
+
+    auto const SampleTypeDefault = 0u
+        | PERF_SAMPLE_IDENTIFIER
+        | PERF_SAMPLE_TID
+        | PERF_SAMPLE_TIME
+        | PERF_SAMPLE_CPU
+        | PERF_SAMPLE_RAW;
+    static_assert(
+        SampleTypeDefault == TracepointSessionOptions::SampleTypeDefault,
+        "SampleTypeDefault out of sync");
+
+    if constexpr (Specialized)
+    {
+        static_assert(SampleTypeConst == (SampleTypeConst & SampleTypeSupported));
+        if (recordSize < sizeof(perf_event_header) + SampleFixedSize(SampleTypeConst))
+        {
+            goto Error;
+        }
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_IDENTIFIER)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        infoId = *reinterpret_cast<uint64_t const*>(p);
+        p += sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_IP)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        if (parsedSampleTypes & PERF_SAMPLE_IP)
+        {
+            m_enumEventInfo.ip = *reinterpret_cast<uint64_t const*>(p);
+        }
+        p += sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_TID)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        if (parsedSampleTypes & PERF_SAMPLE_TID)
+        {
+            auto const pTid = reinterpret_cast<uint32_t const*>(p);
+            m_enumEventInfo.pid = pTid[0];
+            m_enumEventInfo.tid = pTid[1];
+        }
+        p += sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_TIME)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        m_enumEventInfo.time = *reinterpret_cast<uint64_t const*>(p);
+        p += sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_ADDR)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        if (parsedSampleTypes & PERF_SAMPLE_ADDR)
+        {
+            m_enumEventInfo.addr = *reinterpret_cast<uint64_t const*>(p);
+        }
+        p += sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_ID)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        infoId = *reinterpret_cast<uint64_t const*>(p);
+        p += sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_STREAM_ID)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        if (parsedSampleTypes & PERF_SAMPLE_STREAM_ID)
+        {
+            m_enumEventInfo.stream_id = *reinterpret_cast<uint64_t const*>(p);
+        }
+        p += sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_CPU)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        if (parsedSampleTypes & PERF_SAMPLE_CPU)
+        {
+            auto const pCpu = reinterpret_cast<uint32_t const*>(p);
+            m_enumEventInfo.cpu = pCpu[0];
+            m_enumEventInfo.cpu_reserved = pCpu[1];
+        }
+        p += sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_PERIOD)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        if (parsedSampleTypes & PERF_SAMPLE_PERIOD)
+        {
+            m_enumEventInfo.period = *reinterpret_cast<uint64_t const*>(p);
+        }
+        p += sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_CALLCHAIN)
+    {
+        if (!Specialized && p == pEnd) goto Error;
+        auto const infoCallchain = reinterpret_cast<uint64_t const*>(p);
+        if (parsedSampleTypes & PERF_SAMPLE_CALLCHAIN)
+        {
+            m_enumEventInfo.callchain = infoCallchain;
+        }
+        auto const count = *infoCallchain;
+        p += sizeof(uint64_t);
+
+        if ((pEnd - p) / sizeof(uint64_t) < count)
+        {
+            goto Error;
+        }
+        p += count * sizeof(uint64_t);
+    }
+
+    if (infoSampleTypes & PERF_SAMPLE_RAW)
+    {
+        // Specialized: might be at the end if there was a callchain.
+        if ((!Specialized || (infoSampleTypes & PERF_SAMPLE_CALLCHAIN)) && p == pEnd) goto Error;
+
+        assert(p < pEnd);
+
+        auto const* pRaw = reinterpret_cast<uint32_t const*>(p);
+        infoRawDataSize = pRaw[0];
+        infoRawData = reinterpret_cast<char const*>(pRaw + 1);
+        if ((pEnd - p) - sizeof(uint32_t) < infoRawDataSize)
+        {
+            goto Error;
+        }
+
+        assert(p + sizeof(uint32_t) + infoRawDataSize <= pEnd);
+
+        // Try to look up eventDesc by common type field:
+
+        uint32_t commonType;
+        auto const commonTypeOffset = static_cast<uint32_t>(m_cache.CommonTypeOffset());
+        auto const commonTypeSize = m_cache.CommonTypeSize();
+        if (infoRawDataSize <= commonTypeOffset ||
+            infoRawDataSize - commonTypeOffset <= commonTypeSize)
+        {
+            commonType = UINT32_MAX; // Never in the index.
+        }
+        else if (commonTypeSize == sizeof(uint16_t))
+        {
+            uint16_t commonType16;
+            memcpy(&commonType16, infoRawData + commonTypeOffset, sizeof(commonType16));
+            commonType = commonType16;
+        }
+        else if (commonTypeSize == sizeof(uint32_t))
+        {
+            memcpy(&commonType, infoRawData + commonTypeOffset, sizeof(commonType));
+        }
+        else
+        {
+            assert(commonTypeSize == 1);
+            uint8_t commonType8;
+            memcpy(&commonType8, infoRawData + commonTypeOffset, sizeof(commonType8));
+            commonType = commonType8;
+        }
+
+        if (commonType < m_tracepointInfoByCommonTypeIndex.size())
+        {
+            infoTpi = m_tracepointInfoByCommonTypeIndex[commonType];
+            if (infoTpi != nullptr)
+            {
+                infoEventDesc = &infoTpi->m_eventDesc;
+                goto Done;
+            }
+        }
+        else if (commonType >= CommonTypeIndexMax && commonType != UINT32_MAX)
+        {
+            // Unusually large ID. Not in the dense index.
+            auto const infoIt = m_tracepointInfoByCommonType.find(commonType);
+            if (infoIt != m_tracepointInfoByCommonType.end())
+            {
+                infoTpi = &infoIt->second;
+                infoEventDesc = &infoIt->second.m_eventDesc;
+                goto Done;
+            }
+        }
+    }
+    else
+    {
+        assert(p <= pEnd);
+    }
 
-TracepointSessionMode
-TracepointSession::Mode() const noexcept
-{
-    return m_mode;
-}
+    if (infoSampleTypes & (PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_ID))
+    {
+        // Try to look up eventDesc by sample id. Consecutive events are often
+        // from the same tracepoint, so check the most recent hit first.
 
-PerfEventSessionInfo const&
-TracepointSession::SessionInfo() const noexcept
-{
-    return m_sessionInfo;
-}
+        if (m_lastSampleIdTpi != nullptr && m_lastSampleId == infoId)
+        {
+            infoTpi = m_lastSampleIdTpi;
+            infoEventDesc = &infoTpi->m_eventDesc;
+            goto Done;
+        }
 
-bool
-TracepointSession::IsRealtime() const noexcept
-{
-    return m_mode != TracepointSessionMode::Circular;
-}
+        auto const& index = m_tracepointInfoBySampleIdIndex;
+        if (!index.empty())
+        {
+            auto const mask = index.size() - 1;
+            for (size_t i = SampleIdHash(infoId);; i += 1)
+            {
+                auto const& slot = index[i & mask];
+                if (slot.Tpi == nullptr)
+                {
+                    break;
+                }
 
-uint32_t
-TracepointSession::BufferSize(unsigned bufferIndex) const noexcept
-{
-    assert(bufferIndex < BufferCount());
-    return m_buffers[bufferIndex].Size;
-}
+                if (slot.SampleId == infoId)
+                {
+                    m_lastSampleIdTpi = slot.Tpi;
+                    m_lastSampleId = infoId;
+                    infoTpi = slot.Tpi;
+                    infoEventDesc = &infoTpi->m_eventDesc;
+                    goto Done;
+                }
+            }
+        }
+    }
 
-uint32_t
-TracepointSession::BufferCount() const noexcept
-{
-    return m_bufferCount;
-}
+    // Unable to locate eventDesc.
+    goto Error;
 
-uint64_t
-TracepointSession::SampleEventCount() const noexcept
-{
-    return m_sampleEventCount;
-}
+Done:
 
-uint64_t
-TracepointSession::LostEventCount() const noexcept
-{
-    return m_lostEventCount;
-}
+    if (infoTpi->m_rateLimitPerSecond != 0 &&
+        (infoSampleTypes & PERF_SAMPLE_TIME) &&
+        !infoTpi->RateLimitAllows(static_cast<unsigned>(&buffer - m_buffers.get()), m_enumEventInfo.time))
+    {
+        m_enumEventDropped = true;
+        m_enumEventInfo.event_desc = {};
+        m_enumEventInfo.session_info = {};
+        m_enumEventInfo.header = {};
+        m_enumEventInfo.id = {};
+        m_enumEventInfo.raw_data = {};
+        m_enumEventInfo.raw_data_size = {};
+        return false;
+    }
 
-uint64_t
-TracepointSession::CorruptEventCount() const noexcept
-{
-    return m_corruptEventCount;
-}
+    m_enumEventInfo.event_desc = infoEventDesc;
+    m_enumEventInfo.session_info = &m_sessionInfo;
+    m_enumEventInfo.header = infoHeader;
+    m_enumEventInfo.id = infoId;
+    m_enumEventInfo.raw_data = infoRawData;
+    m_enumEventInfo.raw_data_size = infoRawDataSize;
 
-uint64_t
-TracepointSession::CorruptBufferCount() const noexcept
-{
-    return m_corruptBufferCount;
-}
+    m_sampleEventCount += 1;
+    return true;
 
-void
-TracepointSession::Clear() noexcept
-{
-    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
-    {
-        m_buffers[bufferIndex].Mmap.reset();
-        m_buffers[bufferIndex].Data = nullptr;
-    }
+Error:
 
-    m_tracepointInfoByCommonType.clear();
-    m_tracepointInfoBySampleId.clear();
-    m_bufferLeaderFiles = nullptr;
+    assert(p <= pEnd);
 
-    m_sampleEventCount = 0;
-    m_lostEventCount = 0;
-    m_corruptEventCount = 0;
-    m_corruptBufferCount = 0;
+    m_enumEventInfo.event_desc = {};
+    m_enumEventInfo.session_info = {};
+    m_enumEventInfo.header = {};
+    m_enumEventInfo.id = {};
+    m_enumEventInfo.raw_data = {};
+    m_enumEventInfo.raw_data_size = {};
+
+    m_corruptEventCount += 1;
+    return false;
 }
 
 _Success_(return == 0) int
-TracepointSession::DisableTracepoint(unsigned id) noexcept
+TracepointSession::CreateBufferOwners() noexcept
 {
-    auto const metadata = m_cache.FindById(id);
-    auto const error = metadata == nullptr
-        ? ENOENT
-        : DisableTracepointImpl(*metadata);
+    int error = 0;
 
-    return error;
-}
+    assert(m_standbyBuffers || m_bufferGroupCount > 1 || m_adaptiveMaxSize != 0);
+    assert(!m_bufferLeaderFiles);
 
-_Success_(return == 0) int
-TracepointSession::DisableTracepoint(TracepointName name) noexcept
-{
-    int error;
+    try
+    {
+        auto ownerFiles = std::make_unique<unique_fd[]>(m_bufferCount * (m_standbyBuffers ? 2u : 1u));
+        for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+        {
+            if (m_buffers[bufferIndex].Size == 0)
+            {
+                continue;
+            }
 
-    PerfEventMetadata const* metadata;
-    error = m_cache.FindOrAddFromSystem(name, &metadata);
-    if (error == 0)
+            error = CreateBufferOwner(bufferIndex, ownerFiles.get());
+            if (error)
+            {
+                goto Error;
+            }
+        }
+
+        uint64_t realtimeBytes = 0;
+        for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+        {
+            if (m_buffers[bufferIndex].Realtime)
+            {
+                realtimeBytes += m_buffers[bufferIndex].Size;
+            }
+        }
+
+        m_adaptiveBufferBytes = realtimeBytes;
+        m_bufferOwnerFiles = std::move(ownerFiles);
+        m_bufferLeaderFiles = m_bufferOwnerFiles.get();
+        return 0;
+    }
+    catch (...)
     {
-        error = DisableTracepointImpl(*metadata);
+        error = ENOMEM;
     }
 
-    return error;
-}
+Error:
 
-_Success_(return == 0) int
-TracepointSession::EnableTracepoint(unsigned id) noexcept
-{
-    auto const metadata = m_cache.FindById(id);
-    auto const error = metadata == nullptr
-        ? ENOENT
-        : EnableTracepointImpl(*metadata);
+    for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    {
+        auto& buffer = m_buffers[bufferIndex];
+        buffer.Mmap.reset();
+        buffer.Data = nullptr;
+        buffer.StandbyMmap.reset();
+        buffer.StandbyData = nullptr;
+    }
 
     return error;
 }
 
 _Success_(return == 0) int
-TracepointSession::EnableTracepoint(TracepointName name) noexcept
+TracepointSession::CreateBufferOwner(uint32_t bufferIndex, unique_fd* ownerFiles) noexcept
 {
-    int error;
+    auto& buffer = m_buffers[bufferIndex];
+    assert(buffer.Size != 0);
 
-    PerfEventMetadata const* metadata;
-    error = m_cache.FindOrAddFromSystem(name, &metadata);
-    if (error == 0)
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.size = PERF_ATTR_SIZE_VER3;
+    attr.config = PERF_COUNT_SW_DUMMY;
+    attr.use_clockid = 1; // SET_OUTPUT requires matching write_backward and clock.
+    attr.clockid = m_sessionInfo.Clockid();
+
+    // The buffer's wakeup watermark comes from the event that owns it.
+    attr.write_backward = !buffer.Realtime;
+    attr.watermark = buffer.Realtime && m_wakeupUseWatermark;
+    attr.wakeup_events = buffer.Realtime ? m_wakeupValue : 0u;
+
+    auto const prot = buffer.Realtime
+        ? PROT_READ | PROT_WRITE
+        : PROT_READ;
+    auto const mmapSize = m_pageSize + buffer.Size;
+    unique_mmap maps[2];
+    for (unsigned i = 0; i != (buffer.Standby ? 2u : 1u); i += 1)
     {
-        error = EnableTracepointImpl(*metadata);
+        auto& ownerFile = ownerFiles[i * m_bufferCount + bufferIndex];
+
+        errno = 0;
+        ownerFile.reset(PerfEventOpenForBuffer(&attr, bufferIndex, true));
+        if (!ownerFile)
+        {
+            return errno ? errno : ENODEV;
+        }
+
+        errno = 0;
+        auto const cpuMap = mmap(nullptr, mmapSize, prot, MAP_SHARED, ownerFile.get(), 0);
+        if (MAP_FAILED == cpuMap)
+        {
+            return errno ? errno : ENODEV;
+        }
+
+        maps[i].reset(cpuMap, mmapSize);
     }
 
-    return error;
-}
+    buffer.Data = static_cast<uint8_t*>(maps[0].get()) + m_pageSize;
+    buffer.Mmap = std::move(maps[0]);
+    if (buffer.Standby)
+    {
+        buffer.StandbyData = static_cast<uint8_t*>(maps[1].get()) + m_pageSize;
+        buffer.StandbyMmap = std::move(maps[1]);
+    }
 
-TracepointInfoRange
-TracepointSession::TracepointInfos() const noexcept
-{
-    return TracepointInfoRange(m_tracepointInfoByCommonType);
+    buffer.DrainedHead64 = 0;
+    buffer.StandbyDrainedHead64 = 0;
+    return 0;
 }
 
-TracepointInfoIterator
-TracepointSession::TracepointInfosBegin() const noexcept
+void
+TracepointSession::SwitchToStandbyBuffer(uint32_t bufferIndex) noexcept
 {
-    return TracepointInfoIterator(m_tracepointInfoByCommonType.begin());
-}
+    assert(m_buffers[bufferIndex].Standby);
 
-TracepointInfoIterator
-TracepointSession::TracepointInfosEnd() const noexcept
-{
-    return TracepointInfoIterator(m_tracepointInfoByCommonType.end());
-}
+    auto& activeOwner = m_bufferOwnerFiles[bufferIndex];
+    auto& standbyOwner = m_bufferOwnerFiles[m_bufferCount + bufferIndex];
+    for (auto const& pair : m_tracepointInfoByCommonType)
+    {
+        auto const& file = pair.second.m_bufferFiles[bufferIndex];
+        if (file && 0 != ioctl(file.get(), PERF_EVENT_IOC_SET_OUTPUT, standbyOwner.get()))
+        {
+            DEBUG_PRINTF("CPU%u SET_OUTPUT error %u\n", bufferIndex, errno);
+        }
+    }
 
-TracepointInfoIterator
-TracepointSession::FindTracepointInfo(unsigned id) const noexcept
-{
-    return TracepointInfoIterator(m_tracepointInfoByCommonType.find(id));
+    // m_bufferLeaderFiles[bufferIndex] is now the owner of the active buffer.
+    std::swap(activeOwner, standbyOwner);
 }
 
-TracepointInfoIterator
-TracepointSession::FindTracepointInfo(TracepointName name) const noexcept
+uint32_t
+TracepointSession::AdaptiveBufferTarget(BufferInfo& buffer) noexcept
 {
-    auto metadata = m_cache.FindByName(name);
-    return TracepointInfoIterator(metadata
-        ? m_tracepointInfoByCommonType.find(metadata->Id())
-        : m_tracepointInfoByCommonType.end());
-}
+    static constexpr uint32_t ShrinkDrainCount = 256;
 
-_Success_(return == 0) int
-TracepointSession::WaitForWakeup(
-    timespec const* timeout,
-    sigset_t const* sigmask,
-    _Out_opt_ int* pActiveCount) noexcept
-{
-    int error;
-    int activeCount;
+    assert(buffer.Realtime);
+    assert(!buffer.ResizeMmap);
 
-    if (!IsRealtime() || m_bufferLeaderFiles == nullptr)
+    auto const bufferHeader = static_cast<perf_event_mmap_page const*>(buffer.Mmap.get());
+    auto const pending = __atomic_load_n(&bufferHeader->data_head, __ATOMIC_ACQUIRE) - bufferHeader->data_tail;
+    if (pending > buffer.AdaptivePeakBytes)
     {
-        activeCount = 0;
-        error = EPERM;
+        buffer.AdaptivePeakBytes = pending > buffer.Size ? buffer.Size : static_cast<size_t>(pending);
     }
-    else try
-    {
-        if (m_pollfd == nullptr)
-        {
-            m_pollfd = std::make_unique<pollfd[]>(m_bufferCount);
-        }
 
-        unsigned pollfdCount = 0;
-        for (unsigned i = 0; i != m_bufferCount; i += 1)
-        {
-            if (m_buffers[i].Size != 0)
-            {
-                m_pollfd[pollfdCount] = { m_bufferLeaderFiles[i].get(), POLLIN, 0 };
-                pollfdCount += 1;
-            }
-        }
+    buffer.AdaptiveDrainCount += 1;
 
-        activeCount = ppoll(m_pollfd.get(), pollfdCount, timeout, sigmask);
-        if (activeCount < 0)
-        {
-            activeCount = 0;
-            error = errno;
-        }
-        else
+    uint32_t newSize = 0;
+    if (buffer.LostEventCount != buffer.AdaptiveLostBase ||
+        buffer.AdaptivePeakBytes > buffer.Size / 4 * 3)
+    {
+        if (buffer.Size < m_adaptiveMaxSize)
         {
-            error = 0;
+            // Reserve the growth from the budget.
+            uint64_t const growth = buffer.Size;
+            auto inUse = __atomic_load_n(&m_adaptiveBufferBytes, __ATOMIC_RELAXED);
+            do
+            {
+                if (m_adaptiveBudget != 0 && inUse + growth > m_adaptiveBudget)
+                {
+                    break;
+                }
+                else if (__atomic_compare_exchange_n(&m_adaptiveBufferBytes, &inUse, inUse + growth,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                    newSize = buffer.Size * 2;
+                    break;
+                }
+            } while (true);
         }
     }
-    catch (...)
+    else if (buffer.AdaptiveDrainCount < ShrinkDrainCount)
     {
-        activeCount = 0;
-        error = ENOMEM;
+        return 0; // Keep watching.
     }
-
-    if (pActiveCount)
+    else if (buffer.AdaptivePeakBytes < buffer.Size / 8 && buffer.Size > m_adaptiveMinSize)
     {
-        *pActiveCount = activeCount;
+        newSize = buffer.Size / 2;
     }
-    return error;
+
+    // Start a new observation window.
+    buffer.AdaptiveDrainCount = 0;
+    buffer.AdaptivePeakBytes = 0;
+    buffer.AdaptiveLostBase = buffer.LostEventCount;
+    return newSize;
 }
 
 _Success_(return == 0) int
-TracepointSession::GetBufferFiles(
-    _Out_writes_(BufferCount()) int* pBufferFiles) const noexcept
+TracepointSession::SwitchToResizedBuffer(uint32_t bufferIndex, uint32_t newSize) noexcept
 {
     int error;
-
-    if (m_bufferLeaderFiles == nullptr)
+    auto& buffer = m_buffers[bufferIndex];
+    assert(buffer.Realtime);
+    assert(!buffer.ResizeMmap);
+
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.size = PERF_ATTR_SIZE_VER3;
+    attr.config = PERF_COUNT_SW_DUMMY;
+    attr.use_clockid = 1; // SET_OUTPUT requires matching write_backward and clock.
+    attr.clockid = m_sessionInfo.Clockid();
+    attr.watermark = m_wakeupUseWatermark;
+    attr.wakeup_events = m_wakeupValue;
+
+    auto const mmapSize = m_pageSize + newSize;
+    unique_mmap newMmap;
+    uint32_t redirectedCount = 0;
+
+    errno = 0;
+    unique_fd newOwner(PerfEventOpenForBuffer(&attr, bufferIndex, true));
+    if (!newOwner)
     {
-        memset(pBufferFiles, 0, m_bufferCount * sizeof(pBufferFiles[0]));
-        error = EPERM;
+        error = errno ? errno : ENODEV;
+        goto Done;
     }
-    else
+
     {
-        for (unsigned i = 0; i != m_bufferCount; i += 1)
+        errno = 0;
+        auto const cpuMap = mmap(nullptr, mmapSize, PROT_READ | PROT_WRITE, MAP_SHARED, newOwner.get(), 0);
+        if (MAP_FAILED == cpuMap)
         {
-            pBufferFiles[i] = m_bufferLeaderFiles[i].get();
+            error = errno ? errno : ENODEV;
+            goto Done;
         }
 
-        error = 0;
+        newMmap.reset(cpuMap, mmapSize);
     }
 
-    return error;
-}
-
-_Success_(return == 0) int
-TracepointSession::SavePerfDataFile(
-    _In_z_ char const* perfDataFileName,
-    TracepointSavePerfDataFileOptions const& options) noexcept
-{
-    int error = 0;
-    PerfDataFileWriter writer;
-    TracepointTimestampRange writtenRange{}; // Start with an invalid range.
-    bool timesValid;
-
-    if (options.m_timestampWrittenRange)
+    if (m_epollFile)
     {
-        *options.m_timestampWrittenRange = writtenRange;
+        // Register the new owner so that WaitForReadyBuffers sees its wakeups.
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u32 = bufferIndex;
+        if (0 != epoll_ctl(m_epollFile.get(), EPOLL_CTL_ADD, newOwner.get(), &ev))
+        {
+            error = errno;
+            goto Done;
+        }
     }
 
-    error = writer.Create(perfDataFileName, options.m_openMode);
-    if (error != 0)
+    error = 0;
+    for (auto const& pair : m_tracepointInfoByCommonType)
     {
-        goto Done;
-    }
-
-    // Mark the end of the "synthetic events" section (currently empty).
+        auto const& file = pair.second.m_bufferFiles[bufferIndex];
+        if (file)
+        {
+            if (0 != ioctl(file.get(), PERF_EVENT_IOC_SET_OUTPUT, newOwner.get()))
+            {
+                error = errno;
+                break;
+            }
 
-    error = writer.WriteFinishedInit();
-    if (error != 0)
-    {
-        goto Done;
+            redirectedCount += 1;
+        }
     }
 
-    // Write event data:
-
-    error = FlushToWriter(writer, &writtenRange, options.m_filterRange);
     if (error != 0)
     {
-        goto Done;
-    }
-
-    timesValid = (m_sampleType & PERF_SAMPLE_TIME) && writtenRange.First <= writtenRange.Last;
+        // Send the tracepoints back to the current buffer.
+        DEBUG_PRINTF("CPU%u resize SET_OUTPUT error %u\n", bufferIndex, error);
+        for (auto const& pair : m_tracepointInfoByCommonType)
+        {
+            auto const& file = pair.second.m_bufferFiles[bufferIndex];
+            if (redirectedCount == 0)
+            {
+                break;
+            }
+            else if (file)
+            {
+                ioctl(file.get(), PERF_EVENT_IOC_SET_OUTPUT, m_bufferOwnerFiles[bufferIndex].get());
+                redirectedCount -= 1;
+            }
+        }
 
-    // Write system information headers:
+        if (m_epollFile)
+        {
+            epoll_ctl(m_epollFile.get(), EPOLL_CTL_DEL, newOwner.get(), nullptr);
+        }
 
-    error = SetWriterHeaders(writer, timesValid ? &writtenRange : nullptr);
-    if (error != 0)
-    {
         goto Done;
     }
 
-    // Flush to disk:
-
-    error = writer.FinalizeAndClose();
-    if (error != 0)
+    if (m_epollFile)
     {
-        goto Done;
+        epoll_ctl(m_epollFile.get(), EPOLL_CTL_DEL, m_bufferOwnerFiles[bufferIndex].get(), nullptr);
     }
 
-    // Update output parameters:
+    // m_bufferLeaderFiles[bufferIndex] is now the owner of the new buffer.
+    buffer.ResizeRetiredOwner = std::move(m_bufferOwnerFiles[bufferIndex]);
+    m_bufferOwnerFiles[bufferIndex] = std::move(newOwner);
+    buffer.ResizeMmap = std::move(newMmap);
+    buffer.ResizeSize = newSize;
 
-    if (timesValid && options.m_timestampWrittenRange)
+    if (newSize < buffer.Size)
     {
-        *options.m_timestampWrittenRange = writtenRange;
+        __atomic_fetch_sub(&m_adaptiveBufferBytes, static_cast<uint64_t>(buffer.Size - newSize), __ATOMIC_RELAXED);
     }
 
+    __atomic_fetch_add(&m_bufferResizeCount, 1u, __ATOMIC_RELAXED);
+
 Done:
 
     return error;
 }
 
-_Success_(return == 0) int
-TracepointSession::FlushToWriter(
-    tracepoint_decode::PerfDataFileWriter & writer,
-    _Inout_ TracepointTimestampRange* writtenRange,
-    TracepointTimestampRange filterRange) noexcept
+void
+TracepointSession::EnumeratorEnd(uint32_t bufferIndex) const noexcept
 {
-    int error = 0;
-    IovecList vecList;
+    auto& buffer = m_buffers[bufferIndex];
+    assert(buffer.Size != 0);
 
-    if (m_bufferLeaderFiles != nullptr)
+    if (buffer.Indexing)
     {
-        auto recordFn = [this, &vecList, writtenRange, filterRange](
-            BufferInfo const& buffer,
-            uint16_t recordSize,
-            uint32_t recordBufferPos) noexcept
-            {
-                // Look up the correct value for m_enumEventInfo.event_desc.
-
-                m_enumEventInfo.event_desc = nullptr;
-                if (PERF_RECORD_SAMPLE == BufferDataPosToHeader(buffer.Data, recordBufferPos)->type)
-                {
-                    // TODO: We don't need a full parse here. Could potentially
-                    // save a few cycles by inlining ParseSample and removing the
-                    // parts we don't need.
-
-                    // If this succeeds it will set m_enumEventInfo.
-                    if (ParseSample(buffer, recordSize, recordBufferPos))
-                    {
-                        if (filterRange.First > m_enumEventInfo.time ||
-                            filterRange.Last < m_enumEventInfo.time)
-                        {
-                            // TODO: Optimization - in some cases, this means we're going
-                            // to skip the rest of the buffer, so perhaps detect those
-                            // cases and stop the enumeration?
-                            return false; // Skip this event.
-                        }
-
-                        if (m_enumEventInfo.time < writtenRange->First)
-                        {
-                            writtenRange->First = m_enumEventInfo.time;
-                        }
-
-                        if (m_enumEventInfo.time > writtenRange->Last)
-                        {
-                            writtenRange->Last = m_enumEventInfo.time;
-                        }
-                    }
-                }
-
-                // Add event data to vecList.
+        buffer.Index->End();
+        buffer.Indexing = false;
+    }
 
-                auto const unmaskedPosEnd = recordBufferPos + recordSize;
-                if (unmaskedPosEnd <= buffer.Size)
-                {
-                    // Event does not wrap.
-                    vecList.Add(buffer.Data + recordBufferPos, recordSize);
-                }
-                else
-                {
-                    // Event wraps.
-                    vecList.Add(buffer.Data + recordBufferPos, buffer.Size - recordBufferPos);
-                    vecList.Add(buffer.Data, unmaskedPosEnd - buffer.Size);
-                }
+    if (m_metrics)
+    {
+        // DataPos advanced from DataTail as the buffer was enumerated.
+        __atomic_fetch_add(&buffer.BytesDrained, static_cast<size_t>(buffer.DataPos - buffer.DataTail), __ATOMIC_RELAXED);
+    }
 
-                return true;
-            };
+    if (buffer.Standby)
+    {
+        // The buffer we read is now the standby buffer. Nothing to unpause.
+        std::swap(buffer.Mmap, buffer.StandbyMmap);
+        std::swap(buffer.Data, buffer.StandbyData);
+        std::swap(buffer.DrainedHead64, buffer.StandbyDrainedHead64);
+    }
+    else if (!buffer.Realtime)
+    {
+        // Should not change while collection paused.
+        assert(buffer.DataHead64 == __atomic_load_n(
+            &static_cast<perf_event_mmap_page const*>(buffer.Mmap.get())->data_head,
+            __ATOMIC_RELAXED));
 
-        // Pause one buffer at a time.
-        for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+        int error = ioctl(m_bufferLeaderFiles[bufferIndex].get(), PERF_EVENT_IOC_PAUSE_OUTPUT, 0);
+        if (error != 0)
         {
-            EnumeratorBegin(bufferIndex);
-
-            while (EnumeratorMoveNext(bufferIndex, recordFn))
-            {
-                if (m_enumEventInfo.event_desc)
-                {
-                    error = writer.AddTracepointEventDesc(*m_enumEventInfo.event_desc);
-                    if (error != EEXIST && error != 0)
-                    {
-                        EnumeratorEnd(bufferIndex);
-                        goto Done;
-                    }
-                }
-
-                if (vecList.RoomLeft() < 2) // Next recordFn may need up to 2 calls to Add().
-                {
-                    error = vecList.Flush(writer);
-                    if (error != 0)
-                    {
-                        EnumeratorEnd(bufferIndex);
-                        goto Done;
-                    }
-                }
-            }
-
-            error = vecList.Flush(writer);
-
-            EnumeratorEnd(bufferIndex);
-
-            if (error != 0)
-            {
-                goto Done;
-            }
+            DEBUG_PRINTF("CPU%u unpause error %u\n", bufferIndex, error);
         }
     }
+    else if (buffer.DataPos != buffer.DataTail)
+    {
+        // Create a new 64-bit tail value.
+        uint64_t newTail64;
+        static_assert(sizeof(buffer.DataPos) == 8 || sizeof(buffer.DataPos) == 4);
+        if constexpr (sizeof(buffer.DataPos) == 8)
+        {
+            newTail64 = buffer.DataPos;
+        }
+        else
+        {
+            // Convert m_bufferDataPos to a 64-bit value relative to m_bufferDataHead64.
+            // Order of operations needs to be careful about 64-bit wrapping, e.g.
+            // - DataHead64 = 0x600000000
+            // - DataHead32 = 0x000000000
+            // - DataPos32  = 0x0FFFFFFF8
+            // Correct newTail64 is 0x5FFFFFFF8, not 0x6FFFFFFF8
+            newTail64 = buffer.DataHead64 - (static_cast<size_t>(buffer.DataHead64) - buffer.DataPos);
+        }
 
-Done:
+        assert(buffer.DataHead64 - newTail64 <= buffer.Size);
 
-    return error;
-}
+        auto const bufferHeader = static_cast<perf_event_mmap_page*>(buffer.Mmap.get());
 
-_Success_(return == 0) int
-TracepointSession::SetWriterHeaders(
-    tracepoint_decode::PerfDataFileWriter& writer,
-    _In_opt_ TracepointTimestampRange const* writtenRange) noexcept
-{
-    int error;
+        // ATOMIC_RELEASE: perf_events.h recommends smp_mb() here.
+        // For future consideration: Ordered enumerator could probably merge barriers.
+        // For future consideration: This probably just needs a compiler barrier.
+        __atomic_store_n(&bufferHeader->data_tail, newTail64, __ATOMIC_RELEASE);
+    }
 
-    utsname uts;
-    if (0 == uname(&uts))
+    if (buffer.ResizeMmap && buffer.DataPos == static_cast<size_t>(buffer.DataHead64))
     {
-        // HOSTNAME, OSRELEASE, ARCH
-        error = writer.SetUtsNameHeaders(uts);
-        if (error != 0)
-        {
-            goto Done;
-        }
+        // The old buffer has been fully drained. Switch to the new buffer.
+        // (If not fully drained, keep reading the old buffer on the next drain.)
+        buffer.Mmap = std::move(buffer.ResizeMmap);
+        buffer.Data = static_cast<uint8_t*>(buffer.Mmap.get()) + m_pageSize;
+        buffer.Size = buffer.ResizeSize;
+        buffer.ResizeRetiredOwner.reset();
+        buffer.Index.reset(); // Positions in the old buffer.
     }
 
+    if (m_metrics)
     {
-        auto const conf = sysconf(_SC_NPROCESSORS_CONF);
-        auto const onln = sysconf(_SC_NPROCESSORS_ONLN);
-        if (conf > 0 && onln > 0)
-        {
-            // NRCPUS
-            error = writer.SetNrCpusHeader(static_cast<uint32_t>(conf), static_cast<uint32_t>(onln));
-            if (error != 0)
-            {
-                goto Done;
-            }
-        }
+        RecordLatency(m_metrics->BufferHoldNs, MonotonicTimeNs() - buffer.EnumBeginNs);
+    }
+}
+
+void
+TracepointSession::EnumeratorBegin(uint32_t bufferIndex) noexcept
+{
+    auto& buffer = m_buffers[bufferIndex];
+    auto const realtime = buffer.Realtime;
+    if (m_metrics)
+    {
+        buffer.EnumBeginNs = MonotonicTimeNs();
     }
 
-    // CLOCKID, CLOCK_DATA
-    error = writer.SetSessionInfoHeaders(m_sessionInfo);
-    if (error != 0)
+    if (buffer.Standby)
     {
-        goto Done;
+        SwitchToStandbyBuffer(bufferIndex);
     }
-
-    if (writtenRange != nullptr)
+    else if (!realtime)
     {
-        // SAMPLE_TIME
-        error = writer.SetSampleTimeHeader(writtenRange->First, writtenRange->Last);
+        int error = ioctl(m_bufferLeaderFiles[bufferIndex].get(), PERF_EVENT_IOC_PAUSE_OUTPUT, 1);
         if (error != 0)
         {
-            goto Done;
+            DEBUG_PRINTF("CPU%u pause error %u\n", bufferIndex, error);
+        }
+    }
+    else if (m_adaptiveMaxSize != 0 && !buffer.ResizeMmap)
+    {
+        // Resize before reading data_head so that the old buffer is quiescent.
+        auto const newSize = AdaptiveBufferTarget(buffer);
+        if (newSize != 0 &&
+            0 != SwitchToResizedBuffer(bufferIndex, newSize) &&
+            newSize > buffer.Size)
+        {
+            // Could not switch. Return the reserved growth to the budget.
+            __atomic_fetch_sub(&m_adaptiveBufferBytes, static_cast<uint64_t>(newSize - buffer.Size), __ATOMIC_RELAXED);
         }
     }
 
-Done:
-
-    return error;
-}
+    auto const bufferHeader = static_cast<perf_event_mmap_page const*>(buffer.Mmap.get());
 
-_Success_(return == 0) int
-TracepointSession::DisableTracepointImpl(PerfEventMetadata const& metadata) noexcept
-{
-    int error;
+    // ATOMIC_ACQUIRE: perf_events.h recommends smp_rmb() here.
+    // For future consideration: Ordered enumerator could probably merge barriers.
+    buffer.DataHead64 = __atomic_load_n(&bufferHeader->data_head, __ATOMIC_ACQUIRE);
 
-    auto const existingIt = m_tracepointInfoByCommonType.find(metadata.Id());
-    if (existingIt == m_tracepointInfoByCommonType.end())
+    if (0 != (buffer.DataHead64 & 7) ||
+        m_pageSize != bufferHeader->data_offset ||
+        buffer.Size != bufferHeader->data_size)
     {
-        error = ENOENT;
+        // Unexpected - corrupt trace buffer.
+        DEBUG_PRINTF("CPU%u bad perf_event_mmap_page: head=%llx offset=%lx size=%lx\n",
+            bufferIndex,
+            (unsigned long long)buffer.DataHead64,
+            (unsigned long)bufferHeader->data_offset,
+            (unsigned long)bufferHeader->data_size);
+        buffer.DataTail = static_cast<size_t>(buffer.DataHead64) - buffer.Size;
+        buffer.DataPos = static_cast<size_t>(buffer.DataHead64);
+        buffer.CorruptBufferCount += 1;
+    }
+    else if (!realtime)
+    {
+        // Circular: write_backward == 1
+        buffer.DataTail = static_cast<size_t>(buffer.DataHead64) - buffer.Size;
+        buffer.DataPos = buffer.DataTail;
+
+        if (buffer.Standby)
+        {
+            // Only read the data written since this buffer was last drained
+            // (data_head decreases as events are written). The enumerator stops
+            // at DataHead64, so move DataHead64 to the end of the new data.
+            auto const newBytes = buffer.DrainedHead64 - buffer.DataHead64;
+            buffer.DrainedHead64 = buffer.DataHead64;
+            if (newBytes < buffer.Size)
+            {
+                buffer.DataHead64 = buffer.DataHead64 - buffer.Size + newBytes;
+            }
+        }
     }
     else
     {
-        error = SetTracepointEnableState(existingIt->second, false);
+        // Realtime: write_backward == 0
+        auto const bufferDataTail64 = bufferHeader->data_tail;
+        buffer.DataTail = static_cast<size_t>(bufferDataTail64);
+        if (buffer.DataHead64 - bufferDataTail64 > buffer.Size)
+        {
+            // Unexpected - assume bad tail pointer.
+            DEBUG_PRINTF("CPU%u bad data_tail: head=%llx tail=%llx\n",
+                bufferIndex,
+                (unsigned long long)buffer.DataHead64,
+                (unsigned long long)bufferDataTail64);
+            buffer.DataTail = static_cast<size_t>(buffer.DataHead64) - buffer.Size; // Ensure tail gets updated.
+            buffer.DataPos = static_cast<size_t>(buffer.DataHead64);
+            buffer.CorruptBufferCount += 1;
+        }
+        else
+        {
+            buffer.DataPos = buffer.DataTail;
+        }
     }
-
-    return error;
 }
 
-_Success_(return == 0) int
-TracepointSession::EnableTracepointImpl(PerfEventMetadata const& metadata) noexcept
+void
+TracepointSession::IndexBegin(uint32_t bufferIndex, TracepointTimestampRange filterRange) noexcept
 {
-    int error;
-
-    auto const existingIt = m_tracepointInfoByCommonType.find(metadata.Id());
-    if (existingIt == m_tracepointInfoByCommonType.end())
+    auto& buffer = m_buffers[bufferIndex];
+    if (buffer.Realtime || buffer.Standby || 0 == (m_sampleType & PERF_SAMPLE_TIME))
     {
-        error = AddTracepoint(metadata, TracepointEnableState::Enabled);
+        return; // Records are consumed, or their positions change, or no timestamps.
     }
-    else
+
+    if (!buffer.Index)
     {
-        error = SetTracepointEnableState(existingIt->second, true);
+        buffer.Index.reset(new(std::nothrow) TimestampIndex());
+        if (!buffer.Index)
+        {
+            return;
+        }
     }
 
-    return error;
+    buffer.Index->Begin(buffer.DataPos, static_cast<size_t>(buffer.DataHead64), filterRange);
+    buffer.Indexing = true;
 }
 
-_Success_(return == 0) int
-TracepointSession::IoctlForEachFile(
-    _In_reads_(filesCount) unique_fd const* files,
-    unsigned filesCount,
-    unsigned long request,
-    _In_reads_opt_(filesCount) unique_fd const* values) noexcept
+template<class RecordFn>
+bool
+TracepointSession::EnumeratorMoveNext(
+    uint32_t bufferIndex,
+    RecordFn&& recordFn) noexcept(noexcept(recordFn(std::declval<BufferInfo>(), 0u, 0u)))
 {
-    int error = 0;
+    auto& buffer = m_buffers[bufferIndex];
+    assert(buffer.Mmap);
+    assert(buffer.Mmap.get() == buffer.Data - m_pageSize);
+    assert(buffer.Mmap.get_size() == buffer.Size + m_pageSize);
 
-    for (unsigned i = 0; i != filesCount; i += 1)
+    auto const bytesBeforeTime = SampleBytesBeforeTime(m_sampleType);
+
+    for (;;)
     {
-        if (!files[i])
+        auto const remaining = static_cast<size_t>(buffer.DataHead64) - buffer.DataPos;
+        if (remaining == 0)
         {
-            continue;
+            break;
         }
 
-        errno = 0;
-        auto const value = values ? values[i].get() : 0;
-        if (-1 == ioctl(files[i].get(), request, value))
+        if (buffer.Indexing)
         {
-            error = errno;
-            if (error == 0)
+            auto const skipTo = buffer.Index->Skip(buffer.DataPos);
+            if (skipTo != buffer.DataPos)
             {
-                error = ENODEV;
+                buffer.DataPos = skipTo; // No samples in the filter window.
+                continue;
             }
         }
-    }
 
-    return error;
-}
+        auto const eventHeaderBufferPos = buffer.DataPos & (buffer.Size - 1);
+        auto const eventHeader = *BufferDataPosToHeader(buffer.Data, eventHeaderBufferPos);
 
-bool
-TracepointSession::ParseSample(
-    BufferInfo const& buffer,
-    uint16_t recordSize,
-    uint32_t recordBufferPos) noexcept
-{
-    assert(buffer.Mmap);
-    assert(buffer.Mmap.get() == buffer.Data - m_pageSize);
-    assert(buffer.Mmap.get_size() == buffer.Size + m_pageSize);
-    assert(0 == (recordSize & 7));
-    assert(0 == (recordBufferPos & 7));
-    assert(recordSize <= buffer.Size);
-    assert(recordBufferPos < buffer.Size);
+        if (eventHeader.size == 0 ||
+            eventHeader.size > remaining)
+        {
+            // - Circular: this is probably not a real problem - it's probably
+            //   unused buffer space or a partially-overwritten event.
+            // - Realtime: The buffer is corrupt.
+            buffer.CorruptBufferCount += buffer.Realtime;
 
-    uint8_t const* p;
+            // In either case, buffer is done. Mark the buffer's events as consumed.
+            buffer.DataPos = static_cast<size_t>(buffer.DataHead64);
+            break;
+        }
 
-    if (recordBufferPos + recordSize <= buffer.Size)
-    {
-        // Event does not wrap.
-        p = buffer.Data + recordBufferPos;
-    }
-    else
-    {
-        // Event wraps. We need to double-buffer it.
+        if (0 != (eventHeader.size & 7))
+        {
+            // Unexpected - corrupt event header.
+            DEBUG_PRINTF("CPU%u unaligned eventHeader.Size at pos %lx: %u\n",
+                bufferIndex, (unsigned long)buffer.DataPos, eventHeader.size);
+
+            // The event is corrupt, can't parse beyond it. Mark the buffer's events as consumed.
+            buffer.CorruptBufferCount += 1;
+            buffer.DataPos = static_cast<size_t>(buffer.DataHead64);
+            break;
+        }
 
-        if (m_eventDataBuffer.size() < recordSize)
+        if (buffer.Indexing)
         {
-            try
+            // PERF_SAMPLE_TIME is set (checked by IndexBegin).
+            if (eventHeader.type == PERF_RECORD_SAMPLE && eventHeader.size > bytesBeforeTime)
             {
-                m_eventDataBuffer.resize(recordSize);
+                auto const time = *reinterpret_cast<uint64_t const*>(
+                    buffer.Data + ((eventHeaderBufferPos + bytesBeforeTime) & (buffer.Size - 1)));
+                buffer.Index->AddSample(buffer.DataPos, eventHeader.size, time);
             }
-            catch (...)
+            else
             {
-                m_lostEventCount += 1;
-                return false; // out of memory
+                buffer.Index->AddRecord(buffer.DataPos, eventHeader.size);
             }
         }
 
-        auto const afterWrap = recordBufferPos + recordSize - buffer.Size;
-        auto const beforeWrap = buffer.Size - recordBufferPos;
-        auto const eventDataBuffer = m_eventDataBuffer.data();
-        memcpy(eventDataBuffer, buffer.Data + recordBufferPos, beforeWrap);
-        memcpy(eventDataBuffer + beforeWrap, buffer.Data, afterWrap);
-        p = eventDataBuffer;
-    }
+        buffer.DataPos += eventHeader.size;
 
-    auto const pEnd = p + recordSize;
-    auto const infoSampleTypes = m_sampleType;
-    uint64_t infoId = 0;
-    PerfEventDesc const* infoEventDesc;
-    char const* infoRawData = nullptr;
-    uint32_t infoRawDataSize = 0;
+        if (eventHeader.type == PERF_RECORD_LOST)
+        {
+            auto const newEventsLost64 = *reinterpret_cast<uint64_t const*>(
+                buffer.Data + ((eventHeaderBufferPos + sizeof(perf_event_header) + sizeof(uint64_t)) & (buffer.Size - 1)));
+            buffer.LostEventCount += newEventsLost64;
+            buffer.LostRecordCount += 1;
+            buffer.WindowLostEventCount += newEventsLost64;
+
+            // { header, id, lost, sample_id }: sample_id has the time if sample_id_all.
+            auto const timeFromEnd = NonSampleBytesFromTimeToEnd(m_sampleType);
+            if (timeFromEnd != 0 &&
+                eventHeader.size >= sizeof(perf_event_header) + 2 * sizeof(uint64_t) + timeFromEnd)
+            {
+                auto const time = *reinterpret_cast<uint64_t const*>(
+                    buffer.Data + ((eventHeaderBufferPos + eventHeader.size - timeFromEnd) & (buffer.Size - 1)));
+                if (time < buffer.WindowLostRange.First)
+                {
+                    buffer.WindowLostRange.First = time;
+                }
 
-    perf_event_header const* const infoHeader = reinterpret_cast<perf_event_header const*>(p);
-    p += sizeof(perf_event_header);
+                if (time > buffer.WindowLostRange.Last)
+                {
+                    buffer.WindowLostRange.Last = time;
+                }
+            }
+        }
 
-    auto const SampleTypeSupported = 0u
-        | PERF_SAMPLE_IDENTIFIER
-        | PERF_SAMPLE_IP
-        | PERF_SAMPLE_TID
-        | PERF_SAMPLE_TIME
-        | PERF_SAMPLE_ADDR
-        | PERF_SAMPLE_ID
-        | PERF_SAMPLE_STREAM_ID
-        | PERF_SAMPLE_CPU
-        | PERF_SAMPLE_PERIOD
-        | PERF_SAMPLE_CALLCHAIN
-        | PERF_SAMPLE_RAW;
-    static_assert(
-        SampleTypeSupported == TracepointSessionOptions::SampleTypeSupported,
-        "SampleTypeSupported out of sync");
+        if (recordFn(buffer, eventHeader.size, eventHeaderBufferPos))
+        {
+            return true;
+        }
+    }
 
-    auto const SampleTypeDefault = 0u
-        | PERF_SAMPLE_IDENTIFIER
-        | PERF_SAMPLE_TID
-        | PERF_SAMPLE_TIME
-        | PERF_SAMPLE_CPU
-        | PERF_SAMPLE_RAW;
-    static_assert(
-        SampleTypeDefault == TracepointSessionOptions::SampleTypeDefault,
-        "SampleTypeDefault out of sync");
+    return false;
+}
+
+_Success_(return == 0) int
+TracepointSession::SetTracepointEnableState(
+    TracepointInfoImpl & tpi,
+    bool enabled) noexcept
+{
+    int error;
+
+    static auto const UnknownState = TracepointEnableState::Unknown;
+    auto const desiredState = enabled
+        ? TracepointEnableState::Enabled
+        : TracepointEnableState::Disabled;
 
-    // Fast path for default sample type.
-    if (infoSampleTypes == SampleTypeDefault)
+    if (desiredState == tpi.m_enableState)
     {
-        if (recordSize <
-            sizeof(perf_event_header) +
-            sizeof(uint64_t) + // PERF_SAMPLE_IDENTIFIER
-            sizeof(uint64_t) + // PERF_SAMPLE_TID
-            sizeof(uint64_t) + // PERF_SAMPLE_TIME
-            sizeof(uint64_t) + // PERF_SAMPLE_CPU
-            sizeof(uint64_t))  // PERF_SAMPLE_RAW
-        {
-            goto Error;
-        }
+        error = 0;
+        goto Done;
+    }
 
-        // PERF_SAMPLE_IDENTIFIER
-        infoId = *reinterpret_cast<uint64_t const*>(p);
-        p += sizeof(uint64_t);
+    tpi.m_enableState = UnknownState;
 
-        // PERF_SAMPLE_TID
-        auto const pTid = reinterpret_cast<uint32_t const*>(p);
-        m_enumEventInfo.pid = pTid[0];
-        m_enumEventInfo.tid = pTid[1];
-        p += sizeof(uint64_t);
+    error = IoctlForEachFile(
+        tpi.m_bufferFiles.get(),
+        tpi.m_bufferFilesCount,
+        enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE,
+        nullptr);
+    if (error == 0)
+    {
+        tpi.m_enableState = desiredState;
+    }
+
+Done:
 
-        // PERF_SAMPLE_TIME
-        m_enumEventInfo.time = *reinterpret_cast<uint64_t const*>(p);
-        p += sizeof(uint64_t);
+    return error;
+}
 
-        // PERF_SAMPLE_CPU
-        auto const pCpu = reinterpret_cast<uint32_t const*>(p);
-        m_enumEventInfo.cpu = pCpu[0];
-        m_enumEventInfo.cpu_reserved = pCpu[1];
-        p += sizeof(uint64_t);
+_Success_(return == 0) int
+TracepointSession::AddTracepoint(
+    PerfEventMetadata const& metadata,
+    TracepointEnableState enableState,
+    uint32_t group) noexcept(false)
+{
+    int error;
+    TracepointInfoImpl* pTpi = nullptr;
 
-        // PERF_SAMPLE_RAW
-        goto PerfSampleRaw;
-    }
+    assert(group < m_bufferGroupCount);
+    auto const realtime = m_buffers[group * m_groupBufferCount].Realtime;
 
-    if (infoSampleTypes & PERF_SAMPLE_IDENTIFIER)
+    error = AddTracepointInfo(metadata, enableState, group, &pTpi);
+    if (error)
     {
-        if (p == pEnd) goto Error;
-        infoId = *reinterpret_cast<uint64_t const*>(p);
-        p += sizeof(uint64_t);
+        goto Done;
     }
 
-    if (infoSampleTypes & PERF_SAMPLE_IP)
-    {
-        if (p == pEnd) goto Error;
-        m_enumEventInfo.ip = *reinterpret_cast<uint64_t const*>(p);
-        p += sizeof(uint64_t);
-    }
+    // Starting from here, if there is an error then we must RemoveTracepointInfo.
 
-    if (infoSampleTypes & PERF_SAMPLE_TID)
+    error = OpenTracepointFiles(*pTpi);
+    if (error)
     {
-        if (p == pEnd) goto Error;
-        auto const pTid = reinterpret_cast<uint32_t const*>(p);
-        m_enumEventInfo.pid = pTid[0];
-        m_enumEventInfo.tid = pTid[1];
-        p += sizeof(uint64_t);
+        goto Error;
     }
 
-    if (infoSampleTypes & PERF_SAMPLE_TIME)
+    if ((m_standbyBuffers || m_bufferGroupCount > 1 || m_adaptiveMaxSize != 0) && !m_bufferLeaderFiles)
     {
-        if (p == pEnd) goto Error;
-        m_enumEventInfo.time = *reinterpret_cast<uint64_t const*>(p);
-        p += sizeof(uint64_t);
-    }
+        // The buffers are owned by dummy events, not by the first tracepoint,
+        // because mmapped events cannot be redirected to the standby (or
+        // resized) buffer, and because the first tracepoint only has files
+        // for one group.
+        error = CreateBufferOwners();
+        if (error)
+        {
+            goto Error;
+        }
 
-    if (infoSampleTypes & PERF_SAMPLE_ADDR)
-    {
-        if (p == pEnd) goto Error;
-        m_enumEventInfo.addr = *reinterpret_cast<uint64_t const*>(p);
-        p += sizeof(uint64_t);
+        error = IoctlForEachFile(pTpi->m_bufferFiles.get(), m_bufferCount, PERF_EVENT_IOC_SET_OUTPUT, m_bufferLeaderFiles);
+        if (error)
+        {
+            goto Error;
+        }
     }
-
-    if (infoSampleTypes & PERF_SAMPLE_ID)
+    else if (!m_bufferLeaderFiles)
     {
-        if (p == pEnd) goto Error;
-        infoId = *reinterpret_cast<uint64_t const*>(p);
-        p += sizeof(uint64_t);
-    }
+        // This is the first event. Make it the "leader" (the owner of the session buffers).
+        assert(m_bufferGroupCount == 1);
+        auto const prot = realtime
+            ? PROT_READ | PROT_WRITE
+            : PROT_READ;
+        for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+        {
+            if (m_buffers[bufferIndex].Size == 0)
+            {
+                continue;
+            }
 
-    if (infoSampleTypes & PERF_SAMPLE_STREAM_ID)
-    {
-        if (p == pEnd) goto Error;
-        m_enumEventInfo.stream_id = *reinterpret_cast<uint64_t const*>(p);
-        p += sizeof(uint64_t);
-    }
+            auto const mmapSize = m_pageSize + m_buffers[bufferIndex].Size;
 
-    if (infoSampleTypes & PERF_SAMPLE_CPU)
-    {
-        if (p == pEnd) goto Error;
-        auto const pCpu = reinterpret_cast<uint32_t const*>(p);
-        m_enumEventInfo.cpu = pCpu[0];
-        m_enumEventInfo.cpu_reserved = pCpu[1];
-        p += sizeof(uint64_t);
-    }
+            errno = 0;
+            auto cpuMap = mmap(nullptr, mmapSize, prot, MAP_SHARED, pTpi->m_bufferFiles[bufferIndex].get(), 0);
+            if (MAP_FAILED == cpuMap)
+            {
+                error = errno;
 
-    if (infoSampleTypes & PERF_SAMPLE_PERIOD)
-    {
-        if (p == pEnd) goto Error;
-        m_enumEventInfo.period = *reinterpret_cast<uint64_t const*>(p);
-        p += sizeof(uint64_t);
-    }
+                // Clean up any mmaps that we opened.
+                for (uint32_t bufferIndex2 = 0; bufferIndex2 != bufferIndex; bufferIndex2 += 1)
+                {
+                    m_buffers[bufferIndex2].Mmap.reset();
+                    m_buffers[bufferIndex2].Data = nullptr;
+                }
 
-    if (infoSampleTypes & PERF_SAMPLE_CALLCHAIN)
-    {
-        if (p == pEnd) goto Error;
-        auto const infoCallchain = reinterpret_cast<uint64_t const*>(p);
-        m_enumEventInfo.callchain = infoCallchain;
-        auto const count = *infoCallchain;
-        p += sizeof(uint64_t);
+                if (error == 0)
+                {
+                    error = ENODEV;
+                }
 
-        if ((pEnd - p) / sizeof(uint64_t) < count)
-        {
-            goto Error;
+                goto Error;
+            }
+
+            m_buffers[bufferIndex].Mmap.reset(cpuMap, mmapSize);
+            m_buffers[bufferIndex].Data = static_cast<uint8_t*>(cpuMap) + m_pageSize;
         }
-        p += count * sizeof(uint64_t);
     }
 
-    if (infoSampleTypes & PERF_SAMPLE_RAW)
+    error = CommitTracepointInfo(*pTpi);
+    if (error)
     {
-        if (p == pEnd) goto Error;
+        goto Error;
+    }
 
-    PerfSampleRaw:
+    goto Done;
 
-        assert(p < pEnd);
+Error:
 
-        auto const* pRaw = reinterpret_cast<uint32_t const*>(p);
-        infoRawDataSize = pRaw[0];
-        infoRawData = reinterpret_cast<char const*>(pRaw + 1);
-        if ((pEnd - p) - sizeof(uint32_t) < infoRawDataSize)
-        {
-            goto Error;
-        }
+    RemoveTracepointInfo(*pTpi);
 
-        assert(p + sizeof(uint32_t) + infoRawDataSize <= pEnd);
+Done:
 
-        // Try to look up eventDesc by common type field:
+    return error;
+}
 
-        decltype(m_tracepointInfoByCommonType.end()) infoIt;
-        auto const commonTypeOffset = static_cast<uint32_t>(m_cache.CommonTypeOffset());
-        auto const commonTypeSize = m_cache.CommonTypeSize();
-        if (infoRawDataSize <= commonTypeOffset ||
-            infoRawDataSize - commonTypeOffset <= commonTypeSize)
+_Success_(return == 0) int
+TracepointSession::AddTracepointInfo(
+    PerfEventMetadata const& metadata,
+    TracepointEnableState enableState,
+    uint32_t group,
+    _Out_ TracepointInfoImpl** ppTpi) noexcept
+{
+    int error;
+    TracepointInfoImpl* pTpi = nullptr;
+
+    assert(group < m_bufferGroupCount);
+    auto const groupBegin = group * m_groupBufferCount;
+    auto const groupEnd = groupBegin + m_groupBufferCount;
+    auto const realtime = m_buffers[groupBegin].Realtime;
+
+    try
+    {
+        auto const systemName = metadata.SystemName();
+        auto const eventName = metadata.Name();
+        if (systemName.size() > 65535 ||
+            eventName.size() > 65535)
         {
-            infoIt = m_tracepointInfoByCommonType.end();
+            error = E2BIG;
+            goto Done;
         }
-        else if (commonTypeSize == sizeof(uint16_t))
+
+        // With CpuHotplug, leave room for the IDs of CPUs that come online later.
+        uint32_t nonzeroBufferCount = 0;
+        uint32_t idsCapacity = 0;
+        for (uint32_t i = groupBegin; i != groupEnd; i += 1)
         {
-            uint16_t commonType;
-            memcpy(&commonType, infoRawData + commonTypeOffset, sizeof(commonType));
-            infoIt = m_tracepointInfoByCommonType.find(commonType);
+            if (m_buffers[i].Size != 0)
+            {
+                nonzeroBufferCount += 1;
+            }
+
+            if (m_buffers[i].OnlineSize != 0 || m_buffers[i].Size != 0)
+            {
+                idsCapacity += 1;
+            }
         }
-        else if (commonTypeSize == sizeof(uint32_t))
+
+        // We don't use the fields that were added after v3 (except
+        // sample_max_stack, v5, if CallchainLimits set it). Allocate space for
+        // the full structure (we expose the structure to users) but don't ask
+        // the kernel to look at the other new fields.
+        unsigned constexpr PerfEventAttrSizeUsed = PERF_ATTR_SIZE_VER3;
+        bool const useMaxStack = m_callchainMaxStack != 0 && (m_sampleType & PERF_SAMPLE_CALLCHAIN);
+
+        auto const cbEventDescStorage =
+            sizeof(perf_event_attr) +
+            idsCapacity * sizeof(uint64_t) +
+            systemName.size() + 1 + eventName.size() + 1;
+        auto eventDescStorage = std::make_unique<char unsigned[]>(cbEventDescStorage);
+
+        auto const pAttr = reinterpret_cast<perf_event_attr*>(eventDescStorage.get());
+        pAttr->type = PERF_TYPE_TRACEPOINT;
+        pAttr->size = useMaxStack ? PERF_ATTR_SIZE_VER5 : PerfEventAttrSizeUsed;
+        pAttr->config = metadata.Id();
+        pAttr->disabled = enableState != TracepointEnableState::Enabled;
+        pAttr->inherit = m_targetInherit;
+        pAttr->sample_period = 1;
+        pAttr->sample_type = m_sampleType;
+        pAttr->read_format = PERF_FORMAT_ID; // Must align with the definition of struct ReadFormat.
+        pAttr->watermark = m_wakeupUseWatermark;
+        pAttr->use_clockid = 1;
+        pAttr->sample_id_all = 1; // Non-sample records (e.g. PERF_RECORD_LOST) get time, cpu, id.
+        pAttr->write_backward = !realtime;
+        pAttr->wakeup_events = m_wakeupValue;
+        pAttr->clockid = m_sessionInfo.Clockid();
+        static_assert(offsetof(perf_event_attr, clockid) < PerfEventAttrSizeUsed);
+        pAttr->exclude_callchain_kernel = m_callchainExcludeKernel;
+        pAttr->exclude_callchain_user = m_callchainExcludeUser;
+        if (useMaxStack)
         {
-            uint32_t commonType;
-            memcpy(&commonType, infoRawData + commonTypeOffset, sizeof(commonType));
-            infoIt = m_tracepointInfoByCommonType.find(commonType);
+            pAttr->sample_max_stack = m_callchainMaxStack;
+            static_assert(offsetof(perf_event_attr, sample_max_stack) < PERF_ATTR_SIZE_VER5);
         }
-        else
+
+        // pIds will be initialized by OpenTracepointFiles.
+        auto const pIds = reinterpret_cast<uint64_t*>(pAttr + 1);
+
+        auto const pName = reinterpret_cast<char*>(pIds + idsCapacity);
         {
-            assert(commonTypeSize == 1);
-            uint8_t commonType;
-            memcpy(&commonType, infoRawData + commonTypeOffset, sizeof(commonType));
-            infoIt = m_tracepointInfoByCommonType.find(commonType);
+            size_t i = 0;
+            memcpy(&pName[i], systemName.data(), systemName.size());
+            i += systemName.size();
+            pName[i] = ':';
+            i += 1;
+            memcpy(&pName[i], eventName.data(), eventName.size());
+            i += eventName.size();
+            pName[i] = '\0';
+        }
+
+        PerfEventDesc const eventDesc = {
+            pAttr,
+            pName,
+            &metadata,
+            pIds,
+            nonzeroBufferCount
+        };
+
+        auto er = m_tracepointInfoByCommonType.try_emplace(metadata.Id(),
+            eventDesc,
+            std::move(eventDescStorage),
+            std::make_unique<unique_fd[]>(m_bufferCount),
+            m_bufferCount);
+        assert(er.second);
+        pTpi = &er.first->second;
+        pTpi->m_bufferGroup = group;
+        pTpi->m_enableState = enableState;
+        error = 0;
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+    }
+
+Done:
+
+    *ppTpi = pTpi;
+    return error;
+}
+
+_Success_(return == 0) int
+TracepointSession::OpenTracepointFiles(TracepointInfoImpl& tpi) const noexcept
+{
+    int error = 0;
+    auto const groupBegin = tpi.m_bufferGroup * m_groupBufferCount;
+    auto const groupEnd = groupBegin + m_groupBufferCount;
+
+    // The attr is part of tpi.m_eventDescStorage.
+    auto const pAttr = const_cast<perf_event_attr*>(tpi.m_eventDesc.attr);
+
+    // tpi.m_bufferFiles has a slot for every buffer of every group, but only
+    // the slots for this tracepoint's group are used.
+    for (uint32_t bufferIndex = groupBegin; bufferIndex != groupEnd; bufferIndex += 1)
+    {
+        if (m_buffers[bufferIndex].Size == 0)
+        {
+            continue;
         }
 
-        if (infoIt != m_tracepointInfoByCommonType.end())
+        errno = 0;
+        tpi.m_bufferFiles[bufferIndex].reset(PerfEventOpenForBuffer(pAttr, bufferIndex, false));
+        if (!tpi.m_bufferFiles[bufferIndex])
         {
-            infoEventDesc = &infoIt->second.m_eventDesc;
-            goto Done;
+            error = errno;
+            if (error == 0)
+            {
+                error = ENODEV;
+            }
+
+            return error;
         }
     }
-    else
+
+    if (m_bufferLeaderFiles)
     {
-        assert(p <= pEnd);
+        // Leader already exists. Add this event to the leader's mmaps.
+        error = IoctlForEachFile(tpi.m_bufferFiles.get(), m_bufferCount, PERF_EVENT_IOC_SET_OUTPUT, m_bufferLeaderFiles);
+        if (error)
+        {
+            return error;
+        }
     }
 
-    if (infoSampleTypes & (PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_ID))
+    // Find the sample_ids for the new tracepoint. The ids array is part of
+    // tpi.m_eventDescStorage.
+    auto const pIds = const_cast<uint64_t*>(tpi.m_eventDesc.ids);
+    uint32_t cIds = 0;
+    for (uint32_t i = 0; i != m_bufferCount; i += 1)
     {
-        // Try to look up eventDesc by sample id:
+        if (!tpi.m_bufferFiles[i])
+        {
+            continue;
+        }
 
-        auto infoIt = m_tracepointInfoBySampleId.find(infoId);
-        if (infoIt != m_tracepointInfoBySampleId.end())
+        ReadFormat data;
+        error = tpi.Read(i, &data);
+        if (error != 0)
         {
-            infoEventDesc = &infoIt->second->m_eventDesc;
-            goto Done;
+            return error;
         }
+
+        pIds[cIds] = data.id;
+        cIds += 1;
     }
 
-    // Unable to locate eventDesc.
-    goto Error;
+    assert(cIds == tpi.m_eventDesc.ids_count);
+    return 0;
+}
 
-Done:
+_Success_(return == 0) int
+TracepointSession::CommitTracepointInfo(TracepointInfoImpl& tpi) noexcept
+{
+    int error;
+    uint32_t cIdsAdded = 0;
+    auto const pIds = tpi.m_eventDesc.ids;
 
-    m_enumEventInfo.event_desc = infoEventDesc;
-    m_enumEventInfo.session_info = &m_sessionInfo;
-    m_enumEventInfo.header = infoHeader;
-    m_enumEventInfo.id = infoId;
-    m_enumEventInfo.raw_data = infoRawData;
-    m_enumEventInfo.raw_data_size = infoRawDataSize;
+    try
+    {
+        for (; cIdsAdded != tpi.m_eventDesc.ids_count; cIdsAdded += 1)
+        {
+            auto const added = m_tracepointInfoBySampleId.emplace(pIds[cIdsAdded], &tpi).second;
+            assert(added);
+            (void)added;
+        }
 
-    m_sampleEventCount += 1;
-    return true;
+        IndexTracepointInfo(tpi); // may throw bad_alloc.
 
-Error:
+        // Success. Commit it. (No exceptions beyond this point.)
 
-    assert(p <= pEnd);
+        if (!m_bufferLeaderFiles)
+        {
+            m_bufferLeaderFiles = tpi.m_bufferFiles.get(); // Commit this event as the leader.
+        }
+
+        error = 0;
+    }
+    catch (...)
+    {
+        for (uint32_t i = 0; i != cIdsAdded; i += 1)
+        {
+            m_tracepointInfoBySampleId.erase(pIds[i]);
+        }
 
-    m_enumEventInfo.event_desc = {};
-    m_enumEventInfo.session_info = {};
-    m_enumEventInfo.header = {};
-    m_enumEventInfo.id = {};
-    m_enumEventInfo.raw_data = {};
-    m_enumEventInfo.raw_data_size = {};
+        error = ENOMEM;
+    }
 
-    m_corruptEventCount += 1;
-    return false;
+    return error;
 }
 
 void
-TracepointSession::EnumeratorEnd(uint32_t bufferIndex) const noexcept
+TracepointSession::RemoveTracepointInfo(TracepointInfoImpl& tpi) noexcept
 {
-    auto const& buffer = m_buffers[bufferIndex];
-    assert(buffer.Size != 0);
+    assert(m_bufferLeaderFiles != tpi.m_bufferFiles.get());
+
+    // Closes the tracepoint's files.
+    m_tracepointInfoByCommonType.erase(tpi.m_eventDesc.metadata->Id());
+}
 
-    if (!IsRealtime())
+_Success_(return == 0) int
+TracepointSession::OpenTracepointCpuFile(TracepointInfoImpl& tpi, uint32_t bufferIndex) noexcept
+{
+    int error;
+    auto& file = tpi.m_bufferFiles[bufferIndex];
+    assert(!file);
+
+    // Open with the tracepoint's current enable state. The attr is part of
+    // tpi.m_eventDescStorage, and its other settings are current.
+    auto const pAttr = const_cast<perf_event_attr*>(tpi.m_eventDesc.attr);
+    auto const disabled = pAttr->disabled;
+    pAttr->disabled = tpi.m_enableState != TracepointEnableState::Enabled;
+    errno = 0;
+    file.reset(PerfEventOpenForBuffer(pAttr, bufferIndex, false));
+    pAttr->disabled = disabled;
+    if (!file)
     {
-        // Should not change while collection paused.
-        assert(buffer.DataHead64 == __atomic_load_n(
-            &static_cast<perf_event_mmap_page const*>(buffer.Mmap.get())->data_head,
-            __ATOMIC_RELAXED));
+        error = errno ? errno : ENODEV;
+        goto Done;
+    }
 
-        int error = ioctl(m_bufferLeaderFiles[bufferIndex].get(), PERF_EVENT_IOC_PAUSE_OUTPUT, 0);
+    errno = 0;
+    if ((tpi.m_filter && -1 == ioctl(file.get(), PERF_EVENT_IOC_SET_FILTER, tpi.m_filter.get())) ||
+        (tpi.m_bpfProgramFile && -1 == ioctl(file.get(), PERF_EVENT_IOC_SET_BPF, tpi.m_bpfProgramFile.get())) ||
+        (m_bufferLeaderFiles != tpi.m_bufferFiles.get() &&
+            -1 == ioctl(file.get(), PERF_EVENT_IOC_SET_OUTPUT, m_bufferLeaderFiles[bufferIndex].get())))
+    {
+        error = errno ? errno : ENODEV;
+        goto Error;
+    }
+
+    {
+        ReadFormat data;
+        error = tpi.Read(bufferIndex, &data);
         if (error != 0)
         {
-            DEBUG_PRINTF("CPU%u unpause error %u\n", bufferIndex, error);
+            goto Error;
         }
-    }
-    else if (buffer.DataPos != buffer.DataTail)
-    {
-        // Create a new 64-bit tail value.
-        uint64_t newTail64;
-        static_assert(sizeof(buffer.DataPos) == 8 || sizeof(buffer.DataPos) == 4);
-        if constexpr (sizeof(buffer.DataPos) == 8)
+
+        try
         {
-            newTail64 = buffer.DataPos;
+            auto const added = m_tracepointInfoBySampleId.emplace(data.id, &tpi).second;
+            assert(added);
+            (void)added;
         }
-        else
+        catch (...)
         {
-            // Convert m_bufferDataPos to a 64-bit value relative to m_bufferDataHead64.
-            // Order of operations needs to be careful about 64-bit wrapping, e.g.
-            // - DataHead64 = 0x600000000
-            // - DataHead32 = 0x000000000
-            // - DataPos32  = 0x0FFFFFFF8
-            // Correct newTail64 is 0x5FFFFFFF8, not 0x6FFFFFFF8
-            newTail64 = buffer.DataHead64 - (static_cast<size_t>(buffer.DataHead64) - buffer.DataPos);
+            error = ENOMEM;
+            goto Error;
         }
 
-        assert(buffer.DataHead64 - newTail64 <= buffer.Size);
-
-        auto const bufferHeader = static_cast<perf_event_mmap_page*>(buffer.Mmap.get());
+        // AddCpuBuffers made room in the index.
+        assert(m_tracepointInfoBySampleId.size() <= m_tracepointInfoBySampleIdIndex.size() / 2);
+        SampleIdIndexAdd(m_tracepointInfoBySampleIdIndex, data.id, &tpi);
 
-        // ATOMIC_RELEASE: perf_events.h recommends smp_mb() here.
-        // For future consideration: Ordered enumerator could probably merge barriers.
-        // For future consideration: This probably just needs a compiler barrier.
-        __atomic_store_n(&bufferHeader->data_tail, newTail64, __ATOMIC_RELEASE);
+        // The ids array is part of tpi.m_eventDescStorage, with room for every
+        // CPU that can come online.
+        const_cast<uint64_t*>(tpi.m_eventDesc.ids)[tpi.m_eventDesc.ids_count] = data.id;
+        tpi.m_eventDesc.ids_count += 1;
     }
+
+    goto Done;
+
+Error:
+
+    file.reset();
+
+Done:
+
+    return error;
 }
 
-void
-TracepointSession::EnumeratorBegin(uint32_t bufferIndex) noexcept
+_Success_(return == 0) int
+TracepointSession::AddCpuBuffers(uint32_t cpu) noexcept
 {
-    auto const realtime = IsRealtime();
-    if (!realtime)
+    int error = 0;
+
+    if (!m_bufferLeaderFiles)
     {
-        int error = ioctl(m_bufferLeaderFiles[bufferIndex].get(), PERF_EVENT_IOC_PAUSE_OUTPUT, 1);
-        if (error != 0)
+        // No tracepoints yet, so no buffers yet. AddTracepoint will create them.
+        for (uint32_t bufferIndex = cpu; bufferIndex < m_bufferCount; bufferIndex += m_groupBufferCount)
         {
-            DEBUG_PRINTF("CPU%u pause error %u\n", bufferIndex, error);
+            m_buffers[bufferIndex].Size = m_buffers[bufferIndex].OnlineSize;
         }
-    }
-
-    auto& buffer = m_buffers[bufferIndex];
-    auto const bufferHeader = static_cast<perf_event_mmap_page const*>(buffer.Mmap.get());
 
-    // ATOMIC_ACQUIRE: perf_events.h recommends smp_rmb() here.
-    // For future consideration: Ordered enumerator could probably merge barriers.
-    buffer.DataHead64 = __atomic_load_n(&bufferHeader->data_head, __ATOMIC_ACQUIRE);
+        m_onlineCpus[cpu] = true;
+        return 0;
+    }
 
-    if (0 != (buffer.DataHead64 & 7) ||
-        m_pageSize != bufferHeader->data_offset ||
-        buffer.Size != bufferHeader->data_size)
+    // Make room in the sample ID index for one new ID per tracepoint, so that
+    // the IDs can be indexed without allocating.
+    try
     {
-        // Unexpected - corrupt trace buffer.
-        DEBUG_PRINTF("CPU%u bad perf_event_mmap_page: head=%llx offset=%lx size=%lx\n",
-            bufferIndex,
-            (unsigned long long)buffer.DataHead64,
-            (unsigned long)bufferHeader->data_offset,
-            (unsigned long)bufferHeader->data_size);
-        buffer.DataTail = static_cast<size_t>(buffer.DataHead64) - buffer.Size;
-        buffer.DataPos = static_cast<size_t>(buffer.DataHead64);
-        m_corruptBufferCount += 1;
+        auto const idCount = m_tracepointInfoBySampleId.size() + m_tracepointInfoByCommonType.size();
+        if (idCount > m_tracepointInfoBySampleIdIndex.size() / 2)
+        {
+            RebuildSampleIdIndex(idCount);
+        }
     }
-    else if (!realtime)
+    catch (...)
     {
-        // Circular: write_backward == 1
-        buffer.DataTail = static_cast<size_t>(buffer.DataHead64) - buffer.Size;
-        buffer.DataPos = buffer.DataTail;
+        return ENOMEM;
     }
-    else
+
+    // Create the CPU's buffers.
+    if (m_bufferOwnerFiles)
     {
-        // Realtime: write_backward == 0
-        auto const bufferDataTail64 = bufferHeader->data_tail;
-        buffer.DataTail = static_cast<size_t>(bufferDataTail64);
-        if (buffer.DataHead64 - bufferDataTail64 > buffer.Size)
-        {
-            // Unexpected - assume bad tail pointer.
-            DEBUG_PRINTF("CPU%u bad data_tail: head=%llx tail=%llx\n",
-                bufferIndex,
-                (unsigned long long)buffer.DataHead64,
-                (unsigned long long)bufferDataTail64);
-            buffer.DataTail = static_cast<size_t>(buffer.DataHead64) - buffer.Size; // Ensure tail gets updated.
-            buffer.DataPos = static_cast<size_t>(buffer.DataHead64);
-            m_corruptBufferCount += 1;
-        }
-        else
+        for (uint32_t bufferIndex = cpu; bufferIndex < m_bufferCount; bufferIndex += m_groupBufferCount)
         {
-            buffer.DataPos = buffer.DataTail;
-        }
-    }
-}
+            auto& buffer = m_buffers[bufferIndex];
+            if (buffer.OnlineSize == 0)
+            {
+                continue;
+            }
 
-template<class RecordFn>
-bool
-TracepointSession::EnumeratorMoveNext(
-    uint32_t bufferIndex,
-    RecordFn&& recordFn) noexcept(noexcept(recordFn(std::declval<BufferInfo>(), 0u, 0u)))
-{
-    auto& buffer = m_buffers[bufferIndex];
-    assert(buffer.Mmap);
-    assert(buffer.Mmap.get() == buffer.Data - m_pageSize);
-    assert(buffer.Mmap.get_size() == buffer.Size + m_pageSize);
+            buffer.Size = buffer.OnlineSize;
+            error = CreateBufferOwner(bufferIndex, m_bufferOwnerFiles.get());
+            if (error)
+            {
+                goto Error;
+            }
 
-    for (;;)
+            if (buffer.Realtime)
+            {
+                __atomic_fetch_add(&m_adaptiveBufferBytes, static_cast<uint64_t>(buffer.Size), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    else
     {
-        auto const remaining = static_cast<size_t>(buffer.DataHead64) - buffer.DataPos;
-        if (remaining == 0)
+        // Leader mode (one group): the leader tracepoint's file owns the buffer.
+        assert(m_bufferGroupCount == 1);
+        auto& buffer = m_buffers[cpu];
+        if (buffer.OnlineSize != 0)
         {
-            break;
-        }
+            TracepointInfoImpl* leader = nullptr;
+            for (auto& pair : m_tracepointInfoByCommonType)
+            {
+                if (pair.second.m_bufferFiles.get() == m_bufferLeaderFiles)
+                {
+                    leader = &pair.second;
+                    break;
+                }
+            }
 
-        auto const eventHeaderBufferPos = buffer.DataPos & (buffer.Size - 1);
-        auto const eventHeader = *BufferDataPosToHeader(buffer.Data, eventHeaderBufferPos);
+            assert(leader != nullptr);
+            buffer.Size = buffer.OnlineSize;
+            error = OpenTracepointCpuFile(*leader, cpu);
+            if (error)
+            {
+                goto Error;
+            }
 
-        if (eventHeader.size == 0 ||
-            eventHeader.size > remaining)
-        {
-            // - Circular: this is probably not a real problem - it's probably
-            //   unused buffer space or a partially-overwritten event.
-            // - Realtime: The buffer is corrupt.
-            m_corruptBufferCount += IsRealtime();
+            auto const prot = buffer.Realtime
+                ? PROT_READ | PROT_WRITE
+                : PROT_READ;
+            auto const mmapSize = m_pageSize + buffer.Size;
+            errno = 0;
+            auto const cpuMap = mmap(nullptr, mmapSize, prot, MAP_SHARED, m_bufferLeaderFiles[cpu].get(), 0);
+            if (MAP_FAILED == cpuMap)
+            {
+                error = errno ? errno : ENODEV;
+                leader->m_bufferFiles[cpu].reset(); // Its sample ID stays registered, but it has no events.
+                goto Error;
+            }
 
-            // In either case, buffer is done. Mark the buffer's events as consumed.
-            buffer.DataPos = static_cast<size_t>(buffer.DataHead64);
-            break;
+            buffer.Mmap.reset(cpuMap, mmapSize);
+            buffer.Data = static_cast<uint8_t*>(cpuMap) + m_pageSize;
         }
+    }
 
-        if (0 != (eventHeader.size & 7))
-        {
-            // Unexpected - corrupt event header.
-            DEBUG_PRINTF("CPU%u unaligned eventHeader.Size at pos %lx: %u\n",
-                bufferIndex, (unsigned long)buffer.DataPos, eventHeader.size);
+    m_onlineCpus[cpu] = true;
 
-            // The event is corrupt, can't parse beyond it. Mark the buffer's events as consumed.
-            m_corruptBufferCount += 1;
-            buffer.DataPos = static_cast<size_t>(buffer.DataHead64);
-            break;
+    // Attach each tracepoint to the new buffers. A tracepoint that fails is
+    // not collected on this CPU.
+    for (auto& pair : m_tracepointInfoByCommonType)
+    {
+        auto& tpi = pair.second;
+        auto const bufferIndex = tpi.m_bufferGroup * m_groupBufferCount + cpu;
+        if (m_buffers[bufferIndex].Size == 0 || tpi.m_bufferFiles[bufferIndex])
+        {
+            continue; // Not collected on this CPU, or the leader (already open).
         }
 
-        buffer.DataPos += eventHeader.size;
-
-        if (eventHeader.type == PERF_RECORD_LOST)
+        auto const tpError = OpenTracepointCpuFile(tpi, bufferIndex);
+        if (error == 0)
         {
-            auto const newEventsLost64 = *reinterpret_cast<uint64_t const*>(
-                buffer.Data + ((eventHeaderBufferPos + sizeof(perf_event_header) + sizeof(uint64_t)) & (buffer.Size - 1)));
-            m_lostEventCount += newEventsLost64;
+            error = tpError;
         }
+    }
 
-        if (recordFn(buffer, eventHeader.size, eventHeaderBufferPos))
+    if (m_epollFile)
+    {
+        for (uint32_t bufferIndex = cpu; bufferIndex < m_bufferCount; bufferIndex += m_groupBufferCount)
         {
-            return true;
+            if (m_buffers[bufferIndex].Size != 0 && m_buffers[bufferIndex].Realtime)
+            {
+                epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.u32 = bufferIndex;
+                if (0 != epoll_ctl(m_epollFile.get(), EPOLL_CTL_ADD, m_bufferLeaderFiles[bufferIndex].get(), &ev))
+                {
+                    m_epollFile.reset(); // Rebuilt by the next WaitForReadyBuffers.
+                }
+            }
         }
     }
 
-    return false;
-}
-
-_Success_(return == 0) int
-TracepointSession::SetTracepointEnableState(
-    TracepointInfoImpl & tpi,
-    bool enabled) noexcept
-{
-    int error;
+    return error;
 
-    static auto const UnknownState = TracepointEnableState::Unknown;
-    auto const desiredState = enabled
-        ? TracepointEnableState::Enabled
-        : TracepointEnableState::Disabled;
+Error:
 
-    if (desiredState == tpi.m_enableState)
+    // Undo the buffers. The CPU is retried on the next UpdateOnlineCpus.
+    for (uint32_t bufferIndex = cpu; bufferIndex < m_bufferCount; bufferIndex += m_groupBufferCount)
     {
-        error = 0;
-        goto Done;
-    }
-
-    tpi.m_enableState = UnknownState;
+        auto& buffer = m_buffers[bufferIndex];
+        if (buffer.Mmap && buffer.Realtime && m_bufferOwnerFiles)
+        {
+            __atomic_fetch_sub(&m_adaptiveBufferBytes, static_cast<uint64_t>(buffer.Size), __ATOMIC_RELAXED);
+        }
 
-    error = IoctlForEachFile(
-        tpi.m_bufferFiles.get(),
-        tpi.m_bufferFilesCount,
-        enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE,
-        nullptr);
-    if (error == 0)
-    {
-        tpi.m_enableState = desiredState;
+        buffer.Mmap.reset();
+        buffer.Data = nullptr;
+        buffer.StandbyMmap.reset();
+        buffer.StandbyData = nullptr;
+        buffer.Size = 0;
+        buffer.Index.reset();
+        if (m_bufferOwnerFiles)
+        {
+            m_bufferOwnerFiles[bufferIndex].reset();
+            if (m_standbyBuffers)
+            {
+                m_bufferOwnerFiles[m_bufferCount + bufferIndex].reset();
+            }
+        }
     }
 
-Done:
-
     return error;
 }
 
-_Success_(return == 0) int
-TracepointSession::AddTracepoint(
-    PerfEventMetadata const& metadata,
-    TracepointEnableState enableState) noexcept(false)
+bool
+TracepointSession::RemoveCpuBuffers(uint32_t cpu) noexcept
 {
-    int error;
-    uint32_t cIdsAdded = 0;
-    uint64_t* pIds = nullptr;
-
-    try
+    for (uint32_t bufferIndex = cpu; bufferIndex < m_bufferCount; bufferIndex += m_groupBufferCount)
     {
-        auto const systemName = metadata.SystemName();
-        auto const eventName = metadata.Name();
-        if (systemName.size() > 65535 ||
-            eventName.size() > 65535)
+        auto const& buffer = m_buffers[bufferIndex];
+        if (buffer.Size == 0 || !buffer.Mmap)
+        {
+            continue;
+        }
+
+        if (!buffer.Realtime || buffer.ResizeMmap)
+        {
+            return false; // Circular buffers hold the history. Keep them.
+        }
+
+        auto const bufferHeader = static_cast<perf_event_mmap_page const*>(buffer.Mmap.get());
+        if (__atomic_load_n(&bufferHeader->data_head, __ATOMIC_ACQUIRE) != bufferHeader->data_tail)
         {
-            error = E2BIG;
-            goto Error;
+            return false; // Not drained yet.
         }
+    }
 
-        uint32_t nonzeroBufferCount = 0;
-        for (uint32_t i = 0; i != m_bufferCount; i += 1)
+    // The CPU is offline and its buffers are empty, so nothing more will be
+    // written to them.
+
+    if (m_epollFile)
+    {
+        for (uint32_t bufferIndex = cpu; bufferIndex < m_bufferCount; bufferIndex += m_groupBufferCount)
         {
-            if (m_buffers[i].Size != 0)
+            if (m_buffers[bufferIndex].Mmap && m_bufferLeaderFiles[bufferIndex])
             {
-                nonzeroBufferCount += 1;
+                epoll_ctl(m_epollFile.get(), EPOLL_CTL_DEL, m_bufferLeaderFiles[bufferIndex].get(), nullptr);
             }
         }
+    }
 
-        // We don't use the fields that were added after v3. Allocate space for
-        // the full structure (we expose the structure to users) but don't ask
-        // the kernel to look at the new fields.
-        unsigned constexpr PerfEventAttrSizeUsed = PERF_ATTR_SIZE_VER3;
-
-        auto const cbEventDescStorage =
-            sizeof(perf_event_attr) +
-            nonzeroBufferCount * sizeof(uint64_t) +
-            systemName.size() + 1 + eventName.size() + 1;
-        auto eventDescStorage = std::make_unique<char unsigned[]>(cbEventDescStorage);
-
-        auto const pAttr = reinterpret_cast<perf_event_attr*>(eventDescStorage.get());
-        pAttr->type = PERF_TYPE_TRACEPOINT;
-        pAttr->size = PerfEventAttrSizeUsed;
-        pAttr->config = metadata.Id();
-        pAttr->sample_period = 1;
-        pAttr->sample_type = m_sampleType;
-        pAttr->read_format = PERF_FORMAT_ID; // Must align with the definition of struct ReadFormat.
-        pAttr->watermark = m_wakeupUseWatermark;
-        pAttr->use_clockid = 1;
-        pAttr->write_backward = !IsRealtime();
-        pAttr->wakeup_events = m_wakeupValue;
-        pAttr->clockid = m_sessionInfo.Clockid();
-        static_assert(offsetof(perf_event_attr, clockid) < PerfEventAttrSizeUsed);
-
-        // pIds will be initialized after file handle creation.
-        // cIdsAdded tracks initialization.
-        pIds = reinterpret_cast<uint64_t*>(pAttr + 1);
+    // Close the tracepoints' files. Their sample IDs stay registered so that
+    // events that were already collected can still be decoded. In leader
+    // mode, this also closes the buffer owner (the mmap keeps the buffer
+    // alive until it is unmapped below).
+    for (auto& pair : m_tracepointInfoByCommonType)
+    {
+        auto& tpi = pair.second;
+        tpi.m_bufferFiles[tpi.m_bufferGroup * m_groupBufferCount + cpu].reset();
+    }
 
-        auto const pName = reinterpret_cast<char*>(pIds + nonzeroBufferCount);
+    for (uint32_t bufferIndex = cpu; bufferIndex < m_bufferCount; bufferIndex += m_groupBufferCount)
+    {
+        auto& buffer = m_buffers[bufferIndex];
+        if (buffer.Mmap && buffer.Realtime && m_bufferOwnerFiles)
         {
-            size_t i = 0;
-            memcpy(&pName[i], systemName.data(), systemName.size());
-            i += systemName.size();
-            pName[i] = ':';
-            i += 1;
-            memcpy(&pName[i], eventName.data(), eventName.size());
-            i += eventName.size();
-            pName[i] = '\0';
+            __atomic_fetch_sub(&m_adaptiveBufferBytes, static_cast<uint64_t>(buffer.Size), __ATOMIC_RELAXED);
         }
 
-        PerfEventDesc const eventDesc = {
-            pAttr,
-            pName,
-            &metadata,
-            pIds,
-            nonzeroBufferCount
-        };
+        buffer.Mmap.reset();
+        buffer.Data = nullptr;
+        buffer.Size = 0;
+        buffer.Index.reset();
+        if (m_bufferOwnerFiles)
+        {
+            m_bufferOwnerFiles[bufferIndex].reset();
+        }
+    }
 
-        auto er = m_tracepointInfoByCommonType.try_emplace(metadata.Id(),
-            eventDesc,
-            std::move(eventDescStorage),
-            std::make_unique<unique_fd[]>(m_bufferCount),
-            m_bufferCount);
-        assert(er.second);
-        auto& tpi = er.first->second;
-        tpi.m_enableState = enableState;
+    return true;
+}
 
-        // Starting from here, if there is an error then we must erase(metadata.Id).
+_Success_(return == 0) int
+TracepointSession::EnableManyTracepoints(
+    _In_reads_(nameCount) TracepointName const* names,
+    size_t nameCount,
+    _Out_writes_opt_(nameCount) int* pErrors,
+    unsigned threadCount) noexcept
+{
+    int error;
 
-        for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+    try
+    {
+        std::vector<int> errors(nameCount);
+
+        // Look up the tracepoints and create the session entries for the new
+        // ones. The session's maps are only changed on this thread.
+        std::vector<TracepointInfoImpl*> pending;
+        std::vector<size_t> pendingNameIndexes;
+        std::vector<std::pair<size_t, PerfEventMetadata const*>> duplicates;
+        pending.reserve(nameCount);
+        pendingNameIndexes.reserve(nameCount);
+        for (size_t i = 0; i != nameCount; i += 1)
         {
-            if (m_buffers[bufferIndex].Size == 0)
+            PerfEventMetadata const* metadata;
+            errors[i] = m_cache.FindOrAddFromSystem(names[i], &metadata);
+            if (errors[i] != 0)
             {
                 continue;
             }
 
-            errno = 0;
-            tpi.m_bufferFiles[bufferIndex].reset(perf_event_open(pAttr, -1, bufferIndex, -1, PERF_FLAG_FD_CLOEXEC));
-            if (!tpi.m_bufferFiles[bufferIndex])
+            auto const existingIt = m_tracepointInfoByCommonType.find(metadata->Id());
+            if (existingIt != m_tracepointInfoByCommonType.end())
             {
-                error = errno;
-                if (error == 0)
+                if (pending.end() != std::find(pending.begin(), pending.end(), &existingIt->second))
                 {
-                    error = ENODEV;
+                    // Duplicate name. Result depends on the pending entry.
+                    duplicates.emplace_back(i, metadata);
+                }
+                else
+                {
+                    errors[i] = SetTracepointEnableState(existingIt->second, true);
                 }
-
-                goto Error;
             }
-        }
-
-        if (m_bufferLeaderFiles)
-        {
-            // Leader already exists. Add this event to the leader's mmaps.
-            error = IoctlForEachFile(tpi.m_bufferFiles.get(), m_bufferCount, PERF_EVENT_IOC_SET_OUTPUT, m_bufferLeaderFiles);
-            if (error)
+            else if (!m_bufferLeaderFiles)
             {
-                goto Error;
+                // The first tracepoint creates (or attaches to) the session buffers.
+                errors[i] = AddTracepoint(*metadata, TracepointEnableState::Enabled);
             }
-        }
-        else
-        {
-            // This is the first event. Make it the "leader" (the owner of the session buffers).
-            auto const prot = IsRealtime()
-                ? PROT_READ | PROT_WRITE
-                : PROT_READ;
-            for (uint32_t bufferIndex = 0; bufferIndex != m_bufferCount; bufferIndex += 1)
+            else
             {
-                if (m_buffers[bufferIndex].Size == 0)
+                TracepointInfoImpl* pTpi;
+                errors[i] = AddTracepointInfo(*metadata, TracepointEnableState::Enabled, 0, &pTpi);
+                if (errors[i] == 0)
                 {
-                    continue;
+                    pending.push_back(pTpi);
+                    pendingNameIndexes.push_back(i);
                 }
+            }
+        }
 
-                auto const mmapSize = m_pageSize + m_buffers[bufferIndex].Size;
-
-                errno = 0;
-                auto cpuMap = mmap(nullptr, mmapSize, prot, MAP_SHARED, tpi.m_bufferFiles[bufferIndex].get(), 0);
-                if (MAP_FAILED == cpuMap)
+        // Open each pending tracepoint's per-CPU files, redirect them to the
+        // session buffers, and read their sample IDs, on worker threads.
+        std::vector<int> openErrors(pending.size());
+        std::atomic<size_t> nextIndex(0);
+        auto const work = [this, &pending, &openErrors, &nextIndex]() noexcept
+            {
+                for (;;)
                 {
-                    error = errno;
-
-                    // Clean up any mmaps that we opened.
-                    for (uint32_t bufferIndex2 = 0; bufferIndex2 != bufferIndex; bufferIndex2 += 1)
-                    {
-                        m_buffers[bufferIndex2].Mmap.reset();
-                        m_buffers[bufferIndex2].Data = nullptr;
-                    }
-
-                    if (error == 0)
+                    auto const i = nextIndex.fetch_add(1, std::memory_order_relaxed);
+                    if (i >= pending.size())
                     {
-                        error = ENODEV;
+                        break;
                     }
 
-                    goto Error;
+                    openErrors[i] = OpenTracepointFiles(*pending[i]);
                 }
+            };
 
-                m_buffers[bufferIndex].Mmap.reset(cpuMap, mmapSize);
-                m_buffers[bufferIndex].Data = static_cast<uint8_t*>(cpuMap) + m_pageSize;
-            }
+        if (threadCount == 0)
+        {
+            threadCount = std::min(16u, std::max(1u, std::thread::hardware_concurrency()));
         }
 
-        // Find the sample_ids for the new tracepoints.
-        for (uint32_t i = 0; i != m_bufferCount; i += 1)
+        // Each tracepoint needs about 3 syscalls per CPU, so one tracepoint per
+        // thread is enough to cover the thread startup cost on most systems.
+        auto const threadsWanted = std::min<size_t>(threadCount, pending.size());
+
+        std::vector<std::thread> threads;
+        try
         {
-            if (!tpi.m_bufferFiles[i])
+            threads.reserve(threadsWanted);
+            for (size_t i = 1; i < threadsWanted; i += 1)
             {
-                continue;
+                threads.emplace_back(work);
             }
+        }
+        catch (...)
+        {
+            // Continue with the threads we have.
+        }
 
-            ReadFormat data;
-            error = tpi.Read(i, &data);
-            if (error != 0)
+        work();
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        // Commit the tracepoints that opened successfully and remove the rest
+        // (closing their files) in one pass.
+        for (size_t i = 0; i != pending.size(); i += 1)
+        {
+            auto& tpi = *pending[i];
+            auto tpError = openErrors[i];
+            if (tpError == 0)
             {
-                goto Error;
+                tpError = CommitTracepointInfo(tpi);
             }
 
-            pIds[cIdsAdded] = data.id;
-            cIdsAdded += 1;
+            if (tpError != 0)
+            {
+                RemoveTracepointInfo(tpi);
+            }
 
-            auto const added = m_tracepointInfoBySampleId.emplace(data.id, &tpi).second;
-            assert(added);
-            (void)added;
+            errors[pendingNameIndexes[i]] = tpError;
         }
 
-        assert(cIdsAdded == nonzeroBufferCount);
-
-        // Success. Commit it. (No exceptions beyond this point.)
-
-        if (!m_bufferLeaderFiles)
+        for (auto const& duplicate : duplicates)
         {
-            m_bufferLeaderFiles = tpi.m_bufferFiles.get(); // Commit this event as the leader.
+            errors[duplicate.first] = EnableTracepointImpl(*duplicate.second);
         }
 
-        goto Done;
+        error = 0;
+        for (size_t i = 0; i != nameCount; i += 1)
+        {
+            if (pErrors)
+            {
+                pErrors[i] = errors[i];
+            }
+
+            if (error == 0)
+            {
+                error = errors[i];
+            }
+        }
     }
     catch (...)
     {
         error = ENOMEM;
-        goto Error;
+        if (pErrors)
+        {
+            std::fill_n(pErrors, nameCount, ENOMEM);
+        }
     }
 
-Error:
+    return error;
+}
 
-    for (uint32_t i = 0; i != cIdsAdded; i += 1)
+void
+TracepointSession::IndexTracepointInfo(TracepointInfoImpl const& tpi) noexcept(false)
+{
+    auto const commonType = tpi.m_eventDesc.metadata->Id();
+    if (commonType < CommonTypeIndexMax &&
+        commonType >= m_tracepointInfoByCommonTypeIndex.size())
+    {
+        m_tracepointInfoByCommonTypeIndex.resize(commonType + 1u); // may throw bad_alloc.
+    }
+
+    // Keep the sample ID index at most half full. Grow by rebuilding from
+    // m_tracepointInfoBySampleId, which already has tpi's IDs.
+    if (m_tracepointInfoBySampleId.size() > m_tracepointInfoBySampleIdIndex.size() / 2)
+    {
+        RebuildSampleIdIndex(m_tracepointInfoBySampleId.size()); // may throw bad_alloc.
+    }
+    else
     {
-        if (m_buffers[i].Size == 0)
+        for (uint32_t i = 0; i != tpi.m_eventDesc.ids_count; i += 1)
         {
-            continue;
+            SampleIdIndexAdd(m_tracepointInfoBySampleIdIndex, tpi.m_eventDesc.ids[i], &tpi);
         }
+    }
+
+    if (commonType < CommonTypeIndexMax)
+    {
+        m_tracepointInfoByCommonTypeIndex[commonType] = &tpi;
+    }
+}
 
-        m_tracepointInfoBySampleId.erase(pIds[i]);
+void
+TracepointSession::RebuildSampleIdIndex(size_t idCount) noexcept(false)
+{
+    size_t slotCount = 16;
+    while (idCount > slotCount / 2)
+    {
+        slotCount *= 2;
     }
 
-    // May or may not have been added yet. If not, erase does nothing.
-    m_tracepointInfoByCommonType.erase(metadata.Id());
+    std::vector<SampleIdSlot> index(slotCount, SampleIdSlot{ 0, nullptr }); // may throw bad_alloc.
+    for (auto const& pair : m_tracepointInfoBySampleId)
+    {
+        SampleIdIndexAdd(index, pair.first, pair.second);
+    }
 
-Done:
+    // Commit. (No exceptions beyond this point.)
+    m_tracepointInfoBySampleIdIndex.swap(index);
+}
 
-    return error;
+void
+TracepointSession::SampleIdIndexAdd(
+    std::vector<SampleIdSlot>& index,
+    uint64_t sampleId,
+    TracepointInfoImpl const* tpi) noexcept
+{
+    assert(tpi != nullptr);
+    auto const mask = index.size() - 1;
+    for (size_t i = SampleIdHash(sampleId);; i += 1)
+    {
+        auto& slot = index[i & mask];
+        if (slot.Tpi == nullptr)
+        {
+            slot.SampleId = sampleId;
+            slot.Tpi = tpi;
+            break;
+        }
+    }
 }
 
 uint32_t
 TracepointSession::CalculateBufferCount(TracepointSessionOptions const& options) noexcept
 {
-    auto const cpuCount = static_cast<uint32_t>(sysconf(_SC_NPROCESSORS_ONLN));
+    // CpuHotplug: one buffer slot per possible CPU, whether or not it is online.
+    uint32_t possibleCount = 0;
+    if (options.m_cpuHotplug)
+    {
+        ReadCpuListFile("/sys/devices/system/cpu/possible", 0x10000,
+            [&possibleCount](uint32_t cpu) { possibleCount = std::max(possibleCount, cpu + 1); });
+    }
+
+    auto const cpuCount = possibleCount != 0
+        ? possibleCount
+        : static_cast<uint32_t>(sysconf(_SC_NPROCESSORS_ONLN));
     assert(cpuCount > 0);
     assert(cpuCount < 0x10000000);
 
     uint32_t bufferCount;
-    if (options.m_cpuBufferSizes == nullptr && options.m_cpuBufferSizesCount == UINT32_MAX)
+    if (options.m_targetCgroupFile < 0 && options.m_targetPid >= 0 && !options.m_targetInherit)
+    {
+        // TargetProcess without inherit: one buffer (cpu -1) for all CPUs.
+        bufferCount = 1;
+    }
+    else if (options.m_cpuBufferSizes == nullptr && options.m_cpuBufferSizesCount == UINT32_MAX)
     {
         // Either they used the perCpuBufferSize constructor or they passed
         // garbage parameters to the cpuBufferSizes constructor.
@@ -1974,6 +5739,125 @@ TracepointSession::CalculateBufferCount(TracepointSessionOptions const& options)
     return bufferCount;
 }
 
+uint32_t
+TracepointSession::CountCircularBufferGroups(TracepointSessionOptions const& options) noexcept
+{
+    uint32_t count = options.m_mode == TracepointSessionMode::Circular;
+    for (uint32_t i = 0; i != options.m_bufferGroupsCount; i += 1)
+    {
+        count += options.m_bufferGroups[i].Mode == TracepointSessionMode::Circular;
+    }
+
+    return count;
+}
+
+// Returns the rounded-up AdaptiveBufferSize maximum (0 if not adaptive).
+uint32_t
+TracepointSession::AdaptiveMaxBufferSize(uint32_t pageSize, TracepointSessionOptions const& options) noexcept
+{
+    return options.m_adaptiveMaxBufferSize != 0
+        ? RoundUpBufferSize(pageSize, options.m_adaptiveMaxBufferSize)
+        : 0u;
+}
+
+// Returns the rounded-up AdaptiveBufferSize minimum (at most the maximum).
+uint32_t
+TracepointSession::AdaptiveMinBufferSize(uint32_t pageSize, TracepointSessionOptions const& options) noexcept
+{
+    auto const minSize = RoundUpBufferSize(pageSize, options.m_adaptiveMinBufferSize);
+    auto const maxSize = AdaptiveMaxBufferSize(pageSize, options);
+    return minSize < maxSize ? minSize : maxSize;
+}
+
+std::vector<bool>
+TracepointSession::ReadOnlineCpus(uint32_t cpuCount) noexcept(false)
+{
+    std::vector<bool> cpus(cpuCount); // may throw bad_alloc.
+    if (!ReadCpuListFile("/sys/devices/system/cpu/online", cpuCount,
+        [&cpus](uint32_t cpu) { cpus[cpu] = true; }))
+    {
+        cpus.clear();
+    }
+
+    return cpus;
+}
+
+// Returns the CPUs where the session's target can run, or empty if unknown
+// or if the session is system-wide.
+std::vector<bool>
+TracepointSession::ReadTargetCpus(
+    uint32_t cpuCount,
+    TracepointSessionOptions const& options) noexcept(false)
+{
+    std::vector<bool> cpus;
+
+    if (options.m_targetCgroupFile >= 0)
+    {
+        // cgroup v2 cpuset, e.g. "0-3,8-11". Not present if the cgroup does not
+        // have the cpuset controller.
+        auto const file = openat(options.m_targetCgroupFile, "cpuset.cpus.effective", O_RDONLY | O_CLOEXEC);
+        if (file >= 0)
+        {
+            char list[4096];
+            auto const listLen = read(file, list, sizeof(list) - 1);
+            close(file);
+            if (listLen > 0)
+            {
+                list[listLen] = '\0';
+                cpus.resize(cpuCount); // may throw bad_alloc.
+                if (!ParseCpuList(list, cpuCount, [&cpus](uint32_t cpu) { cpus[cpu] = true; }))
+                {
+                    cpus.clear();
+                }
+            }
+        }
+    }
+    else if (options.m_targetPid >= 0 && options.m_targetInherit)
+    {
+        // The mask must be large enough for the kernel's CPU count, which may
+        // be larger than the number of online CPUs.
+        auto const maskCpuCount = std::max(cpuCount, 8192u);
+        auto const maskSize = CPU_ALLOC_SIZE(maskCpuCount);
+        auto const mask = CPU_ALLOC(maskCpuCount);
+        if (mask == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        bool anyCpus = false;
+        if (0 == sched_getaffinity(options.m_targetPid, maskSize, mask))
+        {
+            try
+            {
+                cpus.resize(cpuCount);
+            }
+            catch (...)
+            {
+                CPU_FREE(mask);
+                throw;
+            }
+
+            for (uint32_t cpu = 0; cpu != cpuCount; cpu += 1)
+            {
+                if (CPU_ISSET_S(cpu, maskSize, mask))
+                {
+                    cpus[cpu] = true;
+                    anyCpus = true;
+                }
+            }
+        }
+
+        if (!anyCpus)
+        {
+            cpus.clear();
+        }
+
+        CPU_FREE(mask);
+    }
+
+    return cpus;
+}
+
 std::unique_ptr<TracepointSession::BufferInfo[]>
 TracepointSession::MakeBufferInfos(
     uint32_t bufferCount,
@@ -1985,7 +5869,7 @@ TracepointSession::MakeBufferInfos(
     assert(pageSize != 0);
     assert((pageSize & (pageSize - 1)) == 0);
 
-    auto buffers = std::make_unique<BufferInfo[]>(bufferCount);
+    auto buffers = std::make_unique<BufferInfo[]>(bufferCount * (1 + options.m_bufferGroupsCount));
 
     if (options.m_cpuBufferSizes == nullptr && options.m_cpuBufferSizesCount == UINT32_MAX)
     {
@@ -2013,5 +5897,67 @@ TracepointSession::MakeBufferInfos(
         }
     }
 
+    // TargetCgroup or TargetProcess with inherit: no buffers for the CPUs
+    // where the target cannot run.
+    auto const targetCpus = ReadTargetCpus(bufferCount, options); // may throw bad_alloc.
+    if (!targetCpus.empty())
+    {
+        for (auto i = 0u; i != bufferCount; i += 1)
+        {
+            if (!targetCpus[i])
+            {
+                buffers[i].Size = 0;
+            }
+        }
+    }
+
+    auto const realtime = options.m_mode != TracepointSessionMode::Circular;
+    for (auto i = 0u; i != bufferCount; i += 1)
+    {
+        buffers[i].Realtime = realtime;
+        buffers[i].Standby = !realtime && options.m_circularStandbyBuffer;
+    }
+
+    auto const adaptiveMinSize = AdaptiveMinBufferSize(pageSize, options);
+    auto const adaptiveMaxSize = AdaptiveMaxBufferSize(pageSize, options);
+
+    // bufferCount is the number of buffers per group.
+    // Groups 1..N use the CPUs that group 0 uses.
+    for (auto group = 0u; group != options.m_bufferGroupsCount; group += 1)
+    {
+        auto const& groupOptions = options.m_bufferGroups[group];
+        assert(groupOptions.Mode <= TracepointSessionMode::RealTime);
+        auto const groupRealtime = groupOptions.Mode != TracepointSessionMode::Circular;
+        auto const groupBufferSize = RoundUpBufferSize(pageSize, groupOptions.PerCpuBufferSize);
+        auto const groupBuffers = buffers.get() + (group + 1) * bufferCount;
+        for (auto i = 0u; i != bufferCount; i += 1)
+        {
+            groupBuffers[i].Size = buffers[i].Size != 0 ? groupBufferSize : 0u;
+            groupBuffers[i].Realtime = groupRealtime;
+            groupBuffers[i].Standby = !groupRealtime && options.m_circularStandbyBuffer;
+        }
+    }
+
+    if (adaptiveMaxSize != 0)
+    {
+        for (auto i = 0u; i != bufferCount * (1 + options.m_bufferGroupsCount); i += 1)
+        {
+            auto& buffer = buffers[i];
+            if (buffer.Realtime && buffer.Size != 0)
+            {
+                buffer.Size = buffer.Size < adaptiveMinSize
+                    ? adaptiveMinSize
+                    : buffer.Size > adaptiveMaxSize
+                    ? adaptiveMaxSize
+                    : buffer.Size;
+            }
+        }
+    }
+
+    for (auto i = 0u; i != bufferCount * (1 + options.m_bufferGroupsCount); i += 1)
+    {
+        buffers[i].OnlineSize = buffers[i].Size;
+    }
+
     return buffers;
 }
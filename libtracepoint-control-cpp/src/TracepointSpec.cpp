@@ -27,6 +27,25 @@ CountLeadingWhitespace(std::string_view str)
     return pos;
 }
 
+// Returns the position of the whitespace before the first " if " (or
+// trailing " if"), or npos if there is no filter.
+static size_t
+FindFilterKeyword(std::string_view str)
+{
+    for (size_t pos = 0; str.size() - pos >= 3; pos += 1)
+    {
+        if (AsciiIsSpace(str[pos]) &&
+            str[pos + 1] == 'i' &&
+            str[pos + 2] == 'f' &&
+            (str.size() - pos == 3 || AsciiIsSpace(str[pos + 3])))
+        {
+            return pos;
+        }
+    }
+
+    return str.npos;
+}
+
 TracepointSpec::TracepointSpec(std::string_view const specString) noexcept
 {
     bool identifier;
@@ -42,7 +61,7 @@ TracepointSpec::TracepointSpec(std::string_view const specString) noexcept
     6. SystemName ':' EventName (':' Flags)? (WS Fields*)?
     */
 
-    auto const trimmed = Trim(specString);
+    auto trimmed = Trim(specString);
     Trimmed = trimmed;
 
     size_t pos = 0;
@@ -56,7 +75,21 @@ TracepointSpec::TracepointSpec(std::string_view const specString) noexcept
         Kind = TracepointSpecKind::Empty;
         return; // Case 2
     }
-    else if (trimmed[pos] == ':')
+
+    // Remove the filter (if any), then parse the rest of the spec.
+    if (auto const filterPos = FindFilterKeyword(trimmed);
+        filterPos != trimmed.npos)
+    {
+        Filter = Trim(trimmed.substr(filterPos + 3));
+        trimmed = Trim(trimmed.substr(0, filterPos));
+        if (Filter.empty())
+        {
+            Kind = TracepointSpecKind::ErrorFilterEmpty;
+            return;
+        }
+    }
+
+    if (trimmed[pos] == ':')
     {
         size_t startPos;
 
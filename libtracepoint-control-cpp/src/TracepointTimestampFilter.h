@@ -0,0 +1,426 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Internal: timestamp filter used by TracepointSession::FlushToWriter and
+TracepointSnapshot::WriteToWriter, and the timestamp index kept for circular
+buffers. Not installed.
+*/
+
+#pragma once
+#ifndef _included_TracepointTimestampFilter_h
+#define _included_TracepointTimestampFilter_h 1
+
+#include <tracepoint/TracepointSession.h>
+#include <linux/perf_event.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace tracepoint_control
+{
+    // Returns the offset of the PERF_SAMPLE_TIME field within a SAMPLE record.
+    inline unsigned
+    SampleBytesBeforeTime(uint32_t sampleType) noexcept
+    {
+        return sizeof(uint64_t) * (
+            1u + // perf_event_header
+            (0 != (sampleType & PERF_SAMPLE_IDENTIFIER)) +
+            (0 != (sampleType & PERF_SAMPLE_IP)) +
+            (0 != (sampleType & PERF_SAMPLE_TID)));
+    }
+
+    /*
+    Per-buffer state of a timestamp filter.
+
+    A buffer's events are in timestamp order (circular buffers are read
+    newest-to-oldest, realtime buffers oldest-to-newest), except that a buffer
+    written from several CPUs may have small inversions. If slackNs is not
+    UINT64_MAX, then once a sample is more than slackNs beyond the far edge of
+    the window, the buffer's remaining samples are rejected (callers check
+    PastWindow() to skip them without reading their timestamps). A sample in
+    the window that comes after such a sample is lost. Non-sample records are
+    not filtered.
+    */
+    class TimestampFilter
+    {
+        TracepointTimestampRange const m_range;
+        uint64_t const m_slackNs;
+        bool m_pastWindow;
+
+    public:
+
+        constexpr
+        TimestampFilter(TracepointTimestampRange range, uint64_t slackNs) noexcept
+            : m_range(range)
+            , m_slackNs(slackNs)
+            , m_pastWindow(false)
+        {
+            return;
+        }
+
+        // Returns true if the filter accepts all timestamps.
+        constexpr bool
+        AcceptsAll() const noexcept
+        {
+            return m_range.First == 0 && m_range.Last == UINT64_MAX;
+        }
+
+        // Returns true if the rest of the current buffer's samples are rejected.
+        constexpr bool
+        PastWindow() const noexcept
+        {
+            return m_pastWindow;
+        }
+
+        // Starts a new buffer.
+        void
+        Reset() noexcept
+        {
+            m_pastWindow = false;
+        }
+
+        // Returns true if a sample with the given timestamp should be kept.
+        bool
+        KeepSample(bool newestFirst, uint64_t time) noexcept
+        {
+            if (m_pastWindow)
+            {
+                return false;
+            }
+
+            if (m_range.First <= time && time <= m_range.Last)
+            {
+                return true;
+            }
+
+            if (newestFirst
+                ? time < m_range.First && m_range.First - time > m_slackNs
+                : time > m_range.Last && time - m_range.Last > m_slackNs)
+            {
+                m_pastWindow = true;
+            }
+
+            return false;
+        }
+    };
+
+    /*
+    Timestamp checkpoints for the records of a circular buffer, kept as the
+    buffer is read so that a later read with a timestamp filter can skip the
+    parts of the buffer that have no samples in the window without reading
+    their records.
+
+    The records are grouped into segments of about SegmentBytes. Each segment
+    has the range of its samples' timestamps. Positions are enumerator
+    positions (BufferInfo::DataPos), so a record keeps its position from one
+    read to the next. A circular buffer is read from its newest record to its
+    oldest. New records are written before the newest record and overwrite the
+    oldest records, so a segment stays valid until its end is more than a
+    buffer size past the start of the read.
+
+    Usage, for each read of the buffer: Begin(), then Skip() at each record
+    boundary, then AddSample() or AddRecord() for each record that is read,
+    then End().
+    */
+    class TimestampIndex
+    {
+    public:
+
+        static constexpr size_t SegmentBytes = 0x10000;
+
+        struct Segment
+        {
+            size_t Pos;         // Position of the segment's first record.
+            size_t End;         // Position after the segment's last record.
+            uint64_t TimeFirst; // Smallest sample timestamp.
+            uint64_t TimeLast;  // Largest sample timestamp.
+            bool SamplesOnly;   // false if any record is not a sample with a timestamp.
+        };
+
+    private:
+
+        std::vector<Segment> m_segments; // Segments of the last read, newest first.
+        std::vector<Segment> m_read; // Segments of the read in progress.
+        Segment m_current; // Segment being built. Empty if Pos == End.
+        TracepointTimestampRange m_filter;
+        size_t m_readPos; // Start of the read in progress.
+        size_t m_reusedEnd; // End of the last segment reused from m_segments.
+        size_t m_next; // Next segment of m_segments that may be reused.
+        bool m_reading;
+        bool m_failed; // Out of memory.
+
+        void
+        Push(Segment const& segment) noexcept
+        {
+            try
+            {
+                m_read.push_back(segment);
+            }
+            catch (...)
+            {
+                m_failed = true;
+            }
+        }
+
+        void
+        CloseCurrent() noexcept
+        {
+            if (m_current.Pos != m_current.End)
+            {
+                Push(m_current);
+                m_current.Pos = m_current.End;
+            }
+        }
+
+        // Returns the segment being built, starting a new one if needed.
+        Segment&
+        Current(size_t pos) noexcept
+        {
+            if (m_current.Pos == m_current.End || m_current.End != pos)
+            {
+                CloseCurrent();
+                m_current = { pos, pos, UINT64_MAX, 0, true };
+            }
+
+            return m_current;
+        }
+
+        void
+        Grow(size_t size) noexcept
+        {
+            m_current.End += size;
+            if (m_current.End - m_current.Pos >= SegmentBytes)
+            {
+                CloseCurrent();
+            }
+        }
+
+        // Returns true if pos is inside a segment reused from m_segments.
+        bool
+        InReused(size_t pos) const noexcept
+        {
+            return pos - m_readPos < m_reusedEnd - m_readPos;
+        }
+
+    public:
+
+        TimestampIndex() noexcept
+            : m_current()
+            , m_filter()
+            , m_readPos()
+            , m_reusedEnd()
+            , m_next()
+            , m_reading()
+            , m_failed()
+        {
+            return;
+        }
+
+        // Returns the segments of the last read, newest first.
+        std::vector<Segment> const&
+        Segments() const noexcept
+        {
+            return m_segments;
+        }
+
+        // Starts a read of the records from pos up to head. Segments that end
+        // after head have been (or may have been) overwritten and are dropped.
+        void
+        Begin(size_t pos, size_t head, TracepointTimestampRange filter) noexcept
+        {
+            m_read.clear(); // In case the last read did not End.
+            while (!m_segments.empty() && m_segments.back().End - pos > head - pos)
+            {
+                m_segments.pop_back();
+            }
+
+            m_current = { pos, pos, UINT64_MAX, 0, true };
+            m_filter = filter;
+            m_readPos = pos;
+            m_reusedEnd = pos;
+            m_next = 0;
+            m_reading = true;
+            m_failed = false;
+        }
+
+        // Called at each record boundary. If a segment of the last read starts
+        // at pos, reuses it. Returns the end of that segment if its records
+        // can be skipped (it has only samples, and none of them is in the
+        // filter window), otherwise returns pos.
+        size_t
+        Skip(size_t pos) noexcept
+        {
+            if (m_next != m_segments.size())
+            {
+                auto const& segment = m_segments[m_next];
+                if (segment.Pos == pos)
+                {
+                    CloseCurrent();
+                    Push(segment);
+                    m_next += 1;
+                    m_reusedEnd = segment.End;
+                    if (segment.SamplesOnly &&
+                        (segment.TimeLast < m_filter.First || segment.TimeFirst > m_filter.Last))
+                    {
+                        return segment.End;
+                    }
+                }
+                else if (pos - m_readPos > segment.Pos - m_readPos)
+                {
+                    // Records do not line up with the last read. Stop reusing.
+                    m_next = m_segments.size();
+                }
+            }
+
+            return pos;
+        }
+
+        // Adds a sample with a timestamp.
+        void
+        AddSample(size_t pos, size_t size, uint64_t time) noexcept
+        {
+            if (!InReused(pos))
+            {
+                auto& segment = Current(pos);
+                if (time < segment.TimeFirst)
+                {
+                    segment.TimeFirst = time;
+                }
+
+                if (time > segment.TimeLast)
+                {
+                    segment.TimeLast = time;
+                }
+
+                Grow(size);
+            }
+        }
+
+        // Adds a record that is not a sample with a timestamp. Segments with
+        // such records are never skipped.
+        void
+        AddRecord(size_t pos, size_t size) noexcept
+        {
+            if (!InReused(pos))
+            {
+                Current(pos).SamplesOnly = false;
+                Grow(size);
+            }
+        }
+
+        // Ends the read. Its segments replace the segments of the last read.
+        void
+        End() noexcept
+        {
+            if (m_reading)
+            {
+                CloseCurrent();
+                if (m_failed)
+                {
+                    m_read.clear();
+                }
+
+                m_segments.swap(m_read);
+                m_read.clear();
+                m_reading = false;
+            }
+        }
+    };
+
+    /*
+    Filters the records of a snapshot buffer (complete records, newest first,
+    possibly followed by unused space or a partially-overwritten record).
+    Calls writeFn(pos, size) for each run of records to keep and expands
+    writtenRange with the timestamps of the samples that are kept. Returns the
+    first nonzero writeFn result, or 0.
+    */
+    template<class WriteFn>
+    int
+    FilterSnapshotRecords(
+        uint8_t const* data,
+        size_t dataSize,
+        uint32_t sampleType,
+        TimestampFilter& filter,
+        TracepointTimestampRange* writtenRange,
+        WriteFn&& writeFn)
+    {
+        int error;
+        auto const bytesBeforeTime = SampleBytesBeforeTime(sampleType);
+        bool const sampleHasTime = 0 != (sampleType & PERF_SAMPLE_TIME);
+        size_t writeStart = 0; // Start of the records that have not been written.
+        size_t pos = 0;
+
+        filter.Reset();
+        while (dataSize - pos >= sizeof(perf_event_header))
+        {
+            auto const& header = *reinterpret_cast<perf_event_header const*>(data + pos);
+            if (header.size == 0 ||
+                header.size > dataSize - pos ||
+                0 != (header.size & 7))
+            {
+                break; // End of the buffer's events.
+            }
+
+            if (PERF_RECORD_SAMPLE == header.type &&
+                sampleHasTime &&
+                header.size > bytesBeforeTime)
+            {
+                bool keep;
+                uint64_t time = 0;
+                if (filter.PastWindow())
+                {
+                    keep = false;
+                }
+                else
+                {
+                    time = *reinterpret_cast<uint64_t const*>(data + pos + bytesBeforeTime);
+                    keep = filter.KeepSample(true, time);
+                }
+
+                if (!keep)
+                {
+                    // Skip this event: write the records before it.
+                    if (writeStart != pos)
+                    {
+                        error = writeFn(writeStart, pos - writeStart);
+                        if (error != 0)
+                        {
+                            return error;
+                        }
+                    }
+
+                    writeStart = pos + header.size;
+                }
+                else
+                {
+                    if (time < writtenRange->First)
+                    {
+                        writtenRange->First = time;
+                    }
+
+                    if (time > writtenRange->Last)
+                    {
+                        writtenRange->Last = time;
+                    }
+                }
+            }
+
+            pos += header.size;
+        }
+
+        if (writeStart < pos)
+        {
+            error = writeFn(writeStart, pos - writeStart);
+            if (error != 0)
+            {
+                return error;
+            }
+        }
+
+        return 0;
+    }
+}
+// namespace tracepoint_control
+
+#endif // _included_TracepointTimestampFilter_h
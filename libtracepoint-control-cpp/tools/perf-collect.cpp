@@ -14,8 +14,13 @@ Simple tool for collecting tracepoints into perf.data files.
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <string>
+#include <utility>
 #include <vector>
 
 #define PROGRAM_NAME "perf-collect"
@@ -49,29 +54,130 @@ Options:
                     Set the size of each buffer, in kilobytes. There will be
                     one buffer per CPU. The default is 128, max is 2GB.
 
+--buffersize-max <size>
+                    In realtime trace mode, let each buffer grow up to <size>
+                    kilobytes if it fills up or loses events, and shrink back
+                    toward --buffersize when it stays mostly empty. The
+                    default is 0 (buffers do not change size).
+
+--buffer-budget <size>
+                    With --buffersize-max, limit the total size of all buffers
+                    to <size> megabytes. The default is 0 (no limit).
+
+--cgroup <path>     Collect only the events generated by tasks in the cgroup
+                    <path>, e.g. "/sys/fs/cgroup/system.slice/my.service".
+                    If the cgroup has a cpuset, buffers are created only for
+                    the cgroup's CPUs. Cannot be used with --pid.
+
+--connect <address>
+                    In realtime trace mode, stream the events in perf pipe
+                    format to a receiver (e.g. perf-receive) instead of
+                    writing a file. <address> is "<host>:<port>" for TCP or
+                    "unix:<path>" for a Unix domain socket. Data is sent in
+                    1 MB batches (see --write-mode, --write-async) and can be
+                    compressed with -z. Implies --pipe.
+
 -c, --circular      Use circular trace mode. Events will be collected in
                     circular buffers (new events overwrite old) until the
                     signal is received, at which point the output file will be
                     created, buffer contents will be written to the file, and
                     the tool will exit.
 
+--cpu-hotplug       In realtime trace mode, create buffers for CPUs that come
+                    online after collection starts and free the buffers of
+                    CPUs that go offline (once they have been drained).
+
 -C, --realtime      Use realtime trace mode (default). File will be created
                     immediately and events will be written to the file as they
                     are received until the signal is received, at which point
                     the tool will finalize the file and exit.
 
+--format-cache <file>
+                    Load tracepoint formats from <file> (if it exists) and
+                    save the formats of the enabled tracepoints to <file>
+                    after enabling them. A cached format is used only if the
+                    tracepoint's current ID matches the cached ID, so this
+                    speeds up startup without using stale formats.
+
 -i, --input <file>  Read additional TracepointSpecs from <file>. Each line in
                     the file is treated as a TracepointSpec. Empty lines and
                     lines starting with '#' are ignored.
 
+--numa              In realtime trace mode, drain each buffer on a thread
+                    bound to the NUMA node of the buffer's CPU (uses at least
+                    one thread per node, see --threads). No effect on systems
+                    with a single NUMA node.
+
 -o, --output <file> Set the output filename. The default is "./perf.data".
+                    Use "-" to stream the events to stdout (implies --pipe).
+
+-p, --pid <pid>     Collect only the events generated by process <pid> and by
+                    the threads and processes it creates. Buffers are
+                    created only for the CPUs in the process's CPU affinity.
+                    Cannot be used with --cgroup.
+
+--pipe              In realtime trace mode, write the output in perf pipe
+                    format: the metadata is written at the start and the file
+                    is written sequentially (no seeking), so the output can be
+                    a FIFO or be read while it is being written, e.g. by
+                    "perf-decode -" or "perf report -i -". Cannot be used with
+                    --rotate-size or --rotate-time.
+
+-r, --ready         In realtime trace mode, flush only the buffers that have
+                    reached the wakeup watermark instead of flushing all
+                    buffers on every wakeup. This reduces overhead when most
+                    CPUs are idle. Events in the output file will not be
+                    grouped into rounds (no FinishedRound records).
+
+--rotate-size <size>
+                    In realtime trace mode, start a new output file when the
+                    current file reaches <size> megabytes. When rotating, the
+                    output files are named "<file>.0", "<file>.1", etc. (where
+                    <file> is the --output filename), and each is a complete
+                    perf.data file with its own headers. Files are switched
+                    between flushes, so no events are lost. Unless -r is used,
+                    each file holds complete rounds.
+
+--rotate-time <seconds>
+                    In realtime trace mode, start a new output file every
+                    <seconds> seconds. May be combined with --rotate-size.
+
+--rotate-max <count>
+                    When rotating, keep only the newest <count> output files,
+                    deleting older ones.
+
+-t, --threads <count>
+                    Set the number of threads to use for draining buffers in
+                    realtime trace mode. The default is 1. Using more threads
+                    may reduce lost events on systems with many busy CPUs.
 
 -w, --wakeup <size> Set the wakeup watermark size for realtime trace mode, in
                     kilobytes. The default is 2. The tool will wait for a
                     buffer to have at least this much data before waking to
                     flush the buffer to the output file.
 
--v, --verbose       Show diagnostic output.
+--write-mode <mode> In realtime trace mode, write the output file in 1 MB
+                    blocks instead of once per flush. <mode> is one of:
+                    buffered (blocks go through the page cache), direct
+                    (blocks are written with O_DIRECT), or dropbehind (blocks
+                    are flushed to disk promptly and then dropped from the
+                    page cache). The default is to write once per flush.
+
+--write-async <count>
+                    In realtime trace mode, write the output file's 1 MB
+                    blocks on a background thread, with up to <count> blocks
+                    waiting to be written, so that a slow disk does not delay
+                    draining the buffers. Implies --write-mode buffered unless
+                    another mode is specified. The default is 0 (write on the
+                    collection thread).
+
+-z, --compress      Compress the event data in the output file with zstd
+                    (PERF_RECORD_COMPRESSED records). Requires a tool build
+                    with zstd support.
+
+-v, --verbose       Show diagnostic output, including session statistics
+                    (buffer drain, flush, and file write latency) every 10
+                    seconds and when collection stops.
 
 -h, --help          Show this help message and exit.
 
@@ -112,6 +218,16 @@ In all cases, you may omit "SystemName:" if it is "user_events:", e.g.
     MyProvider_L5K1Gmygroup
     :MyUserEventThatAlreadyExists
 
+Any TracepointSpec may end with " if Filter", where Filter is a kernel event
+filter expression. Events that do not match the filter are discarded by the
+kernel before they reach the trace buffers. For example:
+
+    :sched:sched_switch if prev_pid == 0 || next_pid == 0
+    MyEvent u32 MyField1 if MyField1 > 10
+
+See https://docs.kernel.org/trace/events.html#event-filtering for details on
+the filter syntax.
+
 For TracepointSpecs provided on the command line, use quotation marks to
 ensure correct handling of spaces and semicolons in each TracepointSpec, e.g.
 
@@ -150,7 +266,19 @@ public:
 struct Options
 {
     char const* output = "./perf.data";
+    char const* formatCache = nullptr;
     bool verbose = false;
+    bool readyOnly = false;
+    bool compress = false;
+    bool writeBuffer = false;
+    bool pipe = false; // Pipe format (output "-" means stdout).
+    bool cpuHotplug = false;
+    char const* connect = nullptr; // Socket address, or NULL to write a file.
+    unsigned writeAsync = 0; // Blocks, 0 = synchronous writes.
+    PerfDataFileWriteCache writeCache = PerfDataFileWriteCache::Normal;
+    unsigned rotateSize = 0; // Megabytes, 0 = no size limit.
+    unsigned rotateTime = 0; // Seconds, 0 = no time limit.
+    unsigned rotateMax = 0; // Files to keep, 0 = keep all.
 };
 
 // fprintf(stderr, "PROGRAM_NAME: " + format, args...).
@@ -285,6 +413,10 @@ PushFrontDef(Options const& o, std::vector<Tracepoint>& tracepoints, Tracepoint&
             (unsigned)spec.SystemName.size(), spec.SystemName.data(),
             (unsigned)trimmed.size(), trimmed.data());
         break;
+    case TracepointSpecKind::ErrorFilterEmpty:
+        PrintStderr("error: filter is empty after \"if\" (from \"%.*s\").\n",
+            (unsigned)trimmed.size(), trimmed.data());
+        break;
     }
 }
 
@@ -483,13 +615,45 @@ EnableTracepoints(
     TracepointCache& cache,
     TracepointSession& session)
 {
+    if (o.formatCache)
+    {
+        auto const error = cache.LoadFormatCacheFile(o.formatCache);
+        if (error != 0 && error != ENOENT)
+        {
+            PrintStderr("warning: Cannot load format cache \"%s\", error %u.\n",
+                o.formatCache, error);
+        }
+        else
+        {
+            PrintStderrIf(o.verbose && error == 0, "verbose: Loaded format cache \"%s\".\n",
+                o.formatCache);
+        }
+    }
+
+    // Load all of the formats for existing tracepoints in one batch so the
+    // format files can be read in parallel.
+    std::vector<TracepointName> names;
+    for (auto const& tp : tracepoints)
+    {
+        if (tp.spec.Kind == TracepointSpecKind::Identifier)
+        {
+            names.emplace_back(tp.spec.SystemName, tp.spec.EventName);
+        }
+    }
+
+    std::vector<int> loadErrors(names.size());
+    (void)cache.AddManyFromSystem(names.data(), names.size(), loadErrors.data());
+
     unsigned enabledCount = 0;
+    size_t loadIndex = 0;
+    std::vector<TracepointName> enableNames;
     for (auto const& tp : tracepoints)
     {
         int error;
         if (tp.spec.Kind == TracepointSpecKind::Identifier)
         {
-            error = cache.AddFromSystem(TracepointName(tp.spec.SystemName, tp.spec.EventName));
+            error = loadErrors[loadIndex];
+            loadIndex += 1;
             switch (error)
             {
             default:
@@ -534,26 +698,125 @@ EnableTracepoints(
             }
         }
 
-        error = session.EnableTracepoint(TracepointName(tp.spec.SystemName, tp.spec.EventName));
+        if (!tp.spec.Filter.empty())
+        {
+            auto const filter = std::string(tp.spec.Filter);
+            error = session.SetTracepointFilter(TracepointName(tp.spec.SystemName, tp.spec.EventName), filter.c_str());
+            if (error != 0)
+            {
+                PrintStderr("warning: Cannot set filter \"%s\" for \"%.*s:%.*s\", error %u.\n",
+                    filter.c_str(),
+                    (unsigned)tp.spec.SystemName.size(), tp.spec.SystemName.data(),
+                    (unsigned)tp.spec.EventName.size(), tp.spec.EventName.data(),
+                    error);
+                continue;
+            }
+
+            PrintStderrIf(o.verbose, "verbose: Set filter \"%s\" for \"%.*s:%.*s\".\n",
+                filter.c_str(),
+                (unsigned)tp.spec.SystemName.size(), tp.spec.SystemName.data(),
+                (unsigned)tp.spec.EventName.size(), tp.spec.EventName.data());
+        }
+
+        enableNames.emplace_back(tp.spec.SystemName, tp.spec.EventName);
+    }
+
+    // Enable all of the tracepoints in one batch so the per-CPU perf_event
+    // files can be opened in parallel.
+    std::vector<int> enableErrors(enableNames.size());
+    (void)session.EnableManyTracepoints(enableNames.data(), enableNames.size(), enableErrors.data());
+
+    for (size_t i = 0; i != enableNames.size(); i += 1)
+    {
+        auto const& name = enableNames[i];
+        auto const error = enableErrors[i];
         if (error != 0)
         {
             PrintStderr("warning: Cannot enable \"%.*s:%.*s\", error %u.\n",
-                (unsigned)tp.spec.SystemName.size(), tp.spec.SystemName.data(),
-                (unsigned)tp.spec.EventName.size(), tp.spec.EventName.data(),
+                (unsigned)name.SystemName.size(), name.SystemName.data(),
+                (unsigned)name.EventName.size(), name.EventName.data(),
                 error);
         }
         else
         {
             enabledCount += 1;
             PrintStderrIf(o.verbose, "verbose: Enabled \"%.*s:%.*s\".\n",
-                (unsigned)tp.spec.SystemName.size(), tp.spec.SystemName.data(),
-                (unsigned)tp.spec.EventName.size(), tp.spec.EventName.data());
+                (unsigned)name.SystemName.size(), name.SystemName.data(),
+                (unsigned)name.EventName.size(), name.EventName.data());
+        }
+    }
+
+    if (o.formatCache)
+    {
+        auto const error = cache.SaveFormatCacheFile(o.formatCache);
+        if (error != 0)
+        {
+            PrintStderr("warning: Cannot save format cache \"%s\", error %u.\n",
+                o.formatCache, error);
+        }
+        else
+        {
+            PrintStderrIf(o.verbose, "verbose: Saved format cache \"%s\".\n",
+                o.formatCache);
         }
     }
 
     return enabledCount;
 }
 
+static void
+PrintLatency(char const* name, TracepointLatencyHistogram const& h)
+{
+    PrintStderr("verbose:   %-6s n=%llu avg=%.1fus p50=%.1fus p99=%.1fus max=%.1fus\n",
+        name,
+        static_cast<unsigned long long>(h.Count),
+        h.Count ? static_cast<double>(h.TotalNs) / static_cast<double>(h.Count) / 1000.0 : 0.0,
+        static_cast<double>(h.Percentile(50)) / 1000.0,
+        static_cast<double>(h.Percentile(99)) / 1000.0,
+        static_cast<double>(h.MaxNs) / 1000.0);
+}
+
+// If verbose, prints the session's metrics (cumulative since collection started)
+// and the per-buffer event loss since the previous call.
+static void
+PrintMetrics(Options const& o, TracepointSession& session)
+{
+    if (!o.verbose || !session.MetricsEnabled())
+    {
+        return;
+    }
+
+    TracepointSessionMetrics metrics;
+    session.GetMetrics(&metrics);
+    PrintStderr("verbose: stats: samples=%llu lost=%llu drained=0x%llX written=0x%llX\n",
+        static_cast<unsigned long long>(session.SampleEventCount()),
+        static_cast<unsigned long long>(session.LostEventCount()),
+        static_cast<unsigned long long>(metrics.BytesDrained),
+        static_cast<unsigned long long>(metrics.WriterBytes));
+    PrintLatency("flush", metrics.FlushNs);
+    PrintLatency("hold", metrics.BufferHoldNs);
+    PrintLatency("write", metrics.WriterWriteNs);
+    PrintStderr("verbose:   buffers total=0x%llX resizes=%llu\n",
+        static_cast<unsigned long long>(session.TotalBufferSize()),
+        static_cast<unsigned long long>(session.BufferResizeCount()));
+
+    for (unsigned bufferIndex = 0; bufferIndex != session.BufferCount(); bufferIndex += 1)
+    {
+        TracepointBufferLostInfo lost;
+        session.GetBufferLostInfo(bufferIndex, &lost);
+        if (lost.WindowLostEventCount != 0)
+        {
+            PrintStderr("verbose:   buffer %u lost %llu events (total %llu in %llu gaps)\n",
+                bufferIndex,
+                static_cast<unsigned long long>(lost.WindowLostEventCount),
+                static_cast<unsigned long long>(lost.LostEventCount),
+                static_cast<unsigned long long>(lost.LostRecordCount));
+        }
+    }
+
+    session.ResetLostWindows();
+}
+
 static int
 CollectCircular(Options const& o, TracepointSession& session)
 {
@@ -577,11 +840,13 @@ CollectCircular(Options const& o, TracepointSession& session)
     PrintStderr("info: stopping session (signal %u).\n",
         sig);
 
-    error = session.SavePerfDataFile(o.output);
+    error = session.SavePerfDataFile(o.output, TracepointSavePerfDataFileOptions()
+        .CompressionLevel(o.compress ? 1 : 0));
     if (error == 0)
     {
         PrintStderr("info: saved buffer contents to \"%s\".\n",
             o.output);
+        PrintMetrics(o, session);
     }
     else
     {
@@ -592,136 +857,384 @@ CollectCircular(Options const& o, TracepointSession& session)
     return error;
 }
 
+static uint64_t
+MonotonicNs() noexcept
+{
+    timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// Returns the output filename for the specified segment: o.output if not
+// rotating, otherwise o.output + "." + segment.
+static std::string
+SegmentPath(Options const& o, unsigned segment)
+{
+    std::string path = o.output;
+    if (o.rotateSize != 0 || o.rotateTime != 0)
+    {
+        path += '.';
+        path += std::to_string(segment);
+    }
+
+    return path;
+}
+
+// Creates the output file and writes FinishedInit. On error, reports the error
+// and removes the file.
 static int
-CollectRealtime(Options const& o, TracepointSession& session)
+CreateSegment(
+    Options const& o,
+    TracepointSession& session,
+    PerfDataFileWriter& writer,
+    char const* path)
 {
     int error;
-    unsigned wakeupCount = 0;
-    uint64_t eventBytes = 0;
 
-    PerfDataFileWriter writer;
-    error = writer.Create(o.output);
+    error = !o.pipe
+        ? writer.Create(path)
+        : o.connect != nullptr
+        ? writer.CreatePipeSocket(o.connect)
+        : 0 == strcmp(path, "-")
+        ? writer.CreatePipeFromFile(STDOUT_FILENO)
+        : writer.CreatePipe(path);
     if (error != 0)
     {
         PrintStderr("error: failed creating file \"%s\", error %u.\n",
-            o.output, error);
-        goto Done;
+            path, error);
+        return error;
+    }
+
+    if (o.writeBuffer)
+    {
+        error = writer.EnableWriteBuffer(0x100000, o.writeCache, o.writeAsync);
+        if (error != 0)
+        {
+            PrintStderr("error: failed enabling write buffer, error %u.\n",
+                error);
+            goto Error;
+        }
+    }
+
+    if (o.compress)
+    {
+        error = writer.EnableCompression();
+        if (error != 0)
+        {
+            PrintStderr("error: failed enabling compression, error %u.\n",
+                error);
+            goto Error;
+        }
+    }
+
+    if (o.pipe)
+    {
+        // Pipe format puts the metadata before the events, so provide it now.
+        // FinalizeSegment updates the headers at the end.
+        error = session.AddWriterEventDescs(writer);
+        if (error == 0)
+        {
+            error = session.SetWriterHeaders(writer, nullptr);
+        }
+
+        if (error != 0)
+        {
+            PrintStderr("error: failed collecting metadata for \"%s\", error %u.\n",
+                path, error);
+            goto Error;
+        }
     }
 
     error = writer.WriteFinishedInit();
     if (error != 0)
     {
         PrintStderr("error: failed writing FinishedInit to \"%s\", error %u.\n",
-            o.output, error);
-        unlink(o.output); // Nothing useful in the file.
+            path, error);
+        goto Error;
+    }
+
+    return 0;
+
+Error:
+
+    writer.CloseNoFinalize();
+    if (!o.pipe)
+    {
+        unlink(path); // Nothing useful in the file.
+    }
+
+    return error;
+}
+
+// Sets the system information headers and finalizes the output file.
+static int
+FinalizeSegment(
+    TracepointSession& session,
+    PerfDataFileWriter& writer,
+    char const* path,
+    TracepointTimestampRange const& writtenRange)
+{
+    int error;
+
+    error = session.SetWriterHeaders(writer, &writtenRange);
+    if (error != 0)
+    {
+        PrintStderr("error: failed collecting system info for \"%s\", error %u.\n",
+            path, error);
+    }
+
+    // Finalize even if SetWriterHeaders failed so that the events are usable.
+    auto const newError = writer.FinalizeAndClose();
+    if (newError != 0 && error == 0)
+    {
+        error = newError;
+        PrintStderr("error: failed finalizing \"%s\", error %u.\n",
+            path, error);
+    }
+
+    return error;
+}
+
+static int
+CollectRealtime(Options const& o, TracepointSession& session)
+{
+    int error;
+    unsigned wakeupCount = 0;
+    uint64_t eventBytes = 0; // Includes segments that have been finalized.
+
+    // When rotating, the next segment's file is created ahead of time so that
+    // switching files does not delay draining the buffers.
+    bool const rotating = o.rotateSize != 0 || o.rotateTime != 0;
+    uint64_t const rotateSizeBytes = static_cast<uint64_t>(o.rotateSize) << 20;
+    uint64_t const rotateTimeNs = static_cast<uint64_t>(o.rotateTime) * 1000000000u;
+    unsigned segment = 0;
+    std::string path = SegmentPath(o, segment);
+    std::string nextPath;
+    bool nextCreated = false;
+    PerfDataFileWriter writers[2];
+    PerfDataFileWriter* writer = &writers[0];
+    PerfDataFileWriter* nextWriter = &writers[1];
+    TracepointTimestampRange writtenRange;
+
+    std::vector<uint32_t> readyBufferIndexes;
+
+    if (o.readyOnly)
+    {
+        readyBufferIndexes.resize(session.BufferCount());
+    }
+
+    error = CreateSegment(o, session, *writer, path.c_str());
+    if (error != 0)
+    {
         goto Done;
     }
 
+    if (rotating)
     {
-        auto const writerSessionStartPos = writer.FilePos();
-        auto writerRoundStartPos = writerSessionStartPos;
-        TracepointTimestampRange writtenRange;
+        nextPath = SegmentPath(o, segment + 1);
+        error = CreateSegment(o, session, *nextWriter, nextPath.c_str());
+        if (error != 0)
+        {
+            writer->CloseNoFinalize();
+            unlink(path.c_str()); // Nothing useful in the file.
+            goto Done;
+        }
+
+        nextCreated = true;
+    }
+
+    {
+        uint64_t eventBytesDone = 0; // Bytes in segments that have been finalized.
+        auto writerSegmentStartBytes = writer->EventDataBytes();
+        auto writerRoundStartBytes = writerSegmentStartBytes;
+        uint64_t segmentEndTime = MonotonicNs() + rotateTimeNs;
+        constexpr uint64_t MetricsIntervalNs = 10000000000u;
+        uint64_t metricsTime = MonotonicNs() + MetricsIntervalNs;
 
         assert(SignalHandled == 0);
 
         // Scope for signalMask.
         PrintStderr("info: created \"%s\", collecting until " EXIT_SIGNALS_STR ".\n",
-            o.output);
+            path.c_str());
         {
             SignalMask signalMask;
             error = signalMask.InitError();
             if (error != 0)
             {
-                unlink(o.output); // Nothing useful in the file.
-                goto Done;
+                writer->CloseNoFinalize();
+                if (!o.pipe)
+                {
+                    unlink(path.c_str()); // Nothing useful in the file.
+                }
+
+                goto Finalize;
             }
 
             while (SignalHandled == 0) // Not sure whether this can ever be false.
             {
-                error = session.WaitForWakeup(nullptr, signalMask.OldSigSet());
+                timespec timeout = {};
+                timespec const* pTimeout = nullptr;
+                if (o.rotateTime != 0)
+                {
+                    auto const now = MonotonicNs();
+                    auto const remaining = segmentEndTime > now ? segmentEndTime - now : 0u;
+                    timeout.tv_sec = static_cast<time_t>(remaining / 1000000000u);
+                    timeout.tv_nsec = static_cast<long>(remaining % 1000000000u);
+                    pTimeout = &timeout;
+                }
+
+                uint32_t readyCount = 0;
+                error = o.readyOnly
+                    ? session.WaitForReadyBuffers(readyBufferIndexes.data(), &readyCount, pTimeout, signalMask.OldSigSet())
+                    : session.WaitForWakeup(pTimeout, signalMask.OldSigSet());
                 if (error != 0)
                 {
                     signalMask.Restore();
                     if (error != EINTR)
                     {
-                        PrintStderr("error: ppoll failed, error %u.\n",
-                            error);
+                        PrintStderr("error: %s failed, error %u.\n",
+                            o.readyOnly ? "epoll_pwait" : "ppoll", error);
                     }
                     else
                     {
-                        PrintStderrIf(o.verbose, "verbose: ppoll EINTR.\n");
+                        PrintStderrIf(o.verbose, "verbose: %s EINTR.\n",
+                            o.readyOnly ? "epoll_pwait" : "ppoll");
                     }
                     break;
                 }
 
                 wakeupCount += 1;
-                error = session.FlushToWriter(writer, &writtenRange);
+                error = o.readyOnly
+                    ? session.FlushBuffersToWriter(readyBufferIndexes.data(), readyCount, *writer, &writtenRange)
+                    : session.FlushToWriter(*writer, &writtenRange);
                 if (error != 0)
                 {
                     signalMask.Restore();
                     PrintStderr("error: failed flushing \"%s\", error %u.\n",
-                        o.output, error);
+                        path.c_str(), error);
                     goto Finalize;
                 }
 
-                auto const writerRoundEndPos = writer.FilePos();
-                eventBytes = writerRoundEndPos - writerSessionStartPos;
+                if (o.cpuHotplug)
+                {
+                    auto const hotplugError = session.UpdateOnlineCpus();
+                    PrintStderrIf(o.verbose && hotplugError != 0,
+                        "verbose: UpdateOnlineCpus error %u.\n", hotplugError);
+                }
+
+                auto const writerRoundEndBytes = writer->EventDataBytes();
+                eventBytes = eventBytesDone + writerRoundEndBytes - writerSegmentStartBytes;
                 PrintStderrIf(o.verbose, "verbose: flushed %lu bytes.\n",
-                    static_cast<unsigned long>(writerRoundEndPos - writerRoundStartPos));
-                if (writerRoundStartPos != writerRoundEndPos)
+                    static_cast<unsigned long>(writerRoundEndBytes - writerRoundStartBytes));
+                if (o.verbose && MonotonicNs() >= metricsTime)
                 {
-                    error = writer.WriteFinishedRound();
+                    PrintMetrics(o, session);
+                    metricsTime = MonotonicNs() + MetricsIntervalNs;
+                }
+                if (o.readyOnly)
+                {
+                    // Unflushed buffers may hold events older than the ones we
+                    // just wrote, so this is not the end of a round.
+                    writerRoundStartBytes = writerRoundEndBytes;
+                }
+                else if (writerRoundStartBytes != writerRoundEndBytes)
+                {
+                    error = writer->WriteFinishedRound();
                     if (error != 0)
                     {
                         signalMask.Restore();
                         PrintStderr("error: failed writing FinishedRound to \"%s\", error %u.\n",
-                            o.output, error);
+                            path.c_str(), error);
                         goto Finalize;
                     }
 
-                    writerRoundStartPos = writer.FilePos();
+                    writerRoundStartBytes = writer->EventDataBytes();
+                }
+
+                if (rotating &&
+                    ((o.rotateSize != 0 && writer->FilePos() >= rotateSizeBytes) ||
+                     (o.rotateTime != 0 && MonotonicNs() >= segmentEndTime)))
+                {
+                    // Switch to the next segment's writer (already created), then
+                    // finalize the previous segment. The session keeps collecting
+                    // into its buffers, so no events are lost.
+                    auto const segmentRange = writtenRange;
+                    writtenRange = TracepointTimestampRange();
+                    eventBytesDone = eventBytes;
+                    std::swap(writer, nextWriter);
+                    path.swap(nextPath);
+                    nextCreated = false;
+                    writerSegmentStartBytes = writer->EventDataBytes();
+                    writerRoundStartBytes = writerSegmentStartBytes;
+                    segmentEndTime = MonotonicNs() + rotateTimeNs;
+                    segment += 1;
+
+                    error = FinalizeSegment(session, *nextWriter, nextPath.c_str(), segmentRange);
+                    if (error != 0)
+                    {
+                        signalMask.Restore();
+                        goto Finalize;
+                    }
+
+                    PrintStderr("info: finalized \"%s\", writing to \"%s\".\n",
+                        nextPath.c_str(), path.c_str());
+
+                    if (o.rotateMax != 0 && segment >= o.rotateMax)
+                    {
+                        unlink(SegmentPath(o, segment - o.rotateMax).c_str());
+                    }
+
+                    nextPath = SegmentPath(o, segment + 1);
+                    error = CreateSegment(o, session, *nextWriter, nextPath.c_str());
+                    if (error != 0)
+                    {
+                        signalMask.Restore();
+                        goto Finalize;
+                    }
+
+                    nextCreated = true;
                 }
             }
         }
         PrintStderr("info: stopping session (signal %u).\n",
             SignalHandled);
 
-        error = session.FlushToWriter(writer, &writtenRange);
+        error = session.FlushToWriter(*writer, &writtenRange);
         if (error != 0)
         {
             PrintStderr("error: failed flushing \"%s\", error %u.\n",
-                o.output, error);
+                path.c_str(), error);
             goto Finalize;
         }
 
-        auto const writerSessionEndPos = writer.FilePos();
-        eventBytes = writerSessionEndPos - writerSessionStartPos;
+        auto const writerSegmentEndBytes = writer->EventDataBytes();
+        eventBytes = eventBytesDone + writerSegmentEndBytes - writerSegmentStartBytes;
         PrintStderrIf(o.verbose, "verbose: flushed %lu bytes.\n",
-            static_cast<unsigned long>(writerSessionEndPos - writerRoundStartPos));
-
-        error = session.SetWriterHeaders(writer, &writtenRange);
-        if (error != 0)
-        {
-            PrintStderr("error: failed collecting system info for \"%s\", error %u.\n",
-                o.output, error);
-            goto Finalize;
-        }
+            static_cast<unsigned long>(writerSegmentEndBytes - writerRoundStartBytes));
+        PrintMetrics(o, session);
     }
 
 Finalize:
 
+    // The pre-created next segment does not have any events.
+    if (nextCreated)
     {
-        auto newError = writer.FinalizeAndClose();
+        nextWriter->CloseNoFinalize();
+        unlink(nextPath.c_str());
+    }
+
+    if (writer->FilePos() != static_cast<uint64_t>(-1))
+    {
+        auto const newError = FinalizeSegment(session, *writer, path.c_str(), writtenRange);
         if (newError == 0)
         {
-            PrintStderr("info: woke %u times, wrote 0x%lX bytes to \"%s\".\n",
-                wakeupCount, static_cast<unsigned long>(eventBytes), o.output);
+            PrintStderr("info: woke %u times, wrote 0x%lX bytes to \"%s\"%s.\n",
+                wakeupCount, static_cast<unsigned long>(eventBytes), path.c_str(),
+                segment != 0 ? " and previous files" : "");
         }
         else if (error == 0)
         {
             error = newError;
-            PrintStderr("error: failed finalizing \"%s\", error %u.\n",
-                o.output, error);
         }
     }
 
@@ -741,8 +1254,21 @@ main(int argc, char* argv[])
         Options o;
         unsigned const buffersizeMax = 0x80000000 / 1024;
         unsigned buffersize = 128u;
+        unsigned buffersizeMaxAdaptive = 0u;
+        unsigned const bufferBudgetMax = 0x100000; // 1 TB.
+        unsigned bufferBudget = 0u;
         unsigned const wakeupMax = 0x80000000 / 1024;
         unsigned wakeup = 2u;
+        unsigned const threadsMax = 1024;
+        unsigned threads = 1u;
+        bool numa = false;
+        char const* cgroup = nullptr;
+        unsigned const pidMax = 0x400000; // PID_MAX_LIMIT.
+        unsigned pid = 0u;
+        unsigned const rotateSizeMax = 0x100000; // 1 TB.
+        unsigned const rotateTimeMax = 366 * 24 * 60 * 60;
+        unsigned const rotateMaxMax = 1000000;
+        unsigned const writeAsyncMax = 4096;
         bool realtime = true;
         bool showHelp = false;
         bool usageError = false;
@@ -796,10 +1322,24 @@ main(int argc, char* argv[])
                             usageError = true;
                         }
                         break;
+                    case 'p':
+                        argi += 1;
+                        ArgSize("-p", pidMax, argi, argc, argv, &usageError, &pid);
+                        break;
+                    case 'r':
+                        o.readyOnly = true;
+                        break;
+                    case 't':
+                        argi += 1;
+                        ArgSize("-t", threadsMax, argi, argc, argv, &usageError, &threads);
+                        break;
                     case 'w':
                         argi += 1;
                         ArgSize("-w", wakeupMax, argi, argc, argv, &usageError, &wakeup);
                         break;
+                    case 'z':
+                        o.compress = true;
+                        break;
                     case 'v':
                         o.verbose = true;
                         break;
@@ -822,6 +1362,33 @@ main(int argc, char* argv[])
                     argi += 1;
                     ArgSize("--buffersize", buffersizeMax, argi, argc, argv, &usageError, &buffersize);
                 }
+                else if (0 == strcmp(flag, "buffersize-max"))
+                {
+                    argi += 1;
+                    ArgSize("--buffersize-max", buffersizeMax, argi, argc, argv, &usageError, &buffersizeMaxAdaptive);
+                }
+                else if (0 == strcmp(flag, "buffer-budget"))
+                {
+                    argi += 1;
+                    ArgSize("--buffer-budget", bufferBudgetMax, argi, argc, argv, &usageError, &bufferBudget);
+                }
+                else if (0 == strcmp(flag, "cgroup"))
+                {
+                    argi += 1;
+                    if (argi < argc)
+                    {
+                        cgroup = argv[argi];
+                    }
+                    else
+                    {
+                        PrintStderr("error: missing path for flag --cgroup.\n");
+                        usageError = true;
+                    }
+                }
+                else if (0 == strcmp(flag, "cpu-hotplug"))
+                {
+                    o.cpuHotplug = true;
+                }
                 else if (0 == strcmp(flag, "circular"))
                 {
                     realtime = false;
@@ -830,6 +1397,36 @@ main(int argc, char* argv[])
                 {
                     realtime = true;
                 }
+                else if (0 == strcmp(flag, "pipe"))
+                {
+                    o.pipe = true;
+                }
+                else if (0 == strcmp(flag, "connect"))
+                {
+                    argi += 1;
+                    if (argi < argc)
+                    {
+                        o.connect = argv[argi];
+                    }
+                    else
+                    {
+                        PrintStderr("error: missing address for flag --connect.\n");
+                        usageError = true;
+                    }
+                }
+                else if (0 == strcmp(flag, "format-cache"))
+                {
+                    argi += 1;
+                    if (argi < argc)
+                    {
+                        o.formatCache = argv[argi];
+                    }
+                    else
+                    {
+                        PrintStderr("error: missing filename for flag --format-cache.\n");
+                        usageError = true;
+                    }
+                }
                 else if (0 == strcmp(flag, "input"))
                 {
                     argi += 1;
@@ -843,6 +1440,10 @@ main(int argc, char* argv[])
                         usageError = true;
                     }
                 }
+                else if (0 == strcmp(flag, "numa"))
+                {
+                    numa = true;
+                }
                 else if (0 == strcmp(flag, "output"))
                 {
                     argi += 1;
@@ -856,11 +1457,83 @@ main(int argc, char* argv[])
                         usageError = true;
                     }
                 }
+                else if (0 == strcmp(flag, "pid"))
+                {
+                    argi += 1;
+                    ArgSize("--pid", pidMax, argi, argc, argv, &usageError, &pid);
+                }
+                else if (0 == strcmp(flag, "ready"))
+                {
+                    o.readyOnly = true;
+                }
+                else if (0 == strcmp(flag, "rotate-size"))
+                {
+                    argi += 1;
+                    ArgSize("--rotate-size", rotateSizeMax, argi, argc, argv, &usageError, &o.rotateSize);
+                }
+                else if (0 == strcmp(flag, "rotate-time"))
+                {
+                    argi += 1;
+                    ArgSize("--rotate-time", rotateTimeMax, argi, argc, argv, &usageError, &o.rotateTime);
+                }
+                else if (0 == strcmp(flag, "rotate-max"))
+                {
+                    argi += 1;
+                    ArgSize("--rotate-max", rotateMaxMax, argi, argc, argv, &usageError, &o.rotateMax);
+                }
+                else if (0 == strcmp(flag, "threads"))
+                {
+                    argi += 1;
+                    ArgSize("--threads", threadsMax, argi, argc, argv, &usageError, &threads);
+                }
                 else if (0 == strcmp(flag, "wakeup"))
                 {
                     argi += 1;
                     ArgSize("--wakeup", wakeupMax, argi, argc, argv, &usageError, &wakeup);
                 }
+                else if (0 == strcmp(flag, "write-mode"))
+                {
+                    argi += 1;
+                    if (argi >= argc)
+                    {
+                        PrintStderr("error: missing value for flag --write-mode.\n");
+                        usageError = true;
+                    }
+                    else if (0 == strcmp(argv[argi], "buffered"))
+                    {
+                        o.writeBuffer = true;
+                        o.writeCache = PerfDataFileWriteCache::Normal;
+                    }
+                    else if (0 == strcmp(argv[argi], "direct"))
+                    {
+                        o.writeBuffer = true;
+                        o.writeCache = PerfDataFileWriteCache::Direct;
+                    }
+                    else if (0 == strcmp(argv[argi], "dropbehind"))
+                    {
+                        o.writeBuffer = true;
+                        o.writeCache = PerfDataFileWriteCache::DropBehind;
+                    }
+                    else
+                    {
+                        PrintStderr("error: invalid value \"%s\" for flag --write-mode.\n",
+                            argv[argi]);
+                        usageError = true;
+                    }
+                }
+                else if (0 == strcmp(flag, "write-async"))
+                {
+                    argi += 1;
+                    ArgSize("--write-async", writeAsyncMax, argi, argc, argv, &usageError, &o.writeAsync);
+                    if (o.writeAsync != 0)
+                    {
+                        o.writeBuffer = true;
+                    }
+                }
+                else if (0 == strcmp(flag, "compress"))
+                {
+                    o.compress = true;
+                }
                 else if (0 == strcmp(flag, "verbose"))
                 {
                     o.verbose = true;
@@ -878,6 +1551,21 @@ main(int argc, char* argv[])
             }
         }
 
+        if (0 == strcmp(o.output, "-"))
+        {
+            o.pipe = true;
+        }
+
+        if (o.connect != nullptr)
+        {
+            o.output = o.connect; // For messages.
+            o.pipe = true;
+            o.writeBuffer = true;
+
+            // A closed connection should fail the write (EPIPE), not kill us.
+            signal(SIGPIPE, SIG_IGN);
+        }
+
         if (showHelp || usageError)
         {
             fputs(UsageCommon, stdout);
@@ -891,6 +1579,24 @@ main(int argc, char* argv[])
             error = EINVAL;
             goto Done;
         }
+        else if (!realtime && (o.rotateSize != 0 || o.rotateTime != 0))
+        {
+            PrintStderr("error: --rotate-size and --rotate-time require realtime mode.\n");
+            error = EINVAL;
+            goto Done;
+        }
+        else if (o.pipe && (!realtime || o.rotateSize != 0 || o.rotateTime != 0))
+        {
+            PrintStderr("error: --pipe requires realtime mode without --rotate-size or --rotate-time.\n");
+            error = EINVAL;
+            goto Done;
+        }
+        else if (o.rotateMax != 0 && o.rotateSize == 0 && o.rotateTime == 0)
+        {
+            PrintStderr("error: --rotate-max requires --rotate-size or --rotate-time.\n");
+            error = EINVAL;
+            goto Done;
+        }
         else if (realtime && wakeup >= buffersize)
         {
             PrintStderr("error: wakeup size %u must be less than buffersize %u.\n",
@@ -898,15 +1604,63 @@ main(int argc, char* argv[])
             error = EINVAL;
             goto Done;
         }
+        else if (buffersizeMaxAdaptive != 0 && (!realtime || buffersizeMaxAdaptive < buffersize))
+        {
+            PrintStderr("error: --buffersize-max requires realtime mode and must be at least buffersize %u.\n",
+                buffersize);
+            error = EINVAL;
+            goto Done;
+        }
+        else if (o.cpuHotplug && !realtime)
+        {
+            PrintStderr("error: --cpu-hotplug requires realtime mode.\n");
+            error = EINVAL;
+            goto Done;
+        }
+        else if (cgroup != nullptr && pid != 0)
+        {
+            PrintStderr("error: --cgroup cannot be used with --pid.\n");
+            error = EINVAL;
+            goto Done;
+        }
 
         auto const mode = realtime
             ? TracepointSessionMode::RealTime
             : TracepointSessionMode::Circular;
+        auto sessionOptions = TracepointSessionOptions(mode, buffersize * 1024)
+            .WakeupWatermark(wakeup * 1024)
+            .DrainThreadCount(threads)
+            .DrainNumaAffinity(numa)
+            .AdaptiveBufferSize(buffersize * 1024, buffersizeMaxAdaptive * 1024, static_cast<uint64_t>(bufferBudget) << 20)
+            .CpuHotplug(o.cpuHotplug)
+            .Metrics(o.verbose);
+
+        int cgroupFile = -1;
+        if (cgroup != nullptr)
+        {
+            cgroupFile = open(cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (cgroupFile < 0)
+            {
+                error = errno;
+                PrintStderr("error: Cannot open cgroup \"%s\", error %u.\n",
+                    cgroup, error);
+                goto Done;
+            }
+
+            sessionOptions.TargetCgroup(cgroupFile);
+        }
+        else if (pid != 0)
+        {
+            sessionOptions.TargetProcess(static_cast<pid_t>(pid));
+        }
+
         TracepointCache cache;
-        TracepointSession session(
-            cache,
-            TracepointSessionOptions(mode, buffersize * 1024)
-            .WakeupWatermark(wakeup * 1024));
+        TracepointSession session(cache, sessionOptions);
+
+        if (cgroupFile >= 0)
+        {
+            close(cgroupFile); // The session has its own copy.
+        }
 
         unsigned const enabledCount = EnableTracepoints(o, tracepoints, cache, session);
         if (enabledCount == 0)
@@ -0,0 +1,953 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Simple tool for trimming a perf.data file: copies the events that match the
+filter options to a new perf.data file without decoding or re-encoding them.
+*/
+
+#include <tracepoint/PerfCallchainTable.h>
+#include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfDataFileWriter.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <tracepoint/PerfEventFilter.h>
+#include <tracepoint/PerfEventInfo.h>
+#include <tracepoint/PerfEventMetadata.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#define PROGRAM_NAME "perf-filter"
+
+using namespace tracepoint_decode;
+
+static char const* const UsageCommon = R"(
+Usage: )" PROGRAM_NAME R"( [options...] Input.data
+)";
+
+// Usage error: stderr += UsageCommon + UsageShort.
+static char const* const UsageShort = R"(
+Try ")" PROGRAM_NAME R"( --help" for more information.
+)";
+
+// -h or --help: stdout += UsageCommon + UsageLong.
+static char const* const UsageLong = R"(
+Copies the events of a perf.data file to a new perf.data file, dropping the
+sample events that do not match the filter options. Non-sample events (e.g.
+COMM, MMAP, LOST, FINISHED_ROUND) are always kept since they describe the
+state needed to interpret the samples. Attributes, tracepoint formats, and
+headers are copied from the input.
+
+Events are copied without being decoded. For a normal-mode input, the input
+is mapped and consecutive surviving events are written as one run: small runs
+are gathered and written with writev, and large runs are copied with
+copy_file_range (the filesystem may share the blocks instead of copying
+them), so trimming a large capture runs at about the speed of the disk. Use
+"-" to read a pipe-format stream from stdin.
+
+Input must have the same byte order as this host.
+
+Options:
+
+-o, --output <file> Set the output filename. The default is "./perf.data".
+                    Must not be the input file.
+
+--dedup-callchains  Store each distinct sample stack (PERF_SAMPLE_CALLCHAIN)
+                    once, in "<output>.stacks", and replace the callchain of
+                    each kept sample with a 24-byte reference to its stack.
+                    Tools that don't load the .stacks file see a stack with
+                    no usable frames. Use "perf-decode --callchain" to decode
+                    the stacks.
+
+-v, --verbose       Show diagnostic output.
+
+-h, --help          Show this help message and exit.
+
+Filter options (a sample is kept if it passes all of the specified filters):
+
+-e, --event <glob>  Keep events whose full name matches <glob>, e.g.
+                    "sched:sched_switch" or "user_events:MyProvider_*". '*'
+                    matches any run of chars and '?' matches any one char.
+                    May be repeated (an event matches if it matches any of
+                    the globs).
+
+-p, --provider <glob> Keep events whose provider name matches <glob>. For
+                    EventHeader events the provider name is the part of the
+                    event name before the "_L<level>K<keyword>" suffix. For
+                    other events it is the system name (e.g. "sched"). May be
+                    repeated.
+
+--level <max>       Keep EventHeader events with level <= <max>.
+
+--keyword <mask>    Keep EventHeader events whose keyword has any of the bits
+                    in <mask> set.
+
+--keyword-all <mask> Keep EventHeader events whose keyword has all of the bits
+                    in <mask> set.
+
+--pid <pid>         Keep events from the specified process. May be repeated.
+
+--tid <tid>         Keep events from the specified thread. May be repeated.
+
+--time-min <ns>     Keep events with timestamp >= <ns>, using the raw session
+                    timestamp.
+
+--time-max <ns>     Keep events with timestamp <= <ns>.
+)";
+
+struct Options
+{
+    char const* output = "./perf.data";
+    bool dedupCallchains = false;
+    bool verbose = false;
+};
+
+// fprintf(stderr, "PROGRAM_NAME: " + format, args...).
+static void
+PrintStderr(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fputs(PROGRAM_NAME ": ", stderr);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+static bool
+ArgUInt(
+    char const* flagName,
+    int argi,
+    int argc,
+    char* argv[],
+    bool* usageError,
+    uint64_t valueMax,
+    uint64_t* value) noexcept
+{
+    if (argi >= argc)
+    {
+        PrintStderr("error: missing value for flag %s.\n",
+            flagName);
+        *usageError = true;
+        return false;
+    }
+
+    char* end;
+    errno = 0;
+    auto const parsed = strtoull(argv[argi], &end, 0);
+    if (end == argv[argi] || *end != '\0' || errno != 0 || parsed > valueMax)
+    {
+        PrintStderr("error: invalid value \"%s\" for flag %s.\n",
+            argv[argi], flagName);
+        *usageError = true;
+        return false;
+    }
+
+    *value = parsed;
+    return true;
+}
+
+static void
+ArgGlob(
+    char const* flagName,
+    int argi,
+    int argc,
+    char* argv[],
+    bool* usageError,
+    PerfEventFilter& filter,
+    bool provider)
+{
+    if (argi >= argc)
+    {
+        PrintStderr("error: missing value for flag %s.\n",
+            flagName);
+        *usageError = true;
+    }
+    else if (provider)
+    {
+        filter.AddProviderNameGlob(argv[argi]);
+    }
+    else
+    {
+        filter.AddEventNameGlob(argv[argi]);
+    }
+}
+
+class Filterer
+{
+    // Runs at least this large are copied with copy_file_range.
+    static constexpr uint64_t CopyRangeMin = 0x100000;
+
+    // The writev batch is written when it reaches this size or IovecsMax.
+    static constexpr size_t BatchBytesMax = 0x400000;
+    static constexpr size_t IovecsMax = 1024; // IOV_MAX on Linux.
+
+    Options const& m_o;
+    PerfEventFilter& m_filter;
+    PerfDataFile m_input;
+    PerfDataFileWriter m_writer;
+    std::string_view m_map; // m_input.MappedData().
+    int m_srcFile = -1; // Input file for copy_file_range, -1 if not mapped.
+
+    // Surviving events not yet written: a run of consecutive events in m_map,
+    // and a batch of earlier runs (pointing into m_map) for writev.
+    uint64_t m_runBegin = 0;
+    uint64_t m_runEnd = 0;
+    std::vector<iovec> m_batch;
+    size_t m_batchBytes = 0;
+
+    uint64_t m_firstTime = UINT64_MAX;
+    uint64_t m_lastTime = 0;
+    uint64_t m_eventCount = 0;
+    uint64_t m_sampleCount = 0;
+    uint64_t m_sampleKeptCount = 0;
+    uint64_t m_writevBytes = 0;
+    uint64_t m_writevCalls = 0;
+    uint64_t m_copyRangeBytes = 0;
+    uint64_t m_copyRangeRuns = 0;
+    uint64_t m_copiedBytes = 0;
+
+    // For --dedup-callchains.
+    PerfCallchainTable m_stacks;
+    std::vector<uint8_t> m_dedupSample;
+    uint64_t m_dedupSavedBytes = 0;
+
+public:
+
+    Filterer(Filterer const&) = delete;
+    void operator=(Filterer const&) = delete;
+
+    ~Filterer()
+    {
+        if (m_srcFile >= 0)
+        {
+            close(m_srcFile);
+        }
+    }
+
+    Filterer(Options const& o, PerfEventFilter& filter) noexcept
+        : m_o(o)
+        , m_filter(filter)
+    {
+        return;
+    }
+
+    int
+    Filter(char const* inputPath)
+    {
+        int error;
+        auto const inputName = inputPath[0] ? inputPath : "stdin";
+
+        // CodeQL [SM01937] Users should be able to specify the input file path.
+        error = inputPath[0]
+            ? m_input.OpenMapped(inputPath)
+            : m_input.OpenStdin();
+        if (error != 0)
+        {
+            PrintStderr("error: failed opening \"%s\", error %u.\n",
+                inputName, error);
+            return error;
+        }
+        else if (m_input.ByteReader().ByteSwapNeeded())
+        {
+            // The writer would mix host-endian headers with file-endian data.
+            PrintStderr("error: \"%s\" has a different byte order.\n",
+                inputName);
+            return ENOTSUP;
+        }
+
+        if (m_input.Mapped())
+        {
+            struct stat inputStat, outputStat;
+            if (0 == stat(inputPath, &inputStat) &&
+                0 == stat(m_o.output, &outputStat) &&
+                inputStat.st_dev == outputStat.st_dev &&
+                inputStat.st_ino == outputStat.st_ino)
+            {
+                PrintStderr("error: output \"%s\" is the input file.\n",
+                    m_o.output);
+                return EINVAL;
+            }
+
+            m_map = m_input.MappedData();
+            m_srcFile = open(inputPath, O_RDONLY | O_CLOEXEC);
+            if (m_srcFile < 0)
+            {
+                error = errno;
+                PrintStderr("error: failed opening \"%s\", error %u.\n",
+                    inputName, error);
+                return error;
+            }
+        }
+
+        // CodeQL [SM01937] Users should be able to specify the output file path.
+        error = m_writer.Create(m_o.output);
+        if (error != 0)
+        {
+            PrintStderr("error: failed creating file \"%s\", error %u.\n",
+                m_o.output, error);
+            return error;
+        }
+
+        if (!m_input.Mapped() || !m_input.Header(PERF_HEADER_COMPRESSED).empty() ||
+            m_o.dedupCallchains)
+        {
+            // Events are copied out of a buffer (or rewritten) one at a time,
+            // so combine them. (The write buffer would prevent copy_file_range,
+            // so it is not otherwise used for mapped inputs.)
+            error = m_writer.EnableWriteBuffer();
+            if (error != 0)
+            {
+                PrintStderr("error: failed enabling write buffer, error %u.\n",
+                    error);
+                goto Error;
+            }
+        }
+
+        m_filter.ClearCache();
+        for (;;)
+        {
+            perf_event_header const* pHeader;
+            error = m_input.ReadEvent(&pHeader);
+            if (!pHeader)
+            {
+                if (error != 0)
+                {
+                    PrintStderr("error: failed reading \"%s\", error %u.\n",
+                        inputName, error);
+                    goto Error;
+                }
+                break;
+            }
+
+            m_eventCount += 1;
+
+            bool keep;
+            switch (pHeader->type)
+            {
+            case PERF_RECORD_HEADER_ATTR:
+            case PERF_RECORD_HEADER_EVENT_TYPE:
+            case PERF_RECORD_HEADER_TRACING_DATA:
+            case PERF_RECORD_HEADER_BUILD_ID:
+            case PERF_RECORD_HEADER_FEATURE:
+                // Pipe-mode metadata. PerfDataFile merges it into its tables,
+                // and WriteMetadata writes the tables as headers.
+                keep = false;
+                break;
+            case PERF_RECORD_COMPRESSED:
+                // Only returned by ReadEvent if the library was built without zstd.
+                PrintStderr("error: \"%s\" has compressed events (not supported by this build).\n",
+                    inputName);
+                error = ENOTSUP;
+                goto Error;
+            case PERF_RECORD_SAMPLE:
+                keep = KeepSample(pHeader);
+                break;
+            default:
+                keep = true;
+                break;
+            }
+
+            if (keep)
+            {
+                error = m_o.dedupCallchains && pHeader->type == PERF_RECORD_SAMPLE
+                    ? WriteSampleDedup(pHeader)
+                    : WriteEvent(pHeader, m_input.EventDataSize(pHeader));
+                if (error != 0)
+                {
+                    goto WriteError;
+                }
+            }
+        }
+
+        error = FlushRun();
+        if (error == 0)
+        {
+            error = FlushBatch();
+        }
+
+        if (error != 0)
+        {
+            goto WriteError;
+        }
+
+        error = WriteMetadata();
+        if (error != 0)
+        {
+            goto Error;
+        }
+
+        error = m_writer.FinalizeAndClose();
+        if (error != 0)
+        {
+            PrintStderr("error: failed finalizing \"%s\", error %u.\n",
+                m_o.output, error);
+            unlink(m_o.output);
+            return error;
+        }
+
+        if (m_o.dedupCallchains)
+        {
+            auto const stacksPath = std::string(m_o.output) + ".stacks";
+            error = m_stacks.Save(stacksPath.c_str());
+            if (error != 0)
+            {
+                PrintStderr("error: failed writing \"%s\", error %u.\n",
+                    stacksPath.c_str(), error);
+                return error;
+            }
+
+            PrintStderr("info: %u distinct stacks saved %llu bytes, wrote \"%s\".\n",
+                m_stacks.size(),
+                static_cast<unsigned long long>(m_dedupSavedBytes),
+                stacksPath.c_str());
+        }
+
+        PrintStderr("info: kept %llu of %llu samples (%llu events read), wrote \"%s\".\n",
+            static_cast<unsigned long long>(m_sampleKeptCount),
+            static_cast<unsigned long long>(m_sampleCount),
+            static_cast<unsigned long long>(m_eventCount),
+            m_o.output);
+        if (m_o.verbose)
+        {
+            PrintStderr("verbose: writev: %llu bytes in %llu calls; copy_file_range: %llu bytes in %llu runs; copied: %llu bytes.\n",
+                static_cast<unsigned long long>(m_writevBytes),
+                static_cast<unsigned long long>(m_writevCalls),
+                static_cast<unsigned long long>(m_copyRangeBytes),
+                static_cast<unsigned long long>(m_copyRangeRuns),
+                static_cast<unsigned long long>(m_copiedBytes));
+        }
+
+        return 0;
+
+    WriteError:
+
+        PrintStderr("error: failed writing \"%s\", error %u.\n",
+            m_o.output, error);
+
+    Error:
+
+        m_writer.CloseNoFinalize();
+        unlink(m_o.output);
+        return error;
+    }
+
+private:
+
+    bool
+    KeepSample(perf_event_header const* pHeader)
+    {
+        m_sampleCount += 1;
+
+        PerfSampleEventInfo info;
+        if (0 != m_input.GetSampleEventInfo(pHeader, &info))
+        {
+            // Can't evaluate the filters. Keep it only if nothing is filtered.
+            if (!m_filter.MatchesAll())
+            {
+                return false;
+            }
+        }
+        else if (!m_filter.Matches(info))
+        {
+            return false;
+        }
+        else if (info.SampleType() & PERF_SAMPLE_TIME)
+        {
+            if (info.time < m_firstTime)
+            {
+                m_firstTime = info.time;
+            }
+
+            if (info.time > m_lastTime)
+            {
+                m_lastTime = info.time;
+            }
+        }
+
+        m_sampleKeptCount += 1;
+        return true;
+    }
+
+    // Adds the event to the current run if it is in the mapping. Otherwise
+    // (pipe-mode or decompressed event), writes it immediately since the
+    // pointer is only valid until the next ReadEvent.
+    int
+    WriteEvent(perf_event_header const* pHeader, uint32_t size)
+    {
+        int error;
+
+        auto const pos = reinterpret_cast<uintptr_t>(pHeader) - reinterpret_cast<uintptr_t>(m_map.data());
+        if (pos < m_map.size())
+        {
+            if (pos == m_runEnd)
+            {
+                m_runEnd += size;
+                error = 0;
+            }
+            else
+            {
+                error = FlushRun();
+                m_runBegin = pos;
+                m_runEnd = pos + size;
+            }
+        }
+        else
+        {
+            error = FlushRun();
+            if (error == 0)
+            {
+                error = FlushBatch();
+            }
+
+            if (error == 0)
+            {
+                error = m_writer.WriteEventData(pHeader, size);
+                m_copiedBytes += size;
+            }
+        }
+
+        return error;
+    }
+
+    // Writes the sample with its callchain replaced by a reference to the
+    // stack in m_stacks. Samples without a callchain (or with a callchain that
+    // is no larger than a reference) are written unchanged.
+    int
+    WriteSampleDedup(perf_event_header const* pHeader)
+    {
+        PerfSampleEventInfo info;
+        if (0 != m_input.GetSampleEventInfo(pHeader, &info) ||
+            0 == (info.SampleType() & PERF_SAMPLE_CALLCHAIN) ||
+            0 != m_stacks.MakeReferenceSample(info, m_input.FileBigEndian(), m_dedupSample) ||
+            m_dedupSample.size() == pHeader->size)
+        {
+            return WriteEvent(pHeader, m_input.EventDataSize(pHeader));
+        }
+
+        int error = FlushRun();
+        if (error == 0)
+        {
+            error = FlushBatch();
+        }
+
+        if (error == 0)
+        {
+            error = m_writer.WriteEventData(m_dedupSample.data(), m_dedupSample.size());
+            m_copiedBytes += m_dedupSample.size();
+            m_dedupSavedBytes += pHeader->size - m_dedupSample.size();
+        }
+
+        return error;
+    }
+
+    // Large runs are copied from the input file, small runs are added to the
+    // writev batch.
+    int
+    FlushRun()
+    {
+        int error = 0;
+        auto const runBegin = m_runBegin;
+        auto const runSize = m_runEnd - m_runBegin;
+        m_runBegin = 0;
+        m_runEnd = 0;
+
+        if (runSize == 0)
+        {
+            // Nothing to do.
+        }
+        else if (runSize >= CopyRangeMin && m_srcFile >= 0)
+        {
+            error = FlushBatch();
+            if (error == 0)
+            {
+                error = m_writer.WriteEventDataFromFile(m_srcFile, runBegin, runSize);
+                m_copyRangeBytes += runSize;
+                m_copyRangeRuns += 1;
+            }
+        }
+        else
+        {
+            m_batch.push_back({ const_cast<char*>(m_map.data() + runBegin), static_cast<size_t>(runSize) });
+            m_batchBytes += static_cast<size_t>(runSize);
+            if (m_batch.size() >= IovecsMax || m_batchBytes >= BatchBytesMax)
+            {
+                error = FlushBatch();
+            }
+        }
+
+        return error;
+    }
+
+    int
+    FlushBatch()
+    {
+        int error = 0;
+
+        for (size_t i = 0; i != m_batch.size();)
+        {
+            auto const written = m_writer.WriteEventDataIovecs(&m_batch[i], static_cast<int>(m_batch.size() - i));
+            m_writevCalls += 1;
+            if (written <= 0)
+            {
+                error = written < 0 ? errno : EIO;
+                break;
+            }
+
+            // Skip the fully-written iovecs and trim a partially-written one.
+            auto remaining = static_cast<size_t>(written);
+            while (i != m_batch.size() && remaining >= m_batch[i].iov_len)
+            {
+                remaining -= m_batch[i].iov_len;
+                i += 1;
+            }
+
+            if (remaining != 0)
+            {
+                m_batch[i].iov_base = static_cast<char*>(m_batch[i].iov_base) + remaining;
+                m_batch[i].iov_len -= remaining;
+            }
+        }
+
+        m_writevBytes += m_batchBytes;
+        m_batch.clear();
+        m_batchBytes = 0;
+        return error;
+    }
+
+    // Descs with names are added first, then descs without names fill gaps
+    // (same as perf-file-rewrite-sample).
+    int
+    AddEventDescs()
+    {
+        int error = 0;
+        std::unordered_set<uint64_t> idsAdded;
+        std::vector<uint64_t> ids;
+
+        for (unsigned pass = 0; pass != 2; pass += 1)
+        {
+            for (uintptr_t iDesc = 0; iDesc != m_input.EventDescCount(); iDesc += 1)
+            {
+                auto const& desc = m_input.EventDesc(iDesc);
+                if ((desc.name[0] != '\0') != (pass == 0))
+                {
+                    continue;
+                }
+
+                ids.clear();
+                for (uint32_t iId = 0; iId != desc.ids_count; iId += 1)
+                {
+                    if (idsAdded.insert(desc.ids[iId]).second)
+                    {
+                        ids.push_back(desc.ids[iId]);
+                    }
+                }
+
+                if (ids.empty())
+                {
+                    continue;
+                }
+
+                PerfEventDesc newDesc = desc;
+                newDesc.ids = ids.data();
+                newDesc.ids_count = static_cast<uint32_t>(ids.size());
+                if (desc.metadata == nullptr)
+                {
+                    error = m_writer.AddEventDesc(newDesc);
+                }
+                else
+                {
+                    error = m_writer.AddTracepointEventDesc(newDesc);
+                    if (error == EEXIST)
+                    {
+                        // Format already added (same tracepoint in another attr).
+                        error = m_writer.AddEventDesc(newDesc);
+                    }
+                }
+
+                if (error != 0)
+                {
+                    return error;
+                }
+            }
+        }
+
+        return error;
+    }
+
+    int
+    WriteMetadata()
+    {
+        int error;
+
+        error = AddEventDescs();
+        if (error != 0)
+        {
+            goto Done;
+        }
+
+        if (m_input.TracingDataLongSize() != 0)
+        {
+            error = m_writer.SetTracingData(
+                m_input.TracingDataLongSize(),
+                m_input.TracingDataPageSize(),
+                m_input.TracingDataHeaderPage(),
+                m_input.TracingDataHeaderEvent(),
+                m_input.TracingDataFtraces(),
+                m_input.TracingDataFtraceCount(),
+                m_input.TracingDataKallsyms(),
+                m_input.TracingDataPrintk(),
+                m_input.TracingDataSavedCmdLine());
+            if (error != 0)
+            {
+                goto Done;
+            }
+        }
+
+        for (unsigned i = PERF_HEADER_FIRST_FEATURE; i != PERF_HEADER_LAST_FEATURE; i += 1)
+        {
+            auto const index = static_cast<PerfHeaderIndex>(i);
+            switch (index)
+            {
+            case PERF_HEADER_TRACING_DATA: // Synthesized from the tracepoint EventDescs.
+            case PERF_HEADER_EVENT_DESC: // Synthesized from the EventDescs.
+            case PERF_HEADER_COMPRESSED: // Event data is written uncompressed.
+            case PERF_HEADER_SAMPLE_TIME: // Set from the kept samples.
+                continue;
+            default:
+                break;
+            }
+
+            auto const header = m_input.Header(index);
+            if (!header.empty())
+            {
+                error = m_writer.SetHeader(index, header.data(), header.size());
+                if (error != 0)
+                {
+                    goto Done;
+                }
+            }
+        }
+
+        if (m_firstTime <= m_lastTime)
+        {
+            error = m_writer.SetSampleTimeHeader(m_firstTime, m_lastTime);
+        }
+
+    Done:
+
+        if (error != 0)
+        {
+            PrintStderr("error: failed copying metadata to \"%s\", error %u.\n",
+                m_o.output, error);
+        }
+
+        return error;
+    }
+};
+
+int
+main(int argc, char* argv[])
+{
+    int error;
+
+    try
+    {
+        Options o;
+        PerfEventFilter filter;
+        std::vector<char const*> inputs;
+        uint64_t keywordAny = 0;
+        uint64_t keywordAll = 0;
+        uint64_t timeMin = 0;
+        uint64_t timeMax = UINT64_MAX;
+        uint64_t value;
+        bool showHelp = false;
+        bool usageError = false;
+
+        for (int argi = 1; argi < argc; argi += 1)
+        {
+            auto const* const arg = argv[argi];
+            if (arg[0] != '-')
+            {
+                inputs.push_back(arg);
+            }
+            else if (arg[1] == '\0')
+            {
+                inputs.push_back(""); // "-" means stdin.
+            }
+            else if (arg[1] != '-')
+            {
+                auto const flags = &arg[1];
+                for (unsigned flagsPos = 0; flags[flagsPos] != '\0'; flagsPos += 1)
+                {
+                    auto const flag = flags[flagsPos];
+                    switch (flag)
+                    {
+                    case 'o':
+                        argi += 1;
+                        if (argi < argc)
+                        {
+                            o.output = argv[argi];
+                        }
+                        else
+                        {
+                            PrintStderr("error: missing filename for flag -o.\n");
+                            usageError = true;
+                        }
+                        break;
+                    case 'e':
+                        argi += 1;
+                        ArgGlob("-e", argi, argc, argv, &usageError, filter, false);
+                        break;
+                    case 'p':
+                        argi += 1;
+                        ArgGlob("-p", argi, argc, argv, &usageError, filter, true);
+                        break;
+                    case 'v':
+                        o.verbose = true;
+                        break;
+                    case 'h':
+                        showHelp = true;
+                        break;
+                    default:
+                        PrintStderr("error: invalid flag -%c.\n",
+                            flag);
+                        usageError = true;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                auto const flag = &arg[2];
+                if (0 == strcmp(flag, "output"))
+                {
+                    argi += 1;
+                    if (argi < argc)
+                    {
+                        o.output = argv[argi];
+                    }
+                    else
+                    {
+                        PrintStderr("error: missing filename for flag --output.\n");
+                        usageError = true;
+                    }
+                }
+                else if (0 == strcmp(flag, "event"))
+                {
+                    argi += 1;
+                    ArgGlob("--event", argi, argc, argv, &usageError, filter, false);
+                }
+                else if (0 == strcmp(flag, "provider"))
+                {
+                    argi += 1;
+                    ArgGlob("--provider", argi, argc, argv, &usageError, filter, true);
+                }
+                else if (0 == strcmp(flag, "level"))
+                {
+                    argi += 1;
+                    if (ArgUInt("--level", argi, argc, argv, &usageError, 0xFF, &value))
+                    {
+                        filter.SetLevelMax(static_cast<uint8_t>(value));
+                    }
+                }
+                else if (0 == strcmp(flag, "keyword"))
+                {
+                    argi += 1;
+                    ArgUInt("--keyword", argi, argc, argv, &usageError, UINT64_MAX, &keywordAny);
+                }
+                else if (0 == strcmp(flag, "keyword-all"))
+                {
+                    argi += 1;
+                    ArgUInt("--keyword-all", argi, argc, argv, &usageError, UINT64_MAX, &keywordAll);
+                }
+                else if (0 == strcmp(flag, "pid"))
+                {
+                    argi += 1;
+                    if (ArgUInt("--pid", argi, argc, argv, &usageError, UINT32_MAX, &value))
+                    {
+                        filter.AddPid(static_cast<uint32_t>(value));
+                    }
+                }
+                else if (0 == strcmp(flag, "tid"))
+                {
+                    argi += 1;
+                    if (ArgUInt("--tid", argi, argc, argv, &usageError, UINT32_MAX, &value))
+                    {
+                        filter.AddTid(static_cast<uint32_t>(value));
+                    }
+                }
+                else if (0 == strcmp(flag, "time-min"))
+                {
+                    argi += 1;
+                    ArgUInt("--time-min", argi, argc, argv, &usageError, UINT64_MAX, &timeMin);
+                }
+                else if (0 == strcmp(flag, "time-max"))
+                {
+                    argi += 1;
+                    ArgUInt("--time-max", argi, argc, argv, &usageError, UINT64_MAX, &timeMax);
+                }
+                else if (0 == strcmp(flag, "dedup-callchains"))
+                {
+                    o.dedupCallchains = true;
+                }
+                else if (0 == strcmp(flag, "verbose"))
+                {
+                    o.verbose = true;
+                }
+                else if (0 == strcmp(flag, "help"))
+                {
+                    showHelp = true;
+                }
+                else
+                {
+                    PrintStderr("error: invalid flag \"--%s\".\n",
+                        flag);
+                    usageError = true;
+                }
+            }
+        }
+
+        if (showHelp || usageError)
+        {
+            fputs(UsageCommon, stdout);
+            fputs(showHelp ? UsageLong : UsageShort, stdout);
+            error = EINVAL;
+        }
+        else if (inputs.size() != 1)
+        {
+            PrintStderr("error: expected one input file, exiting.\n");
+            error = EINVAL;
+        }
+        else
+        {
+            if (keywordAny != 0 || keywordAll != 0)
+            {
+                filter.SetKeywordMask(keywordAny, keywordAll);
+            }
+
+            filter.SetTimeRange(timeMin, timeMax);
+
+            Filterer filterer(o, filter);
+            error = filterer.Filter(inputs[0]);
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        PrintStderr("fatal error: %s.\n",
+            ex.what());
+        error = ENOMEM;
+    }
+
+    return error;
+}
@@ -0,0 +1,1081 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Simple tool for merging several perf.data files (e.g. one per host or per
+collection segment) into one time-ordered perf.data file.
+*/
+
+#include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfDataFileWriter.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <tracepoint/PerfEventInfo.h>
+#include <tracepoint/PerfEventMetadata.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define PROGRAM_NAME "perf-merge"
+
+using namespace std::string_view_literals;
+using namespace tracepoint_decode;
+
+static char const* const UsageCommon = R"(
+Usage: )" PROGRAM_NAME R"( [options...] Input1.data Input2.data...
+)";
+
+// Usage error: stderr += UsageCommon + UsageShort.
+static char const* const UsageShort = R"(
+Try ")" PROGRAM_NAME R"( --help" for more information.
+)";
+
+// -h or --help: stdout += UsageCommon + UsageLong.
+static char const* const UsageLong = R"(
+Merges the events of the input perf.data files into one perf.data file, in
+timestamp order, in a single pass over the inputs.
+
+Inputs are read one round at a time (a round ends at a FINISHED_ROUND record,
+which perf-collect and "perf record" write after each buffer flush). An event
+is written once no input can still produce an older event, so memory use is
+bounded by about two rounds per input. An input without FINISHED_ROUND
+records is read completely before its events are written.
+
+Metadata is combined so that the output decodes like the inputs:
+
+- Sample IDs that are used by more than one input are given new values in
+  the events and event descriptors of the later inputs.
+- Tracepoint formats that are identical (same system, name, and format,
+  ignoring the tracepoint ID) are stored once. Different formats that have
+  the same tracepoint ID are given new IDs in the attributes and in the
+  common_type field of the events.
+- Timestamps are converted to the clock of the first input that has
+  CLOCK_DATA (if the inputs have CLOCK_DATA), so events from hosts with
+  different boot times are ordered by wall-clock time.
+- Other headers (hostname, CPU information, etc.) are copied from the first
+  input.
+
+Inputs must have the same byte order as this host.
+
+Options:
+
+-o, --output <file> Set the output filename. The default is "./perf.data".
+
+-v, --verbose       Show diagnostic output.
+
+-h, --help          Show this help message and exit.
+)";
+
+struct Options
+{
+    char const* output = "./perf.data";
+    bool verbose = false;
+};
+
+// fprintf(stderr, "PROGRAM_NAME: " + format, args...).
+static void
+PrintStderr(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fputs(PROGRAM_NAME ": ", stderr);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+// Returns the format with the "ID: nnn" line removed, prefixed by the system
+// name, i.e. a key that is the same for identical tracepoints on different
+// hosts.
+static std::string
+FormatKey(PerfEventMetadata const& metadata)
+{
+    auto const format = metadata.FormatFileContents();
+    std::string key;
+    key.reserve(metadata.SystemName().size() + 1 + format.size());
+    key += metadata.SystemName();
+    key += '\n';
+
+    size_t pos = 0;
+    while (pos < format.size())
+    {
+        auto lineEnd = format.find('\n', pos);
+        lineEnd = lineEnd == format.npos ? format.size() : lineEnd + 1;
+        auto const line = format.substr(pos, lineEnd - pos);
+        if (line.substr(0, 3) != "ID:"sv)
+        {
+            key += line;
+        }
+
+        pos = lineEnd;
+    }
+
+    return key;
+}
+
+// Returns the format with the "ID: nnn" line changed to "ID: newId".
+static std::string
+FormatWithId(std::string_view format, uint32_t newId)
+{
+    std::string result;
+    result.reserve(format.size() + 10);
+
+    size_t pos = 0;
+    while (pos < format.size())
+    {
+        auto lineEnd = format.find('\n', pos);
+        lineEnd = lineEnd == format.npos ? format.size() : lineEnd + 1;
+        auto const line = format.substr(pos, lineEnd - pos);
+        if (line.substr(0, 3) != "ID:"sv)
+        {
+            result += line;
+        }
+        else
+        {
+            result += "ID: ";
+            result += std::to_string(newId);
+            result += '\n';
+        }
+
+        pos = lineEnd;
+    }
+
+    return result;
+}
+
+// Where an input's tracepoint went in the output.
+struct CommonTypeMapping
+{
+    PerfEventMetadata const* metadata; // Metadata with Id() == output common_type.
+    uint32_t oldId;
+    uint8_t fieldOffset; // Offset of the common_type field in raw data.
+    uint8_t fieldSize; // Size of the common_type field (0 if not usable).
+};
+
+struct Input
+{
+    char const* path;
+    PerfDataFile file;
+    std::unordered_map<uint64_t, uint64_t> ids; // Input sample_id -> output sample_id.
+    std::unordered_map<uint32_t, CommonTypeMapping> commonTypes; // Input common_type -> output.
+    int64_t timeDelta = 0; // Added to each timestamp.
+    uint64_t lastTime = 0; // Time of the most recent event that had a time.
+    uint64_t maxTimeSeen = 0;
+    uint64_t roundFlushTime = 0;
+    uint64_t doneTime = 0; // Events with time <= doneTime have all been read.
+    uint64_t eventCount = 0;
+    bool timeDeltaSet = false;
+    bool eof = false;
+};
+
+// An event waiting to be written, host-endian, ids and time already rewritten.
+struct PendingEvent
+{
+    std::vector<uint64_t> data;
+    uint32_t size;
+};
+
+using EventMap = std::multimap<uint64_t, PendingEvent>;
+
+// Merges inputs. Holds the state shared by the inputs.
+class Merger
+{
+    struct FormatInfo
+    {
+        uint32_t id;
+        PerfEventMetadata const* metadata;
+    };
+
+    // Metadata owned by the merger (for tracepoints that were given a new ID).
+    struct OwnedMetadata
+    {
+        std::string systemName;
+        std::string format;
+        PerfEventMetadata metadata;
+    };
+
+    Options const& m_o;
+    std::vector<std::unique_ptr<Input>> m_inputs;
+    PerfDataFileWriter m_writer;
+    EventMap m_events;
+    std::vector<EventMap::node_type> m_freeNodes;
+    std::unordered_set<uint64_t> m_idsUsed;
+    std::unordered_set<uint32_t> m_commonTypesUsed;
+    std::unordered_map<std::string, FormatInfo> m_formats; // FormatKey -> output tracepoint.
+    std::deque<OwnedMetadata> m_ownedMetadata;
+    PerfEventSessionInfo const* m_pReferenceSessionInfo = nullptr; // Clock of the output.
+    uint64_t m_nextId = 1;
+    uint32_t m_nextCommonType = 1;
+    uint64_t m_firstTime = UINT64_MAX;
+    uint64_t m_lastTime = 0;
+    unsigned m_remappedIds = 0;
+    unsigned m_remappedCommonTypes = 0;
+    unsigned m_dedupedFormats = 0;
+
+public:
+
+    explicit
+    Merger(Options const& o)
+        : m_o(o)
+    {
+        return;
+    }
+
+    int
+    Merge(char const* const* inputPaths, unsigned inputCount)
+    {
+        int error = 0;
+
+        m_inputs.reserve(inputCount);
+        for (unsigned i = 0; i != inputCount; i += 1)
+        {
+            auto& input = *m_inputs.emplace_back(std::make_unique<Input>());
+            input.path = inputPaths[i];
+
+            // CodeQL [SM01937] Users should be able to specify the input file path.
+            error = input.file.OpenMapped(input.path);
+            if (error != 0)
+            {
+                PrintStderr("error: failed opening \"%s\", error %u.\n",
+                    input.path, error);
+                return error;
+            }
+            else if (input.file.ByteReader().ByteSwapNeeded())
+            {
+                // The writer would mix host-endian headers with file-endian data.
+                PrintStderr("error: \"%s\" has a different byte order.\n",
+                    input.path);
+                return ENOTSUP;
+            }
+        }
+
+        // Assign output ids in input order so the earliest input keeps its ids.
+        // (Pipe-format inputs get more attrs as they are read. Those are
+        // mapped when first seen.)
+        for (auto& pInput : m_inputs)
+        {
+            auto& input = *pInput;
+            for (uintptr_t iDesc = 0; iDesc != input.file.EventDescCount(); iDesc += 1)
+            {
+                auto const& desc = input.file.EventDesc(iDesc);
+                for (uint32_t iId = 0; iId != desc.ids_count; iId += 1)
+                {
+                    MapId(input, desc.ids[iId]);
+                }
+
+                if (desc.metadata != nullptr)
+                {
+                    MapCommonType(input, *desc.metadata);
+                }
+            }
+        }
+
+        // CodeQL [SM01937] Users should be able to specify the output file path.
+        error = m_writer.Create(m_o.output);
+        if (error != 0)
+        {
+            PrintStderr("error: failed creating file \"%s\", error %u.\n",
+                m_o.output, error);
+            return error;
+        }
+
+        error = m_writer.EnableWriteBuffer();
+        if (error != 0)
+        {
+            PrintStderr("error: failed enabling write buffer, error %u.\n",
+                error);
+            goto Error;
+        }
+
+        for (;;)
+        {
+            // Read a round from the input that is furthest behind, then write
+            // the events that no input can precede.
+            Input* pNext = nullptr;
+            uint64_t doneTime = UINT64_MAX;
+            for (auto& pInput : m_inputs)
+            {
+                if (!pInput->eof && (pNext == nullptr || pInput->doneTime < pNext->doneTime))
+                {
+                    pNext = pInput.get();
+                }
+            }
+
+            if (pNext == nullptr)
+            {
+                break;
+            }
+
+            error = ReadRound(*pNext);
+            if (error != 0)
+            {
+                goto Error;
+            }
+
+            for (auto& pInput : m_inputs)
+            {
+                if (!pInput->eof && pInput->doneTime < doneTime)
+                {
+                    doneTime = pInput->doneTime;
+                }
+            }
+
+            error = WriteEvents(doneTime);
+            if (error != 0)
+            {
+                goto Error;
+            }
+        }
+
+        error = WriteMetadata();
+        if (error != 0)
+        {
+            goto Error;
+        }
+
+        error = m_writer.FinalizeAndClose();
+        if (error != 0)
+        {
+            PrintStderr("error: failed finalizing \"%s\", error %u.\n",
+                m_o.output, error);
+            unlink(m_o.output);
+            return error;
+        }
+
+        if (m_o.verbose)
+        {
+            for (auto const& pInput : m_inputs)
+            {
+                PrintStderr("verbose: \"%s\": %llu events, time delta %lld ns.\n",
+                    pInput->path,
+                    static_cast<unsigned long long>(pInput->eventCount),
+                    static_cast<long long>(pInput->timeDelta));
+            }
+
+            PrintStderr("verbose: %u sample ids remapped, %u tracepoint ids remapped, %u duplicate formats merged.\n",
+                m_remappedIds, m_remappedCommonTypes, m_dedupedFormats);
+        }
+
+        return 0;
+
+    Error:
+
+        m_writer.CloseNoFinalize();
+        unlink(m_o.output);
+        return error;
+    }
+
+private:
+
+    // Sets input.timeDelta so that timestamps are converted to the session
+    // clock of the first input with CLOCK_DATA to be read:
+    // time + (inputOffset - referenceOffset). Called at the input's first event
+    // (pipe-format inputs get CLOCK_DATA from records before the events).
+    void
+    SetTimeDelta(Input& input) noexcept
+    {
+        auto const& sessionInfo = input.file.SessionInfo();
+        input.timeDeltaSet = true;
+        if (!sessionInfo.ClockOffsetKnown())
+        {
+            PrintStderr("warning: \"%s\" has no CLOCK_DATA, timestamps not converted.\n",
+                input.path);
+            return;
+        }
+
+        if (m_pReferenceSessionInfo == nullptr)
+        {
+            m_pReferenceSessionInfo = &sessionInfo;
+        }
+
+        auto const offset = sessionInfo.ClockOffset();
+        auto const referenceOffset = m_pReferenceSessionInfo->ClockOffset();
+        input.timeDelta =
+            (offset.tv_sec - referenceOffset.tv_sec) * 1000000000 +
+            (static_cast<int64_t>(offset.tv_nsec) - static_cast<int64_t>(referenceOffset.tv_nsec));
+    }
+
+    // Returns the output sample_id for the input's sample_id. Keeps the id
+    // unless an earlier mapping already uses it.
+    uint64_t
+    MapId(Input& input, uint64_t oldId)
+    {
+        auto [it, inserted] = input.ids.try_emplace(oldId, oldId);
+        if (inserted && !m_idsUsed.insert(oldId).second)
+        {
+            while (!m_idsUsed.insert(m_nextId).second)
+            {
+                m_nextId += 1;
+            }
+
+            it->second = m_nextId;
+            m_remappedIds += 1;
+        }
+
+        return it->second;
+    }
+
+    // Returns the output tracepoint for the input's tracepoint. Identical
+    // formats share one output tracepoint. Keeps the common_type unless an
+    // earlier (different) format already uses it.
+    CommonTypeMapping const&
+    MapCommonType(Input& input, PerfEventMetadata const& metadata)
+    {
+        auto const oldId = metadata.Id();
+        auto [it, inserted] = input.commonTypes.try_emplace(oldId);
+        if (!inserted)
+        {
+            return it->second;
+        }
+
+        auto& mapping = it->second;
+        mapping.oldId = oldId;
+        mapping.fieldOffset = 0;
+        mapping.fieldSize = 0;
+        for (auto const& field : metadata.Fields())
+        {
+            if (field.Name() == "common_type"sv)
+            {
+                if (field.Offset() < 0x100 && (field.Size() == 2 || field.Size() == 4))
+                {
+                    mapping.fieldOffset = static_cast<uint8_t>(field.Offset());
+                    mapping.fieldSize = static_cast<uint8_t>(field.Size());
+                }
+                break;
+            }
+        }
+
+        auto [formatIt, newFormat] = m_formats.try_emplace(FormatKey(metadata));
+        auto& format = formatIt->second;
+        if (!newFormat)
+        {
+            // Same tracepoint as an earlier input.
+            m_dedupedFormats += 1;
+        }
+        else if (m_commonTypesUsed.insert(oldId).second)
+        {
+            format.id = oldId;
+            format.metadata = &metadata;
+        }
+        else
+        {
+            // A different tracepoint already has this id.
+            while (!m_commonTypesUsed.insert(m_nextCommonType).second)
+            {
+                m_nextCommonType += 1;
+            }
+
+            auto& owned = m_ownedMetadata.emplace_back();
+            owned.systemName = metadata.SystemName();
+            owned.format = FormatWithId(metadata.FormatFileContents(), m_nextCommonType);
+            if (!owned.metadata.Parse(input.file.TracingDataLongSize() != 4, owned.systemName, owned.format) ||
+                owned.metadata.Id() != m_nextCommonType)
+            {
+                PrintStderr("warning: \"%s\": could not assign a new id to tracepoint %.*s:%.*s.\n",
+                    input.path,
+                    static_cast<int>(metadata.SystemName().size()), metadata.SystemName().data(),
+                    static_cast<int>(metadata.Name().size()), metadata.Name().data());
+                m_ownedMetadata.pop_back();
+                format.id = oldId;
+                format.metadata = &metadata;
+            }
+            else
+            {
+                format.id = m_nextCommonType;
+                format.metadata = &owned.metadata;
+            }
+        }
+
+        mapping.metadata = format.metadata;
+        if (format.id != oldId)
+        {
+            m_remappedCommonTypes += 1;
+        }
+
+        return mapping;
+    }
+
+    // Reads events from input until the end of the current round (or EOF),
+    // rewriting them and adding them to m_events.
+    int
+    ReadRound(Input& input)
+    {
+        int error;
+
+        for (;;)
+        {
+            perf_event_header const* pHeader;
+            error = input.file.ReadEvent(&pHeader);
+            if (pHeader == nullptr)
+            {
+                if (error != 0)
+                {
+                    // Keep the events read so far.
+                    PrintStderr("warning: \"%s\": read error %u after %llu events, ignoring rest of input.\n",
+                        input.path, error, static_cast<unsigned long long>(input.eventCount));
+                }
+
+                input.eof = true;
+                input.doneTime = UINT64_MAX;
+                return 0;
+            }
+
+            switch (pHeader->type)
+            {
+            case PERF_RECORD_FINISHED_ROUND:
+                // Events after this are not older than the events before the
+                // previous round.
+                input.doneTime = input.roundFlushTime;
+                input.roundFlushTime = input.maxTimeSeen;
+                return 0;
+            case PERF_RECORD_HEADER_ATTR:
+            case PERF_RECORD_HEADER_EVENT_TYPE:
+            case PERF_RECORD_HEADER_TRACING_DATA:
+            case PERF_RECORD_HEADER_BUILD_ID:
+            case PERF_RECORD_HEADER_FEATURE:
+            case PERF_RECORD_ID_INDEX:
+            case PERF_RECORD_FINISHED_INIT:
+                // Metadata goes to the output headers. ID_INDEX would have the
+                // input's ids.
+                continue;
+            case PERF_RECORD_COMPRESSED:
+                // Only returned if the library was built without zstd.
+                PrintStderr("error: \"%s\" is compressed, but this tool was built without zstd.\n",
+                    input.path);
+                return ENOTSUP;
+            default:
+                break;
+            }
+
+            if (!input.timeDeltaSet)
+            {
+                SetTimeDelta(input);
+            }
+
+            auto const size = input.file.EventDataSize(pHeader);
+            EventMap::node_type node;
+            if (m_freeNodes.empty())
+            {
+                node = m_events.extract(m_events.emplace(0, PendingEvent()));
+            }
+            else
+            {
+                node = std::move(m_freeNodes.back());
+                m_freeNodes.pop_back();
+            }
+
+            auto& pending = node.mapped();
+            pending.size = size;
+            pending.data.resize((size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+            memcpy(pending.data.data(), pHeader, size);
+
+            uint64_t time;
+            if (RewriteEvent(input, pHeader, pending.data.data(), &time))
+            {
+                input.lastTime = time;
+                if (time > input.maxTimeSeen)
+                {
+                    input.maxTimeSeen = time;
+                }
+            }
+            else
+            {
+                // Keep untimed events near the events around them.
+                time = input.lastTime;
+            }
+
+            node.key() = time;
+            m_events.insert(std::move(node));
+            input.eventCount += 1;
+        }
+    }
+
+    // Remaps the sample_ids, common_type, and time of the copy of the event.
+    // Returns true and sets *pTime if the event has a time.
+    bool
+    RewriteEvent(Input& input, perf_event_header const* pHeader, uint64_t* pArray, uint64_t* pTime)
+    {
+        auto const cArray = pHeader->size / sizeof(uint64_t);
+        bool hasTime = false;
+
+        if (pHeader->type == PERF_RECORD_SAMPLE)
+        {
+            PerfSampleEventInfo info;
+            if (0 != input.file.GetSampleEventInfo(pHeader, &info))
+            {
+                return false;
+            }
+
+            // Same layout as in PerfDataFile::GetSampleEventInfo.
+            auto const sampleType = info.SampleType();
+            size_t iArray = 1;
+            if (sampleType & PERF_SAMPLE_IDENTIFIER)
+            {
+                pArray[iArray] = MapId(input, pArray[iArray]);
+                iArray += 1;
+            }
+
+            iArray += (0 != (sampleType & PERF_SAMPLE_IP)) + (0 != (sampleType & PERF_SAMPLE_TID));
+            if (sampleType & PERF_SAMPLE_TIME)
+            {
+                pArray[iArray] += static_cast<uint64_t>(input.timeDelta);
+                *pTime = pArray[iArray];
+                hasTime = true;
+                iArray += 1;
+            }
+
+            iArray += (0 != (sampleType & PERF_SAMPLE_ADDR));
+            if (sampleType & PERF_SAMPLE_ID)
+            {
+                pArray[iArray] = MapId(input, pArray[iArray]);
+            }
+
+            if ((sampleType & PERF_SAMPLE_READ) && (info.Attr().read_format & PERF_FORMAT_ID))
+            {
+                RewriteReadValues(input, info.Attr().read_format,
+                    pArray + (info.read_values - reinterpret_cast<uint64_t const*>(pHeader)));
+            }
+
+            auto const pMetadata = info.Metadata();
+            if ((sampleType & PERF_SAMPLE_RAW) && pMetadata != nullptr)
+            {
+                auto const& mapping = MapCommonType(input, *pMetadata);
+                auto const newId = mapping.metadata->Id();
+                if (newId != mapping.oldId &&
+                    mapping.fieldSize != 0 &&
+                    mapping.fieldOffset + mapping.fieldSize <= info.raw_data_size)
+                {
+                    auto const pField = reinterpret_cast<char*>(pArray) +
+                        (static_cast<char const*>(info.raw_data) - reinterpret_cast<char const*>(pHeader)) +
+                        mapping.fieldOffset;
+                    if (mapping.fieldSize == 2)
+                    {
+                        auto const newId16 = static_cast<uint16_t>(newId);
+                        memcpy(pField, &newId16, sizeof(newId16));
+                    }
+                    else
+                    {
+                        memcpy(pField, &newId, sizeof(newId));
+                    }
+                }
+            }
+        }
+        else if (pHeader->type < PERF_RECORD_USER_TYPE_START)
+        {
+            // Ids in the body of the record.
+            switch (pHeader->type)
+            {
+            case PERF_RECORD_LOST: // { header, u64 id, u64 lost, sample_id }
+                if (cArray > 1)
+                {
+                    pArray[1] = MapId(input, pArray[1]);
+                }
+                break;
+            case PERF_RECORD_THROTTLE: // { header, u64 time, u64 id, u64 stream_id, sample_id }
+            case PERF_RECORD_UNTHROTTLE:
+                if (cArray > 2)
+                {
+                    pArray[2] = MapId(input, pArray[2]);
+                }
+                break;
+            default:
+                break;
+            }
+
+            PerfNonSampleEventInfo info;
+            if (0 != input.file.GetNonSampleEventInfo(pHeader, &info) ||
+                !info.Attr().sample_id_all)
+            {
+                return false;
+            }
+
+            // Same layout as in PerfDataFile::GetNonSampleEventInfo.
+            auto const sampleType = info.SampleType();
+            auto iArray = cArray;
+            if (sampleType & PERF_SAMPLE_IDENTIFIER)
+            {
+                iArray -= 1;
+                pArray[iArray] = MapId(input, pArray[iArray]);
+            }
+
+            iArray -= (0 != (sampleType & PERF_SAMPLE_CPU)) + (0 != (sampleType & PERF_SAMPLE_STREAM_ID));
+            if (sampleType & PERF_SAMPLE_ID)
+            {
+                iArray -= 1;
+                pArray[iArray] = MapId(input, pArray[iArray]);
+            }
+
+            if (sampleType & PERF_SAMPLE_TIME)
+            {
+                iArray -= 1;
+                pArray[iArray] += static_cast<uint64_t>(input.timeDelta);
+                *pTime = pArray[iArray];
+                hasTime = true;
+            }
+        }
+
+        return hasTime;
+    }
+
+    // Remaps the ids in a PERF_SAMPLE_READ block (already validated by
+    // GetSampleEventInfo).
+    void
+    RewriteReadValues(Input& input, uint64_t readFormat, uint64_t* pValues)
+    {
+        unsigned const cTimes =
+            (0 != (readFormat & PERF_FORMAT_TOTAL_TIME_ENABLED)) +
+            (0 != (readFormat & PERF_FORMAT_TOTAL_TIME_RUNNING));
+        if (readFormat & PERF_FORMAT_GROUP)
+        {
+            // { u64 nr, [time_enabled], [time_running], { u64 value, u64 id, [lost] } * nr }
+            auto const cValues = pValues[0];
+            auto const cPerValue = 2u + (0 != (readFormat & PERF_FORMAT_LOST));
+            auto pValue = pValues + 1 + cTimes;
+            for (uint64_t i = 0; i != cValues; i += 1, pValue += cPerValue)
+            {
+                pValue[1] = MapId(input, pValue[1]);
+            }
+        }
+        else
+        {
+            // { u64 value, [time_enabled], [time_running], u64 id, [lost] }
+            pValues[1 + cTimes] = MapId(input, pValues[1 + cTimes]);
+        }
+    }
+
+    // Writes (and frees) the pending events with time <= doneTime.
+    int
+    WriteEvents(uint64_t doneTime)
+    {
+        int error = 0;
+        bool wroteEvents = false;
+
+        while (!m_events.empty() && m_events.begin()->first <= doneTime)
+        {
+            auto node = m_events.extract(m_events.begin());
+            auto const& pending = node.mapped();
+            error = m_writer.WriteEventData(pending.data.data(), pending.size);
+            if (error != 0)
+            {
+                PrintStderr("error: failed writing \"%s\", error %u.\n",
+                    m_o.output, error);
+                return error;
+            }
+
+            auto const type = reinterpret_cast<perf_event_header const*>(pending.data.data())->type;
+            if (type == PERF_RECORD_SAMPLE)
+            {
+                if (node.key() < m_firstTime)
+                {
+                    m_firstTime = node.key();
+                }
+
+                if (node.key() > m_lastTime)
+                {
+                    m_lastTime = node.key();
+                }
+            }
+
+            wroteEvents = true;
+            m_freeNodes.push_back(std::move(node));
+        }
+
+        if (wroteEvents)
+        {
+            // Output is sorted, so readers can flush after each batch.
+            error = m_writer.WriteFinishedRound();
+            if (error != 0)
+            {
+                PrintStderr("error: failed writing \"%s\", error %u.\n",
+                    m_o.output, error);
+            }
+        }
+
+        return error;
+    }
+
+    // Adds an input's EventDescs to the output, with output ids and
+    // common_type. Descs with names are added first, then descs without
+    // names fill gaps (same as perf-file-rewrite-sample).
+    int
+    AddEventDescs(Input& input)
+    {
+        int error = 0;
+        std::unordered_set<uint64_t> idsAdded;
+        std::vector<uint64_t> ids;
+
+        for (unsigned pass = 0; pass != 2; pass += 1)
+        {
+            for (uintptr_t iDesc = 0; iDesc != input.file.EventDescCount(); iDesc += 1)
+            {
+                auto const& desc = input.file.EventDesc(iDesc);
+                if ((desc.name[0] != '\0') != (pass == 0))
+                {
+                    continue;
+                }
+
+                ids.clear();
+                for (uint32_t iId = 0; iId != desc.ids_count; iId += 1)
+                {
+                    auto const newId = MapId(input, desc.ids[iId]);
+                    if (idsAdded.insert(newId).second)
+                    {
+                        ids.push_back(newId);
+                    }
+                }
+
+                if (ids.empty())
+                {
+                    continue;
+                }
+
+                auto attr = *desc.attr;
+                PerfEventDesc newDesc = desc;
+                newDesc.attr = &attr;
+                newDesc.ids = ids.data();
+                newDesc.ids_count = static_cast<uint32_t>(ids.size());
+                if (desc.metadata == nullptr)
+                {
+                    error = m_writer.AddEventDesc(newDesc);
+                }
+                else
+                {
+                    auto const& mapping = MapCommonType(input, *desc.metadata);
+                    attr.config = mapping.metadata->Id();
+                    newDesc.metadata = mapping.metadata;
+                    error = m_writer.AddTracepointEventDesc(newDesc);
+                    if (error == EEXIST)
+                    {
+                        // Format already added (same tracepoint in another attr or input).
+                        error = m_writer.AddEventDesc(newDesc);
+                    }
+                }
+
+                if (error != 0)
+                {
+                    return error;
+                }
+            }
+        }
+
+        return error;
+    }
+
+    int
+    WriteMetadata()
+    {
+        int error = 0;
+
+        for (auto& pInput : m_inputs)
+        {
+            error = AddEventDescs(*pInput);
+            if (error != 0)
+            {
+                goto Done;
+            }
+        }
+
+        for (auto& pInput : m_inputs)
+        {
+            auto const& file = pInput->file;
+            if (file.TracingDataLongSize() != 0)
+            {
+                error = m_writer.SetTracingData(
+                    file.TracingDataLongSize(),
+                    file.TracingDataPageSize(),
+                    file.TracingDataHeaderPage(),
+                    file.TracingDataHeaderEvent(),
+                    file.TracingDataFtraces(),
+                    file.TracingDataFtraceCount(),
+                    file.TracingDataKallsyms(),
+                    file.TracingDataPrintk(),
+                    file.TracingDataSavedCmdLine());
+                if (error != 0)
+                {
+                    goto Done;
+                }
+                break;
+            }
+        }
+
+        for (unsigned i = PERF_HEADER_FIRST_FEATURE; i != PERF_HEADER_LAST_FEATURE; i += 1)
+        {
+            auto const index = static_cast<PerfHeaderIndex>(i);
+            switch (index)
+            {
+            case PERF_HEADER_TRACING_DATA: // Synthesized from the tracepoint EventDescs.
+            case PERF_HEADER_EVENT_DESC: // Synthesized from the EventDescs.
+            case PERF_HEADER_COMPRESSED: // Event data is written uncompressed.
+            case PERF_HEADER_SAMPLE_TIME: // Set from the merged events.
+            case PERF_HEADER_CLOCKID: // Set from the reference input.
+            case PERF_HEADER_CLOCK_DATA:
+                continue;
+            default:
+                break;
+            }
+
+            auto const header = m_inputs[0]->file.Header(index);
+            if (!header.empty())
+            {
+                error = m_writer.SetHeader(index, header.data(), header.size());
+                if (error != 0)
+                {
+                    goto Done;
+                }
+            }
+        }
+
+        // Times were converted to the clock of the reference input.
+        error = m_writer.SetSessionInfoHeaders(m_pReferenceSessionInfo != nullptr
+            ? *m_pReferenceSessionInfo
+            : m_inputs[0]->file.SessionInfo());
+        if (error != 0)
+        {
+            goto Done;
+        }
+
+        if (m_firstTime <= m_lastTime)
+        {
+            error = m_writer.SetSampleTimeHeader(m_firstTime, m_lastTime);
+        }
+
+    Done:
+
+        if (error != 0)
+        {
+            PrintStderr("error: failed copying metadata to \"%s\", error %u.\n",
+                m_o.output, error);
+        }
+
+        return error;
+    }
+};
+
+int
+main(int argc, char* argv[])
+{
+    int error;
+
+    try
+    {
+        Options o;
+        std::vector<char const*> inputs;
+        bool showHelp = false;
+        bool usageError = false;
+
+        for (int argi = 1; argi < argc; argi += 1)
+        {
+            auto const* const arg = argv[argi];
+            if (arg[0] != '-')
+            {
+                inputs.push_back(arg);
+            }
+            else if (arg[1] != '-')
+            {
+                auto const flags = &arg[1];
+                for (unsigned flagsPos = 0; flags[flagsPos] != '\0'; flagsPos += 1)
+                {
+                    auto const flag = flags[flagsPos];
+                    switch (flag)
+                    {
+                    case 'o':
+                        argi += 1;
+                        if (argi < argc)
+                        {
+                            o.output = argv[argi];
+                        }
+                        else
+                        {
+                            PrintStderr("error: missing filename for flag -o.\n");
+                            usageError = true;
+                        }
+                        break;
+                    case 'v':
+                        o.verbose = true;
+                        break;
+                    case 'h':
+                        showHelp = true;
+                        break;
+                    default:
+                        PrintStderr("error: invalid flag -%c.\n",
+                            flag);
+                        usageError = true;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                auto const flag = &arg[2];
+                if (0 == strcmp(flag, "output"))
+                {
+                    argi += 1;
+                    if (argi < argc)
+                    {
+                        o.output = argv[argi];
+                    }
+                    else
+                    {
+                        PrintStderr("error: missing filename for flag --output.\n");
+                        usageError = true;
+                    }
+                }
+                else if (0 == strcmp(flag, "verbose"))
+                {
+                    o.verbose = true;
+                }
+                else if (0 == strcmp(flag, "help"))
+                {
+                    showHelp = true;
+                }
+                else
+                {
+                    PrintStderr("error: invalid flag \"--%s\".\n",
+                        flag);
+                    usageError = true;
+                }
+            }
+        }
+
+        if (showHelp || usageError)
+        {
+            fputs(UsageCommon, stdout);
+            fputs(showHelp ? UsageLong : UsageShort, stdout);
+            error = EINVAL;
+        }
+        else if (inputs.empty())
+        {
+            PrintStderr("error: no input files specified, exiting.\n");
+            error = EINVAL;
+        }
+        else
+        {
+            Merger merger(o);
+            error = merger.Merge(inputs.data(), static_cast<unsigned>(inputs.size()));
+            if (error == 0)
+            {
+                PrintStderr("info: merged %u files into \"%s\".\n",
+                    static_cast<unsigned>(inputs.size()), o.output);
+            }
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        PrintStderr("fatal error: %s.\n",
+            ex.what());
+        error = ENOMEM;
+    }
+
+    return error;
+}
@@ -0,0 +1,654 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Simple tool for receiving pipe-format event streams (e.g. from
+perf-collect --connect) and saving them to perf.data files.
+*/
+
+#include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfDataFileWriter.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <memory>
+#include <string>
+
+#ifndef _Inout_
+#define _Inout_
+#endif
+
+#define PROGRAM_NAME "perf-receive"
+
+using namespace tracepoint_decode;
+
+static char const* const UsageCommon = R"(
+Usage: )" PROGRAM_NAME R"( [options...] Address
+)";
+
+// Usage error: stderr += UsageCommon + UsageShort.
+static char const* const UsageShort = R"(
+Try ")" PROGRAM_NAME R"( --help" for more information.
+)";
+
+// -h or --help: stdout += UsageCommon + UsageLong.
+static char const* const UsageLong = R"(
+Listens on the specified address, accepts a connection, and saves the
+pipe-format event stream received from the connection (e.g. from
+"perf-collect --connect <address>") to a perf.data file. By default, the
+stream is rebuilt as a normal perf.data file (with the metadata in the file
+headers, readable by tools that need to seek). The file is finalized when the
+sender closes the connection.
+
+Address is "<host>:<port>" or ":<port>" (all interfaces) for TCP, or
+"unix:<path>" for a Unix domain socket. The Unix domain socket is removed
+when the tool exits.
+
+Options:
+
+-o, --output <file> Set the output filename. The default is "./perf.data".
+                    Use "-" to write the stream to stdout (implies --raw),
+                    e.g. to pipe it to "perf-decode -".
+
+-n, --count <count> Accept <count> connections, one after another. If <count>
+                    is more than 1, the output files are named "<file>.0",
+                    "<file>.1", etc. The default is 1.
+
+--raw               Save the stream as received (pipe format) instead of
+                    rebuilding it. This uses less CPU, but the output can
+                    only be read sequentially (e.g. by perf-decode or
+                    "perf report -i <file>").
+
+-v, --verbose       Show diagnostic output.
+
+-h, --help          Show this help message and exit.
+)";
+
+struct Options
+{
+    char const* output = "./perf.data";
+    bool raw = false;
+    bool verbose = false;
+};
+
+// fprintf(stderr, "PROGRAM_NAME: " + format, args...).
+static void
+PrintStderr(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fputs(PROGRAM_NAME ": ", stderr);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+static void
+ArgSize(
+    _In_z_ char const* flagName,
+    unsigned maxValue,
+    int argi,
+    int argc,
+    _In_reads_(argc) char* argv[],
+    _Inout_ bool* usageError,
+    _Inout_ unsigned* value)
+{
+    if (argi >= argc)
+    {
+        PrintStderr("error: missing value for flag %s.\n",
+            flagName);
+        *usageError = true;
+    }
+    else
+    {
+        auto const* const arg = argv[argi];
+        auto argValue = strtoul(arg, nullptr, 0);
+        if (argValue == 0)
+        {
+            PrintStderr("error: expected positive integer for flag %s \"%s\".\n",
+                flagName, arg);
+            *usageError = true;
+        }
+        else if (argValue > maxValue)
+        {
+            PrintStderr("error: value %lu too large (max %u) for flag %s \"%s\".\n",
+                argValue, maxValue, flagName, arg);
+            *usageError = true;
+        }
+        else
+        {
+            *value = static_cast<unsigned>(argValue);
+        }
+    }
+}
+
+// Creates a listening socket for address. On error, reports the error and
+// returns -1.
+static int
+Listen(char const* address)
+{
+    int sock = -1;
+    int error;
+
+    if (0 == strncmp(address, "unix:", 5))
+    {
+        sockaddr_un addr = {};
+        auto const path = address + 5;
+        auto const pathLen = strlen(path);
+        if (pathLen == 0 || pathLen >= sizeof(addr.sun_path))
+        {
+            PrintStderr("error: invalid Unix domain socket path \"%s\".\n",
+                path);
+            return -1;
+        }
+
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path, pathLen);
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        error = sock < 0 ? errno
+            : 0 != bind(sock, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) ? errno
+            : 0;
+    }
+    else
+    {
+        // "host:port", "[host]:port", or ":port".
+        auto const colon = strrchr(address, ':');
+        if (colon == nullptr || colon[1] == '\0')
+        {
+            PrintStderr("error: invalid address \"%s\" (expected host:port or unix:path).\n",
+                address);
+            return -1;
+        }
+
+        std::string host(address, colon);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        {
+            host = host.substr(1, host.size() - 2);
+        }
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* addrs = nullptr;
+        auto const gaiError = getaddrinfo(host.empty() ? nullptr : host.c_str(), colon + 1, &hints, &addrs);
+        if (gaiError != 0)
+        {
+            PrintStderr("error: cannot resolve \"%s\": %s.\n",
+                address, gai_strerror(gaiError));
+            return -1;
+        }
+
+        error = EADDRNOTAVAIL;
+        for (auto ai = addrs; ai != nullptr; ai = ai->ai_next)
+        {
+            sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (sock < 0)
+            {
+                error = errno;
+                continue;
+            }
+
+            int const one = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (0 == bind(sock, ai->ai_addr, ai->ai_addrlen))
+            {
+                error = 0;
+                break;
+            }
+
+            error = errno;
+            close(sock);
+            sock = -1;
+        }
+
+        freeaddrinfo(addrs);
+    }
+
+    if (error == 0 && 0 != listen(sock, 1))
+    {
+        error = errno;
+    }
+
+    if (error != 0)
+    {
+        PrintStderr("error: failed listening on \"%s\", error %u.\n",
+            address, error);
+        if (sock >= 0)
+        {
+            close(sock);
+        }
+
+        return -1;
+    }
+
+    return sock;
+}
+
+// Copies the stream from conn to path ("-" = stdout) without parsing it.
+static int
+ReceiveRaw(int conn, char const* path, _Out_ uint64_t* pBytes)
+{
+    int error = 0;
+    uint64_t bytes = 0;
+
+    bool const isStdout = 0 == strcmp(path, "-");
+    int const output = isStdout
+        ? STDOUT_FILENO
+        : open(path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+    if (output < 0)
+    {
+        error = errno;
+        PrintStderr("error: failed creating file \"%s\", error %u.\n",
+            path, error);
+        *pBytes = 0;
+        return error;
+    }
+
+    auto const buffer = std::make_unique<char[]>(0x100000);
+    for (;;)
+    {
+        auto const readSize = read(conn, buffer.get(), 0x100000);
+        if (readSize <= 0)
+        {
+            if (readSize < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                error = errno;
+                PrintStderr("error: failed receiving stream, error %u.\n",
+                    error);
+            }
+
+            break;
+        }
+
+        for (ssize_t written = 0; written < readSize;)
+        {
+            auto const writeSize = write(output, buffer.get() + written, static_cast<size_t>(readSize - written));
+            if (writeSize < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                error = errno;
+                PrintStderr("error: failed writing \"%s\", error %u.\n",
+                    path, error);
+                goto Done;
+            }
+
+            written += writeSize;
+        }
+
+        bytes += static_cast<uint64_t>(readSize);
+    }
+
+Done:
+
+    if (!isStdout)
+    {
+        close(output);
+    }
+
+    *pBytes = bytes;
+    return error;
+}
+
+// Reads the stream from conn and writes it to path as a normal perf.data file.
+static int
+ReceiveRebuild(Options const& o, int conn, char const* path, _Out_ uint64_t* pBytes)
+{
+    int error;
+    PerfDataFile reader;
+    PerfDataFileWriter writer;
+    unsigned eventCount = 0;
+
+    *pBytes = 0;
+
+    error = reader.OpenPipeFromFile(conn);
+    if (error != 0)
+    {
+        PrintStderr("error: failed reading pipe header from connection, error %u.\n",
+            error);
+        return error;
+    }
+    else if (reader.ByteReader().ByteSwapNeeded())
+    {
+        // The writer would mix host-endian headers with file-endian data.
+        PrintStderr("error: sender has a different byte order (use --raw).\n");
+        return ENOTSUP;
+    }
+
+    error = writer.Create(path);
+    if (error != 0)
+    {
+        PrintStderr("error: failed creating file \"%s\", error %u.\n",
+            path, error);
+        return error;
+    }
+
+    error = writer.EnableWriteBuffer();
+    if (error != 0)
+    {
+        PrintStderr("error: failed enabling write buffer, error %u.\n",
+            error);
+        writer.CloseNoFinalize();
+        unlink(path);
+        return error;
+    }
+
+    // Event data goes to the data section. Metadata records go to the headers.
+    for (;;)
+    {
+        perf_event_header const* pHeader;
+        error = reader.ReadEvent(&pHeader);
+        if (pHeader == nullptr)
+        {
+            if (error != 0)
+            {
+                // Keep the events received so far.
+                PrintStderr("warning: stream ended with error %u after %u events.\n",
+                    error, eventCount);
+                error = 0;
+            }
+
+            break;
+        }
+
+        switch (pHeader->type)
+        {
+        case PERF_RECORD_HEADER_ATTR:
+        case PERF_RECORD_HEADER_EVENT_TYPE:
+        case PERF_RECORD_HEADER_TRACING_DATA:
+        case PERF_RECORD_HEADER_BUILD_ID:
+        case PERF_RECORD_HEADER_FEATURE:
+            continue;
+        case PERF_RECORD_COMPRESSED:
+            // Only returned if the library was built without zstd.
+            PrintStderr("error: stream is compressed, but this tool was built without zstd (use --raw).\n");
+            error = ENOTSUP;
+            break;
+        default:
+            error = writer.WriteEventData(pHeader, reader.EventDataSize(pHeader));
+            if (error != 0)
+            {
+                PrintStderr("error: failed writing \"%s\", error %u.\n",
+                    path, error);
+            }
+            break;
+        }
+
+        if (error != 0)
+        {
+            writer.CloseNoFinalize();
+            return error;
+        }
+
+        eventCount += 1;
+    }
+
+    for (uintptr_t i = 0; i != reader.EventDescCount() && error == 0; i += 1)
+    {
+        auto const& desc = reader.EventDesc(i);
+        error = desc.metadata != nullptr
+            ? writer.AddTracepointEventDesc(desc)
+            : writer.AddEventDesc(desc);
+        if (error == EEXIST)
+        {
+            // Same tracepoint in two attrs (e.g. split HEADER_ATTR records).
+            error = writer.AddEventDesc(desc);
+        }
+    }
+
+    for (unsigned i = 0; i != PERF_HEADER_LAST_FEATURE && error == 0; i += 1)
+    {
+        auto const index = static_cast<PerfHeaderIndex>(i);
+        if (index == PERF_HEADER_EVENT_DESC || // Synthesized from the EventDescs.
+            index == PERF_HEADER_COMPRESSED) // Event data is written uncompressed.
+        {
+            continue;
+        }
+
+        auto const header = reader.Header(index);
+        if (!header.empty())
+        {
+            error = writer.SetHeader(index, header.data(), header.size());
+        }
+    }
+
+    if (error != 0)
+    {
+        PrintStderr("error: failed copying metadata to \"%s\", error %u.\n",
+            path, error);
+        writer.CloseNoFinalize();
+        return error;
+    }
+
+    *pBytes = writer.EventDataBytes();
+    error = writer.FinalizeAndClose();
+    if (error != 0)
+    {
+        PrintStderr("error: failed finalizing \"%s\", error %u.\n",
+            path, error);
+    }
+    else if (o.verbose)
+    {
+        PrintStderr("verbose: %u events, %u event descriptors.\n",
+            eventCount, static_cast<unsigned>(reader.EventDescCount()));
+    }
+
+    return error;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int error;
+    int listener = -1;
+    char const* address = nullptr;
+
+    try
+    {
+        Options o;
+        unsigned const countMax = 1000000;
+        unsigned count = 1;
+        bool showHelp = false;
+        bool usageError = false;
+
+        for (int argi = 1; argi < argc; argi += 1)
+        {
+            auto const* const arg = argv[argi];
+            if (arg[0] != '-')
+            {
+                if (address != nullptr)
+                {
+                    PrintStderr("error: unexpected argument \"%s\".\n",
+                        arg);
+                    usageError = true;
+                }
+
+                address = arg;
+            }
+            else if (arg[1] != '-')
+            {
+                auto const flags = &arg[1];
+                for (unsigned flagsPos = 0; flags[flagsPos] != '\0'; flagsPos += 1)
+                {
+                    auto const flag = flags[flagsPos];
+                    switch (flag)
+                    {
+                    case 'n':
+                        argi += 1;
+                        ArgSize("-n", countMax, argi, argc, argv, &usageError, &count);
+                        break;
+                    case 'o':
+                        argi += 1;
+                        if (argi < argc)
+                        {
+                            o.output = argv[argi];
+                        }
+                        else
+                        {
+                            PrintStderr("error: missing filename for flag -o.\n");
+                            usageError = true;
+                        }
+                        break;
+                    case 'v':
+                        o.verbose = true;
+                        break;
+                    case 'h':
+                        showHelp = true;
+                        break;
+                    default:
+                        PrintStderr("error: invalid flag -%c.\n",
+                            flag);
+                        usageError = true;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                auto const flag = &arg[2];
+                if (0 == strcmp(flag, "count"))
+                {
+                    argi += 1;
+                    ArgSize("--count", countMax, argi, argc, argv, &usageError, &count);
+                }
+                else if (0 == strcmp(flag, "output"))
+                {
+                    argi += 1;
+                    if (argi < argc)
+                    {
+                        o.output = argv[argi];
+                    }
+                    else
+                    {
+                        PrintStderr("error: missing filename for flag --output.\n");
+                        usageError = true;
+                    }
+                }
+                else if (0 == strcmp(flag, "raw"))
+                {
+                    o.raw = true;
+                }
+                else if (0 == strcmp(flag, "verbose"))
+                {
+                    o.verbose = true;
+                }
+                else if (0 == strcmp(flag, "help"))
+                {
+                    showHelp = true;
+                }
+                else
+                {
+                    PrintStderr("error: invalid flag \"--%s\".\n",
+                        flag);
+                    usageError = true;
+                }
+            }
+        }
+
+        if (0 == strcmp(o.output, "-"))
+        {
+            o.raw = true;
+        }
+
+        if (showHelp || usageError)
+        {
+            fputs(UsageCommon, stdout);
+            fputs(showHelp ? UsageLong : UsageShort, stdout);
+            error = EINVAL;
+            goto Done;
+        }
+        else if (address == nullptr)
+        {
+            PrintStderr("error: no address specified, exiting.\n");
+            error = EINVAL;
+            goto Done;
+        }
+
+        // A closed stdout should fail the write (EPIPE), not kill us.
+        signal(SIGPIPE, SIG_IGN);
+
+        listener = Listen(address);
+        if (listener < 0)
+        {
+            error = EADDRNOTAVAIL;
+            address = nullptr; // Not ours to remove.
+            goto Done;
+        }
+
+        error = 0;
+        for (unsigned i = 0; i != count; i += 1)
+        {
+            std::string path = o.output;
+            if (count != 1 && 0 != strcmp(path.c_str(), "-"))
+            {
+                path += '.';
+                path += std::to_string(i);
+            }
+
+            PrintStderr("info: listening on \"%s\".\n",
+                address);
+            int const conn = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0)
+            {
+                error = errno;
+                PrintStderr("error: accept failed, error %u.\n",
+                    error);
+                break;
+            }
+
+            uint64_t bytes;
+            auto const newError = o.raw
+                ? ReceiveRaw(conn, path.c_str(), &bytes)
+                : ReceiveRebuild(o, conn, path.c_str(), &bytes);
+            close(conn);
+
+            if (newError == 0)
+            {
+                PrintStderr("info: connection closed, wrote 0x%lX bytes to \"%s\".\n",
+                    static_cast<unsigned long>(bytes), path.c_str());
+            }
+            else if (error == 0)
+            {
+                error = newError;
+            }
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        PrintStderr("fatal error: %s.\n",
+            ex.what());
+        error = ENOMEM;
+    }
+
+Done:
+
+    if (listener >= 0)
+    {
+        close(listener);
+        if (address != nullptr && 0 == strncmp(address, "unix:", 5))
+        {
+            unlink(address + 5);
+        }
+    }
+
+    return error;
+}
@@ -0,0 +1,1444 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Collector for the shared-memory ring written by libtracepoint-shm (see
+tracepoint-shm.h). Drains the ring and saves the events to a perf.data file.
+*/
+
+#include <tracepoint/tracepoint-shm.h>
+#include <tracepoint/PerfDataFileWriter.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <tracepoint/PerfEventMetadata.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _Inout_
+#define _Inout_
+#endif
+
+#define PROGRAM_NAME "perf-shm-collect"
+#define EXIT_SIGNALS      SIGTERM, SIGINT
+#define EXIT_SIGNALS_STR "SIGTERM or SIGINT"
+
+using namespace std::string_view_literals;
+using namespace tracepoint_decode;
+
+static constexpr int ExitSigs[] = { EXIT_SIGNALS };
+
+static char const* const UsageCommon = R"(
+Usage: )" PROGRAM_NAME R"( [options...]
+)";
+
+// Usage error: stderr += UsageCommon + UsageShort.
+static char const* const UsageShort = R"(
+Try ")" PROGRAM_NAME R"( --help" for more information.
+)";
+
+// -h or --help: stdout += UsageCommon + UsageLong.
+static char const* const UsageLong = R"(
+Collects events from the shared-memory ring that is written by programs
+linked against libtracepoint-shm (instead of libtracepoint), and saves them
+to a perf.data file. Collection runs until )" EXIT_SIGNALS_STR R"( is
+received. Does not require any privileges or kernel support beyond access
+to the ring file.
+
+If the ring file does not exist, it is created. If it exists (e.g. from a
+previous run of this tool), the tool attaches to it and collects the events
+that are already in it, so programs that already mapped the ring keep
+working. Only one collector can be attached to a ring at a time.
+
+Events are saved as "user_events:EventName" tracepoints. The tracepoint
+format is generated from the event's registration string in the same way as
+the kernel's user_events facility, so the output decodes the same way as a
+user_events trace (e.g. with perf-decode).
+
+Options:
+
+-o, --output <file> Set the output filename. The default is "./perf.data".
+
+-r, --ring <file>   Set the ring filename. The default is the value of the
+                    )" TRACEPOINT_SHM_PATH_ENV R"( environment variable, or
+                    ")" TRACEPOINT_SHM_PATH_DEFAULT R"(" if it is not set.
+                    Programs must use the same path (via
+                    )" TRACEPOINT_SHM_PATH_ENV R"().
+
+-s, --size <size>   Set the size of the ring's data area, in kilobytes, when
+                    creating the ring. Rounded up to a power of 2. The default
+                    is 4096, min is 256, max is 1GB.
+
+-i, --interval <ms> Set the time to wait between drains of the ring, in
+                    milliseconds. The default is 10.
+
+-t, --stall-timeout <ms>
+                    Set how long a reserved record may stay unclaimed before
+                    it is skipped, in milliseconds. This recovers from a
+                    program that died (or was stopped) right after reserving
+                    space for an event, but loses the other unclaimed events
+                    that were reserved before the stall was seen. A program
+                    that resumes after its record was skipped drops that
+                    event. A record that a program has started writing is
+                    never skipped. The default is 1000. Use 0 to wait forever.
+
+-v, --verbose       Show diagnostic output.
+
+-h, --help          Show this help message and exit.
+)";
+
+static unsigned const RingRegistrySize = 0x40000;
+static unsigned const RingPageSize = 0x1000;
+
+// Size of the fields that precede the payload in the synthesized sample:
+// header, IDENTIFIER, TID, TIME, CPU, RAW size, common fields.
+static unsigned const SamplePrefixSize = 8 + 8 + 8 + 8 + 8 + 4 + 8;
+
+struct Options
+{
+    char const* output = "./perf.data";
+    char const* ringPath = nullptr;
+    unsigned sizeKB = 4096;
+    unsigned intervalMS = 10;
+    unsigned stallTimeoutMS = 1000;
+    bool verbose = false;
+};
+
+// One distinct "EventName ArgList" registration.
+struct ShmEvent
+{
+    std::string formatFile; // Referenced by metadata (must not move).
+    PerfEventMetadata metadata;
+    perf_event_attr attr = {};
+    std::string name; // "user_events:EventName"
+    uint64_t sampleId = 0;
+};
+
+// Attached ring.
+struct ShmRing
+{
+    int file = -1;
+    tracepoint_shm_header* header = nullptr;
+    size_t mapSize = 0;
+
+    ~ShmRing()
+    {
+        if (header != nullptr)
+        {
+            munmap(header, mapSize);
+        }
+
+        if (file >= 0)
+        {
+            close(file);
+        }
+    }
+};
+
+static uint64_t
+MonotonicNs() noexcept
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// fprintf(stderr, "PROGRAM_NAME: " + format, args...).
+static void
+PrintStderr(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fputs(PROGRAM_NAME ": ", stderr);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+static void
+ArgSize(
+    _In_z_ char const* flagName,
+    unsigned minValue,
+    unsigned maxValue,
+    int argi,
+    int argc,
+    _In_reads_(argc) char* argv[],
+    _Inout_ bool* usageError,
+    _Inout_ unsigned* value)
+{
+    if (argi >= argc)
+    {
+        PrintStderr("error: missing value for flag %s.\n",
+            flagName);
+        *usageError = true;
+    }
+    else
+    {
+        auto const* const arg = argv[argi];
+        auto argValue = strtoul(arg, nullptr, 0);
+        if (argValue < minValue)
+        {
+            PrintStderr("error: value %lu too small (min %u) for flag %s \"%s\".\n",
+                argValue, minValue, flagName, arg);
+            *usageError = true;
+        }
+        else if (argValue > maxValue)
+        {
+            PrintStderr("error: value %lu too large (max %u) for flag %s \"%s\".\n",
+                argValue, maxValue, flagName, arg);
+            *usageError = true;
+        }
+        else
+        {
+            *value = static_cast<unsigned>(argValue);
+        }
+    }
+}
+
+static bool
+IsSpace(char ch) noexcept
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+static std::string_view
+Trim(std::string_view str) noexcept
+{
+    while (!str.empty() && IsSpace(str.front()))
+    {
+        str.remove_prefix(1);
+    }
+
+    while (!str.empty() && IsSpace(str.back()))
+    {
+        str.remove_suffix(1);
+    }
+
+    return str;
+}
+
+// Returns the size of a user_events scalar type, or 0 if not recognized.
+// Sets *pSigned.
+static unsigned
+ScalarTypeSize(std::string_view type, _Out_ bool* pSigned) noexcept
+{
+    *pSigned = false;
+    if (type == "u8"sv || type == "__u8"sv || type == "uint8_t"sv ||
+        type == "unsigned char"sv)
+    {
+        return 1;
+    }
+    else if (type == "s8"sv || type == "__s8"sv || type == "int8_t"sv ||
+        type == "char"sv || type == "signed char"sv)
+    {
+        *pSigned = true;
+        return 1;
+    }
+    else if (type == "u16"sv || type == "__u16"sv || type == "uint16_t"sv ||
+        type == "unsigned short"sv)
+    {
+        return 2;
+    }
+    else if (type == "s16"sv || type == "__s16"sv || type == "int16_t"sv ||
+        type == "short"sv)
+    {
+        *pSigned = true;
+        return 2;
+    }
+    else if (type == "u32"sv || type == "__u32"sv || type == "uint32_t"sv ||
+        type == "unsigned int"sv || type == "unsigned"sv)
+    {
+        return 4;
+    }
+    else if (type == "s32"sv || type == "__s32"sv || type == "int32_t"sv ||
+        type == "int"sv || type == "pid_t"sv)
+    {
+        *pSigned = true;
+        return 4;
+    }
+    else if (type == "u64"sv || type == "__u64"sv || type == "uint64_t"sv ||
+        type == "unsigned long long"sv)
+    {
+        return 8;
+    }
+    else if (type == "s64"sv || type == "__s64"sv || type == "int64_t"sv ||
+        type == "long long"sv)
+    {
+        *pSigned = true;
+        return 8;
+    }
+    else if (type == "unsigned long"sv)
+    {
+        return sizeof(long);
+    }
+    else if (type == "long"sv)
+    {
+        *pSigned = true;
+        return sizeof(long);
+    }
+
+    return 0;
+}
+
+// Appends a tracefs format line for one user_events field definition, e.g.
+// "u32 MyField", "char MyField[20]", "__rel_loc u8[] MyField", or
+// "struct MyStruct MyField 24". Returns false if the field is not supported.
+static bool
+AppendFieldFormat(std::string& format, std::string_view field, _Inout_ unsigned* pOffset)
+{
+    unsigned size;
+    bool isSigned = false;
+    std::string_view decl = field; // Text for the "field:" property.
+
+    if (field.substr(0, 7) == "struct "sv)
+    {
+        // "struct Type Name Size"
+        auto const lastSpace = field.find_last_of(" \t");
+        auto const sizeStr = std::string(field.substr(lastSpace + 1));
+        char* sizeEnd;
+        auto const sizeVal = strtoul(sizeStr.c_str(), &sizeEnd, 0);
+        if (sizeVal == 0 || sizeVal > 0xFFFF || *sizeEnd != '\0')
+        {
+            return false;
+        }
+
+        size = static_cast<unsigned>(sizeVal);
+        decl = Trim(field.substr(0, lastSpace));
+    }
+    else if (field.substr(0, 11) == "__data_loc "sv || field.substr(0, 10) == "__rel_loc "sv)
+    {
+        size = 4;
+    }
+    else
+    {
+        // "Type Name", "Type[N] Name", or "Type Name[N]".
+        std::string text(field);
+        unsigned count = 1;
+        auto const bracket = text.find('[');
+        if (bracket != std::string::npos)
+        {
+            auto const bracketEnd = text.find(']', bracket);
+            if (bracketEnd == std::string::npos)
+            {
+                return false;
+            }
+
+            char* countEnd;
+            auto const countVal = strtoul(text.c_str() + bracket + 1, &countEnd, 0);
+            if (countVal == 0 || countVal > 0xFFFF || countEnd != text.c_str() + bracketEnd)
+            {
+                return false;
+            }
+
+            count = static_cast<unsigned>(countVal);
+            text.erase(bracket, bracketEnd + 1 - bracket);
+        }
+
+        auto const trimmed = Trim(text);
+        auto const lastSpace = trimmed.find_last_of(" \t");
+        if (lastSpace == std::string_view::npos)
+        {
+            return false;
+        }
+
+        // Normalize whitespace within the type, e.g. "unsigned  int".
+        std::string type;
+        for (auto ch : Trim(trimmed.substr(0, lastSpace)))
+        {
+            if (!IsSpace(ch))
+            {
+                type += ch;
+            }
+            else if (type.back() != ' ')
+            {
+                type += ' ';
+            }
+        }
+
+        auto const elementSize = ScalarTypeSize(type, &isSigned);
+        if (elementSize == 0 || elementSize * count > 0xFFFF)
+        {
+            return false;
+        }
+
+        size = elementSize * count;
+    }
+
+    if (*pOffset + size > 0xFFFF)
+    {
+        return false;
+    }
+
+    format += "\tfield:";
+    format += decl;
+    format += ";\toffset:";
+    format += std::to_string(*pOffset);
+    format += ";\tsize:";
+    format += std::to_string(size);
+    format += ";\tsigned:";
+    format += isSigned ? '1' : '0';
+    format += ";\n";
+    *pOffset += size;
+    return true;
+}
+
+// Generates the tracefs "format" file that user_events would generate for the
+// specified "EventName[:Flags] ArgList" registration.
+static std::string
+MakeFormatFile(
+    std::string_view nameArgs,
+    uint32_t id,
+    _Out_ std::string_view* pEventName,
+    _Out_ unsigned* pBadFieldCount)
+{
+    auto const nameEnd = nameArgs.find_first_of(" \t");
+    auto eventName = nameArgs.substr(0, nameEnd);
+    auto args = nameEnd == std::string_view::npos
+        ? std::string_view()
+        : nameArgs.substr(nameEnd + 1);
+
+    auto const flagsPos = eventName.find(':');
+    if (flagsPos != std::string_view::npos)
+    {
+        eventName = eventName.substr(0, flagsPos);
+    }
+
+    std::string format;
+    format += "name: ";
+    format += eventName;
+    format += "\nID: ";
+    format += std::to_string(id);
+    format += "\nformat:\n"
+        "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+        "\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+        "\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+        "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+        "\n";
+
+    unsigned badFieldCount = 0;
+    unsigned offset = 8;
+    while (!args.empty())
+    {
+        auto const semicolon = args.find(';');
+        auto const field = Trim(args.substr(0, semicolon));
+        args = semicolon == std::string_view::npos
+            ? std::string_view()
+            : args.substr(semicolon + 1);
+        if (!field.empty() && !AppendFieldFormat(format, field, &offset))
+        {
+            // Same as the kernel: a field we can't parse makes the rest of
+            // the payload undecodable, so stop here.
+            badFieldCount += 1;
+            break;
+        }
+    }
+
+    format += "\nprint fmt: \"\"\n";
+
+    *pEventName = eventName;
+    *pBadFieldCount = badFieldCount;
+    return format;
+}
+
+// Validates the ring header against the file size. Returns 0 if usable.
+static int
+ValidateRing(tracepoint_shm_header const* h, uint64_t fileSize) noexcept
+{
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != TRACEPOINT_SHM_MAGIC)
+    {
+        return EINVAL;
+    }
+    else if (h->version != TRACEPOINT_SHM_VERSION ||
+        h->header_size != sizeof(tracepoint_shm_header))
+    {
+        return ENOTSUP;
+    }
+    else if (
+        h->registry_offset < sizeof(tracepoint_shm_header) ||
+        h->registry_offset > fileSize ||
+        h->registry_size > 0x7FFFFFFF ||
+        0 != (h->registry_size & 7) ||
+        h->registry_size > fileSize - h->registry_offset ||
+        h->data_size == 0 ||
+        0 != (h->data_size & (h->data_size - 1)) ||
+        0 != (h->data_offset & 63) ||
+        h->data_offset > fileSize ||
+        h->data_size > fileSize - h->data_offset ||
+        0 != (h->claims_offset & 63) ||
+        h->claims_offset > fileSize ||
+        h->data_size / 2 > fileSize - h->claims_offset)
+    {
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+// Maps the ring file and validates it. Returns 0 for success.
+static int
+MapRing(ShmRing& ring, int file)
+{
+    struct stat st;
+    if (0 != fstat(file, &st))
+    {
+        return errno;
+    }
+    else if (st.st_size < static_cast<off_t>(sizeof(tracepoint_shm_header)))
+    {
+        return EINVAL;
+    }
+
+    auto const map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (map == MAP_FAILED)
+    {
+        return errno;
+    }
+
+    auto const header = static_cast<tracepoint_shm_header*>(map);
+    auto const error = ValidateRing(header, static_cast<uint64_t>(st.st_size));
+    if (error != 0)
+    {
+        munmap(map, static_cast<size_t>(st.st_size));
+        return error;
+    }
+
+    ring.header = header;
+    ring.mapSize = static_cast<size_t>(st.st_size);
+    return 0;
+}
+
+// Creates a new ring file at path. Initializes it under a temporary name, then
+// links it into place so that programs never see a partially-initialized
+// ring. Returns EEXIST if path already exists.
+static int
+CreateRing(ShmRing& ring, char const* path, uint64_t dataSize)
+{
+    int error;
+    auto const tempPath = std::string(path) + ".tmp." + std::to_string(getpid());
+    auto const dataOffset = RingPageSize + RingRegistrySize;
+    auto const claimsOffset = dataOffset + dataSize;
+    auto const fileSize = claimsOffset + dataSize / 2;
+
+    int const file = open(tempPath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (file < 0)
+    {
+        return errno;
+    }
+
+    if (0 != ftruncate(file, static_cast<off_t>(fileSize)))
+    {
+        error = errno;
+        goto Error;
+    }
+
+    {
+        auto const map = mmap(nullptr, static_cast<size_t>(fileSize), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if (map == MAP_FAILED)
+        {
+            error = errno;
+            goto Error;
+        }
+
+        auto const header = static_cast<tracepoint_shm_header*>(map);
+        header->version = TRACEPOINT_SHM_VERSION;
+        header->header_size = sizeof(tracepoint_shm_header);
+        header->registry_size = RingRegistrySize;
+        header->registry_offset = RingPageSize;
+        header->data_offset = dataOffset;
+        header->data_size = dataSize;
+        header->claims_offset = claimsOffset;
+        __atomic_store_n(&header->magic, TRACEPOINT_SHM_MAGIC, __ATOMIC_RELEASE);
+
+        ring.header = header;
+        ring.mapSize = static_cast<size_t>(fileSize);
+    }
+
+    if (0 != link(tempPath.c_str(), path))
+    {
+        error = errno;
+        munmap(ring.header, ring.mapSize);
+        ring.header = nullptr;
+        goto Error;
+    }
+
+    unlink(tempPath.c_str());
+    ring.file = file;
+    return 0;
+
+Error:
+
+    close(file);
+    unlink(tempPath.c_str());
+    return error;
+}
+
+// Attaches to the ring at path, creating it if it does not exist.
+static int
+OpenRing(Options const& o, ShmRing& ring, char const* path)
+{
+    int error;
+
+    uint64_t dataSize = 0x40000;
+    while (dataSize < static_cast<uint64_t>(o.sizeKB) * 1024u)
+    {
+        dataSize *= 2;
+    }
+
+    for (unsigned attempt = 0;; attempt += 1)
+    {
+        int const file = open(path, O_RDWR | O_CLOEXEC);
+        if (file >= 0)
+        {
+            error = MapRing(ring, file);
+            if (error != 0)
+            {
+                close(file);
+                PrintStderr("error: \"%s\" is not a valid ring file, error %u.\n",
+                    path, error);
+                return error;
+            }
+
+            ring.file = file;
+            if (o.verbose)
+            {
+                PrintStderr("verbose: attached to existing ring \"%s\" (0x%lX bytes).\n",
+                    path, static_cast<unsigned long>(ring.header->data_size));
+            }
+            break;
+        }
+        else if (errno != ENOENT || attempt != 0)
+        {
+            error = errno;
+            PrintStderr("error: failed opening ring \"%s\", error %u.\n",
+                path, error);
+            return error;
+        }
+
+        error = CreateRing(ring, path, dataSize);
+        if (error == 0)
+        {
+            if (o.verbose)
+            {
+                PrintStderr("verbose: created ring \"%s\" (0x%lX bytes).\n",
+                    path, static_cast<unsigned long>(dataSize));
+            }
+            break;
+        }
+        else if (error != EEXIST)
+        {
+            PrintStderr("error: failed creating ring \"%s\", error %u.\n",
+                path, error);
+            return error;
+        }
+
+        // Someone else created it. Try again to attach.
+    }
+
+    if (0 != flock(ring.file, LOCK_EX | LOCK_NB))
+    {
+        error = errno;
+        PrintStderr("error: another collector is attached to ring \"%s\".\n",
+            path);
+        return error == EWOULDBLOCK ? EBUSY : error;
+    }
+
+    return 0;
+}
+
+class Collector
+{
+    Options const& m_o;
+    ShmRing& m_ring;
+    PerfDataFileWriter& m_writer;
+    std::unordered_map<std::string_view, std::unique_ptr<ShmEvent>> m_eventsByNameArgs;
+    std::unordered_map<uint32_t, ShmEvent const*> m_eventsByEventId;
+    std::vector<std::string> m_nameArgs; // Keys of m_eventsByNameArgs.
+    uint64_t m_stallTail = UINT64_MAX; // Position of the uncommitted record, or UINT64_MAX.
+    uint64_t m_stallHead = 0; // data_head when the stall was first seen.
+    uint64_t m_stallStartNs = 0;
+
+public:
+
+    uint64_t sampleCount = 0;
+    uint64_t unknownCount = 0; // Records with an invalid event_id.
+    uint64_t stallCount = 0; // Number of times uncommitted records were skipped.
+    uint64_t stallBytes = 0; // Bytes of the ring skipped because of stalls.
+    uint64_t timeFirst = UINT64_MAX;
+    uint64_t timeLast = 0;
+
+    Collector(Options const& o, ShmRing& ring, PerfDataFileWriter& writer) noexcept
+        : m_o(o)
+        , m_ring(ring)
+        , m_writer(writer)
+    {
+        return;
+    }
+
+    // Writes all committed records to the writer. Returns 0 for success.
+    // Sets *pCount to the number of records consumed.
+    int
+    Drain(_Out_ uint64_t* pCount)
+    {
+        int error = 0;
+        auto const header = m_ring.header;
+        auto const data = reinterpret_cast<char*>(header) + header->data_offset;
+        auto const dataSize = header->data_size;
+        auto const mask = dataSize - 1;
+        uint64_t tail = __atomic_load_n(&header->data_tail, __ATOMIC_RELAXED); // We are the only consumer.
+        uint64_t count = 0;
+
+        for (;;)
+        {
+            auto const offset = tail & mask;
+            auto const record = reinterpret_cast<tracepoint_shm_record*>(data + offset);
+            auto const size = __atomic_load_n(&record->size, __ATOMIC_ACQUIRE);
+            if (size == 0)
+            {
+                if (SkipStalled(&tail))
+                {
+                    continue;
+                }
+
+                break; // Not yet committed.
+            }
+            else if (size < 8 || 0 != (size & 7) || size > dataSize - offset)
+            {
+                PrintStderr("error: corrupt ring record at position 0x%lX.\n",
+                    static_cast<unsigned long>(tail));
+                error = EINVAL;
+                break;
+            }
+
+            if (record->event_id != TRACEPOINT_SHM_PAD_ID)
+            {
+                if (size < sizeof(tracepoint_shm_record) ||
+                    record->data_size > size - sizeof(tracepoint_shm_record) ||
+                    record->data_size > TRACEPOINT_SHM_DATA_MAX)
+                {
+                    unknownCount += 1;
+                }
+                else
+                {
+                    error = WriteSample(*record);
+                    if (error != 0)
+                    {
+                        break;
+                    }
+                }
+
+                count += 1;
+            }
+
+            // Zero-fill so that the space reads as "not committed" when reused,
+            // and free its claim words for the next lap.
+            // Release: these must be visible before producers see the new tail.
+            memset(record, 0, size);
+            FreeClaims(tail, size);
+            tail += size;
+            __atomic_store_n(&header->data_tail, tail, __ATOMIC_RELEASE);
+        }
+
+        *pCount = count;
+        return error;
+    }
+
+    // Sets the claim words of [pos, pos + size) to free for the next lap.
+    // The range must not wrap.
+    void
+    FreeClaims(uint64_t pos, uint32_t size) noexcept
+    {
+        auto const header = m_ring.header;
+        auto const dataSize = header->data_size;
+        auto const claims = reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(header) + header->claims_offset) +
+            (pos & (dataSize - 1)) / 8;
+        auto const claimFree = TRACEPOINT_SHM_CLAIM_FREE(pos + dataSize, dataSize);
+        for (uint32_t i = 0; i != size / 8; i += 1)
+        {
+            __atomic_store_n(&claims[i], claimFree, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Called when the record at *pTail is not committed. If the record is
+    // reserved and has stayed uncommitted for longer than the stall timeout
+    // (e.g. the producer died before claiming it), reclaims the unclaimed
+    // space from *pTail up to the first claimed record (or the data_head seen
+    // when the stall began), then returns true. Otherwise returns false (wait
+    // for the record).
+    bool
+    SkipStalled(_Inout_ uint64_t* pTail) noexcept
+    {
+        auto const header = m_ring.header;
+        auto const tail = *pTail;
+        auto const head = __atomic_load_n(&header->data_head, __ATOMIC_RELAXED);
+        if (head == tail || m_o.stallTimeoutMS == 0)
+        {
+            return false; // Ring is empty, or never skip.
+        }
+
+        auto const nowNs = MonotonicNs();
+        if (m_stallTail != tail)
+        {
+            // New stall. Every record before head has been reserved, so its
+            // producer has the full timeout to claim it.
+            m_stallTail = tail;
+            m_stallHead = head;
+            m_stallStartNs = nowNs;
+            return false;
+        }
+
+        if (nowNs - m_stallStartNs < m_o.stallTimeoutMS * uint64_t(1000000))
+        {
+            return false;
+        }
+
+        // Move each claim word to the next lap so that a late producer's
+        // claim fails. A failed compare-exchange means that a producer claimed
+        // the word, i.e. a record starts there, so stop.
+        auto const dataSize = header->data_size;
+        auto const claims = reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(header) + header->claims_offset);
+        auto pos = tail;
+        for (; pos != m_stallHead; pos += 8)
+        {
+            auto expected = TRACEPOINT_SHM_CLAIM_FREE(pos, dataSize);
+            if (!__atomic_compare_exchange_n(
+                &claims[(pos & (dataSize - 1)) / 8],
+                &expected,
+                TRACEPOINT_SHM_CLAIM_FREE(pos + dataSize, dataSize),
+                false,
+                __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+
+        m_stallTail = UINT64_MAX;
+        if (pos == tail)
+        {
+            return false; // The record at tail is claimed. Wait for its commit.
+        }
+
+        if (m_o.verbose)
+        {
+            PrintStderr("verbose: skipped 0x%lX bytes after record at position 0x%lX was not claimed.\n",
+                static_cast<unsigned long>(pos - tail),
+                static_cast<unsigned long>(tail));
+        }
+
+        stallCount += 1;
+        stallBytes += pos - tail;
+        *pTail = pos;
+
+        // Release: the claim words must be updated before producers see the new tail.
+        __atomic_store_n(&header->data_tail, pos, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Adds the EventDescs for the events that were seen.
+    int
+    AddEventDescs()
+    {
+        for (auto const& pair : m_eventsByNameArgs)
+        {
+            auto const& event = *pair.second;
+            PerfEventDesc const desc = {
+                &event.attr,
+                event.name.c_str(),
+                &event.metadata,
+                &event.sampleId,
+                1
+            };
+
+            auto const error = m_writer.AddTracepointEventDesc(desc);
+            if (error != 0)
+            {
+                return error;
+            }
+        }
+
+        return 0;
+    }
+
+    size_t
+    EventCount() const noexcept
+    {
+        return m_eventsByNameArgs.size();
+    }
+
+private:
+
+    // Returns the event for the registration at eventId, or nullptr if the
+    // registration is not valid.
+    ShmEvent const*
+    GetEvent(uint32_t eventId)
+    {
+        auto const it = m_eventsByEventId.find(eventId);
+        if (it != m_eventsByEventId.end())
+        {
+            return it->second;
+        }
+
+        auto const header = m_ring.header;
+        auto const registrySize = header->registry_size;
+        if (eventId > registrySize - sizeof(tracepoint_shm_registration) ||
+            0 != (eventId & 7))
+        {
+            return nullptr;
+        }
+
+        auto const registry = reinterpret_cast<char const*>(header) + header->registry_offset;
+        auto const entry = reinterpret_cast<tracepoint_shm_registration const*>(registry + eventId);
+        if (!__atomic_load_n(&entry->ready, __ATOMIC_ACQUIRE))
+        {
+            return nullptr;
+        }
+
+        auto const entrySize = __atomic_load_n(&entry->size, __ATOMIC_RELAXED);
+        if (entrySize <= sizeof(tracepoint_shm_registration) ||
+            entrySize > registrySize - eventId)
+        {
+            return nullptr;
+        }
+
+        auto const nameArgsBegin = reinterpret_cast<char const*>(entry + 1);
+        auto const nameArgsMax = entrySize - sizeof(tracepoint_shm_registration);
+        auto const nameArgsLen = strnlen(nameArgsBegin, nameArgsMax);
+        if (nameArgsLen == 0 || nameArgsLen == nameArgsMax)
+        {
+            return nullptr;
+        }
+
+        auto const nameArgs = std::string_view(nameArgsBegin, nameArgsLen);
+        ShmEvent const* pEvent;
+        auto const existing = m_eventsByNameArgs.find(nameArgs);
+        if (existing != m_eventsByNameArgs.end())
+        {
+            pEvent = existing->second.get();
+        }
+        else if (m_eventsByNameArgs.size() >= 0xFFFF)
+        {
+            return nullptr; // common_type is 16 bits.
+        }
+        else
+        {
+            auto const id = static_cast<uint32_t>(m_eventsByNameArgs.size() + 1);
+            auto event = std::make_unique<ShmEvent>();
+
+            std::string_view eventName;
+            unsigned badFieldCount;
+            event->formatFile = MakeFormatFile(nameArgs, id, &eventName, &badFieldCount);
+            if (badFieldCount != 0)
+            {
+                PrintStderr("warning: unsupported field in \"%.*s\".\n",
+                    static_cast<unsigned>(nameArgs.size()), nameArgs.data());
+            }
+
+            if (!event->metadata.Parse(sizeof(long) == 8, "user_events"sv, event->formatFile))
+            {
+                return nullptr;
+            }
+
+            event->name = "user_events:";
+            event->name += eventName;
+            event->sampleId = id;
+            event->attr.type = PERF_TYPE_TRACEPOINT;
+            event->attr.size = PERF_ATTR_SIZE_VER3;
+            event->attr.config = id;
+            event->attr.sample_period = 1;
+            event->attr.sample_type =
+                PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                PERF_SAMPLE_CPU | PERF_SAMPLE_RAW;
+            event->attr.use_clockid = 1;
+            event->attr.clockid = CLOCK_MONOTONIC;
+
+            if (m_o.verbose)
+            {
+                PrintStderr("verbose: new event %u: \"%.*s\".\n",
+                    id, static_cast<unsigned>(nameArgs.size()), nameArgs.data());
+            }
+
+            m_nameArgs.emplace_back(nameArgs);
+            pEvent = event.get();
+            m_eventsByNameArgs.emplace(m_nameArgs.back(), std::move(event));
+        }
+
+        m_eventsByEventId.emplace(eventId, pEvent);
+        return pEvent;
+    }
+
+    int
+    WriteSample(tracepoint_shm_record const& record)
+    {
+        auto const event = GetEvent(record.event_id);
+        if (event == nullptr)
+        {
+            unknownCount += 1;
+            return 0;
+        }
+
+        // RAW = u32 size + common fields + payload, padded to 8 bytes.
+        auto const rawDataSize = 8u + record.data_size;
+        auto const rawPaddedSize = (4u + rawDataSize + 7u) & ~7u;
+        auto const sampleSize = SamplePrefixSize - 12u + rawPaddedSize;
+        assert(sampleSize <= 0xFFFF); // Guaranteed by TRACEPOINT_SHM_DATA_MAX.
+
+        alignas(8) uint8_t prefix[SamplePrefixSize];
+        uint8_t* p = prefix;
+        auto const put = [&p](void const* value, size_t size)
+            {
+                memcpy(p, value, size);
+                p += size;
+            };
+
+        perf_event_header eventHeader;
+        eventHeader.type = PERF_RECORD_SAMPLE;
+        eventHeader.misc = 2; // PERF_RECORD_MISC_USER
+        eventHeader.size = static_cast<uint16_t>(sampleSize);
+        uint32_t const zero32 = 0;
+        uint32_t const rawSize = rawPaddedSize - 4u;
+        uint16_t const commonType = static_cast<uint16_t>(event->sampleId);
+        uint16_t const zero16 = 0;
+
+        put(&eventHeader, sizeof(eventHeader));
+        put(&event->sampleId, 8);   // IDENTIFIER
+        put(&record.pid, 4);        // TID
+        put(&record.tid, 4);
+        put(&record.time, 8);       // TIME
+        put(&record.cpu, 4);        // CPU
+        put(&zero32, 4);
+        put(&rawSize, 4);           // RAW
+        put(&commonType, 2);        // common_type
+        put(&zero16, 2);            // common_flags, common_preempt_count
+        put(&record.tid, 4);        // common_pid
+        assert(p == prefix + SamplePrefixSize);
+
+        static uint8_t const padding[8] = {};
+        iovec vecs[3] = {
+            { prefix, SamplePrefixSize },
+            { const_cast<tracepoint_shm_record*>(&record + 1), record.data_size },
+            { const_cast<uint8_t*>(padding), rawPaddedSize - 4u - rawDataSize },
+        };
+
+        if (0 > m_writer.WriteEventDataIovecs(vecs, 3))
+        {
+            auto const error = errno;
+            PrintStderr("error: failed writing \"%s\", error %u.\n",
+                m_o.output, error);
+            return error;
+        }
+
+        sampleCount += 1;
+        if (record.time < timeFirst)
+        {
+            timeFirst = record.time;
+        }
+
+        if (record.time > timeLast)
+        {
+            timeLast = record.time;
+        }
+
+        return 0;
+    }
+};
+
+// Sets the system information headers. Returns 0 for success.
+static int
+SetWriterHeaders(PerfDataFileWriter& writer, Collector const& collector)
+{
+    int error;
+
+    utsname uts;
+    if (0 == uname(&uts))
+    {
+        // HOSTNAME, OSRELEASE, ARCH
+        error = writer.SetUtsNameHeaders(uts);
+        if (error != 0)
+        {
+            return error;
+        }
+    }
+
+    auto const conf = sysconf(_SC_NPROCESSORS_CONF);
+    auto const onln = sysconf(_SC_NPROCESSORS_ONLN);
+    if (conf > 0 && onln > 0)
+    {
+        // NRCPUS
+        error = writer.SetNrCpusHeader(static_cast<uint32_t>(conf), static_cast<uint32_t>(onln));
+        if (error != 0)
+        {
+            return error;
+        }
+    }
+
+    // CLOCKID, CLOCK_DATA
+    error = writer.SetClockidHeader(CLOCK_MONOTONIC);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    timespec monotonic;
+    timespec realtime;
+    if (0 == clock_gettime(CLOCK_MONOTONIC, &monotonic) &&
+        0 == clock_gettime(CLOCK_REALTIME, &realtime))
+    {
+        error = writer.SetClockDataHeader(
+            CLOCK_MONOTONIC,
+            static_cast<uint64_t>(realtime.tv_sec) * 1000000000u + static_cast<uint64_t>(realtime.tv_nsec),
+            static_cast<uint64_t>(monotonic.tv_sec) * 1000000000u + static_cast<uint64_t>(monotonic.tv_nsec));
+        if (error != 0)
+        {
+            return error;
+        }
+    }
+
+    if (collector.timeFirst <= collector.timeLast)
+    {
+        // SAMPLE_TIME
+        error = writer.SetSampleTimeHeader(collector.timeFirst, collector.timeLast);
+        if (error != 0)
+        {
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+static int
+Collect(Options const& o, char const* ringPath, sigset_t const& exitSigs)
+{
+    int error;
+    ShmRing ring;
+    PerfDataFileWriter writer;
+
+    error = OpenRing(o, ring, ringPath);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    error = writer.Create(o.output);
+    if (error != 0)
+    {
+        PrintStderr("error: failed creating file \"%s\", error %u.\n",
+            o.output, error);
+        return error;
+    }
+
+    error = writer.EnableWriteBuffer();
+    if (error == 0)
+    {
+        error = writer.WriteFinishedInit();
+    }
+
+    if (error != 0)
+    {
+        PrintStderr("error: failed writing \"%s\", error %u.\n",
+            o.output, error);
+        writer.CloseNoFinalize();
+        return error;
+    }
+
+    Collector collector(o, ring, writer);
+    auto const droppedStart = __atomic_load_n(&ring.header->dropped_count, __ATOMIC_RELAXED);
+
+    PrintStderr("info: collecting from \"%s\" until " EXIT_SIGNALS_STR ".\n",
+        ringPath);
+
+    timespec const interval = {
+        static_cast<time_t>(o.intervalMS / 1000u),
+        static_cast<long>(o.intervalMS % 1000u) * 1000000
+    };
+
+    for (bool exiting = false;;)
+    {
+        uint64_t count;
+        error = collector.Drain(&count);
+        if (error != 0)
+        {
+            break;
+        }
+
+        if (count != 0)
+        {
+            // Each drain pass is a round: everything committed so far has
+            // been written.
+            error = writer.WriteFinishedRound();
+            if (error != 0)
+            {
+                PrintStderr("error: failed writing \"%s\", error %u.\n",
+                    o.output, error);
+                break;
+            }
+        }
+
+        if (exiting)
+        {
+            break;
+        }
+
+        int const sig = sigtimedwait(&exitSigs, nullptr, &interval);
+        if (sig > 0)
+        {
+            exiting = true; // One more drain, then exit.
+        }
+    }
+
+    if (error == 0)
+    {
+        error = collector.AddEventDescs();
+        if (error == 0)
+        {
+            error = SetWriterHeaders(writer, collector);
+        }
+
+        if (error != 0)
+        {
+            PrintStderr("error: failed writing metadata to \"%s\", error %u.\n",
+                o.output, error);
+        }
+    }
+
+    if (error != 0)
+    {
+        writer.CloseNoFinalize();
+        return error;
+    }
+
+    error = writer.FinalizeAndClose();
+    if (error != 0)
+    {
+        PrintStderr("error: failed finalizing \"%s\", error %u.\n",
+            o.output, error);
+        return error;
+    }
+
+    auto const dropped = __atomic_load_n(&ring.header->dropped_count, __ATOMIC_RELAXED) - droppedStart;
+    PrintStderr("info: wrote %llu events (%u event types) to \"%s\".\n",
+        static_cast<unsigned long long>(collector.sampleCount),
+        static_cast<unsigned>(collector.EventCount()),
+        o.output);
+    if (dropped != 0)
+    {
+        PrintStderr("warning: %llu events were dropped because the ring was full.\n",
+            static_cast<unsigned long long>(dropped));
+    }
+
+    if (collector.unknownCount != 0)
+    {
+        PrintStderr("warning: %llu records had an invalid event registration.\n",
+            static_cast<unsigned long long>(collector.unknownCount));
+    }
+
+    if (collector.stallCount != 0)
+    {
+        PrintStderr("warning: skipped %llu bytes of the ring (%llu times) because a record was never claimed.\n",
+            static_cast<unsigned long long>(collector.stallBytes),
+            static_cast<unsigned long long>(collector.stallCount));
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int error;
+
+    try
+    {
+        Options o;
+        unsigned const sizeKBMin = 256;
+        unsigned const sizeKBMax = 0x100000;
+        unsigned const intervalMSMax = 60000;
+        unsigned const stallTimeoutMSMax = 3600000;
+        bool showHelp = false;
+        bool usageError = false;
+
+        for (int argi = 1; argi < argc; argi += 1)
+        {
+            auto const* const arg = argv[argi];
+            if (arg[0] != '-')
+            {
+                PrintStderr("error: unexpected argument \"%s\".\n",
+                    arg);
+                usageError = true;
+            }
+            else if (arg[1] != '-')
+            {
+                auto const flags = &arg[1];
+                for (unsigned flagsPos = 0; flags[flagsPos] != '\0'; flagsPos += 1)
+                {
+                    auto const flag = flags[flagsPos];
+                    switch (flag)
+                    {
+                    case 'i':
+                        argi += 1;
+                        ArgSize("-i", 1, intervalMSMax, argi, argc, argv, &usageError, &o.intervalMS);
+                        break;
+                    case 't':
+                        argi += 1;
+                        ArgSize("-t", 0, stallTimeoutMSMax, argi, argc, argv, &usageError, &o.stallTimeoutMS);
+                        break;
+                    case 'o':
+                        argi += 1;
+                        if (argi < argc)
+                        {
+                            o.output = argv[argi];
+                        }
+                        else
+                        {
+                            PrintStderr("error: missing filename for flag -o.\n");
+                            usageError = true;
+                        }
+                        break;
+                    case 'r':
+                        argi += 1;
+                        if (argi < argc)
+                        {
+                            o.ringPath = argv[argi];
+                        }
+                        else
+                        {
+                            PrintStderr("error: missing filename for flag -r.\n");
+                            usageError = true;
+                        }
+                        break;
+                    case 's':
+                        argi += 1;
+                        ArgSize("-s", sizeKBMin, sizeKBMax, argi, argc, argv, &usageError, &o.sizeKB);
+                        break;
+                    case 'v':
+                        o.verbose = true;
+                        break;
+                    case 'h':
+                        showHelp = true;
+                        break;
+                    default:
+                        PrintStderr("error: invalid flag -%c.\n",
+                            flag);
+                        usageError = true;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                auto const flag = &arg[2];
+                if (0 == strcmp(flag, "interval"))
+                {
+                    argi += 1;
+                    ArgSize("--interval", 1, intervalMSMax, argi, argc, argv, &usageError, &o.intervalMS);
+                }
+                else if (0 == strcmp(flag, "output"))
+                {
+                    argi += 1;
+                    if (argi < argc)
+                    {
+                        o.output = argv[argi];
+                    }
+                    else
+                    {
+                        PrintStderr("error: missing filename for flag --output.\n");
+                        usageError = true;
+                    }
+                }
+                else if (0 == strcmp(flag, "ring"))
+                {
+                    argi += 1;
+                    if (argi < argc)
+                    {
+                        o.ringPath = argv[argi];
+                    }
+                    else
+                    {
+                        PrintStderr("error: missing filename for flag --ring.\n");
+                        usageError = true;
+                    }
+                }
+                else if (0 == strcmp(flag, "size"))
+                {
+                    argi += 1;
+                    ArgSize("--size", sizeKBMin, sizeKBMax, argi, argc, argv, &usageError, &o.sizeKB);
+                }
+                else if (0 == strcmp(flag, "stall-timeout"))
+                {
+                    argi += 1;
+                    ArgSize("--stall-timeout", 0, stallTimeoutMSMax, argi, argc, argv, &usageError, &o.stallTimeoutMS);
+                }
+                else if (0 == strcmp(flag, "verbose"))
+                {
+                    o.verbose = true;
+                }
+                else if (0 == strcmp(flag, "help"))
+                {
+                    showHelp = true;
+                }
+                else
+                {
+                    PrintStderr("error: invalid flag \"--%s\".\n",
+                        flag);
+                    usageError = true;
+                }
+            }
+        }
+
+        if (showHelp || usageError)
+        {
+            fputs(UsageCommon, stdout);
+            fputs(showHelp ? UsageLong : UsageShort, stdout);
+            error = EINVAL;
+            goto Done;
+        }
+
+        char const* ringPath = o.ringPath;
+        if (ringPath == nullptr)
+        {
+            ringPath = getenv(TRACEPOINT_SHM_PATH_ENV);
+            if (ringPath == nullptr || ringPath[0] == '\0')
+            {
+                ringPath = TRACEPOINT_SHM_PATH_DEFAULT;
+            }
+        }
+
+        // Exit signals are received via sigtimedwait.
+        sigset_t exitSigs;
+        sigemptyset(&exitSigs);
+        for (auto sig : ExitSigs)
+        {
+            sigaddset(&exitSigs, sig);
+        }
+
+        sigprocmask(SIG_BLOCK, &exitSigs, nullptr);
+
+        error = Collect(o, ringPath, exitSigs);
+    }
+    catch (std::exception const& ex)
+    {
+        PrintStderr("fatal error: %s.\n",
+            ex.what());
+        error = ENOMEM;
+    }
+
+Done:
+
+    return error;
+}
@@ -0,0 +1,626 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for libtracepoint-control and its tools that do not need access to tracefs.
+Usage: tracepoint-control-utest <dataDir> <testName> [<toolPath>]
+*/
+
+#include "../src/TracepointCpuList.h"
+#include "../src/TracepointTimestampFilter.h"
+#include <tracepoint/TracepointCache.h>
+#include <tracepoint/TracepointSession.h>
+#include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfEventInfo.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace tracepoint_control;
+using namespace tracepoint_decode;
+
+extern char** environ;
+
+// Tool to run (e.g. perf-merge), from the command line.
+static char const* g_toolPath = nullptr;
+
+// Reports a failed check and aborts the test.
+static void
+Verify(bool condition, char const* what)
+{
+    if (!condition)
+    {
+        fprintf(stdout, "\n- Check failed: %s", what);
+        throw std::exception();
+    }
+}
+
+// Appends a record to buffer. The record's first field is value.
+static void
+AppendRecord(std::vector<uint64_t>& buffer, uint32_t type, uint16_t size, uint64_t value)
+{
+    perf_event_header header = {};
+    header.type = type;
+    header.size = size;
+    auto const pos = buffer.size();
+    buffer.resize(pos + size / 8u);
+    memcpy(&buffer[pos], &header, sizeof(header));
+    buffer[pos + 1] = value;
+}
+
+// Returns the first field of each record written by FilterSnapshotRecords.
+static std::vector<uint64_t>
+FilterValues(
+    std::vector<uint64_t> const& buffer,
+    uint64_t slackNs,
+    _Out_ TracepointTimestampRange* writtenRange)
+{
+    std::vector<uint64_t> values;
+    auto const data = reinterpret_cast<uint8_t const*>(buffer.data());
+    TimestampFilter filter({ 1000, 2000 }, slackNs);
+    *writtenRange = TracepointTimestampRange();
+    auto const error = FilterSnapshotRecords(
+        data,
+        buffer.size() * sizeof(uint64_t),
+        PERF_SAMPLE_TIME,
+        filter,
+        writtenRange,
+        [&values, data](size_t pos, size_t size)
+        {
+            auto const end = pos + size;
+            while (pos != end)
+            {
+                auto const header = reinterpret_cast<perf_event_header const*>(data + pos);
+                values.push_back(*reinterpret_cast<uint64_t const*>(header + 1));
+                pos += header->size;
+            }
+            return 0;
+        });
+    Verify(error == 0, "FilterSnapshotRecords");
+    return values;
+}
+
+// Early stop is opt-in, skips only samples, and keeps in-window samples that
+// are within the slack.
+static void
+TestTimestampFilter(std::string const&)
+{
+    // Newest-to-oldest, window 1000..2000. The sample at 1200 comes after (is
+    // older than) a sample 200 before the window.
+    std::vector<uint64_t> buffer;
+    AppendRecord(buffer, PERF_RECORD_SAMPLE, 16, 2500);
+    AppendRecord(buffer, PERF_RECORD_SAMPLE, 16, 1500);
+    AppendRecord(buffer, PERF_RECORD_COMM, 24, 1);
+    AppendRecord(buffer, PERF_RECORD_SAMPLE, 16, 800);
+    AppendRecord(buffer, PERF_RECORD_SAMPLE, 16, 1200);
+    AppendRecord(buffer, PERF_RECORD_LOST, 24, 2);
+    AppendRecord(buffer, PERF_RECORD_SAMPLE, 16, 1100);
+
+    TracepointTimestampRange range;
+
+    // Default: every sample is checked.
+    Verify(FilterValues(buffer, UINT64_MAX, &range) == std::vector<uint64_t>{ 1500, 1, 1200, 2, 1100 },
+        "no slack keeps out-of-order sample");
+    Verify(range.First == 1100 && range.Last == 1500, "no slack range");
+
+    // Out-of-order sample is within the slack.
+    Verify(FilterValues(buffer, 500, &range) == std::vector<uint64_t>{ 1500, 1, 1200, 2, 1100 },
+        "wide slack keeps out-of-order sample");
+
+    // Out-of-order sample is past the slack: later samples are skipped, but
+    // non-sample records are still written.
+    Verify(FilterValues(buffer, 100, &range) == std::vector<uint64_t>{ 1500, 1, 2 },
+        "narrow slack skips samples only");
+    Verify(range.First == 1500 && range.Last == 1500, "narrow slack range");
+
+    // Oldest-to-newest (realtime) stops on the other side of the window.
+    TimestampFilter filter({ 1000, 2000 }, 100);
+    Verify(!filter.KeepSample(false, 800), "realtime before window");
+    Verify(!filter.PastWindow(), "realtime before window is not past");
+    Verify(filter.KeepSample(false, 1500), "realtime in window");
+    Verify(!filter.KeepSample(false, 2050), "realtime within slack");
+    Verify(!filter.PastWindow(), "realtime within slack is not past");
+    Verify(!filter.KeepSample(false, 2200), "realtime past slack");
+    Verify(filter.PastWindow(), "realtime past slack is past");
+    Verify(!filter.KeepSample(false, 1900), "realtime out-of-order after past");
+    filter.Reset();
+    Verify(filter.KeepSample(false, 1900), "Reset");
+
+    Verify(TimestampFilter({ 0, UINT64_MAX }, 0).AcceptsAll(), "AcceptsAll");
+    Verify(!TimestampFilter({ 1, UINT64_MAX }, 0).AcceptsAll(), "!AcceptsAll");
+}
+
+struct IndexRecord
+{
+    size_t pos;
+    uint16_t size;
+    bool sample;
+    uint64_t time;
+};
+
+// Reads records from pos up to head the way the session's enumerator does.
+// Returns the positions of the records that were read (not skipped).
+static std::vector<size_t>
+IndexRead(
+    TimestampIndex& index,
+    std::vector<IndexRecord> const& records,
+    size_t pos,
+    size_t head,
+    TracepointTimestampRange filter)
+{
+    std::vector<size_t> read;
+    index.Begin(pos, head, filter);
+    while (pos != head)
+    {
+        auto const skipTo = index.Skip(pos);
+        if (skipTo != pos)
+        {
+            pos = skipTo;
+            continue;
+        }
+
+        auto const it = std::find_if(records.begin(), records.end(),
+            [pos](IndexRecord const& r) { return r.pos == pos; });
+        Verify(it != records.end(), "IndexRead record boundary");
+        if (it->sample)
+        {
+            index.AddSample(pos, it->size, it->time);
+        }
+        else
+        {
+            index.AddRecord(pos, it->size);
+        }
+
+        read.push_back(pos);
+        pos += it->size;
+    }
+
+    index.End();
+    return read;
+}
+
+// Segments that have only samples outside the filter window are skipped,
+// segments with other records are always read, and overwritten segments are
+// dropped.
+static void
+TestTimestampIndex(std::string const&)
+{
+    // 16 records of 16 KB (4 per segment), newest first. Record 9 is not a sample.
+    size_t const recordSize = TimestampIndex::SegmentBytes / 4;
+    size_t const pos0 = 0x100000;
+    size_t const head0 = pos0 + 16 * recordSize;
+    std::vector<IndexRecord> records;
+    for (unsigned i = 0; i != 16; i += 1)
+    {
+        records.push_back({ pos0 + i * recordSize, static_cast<uint16_t>(recordSize), i != 9, 10000u - i * 10u });
+    }
+
+    auto const recordPositions = [&](std::vector<unsigned> const& indexes)
+    {
+        std::vector<size_t> positions;
+        for (auto i : indexes)
+        {
+            positions.push_back(records[i].pos);
+        }
+        return positions;
+    };
+
+    TimestampIndex index;
+
+    // First read: nothing to reuse, every record is read.
+    Verify(IndexRead(index, records, pos0, head0, { 9965, 10015 }) ==
+        recordPositions({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }),
+        "first read reads everything");
+    Verify(index.Segments().size() == 4, "first read segments");
+    Verify(index.Segments()[1].TimeFirst == 9930 && index.Segments()[1].TimeLast == 9960, "segment times");
+    Verify(!index.Segments()[2].SamplesOnly, "segment with non-sample");
+
+    // Two new records overwrite records 14 and 15 (head decreases).
+    size_t const pos1 = pos0 - 2 * recordSize;
+    size_t const head1 = head0 - 2 * recordSize;
+    records.push_back({ pos1, static_cast<uint16_t>(recordSize), true, 10020 }); // 16
+    records.push_back({ pos1 + recordSize, static_cast<uint16_t>(recordSize), true, 10010 }); // 17
+
+    // Segment 1 (records 4-7) is skipped. Segment 2 has a non-sample. Segment
+    // 3 was partly overwritten, so records 12 and 13 are read.
+    Verify(IndexRead(index, records, pos1, head1, { 9965, 10015 }) ==
+        recordPositions({ 16, 17, 0, 1, 2, 3, 8, 9, 10, 11, 12, 13 }),
+        "second read skips segment");
+    Verify(index.Segments().size() == 5, "second read segments");
+    Verify(index.Segments()[0].Pos == pos1 && index.Segments()[0].End == pos0, "new segment");
+    Verify(index.Segments()[4].Pos == records[12].pos && index.Segments()[4].End == head1, "re-read segment");
+
+    // Nothing new: only the segment with a non-sample is read.
+    Verify(IndexRead(index, records, pos1, head1, { 0, 100 }) ==
+        recordPositions({ 8, 9, 10, 11 }),
+        "third read skips all samples");
+    Verify(index.Segments().size() == 5, "third read segments");
+
+    // Everything overwritten: the index is dropped.
+    index.Begin(pos1 - 0x100000, head1 - 0x100000, { 0, 100 });
+    Verify(index.Skip(pos1 - 0x100000) == pos1 - 0x100000, "overwritten not skipped");
+    index.End();
+    Verify(index.Segments().empty(), "overwritten segments dropped");
+}
+
+// Returns the cpus that ParseCpuList reports for list, or { UINT32_MAX } if
+// ParseCpuList returns false.
+static std::vector<uint32_t>
+CpuListValues(char const* list, uint32_t cpuCount)
+{
+    std::vector<uint32_t> cpus;
+    if (!ParseCpuList(list, cpuCount, [&cpus](uint32_t cpu) { cpus.push_back(cpu); }))
+    {
+        cpus.push_back(UINT32_MAX);
+    }
+    return cpus;
+}
+
+static void
+TestCpuList(std::string const&)
+{
+    static struct {
+        char const* list;
+        uint32_t cpuCount;
+        std::vector<uint32_t> expected;
+    } const cases[] = {
+        { "", 16, { UINT32_MAX } },
+        { "\n", 16, { UINT32_MAX } },
+        { "0", 16, { 0 } },
+        { "0-3,8-11", 16, { 0, 1, 2, 3, 8, 9, 10, 11 } },
+        { "0-3,8-11\n", 16, { 0, 1, 2, 3, 8, 9, 10, 11 } },
+        { "5\n", 16, { 5 } },
+        { "0-3,8-11", 10, { 0, 1, 2, 3, 8, 9 } },
+        { "2,4-5", 4, { 2 } },
+        { "4-7", 4, {} },
+    };
+
+    for (auto const& c : cases)
+    {
+        Verify(CpuListValues(c.list, c.cpuCount) == c.expected, c.list);
+    }
+}
+
+// UpdateOnlineCpus requires CpuHotplug(true). Does not need tracefs.
+static void
+TestCpuHotplugOff(std::string const&)
+{
+    TracepointCache cache;
+    TracepointSession session(cache, TracepointSessionOptions(TracepointSessionMode::Circular, 4096));
+    Verify(ENOTSUP == session.UpdateOnlineCpus(), "UpdateOnlineCpus ENOTSUP");
+}
+
+// Runs g_toolPath with the specified arguments (and stdin redirected from
+// stdinPath, if not null) and waits for it to exit. Verifies that it exits
+// with 0.
+static void
+RunTool(std::vector<std::string> const& args, char const* stdinPath = nullptr)
+{
+    Verify(g_toolPath != nullptr, "toolPath argument");
+
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(g_toolPath));
+    for (auto const& arg : args)
+    {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    Verify(0 == posix_spawn_file_actions_init(&actions), "posix_spawn_file_actions_init");
+    if (stdinPath != nullptr)
+    {
+        Verify(0 == posix_spawn_file_actions_addopen(&actions, 0, stdinPath, O_RDONLY, 0), "addopen");
+    }
+
+    pid_t pid;
+    auto const spawnError = posix_spawn(&pid, g_toolPath, &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    Verify(0 == spawnError, "posix_spawn");
+
+    int status;
+    Verify(pid == waitpid(pid, &status, 0), "waitpid");
+    Verify(WIFEXITED(status) && WEXITSTATUS(status) == 0, "tool exit code");
+}
+
+// The parts of a sample that a tool must preserve.
+struct Sample
+{
+    std::string name;
+    uint64_t time;
+    uint32_t pid;
+    uint32_t tid;
+    std::vector<uint8_t> raw; // Without common_type (tools may renumber it).
+    bool hasMetadata;
+
+    // Compares everything except time.
+    auto
+    Key() const
+    {
+        return std::tie(name, pid, tid, raw, hasMetadata);
+    }
+
+    bool
+    operator<(Sample const& other) const
+    {
+        return std::tie(name, time, pid, tid, raw, hasMetadata) <
+            std::tie(other.name, other.time, other.pid, other.tid, other.raw, other.hasMetadata);
+    }
+};
+
+// Returns the samples of the file, in file order. Verifies that all of the
+// file's events can be read and all of its samples decoded.
+static std::vector<Sample>
+ReadSamples(std::string const& path)
+{
+    std::vector<Sample> samples;
+    PerfDataFile file;
+    Verify(0 == file.Open(path.c_str()), "Open");
+    for (;;)
+    {
+        perf_event_header const* header;
+        Verify(0 == file.ReadEvent(&header), "ReadEvent");
+        if (header == nullptr)
+        {
+            break;
+        }
+        else if (header->type != PERF_RECORD_SAMPLE)
+        {
+            continue;
+        }
+
+        PerfSampleEventInfo info;
+        Verify(0 == file.GetSampleEventInfo(header, &info), "GetSampleEventInfo");
+        Verify(0 != (info.SampleType() & PERF_SAMPLE_TIME), "sample has time");
+        Verify(0 != (info.SampleType() & PERF_SAMPLE_TID), "sample has tid");
+        auto const raw = static_cast<uint8_t const*>(info.raw_data);
+        auto const rawSkip = info.raw_data_size < 2 ? info.raw_data_size : 2u;
+        samples.push_back({
+            info.Name(),
+            info.time,
+            info.pid,
+            info.tid,
+            std::vector<uint8_t>(raw + rawSkip, raw + info.raw_data_size),
+            info.Metadata() != nullptr });
+    }
+
+    return samples;
+}
+
+// Returns the samples sorted by Key().
+static std::vector<Sample>
+SortByKey(std::vector<Sample> samples)
+{
+    std::sort(samples.begin(), samples.end(),
+        [](Sample const& a, Sample const& b) { return a.Key() < b.Key(); });
+    return samples;
+}
+
+// Returns true if the samples have the same keys (ignoring order and time).
+static bool
+SameKeys(std::vector<Sample> const& a, std::vector<Sample> const& b)
+{
+    return a.size() == b.size() &&
+        std::equal(a.begin(), a.end(), b.begin(),
+            [](Sample const& x, Sample const& y) { return x.Key() == y.Key(); });
+}
+
+// perf-merge output has every sample of the inputs, in time order, and the
+// samples of the first input keep their timestamps.
+static void
+TestPerfMerge(std::string const& dataDir)
+{
+    auto const perfPath = dataDir + "/perf.data";
+    auto const pipePath = dataDir + "/pipe.data";
+    auto const perf = ReadSamples(perfPath);
+    auto const pipe = ReadSamples(pipePath);
+    Verify(perf.size() == 539 && pipe.size() == 551, "input sample counts");
+
+    // Different inputs.
+    {
+        auto const outputPath = dataDir + "/perf-merge.data";
+        RunTool({ "-o", outputPath, perfPath, pipePath });
+        auto const merged = ReadSamples(outputPath);
+
+        Verify(merged.size() == perf.size() + pipe.size(), "merged sample count");
+        for (size_t i = 1; i < merged.size(); i += 1)
+        {
+            Verify(merged[i - 1].time <= merged[i].time, "merged in time order");
+        }
+
+        auto inputs = perf;
+        inputs.insert(inputs.end(), pipe.begin(), pipe.end());
+        Verify(SameKeys(SortByKey(merged), SortByKey(inputs)), "merged samples are the input samples");
+
+        auto sortedMerged = merged;
+        auto sortedPerf = perf;
+        std::sort(sortedMerged.begin(), sortedMerged.end());
+        std::sort(sortedPerf.begin(), sortedPerf.end());
+        Verify(std::includes(sortedMerged.begin(), sortedMerged.end(), sortedPerf.begin(), sortedPerf.end()),
+            "first input keeps its timestamps");
+    }
+
+    // Same input twice: every sample ID and tracepoint ID is used by both
+    // inputs, so the second input's samples are renumbered.
+    {
+        auto const outputPath = dataDir + "/perf-merge-self.data";
+        RunTool({ "-o", outputPath, perfPath, perfPath });
+        auto merged = ReadSamples(outputPath);
+
+        auto expected = perf;
+        expected.insert(expected.end(), perf.begin(), perf.end());
+        std::sort(merged.begin(), merged.end());
+        std::sort(expected.begin(), expected.end());
+        Verify(merged.size() == expected.size(), "self-merge sample count");
+        for (size_t i = 0; i != merged.size(); i += 1)
+        {
+            Verify(!(merged[i] < expected[i]) && !(expected[i] < merged[i]), "self-merge samples");
+        }
+    }
+}
+
+// Runs perf-filter with the specified filter arguments on inputPath (or, if
+// inputPath is "-", on stdin redirected from pipePath). Verifies that the
+// output has the non-sample events of the input and exactly the samples for
+// which expected returns true, unchanged and in input order.
+template<class ExpectedFn>
+static size_t
+VerifyPerfFilter(
+    std::string const& dataDir,
+    std::string const& inputPath,
+    std::vector<std::string> filterArgs,
+    ExpectedFn&& expected)
+{
+    auto const pipePath = dataDir + "/pipe.data";
+    auto const readPath = inputPath == "-" ? pipePath : inputPath;
+    auto const outputPath = dataDir + "/perf-filter.data";
+    filterArgs.insert(filterArgs.begin(), { "-o", outputPath });
+    filterArgs.push_back(inputPath);
+    RunTool(filterArgs, inputPath == "-" ? pipePath.c_str() : nullptr);
+
+    std::vector<Sample> expectedSamples;
+    for (auto const& sample : ReadSamples(readPath))
+    {
+        if (expected(sample))
+        {
+            expectedSamples.push_back(sample);
+        }
+    }
+
+    auto const filtered = ReadSamples(outputPath);
+    Verify(filtered.size() == expectedSamples.size(), "filtered sample count");
+    for (size_t i = 0; i != filtered.size(); i += 1)
+    {
+        Verify(!(filtered[i] < expectedSamples[i]) && !(expectedSamples[i] < filtered[i]), "filtered sample");
+    }
+
+    // Non-sample events are kept.
+    auto const countNonSamples = [](std::string const& path)
+    {
+        size_t count = 0;
+        PerfDataFile file;
+        Verify(0 == file.Open(path.c_str()), "Open");
+        perf_event_header const* header;
+        while (0 == file.ReadEvent(&header) && header != nullptr)
+        {
+            count += header->type != PERF_RECORD_SAMPLE;
+        }
+        return count;
+    };
+
+    if (inputPath != "-")
+    {
+        Verify(countNonSamples(outputPath) == countNonSamples(readPath), "non-sample events kept");
+    }
+
+    return filtered.size();
+}
+
+// perf-filter output decodes to the samples of the input that match the
+// filter options. Expected counts are from TestOutput/perf.data.linux.json.
+static void
+TestPerfFilter(std::string const& dataDir)
+{
+    auto const perfPath = dataDir + "/perf.data";
+    auto const startsWith = [](Sample const& sample, char const* prefix)
+    {
+        return 0 == sample.name.compare(0, strlen(prefix), prefix);
+    };
+
+    Verify(113 == VerifyPerfFilter(dataDir, perfPath, { "-p", "TestProviderC" },
+        [&](Sample const& s) { return startsWith(s, "user_events:TestProviderC_"); }),
+        "provider");
+
+    Verify(285 + 2 == VerifyPerfFilter(dataDir, perfPath, { "-e", "sched:*", "-e", "user_events:*_L4K*" },
+        [&](Sample const& s) {
+            return startsWith(s, "sched:") ||
+                startsWith(s, "user_events:TestProviderC_L4K") ||
+                startsWith(s, "user_events:TestProviderCpp_L4K"); }),
+        "event globs");
+
+    Verify(4 == VerifyPerfFilter(dataDir, perfPath, { "--level", "4" },
+        [&](Sample const& s) {
+            return startsWith(s, "user_events:TestProviderC_L1K") ||
+                startsWith(s, "user_events:TestProviderC_L4K") ||
+                startsWith(s, "user_events:TestProviderCpp_L1K") ||
+                startsWith(s, "user_events:TestProviderCpp_L4K"); }),
+        "level");
+
+    Verify(2 == VerifyPerfFilter(dataDir, perfPath, { "--keyword-all", "0xa1" },
+        [&](Sample const& s) { return s.name.find("_L1Kf123456789abcdef") != std::string::npos; }),
+        "keyword");
+
+    auto const samples = ReadSamples(perfPath);
+    auto const timeMin = samples[100].time;
+    auto const timeMax = samples[400].time;
+    Verify(timeMin < timeMax, "time range");
+    Verify(0 != VerifyPerfFilter(dataDir, perfPath,
+        { "--pid", "2002", "--pid", "2004", "--time-min", std::to_string(timeMin), "--time-max", std::to_string(timeMax) },
+        [=](Sample const& s) {
+            return (s.pid == 2002 || s.pid == 2004) && timeMin <= s.time && s.time <= timeMax; }),
+        "pid and time");
+
+    Verify(25 == VerifyPerfFilter(dataDir, perfPath, { "--tid", "2002" },
+        [](Sample const& s) { return s.tid == 2002; }),
+        "tid");
+
+    // Pipe-format input from stdin.
+    Verify(0 != VerifyPerfFilter(dataDir, "-", { "-p", "TestProviderCpp" },
+        [&](Sample const& s) { return startsWith(s, "user_events:TestProviderCpp_"); }),
+        "pipe input");
+}
+
+struct TestEntry
+{
+    char const* name;
+    void (*fn)(std::string const& dataDir);
+};
+
+static TestEntry const Tests[] = {
+    { "timestamp-filter", TestTimestampFilter },
+    { "timestamp-index", TestTimestampIndex },
+    { "cpu-list", TestCpuList },
+    { "cpu-hotplug-off", TestCpuHotplugOff },
+    { "perf-merge", TestPerfMerge },
+    { "perf-filter", TestPerfFilter },
+};
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3 && argc != 4)
+    {
+        fprintf(stdout, "Usage: %s <dataDir> <testName> [<toolPath>]\n", argv[0]);
+        return 1;
+    }
+
+    g_toolPath = argc > 3 ? argv[3] : nullptr;
+
+    for (auto const& test : Tests)
+    {
+        if (0 == strcmp(test.name, argv[2]))
+        {
+            try
+            {
+                test.fn(argv[1]);
+                return 0;
+            }
+            catch (std::exception const& ex)
+            {
+                fprintf(stdout, "\nERROR: %s: %s\n", test.name, ex.what());
+                return 1;
+            }
+        }
+    }
+
+    fprintf(stdout, "Unknown test: %s\n", argv[2]);
+    return 1;
+}
@@ -10,6 +10,7 @@
 
 #ifdef _WIN32
 #include <sal.h>
+#include <stdlib.h> // _byteswap_ushort
 #endif
 #ifndef _In_
 #define _In_
@@ -133,6 +134,159 @@ namespace tracepoint_decode
             return ReadAs<ValType>(pSrc);
         }
     };
+    // Loads values from the perf event data buffer, handling misaligned
+    // values, with the byte-swap decision made at compile time. Use in hot
+    // loops after choosing the specialization once per file or session, e.g.
+    //
+    //     return byteReader.ByteSwapNeeded()
+    //         ? DecodeImpl(PerfByteReaderT<true>(), ...)
+    //         : DecodeImpl(PerfByteReaderT<false>(), ...);
+    //
+    // Has the same Read methods as PerfByteReader, so templates can accept
+    // either.
+    template<bool ByteSwap>
+    class PerfByteReaderT
+    {
+    public:
+
+        // Returns ByteSwap.
+        static constexpr bool
+        ByteSwapNeeded() noexcept
+        {
+            return ByteSwap;
+        }
+
+        // Returns *pSrc as uint8_t.
+        static uint8_t
+        ReadAsU8(_In_reads_bytes_(1) void const* pSrc) noexcept
+        {
+            return *static_cast<uint8_t const*>(pSrc);
+        }
+
+        // Reads 2 bytes from pSrc, performs byteswap if ByteSwap,
+        // then returns the result as uint16_t.
+        static uint16_t
+        ReadAsU16(_In_reads_bytes_(2) void const* pSrc) noexcept
+        {
+            uint16_t fileBits;
+            memcpy(&fileBits, pSrc, sizeof(fileBits));
+            if constexpr (ByteSwap)
+            {
+#ifdef _MSC_VER
+                fileBits = _byteswap_ushort(fileBits);
+#else
+                fileBits = __builtin_bswap16(fileBits);
+#endif
+            }
+            return fileBits;
+        }
+
+        // Reads 4 bytes from pSrc, performs byteswap if ByteSwap,
+        // then returns the result as uint32_t.
+        static uint32_t
+        ReadAsU32(_In_reads_bytes_(4) void const* pSrc) noexcept
+        {
+            uint32_t fileBits;
+            memcpy(&fileBits, pSrc, sizeof(fileBits));
+            if constexpr (ByteSwap)
+            {
+#ifdef _MSC_VER
+                fileBits = _byteswap_ulong(fileBits);
+#else
+                fileBits = __builtin_bswap32(fileBits);
+#endif
+            }
+            return fileBits;
+        }
+
+        // Reads 8 bytes from pSrc, performs byteswap if ByteSwap,
+        // then returns the result as uint64_t.
+        static uint64_t
+        ReadAsU64(_In_reads_bytes_(8) void const* pSrc) noexcept
+        {
+            uint64_t fileBits;
+            memcpy(&fileBits, pSrc, sizeof(fileBits));
+            if constexpr (ByteSwap)
+            {
+#ifdef _MSC_VER
+                fileBits = _byteswap_uint64(fileBits);
+#else
+                fileBits = __builtin_bswap64(fileBits);
+#endif
+            }
+            return fileBits;
+        }
+
+        // Requires: cbSrc is 1, 2, or 4.
+        // Reads cbSrc bytes from pSrc, performs byteswap if ByteSwap,
+        // then returns the result cast to uint32_t.
+        static uint32_t
+        ReadAsDynU32(_In_reads_bytes_(cbSrc) void const* pSrc, uint8_t cbSrc) noexcept
+        {
+            return cbSrc == 4 ? ReadAsU32(pSrc)
+                : cbSrc == 2 ? ReadAsU16(pSrc)
+                : ReadAsU8(pSrc);
+        }
+
+        // Requires: cbSrc is 1, 2, 4, or 8.
+        // Reads cbSrc bytes from pSrc, performs byteswap if ByteSwap,
+        // then returns the result cast to uint64_t.
+        static uint64_t
+        ReadAsDynU64(_In_reads_bytes_(cbSrc) void const* pSrc, uint8_t cbSrc) noexcept
+        {
+            return cbSrc == 8 ? ReadAsU64(pSrc)
+                : cbSrc == 4 ? ReadAsU32(pSrc)
+                : cbSrc == 2 ? ReadAsU16(pSrc)
+                : ReadAsU8(pSrc);
+        }
+
+        // Requires: sizeof(ValType) is 1, 2, 4, or 8.
+        // Reads sizeof(ValType) bytes from pSrc, performs byteswap if ByteSwap,
+        // then returns the result cast to ValType.
+        // ValType should be a trivial type, e.g. uint32_t, long, or double.
+        template<class ValType>
+        static ValType
+        ReadAs(_In_reads_bytes_(sizeof(ValType)) void const* pSrc) noexcept
+        {
+            ValType v;
+            if constexpr (sizeof(ValType) == sizeof(uint8_t))
+            {
+                memcpy(&v, pSrc, sizeof(v));
+            }
+            else if constexpr (sizeof(ValType) == sizeof(uint16_t))
+            {
+                auto const uintVal = ReadAsU16(pSrc);
+                memcpy(&v, &uintVal, sizeof(v));
+            }
+            else if constexpr (sizeof(ValType) == sizeof(uint32_t))
+            {
+                auto const uintVal = ReadAsU32(pSrc);
+                memcpy(&v, &uintVal, sizeof(v));
+            }
+            else if constexpr (sizeof(ValType) == sizeof(uint64_t))
+            {
+                auto const uintVal = ReadAsU64(pSrc);
+                memcpy(&v, &uintVal, sizeof(v));
+            }
+            else
+            {
+                static_assert(sizeof(ValType) == 0,
+                    "ReadAs supports values of size 1, 2, 4, and 8.");
+            }
+            return v;
+        }
+
+        // Requires: sizeof(ValType) is 1, 2, 4, or 8.
+        // Reads sizeof(ValType) bytes from pSrc, performs byteswap if ByteSwap,
+        // then returns the result cast to ValType.
+        // ValType should be a trivial type, e.g. uint32_t, long, or double.
+        template<class ValType>
+        static ValType
+        Read(_In_ ValType const* pSrc) noexcept
+        {
+            return ReadAs<ValType>(pSrc);
+        }
+    };
 }
 // namespace tracepoint_decode
 
@@ -0,0 +1,152 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+PerfCallchainTable: deduplicated storage for sample stacks
+(PERF_SAMPLE_CALLCHAIN).
+
+Each distinct callchain is stored once and identified by a stack id
+(1..size()). When writing a file, a sample's callchain can be replaced by a
+3-word stack reference { 2, ReferenceContext, stackId } (see
+MakeReferenceSample), so a stack that is logged many times costs 24 bytes per
+sample instead of 8 bytes per frame. The record is still a valid
+PERF_RECORD_SAMPLE: tools that don't know about the table see a callchain
+with an unknown context marker and ignore it.
+
+The table is saved as a sidecar file, by convention "<file>.stacks". To read
+the full stacks, load the sidecar and pass it to PerfDataFile::SetCallchainTable,
+which makes GetSampleEventInfo return the table's callchain for samples with a
+stack reference:
+
+    PerfCallchainTable stacks;
+    if (0 == stacks.Load((path + ".stacks").c_str()))
+    {
+        file.SetCallchainTable(&stacks);
+    }
+
+Sidecar format (all integers in the byte order of the writing host; a reader
+detects a byte order mismatch by checking Version):
+
+    Header:  char Magic[8] = "PerfStks", uint32 Version = 1,
+             uint32 StackCount, uint64 WordCount.
+    Stacks:  WordCount uint64 words. For each stack, in id order:
+             uint64 nr, uint64 ips[nr] (same layout as the sample's callchain).
+*/
+
+#pragma once
+#ifndef _included_PerfCallchainTable_h
+#define _included_PerfCallchainTable_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <sal.h>
+#endif
+#ifndef _In_z_
+#define _In_z_
+#endif
+#ifndef _Success_
+#define _Success_(condition)
+#endif
+
+namespace tracepoint_decode
+{
+    // Forward declaration from PerfEventInfo.h:
+    struct PerfSampleEventInfo;
+
+    class PerfCallchainTable
+    {
+        std::vector<uint64_t> m_words; // For each stack: nr, ips[nr].
+        std::vector<size_t> m_stackPos; // m_stackPos[id - 1] = index of the stack's nr in m_words.
+        std::vector<uint32_t> m_slots; // Open-addressing table of ids (0 = empty), size is 0 or a power of 2, at most half full.
+
+    public:
+
+        // Context marker used in stack references. This is PERF_CONTEXT_MAX,
+        // which the kernel never emits as a context.
+        static constexpr uint64_t ReferenceContext = ~uint64_t(4094); // (uint64_t)-4095.
+
+        // Size of a stack reference: { 2, ReferenceContext, stackId }.
+        static constexpr unsigned ReferenceWords = 3;
+
+        // Creates an empty table.
+        PerfCallchainTable() noexcept;
+
+        // Removes all stacks. Stack ids will be reused.
+        void
+        Clear() noexcept;
+
+        // Returns the number of distinct stacks. Valid stack ids are 1..size().
+        uint32_t
+        size() const noexcept;
+
+        // Adds a callchain (nr followed by nr ips, host-endian) if it is not
+        // already in the table. Returns its stack id. May throw bad_alloc.
+        // Requires: callchain does not point into this table.
+        uint32_t
+        Add(uint64_t const* callchain);
+
+        // Returns the stack with the specified id (nr followed by nr ips),
+        // or NULL if id is not valid.
+        uint64_t const*
+        Get(uint32_t id) const noexcept;
+
+        // If callchain is a stack reference { 2, ReferenceContext, id } (with
+        // 0 < id <= UINT32_MAX), returns id. Otherwise returns 0.
+        static uint32_t
+        ReferenceId(uint64_t const* callchain) noexcept;
+
+        // If callchain is a reference to a stack in this table, returns the
+        // stack. Otherwise returns callchain.
+        uint64_t const*
+        Expand(uint64_t const* callchain) const noexcept;
+
+        // Adds the sample's callchain to the table and sets sample to a copy of
+        // the sample's record (info.header) with the callchain replaced by a
+        // stack reference. Use this to write the sample to a file, e.g. with
+        // PerfDataFileWriter::WriteEventData. If the callchain is not larger
+        // than a reference (nr <= 2), the record is copied unchanged.
+        //
+        // Returns 0 for success, or:
+        // - EINVAL if the sample has no PERF_SAMPLE_CALLCHAIN or info.callchain
+        //   does not point into the record (e.g. if it was expanded by a
+        //   PerfDataFile with a callchain table).
+        // - EEXIST if the callchain is already a stack reference.
+        // - ENOTSUP if fileBigEndian does not match the host byte order.
+        // May throw bad_alloc.
+        _Success_(return == 0) int
+        MakeReferenceSample(
+            PerfSampleEventInfo const& info,
+            bool fileBigEndian,
+            std::vector<uint8_t>& sample);
+
+        // Writes the table to the specified sidecar file.
+        // Returns 0 for success, errno for error.
+        _Success_(return == 0) int
+        Save(_In_z_ char const* stacksPath) const noexcept;
+
+        // Replaces the contents of the table with the contents of the specified
+        // sidecar file. Returns 0 for success, ENOENT (or other errno) if the
+        // file could not be read, or EINVAL if the file is not a valid table.
+        // On error, the table is empty. May throw bad_alloc.
+        _Success_(return == 0) int
+        Load(_In_z_ char const* stacksPath);
+
+    private:
+
+        // Returns the slot for the stack at m_words[pos], i.e. either the slot
+        // that holds an equal stack or the empty slot where it belongs.
+        // Requires: m_slots is not empty.
+        size_t
+        FindSlot(size_t pos) const noexcept;
+
+        // Grows m_slots if needed to make room for one more id, then rehashes.
+        void
+        ReserveSlot();
+    };
+}
+// namespace tracepoint_decode
+
+#endif // _included_PerfCallchainTable_h
@@ -11,6 +11,7 @@ PerfDataFile class - Reads perf.data files.
 
 #include "PerfByteReader.h"
 #include "PerfDataFileDefs.h"
+#include "PerfEventMetadata.h"
 #include "PerfEventSessionInfo.h"
 #include <stdint.h>
 #include <stdio.h> // FILE
@@ -47,6 +48,9 @@ PerfDataFile class - Reads perf.data files.
 #define _Ret_opt_
 #endif
 
+// Forward declaration from zstd.h:
+struct ZSTD_DCtx_s;
+
 namespace tracepoint_decode
 {
     // Forward declarations from PerfEventInfo.h:
@@ -56,11 +60,37 @@ namespace tracepoint_decode
     // Forward declaration from PerfEventMetadata.h:
     class PerfEventMetadata;
 
+    // Forward declaration from PerfCallchainTable.h:
+    class PerfCallchainTable;
+
+    class PerfDataFileChunkReader;
+
+    // A range of events within the data section of a perf.data file, as returned
+    // by PerfDataFile::GetDataChunks.
+    struct PerfDataFileChunk
+    {
+        uint64_t beginFilePos; // Position of the first event in the chunk.
+        uint64_t endFilePos;   // Position immediately after the last event in the chunk.
+    };
+
     /*
     PerfDataFile class - Reads perf.data files.
+
+    Threading: a PerfDataFile is not internally synchronized. Non-const methods
+    (Open*, Close, ReadEvent, SeekToTime, SetLazyMetadata, etc.) require
+    exclusive access. By default, metadata (headers, attributes, and tracepoint
+    formats) is fully loaded by Open (normal-mode) or by the ReadEvent that
+    returns the metadata record (pipe-mode), so const methods (Header,
+    EventDesc, GetSampleEventInfo, etc.) only read the object and may be called
+    concurrently from multiple threads while no thread is using a non-const
+    method. If SetLazyMetadata(true) is used, const methods may load metadata
+    on first use and must not be called concurrently until GetDataChunks has
+    been called (it loads everything).
     */
     class PerfDataFile
     {
+        friend class PerfDataFileChunkReader;
+
         struct perf_file_section;
         struct perf_pipe_header;
         struct perf_file_header;
@@ -69,6 +99,31 @@ namespace tracepoint_decode
         {
             std::unique_ptr<perf_event_attr> attrStorage;
             std::unique_ptr<uint64_t[]> idsStorage;
+            bool metadataResolved; // metadata has been looked up (see ResolveEventDesc).
+        };
+
+        struct HeaderSection
+        {
+            uint64_t filePos;
+            uint64_t size;
+        };
+
+        struct TracingFormat
+        {
+            std::string_view systemName; // Points into m_headers.
+            std::string_view formatFileContents; // Points into m_headers.
+        };
+
+        struct EventDescIdSlot
+        {
+            uint64_t id;
+            size_t eventDescIndex; // Index into m_eventDescList, or SIZE_MAX if slot is empty.
+        };
+
+        struct TimeIndexEntry
+        {
+            uint64_t filePos;      // Position of the first event in the segment.
+            uint64_t maxTimeSoFar; // Max time of all events through end of segment.
         };
 
         uint64_t m_filePos;
@@ -76,17 +131,28 @@ namespace tracepoint_decode
         uint64_t m_dataBeginFilePos;
         uint64_t m_dataEndFilePos;
         FILE* m_file;
+        uint8_t const* m_mapData; // Non-NULL if file is memory-mapped.
         std::vector<uint8_t> m_eventData;
+        std::vector<uint8_t> m_decompData; // Events from PERF_RECORD_COMPRESSED records.
+        size_t m_decompPos; // Offset of the next event in m_decompData.
+        ZSTD_DCtx_s* m_zstd; // Created on first PERF_RECORD_COMPRESSED.
         std::vector<char> m_headers[PERF_HEADER_LAST_FEATURE]; // Stored file-endian.
+        HeaderSection m_headerSections[PERF_HEADER_LAST_FEATURE]; // Where LoadHeader finds each header.
+        uint64_t m_headersPending; // Bit N set: header N is in the file but not yet loaded.
         std::vector<EventDesc> m_eventDescList; // Stored host-endian. Name points into m_headers.
-        std::map<uint64_t, size_t> m_eventDescById; // Index into m_eventDescList.
+        std::vector<EventDescIdSlot> m_eventDescById; // Open-addressing table, size is 0 or a power of 2, at most half full.
+        size_t m_eventDescByIdCount; // Number of non-empty slots in m_eventDescById.
+        std::vector<TimeIndexEntry> m_timeIndex; // Built by BuildTimeIndex.
         PerfEventSessionInfo m_sessionInfo;
         PerfByteReader m_byteReader;
+        PerfCallchainTable const* m_callchainTable; // Set by SetCallchainTable. Not owned.
         int8_t m_sampleIdOffset; // -1 = unset, -2 = no id.
         int8_t m_nonSampleIdOffset; // -1 = unset, -2 = no id.
         int8_t m_commonTypeOffset; // -1 = unset, -2 = not available.
         uint8_t m_commonTypeSize;
         bool m_parsedHeaderEventDesc;
+        bool m_builtTimeIndex;
+        bool m_lazyMetadata; // Set by SetLazyMetadata. Not changed by Open or Close.
 
         // HEADER_TRACING_DATA
         bool m_parsedTracingData;
@@ -95,7 +161,10 @@ namespace tracepoint_decode
         std::string_view m_headerPage; // Points into m_headers.
         std::string_view m_headerEvent; // Points into m_headers.
         std::vector<std::string_view> m_ftraces; // Points into m_headers.
-        std::map<uint32_t, PerfEventMetadata> m_metadataById; // Points into m_headers.
+        std::map<uint32_t, TracingFormat> m_unparsedFormatsById; // Formats not yet parsed into m_metadataById.
+        std::map<uint32_t, PerfEventMetadata const*> m_metadataById; // Points into m_metadataStore.
+        PerfEventMetadataStore m_metadataStore; // Fields of parsed formats. Text points into m_headers.
+        PerfEventMetadata m_parseScratch; // Reused by FindMetadata.
         std::string_view m_kallsyms; // Points into m_headers.
         std::string_view m_printk; // Points into m_headers.
         std::string_view m_cmdline; // Points into m_headers.
@@ -115,6 +184,25 @@ namespace tracepoint_decode
         PerfByteReader
         ByteReader() const noexcept;
 
+        // Returns the session's clock information (from the CLOCKID and
+        // CLOCK_DATA headers). The same object is referenced by the
+        // session_info of the event infos returned for this file.
+        PerfEventSessionInfo const&
+        SessionInfo() const noexcept;
+
+        // Returns true if the currently-opened file was opened with OpenMapped and
+        // the mapping succeeded, i.e. if ReadEvent returns pointers directly into
+        // the file mapping.
+        bool
+        Mapped() const noexcept;
+
+        // If Mapped(), returns the file mapping (the whole file). Events returned
+        // by ReadEvent that point into this range remain valid until the file is
+        // closed, and their position in the file is their offset from data().
+        // Returns {} if not Mapped().
+        std::string_view
+        MappedData() const noexcept;
+
         // Returns the position within the input file of the event that will be
         // read by the next call to ReadEvent().
         // Returns UINT64_MAX after end-of-file or file error.
@@ -148,6 +236,10 @@ namespace tracepoint_decode
         // Returns the raw data from the specified header (file-endian, use ByteReader()
         // to do byte-swapping as appropriate).
         // Returns empty if the requested header was not loaded from the file.
+        //
+        // If LazyMetadata(), most headers of a normal-mode file are read from
+        // the file on first access, so the first call for a header may read from
+        // the file. The returned data remains valid until the file is closed.
         std::string_view
         Header(PerfHeaderIndex headerIndex) const noexcept;
 
@@ -196,18 +288,51 @@ namespace tracepoint_decode
         std::string_view
         TracingDataSavedCmdLine() const noexcept;
 
+        // Returns true if metadata is loaded on first use (see SetLazyMetadata).
+        bool
+        LazyMetadata() const noexcept;
+
+        // Sets whether metadata is loaded on first use. Default is false.
+        // Applies to files opened after the call (not changed by Open or Close).
+        //
+        // If false, Open loads all of the headers of a normal-mode file and
+        // parses all of the tracepoint formats that the file's events use, and
+        // ReadEvent does the same for pipe-mode metadata records. Const methods
+        // then never modify the object (see the class threading notes).
+        //
+        // If true, Open loads only the attributes and the headers needed to read
+        // events. Other headers are read on first access to Header() or
+        // TracingData*(), and each tracepoint format is parsed when an event
+        // that uses it is first decoded. This makes Open faster for large files
+        // when only a few events or headers are needed, but const methods may
+        // then modify the object, so they must not be called concurrently.
+        void
+        SetLazyMetadata(bool lazy) noexcept;
+
         // Closes the input file, if any.
         void
         Close() noexcept;
 
         // Closes the current input file (if any), then opens the specified
         // perf.data file using fopen and reads the file header.
-        // If not a pipe-mode file, loads metadata. If a pipe-mode file, metadata
-        // will be loaded as the metadata events are encountered by ReadEvent.
+        // If not a pipe-mode file, loads metadata (see SetLazyMetadata). If a
+        // pipe-mode file, metadata will be loaded as the metadata events are
+        // encountered by ReadEvent.
         // On successful return, the file will be positioned before the first event.
         _Success_(return == 0) int
         Open(_In_z_ char const* filePath) noexcept;
 
+        // Same as Open, but if the file is not a pipe-mode file, also maps the
+        // file into memory. When mapped, ReadEvent returns pointers directly into
+        // the mapping instead of copying each event into a buffer, so the data
+        // of events (e.g. PerfSampleEventInfo::raw_data) is not copied.
+        //
+        // Falls back to normal (buffered) reading if the file is a pipe-mode
+        // file or if the file cannot be mapped. Use Mapped() to determine
+        // whether the mapping is in use. On Windows, always falls back.
+        _Success_(return == 0) int
+        OpenMapped(_In_z_ char const* filePath) noexcept;
+
         // Closes the current input file (if any), then switches stdin to binary
         // mode (Windows-only), then reads the file header from stdin. If stdin is
         // not a pipe-mode file, returns an error. Metadata will be loaded as the
@@ -216,11 +341,20 @@ namespace tracepoint_decode
         _Success_(return == 0) int
         OpenStdin() noexcept;
 
+        // Same as OpenStdin, but reads from a duplicate (dup) of the specified
+        // file descriptor, e.g. a connected socket or the read end of a pipe.
+        // The caller still owns file.
+        _Success_(return == 0) int
+        OpenPipeFromFile(int file) noexcept;
+
         // Returns the event header (host-endian) followed by the raw data from the
         // file (file-endian, use ByteReader() to do byte-swapping as appropriate).
         //
         // On success, sets *ppEventHeader to the event and returns 0.
         // The returned pointer is valid until the next call to ReadEvent.
+        // (If Mapped(), the returned pointer usually points into the file
+        // mapping, but the only guarantee is that it is valid until the next
+        // call to ReadEvent.)
         // 
         // On end-of-file, sets *ppEventHeader to NULL and returns 0.
         // 
@@ -229,9 +363,62 @@ namespace tracepoint_decode
         // Note that for PERF_RECORD_HEADER_TRACING_DATA and PERF_RECORD_AUXTRACE,
         // there will be extra data immediately after the event. Use EventDataSize to
         // get the actual event size.
+        //
+        // If the library was built with zstd support, PERF_RECORD_COMPRESSED
+        // records are decompressed and the events they contain are returned
+        // instead of the PERF_RECORD_COMPRESSED records. Otherwise, the
+        // PERF_RECORD_COMPRESSED records are returned as-is.
         _Success_(return == 0) int
         ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEventHeader) noexcept;
 
+        // Scans the events of the current file and builds an index from timestamp
+        // to file position for use by SeekToTime. The file is split into segments
+        // at each PERF_RECORD_FINISHED_ROUND (segments are also split every 1MB so
+        // that files without FINISHED_ROUND records are usefully indexed). Only
+        // sample events are read in full; other events are skipped by size.
+        // Does nothing if the index has already been built. Does not change
+        // FilePos(). Called automatically by SeekToTime if needed.
+        //
+        // Returns ENOTSUP if the file is a pipe-mode file or has a
+        // PERF_HEADER_COMPRESSED header.
+        _Success_(return == 0) int
+        BuildTimeIndex() noexcept;
+
+        // Positions the file so that the next ReadEvent returns the first event of
+        // the earliest segment that might contain a sample with time >= minTime.
+        // All sample events before the new position have time < minTime, but
+        // events after the new position might also have time < minTime (events
+        // are not sorted), so the caller should still filter by time. If no
+        // sample has time >= minTime, positions the file at end-of-file.
+        //
+        // Non-sample events before the new position are skipped. This is ok
+        // for normal-mode files since their metadata is loaded by Open.
+        //
+        // Builds the index (BuildTimeIndex) if needed. Invalidates any pointer
+        // returned by ReadEvent. Returns ENOTSUP if the file is a pipe-mode file or
+        // has a PERF_HEADER_COMPRESSED header.
+        _Success_(return == 0) int
+        SeekToTime(uint64_t minTime) noexcept;
+
+        // Splits the data section of the current file into chunks of about
+        // chunkSizeTarget bytes for decoding by multiple threads using
+        // PerfDataFileChunkReader. Chunks end immediately after a
+        // PERF_RECORD_FINISHED_ROUND when possible (a chunk is only split
+        // elsewhere if no FINISHED_ROUND is found within 4 * chunkSizeTarget
+        // bytes), so events are usually out of order only within a round and the
+        // round before it. Chunks are contiguous and in file order.
+        //
+        // Only reads event headers from the mapping. Does not change FilePos().
+        // If LazyMetadata(), also loads all of the file's headers and tracepoint
+        // formats (see PerfDataFileChunkReader), so it must not be called
+        // concurrently with other methods.
+        // Returns ENOTSUP if the file is not Mapped() (e.g. pipe-mode file) or has a
+        // PERF_HEADER_COMPRESSED header.
+        _Success_(return == 0) int
+        GetDataChunks(
+            uint64_t chunkSizeTarget,
+            _Out_ std::vector<PerfDataFileChunk>* pChunks) const noexcept;
+
         // Given a pEventHeader that was returned from ReadEvent, returns the actual
         // size of the specified event.
         //
@@ -253,6 +440,16 @@ namespace tracepoint_decode
             _In_ perf_event_header const* pEventHeader,
             _Out_ PerfSampleEventInfo* pInfo) const noexcept;
 
+        // Sets the table used to expand stack references (see PerfCallchainTable)
+        // in sample callchains, or NULL (the default) to return callchains as
+        // they are in the file. If set, GetSampleEventInfo sets pInfo->callchain
+        // to the table's stack for samples whose callchain is a reference to a
+        // stack in the table. The table must outlive its use by this object.
+        // Not changed by Open or Close. Has no effect for files that need byte
+        // swapping (the table is only written for host-endian files).
+        void
+        SetCallchainTable(PerfCallchainTable const* table) noexcept;
+
         // Tries to get event information from the event's suffix. The event suffix
         // is usually present only for non-sample kernel-generated events.
         // If the event suffix is not present, this function may return an error or
@@ -266,17 +463,61 @@ namespace tracepoint_decode
             _In_ perf_event_header const* pEventHeader,
             _Out_ PerfNonSampleEventInfo* pInfo) const noexcept;
 
+        // Gets the number of events reported as lost by a PERF_RECORD_LOST or
+        // PERF_RECORD_LOST_SAMPLES record. Records from TracepointSession are
+        // written with sample_id_all, so GetNonSampleEventInfo can be used to get
+        // the time and cpu at which the loss was reported (the end of the gap).
+        // Returns EINVAL if the event is not a LOST or LOST_SAMPLES record or is
+        // too small.
+        _Success_(return == 0) int
+        GetLostEventCount(
+            _In_ perf_event_header const* pEventHeader,
+            _Out_ uint64_t* pLostCount) const noexcept;
+
     private:
 
+        // Reads the pipe header from m_file (OpenStdin, OpenPipeFromFile).
+        _Success_(return == 0) int
+        OpenPipeHeader() noexcept;
+
         _Success_(return == 0) int
         LoadAttrs(perf_file_section const& attrs, uint64_t cbAttrAndIdSection64) noexcept;
 
+        // Records the position of each header. Loads the headers that Open needs.
         _Success_(return == 0) int
         LoadHeaders(perf_file_section const& data, uint64_t flags) noexcept;
 
+        // If the header is pending, reads it from the file (preserving FilePos).
+        void
+        LoadHeader(PerfHeaderIndex headerIndex) noexcept;
+
+        // If the TRACING_DATA header is pending, loads and parses it.
+        void
+        EnsureTracingData() noexcept;
+
+        // Loads all pending headers and resolves the metadata of all EventDescs.
+        void
+        LoadAll() noexcept;
+
+        // Returns this (for lazy loading from const methods). Const methods only
+        // use it to load pending metadata, i.e. only if LazyMetadata().
+        PerfDataFile&
+        Lazy() const noexcept;
+
+        // Finds the tracepoint formats in the TRACING_DATA header. The formats are
+        // parsed by FindMetadata on first use.
         void
         ParseTracingData() noexcept;
 
+        // Returns the metadata for the specified common_type, parsing its format
+        // if needed. Returns NULL if not found or not valid.
+        PerfEventMetadata const*
+        FindMetadata(uint32_t id) noexcept;
+
+        // Returns m_eventDescList[eventDescIndex] after looking up its metadata.
+        PerfEventDesc const&
+        ResolveEventDesc(size_t eventDescIndex) const noexcept;
+
         void
         ParseHeaderClockid() noexcept;
 
@@ -292,6 +533,13 @@ namespace tracepoint_decode
         _Success_(return == 0) int
         GetNonSampleEventId(_In_ perf_event_header const* pEventHeader, _Out_ uint64_t* pId) const noexcept;
 
+        // GetSampleEventInfo with the byte-swap decision made at compile time.
+        template<bool ByteSwap>
+        _Success_(return == 0) int
+        GetSampleEventInfoImpl(
+            _In_ perf_event_header const* pEventHeader,
+            _Out_ PerfSampleEventInfo* pInfo) const noexcept;
+
         _Success_(return == 0) int
         AddAttr(
             std::unique_ptr<perf_event_attr> pAttr,
@@ -300,9 +548,26 @@ namespace tracepoint_decode
             _In_reads_bytes_(cbIdsFileEndian) void const* pbIdsFileEndian,
             uintptr_t cbIdsFileEndian) noexcept(false);
 
+        // Returns the m_eventDescList index for the sample_id, or SIZE_MAX if not found.
+        size_t
+        FindEventDescIndex(uint64_t id) const noexcept;
+
+        // Sets the m_eventDescList index for the sample_id (replacing any previous index).
+        void
+        SetEventDescIndex(uint64_t id, size_t eventDescIndex) noexcept(false);
+
+        // Decompresses the payload of a PERF_RECORD_COMPRESSED record, appending
+        // the output to the unread data in m_decompData.
+        _Success_(return == 0) int
+        DecompressEventData(
+            _In_reads_bytes_(cb) uint8_t const* pb,
+            uint32_t cb) noexcept(false);
+
+        // On success, pEvent is updated to point at the (possibly reallocated)
+        // event.
         template<class SizeType>
         _Success_(return == 0) int
-        ReadPostEventData(uint16_t eventSizeFromHeader) noexcept;
+        ReadPostEventData(uint8_t const*& pEvent, uint16_t eventSizeFromHeader) noexcept;
 
         bool
         EnsureEventDataSize(uint32_t minSize) noexcept;
@@ -315,6 +580,7 @@ namespace tracepoint_decode
         SectionValid(perf_file_section const& section) const noexcept;
 
         // Returns 0 (success), EIO (fread error), or EPIPE (eof).
+        // If Mapped(), copies from the mapping instead of calling fread.
         _Success_(return == 0) int
         FileRead(_Out_writes_bytes_all_(cb) void* p, uintptr_t cb) noexcept;
 
@@ -324,6 +590,62 @@ namespace tracepoint_decode
         // Returns 0 (success), EIO (fread error), EPIPE (eof), or others.
         _Success_(return == 0) int
         FileSeekAndRead(uint64_t filePos, _Out_writes_bytes_all_(cb) void* p, uintptr_t cb) noexcept;
+
+        // Same as FileSeekAndRead, but then restores the file position.
+        _Success_(return == 0) int
+        FileReadAt(uint64_t filePos, _Out_writes_bytes_all_(cb) void* p, uintptr_t cb) noexcept;
+    };
+
+    /*
+    PerfDataFileChunkReader class - Reads the events of one PerfDataFileChunk.
+
+    Multiple chunk readers (e.g. one per thread) can read from the same
+    PerfDataFile concurrently. GetDataChunks loads all of the file's lazily-loaded
+    headers and formats, so afterwards the PerfDataFile is only read (its mapping
+    and metadata), and it is safe to call its const methods such as
+    GetSampleEventInfo from any thread while chunk readers are in use. The
+    PerfDataFile must not be closed, reopened, or read via ReadEvent while any
+    chunk reader is in use.
+
+    Metadata records in the data section (e.g. PERF_RECORD_FINISHED_INIT) are
+    returned but not processed. Normal-mode files load their metadata during
+    Open, so this does not affect GetSampleEventInfo.
+    */
+    class PerfDataFileChunkReader
+    {
+        PerfDataFile const* m_file;
+        uint64_t m_filePos;
+        uint64_t m_endFilePos;
+        std::vector<uint8_t> m_eventData; // For events that are byte-swapped or misaligned.
+
+    public:
+
+        PerfDataFileChunkReader(PerfDataFileChunkReader const&) = delete;
+        void operator=(PerfDataFileChunkReader const&) = delete;
+
+        PerfDataFileChunkReader() noexcept;
+
+        // Positions the reader at the start of the chunk.
+        // Requires: file is memory-mapped (OpenMapped) and not compressed, and
+        // chunk is a range of whole events within the data section, e.g. a
+        // chunk returned by file.GetDataChunks, or { pos, DataEndFilePos() }
+        // where pos is an event's position (the value of FilePos() before the
+        // ReadEvent that returned it).
+        void
+        Reset(PerfDataFile const& file, PerfDataFileChunk const& chunk) noexcept;
+
+        // Returns the position within the input file of the event that will be
+        // read by the next call to ReadEvent().
+        // Returns UINT64_MAX after error.
+        uint64_t
+        FilePos() const noexcept;
+
+        // Same as PerfDataFile::ReadEvent, but returns the events of the chunk.
+        // On end-of-chunk, sets *ppEventHeader to NULL and returns 0.
+        // The returned pointer is valid until the next call to ReadEvent or Reset
+        // (usually it points into the file mapping).
+        _Success_(return == 0) int
+        ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEventHeader) noexcept;
     };
 }
 // namespace tracepoint_decode
@@ -21,6 +21,9 @@
 #ifndef _In_z_
 #define _In_z_
 #endif
+#ifndef _In_opt_z_
+#define _In_opt_z_
+#endif
 #ifndef _In_reads_
 #define _In_reads_(count)
 #endif
@@ -56,11 +59,30 @@ struct utsname;
 
 #endif // !_WIN32
 
+// Forward declaration from zstd.h:
+struct ZSTD_CCtx_s;
+
 namespace tracepoint_decode
 {
     // Forward declaration from PerfEventSessionInfo.h:
     class PerfEventSessionInfo;
 
+    // How the PerfDataFileWriter write buffer interacts with the OS page cache.
+    // See PerfDataFileWriter::EnableWriteBuffer.
+    enum class PerfDataFileWriteCache : uint8_t
+    {
+        // Write each block through the page cache (normal writes).
+        Normal,
+
+        // Write each aligned block with O_DIRECT, bypassing the page cache.
+        Direct,
+
+        // Write each block through the page cache, start writeback immediately
+        // (sync_file_range), and drop older blocks from the page cache
+        // (posix_fadvise DONTNEED) once their writeback completes.
+        DropBehind,
+    };
+
     /*
     PerfDataFileWriter class - Writes perf.data files.
 
@@ -76,6 +98,21 @@ namespace tracepoint_decode
       - Call SetHeader() to provide data for other headers in the file.
     - Close the file: writer.FinalizeAndClose();
       - This writes the file footers, finalizes the headers, then closes the file.
+
+    To stream the data (e.g. to a pipe or socket), open the output with
+    CreatePipe() or CreatePipeFromFile() instead of Create(). This writes the
+    perf pipe format, which is read sequentially and never needs to seek:
+    - Call AddTracepointEventDesc(), AddEventDesc(), and SetHeader() for the
+      data that is known at the start of the trace.
+    - Call WriteFinishedInit(). This writes the metadata inline as
+      PERF_RECORD_HEADER_ATTR, PERF_RECORD_HEADER_TRACING_DATA and
+      PERF_RECORD_HEADER_FEATURE records, then writes the
+      PERF_RECORD_FINISHED_INIT record.
+    - Call WriteEventData() to write event data. AddEventDesc() and
+      AddTracepointEventDesc() write a PERF_RECORD_HEADER_ATTR record
+      immediately, so call them before writing events that use the new ids.
+    - Call FinalizeAndClose(). This writes PERF_RECORD_HEADER_FEATURE records
+      for the headers, then closes the output.
     */
     class PerfDataFileWriter
     {
@@ -83,9 +120,27 @@ namespace tracepoint_decode
         struct perf_file_header;
         struct EventDesc;
         struct TracepointInfo;
+        class AsyncWriter;
 
         uint64_t m_filePos;
+        uint64_t m_eventDataBytes; // Event data written since Create (before compression).
         int m_file;
+        ZSTD_CCtx_s* m_zstd; // Non-NULL if compression is enabled.
+        int m_compressionLevel;
+        uint64_t m_compressedBytes; // Size of PERF_RECORD_COMPRESSED records written.
+        std::vector<char> m_compressInput; // Event data waiting to be compressed.
+        std::vector<char> m_compressOutput; // Scratch buffer for one PERF_RECORD_COMPRESSED.
+        std::unique_ptr<char[]> m_writeBufferStorage; // m_writeBuffer + alignment padding.
+        char* m_writeBuffer; // Page-aligned, size is m_writeBlockSize.
+        uint32_t m_writeBlockSize; // 0 if the write buffer is disabled.
+        uint32_t m_writeBufferUsed; // Bytes in m_writeBuffer (not yet written to the file).
+        uint32_t m_writeAlignment; // Page size. O_DIRECT writes must be aligned to this.
+        PerfDataFileWriteCache m_writeCache;
+        bool m_writeDirectActive; // O_DIRECT is currently set on m_file.
+        uint64_t m_dropBehindPos; // DropBehind: data before this offset has been dropped from the cache.
+        std::unique_ptr<AsyncWriter> m_async; // Non-NULL if blocks are written by a background thread.
+        bool m_pipeMode; // Output uses the pipe format (CreatePipe).
+        bool m_pipeInitWritten; // Pipe mode: attrs, tracing data, and EVENT_DESC have been written.
         std::vector<EventDesc> m_eventDescs;
         std::map<uint32_t, TracepointInfo> m_tracepointInfoByCommonType;
         std::vector<char> m_headers[PERF_HEADER_LAST_FEATURE];
@@ -101,6 +156,10 @@ namespace tracepoint_decode
 
     public:
 
+        // Maximum number of bytes of event data per batch of compressed records
+        // (also recorded as mmap_len in PERF_HEADER_COMPRESSED).
+        static constexpr uint32_t CompressionChunkSize = 0x40000;
+
         PerfDataFileWriter(PerfDataFileWriter const&) = delete;
         void operator=(PerfDataFileWriter const&) = delete;
 
@@ -126,11 +185,130 @@ namespace tracepoint_decode
         _Success_(return == 0) int
         Create(_In_z_ char const* filePath, int mode = -1) noexcept;
 
+        // Calls CloseNoFinalize() to close any previous output file, then opens
+        // filePath using open(filePath, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, mode)
+        // and writes a perf pipe-format header. filePath may be a regular file or
+        // a FIFO. The output is written sequentially (no seeking), so it can be
+        // read while it is being written, e.g. by PerfDataFile::OpenStdin().
+        // On error, closes the output file and returns errno.
+        //
+        // In pipe mode, tracepoint format information (the
+        // PERF_RECORD_HEADER_TRACING_DATA record) and PERF_HEADER_EVENT_DESC
+        // are written by WriteFinishedInit(), so call AddTracepointEventDesc()
+        // for all tracepoints before WriteFinishedInit(). Tracepoints added
+        // later get a PERF_RECORD_HEADER_ATTR record but no format information.
+        // Headers that do not fit in a single record (64 KB) are not written.
+        // If a header is set both before and after WriteFinishedInit(), it is
+        // written twice (readers use the last value).
+        _Success_(return == 0) int
+        CreatePipe(_In_z_ char const* filePath, int mode = -1) noexcept;
+
+        // Same as CreatePipe(), but writes to a duplicate (dup) of the specified
+        // file descriptor, e.g. STDOUT_FILENO or a connected socket. The caller
+        // still owns file.
+        _Success_(return == 0) int
+        CreatePipeFromFile(int file) noexcept;
+
+#ifndef _WIN32
+
+        // Same as CreatePipe(), but connects a stream socket to the specified
+        // address and writes to the socket, e.g. to stream a live session to a
+        // receiver on another host. address is one of:
+        // - "unix:<path>" for a Unix domain socket.
+        // - "<host>:<port>" for TCP, e.g. "collector:9000" or "[::1]:9000".
+        //
+        // Returns EINVAL if address is malformed, EADDRNOTAVAIL if host cannot
+        // be resolved, or the errno from socket/connect.
+        //
+        // Notes:
+        // - Use EnableWriteBuffer() to send the data in large batches, and
+        //   EnableCompression() to reduce the amount of data sent.
+        // - If the receiver closes the connection, writes raise SIGPIPE.
+        //   Ignore SIGPIPE to get EPIPE errors instead.
+        _Success_(return == 0) int
+        CreatePipeSocket(_In_z_ char const* address) noexcept;
+
+#endif // !_WIN32
+
         // Returns the file offset at which the next call to WriteEventData()
         // will begin writing. Returns -1 if file is closed.
         uint64_t
         FilePos() const noexcept;
 
+        // Returns the number of bytes of event data that have been passed to
+        // WriteEventData(), WriteEventDataIovecs(), WriteFinishedInit(), and
+        // WriteFinishedRound() since the file was created. If compression is
+        // enabled, this is the size before compression (FilePos() does not
+        // advance until the compressed data is written).
+        uint64_t
+        EventDataBytes() const noexcept;
+
+        // Enables zstd compression of event data for the current output file.
+        // Subsequent event data is buffered and written as PERF_RECORD_COMPRESSED
+        // records, one batch per CompressionChunkSize bytes of event data or per
+        // WriteFinishedRound(), whichever comes first. FinalizeAndClose() adds a
+        // PERF_HEADER_COMPRESSED header. Compression stays enabled until the file
+        // is closed.
+        //
+        // level is the zstd compression level, e.g. 1 (fastest) to 22.
+        //
+        // Returns 0 for success, EBADF if no file is open, EALREADY if compression
+        // is already enabled, ENOTSUP if this library was built without zstd, or
+        // ENOMEM.
+        //
+        // Notes:
+        // - Event data may be split across PERF_RECORD_COMPRESSED records, so
+        //   the file requires a reader that supports this (PerfDataFile or perf
+        //   5.7+).
+        // - Do not write PERF_RECORD_HEADER_TRACING_DATA or PERF_RECORD_AUXTRACE
+        //   events (events with data beyond hdr.size) while compression is enabled.
+        _Success_(return == 0) int
+        EnableCompression(int level = 1) noexcept;
+
+        // Enables a write-combining buffer for the current output file. Data is
+        // collected in a page-aligned buffer and written to the file in blocks of
+        // blockSize bytes, each starting at a file offset that is a multiple of
+        // blockSize (the first block may be shorter). This replaces many small
+        // writes (e.g. one per WriteEventData or WriteEventDataIovecs call) with
+        // a few large ones. The buffer stays enabled until the file is closed.
+        //
+        // blockSize is rounded up to a multiple of the page size. cache controls
+        // how the blocks interact with the page cache:
+        // - Normal: blocks are written normally.
+        // - Direct: full, aligned blocks are written with O_DIRECT. The first
+        //   (unaligned) block, the final partial block, and the file header are
+        //   written normally.
+        // - DropBehind: writeback of each block is started as soon as it is
+        //   written, and blocks more than 4 blocks behind the end of the file
+        //   are waited for and dropped from the page cache, so a long capture
+        //   neither fills the page cache nor causes large writeback bursts.
+        //
+        // Returns 0 for success, EBADF if no file is open, EALREADY if the buffer
+        // is already enabled, EINVAL if blockSize is 0 or if the file does not
+        // support O_DIRECT (cache = Direct), ENOTSUP if cache is not Normal on a
+        // system that does not support it, EAGAIN if the background thread
+        // could not be created, or ENOMEM.
+        //
+        // If asyncBlockCount is not 0, full blocks are written by a background
+        // thread, so a slow disk does not delay the caller (e.g. the next buffer
+        // drain). The writer allocates asyncBlockCount + 1 blocks. When all
+        // asyncBlockCount blocks are waiting to be written, the next call that
+        // fills a block waits for the thread to finish one (backpressure).
+        //
+        // Notes:
+        // - FilePos() includes the buffered data.
+        // - FinalizeAndClose() and CloseNoFinalize() write the buffered data
+        //   (and wait for the background thread to finish).
+        // - If a block write fails, the data in that block is lost and the
+        //   error is returned by the current write call (or, with
+        //   asyncBlockCount, by a later write call or FinalizeAndClose(); later
+        //   blocks are then discarded).
+        _Success_(return == 0) int
+        EnableWriteBuffer(
+            uint32_t blockSize = 0x100000,
+            PerfDataFileWriteCache cache = PerfDataFileWriteCache::Normal,
+            uint32_t asyncBlockCount = 0) noexcept;
+
         // Adds a block of event data to the output file.
         // Data should be a sequence of perf_event_header blocks, i.e. a
         // perf_event_header, then data, then another perf_event_header, etc.
@@ -168,12 +346,33 @@ namespace tracepoint_decode
             _In_reads_(iovecsCount) struct iovec const* iovecs,
             int iovecsCount) noexcept;
 
+        // Advanced: Adds dataSize bytes of event data read from srcFile at offset
+        // srcFilePos, e.g. a run of events from the data section of an input
+        // perf.data file. Same requirements as WriteEventData. Does not change
+        // srcFile's file position.
+        //
+        // If neither compression nor the write buffer is enabled, the data is
+        // copied with copy_file_range, so it does not pass through user memory
+        // (and the filesystem may share the blocks instead of copying them).
+        // Otherwise, or if copy_file_range is not supported for these files,
+        // the data is read with pread and written normally.
+        //
+        // Returns 0 for success, EBADF if no file is open, EINVAL if srcFile
+        // ends before srcFilePos + dataSize, or errno. On error, file state is
+        // unspecified (as with WriteEventData).
+        _Success_(return == 0) int
+        WriteEventDataFromFile(
+            int srcFile,
+            uint64_t srcFilePos,
+            uint64_t dataSize) noexcept;
+
 #endif // !_WIN32
 
         // Adds a PERF_RECORD_FINISHED_INIT record to the output file. This should be
         // called after all "initial system state" data has been written to the file,
         //  e.g. non-sample events like PERF_RECORD_MMAP, PERF_RECORD_COMM,
         // PERF_RECORD_ID_INDEX, PERF_RECORD_THREAD_MAP, PERF_RECORD_CPU_MAP.
+        // In pipe mode, first writes the metadata records (see CreatePipe).
         _Success_(return == 0) int
         WriteFinishedInit() noexcept;
 
@@ -325,6 +524,43 @@ namespace tracepoint_decode
             _In_reads_bytes_(dataSize) void const* data,
             size_t dataSize) noexcept;
 
+        // Writes directly to m_file (bypasses the write buffer).
+        _Success_(return == 0) int
+        WriteFile(
+            _In_reads_bytes_(dataSize) void const* data,
+            size_t dataSize) noexcept;
+
+        // Writes (or, if async, queues) the contents of m_writeBuffer. If disable
+        // is true, also waits for the async thread, then disables the write
+        // buffer and O_DIRECT.
+        _Success_(return == 0) int
+        FlushWriteBuffer(bool disable) noexcept;
+
+        // Writes one block at the current file position (filePos), handling
+        // O_DIRECT and DropBehind. Does not update m_filePos. Called on the
+        // async thread if async.
+        _Success_(return == 0) int
+        WriteBlock(
+            _In_reads_bytes_(size) char const* data,
+            uint32_t size,
+            uint64_t filePos,
+            _Out_ size_t* pWritten) noexcept;
+
+        // Sets or clears O_DIRECT on m_file.
+        _Success_(return == 0) int
+        SetWriteDirect(bool enable) noexcept;
+
+        // Appends data to m_compressInput, compressing and writing each full chunk.
+        _Success_(return == 0) int
+        CompressEventData(
+            _In_reads_bytes_(dataSize) void const* data,
+            size_t dataSize) noexcept;
+
+        // Compresses m_compressInput and writes it as PERF_RECORD_COMPRESSED
+        // records. If end is true, also ends the zstd frame.
+        _Success_(return == 0) int
+        FlushCompression(bool end) noexcept;
+
         void
         SynthesizeTracingData();
 
@@ -340,6 +576,24 @@ namespace tracepoint_decode
         // Then writes the id data.
         _Success_(return == 0) int
         WriteAttrs(_Out_ perf_file_section* pAttrsSection) noexcept;
+
+        // Opens the output (Create or CreatePipe).
+        _Success_(return == 0) int
+        CreateImpl(_In_opt_z_ char const* filePath, int file, int mode, bool pipeMode) noexcept;
+
+        // Pipe mode: writes PERF_RECORD_HEADER_ATTR record(s) for desc.
+        _Success_(return == 0) int
+        WritePipeAttr(EventDesc const& desc) noexcept;
+
+        // Pipe mode: if !m_pipeInitWritten, writes an attr record for each
+        // EventDesc, the tracing data record, and the EVENT_DESC feature. Then
+        // writes a feature record for each other header that has been set.
+        _Success_(return == 0) int
+        WritePipeMetadata() noexcept(false);
+
+        // Pipe mode: writes a PERF_RECORD_HEADER_FEATURE record for the header.
+        _Success_(return == 0) int
+        WritePipeFeature(uint32_t index) noexcept;
     };
 }
 // namespace tracepoint_decode
@@ -0,0 +1,122 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+PerfEventFilter: selects sample events by name, EventHeader level/keyword,
+pid/tid, and time, using only the information returned by
+PerfDataFile::GetSampleEventInfo (the event payload is not decoded).
+*/
+
+#pragma once
+#ifndef _included_PerfEventFilter_h
+#define _included_PerfEventFilter_h
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace tracepoint_decode
+{
+    struct PerfEventDesc;
+    struct PerfSampleEventInfo;
+
+    class PerfEventFilter
+    {
+        std::vector<std::string> m_eventNameGlobs;
+        std::vector<std::string> m_providerNameGlobs;
+        std::vector<uint32_t> m_pids; // Sorted.
+        std::vector<uint32_t> m_tids; // Sorted.
+        uint64_t m_keywordAny;
+        uint64_t m_keywordAll;
+        uint64_t m_timeMin;
+        uint64_t m_timeMax;
+        uint8_t m_levelMax;
+        bool m_descFilterEnabled; // Any name/level/keyword filter set.
+
+        // Per-event-desc results of the name/level/keyword checks.
+        std::unordered_map<PerfEventDesc const*, bool> m_descResults;
+        PerfEventDesc const* m_lastDesc;
+        bool m_lastDescResult;
+
+    public:
+
+        PerfEventFilter(PerfEventFilter const&) = default;
+        PerfEventFilter& operator=(PerfEventFilter const&) = default;
+        ~PerfEventFilter();
+
+        // Creates a filter that matches all sample events.
+        PerfEventFilter() noexcept;
+
+        // Adds a glob pattern ('*' matches any run of chars, '?' matches any one
+        // char) for the event's full name, e.g. "user_events:MyProvider_L*". An
+        // event matches if its name matches any of the event name globs.
+        // May throw bad_alloc.
+        void
+        AddEventNameGlob(std::string_view glob);
+
+        // Adds a glob pattern for the event's provider name. For EventHeader events
+        // (e.g. "user_events:MyProvider_L5K1"), the provider name is the part of the
+        // event name before the last '_' (e.g. "MyProvider"). For other events,
+        // the provider name is the system name (e.g. "sched"). An event matches if
+        // its provider name matches any of the provider name globs.
+        // May throw bad_alloc.
+        void
+        AddProviderNameGlob(std::string_view glob);
+
+        // Only match EventHeader events with level <= levelMax (e.g. 4 to exclude
+        // verbose events). Events without an "_L<level>K<keyword>" name suffix do
+        // not match if a level or keyword filter is set.
+        void
+        SetLevelMax(uint8_t levelMax) noexcept;
+
+        // Only match EventHeader events where (keyword & any) != 0 (if any != 0) and
+        // (keyword & all) == all.
+        void
+        SetKeywordMask(uint64_t any, uint64_t all = 0) noexcept;
+
+        // Only match samples with one of the specified pids. Samples without
+        // PERF_SAMPLE_TID do not match if a pid or tid filter is set.
+        // May throw bad_alloc.
+        void
+        AddPid(uint32_t pid);
+
+        // Only match samples with one of the specified tids.
+        // May throw bad_alloc.
+        void
+        AddTid(uint32_t tid);
+
+        // Only match samples with timeMin <= time <= timeMax, where time is the
+        // sample's session timestamp (not adjusted to wall-clock time). Samples
+        // without PERF_SAMPLE_TIME do not match if a time filter is set.
+        void
+        SetTimeRange(uint64_t timeMin, uint64_t timeMax) noexcept;
+
+        // Returns true if no filters have been set, i.e. everything matches.
+        bool
+        MatchesAll() const noexcept;
+
+        // Returns true if the sample passes all filters. The name/level/keyword
+        // checks are computed once per PerfEventDesc and cached, so a rejected
+        // event costs a cache lookup plus the pid/tid/time comparisons.
+        // Requires: ClearCache() has been called since the PerfDataFile that
+        // returned the sample was last opened or closed.
+        // May throw bad_alloc.
+        bool
+        Matches(PerfSampleEventInfo const& sampleEventInfo);
+
+        // Discards the cached per-PerfEventDesc results. Call this after opening
+        // or closing a PerfDataFile (PerfEventDesc pointers may be reused).
+        void
+        ClearCache() noexcept;
+
+    private:
+
+        bool
+        DescMatches(PerfSampleEventInfo const& sampleEventInfo) const;
+    };
+}
+// namespace tracepoint_decode
+
+#endif // _included_PerfEventFilter_h
@@ -49,7 +49,7 @@ namespace tracepoint_decode
         uint64_t addr;                          // Valid if SampleType() & PERF_SAMPLE_ADDR.
         uint64_t period;                        // Valid if SampleType() & PERF_SAMPLE_PERIOD.
         uint64_t const* read_values;            // Valid if SampleType() & PERF_SAMPLE_READ. Points into event.
-        uint64_t const* callchain;              // Valid if SampleType() & PERF_SAMPLE_CALLCHAIN. Points into event.
+        uint64_t const* callchain;              // Valid if SampleType() & PERF_SAMPLE_CALLCHAIN. Points into event, or into the PerfCallchainTable set by PerfDataFile::SetCallchainTable.
         _Field_size_bytes_(raw_data_size) void const* raw_data; // Valid if SampleType() & PERF_SAMPLE_RAW. Points into event.
         uintptr_t raw_data_size;                // Valid if SampleType() & PERF_SAMPLE_RAW. Size of raw_data.
 
@@ -6,7 +6,10 @@
 #define _included_PerfEventMetadata_h
 
 #include <stdint.h>
+#include <deque>
+#include <memory>
 #include <string_view>
+#include <unordered_set>
 #include <vector>
 
 #ifdef _WIN32
@@ -43,8 +46,12 @@ namespace tracepoint_decode
         PerfFieldArrayRelDyn,   // e.g. "__rel_loc char val[]", value = (len << 16) | relativeOffset.
     };
 
+    class PerfEventMetadataStore; // Forward declaration
+
     class PerfFieldMetadata
     {
+        friend class PerfEventMetadataStore;
+
         static constexpr std::string_view noname = std::string_view("noname", 6);
 
         std::string_view m_name;     // deduced from field, e.g. "my_field".
@@ -96,8 +103,8 @@ namespace tracepoint_decode
             uint16_t size,
             int8_t isSigned = -1) noexcept;
 
-        // Returns the field name, e.g. "my_field". Never empty. (Deduced from
-        // "field:".)
+        // Returns the field name, e.g. "my_field". Never empty. Always a valid C
+        // identifier, so it never needs escaping. (Deduced from "field:".)
         constexpr std::string_view
         Name() const noexcept { return m_name; }
 
@@ -155,6 +162,43 @@ namespace tracepoint_decode
             bool fileBigEndian) const noexcept;
     };
 
+    // Read-only view of a contiguous array of PerfFieldMetadata.
+    class PerfFieldMetadataList
+    {
+        PerfFieldMetadata const* m_data;
+        size_t m_size;
+
+    public:
+
+        constexpr
+        PerfFieldMetadataList() noexcept
+            : m_data()
+            , m_size() {}
+
+        constexpr
+        PerfFieldMetadataList(PerfFieldMetadata const* data, size_t size) noexcept
+            : m_data(data)
+            , m_size(size) {}
+
+        constexpr PerfFieldMetadata const*
+        data() const noexcept { return m_data; }
+
+        constexpr size_t
+        size() const noexcept { return m_size; }
+
+        constexpr bool
+        empty() const noexcept { return m_size == 0; }
+
+        constexpr PerfFieldMetadata const*
+        begin() const noexcept { return m_data; }
+
+        constexpr PerfFieldMetadata const*
+        end() const noexcept { return m_data + m_size; }
+
+        constexpr PerfFieldMetadata const&
+        operator[](size_t index) const noexcept { return m_data[index]; }
+    };
+
     enum class PerfEventKind : uint8_t
     {
         Normal,         // No special handling detected.
@@ -167,7 +211,9 @@ namespace tracepoint_decode
         std::string_view m_formatFileContents;
         std::string_view m_name;
         std::string_view m_printFmt;
-        std::vector<PerfFieldMetadata> m_fields;
+        std::vector<PerfFieldMetadata> m_ownedFields; // Filled by Parse. Empty if fields are in a PerfEventMetadataStore.
+        PerfFieldMetadata const* m_fields; // m_ownedFields.data() or PerfEventMetadataStore storage.
+        uint32_t m_fieldCount;
         uint32_t m_id; // From common_type; not the same as the perf_event_attr::id or PerfSampleEventInfo::id.
         uint16_t m_commonFieldCount; // fields[common_field_count] is the first user field.
         uint16_t m_commonFieldsSize; // Offset of the end of the last common field
@@ -177,6 +223,10 @@ namespace tracepoint_decode
 
         ~PerfEventMetadata();
         PerfEventMetadata() noexcept;
+        PerfEventMetadata(PerfEventMetadata const& other) noexcept(false); // May throw bad_alloc.
+        PerfEventMetadata(PerfEventMetadata&& other) noexcept;
+        PerfEventMetadata& operator=(PerfEventMetadata const& other) noexcept(false); // May throw bad_alloc.
+        PerfEventMetadata& operator=(PerfEventMetadata&& other) noexcept;
 
         // Returns the value of the systemName parameter, e.g. "user_events".
         constexpr std::string_view
@@ -196,8 +246,8 @@ namespace tracepoint_decode
         PrintFmt() const noexcept { return m_printFmt; }
 
         // Returns the fields from the "format:" property.
-        constexpr std::vector<PerfFieldMetadata> const&
-        Fields() const noexcept { return m_fields; }
+        constexpr PerfFieldMetadataList
+        Fields() const noexcept { return { m_fields, m_fieldCount }; }
 
         // Returns the value of the "ID:" property. Note that this value gets
         // matched against the "common_type" field of an event, not the id field
@@ -220,7 +270,8 @@ namespace tracepoint_decode
         constexpr PerfEventKind
         Kind() const noexcept { return m_kind; }
 
-        // Sets all properties of this object to {} values.
+        // Sets all properties of this object to {} values. Keeps the capacity of
+        // the field storage so that the object can be reused for Parse.
         void
         Clear() noexcept;
 
@@ -235,6 +286,78 @@ namespace tracepoint_decode
             bool longSize64, // true if sizeof(long) == 8, false if sizeof(long) == 4.
             std::string_view systemName,
             std::string_view formatFileContents) noexcept(false); // May throw bad_alloc.
+
+    private:
+
+        friend class PerfEventMetadataStore;
+    };
+
+    /*
+    Compact storage for many PerfEventMetadata objects, e.g. all of the
+    tracepoints of a session or a file. Instead of a separate heap block for
+    each event's text and fields:
+
+    - Format file contents are copied into a shared text pool and system names
+      are interned, so the strings of stored events (names, fields, types)
+      are packed together.
+    - Fields are packed into shared field arrays, each event's fields
+      contiguous.
+    - Stored PerfEventMetadata objects are never moved, so returned references
+      remain valid until Clear or destruction.
+
+    Typical use: Parse into a reusable scratch PerfEventMetadata, then Add it.
+    Not thread-safe: callers must serialize Add and Clear. Stored metadata may
+    be read concurrently.
+    */
+    class PerfEventMetadataStore
+    {
+        std::vector<std::unique_ptr<char[]>> m_textChunks;
+        std::vector<std::unique_ptr<PerfFieldMetadata[]>> m_fieldChunks;
+        std::deque<PerfEventMetadata> m_events;
+        std::unordered_set<std::string_view> m_systemNames; // Points into m_textChunks.
+        char* m_textNext;
+        size_t m_textLeft;
+        PerfFieldMetadata* m_fieldNext;
+        size_t m_fieldLeft;
+
+    public:
+
+        PerfEventMetadataStore(PerfEventMetadataStore const&) = delete;
+        void operator=(PerfEventMetadataStore const&) = delete;
+        ~PerfEventMetadataStore();
+        PerfEventMetadataStore() noexcept;
+
+        // Returns the number of stored events.
+        size_t
+        size() const noexcept;
+
+        // Removes all events. Invalidates all references returned by Add.
+        void
+        Clear() noexcept;
+
+        // Stores a copy of metadata, e.g. the result of a successful Parse. The
+        // metadata's strings must point into its SystemName() and
+        // FormatFileContents() (as they do after Parse).
+        //
+        // If copyText is true, the system name and format file contents are
+        // copied into the store. If copyText is false, the stored metadata
+        // points at the original strings, which must outlive the store (e.g.
+        // the caller already keeps the format text in a long-lived buffer).
+        //
+        // Returns the stored metadata. Throws bad_alloc for out-of-memory.
+        PerfEventMetadata const&
+        Add(PerfEventMetadata const& metadata, bool copyText = true) noexcept(false);
+
+    private:
+
+        std::string_view
+        AddText(std::string_view text) noexcept(false);
+
+        std::string_view
+        InternSystemName(std::string_view systemName) noexcept(false);
+
+        PerfFieldMetadata*
+        AllocFields(size_t count) noexcept(false);
     };
 }
 // namespace tracepoint_decode
@@ -0,0 +1,342 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <tracepoint/PerfCallchainTable.h>
+#include <tracepoint/PerfByteReader.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <tracepoint/PerfEventInfo.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+
+#ifdef _WIN32
+#include <share.h>
+#define fopen(filename, mode) _fsopen(filename, mode, _SH_DENYWR)
+#endif // _WIN32
+
+using namespace tracepoint_decode;
+
+static char const StacksMagic[8] = { 'P', 'e', 'r', 'f', 'S', 't', 'k', 's' };
+static uint32_t const StacksVersion = 1;
+
+struct StacksFileHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t StackCount;
+    uint64_t WordCount;
+};
+
+static_assert(sizeof(StacksFileHeader) == 24, "StacksFileHeader has padding");
+
+struct fcloseDelete
+{
+    void operator()(FILE* file) const noexcept
+    {
+        fclose(file);
+    }
+};
+
+using unique_file = std::unique_ptr<FILE, fcloseDelete>;
+
+static size_t
+HashStack(uint64_t const* stack) noexcept
+{
+    auto const nr = stack[0];
+    uint64_t h = nr * 0x9E3779B97F4A7C15u;
+    for (uint64_t i = 1; i <= nr; i += 1)
+    {
+        h = (h ^ stack[i]) * 0x9E3779B97F4A7C15u;
+        h ^= h >> 29;
+    }
+
+    return static_cast<size_t>(h);
+}
+
+PerfCallchainTable::PerfCallchainTable() noexcept
+    : m_words()
+    , m_stackPos()
+    , m_slots()
+{
+    return;
+}
+
+void
+PerfCallchainTable::Clear() noexcept
+{
+    m_words.clear();
+    m_stackPos.clear();
+    m_slots.clear();
+}
+
+uint32_t
+PerfCallchainTable::size() const noexcept
+{
+    return static_cast<uint32_t>(m_stackPos.size());
+}
+
+uint32_t
+PerfCallchainTable::Add(uint64_t const* callchain)
+{
+    ReserveSlot();
+
+    // Append the stack, then look it up. If it is already present, remove it.
+    auto const pos = m_words.size();
+    m_words.insert(m_words.end(), callchain, callchain + 1 + callchain[0]);
+
+    auto const slot = FindSlot(pos);
+    auto id = m_slots[slot];
+    if (id != 0)
+    {
+        m_words.resize(pos);
+    }
+    else
+    {
+        m_stackPos.push_back(pos);
+        id = static_cast<uint32_t>(m_stackPos.size());
+        m_slots[slot] = id;
+    }
+
+    return id;
+}
+
+uint64_t const*
+PerfCallchainTable::Get(uint32_t id) const noexcept
+{
+    return id - 1u < m_stackPos.size()
+        ? &m_words[m_stackPos[id - 1u]]
+        : nullptr;
+}
+
+uint32_t
+PerfCallchainTable::ReferenceId(uint64_t const* callchain) noexcept
+{
+    return callchain[0] == 2 &&
+        callchain[1] == ReferenceContext &&
+        callchain[2] - 1u < UINT32_MAX
+        ? static_cast<uint32_t>(callchain[2])
+        : 0u;
+}
+
+uint64_t const*
+PerfCallchainTable::Expand(uint64_t const* callchain) const noexcept
+{
+    auto const id = ReferenceId(callchain);
+    if (id != 0)
+    {
+        auto const stack = Get(id);
+        if (stack != nullptr)
+        {
+            return stack;
+        }
+    }
+
+    return callchain;
+}
+
+_Success_(return == 0) int
+PerfCallchainTable::MakeReferenceSample(
+    PerfSampleEventInfo const& info,
+    bool fileBigEndian,
+    std::vector<uint8_t>& sample)
+{
+    if (PerfByteReader(fileBigEndian).ByteSwapNeeded())
+    {
+        return ENOTSUP;
+    }
+
+    if (0 == (info.SampleType() & PERF_SAMPLE_CALLCHAIN))
+    {
+        return EINVAL;
+    }
+
+    auto const record = reinterpret_cast<uint8_t const*>(info.header);
+    size_t const recordSize = info.header->size;
+    auto const chain = reinterpret_cast<uint8_t const*>(info.callchain);
+    if (chain < record + sizeof(perf_event_header) ||
+        chain >= record + recordSize ||
+        (record + recordSize - chain) / sizeof(uint64_t) <= info.callchain[0])
+    {
+        return EINVAL;
+    }
+
+    if (0 != ReferenceId(info.callchain))
+    {
+        return EEXIST;
+    }
+
+    auto const chainSize = (1 + static_cast<size_t>(info.callchain[0])) * sizeof(uint64_t);
+    if (chainSize <= ReferenceWords * sizeof(uint64_t))
+    {
+        // No smaller as a reference. Keep the callchain in the sample.
+        sample.assign(record, record + recordSize);
+        return 0;
+    }
+
+    uint64_t const reference[ReferenceWords] = { 2, ReferenceContext, Add(info.callchain) };
+    auto const referenceBytes = reinterpret_cast<uint8_t const*>(reference);
+
+    sample.clear();
+    sample.reserve(recordSize - chainSize + sizeof(reference));
+    sample.insert(sample.end(), record, chain);
+    sample.insert(sample.end(), referenceBytes, referenceBytes + sizeof(reference));
+    sample.insert(sample.end(), chain + chainSize, record + recordSize);
+
+    auto const header = reinterpret_cast<perf_event_header*>(sample.data());
+    header->size = static_cast<uint16_t>(sample.size());
+    return 0;
+}
+
+_Success_(return == 0) int
+PerfCallchainTable::Save(_In_z_ char const* stacksPath) const noexcept
+{
+    int err;
+
+    unique_file file(fopen(stacksPath, "wb"));
+    if (!file)
+    {
+        err = errno;
+    }
+    else
+    {
+        StacksFileHeader fileHeader = {};
+        memcpy(fileHeader.Magic, StacksMagic, sizeof(StacksMagic));
+        fileHeader.Version = StacksVersion;
+        fileHeader.StackCount = size();
+        fileHeader.WordCount = m_words.size();
+
+        if (1 != fwrite(&fileHeader, sizeof(fileHeader), 1, file.get()) ||
+            m_words.size() != fwrite(m_words.data(), sizeof(m_words[0]), m_words.size(), file.get()))
+        {
+            err = EIO;
+        }
+        else
+        {
+            err = 0 == fclose(file.release()) ? 0 : EIO;
+        }
+    }
+
+    return err;
+}
+
+_Success_(return == 0) int
+PerfCallchainTable::Load(_In_z_ char const* stacksPath)
+{
+    int err;
+    StacksFileHeader fileHeader;
+
+    Clear();
+
+    unique_file file(fopen(stacksPath, "rb"));
+    if (!file)
+    {
+        err = errno;
+    }
+    else if (
+        1 != fread(&fileHeader, sizeof(fileHeader), 1, file.get()) ||
+        0 != memcmp(fileHeader.Magic, StacksMagic, sizeof(StacksMagic)) ||
+        fileHeader.Version != StacksVersion ||
+        fileHeader.WordCount > SIZE_MAX / sizeof(uint64_t) ||
+        fileHeader.WordCount < fileHeader.StackCount)
+    {
+        err = EINVAL;
+    }
+    else
+    {
+        m_words.resize(static_cast<size_t>(fileHeader.WordCount));
+        char extra;
+        if (m_words.size() != fread(m_words.data(), sizeof(m_words[0]), m_words.size(), file.get()) ||
+            0 != fread(&extra, 1, 1, file.get()))
+        {
+            err = EINVAL;
+        }
+        else
+        {
+            // Rebuild the stack positions and the hash table. Stacks are
+            // distinct when saved, so each one gets its own slot.
+            err = 0;
+            m_stackPos.reserve(fileHeader.StackCount);
+            for (size_t pos = 0; pos != m_words.size(); pos += 1 + static_cast<size_t>(m_words[pos]))
+            {
+                if (m_words[pos] >= m_words.size() - pos ||
+                    m_stackPos.size() == fileHeader.StackCount)
+                {
+                    err = EINVAL;
+                    break;
+                }
+
+                ReserveSlot();
+                auto const slot = FindSlot(pos);
+                if (m_slots[slot] != 0)
+                {
+                    err = EINVAL; // Duplicate stack.
+                    break;
+                }
+
+                m_stackPos.push_back(pos);
+                m_slots[slot] = static_cast<uint32_t>(m_stackPos.size());
+            }
+
+            if (err == 0 && m_stackPos.size() != fileHeader.StackCount)
+            {
+                err = EINVAL;
+            }
+        }
+    }
+
+    if (err != 0)
+    {
+        Clear();
+    }
+
+    return err;
+}
+
+size_t
+PerfCallchainTable::FindSlot(size_t pos) const noexcept
+{
+    assert(!m_slots.empty());
+    auto const stack = &m_words[pos];
+    auto const stackSize = (1 + static_cast<size_t>(stack[0])) * sizeof(uint64_t);
+    auto const mask = m_slots.size() - 1;
+    for (auto slot = HashStack(stack) & mask;; slot = (slot + 1) & mask)
+    {
+        auto const id = m_slots[slot];
+        if (id == 0)
+        {
+            return slot;
+        }
+
+        auto const existing = &m_words[m_stackPos[id - 1]];
+        if (existing[0] == stack[0] &&
+            0 == memcmp(existing, stack, stackSize))
+        {
+            return slot;
+        }
+    }
+}
+
+void
+PerfCallchainTable::ReserveSlot()
+{
+    if (m_slots.size() > m_stackPos.size() * 2 + 2)
+    {
+        return;
+    }
+
+    m_slots.assign(m_slots.empty() ? 16 : m_slots.size() * 2, 0);
+    auto const mask = m_slots.size() - 1;
+    for (uint32_t id = 1; id <= m_stackPos.size(); id += 1)
+    {
+        auto slot = HashStack(&m_words[m_stackPos[id - 1]]) & mask;
+        while (m_slots[slot] != 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+
+        m_slots[slot] = id;
+    }
+}
@@ -2,6 +2,7 @@
 // Licensed under the MIT License.
 
 #include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfCallchainTable.h>
 #include <tracepoint/PerfEventAbi.h>
 #include <tracepoint/PerfEventMetadata.h>
 #include <tracepoint/PerfEventInfo.h>
@@ -10,6 +11,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <optional>
 
 using namespace std::string_view_literals;
@@ -21,14 +23,27 @@ using namespace tracepoint_decode;
 #define FSEEK64(file, offset, origin)   _fseeki64(file, offset, origin)
 #define FTELL64(file)                   _ftelli64(file)
 #define FOPEN(path, mode)               _fsopen(path, mode, _SH_DENYWR)
+#define DUP(file)                       _dup(file)
+#define FDOPEN(file, mode)              _fdopen(file, mode)
+#define CLOSE(file)                     _close(file)
 #define bswap_64(n) _byteswap_uint64(n)
 #else // _WIN32
 #define FSEEK64(file, offset, origin)   fseeko64(file, offset, origin)
 #define FTELL64(file)                   ftello64(file)
 #define FOPEN(path, mode)               fopen(path, mode)
+#define DUP(file)                       fcntl(file, F_DUPFD_CLOEXEC, 0)
+#define FDOPEN(file, mode)              fdopen(file, mode)
+#define CLOSE(file)                     close(file)
+#include <fcntl.h>
+#include <unistd.h>
 #include <byteswap.h>
+#include <sys/mman.h>
 #endif // _WIN32
 
+#ifdef TRACEPOINT_DECODE_ZSTD
+#include <zstd.h>
+#endif // TRACEPOINT_DECODE_ZSTD
+
 #ifndef _Inout_
 #define _Inout_
 #endif
@@ -113,10 +128,24 @@ ArrayCount(T(&)[N]) noexcept
 
 PerfDataFile::~PerfDataFile() noexcept
 {
+#ifndef _WIN32
+    if (m_mapData)
+    {
+        munmap(const_cast<uint8_t*>(m_mapData), static_cast<size_t>(m_fileLen));
+    }
+#endif // _WIN32
+
     if (m_file)
     {
         fclose(m_file);
     }
+
+#ifdef TRACEPOINT_DECODE_ZSTD
+    if (m_zstd != nullptr)
+    {
+        ZSTD_freeDCtx(m_zstd);
+    }
+#endif // TRACEPOINT_DECODE_ZSTD
 }
 
 PerfDataFile::PerfDataFile() noexcept
@@ -125,17 +154,28 @@ PerfDataFile::PerfDataFile() noexcept
     , m_dataBeginFilePos(0)
     , m_dataEndFilePos(0)
     , m_file(0)
+    , m_mapData(nullptr)
     , m_eventData()
+    , m_decompData()
+    , m_decompPos(0)
+    , m_zstd(nullptr)
     , m_headers()
+    , m_headerSections()
+    , m_headersPending(0)
     , m_eventDescList()
     , m_eventDescById()
+    , m_eventDescByIdCount(0)
+    , m_timeIndex()
     , m_sessionInfo()
     , m_byteReader()
+    , m_callchainTable(nullptr)
     , m_sampleIdOffset(-1)
     , m_nonSampleIdOffset(-1)
     , m_commonTypeOffset(-1)
     , m_commonTypeSize(0)
     , m_parsedHeaderEventDesc(0)
+    , m_builtTimeIndex(0)
+    , m_lazyMetadata(false)
     , m_parsedTracingData(0)
     , m_tracingDataLongSize(0)
     , m_tracingDataPageSize(0)
@@ -155,6 +195,26 @@ PerfDataFile::ByteReader() const noexcept
     return m_byteReader;
 }
 
+PerfEventSessionInfo const&
+PerfDataFile::SessionInfo() const noexcept
+{
+    return m_sessionInfo;
+}
+
+bool
+PerfDataFile::Mapped() const noexcept
+{
+    return m_mapData != nullptr;
+}
+
+std::string_view
+PerfDataFile::MappedData() const noexcept
+{
+    return m_mapData != nullptr
+        ? std::string_view(reinterpret_cast<char const*>(m_mapData), static_cast<size_t>(m_fileLen))
+        : std::string_view();
+}
+
 uint64_t
 PerfDataFile::FilePos() const noexcept
 {
@@ -183,83 +243,116 @@ PerfEventDesc const&
 PerfDataFile::EventDesc(uintptr_t eventDescIndex) const noexcept
 {
     assert(eventDescIndex < m_eventDescList.size());
-    return m_eventDescList[eventDescIndex];
+    return ResolveEventDesc(eventDescIndex);
 }
 
 _Ret_opt_ PerfEventDesc const*
 PerfDataFile::FindEventDescById(uint64_t sampleId) const noexcept
 {
-    auto const it = m_eventDescById.find(sampleId);
-    return it != m_eventDescById.end()
-        ? &m_eventDescList[it->second]
+    auto const eventDescIndex = FindEventDescIndex(sampleId);
+    return eventDescIndex != SIZE_MAX
+        ? &ResolveEventDesc(eventDescIndex)
         : nullptr;
 }
 
 std::string_view
 PerfDataFile::Header(PerfHeaderIndex headerIndex) const noexcept
 {
-    return headerIndex < ArrayCount(m_headers)
-        ? std::string_view(m_headers[headerIndex].data(), m_headers[headerIndex].size())
-        : std::string_view();
+    if (headerIndex >= ArrayCount(m_headers))
+    {
+        return std::string_view();
+    }
+
+    Lazy().LoadHeader(headerIndex);
+    return std::string_view(m_headers[headerIndex].data(), m_headers[headerIndex].size());
 }
 
 uint8_t
 PerfDataFile::TracingDataLongSize() const noexcept
 {
+    Lazy().EnsureTracingData();
     return m_tracingDataLongSize;
 }
 
 uint32_t
 PerfDataFile::TracingDataPageSize() const noexcept
 {
+    Lazy().EnsureTracingData();
     return m_tracingDataPageSize;
 }
 
 std::string_view
 PerfDataFile::TracingDataHeaderPage() const noexcept
 {
+    Lazy().EnsureTracingData();
     return m_headerPage;
 }
 
 std::string_view
 PerfDataFile::TracingDataHeaderEvent() const noexcept
 {
+    Lazy().EnsureTracingData();
     return m_headerEvent;
 }
 
 std::string_view const*
 PerfDataFile::TracingDataFtraces() const noexcept
 {
+    Lazy().EnsureTracingData();
     return m_ftraces.data();
 }
 
 uint32_t
 PerfDataFile::TracingDataFtraceCount() const noexcept
 {
+    Lazy().EnsureTracingData();
     return static_cast<uint32_t>(m_ftraces.size());
 }
 
 std::string_view
 PerfDataFile::TracingDataKallsyms() const noexcept
 {
+    Lazy().EnsureTracingData();
     return m_kallsyms;
 }
 
 std::string_view
 PerfDataFile::TracingDataPrintk() const noexcept
 {
+    Lazy().EnsureTracingData();
     return m_printk;
 }
 
 std::string_view
 PerfDataFile::TracingDataSavedCmdLine() const noexcept
 {
+    Lazy().EnsureTracingData();
     return m_cmdline;
 }
 
+bool
+PerfDataFile::LazyMetadata() const noexcept
+{
+    return m_lazyMetadata;
+}
+
+void
+PerfDataFile::SetLazyMetadata(bool lazy) noexcept
+{
+    m_lazyMetadata = lazy;
+}
+
 void
 PerfDataFile::Close() noexcept
 {
+#ifndef _WIN32
+    if (m_mapData != nullptr)
+    {
+        munmap(const_cast<uint8_t*>(m_mapData), static_cast<size_t>(m_fileLen));
+    }
+#endif // _WIN32
+
+    m_mapData = nullptr;
     m_filePos = 0;
     m_fileLen = 0;
     m_dataBeginFilePos = 0;
@@ -272,19 +365,33 @@ PerfDataFile::Close() noexcept
 
     m_file = nullptr;
 
+    m_decompData.clear();
+    m_decompPos = 0;
+#ifdef TRACEPOINT_DECODE_ZSTD
+    if (m_zstd != nullptr)
+    {
+        ZSTD_DCtx_reset(m_zstd, ZSTD_reset_session_only);
+    }
+#endif // TRACEPOINT_DECODE_ZSTD
+
     for (auto& header : m_headers)
     {
         header.clear();
     }
 
+    m_headersPending = 0;
+
     m_eventDescList.clear();
     m_eventDescById.clear();
+    m_eventDescByIdCount = 0;
+    m_timeIndex.clear();
     m_byteReader = PerfByteReader();
     m_sampleIdOffset = -1;
     m_nonSampleIdOffset = -1;
     m_commonTypeOffset = -1;
     m_commonTypeSize = 0;
     m_parsedHeaderEventDesc = false;
+    m_builtTimeIndex = false;
 
     // HEADER_TRACING_DATA
     m_parsedTracingData = false;
@@ -293,7 +400,10 @@ PerfDataFile::Close() noexcept
     m_headerPage = {};
     m_headerEvent = {};
     m_ftraces.clear();
+    m_unparsedFormatsById.clear();
     m_metadataById.clear();
+    m_metadataStore.Clear();
+    m_parseScratch.Clear();
     m_kallsyms = {};
     m_printk = {};
     m_cmdline = {};
@@ -377,8 +487,12 @@ PerfDataFile::Open(_In_z_ char const* filePath) noexcept
                 ParseHeaderClockid();
                 ParseHeaderClockData();
                 ParseHeaderEventDesc();
-                ParseTracingData();
-                error = 0;
+                if (!m_lazyMetadata)
+                {
+                    LoadAll(); // So that const methods don't need to load anything.
+                }
+
+                error = 0; // If lazy, TRACING_DATA is parsed on first use (EnsureTracingData).
             }
         }
     }
@@ -387,11 +501,38 @@ PerfDataFile::Open(_In_z_ char const* filePath) noexcept
 }
 
 _Success_(return == 0) int
-PerfDataFile::OpenStdin() noexcept
+PerfDataFile::OpenMapped(_In_z_ char const* filePath) noexcept
 {
-    int error;
-    perf_file_header header;
+    int error = Open(filePath);
+
+#ifndef _WIN32
+
+    // Pipe-mode files are read sequentially and might not be seekable, so
+    // they always use the buffered path. Mapping failure is not an error.
+    if (error == 0 &&
+        m_dataEndFilePos != UINT64_MAX &&
+        m_fileLen != 0 &&
+        m_fileLen <= SIZE_MAX)
+    {
+        auto const fd = fileno(m_file);
+        auto const p = fd < 0
+            ? MAP_FAILED
+            : mmap(nullptr, static_cast<size_t>(m_fileLen), PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            madvise(p, static_cast<size_t>(m_fileLen), MADV_SEQUENTIAL);
+            m_mapData = static_cast<uint8_t const*>(p);
+        }
+    }
+
+#endif // _WIN32
 
+    return error;
+}
+
+_Success_(return == 0) int
+PerfDataFile::OpenStdin() noexcept
+{
     Close();
 
 #ifdef _WIN32
@@ -404,6 +545,37 @@ PerfDataFile::OpenStdin() noexcept
 #endif
 
     m_file = stdin;
+    return OpenPipeHeader();
+}
+
+_Success_(return == 0) int
+PerfDataFile::OpenPipeFromFile(int file) noexcept
+{
+    Close();
+
+    auto const dupFile = DUP(file);
+    if (dupFile < 0)
+    {
+        return errno;
+    }
+
+    m_file = FDOPEN(dupFile, "rb");
+    if (m_file == nullptr)
+    {
+        auto const error = errno;
+        CLOSE(dupFile);
+        return error;
+    }
+
+    return OpenPipeHeader();
+}
+
+_Success_(return == 0) int
+PerfDataFile::OpenPipeHeader() noexcept
+{
+    int error;
+    perf_file_header header;
+
     if (0 != (error = FileRead(&header.pipe_header, sizeof(header.pipe_header))))
     {
         // error already set.
@@ -431,7 +603,7 @@ PerfDataFile::OpenStdin() noexcept
         }
         else
         {
-            // Don't try to seek on stdin.
+            // Don't try to seek on stdin (or a socket).
             error = ENOTSUP;
         }
     }
@@ -441,7 +613,7 @@ PerfDataFile::OpenStdin() noexcept
 
 template<class SizeType>
 _Success_(return == 0) int
-PerfDataFile::ReadPostEventData(uint16_t eventSizeFromHeader) noexcept
+PerfDataFile::ReadPostEventData(uint8_t const*& pEvent, uint16_t eventSizeFromHeader) noexcept
 {
     if (eventSizeFromHeader < sizeof(perf_event_header) + sizeof(SizeType))
     {
@@ -449,22 +621,31 @@ PerfDataFile::ReadPostEventData(uint16_t eventSizeFromHeader) noexcept
     }
 
     auto const specialDataSize = m_byteReader.ReadAs<SizeType>(
-        m_eventData.data() + sizeof(perf_event_header));
+        pEvent + sizeof(perf_event_header));
     if (specialDataSize > 0x80000000 || 0 != (specialDataSize & 7u))
     {
         return EINVAL;
     }
-    else if (auto const specialDataSize32 = static_cast<uint32_t>(specialDataSize);
-        !EnsureEventDataSize(eventSizeFromHeader + specialDataSize32))
+
+    auto const specialDataSize32 = static_cast<uint32_t>(specialDataSize);
+    if (specialDataSize32 > m_dataEndFilePos - m_filePos)
     {
-        return ENOMEM;
+        return EINVAL;
     }
-    else if (specialDataSize32 > m_dataEndFilePos - m_filePos)
+    else if (pEvent != m_eventData.data())
     {
-        return EINVAL;
+        // Zero-copy: the special data immediately follows the event in the mapping.
+        assert(m_mapData != nullptr);
+        m_filePos += specialDataSize32;
+        return 0;
+    }
+    else if (!EnsureEventDataSize(eventSizeFromHeader + specialDataSize32))
+    {
+        return ENOMEM;
     }
     else
     {
+        pEvent = m_eventData.data();
         return FileRead(m_eventData.data() + eventSizeFromHeader, specialDataSize32);
     }
 }
@@ -476,8 +657,55 @@ PerfDataFile::ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEv
     
     try
     {
-        auto const eventStartFilePos = m_filePos;
+        uint64_t eventStartFilePos;
+        uint8_t const* pEvent;
+        uint16_t eventHeaderSize;
+        uint32_t eventHeaderType;
+        uint32_t cbEventData;
+
+    NextEvent:
+
+        if (m_decompData.size() - m_decompPos >= sizeof(perf_event_header))
+        {
+            // Return the next event from the decompressed data, if it is complete.
+            auto const pDecompEvent = reinterpret_cast<perf_event_header*>(m_decompData.data() + m_decompPos);
+            auto const decompEventSize = m_byteReader.Read(&pDecompEvent->size);
+            if (decompEventSize < sizeof(perf_event_header))
+            {
+                error = EINVAL;
+                goto ErrorOrEof;
+            }
+
+            if (decompEventSize <= m_decompData.size() - m_decompPos)
+            {
+                if (m_byteReader.ByteSwapNeeded())
+                {
+                    pDecompEvent->ByteSwap();
+                }
 
+                m_decompPos += decompEventSize;
+                eventStartFilePos = m_filePos;
+                pEvent = reinterpret_cast<uint8_t const*>(pDecompEvent);
+                eventHeaderSize = decompEventSize;
+                eventHeaderType = pDecompEvent->type;
+                cbEventData = static_cast<uint32_t>(eventHeaderSize - sizeof(perf_event_header));
+
+                // Events with data beyond hdr.size are not supported in compressed data.
+                if (eventHeaderType == PERF_RECORD_HEADER_TRACING_DATA ||
+                    eventHeaderType == PERF_RECORD_AUXTRACE ||
+                    eventHeaderType == PERF_RECORD_COMPRESSED)
+                {
+                    error = EINVAL;
+                    goto ErrorOrEof;
+                }
+
+                goto HaveEvent;
+            }
+
+            // Otherwise the rest of the event is in the next PERF_RECORD_COMPRESSED.
+        }
+
+        eventStartFilePos = m_filePos;
         if (eventStartFilePos >= m_dataEndFilePos)
         {
             error = m_filePos == m_dataEndFilePos && m_filePos != UINT64_MAX
@@ -493,44 +721,74 @@ PerfDataFile::ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEv
             goto ErrorOrEof;
         }
 
-        if (0 != (error = FileRead(m_eventData.data(), sizeof(perf_event_header))))
+        if (m_mapData != nullptr &&
+            !m_byteReader.ByteSwapNeeded() &&
+            0 == (eventStartFilePos & (alignof(perf_event_header) - 1)))
         {
-            if (error == EPIPE &&
-                m_filePos == eventStartFilePos &&
-                m_filePos != UINT64_MAX &&
-                m_dataEndFilePos == UINT64_MAX)
+            // Zero-copy: use the event directly from the mapping.
+            pEvent = m_mapData + eventStartFilePos;
+            eventHeaderSize = reinterpret_cast<perf_event_header const*>(pEvent)->size;
+            eventHeaderType = reinterpret_cast<perf_event_header const*>(pEvent)->type;
+
+            if (eventHeaderSize < sizeof(perf_event_header))
             {
-                error = 0; // pipe-mode has reached EOF.
+                error = EINVAL;
+                goto ErrorOrEof;
             }
-            goto ErrorOrEof;
-        }
 
-        if (m_byteReader.ByteSwapNeeded())
-        {
-            reinterpret_cast<perf_event_header*>(m_eventData.data())->ByteSwap();
+            if (eventHeaderSize > m_dataEndFilePos - m_filePos)
+            {
+                error = EINVAL;
+                goto ErrorOrEof;
+            }
+
+            cbEventData = static_cast<uint32_t>(eventHeaderSize - sizeof(perf_event_header));
+            m_filePos += eventHeaderSize;
         }
+        else
+        {
+            if (0 != (error = FileRead(m_eventData.data(), sizeof(perf_event_header))))
+            {
+                if (error == EPIPE &&
+                    m_filePos == eventStartFilePos &&
+                    m_filePos != UINT64_MAX &&
+                    m_dataEndFilePos == UINT64_MAX)
+                {
+                    error = 0; // pipe-mode has reached EOF.
+                }
+                goto ErrorOrEof;
+            }
 
-        auto const eventHeaderSize = reinterpret_cast<perf_event_header*>(m_eventData.data())->size;
-        auto const eventHeaderType = reinterpret_cast<perf_event_header*>(m_eventData.data())->type;
+            if (m_byteReader.ByteSwapNeeded())
+            {
+                reinterpret_cast<perf_event_header*>(m_eventData.data())->ByteSwap();
+            }
 
-        if (eventHeaderSize < sizeof(perf_event_header))
-        {
-            error = EINVAL;
-            goto ErrorOrEof;
-        }
+            pEvent = m_eventData.data();
+            eventHeaderSize = reinterpret_cast<perf_event_header const*>(pEvent)->size;
+            eventHeaderType = reinterpret_cast<perf_event_header const*>(pEvent)->type;
 
-        auto const cbEventData = static_cast<uint32_t>(eventHeaderSize - sizeof(perf_event_header));
-        if (cbEventData > m_dataEndFilePos - m_filePos)
-        {
-            error = EINVAL;
-            goto ErrorOrEof;
-        }
+            if (eventHeaderSize < sizeof(perf_event_header))
+            {
+                error = EINVAL;
+                goto ErrorOrEof;
+            }
 
-        if (0 != (error = FileRead(m_eventData.data() + sizeof(perf_event_header), cbEventData)))
-        {
-            goto ErrorOrEof;
+            cbEventData = static_cast<uint32_t>(eventHeaderSize - sizeof(perf_event_header));
+            if (cbEventData > m_dataEndFilePos - m_filePos)
+            {
+                error = EINVAL;
+                goto ErrorOrEof;
+            }
+
+            if (0 != (error = FileRead(m_eventData.data() + sizeof(perf_event_header), cbEventData)))
+            {
+                goto ErrorOrEof;
+            }
         }
 
+    HaveEvent:
+
         // Successfully read the basic event data.
         // Check for any special cases based on the type.
         switch (eventHeaderType)
@@ -539,7 +797,7 @@ PerfDataFile::ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEv
         {
             if (cbEventData >= PERF_ATTR_SIZE_VER0)
             {
-                auto const pbEventData = m_eventData.data() + sizeof(perf_event_header);
+                auto const pbEventData = pEvent + sizeof(perf_event_header);
                 auto const attrSize = m_byteReader.Read(&reinterpret_cast<perf_event_attr const*>(pbEventData)->size);
                 if (attrSize > cbEventData)
                 {
@@ -558,43 +816,55 @@ PerfDataFile::ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEv
                 {
                     goto ErrorOrEof;
                 }
+
+                if (!m_lazyMetadata)
+                {
+                    LoadAll(); // Resolve the new attr's metadata.
+                }
             }
             break;
         }
         case PERF_RECORD_HEADER_TRACING_DATA:
         {
-            // Note: ReadPostEventData may cause m_eventData to reallocate.
-            if (0 != (error = ReadPostEventData<uint32_t>(eventHeaderSize)))
+            // Note: ReadPostEventData may cause m_eventData to reallocate (updates pEvent).
+            if (0 != (error = ReadPostEventData<uint32_t>(pEvent, eventHeaderSize)))
             {
                 goto ErrorOrEof;
             }
-            else if (!m_parsedTracingData)
+
+            EnsureTracingData(); // The file's header (if any) takes precedence.
+            if (!m_parsedTracingData)
             {
-                auto const pbEventData = m_eventData.data() + sizeof(perf_event_header);
+                auto const pbEventData = pEvent + sizeof(perf_event_header);
                 auto const len = m_byteReader.ReadAsU32(pbEventData);
 
                 // ReadPostEventData ensures this.
-                assert(sizeof(perf_event_header) + sizeof(uint32_t) + len <= m_eventData.size());
+                assert(sizeof(perf_event_header) + sizeof(uint32_t) + len <= m_filePos - eventStartFilePos);
 
                 auto& header = m_headers[PERF_HEADER_TRACING_DATA];
                 header.resize(len);
                 memcpy(header.data(), pbEventData + sizeof(uint32_t), len);
                 ParseTracingData();
+                if (!m_lazyMetadata)
+                {
+                    LoadAll(); // Resolve the metadata of existing attrs.
+                }
             }
             break;
         }
         case PERF_RECORD_HEADER_BUILD_ID:
         {
-            auto const pbEventData = m_eventData.data() + sizeof(perf_event_header);
+            auto const pbEventData = pEvent + sizeof(perf_event_header);
             auto& header = m_headers[PERF_HEADER_BUILD_ID];
+            m_headersPending &= ~(uint64_t(1) << PERF_HEADER_BUILD_ID); // Replaced.
             header.resize(cbEventData);
             memcpy(header.data(), pbEventData, cbEventData);
             break;
         }
         case PERF_RECORD_AUXTRACE:
         {
-            // Note: ReadPostEventData may cause m_eventData to reallocate.
-            if (0 != (error = ReadPostEventData<uint64_t>(eventHeaderSize)))
+            // Note: ReadPostEventData may cause m_eventData to reallocate (updates pEvent).
+            if (0 != (error = ReadPostEventData<uint64_t>(pEvent, eventHeaderSize)))
             {
                 goto ErrorOrEof;
             }
@@ -604,11 +874,12 @@ PerfDataFile::ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEv
         {
             if (cbEventData >= sizeof(uint64_t))
             {
-                auto const pbEventData = m_eventData.data() + sizeof(perf_event_header);
+                auto const pbEventData = pEvent + sizeof(perf_event_header);
                 auto const bit = m_byteReader.ReadAsU64(pbEventData);
                 if (bit < ArrayCount(m_headers))
                 {
                     auto& header = m_headers[static_cast<size_t>(bit)];
+                    m_headersPending &= ~(uint64_t(1) << bit); // Replaced.
                     header.resize(cbEventData - sizeof(uint64_t));
                     memcpy(
                         header.data(),
@@ -631,8 +902,26 @@ PerfDataFile::ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEv
         case PERF_RECORD_FINISHED_INIT:
         {
             ParseHeaderEventDesc();
+            if (!m_lazyMetadata)
+            {
+                LoadAll(); // Resolve the metadata of attrs from EVENT_DESC.
+            }
             break;
         }
+        case PERF_RECORD_COMPRESSED:
+        {
+            error = DecompressEventData(pEvent + sizeof(perf_event_header), cbEventData);
+            if (error == 0)
+            {
+                goto NextEvent;
+            }
+            else if (error != ENOTSUP)
+            {
+                goto ErrorOrEof;
+            }
+
+            break; // Built without zstd: return the compressed record as-is.
+        }
         default:
             break;
         }
@@ -643,7 +932,7 @@ PerfDataFile::ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEv
             goto ErrorOrEof;
         }
 
-        *ppEventHeader = reinterpret_cast<perf_event_header*>(m_eventData.data());
+        *ppEventHeader = reinterpret_cast<perf_event_header const*>(pEvent);
         return 0;
     }
     catch (std::bad_alloc const&)
@@ -654,10 +943,72 @@ PerfDataFile::ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEv
 ErrorOrEof:
 
     m_filePos = UINT64_MAX; // Subsequent ReadEvent should get EPIPE.
+    m_decompData.clear();
+    m_decompPos = 0;
     *ppEventHeader = nullptr;
     return error;
 }
 
+_Success_(return == 0) int
+PerfDataFile::DecompressEventData(
+    _In_reads_bytes_(cb) uint8_t const* pb,
+    uint32_t cb) noexcept(false)
+{
+#ifdef TRACEPOINT_DECODE_ZSTD
+    // Limits the damage from a corrupt (or malicious) compressed record.
+    static constexpr size_t DecompDataMax = 0x4000000;
+
+    if (m_zstd == nullptr)
+    {
+        m_zstd = ZSTD_createDCtx();
+        if (m_zstd == nullptr)
+        {
+            return ENOMEM;
+        }
+    }
+
+    // Keep any partial event left over from the previous record.
+    auto const leftover = m_decompData.size() - m_decompPos;
+    if (leftover != 0)
+    {
+        memmove(m_decompData.data(), m_decompData.data() + m_decompPos, leftover);
+    }
+
+    m_decompData.resize(leftover);
+    m_decompPos = 0;
+
+    auto const outSize = ZSTD_DStreamOutSize();
+    ZSTD_inBuffer input = { pb, cb, 0 };
+    for (;;)
+    {
+        auto const used = m_decompData.size();
+        if (used > DecompDataMax)
+        {
+            return EINVAL;
+        }
+
+        m_decompData.resize(used + outSize);
+        ZSTD_outBuffer output = { m_decompData.data() + used, outSize, 0 };
+        auto const result = ZSTD_decompressStream(m_zstd, &output, &input);
+        m_decompData.resize(used + output.pos);
+        if (ZSTD_isError(result))
+        {
+            return EINVAL;
+        }
+
+        // If the output buffer was filled, the decoder may have more to flush.
+        if (input.pos == input.size && output.pos != output.size)
+        {
+            return 0;
+        }
+    }
+#else // TRACEPOINT_DECODE_ZSTD
+    (void)pb;
+    (void)cb;
+    return ENOTSUP; // ReadEvent returns the record as-is.
+#endif // TRACEPOINT_DECODE_ZSTD
+}
+
 uint32_t
 PerfDataFile::EventDataSize(perf_event_header const* pEventHeader) noexcept
 {
@@ -672,24 +1023,385 @@ PerfDataFile::EventDataSize(perf_event_header const* pEventHeader) noexcept
         break;
 
     case PERF_RECORD_HEADER_TRACING_DATA:
-        assert(pEventHeader->size >= sizeof(perf_event_header) + sizeof(uint64_t));
-        size = static_cast<uint32_t>(pEventHeader->size + m_byteReader.ReadAs<uint64_t>(pEventHeader + 1));
+        assert(pEventHeader->size >= sizeof(perf_event_header) + sizeof(uint32_t));
+        size = static_cast<uint32_t>(pEventHeader->size + m_byteReader.ReadAs<uint32_t>(pEventHeader + 1));
         break;
 
     case PERF_RECORD_AUXTRACE:
-        assert(pEventHeader->size >= sizeof(perf_event_header) + sizeof(uint32_t));
-        size = static_cast<uint32_t>(pEventHeader->size + m_byteReader.ReadAs<uint32_t>(pEventHeader + 1));
+        assert(pEventHeader->size >= sizeof(perf_event_header) + sizeof(uint64_t));
+        size = static_cast<uint32_t>(pEventHeader->size + m_byteReader.ReadAs<uint64_t>(pEventHeader + 1));
         break;
     }
 
     return size;
 }
 
+_Success_(return == 0) int
+PerfDataFile::BuildTimeIndex() noexcept
+{
+    static constexpr uint64_t SegmentSizeMax = 0x100000;
+
+    int error;
+
+    if (m_builtTimeIndex)
+    {
+        return 0;
+    }
+    else if (m_file == nullptr)
+    {
+        return EPERM;
+    }
+    else if (m_dataEndFilePos == UINT64_MAX ||
+        !m_headers[PERF_HEADER_COMPRESSED].empty())
+    {
+        // Compressed events cannot be indexed by file position.
+        return ENOTSUP;
+    }
+
+    try
+    {
+        auto const savedFilePos = m_filePos;
+        uint64_t maxTimeSoFar = 0;
+        uint64_t segmentBeginPos = m_dataBeginFilePos;
+        uint64_t pos = m_dataBeginFilePos;
+        PerfSampleEventInfo info;
+
+        m_timeIndex.clear();
+        while (pos < m_dataEndFilePos)
+        {
+            perf_event_header header;
+            if (sizeof(header) > m_dataEndFilePos - pos)
+            {
+                error = EINVAL;
+                goto Error;
+            }
+            else if (0 != (error = FileSeekAndRead(pos, &header, sizeof(header))))
+            {
+                goto Error;
+            }
+
+            if (m_byteReader.ByteSwapNeeded())
+            {
+                header.ByteSwap();
+            }
+
+            if (header.size < sizeof(header) ||
+                header.size > m_dataEndFilePos - pos)
+            {
+                error = EINVAL;
+                goto Error;
+            }
+
+            uint64_t eventSize = header.size;
+            switch (header.type)
+            {
+            case PERF_RECORD_SAMPLE:
+            {
+                uint8_t const* pEvent;
+                if (m_mapData != nullptr &&
+                    !m_byteReader.ByteSwapNeeded() &&
+                    0 == (pos & (alignof(perf_event_header) - 1)))
+                {
+                    pEvent = m_mapData + pos;
+                }
+                else
+                {
+                    // Copy the event into m_eventData (host-endian header).
+                    memcpy(m_eventData.data(), &header, sizeof(header));
+                    if (0 != (error = FileRead(m_eventData.data() + sizeof(header), header.size - sizeof(header))))
+                    {
+                        goto Error;
+                    }
+
+                    pEvent = m_eventData.data();
+                }
+
+                if (0 == GetSampleEventInfo(reinterpret_cast<perf_event_header const*>(pEvent), &info) &&
+                    0 != (info.SampleType() & PERF_SAMPLE_TIME) &&
+                    info.time > maxTimeSoFar)
+                {
+                    maxTimeSoFar = info.time;
+                }
+                break;
+            }
+            case PERF_RECORD_HEADER_TRACING_DATA:
+            case PERF_RECORD_AUXTRACE:
+            {
+                // Extra data follows the event.
+                uint64_t specialDataSize;
+                if (header.type == PERF_RECORD_HEADER_TRACING_DATA)
+                {
+                    uint32_t size32;
+                    if (header.size < sizeof(header) + sizeof(size32))
+                    {
+                        error = EINVAL;
+                        goto Error;
+                    }
+                    else if (0 != (error = FileRead(&size32, sizeof(size32))))
+                    {
+                        goto Error;
+                    }
+
+                    specialDataSize = m_byteReader.Read(&size32);
+                }
+                else
+                {
+                    uint64_t size64;
+                    if (header.size < sizeof(header) + sizeof(size64))
+                    {
+                        error = EINVAL;
+                        goto Error;
+                    }
+                    else if (0 != (error = FileRead(&size64, sizeof(size64))))
+                    {
+                        goto Error;
+                    }
+
+                    specialDataSize = m_byteReader.Read(&size64);
+                }
+
+                if (specialDataSize > 0x80000000 || 0 != (specialDataSize & 7u) ||
+                    specialDataSize > m_dataEndFilePos - pos - header.size)
+                {
+                    error = EINVAL;
+                    goto Error;
+                }
+
+                eventSize += specialDataSize;
+                break;
+            }
+            default:
+                break;
+            }
+
+            pos += eventSize;
+
+            if (header.type == PERF_RECORD_FINISHED_ROUND ||
+                pos - segmentBeginPos >= SegmentSizeMax)
+            {
+                m_timeIndex.push_back({ segmentBeginPos, maxTimeSoFar });
+                segmentBeginPos = pos;
+            }
+        }
+
+        if (segmentBeginPos != pos)
+        {
+            m_timeIndex.push_back({ segmentBeginPos, maxTimeSoFar });
+        }
+
+        if (savedFilePos == UINT64_MAX)
+        {
+            m_filePos = UINT64_MAX; // Preserve error/EOF state.
+        }
+        else if (0 != (error = FileSeek(savedFilePos)))
+        {
+            goto Error;
+        }
+
+        m_builtTimeIndex = true;
+        return 0;
+    }
+    catch (std::bad_alloc const&)
+    {
+        error = ENOMEM;
+    }
+
+Error:
+
+    m_timeIndex.clear();
+    m_filePos = UINT64_MAX; // Subsequent ReadEvent should get EPIPE.
+    return error;
+}
+
+_Success_(return == 0) int
+PerfDataFile::SeekToTime(uint64_t minTime) noexcept
+{
+    int error = BuildTimeIndex();
+    if (error == 0)
+    {
+        // maxTimeSoFar is non-decreasing, so find the first segment that reaches minTime.
+        auto const it = std::lower_bound(
+            m_timeIndex.begin(),
+            m_timeIndex.end(),
+            minTime,
+            [](TimeIndexEntry const& entry, uint64_t value) noexcept
+            {
+                return entry.maxTimeSoFar < value;
+            });
+        auto const filePos = it == m_timeIndex.end()
+            ? m_dataEndFilePos
+            : it->filePos;
+        error = FileSeek(filePos);
+        if (error != 0)
+        {
+            m_filePos = UINT64_MAX;
+        }
+    }
+
+    return error;
+}
+
+// Reads the header of the mapped event at pos (host-endian) and determines the
+// event's full size, including the extra data that follows
+// PERF_RECORD_HEADER_TRACING_DATA and PERF_RECORD_AUXTRACE records.
+static _Success_(return == 0) int
+ReadMappedEventExtent(
+    uint8_t const* mapData,
+    uint64_t pos,
+    uint64_t endPos,
+    PerfByteReader byteReader,
+    _Out_ perf_event_header* pHeader,
+    _Out_ uint64_t* pEventSize) noexcept
+{
+    if (sizeof(perf_event_header) > endPos - pos)
+    {
+        return EINVAL;
+    }
+
+    memcpy(pHeader, mapData + pos, sizeof(perf_event_header));
+    if (byteReader.ByteSwapNeeded())
+    {
+        pHeader->ByteSwap();
+    }
+
+    if (pHeader->size < sizeof(perf_event_header) ||
+        pHeader->size > endPos - pos)
+    {
+        return EINVAL;
+    }
+
+    uint64_t eventSize = pHeader->size;
+    if (pHeader->type == PERF_RECORD_HEADER_TRACING_DATA ||
+        pHeader->type == PERF_RECORD_AUXTRACE)
+    {
+        uint64_t specialDataSize;
+        if (pHeader->type == PERF_RECORD_HEADER_TRACING_DATA)
+        {
+            if (pHeader->size < sizeof(perf_event_header) + sizeof(uint32_t))
+            {
+                return EINVAL;
+            }
+
+            specialDataSize = byteReader.ReadAsU32(mapData + pos + sizeof(perf_event_header));
+        }
+        else
+        {
+            if (pHeader->size < sizeof(perf_event_header) + sizeof(uint64_t))
+            {
+                return EINVAL;
+            }
+
+            specialDataSize = byteReader.ReadAsU64(mapData + pos + sizeof(perf_event_header));
+        }
+
+        if (specialDataSize > 0x80000000 || 0 != (specialDataSize & 7u) ||
+            specialDataSize > endPos - pos - pHeader->size)
+        {
+            return EINVAL;
+        }
+
+        eventSize += specialDataSize;
+    }
+
+    *pEventSize = eventSize;
+    return 0;
+}
+
+_Success_(return == 0) int
+PerfDataFile::GetDataChunks(
+    uint64_t chunkSizeTarget,
+    _Out_ std::vector<PerfDataFileChunk>* pChunks) const noexcept
+{
+    int error;
+
+    pChunks->clear();
+
+    if (m_mapData == nullptr ||
+        m_dataEndFilePos == UINT64_MAX ||
+        !m_headers[PERF_HEADER_COMPRESSED].empty())
+    {
+        return ENOTSUP;
+    }
+
+    // Chunk readers may call const methods concurrently, so those must not
+    // load anything. (No-op unless m_lazyMetadata.)
+    Lazy().LoadAll();
+
+    if (chunkSizeTarget == 0)
+    {
+        chunkSizeTarget = 1;
+    }
+
+    auto const chunkSizeMax = chunkSizeTarget > UINT64_MAX / 4
+        ? UINT64_MAX
+        : chunkSizeTarget * 4;
+
+    try
+    {
+        uint64_t chunkBeginPos = m_dataBeginFilePos;
+        uint64_t pos = m_dataBeginFilePos;
+        while (pos < m_dataEndFilePos)
+        {
+            perf_event_header header;
+            uint64_t eventSize;
+            error = ReadMappedEventExtent(m_mapData, pos, m_dataEndFilePos, m_byteReader, &header, &eventSize);
+            if (error != 0)
+            {
+                goto Error;
+            }
+
+            pos += eventSize;
+
+            auto const chunkSize = pos - chunkBeginPos;
+            if ((header.type == PERF_RECORD_FINISHED_ROUND && chunkSize >= chunkSizeTarget) ||
+                chunkSize >= chunkSizeMax)
+            {
+                pChunks->push_back({ chunkBeginPos, pos });
+                chunkBeginPos = pos;
+            }
+        }
+
+        if (chunkBeginPos != pos)
+        {
+            pChunks->push_back({ chunkBeginPos, pos });
+        }
+
+        return 0;
+    }
+    catch (std::bad_alloc const&)
+    {
+        error = ENOMEM;
+    }
+
+Error:
+
+    pChunks->clear();
+    return error;
+}
+
 _Success_(return == 0) int
 PerfDataFile::GetSampleEventInfo(
     _In_ perf_event_header const* pEventHeader,
     _Out_ PerfSampleEventInfo* pInfo) const noexcept
 {
+    return m_byteReader.ByteSwapNeeded()
+        ? GetSampleEventInfoImpl<true>(pEventHeader, pInfo)
+        : GetSampleEventInfoImpl<false>(pEventHeader, pInfo);
+}
+
+void
+PerfDataFile::SetCallchainTable(PerfCallchainTable const* table) noexcept
+{
+    m_callchainTable = table;
+}
+
+template<bool ByteSwap>
+_Success_(return == 0) int
+PerfDataFile::GetSampleEventInfoImpl(
+    _In_ perf_event_header const* pEventHeader,
+    _Out_ PerfSampleEventInfo* pInfo) const noexcept
+{
+    PerfByteReaderT<ByteSwap> const byteReader;
     auto const SupportedSampleTypes = 0
         | PERF_SAMPLE_IDENTIFIER
         | PERF_SAMPLE_IP
@@ -710,14 +1422,14 @@ PerfDataFile::GetSampleEventInfo(
     error = GetSampleEventId(pEventHeader, &id);
     if (!error)
     {
-        auto eventDescIt = m_eventDescById.find(id);
-        if (eventDescIt == m_eventDescById.end())
+        auto const eventDescIndex = FindEventDescIndex(id);
+        if (eventDescIndex == SIZE_MAX)
         {
             error = ENOENT;
             goto Error;
         }
 
-        auto const& eventDesc = m_eventDescList[eventDescIt->second];
+        auto const& eventDesc = ResolveEventDesc(eventDescIndex);
         auto const infoSampleTypes = eventDesc.attr->sample_type & SupportedSampleTypes;
         char const* infoRawData = nullptr;
         uint32_t infoRawDataSize = 0;
@@ -735,7 +1447,7 @@ PerfDataFile::GetSampleEventInfo(
         if (infoSampleTypes & PERF_SAMPLE_IP)
         {
             IF_EQUAL_GOTO_ERROR(iArray, cArray);
-            pInfo->ip = m_byteReader.Read(&pArray[iArray]);
+            pInfo->ip = byteReader.Read(&pArray[iArray]);
             iArray += 1;
         }
 
@@ -743,22 +1455,22 @@ PerfDataFile::GetSampleEventInfo(
         {
             IF_EQUAL_GOTO_ERROR(iArray, cArray);
             auto const* p32 = reinterpret_cast<uint32_t const*>(&pArray[iArray]);
-            pInfo->pid = m_byteReader.Read(&p32[0]);
-            pInfo->tid = m_byteReader.Read(&p32[1]);
+            pInfo->pid = byteReader.Read(&p32[0]);
+            pInfo->tid = byteReader.Read(&p32[1]);
             iArray += 1;
         }
 
         if (infoSampleTypes & PERF_SAMPLE_TIME)
         {
             IF_EQUAL_GOTO_ERROR(iArray, cArray);
-            pInfo->time = m_byteReader.Read(&pArray[iArray]);
+            pInfo->time = byteReader.Read(&pArray[iArray]);
             iArray += 1;
         }
 
         if (infoSampleTypes & PERF_SAMPLE_ADDR)
         {
             IF_EQUAL_GOTO_ERROR(iArray, cArray);
-            pInfo->addr = m_byteReader.Read(&pArray[iArray]);
+            pInfo->addr = byteReader.Read(&pArray[iArray]);
             iArray += 1;
         }
 
@@ -771,7 +1483,7 @@ PerfDataFile::GetSampleEventInfo(
         if (infoSampleTypes & PERF_SAMPLE_STREAM_ID)
         {
             IF_EQUAL_GOTO_ERROR(iArray, cArray);
-            pInfo->stream_id = m_byteReader.Read(&pArray[iArray]);
+            pInfo->stream_id = byteReader.Read(&pArray[iArray]);
             iArray += 1;
         }
 
@@ -779,15 +1491,15 @@ PerfDataFile::GetSampleEventInfo(
         {
             IF_EQUAL_GOTO_ERROR(iArray, cArray);
             auto const* p32 = reinterpret_cast<uint32_t const*>(&pArray[iArray]);
-            pInfo->cpu = m_byteReader.Read(&p32[0]);
-            pInfo->cpu_reserved = m_byteReader.Read(&p32[1]);
+            pInfo->cpu = byteReader.Read(&p32[0]);
+            pInfo->cpu_reserved = byteReader.Read(&p32[1]);
             iArray += 1;
         }
 
         if (infoSampleTypes & PERF_SAMPLE_PERIOD)
         {
             IF_EQUAL_GOTO_ERROR(iArray, cArray);
-            pInfo->period = m_byteReader.Read(&pArray[iArray]);
+            pInfo->period = byteReader.Read(&pArray[iArray]);
             iArray += 1;
         }
 
@@ -811,7 +1523,7 @@ PerfDataFile::GetSampleEventInfo(
             else if (attrReadFormat & PERF_FORMAT_GROUP)
             {
                 IF_EQUAL_GOTO_ERROR(iArray, cArray);
-                auto const cValues = m_byteReader.Read(&pArray[iArray]);
+                auto const cValues = byteReader.Read(&pArray[iArray]);
 
                 auto const cStaticItems = 1u // cValues
                     + (0 != (attrReadFormat & PERF_FORMAT_TOTAL_TIME_ENABLED))
@@ -851,7 +1563,7 @@ PerfDataFile::GetSampleEventInfo(
             IF_EQUAL_GOTO_ERROR(iArray, cArray);
             auto const infoCallchain = &pArray[iArray];
             pInfo->callchain = infoCallchain;
-            auto const count = m_byteReader.Read(infoCallchain);
+            auto const count = byteReader.Read(infoCallchain);
             iArray += 1;
 
             if (cArray - iArray < count)
@@ -860,13 +1572,18 @@ PerfDataFile::GetSampleEventInfo(
                 goto Error;
             }
             iArray += static_cast<size_t>(count);
+
+            if (!ByteSwap && m_callchainTable != nullptr)
+            {
+                pInfo->callchain = m_callchainTable->Expand(infoCallchain);
+            }
         }
 
         if (infoSampleTypes & PERF_SAMPLE_RAW)
         {
             IF_EQUAL_GOTO_ERROR(iArray, cArray);
             auto const* p32 = reinterpret_cast<uint32_t const*>(&pArray[iArray]);
-            infoRawDataSize = m_byteReader.Read(&p32[0]);
+            infoRawDataSize = byteReader.Read(&p32[0]);
             infoRawData = reinterpret_cast<char const*>(p32 + 1);
             if ((cArray - iArray) * sizeof(uint64_t) - sizeof(uint32_t) < infoRawDataSize)
             {
@@ -917,14 +1634,14 @@ PerfDataFile::GetNonSampleEventInfo(
     error = GetNonSampleEventId(pEventHeader, &id);
     if (!error)
     {
-        auto eventDescIt = m_eventDescById.find(id);
-        if (eventDescIt == m_eventDescById.end())
+        auto const eventDescIndex = FindEventDescIndex(id);
+        if (eventDescIndex == SIZE_MAX)
         {
             error = ENOENT;
             goto Error;
         }
 
-        auto const& eventDesc = m_eventDescList[eventDescIt->second];
+        auto const& eventDesc = ResolveEventDesc(eventDescIndex);
         auto const infoSampleTypes = eventDesc.attr->sample_type & SupportedSampleTypes;
 
         auto const pArray = reinterpret_cast<uint64_t const*>(pEventHeader);
@@ -984,13 +1701,45 @@ PerfDataFile::GetNonSampleEventInfo(
         return 0;
     }
 
-Error:
+Error:
+
+    pInfo->event_desc = {};
+    pInfo->session_info = {};
+    pInfo->header = {};
+    pInfo->id = {};
+    return error;
+}
+
+_Success_(return == 0) int
+PerfDataFile::GetLostEventCount(
+    _In_ perf_event_header const* pEventHeader,
+    _Out_ uint64_t* pLostCount) const noexcept
+{
+    // PERF_RECORD_LOST: { header, u64 id, u64 lost, sample_id }.
+    // PERF_RECORD_LOST_SAMPLES: { header, u64 lost, sample_id }.
+    unsigned lostIndex;
+    switch (pEventHeader->type)
+    {
+    case PERF_RECORD_LOST:
+        lostIndex = 1;
+        break;
+    case PERF_RECORD_LOST_SAMPLES:
+        lostIndex = 0;
+        break;
+    default:
+        *pLostCount = 0;
+        return EINVAL;
+    }
+
+    if (pEventHeader->size < sizeof(perf_event_header) + (lostIndex + 1) * sizeof(uint64_t))
+    {
+        *pLostCount = 0;
+        return EINVAL;
+    }
 
-    pInfo->event_desc = {};
-    pInfo->session_info = {};
-    pInfo->header = {};
-    pInfo->id = {};
-    return error;
+    auto const pArray = reinterpret_cast<uint64_t const*>(pEventHeader + 1);
+    *pLostCount = m_byteReader.Read(&pArray[lostIndex]);
+    return 0;
 }
 
 _Success_(return == 0) int
@@ -1075,42 +1824,65 @@ Done:
 _Success_(return == 0) int
 PerfDataFile::LoadHeaders(perf_file_section const& data, uint64_t flags) noexcept
 {
+    // Headers needed by Open and ReadEvent. Others are loaded on first use.
+    static constexpr uint64_t EagerHeaders = 0
+        | (uint64_t(1) << PERF_HEADER_EVENT_DESC)
+        | (uint64_t(1) << PERF_HEADER_CLOCKID)
+        | (uint64_t(1) << PERF_HEADER_COMPRESSED)
+        | (uint64_t(1) << PERF_HEADER_CLOCK_DATA);
+
     int error;
 
     try
     {
-        error = 0;
+        // The section table has an entry for each bit set in flags, in bit order.
+        perf_file_section sections[ArrayCount(m_headers)];
+        unsigned sectionCount = 0;
+        for (unsigned i = 0; i != ArrayCount(m_headers); i += 1)
+        {
+            sectionCount += (flags >> i) & 1;
+        }
+
+        error = FileSeekAndRead(data.offset + data.size, sections, sectionCount * sizeof(sections[0]));
+        if (error)
+        {
+            goto Done;
+        }
 
-        auto filePos = data.offset + data.size;
-        uint64_t mask = 1;
-        for (auto& header : m_headers)
+        unsigned sectionIndex = 0;
+        for (unsigned i = 0; i != ArrayCount(m_headers); i += 1)
         {
-            if (flags & mask)
+            if (flags & (uint64_t(1) << i))
             {
-                perf_file_section section;
-                error = FileSeekAndRead(filePos, &section, sizeof(section));
-                filePos += sizeof(section);
-                if (error)
-                {
-                    break;
-                }
+                auto const& section = sections[sectionIndex];
+                sectionIndex += 1;
 
                 if (!SectionValid(section) ||
                     section.size > 0x80000000)
                 {
                     error = EINVAL;
-                    break;
+                    goto Done;
                 }
 
-                header.resize(static_cast<size_t>(section.size));
-                error = FileSeekAndRead(section.offset, header.data(), header.size());
+                m_headerSections[i] = { section.offset, section.size };
+                m_headersPending |= uint64_t(1) << i;
+            }
+        }
+
+        for (unsigned i = 0; i != ArrayCount(m_headers); i += 1)
+        {
+            auto const mask = uint64_t(1) << i;
+            if (m_headersPending & mask & EagerHeaders)
+            {
+                m_headersPending &= ~mask;
+                auto& header = m_headers[i];
+                header.resize(static_cast<size_t>(m_headerSections[i].size));
+                error = FileSeekAndRead(m_headerSections[i].filePos, header.data(), header.size());
                 if (error)
                 {
-                    break;
+                    goto Done;
                 }
             }
-
-            mask <<= 1;
         }
     }
     catch (std::bad_alloc const&)
@@ -1118,9 +1890,93 @@ PerfDataFile::LoadHeaders(perf_file_section const& data, uint64_t flags) noexcep
         error = ENOMEM;
     }
 
+Done:
+
     return error;
 }
 
+void
+PerfDataFile::LoadHeader(PerfHeaderIndex headerIndex) noexcept
+{
+    auto const mask = uint64_t(1) << headerIndex;
+    if (0 == (m_headersPending & mask))
+    {
+        return;
+    }
+
+    m_headersPending &= ~mask;
+
+    auto& header = m_headers[headerIndex];
+    try
+    {
+        header.resize(static_cast<size_t>(m_headerSections[headerIndex].size));
+        if (0 != FileReadAt(m_headerSections[headerIndex].filePos, header.data(), header.size()))
+        {
+            header.clear();
+        }
+    }
+    catch (std::bad_alloc const&)
+    {
+        header.clear();
+    }
+}
+
+void
+PerfDataFile::EnsureTracingData() noexcept
+{
+    if (m_headersPending & (uint64_t(1) << PERF_HEADER_TRACING_DATA))
+    {
+        LoadHeader(PERF_HEADER_TRACING_DATA);
+        ParseTracingData();
+    }
+}
+
+void
+PerfDataFile::LoadAll() noexcept
+{
+    EnsureTracingData();
+
+    for (unsigned i = 0; i != ArrayCount(m_headers); i += 1)
+    {
+        LoadHeader(static_cast<PerfHeaderIndex>(i));
+    }
+
+    for (size_t i = 0; i != m_eventDescList.size(); i += 1)
+    {
+        ResolveEventDesc(i);
+    }
+}
+
+PerfDataFile&
+PerfDataFile::Lazy() const noexcept
+{
+    // Lazily-loaded headers and formats are logically part of the opened
+    // file, so const methods load them as needed. Nothing is pending (so
+    // nothing is modified) unless m_lazyMetadata.
+    return const_cast<PerfDataFile&>(*this);
+}
+
+PerfEventDesc const&
+PerfDataFile::ResolveEventDesc(size_t eventDescIndex) const noexcept
+{
+    auto const& desc = m_eventDescList[eventDescIndex];
+    if (!desc.metadataResolved)
+    {
+        auto& self = Lazy();
+        auto& mutableDesc = self.m_eventDescList[eventDescIndex];
+        if (mutableDesc.metadata == nullptr && mutableDesc.attr->type == PERF_TYPE_TRACEPOINT)
+        {
+            // May parse TRACING_DATA (which clears metadataResolved).
+            self.EnsureTracingData();
+            mutableDesc.metadata = self.FindMetadata(static_cast<uint32_t>(mutableDesc.attr->config));
+        }
+
+        mutableDesc.metadataResolved = true;
+    }
+
+    return desc;
+}
+
 // Returns pEnd - p.
 static constexpr size_t
 Remaining(char const* p, char const* pEnd) noexcept
@@ -1206,6 +2062,40 @@ ReadNamedSection(
     return ReadSection<SizeType>(byteReader, p + cchExpectedName, pEnd, sv);
 }
 
+// Finds the "ID:" line of a tracepoint format file (same rules as
+// PerfEventMetadata::Parse). Returns true and sets id if found.
+static bool
+FormatId(std::string_view formatFileContents, _Out_ uint32_t* id) noexcept
+{
+    auto p = formatFileContents.data();
+    auto const pEnd = p + formatFileContents.size();
+    while (p != pEnd)
+    {
+        auto const pLineEnd = std::find(p, pEnd, '\n');
+        if (Remaining(p, pLineEnd) > 3 && 0 == memcmp(p, "ID:", 3))
+        {
+            p += 3;
+            while (p != pLineEnd && (*p == ' ' || *p == '\t'))
+            {
+                p += 1;
+            }
+
+            // strtoul needs a NUL-terminated copy of the value.
+            char value[24];
+            auto const cchValue = std::min(Remaining(p, pLineEnd), sizeof(value) - 1);
+            memcpy(value, p, cchValue);
+            value[cchValue] = 0;
+            *id = static_cast<uint32_t>(strtoul(value, nullptr, 0));
+            return true;
+        }
+
+        p = pLineEnd == pEnd ? pEnd : pLineEnd + 1;
+    }
+
+    *id = 0;
+    return false;
+}
+
 void
 PerfDataFile::ParseTracingData() noexcept
 {
@@ -1322,64 +2212,20 @@ PerfDataFile::ParseTracingData() noexcept
                         return; // Unexpected.
                     }
 
-                    PerfEventMetadata eventMetadata;
-                    auto longSize64 = m_tracingDataLongSize == 0
-                        ? sizeof(uintptr_t) == 8
-                        : m_tracingDataLongSize == 8;
-                    if (eventMetadata.Parse(longSize64, systemName, formatFileContents))
+                    uint32_t id;
+                    if (FormatId(formatFileContents, &id))
                     {
-                        int8_t commonTypeOffset = -1;
-                        uint8_t commonTypeSize = 0;
-                        for (uint32_t i = 0; i != eventMetadata.CommonFieldCount(); i += 1)
-                        {
-                            auto const& field = eventMetadata.Fields()[i];
-                            if (field.Name() == "common_type"sv)
-                            {
-                                if (field.Offset() < 128 &&
-                                    (field.Size() == 1 || field.Size() == 2 || field.Size() == 4) &&
-                                    field.Array() == PerfFieldArrayNone)
-                                {
-                                    commonTypeOffset = static_cast<int8_t>(field.Offset());
-                                    commonTypeSize = static_cast<uint8_t>(field.Size());
-                                }
-                                break;
-                            }
-                        }
-
-                        if (commonTypeOffset == -1)
-                        {
-                            // Unexpected: did not find a usable "common_type" field.
-                            continue;
-                        }
-                        else if (m_commonTypeOffset == -1)
-                        {
-                            // First event to be parsed. Use its "common_type" field.
-                            m_commonTypeOffset = commonTypeOffset;
-                            m_commonTypeSize = commonTypeSize;
-                        }
-                        else if (
-                            m_commonTypeOffset != commonTypeOffset ||
-                            m_commonTypeSize != commonTypeSize)
-                        {
-                            // Unexpected: found a different "common_type" field.
-                            continue;
-                        }
-
-                        m_metadataById.try_emplace(eventMetadata.Id(), std::move(eventMetadata));
+                        m_unparsedFormatsById.try_emplace(id, TracingFormat{ systemName, formatFileContents });
                     }
                 }
             }
 
-            // Update EventDesc with the new metadata.
+            // EventDescs that did not find metadata should look again.
             for (auto& desc : m_eventDescList)
             {
-                if (desc.metadata == nullptr && desc.attr->type == PERF_TYPE_TRACEPOINT)
+                if (desc.metadata == nullptr)
                 {
-                    auto it = m_metadataById.find(static_cast<uint32_t>(desc.attr->config));
-                    if (it != m_metadataById.end())
-                    {
-                        desc.metadata = &it->second;
-                    }
+                    desc.metadataResolved = false;
                 }
             }
 
@@ -1417,6 +2263,83 @@ PerfDataFile::ParseTracingData() noexcept
     }
 }
 
+PerfEventMetadata const*
+PerfDataFile::FindMetadata(uint32_t id) noexcept
+{
+    auto const parsed = m_metadataById.find(id);
+    if (parsed != m_metadataById.end())
+    {
+        return parsed->second;
+    }
+
+    auto const unparsed = m_unparsedFormatsById.find(id);
+    if (unparsed == m_unparsedFormatsById.end())
+    {
+        return nullptr;
+    }
+
+    auto const format = unparsed->second;
+    m_unparsedFormatsById.erase(unparsed);
+
+    try
+    {
+        auto& eventMetadata = m_parseScratch;
+        auto longSize64 = m_tracingDataLongSize == 0
+            ? sizeof(uintptr_t) == 8
+            : m_tracingDataLongSize == 8;
+        if (!eventMetadata.Parse(longSize64, format.systemName, format.formatFileContents) ||
+            eventMetadata.Id() != id)
+        {
+            return nullptr;
+        }
+
+        int8_t commonTypeOffset = -1;
+        uint8_t commonTypeSize = 0;
+        for (uint32_t i = 0; i != eventMetadata.CommonFieldCount(); i += 1)
+        {
+            auto const& field = eventMetadata.Fields()[i];
+            if (field.Name() == "common_type"sv)
+            {
+                if (field.Offset() < 128 &&
+                    (field.Size() == 1 || field.Size() == 2 || field.Size() == 4) &&
+                    field.Array() == PerfFieldArrayNone)
+                {
+                    commonTypeOffset = static_cast<int8_t>(field.Offset());
+                    commonTypeSize = static_cast<uint8_t>(field.Size());
+                }
+                break;
+            }
+        }
+
+        if (commonTypeOffset == -1)
+        {
+            // Unexpected: did not find a usable "common_type" field.
+            return nullptr;
+        }
+        else if (m_commonTypeOffset == -1)
+        {
+            // First event to be parsed. Use its "common_type" field.
+            m_commonTypeOffset = commonTypeOffset;
+            m_commonTypeSize = commonTypeSize;
+        }
+        else if (
+            m_commonTypeOffset != commonTypeOffset ||
+            m_commonTypeSize != commonTypeSize)
+        {
+            // Unexpected: found a different "common_type" field.
+            return nullptr;
+        }
+
+        auto const stored = &m_metadataStore.Add(eventMetadata, false);
+        m_metadataById.try_emplace(id, stored);
+        return stored;
+    }
+    catch (std::bad_alloc const&)
+    {
+        return nullptr;
+    }
+}
+
 void
 PerfDataFile::ParseHeaderClockid() noexcept
 {
@@ -1667,30 +2590,99 @@ PerfDataFile::AddAttr(
     auto const eventDescIndex = m_eventDescList.size();
     auto const pEventListIds = pIds.get(); // To access ids after we move-from pIds.
 
-    PerfEventMetadata const* pMetadata = nullptr;
-    if (pAttr->type == PERF_TYPE_TRACEPOINT)
-    {
-        auto itMetadata = m_metadataById.find(static_cast<uint32_t>(pAttr->config));
-        if (itMetadata != m_metadataById.end())
-        {
-            pMetadata = &itMetadata->second;
-        }
-    }
-
+    // metadata is looked up on first use (ResolveEventDesc).
     m_eventDescList.push_back({
-        { pAttr.get(), pName, pMetadata, pIds.get(), cIds},
+        { pAttr.get(), pName, nullptr, pIds.get(), cIds},
         std::move(pAttr),
-        std::move(pIds)
+        std::move(pIds),
+        false
     });
 
     for (uint32_t i = 0; i != cIds; i += 1)
     {
-        m_eventDescById[pEventListIds[i]] = eventDescIndex;
+        SetEventDescIndex(pEventListIds[i], eventDescIndex);
     }
 
     return 0;
 }
 
+// Fibonacci hashing: sample_ids are usually sequential, so use the high bits
+// of the product.
+static size_t
+EventDescIdHash(uint64_t id) noexcept
+{
+    return static_cast<size_t>((id * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+}
+
+size_t
+PerfDataFile::FindEventDescIndex(uint64_t id) const noexcept
+{
+    size_t eventDescIndex = SIZE_MAX;
+
+    if (!m_eventDescById.empty())
+    {
+        auto const mask = m_eventDescById.size() - 1;
+        for (size_t i = EventDescIdHash(id);; i += 1)
+        {
+            auto const& slot = m_eventDescById[i & mask];
+            if (slot.id == id || slot.eventDescIndex == SIZE_MAX)
+            {
+                eventDescIndex = slot.eventDescIndex;
+                break;
+            }
+        }
+    }
+
+    return eventDescIndex;
+}
+
+void
+PerfDataFile::SetEventDescIndex(uint64_t id, size_t eventDescIndex) noexcept(false)
+{
+    assert(eventDescIndex != SIZE_MAX);
+
+    if (m_eventDescByIdCount + 1 > m_eventDescById.size() / 2)
+    {
+        size_t slotCount = m_eventDescById.empty() ? 16 : m_eventDescById.size() * 2;
+        std::vector<EventDescIdSlot> table(slotCount, EventDescIdSlot{ 0, SIZE_MAX }); // may throw bad_alloc.
+        for (auto const& slot : m_eventDescById)
+        {
+            if (slot.eventDescIndex != SIZE_MAX)
+            {
+                for (size_t i = EventDescIdHash(slot.id);; i += 1)
+                {
+                    auto& newSlot = table[i & (slotCount - 1)];
+                    if (newSlot.eventDescIndex == SIZE_MAX)
+                    {
+                        newSlot = slot;
+                        break;
+                    }
+                }
+            }
+        }
+
+        m_eventDescById.swap(table);
+    }
+
+    auto const mask = m_eventDescById.size() - 1;
+    for (size_t i = EventDescIdHash(id);; i += 1)
+    {
+        auto& slot = m_eventDescById[i & mask];
+        if (slot.eventDescIndex == SIZE_MAX)
+        {
+            slot.id = id;
+            slot.eventDescIndex = eventDescIndex;
+            m_eventDescByIdCount += 1;
+            break;
+        }
+        else if (slot.id == id)
+        {
+            slot.eventDescIndex = eventDescIndex;
+            break;
+        }
+    }
+}
+
 bool
 PerfDataFile::EnsureEventDataSize(uint32_t minSize) noexcept
 {
@@ -1744,6 +2736,18 @@ PerfDataFile::SectionValid(perf_file_section const& section) const noexcept
 _Success_(return == 0) int
 PerfDataFile::FileRead(_Out_writes_bytes_all_(cb) void* p, uintptr_t cb) noexcept
 {
+    if (m_mapData != nullptr)
+    {
+        if (m_filePos > m_fileLen || cb > m_fileLen - m_filePos)
+        {
+            return EPIPE;
+        }
+
+        memcpy(p, m_mapData + m_filePos, cb);
+        m_filePos += cb;
+        return 0;
+    }
+
     auto pLeft = static_cast<uint8_t*>(p);
     auto cLeft = cb;
 
@@ -1779,6 +2783,11 @@ PerfDataFile::FileSeek(uint64_t filePos) noexcept
     {
         error = 0;
     }
+    else if (m_mapData != nullptr)
+    {
+        m_filePos = filePos; // FileRead will check bounds.
+        error = 0;
+    }
     else if (FSEEK64(m_file, filePos, SEEK_SET))
     {
         error = errno;
@@ -1801,3 +2810,125 @@ PerfDataFile::FileSeekAndRead(
     int error = FileSeek(filePos);
     return error ? error : FileRead(p, cb);
 }
+
+_Success_(return == 0) int
+PerfDataFile::FileReadAt(
+    uint64_t filePos,
+    _Out_writes_bytes_all_(cb) void* p,
+    uintptr_t cb) noexcept
+{
+    if (m_mapData != nullptr)
+    {
+        if (filePos > m_fileLen || cb > m_fileLen - filePos)
+        {
+            return EPIPE;
+        }
+
+        memcpy(p, m_mapData + filePos, cb);
+        return 0;
+    }
+
+    // Preserve the read position for ReadEvent.
+    auto const oldFilePos = m_filePos;
+    int error = FileSeekAndRead(filePos, p, cb);
+    if (oldFilePos == UINT64_MAX)
+    {
+        m_filePos = UINT64_MAX;
+    }
+    else if (FileSeek(oldFilePos))
+    {
+        m_filePos = UINT64_MAX; // Next ReadEvent will fail.
+    }
+
+    return error;
+}
+
+PerfDataFileChunkReader::PerfDataFileChunkReader() noexcept
+    : m_file(nullptr)
+    , m_filePos(0)
+    , m_endFilePos(0)
+    , m_eventData()
+{
+    return;
+}
+
+void
+PerfDataFileChunkReader::Reset(
+    PerfDataFile const& file,
+    PerfDataFileChunk const& chunk) noexcept
+{
+    assert(file.m_mapData != nullptr); // Requires: mapped file (see header).
+    assert(file.m_dataBeginFilePos <= chunk.beginFilePos);
+    assert(chunk.beginFilePos <= chunk.endFilePos);
+    assert(chunk.endFilePos <= file.m_dataEndFilePos);
+    m_file = &file;
+    m_filePos = chunk.beginFilePos;
+    m_endFilePos = chunk.endFilePos;
+}
+
+uint64_t
+PerfDataFileChunkReader::FilePos() const noexcept
+{
+    return m_filePos;
+}
+
+_Success_(return == 0) int
+PerfDataFileChunkReader::ReadEvent(_Outptr_result_maybenull_ perf_event_header const** ppEventHeader) noexcept
+{
+    int error;
+
+    if (m_filePos >= m_endFilePos)
+    {
+        *ppEventHeader = nullptr;
+        return m_filePos == m_endFilePos
+            ? 0 // End of chunk.
+            : EPIPE; // Calling ReadEvent after error.
+    }
+
+    assert(m_file != nullptr);
+    auto const mapData = m_file->m_mapData;
+    auto const byteReader = m_file->m_byteReader;
+
+    perf_event_header header;
+    uint64_t eventSize;
+    error = ReadMappedEventExtent(mapData, m_filePos, m_endFilePos, byteReader, &header, &eventSize);
+    if (error != 0)
+    {
+        goto Error;
+    }
+
+    if (!byteReader.ByteSwapNeeded() &&
+        0 == (m_filePos & (alignof(perf_event_header) - 1)))
+    {
+        // Zero-copy: use the event directly from the mapping.
+        *ppEventHeader = reinterpret_cast<perf_event_header const*>(mapData + m_filePos);
+    }
+    else
+    {
+        try
+        {
+            if (m_eventData.size() < eventSize)
+            {
+                m_eventData.resize(static_cast<size_t>(eventSize));
+            }
+        }
+        catch (std::bad_alloc const&)
+        {
+            error = ENOMEM;
+            goto Error;
+        }
+
+        memcpy(m_eventData.data(), mapData + m_filePos, static_cast<size_t>(eventSize));
+        memcpy(m_eventData.data(), &header, sizeof(header)); // Host-endian header.
+        *ppEventHeader = reinterpret_cast<perf_event_header const*>(m_eventData.data());
+    }
+
+    m_filePos += eventSize;
+    return 0;
+
+Error:
+
+    m_filePos = UINT64_MAX; // Subsequent ReadEvent should get EPIPE.
+    *ppEventHeader = nullptr;
+    return error;
+}
@@ -11,11 +11,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>  // _O_BINARY
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
 
 #ifdef _WIN32
 #include <io.h>
 static bool constexpr HostIsBigEndian = false;
 #define CLOSE(file)                     _close(file)
+#define DUP(file)                       _dup(file)
 #define LSEEK64(file, offset, origin)   _lseeki64(file, offset, origin)
 #define WRITE(file, data, size)         _write(file, data, size)
 #define WRITE_SIZE(size)                static_cast<unsigned>(std::min<size_t>(0x80000000, size))
@@ -25,15 +31,24 @@ static bool constexpr HostIsBigEndian = false;
 #include <unistd.h>
 #include <sys/utsname.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
 #include <endian.h>
 static bool constexpr HostIsBigEndian = __BYTE_ORDER == __BIG_ENDIAN;
 #define CLOSE(file)                     close(file)
+#define DUP(file)                       fcntl(file, F_DUPFD_CLOEXEC, 0)
 #define LSEEK64(file, offset, origin)   lseek64(file, offset, origin)
 #define WRITE(file, data, size)         write(file, data, size)
 #define WRITE_SIZE(size)                (size)
 #define GETPAGESIZE()                   sysconf(_SC_PAGESIZE)
 #endif // _WIN32
 
+#ifdef TRACEPOINT_DECODE_ZSTD
+#include <zstd.h>
+#endif // TRACEPOINT_DECODE_ZSTD
+
 #ifndef _Inout_
 #define _Inout_
 #endif
@@ -55,6 +70,182 @@ open_s(_Out_ int* pFile, _In_z_ char const* path, int oflags, int pmode)
 #endif
 }
 
+// Writes dataSize bytes to file, retrying short writes. Sets *pWritten to the
+// number of bytes written (less than dataSize only if there was an error).
+_Success_(return == 0) static int
+WriteAll(
+    int file,
+    _In_reads_bytes_(dataSize) void const* data,
+    size_t dataSize,
+    _Out_ size_t* pWritten) noexcept
+{
+    int error = 0;
+    size_t i = 0;
+
+    while (i < dataSize)
+    {
+        auto const writeSize = WRITE_SIZE(dataSize - i);
+        auto const writeResult = WRITE(
+            file,
+            static_cast<char const*>(data) + i,
+            writeSize);
+        if (writeResult < 0)
+        {
+            error = errno;
+            break;
+        }
+
+        i += writeResult;
+    }
+
+    *pWritten = i;
+    return error;
+}
+
+// AsyncWriter
+
+/*
+Background thread for EnableWriteBuffer(..., asyncBlockCount). Owns a pool of
+blocks. Submit() queues the writer's current block and gives the writer a free
+block, waiting if all blocks are queued (backpressure). The thread writes the
+queued blocks in order. After a write error, the remaining blocks are
+discarded and the error is returned by the next Submit() or by Stop().
+*/
+class PerfDataFileWriter::AsyncWriter
+{
+    struct Block
+    {
+        std::unique_ptr<char[]> Storage;
+        char* Data; // Aligned, within Storage.
+        uint32_t Size; // Bytes to write.
+        uint64_t FilePos; // Where the data goes.
+    };
+
+    PerfDataFileWriter& m_writer;
+    std::mutex m_mutex;
+    std::condition_variable m_cond; // Signaled when the queue or state changes.
+    std::vector<Block> m_free;
+    std::vector<Block> m_queue; // Oldest first. Capacity reserved, so push_back does not throw.
+    int m_error = 0;
+    bool m_busy = false; // The thread is writing a block.
+    bool m_exiting = false;
+    std::thread m_thread;
+
+public:
+
+    AsyncWriter(AsyncWriter const&) = delete;
+    void operator=(AsyncWriter const&) = delete;
+
+    ~AsyncWriter()
+    {
+        Stop();
+    }
+
+    // May throw bad_alloc or system_error.
+    AsyncWriter(PerfDataFileWriter& writer, uint32_t blockCount) noexcept(false)
+        : m_writer(writer)
+    {
+        auto const alignment = writer.m_writeAlignment;
+        auto const blockSize = writer.m_writeBlockSize;
+        m_free.reserve(blockCount + 1u);
+        m_queue.reserve(blockCount + 1u);
+        for (uint32_t i = 0; i != blockCount; i += 1)
+        {
+            Block block;
+            block.Storage = std::make_unique<char[]>(blockSize + alignment);
+            auto const storage = reinterpret_cast<uintptr_t>(block.Storage.get());
+            block.Data = reinterpret_cast<char*>((storage + alignment - 1) & ~uintptr_t(alignment - 1));
+            block.Size = 0;
+            block.FilePos = 0;
+            m_free.push_back(std::move(block));
+        }
+
+        m_thread = std::thread(&AsyncWriter::ThreadProc, this);
+    }
+
+    // Queues the writer's current block (size bytes for filePos) and replaces
+    // it with a free block.
+    _Success_(return == 0) int
+    Submit(uint32_t size, uint64_t filePos) noexcept
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() { return m_error != 0 || !m_free.empty(); });
+        if (m_error != 0)
+        {
+            return m_error; // Keep the current block (its data is discarded).
+        }
+
+        auto& writer = m_writer;
+        Block block = std::move(m_free.back());
+        m_free.pop_back();
+        std::swap(block.Storage, writer.m_writeBufferStorage);
+        std::swap(block.Data, writer.m_writeBuffer);
+        block.Size = size;
+        block.FilePos = filePos;
+        m_queue.push_back(std::move(block));
+        m_cond.notify_all();
+        return 0;
+    }
+
+    // Waits for the queued blocks to be written, then stops the thread.
+    // Returns the first write error, if any.
+    _Success_(return == 0) int
+    Stop() noexcept
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this]() { return m_queue.empty() && !m_busy; });
+            m_exiting = true;
+        }
+        m_cond.notify_all();
+
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+
+        return m_error;
+    }
+
+private:
+
+    void
+    ThreadProc() noexcept
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_cond.wait(lock, [this]() { return m_exiting || !m_queue.empty(); });
+            if (m_queue.empty())
+            {
+                break; // Exiting.
+            }
+
+            Block block = std::move(m_queue.front());
+            m_queue.erase(m_queue.begin());
+            m_busy = true;
+            auto error = m_error;
+            lock.unlock();
+
+            if (error == 0)
+            {
+                size_t written;
+                error = m_writer.WriteBlock(block.Data, block.Size, block.FilePos, &written);
+            }
+
+            lock.lock();
+            if (m_error == 0)
+            {
+                m_error = error;
+            }
+
+            m_free.push_back(std::move(block));
+            m_busy = false;
+            m_cond.notify_all();
+        }
+    }
+};
+
 template<class T>
 static void
 AppendValue(_Inout_ std::vector<char>* pHeader, T const& value)
@@ -171,7 +362,22 @@ PerfDataFileWriter::~PerfDataFileWriter()
 
 PerfDataFileWriter::PerfDataFileWriter() noexcept(false)
     : m_filePos(InvalidFilePos)
+    , m_eventDataBytes(0)
     , m_file(-1)
+    , m_zstd(nullptr)
+    , m_compressionLevel(0)
+    , m_compressedBytes(0)
+    , m_writeBufferStorage()
+    , m_writeBuffer(nullptr)
+    , m_writeBlockSize(0)
+    , m_writeBufferUsed(0)
+    , m_writeAlignment(static_cast<uint32_t>(GETPAGESIZE()))
+    , m_writeCache(PerfDataFileWriteCache::Normal)
+    , m_writeDirectActive(false)
+    , m_dropBehindPos(0)
+    , m_async()
+    , m_pipeMode(false)
+    , m_pipeInitWritten(false)
     , m_eventDescs()
     , m_tracepointInfoByCommonType()
     , m_headers()
@@ -187,11 +393,36 @@ PerfDataFileWriter::CloseNoFinalize() noexcept
     assert(ValidFilePos());
     if (m_file >= 0)
     {
+        FlushWriteBuffer(true); // Best effort.
         CLOSE(m_file);
     }
 
     m_file = -1;
     m_filePos = InvalidFilePos;
+    m_eventDataBytes = 0;
+
+#ifdef TRACEPOINT_DECODE_ZSTD
+    if (m_zstd != nullptr)
+    {
+        ZSTD_freeCCtx(m_zstd);
+    }
+#endif // TRACEPOINT_DECODE_ZSTD
+
+    m_zstd = nullptr;
+    m_compressionLevel = 0;
+    m_compressedBytes = 0;
+    m_compressInput.clear();
+
+    m_writeBufferStorage.reset();
+    m_writeBuffer = nullptr;
+    m_writeBlockSize = 0;
+    m_writeBufferUsed = 0;
+    m_writeCache = PerfDataFileWriteCache::Normal;
+    m_writeDirectActive = false;
+    m_dropBehindPos = 0;
+    m_async.reset();
+    m_pipeMode = false;
+    m_pipeInitWritten = false;
 }
 
 _Success_(return == 0) int
@@ -201,16 +432,57 @@ PerfDataFileWriter::FinalizeAndClose() noexcept
 
     try
     {
-        if (m_headers[PERF_HEADER_TRACING_DATA].empty())
+        // In pipe mode, these are synthesized by WritePipeMetadata.
+        if (!m_pipeMode && m_headers[PERF_HEADER_TRACING_DATA].empty())
         {
             SynthesizeTracingData();
         }
 
-        if (m_headers[PERF_HEADER_EVENT_DESC].empty())
+        if (!m_pipeMode && m_headers[PERF_HEADER_EVENT_DESC].empty())
         {
             SynthesizeEventDesc();
         }
 
+        if (m_zstd != nullptr)
+        {
+            error = FlushCompression(true);
+            if (error != 0)
+            {
+                goto Done;
+            }
+
+            /*
+            struct perf_header_compressed {
+                uint32_t version; // 1
+                uint32_t type; // 1 = PERF_COMP_ZSTD
+                uint32_t level;
+                uint32_t ratio;
+                uint32_t mmap_len; // Max decompressed size of one record.
+            };
+            */
+            auto& header = m_headers[PERF_HEADER_COMPRESSED];
+            header.clear();
+            AppendValue<uint32_t>(&header, 1);
+            AppendValue<uint32_t>(&header, 1);
+            AppendValue<uint32_t>(&header, static_cast<uint32_t>(m_compressionLevel));
+            AppendValue<uint32_t>(&header, m_compressedBytes == 0
+                ? 0u
+                : static_cast<uint32_t>(m_eventDataBytes / m_compressedBytes));
+            AppendValue<uint32_t>(&header, CompressionChunkSize);
+        }
+
+        if (m_pipeMode)
+        {
+            // No file header or footer. The headers go inline at the end.
+            error = WritePipeMetadata();
+            if (error == 0)
+            {
+                error = FlushWriteBuffer(true);
+            }
+
+            goto Done;
+        }
+
         perf_file_header fileHeader = {};
         fileHeader.magic = perf_file_header::Magic2;
         fileHeader.size = sizeof(perf_file_header);
@@ -239,6 +511,12 @@ PerfDataFileWriter::FinalizeAndClose() noexcept
 
         // Finalize the file header.
 
+        error = FlushWriteBuffer(true);
+        if (error != 0)
+        {
+            goto Done;
+        }
+
         assert(ValidFilePos());
 
         auto const seekResult = LSEEK64(m_file, 0, SEEK_SET);
@@ -264,36 +542,128 @@ Done:
 
 _Success_(return == 0) int
 PerfDataFileWriter::Create(_In_z_ char const* filePath, int mode) noexcept
+{
+    return CreateImpl(filePath, -1, mode, false);
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::CreatePipe(_In_z_ char const* filePath, int mode) noexcept
+{
+    return CreateImpl(filePath, -1, mode, true);
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::CreatePipeFromFile(int file) noexcept
+{
+    return CreateImpl(nullptr, file, 0, true);
+}
+
+#ifndef _WIN32
+
+_Success_(return == 0) int
+PerfDataFileWriter::CreatePipeSocket(_In_z_ char const* address) noexcept
 {
     int error;
+    int sock = -1;
 
     CloseNoFinalize();
-    m_eventDescs.clear();
-    m_tracepointInfoByCommonType.clear();
-    for (auto& header : m_headers)
-    {
-        header.clear();
-    }
 
-    error = open_s(&m_file, filePath, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, mode);
-    if (m_file < 0)
+    if (0 == strncmp(address, "unix:", 5))
     {
-        error = errno;
+        sockaddr_un addr = {};
+        auto const path = address + 5;
+        auto const pathLen = strlen(path);
+        if (pathLen == 0 || pathLen >= sizeof(addr.sun_path))
+        {
+            return EINVAL;
+        }
+
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path, pathLen);
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+        {
+            return errno;
+        }
+
+        error = 0 == connect(sock, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr))
+            ? 0
+            : errno;
     }
     else
     {
-        m_filePos = 0;
-        static constexpr perf_file_header zeroHeader = {};
-        error = WriteData(&zeroHeader, sizeof(zeroHeader));
-        if (error != 0)
+        // "host:port" or "[host]:port".
+        auto const colon = strrchr(address, ':');
+        if (colon == nullptr || colon == address || colon[1] == '\0')
         {
-            CloseNoFinalize();
+            return EINVAL;
+        }
+
+        char host[256];
+        auto hostBegin = address;
+        auto hostLen = static_cast<size_t>(colon - address);
+        if (hostBegin[0] == '[' && hostLen >= 2 && hostBegin[hostLen - 1] == ']')
+        {
+            hostBegin += 1;
+            hostLen -= 2;
+        }
+
+        if (hostLen == 0 || hostLen >= sizeof(host))
+        {
+            return EINVAL;
         }
+
+        memcpy(host, hostBegin, hostLen);
+        host[hostLen] = '\0';
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addrs = nullptr;
+        if (0 != getaddrinfo(host, colon + 1, &hints, &addrs))
+        {
+            return EADDRNOTAVAIL;
+        }
+
+        error = EADDRNOTAVAIL;
+        for (auto ai = addrs; ai != nullptr; ai = ai->ai_next)
+        {
+            sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (sock < 0)
+            {
+                error = errno;
+                continue;
+            }
+
+            if (0 == connect(sock, ai->ai_addr, ai->ai_addrlen))
+            {
+                error = 0;
+                break;
+            }
+
+            error = errno;
+            close(sock);
+            sock = -1;
+        }
+
+        freeaddrinfo(addrs);
+    }
+
+    if (error == 0)
+    {
+        error = CreateImpl(nullptr, sock, 0, true);
+    }
+
+    if (sock >= 0)
+    {
+        close(sock); // CreateImpl uses a duplicate.
     }
 
     return error;
 }
 
+#endif // !_WIN32
+
 uint64_t
 PerfDataFileWriter::FilePos() const noexcept
 {
@@ -301,12 +671,167 @@ PerfDataFileWriter::FilePos() const noexcept
     return m_filePos;
 }
 
+uint64_t
+PerfDataFileWriter::EventDataBytes() const noexcept
+{
+    return m_eventDataBytes;
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::EnableCompression(int level) noexcept
+{
+#ifdef TRACEPOINT_DECODE_ZSTD
+    int error;
+
+    if (m_file < 0)
+    {
+        error = EBADF;
+    }
+    else if (m_zstd != nullptr)
+    {
+        error = EALREADY;
+    }
+    else try
+    {
+        m_compressInput.reserve(CompressionChunkSize);
+        m_compressOutput.resize(0xFFFF & ~7u);
+
+        m_zstd = ZSTD_createCCtx();
+        if (m_zstd == nullptr)
+        {
+            error = ENOMEM;
+        }
+        else if (ZSTD_isError(ZSTD_CCtx_setParameter(m_zstd, ZSTD_c_compressionLevel, level)))
+        {
+            ZSTD_freeCCtx(m_zstd);
+            m_zstd = nullptr;
+            error = EINVAL;
+        }
+        else
+        {
+            m_compressionLevel = level;
+            error = 0;
+        }
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+    }
+
+    return error;
+#else // TRACEPOINT_DECODE_ZSTD
+    (void)level;
+    return m_file < 0 ? EBADF : ENOTSUP;
+#endif // TRACEPOINT_DECODE_ZSTD
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::EnableWriteBuffer(
+    uint32_t blockSize,
+    PerfDataFileWriteCache cache,
+    uint32_t asyncBlockCount) noexcept
+{
+    int error;
+
+    auto const alignment = m_writeAlignment;
+    if (m_file < 0)
+    {
+        error = EBADF;
+    }
+    else if (m_writeBlockSize != 0)
+    {
+        error = EALREADY;
+    }
+    else if (blockSize == 0 || blockSize > 0x80000000)
+    {
+        error = EINVAL;
+    }
+    else
+    {
+#ifdef _WIN32
+        if (cache != PerfDataFileWriteCache::Normal)
+        {
+            return ENOTSUP;
+        }
+#else // _WIN32
+        if (cache == PerfDataFileWriteCache::Direct)
+        {
+            // O_DIRECT on a pipe enables packet mode, so only use it for files.
+            struct stat st;
+            if (0 != fstat(m_file, &st) || !S_ISREG(st.st_mode))
+            {
+                return EINVAL;
+            }
+
+            // Fail now (e.g. EINVAL on tmpfs) rather than on the first block.
+            error = SetWriteDirect(true);
+            if (error != 0)
+            {
+                return error;
+            }
+
+            SetWriteDirect(false);
+        }
+#endif // _WIN32
+
+        blockSize = (blockSize + alignment - 1) & ~(alignment - 1);
+        m_writeBufferStorage.reset(new(std::nothrow) char[blockSize + alignment]);
+        if (!m_writeBufferStorage)
+        {
+            error = ENOMEM;
+        }
+        else
+        {
+            auto const storage = reinterpret_cast<uintptr_t>(m_writeBufferStorage.get());
+            m_writeBuffer = reinterpret_cast<char*>((storage + alignment - 1) & ~uintptr_t(alignment - 1));
+            m_writeBlockSize = blockSize;
+            m_writeBufferUsed = 0;
+            m_writeCache = cache;
+            m_dropBehindPos = m_filePos - m_filePos % alignment;
+            error = 0;
+
+            if (asyncBlockCount != 0)
+            {
+                try
+                {
+                    m_async = std::make_unique<AsyncWriter>(*this, asyncBlockCount);
+                }
+                catch (std::system_error const& ex)
+                {
+                    error = ex.code().value() ? ex.code().value() : EAGAIN;
+                }
+                catch (...)
+                {
+                    error = ENOMEM;
+                }
+
+                if (error != 0)
+                {
+                    m_writeBufferStorage.reset();
+                    m_writeBuffer = nullptr;
+                    m_writeBlockSize = 0;
+                    m_writeCache = PerfDataFileWriteCache::Normal;
+                }
+            }
+        }
+    }
+
+    return error;
+}
+
 _Success_(return == 0) int
 PerfDataFileWriter::WriteEventData(
     _In_reads_bytes_(dataSize) void const* data,
     size_t dataSize) noexcept
 {
-    int error = WriteData(data, dataSize);
+    int error = m_zstd != nullptr
+        ? CompressEventData(data, dataSize)
+        : WriteData(data, dataSize);
+    if (error == 0)
+    {
+        m_eventDataBytes += dataSize;
+    }
+
     return error;
 }
 
@@ -317,15 +842,135 @@ PerfDataFileWriter::WriteEventDataIovecs(
     _In_reads_(iovecsCount) struct iovec const* iovecs,
     int iovecsCount) noexcept
 {
+    if (m_zstd != nullptr || m_writeBlockSize != 0)
+    {
+        size_t total = 0;
+        for (int i = 0; i < iovecsCount; i += 1)
+        {
+            int const error = m_zstd != nullptr
+                ? CompressEventData(iovecs[i].iov_base, iovecs[i].iov_len)
+                : WriteData(iovecs[i].iov_base, iovecs[i].iov_len);
+            if (error != 0)
+            {
+                errno = error;
+                return -1;
+            }
+
+            total += iovecs[i].iov_len;
+        }
+
+        m_eventDataBytes += total;
+        return static_cast<ptrdiff_t>(total);
+    }
+
     auto const writeResult = writev(m_file, iovecs, iovecsCount);
     if (writeResult >= 0)
     {
         m_filePos += writeResult;
+        m_eventDataBytes += writeResult;
     }
 
     return writeResult;
 }
 
+_Success_(return == 0) int
+PerfDataFileWriter::WriteEventDataFromFile(
+    int srcFile,
+    uint64_t srcFilePos,
+    uint64_t dataSize) noexcept
+{
+    int error = 0;
+    uint64_t done = 0;
+
+    if (m_file < 0)
+    {
+        return EBADF;
+    }
+
+    if (m_zstd == nullptr && m_writeBlockSize == 0)
+    {
+        // Copy in the kernel. m_file's file position is used and advanced.
+        while (done < dataSize)
+        {
+            off64_t srcOffset = static_cast<off64_t>(srcFilePos + done);
+            auto const copySize = static_cast<size_t>(std::min<uint64_t>(dataSize - done, 0x40000000));
+            auto const copyResult = copy_file_range(srcFile, &srcOffset, m_file, nullptr, copySize, 0);
+            if (copyResult > 0)
+            {
+                m_filePos += copyResult;
+                done += copyResult;
+            }
+            else if (copyResult == 0)
+            {
+                error = EINVAL; // srcFile is too short.
+                goto Done;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+            {
+                // Not supported for these files (e.g. output is a pipe, or the
+                // files are on different filesystems). Copy the rest below.
+                break;
+            }
+            else
+            {
+                error = errno;
+                goto Done;
+            }
+        }
+    }
+
+    if (done < dataSize)
+    {
+        static constexpr size_t BounceSize = 0x40000;
+        std::unique_ptr<char[]> bounce(new(std::nothrow) char[BounceSize]);
+        if (!bounce)
+        {
+            error = ENOMEM;
+            goto Done;
+        }
+
+        while (done < dataSize)
+        {
+            auto const readSize = static_cast<size_t>(std::min<uint64_t>(dataSize - done, BounceSize));
+            auto const readResult = pread64(srcFile, bounce.get(), readSize, static_cast<off64_t>(srcFilePos + done));
+            if (readResult < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                error = errno;
+                goto Done;
+            }
+            else if (readResult == 0)
+            {
+                error = EINVAL; // srcFile is too short.
+                goto Done;
+            }
+
+            error = m_zstd != nullptr
+                ? CompressEventData(bounce.get(), static_cast<size_t>(readResult))
+                : WriteData(bounce.get(), static_cast<size_t>(readResult));
+            if (error != 0)
+            {
+                goto Done;
+            }
+
+            done += static_cast<uint64_t>(readResult);
+        }
+    }
+
+Done:
+
+    m_eventDataBytes += done;
+    return error;
+}
+
 #endif // !_WIN32
 
 _Success_(return == 0) int
@@ -333,6 +978,25 @@ PerfDataFileWriter::WriteFinishedInit() noexcept
 {
     static perf_event_header const finishedInit = {
         PERF_RECORD_FINISHED_INIT, 0, sizeof(perf_event_header) };
+
+    if (m_pipeMode && !m_pipeInitWritten)
+    {
+        int error;
+        try
+        {
+            error = WritePipeMetadata();
+        }
+        catch (...)
+        {
+            error = ENOMEM;
+        }
+
+        if (error != 0)
+        {
+            return error;
+        }
+    }
+
     return WriteEventData(&finishedInit, sizeof(finishedInit));
 }
 
@@ -341,7 +1005,22 @@ PerfDataFileWriter::WriteFinishedRound() noexcept
 {
     static perf_event_header const finishedRound = {
         PERF_RECORD_FINISHED_ROUND, 0, sizeof(perf_event_header) };
-    return WriteEventData(&finishedRound, sizeof(finishedRound));
+
+    // FinishedRound goes after the compressed data for the round (uncompressed,
+    // as done by perf record).
+    int error = m_zstd != nullptr
+        ? FlushCompression(false)
+        : 0;
+    if (error == 0)
+    {
+        error = WriteData(&finishedRound, sizeof(finishedRound));
+        if (error == 0)
+        {
+            m_eventDataBytes += sizeof(finishedRound);
+        }
+    }
+
+    return error;
 }
 
 size_t
@@ -656,104 +1335,358 @@ PerfDataFileWriter::AddEventDesc(PerfEventDesc const& desc) noexcept
         }
         else
         {
-            m_eventDescs.emplace_back(desc, static_cast<uint32_t>(nameLen));
-            error = 0;
+            m_eventDescs.emplace_back(desc, static_cast<uint32_t>(nameLen));
+            error = m_pipeInitWritten
+                ? WritePipeAttr(m_eventDescs.back())
+                : 0;
+        }
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+    }
+
+    return error;
+}
+
+bool
+PerfDataFileWriter::HasTracepointEventDesc(uint32_t common_type) const noexcept
+{
+    return 0 != m_tracepointInfoByCommonType.count(common_type);
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::AddTracepointEventDesc(PerfEventDesc const& desc) noexcept
+{
+    int error;
+
+    assert(desc.attr != nullptr); // Precondition
+    assert(desc.name != nullptr); // Precondition
+    assert(desc.metadata != nullptr); // Precondition
+    try
+    {
+        auto [it, inserted] = m_tracepointInfoByCommonType.try_emplace(
+            desc.metadata->Id(),
+            *desc.metadata,
+            m_eventDescs.size());
+        if (!inserted)
+        {
+            error = EEXIST;
+        }
+        else
+        {
+            // Added new metadata so add new EventDesc too.
+            error = AddEventDesc(desc);
+            if (error != 0)
+            {
+                m_tracepointInfoByCommonType.erase(it);
+            }
+        }
+    }
+    catch (...)
+    {
+        error = ENOMEM;
+    }
+
+    return error;
+}
+
+bool
+PerfDataFileWriter::ValidFilePos() const noexcept
+{
+    if (m_file < 0)
+    {
+        // File is closed, m_filePos should be -1.
+        return m_filePos == InvalidFilePos;
+    }
+    else if (m_async)
+    {
+        // The writer thread is moving the file position.
+        return true;
+    }
+    else if (m_pipeMode)
+    {
+        // Output might not have a file position (pipe, socket, /dev/null).
+        return true;
+    }
+
+    auto const seekResult = LSEEK64(m_file, 0, SEEK_CUR);
+    if (seekResult < 0)
+    {
+        // File is in error condition, m_filePos is unknown.
+        return true;
+    }
+
+    return m_filePos == static_cast<uint64_t>(seekResult) + m_writeBufferUsed;
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::WriteData(
+    _In_reads_bytes_(dataSize) void const* data,
+    size_t dataSize) noexcept
+{
+    int error = 0;
+
+    if (m_writeBlockSize == 0)
+    {
+        return WriteFile(data, dataSize);
+    }
+
+    for (size_t i = 0; i < dataSize;)
+    {
+        // The buffer ends at the next multiple of m_writeBlockSize in the file.
+        auto const bufferFilePos = m_filePos - m_writeBufferUsed;
+        auto const bufferEnd = m_writeBlockSize - bufferFilePos % m_writeBlockSize;
+        auto const copySize = std::min<size_t>(dataSize - i, bufferEnd - m_writeBufferUsed);
+        memcpy(m_writeBuffer + m_writeBufferUsed, static_cast<char const*>(data) + i, copySize);
+        m_writeBufferUsed += static_cast<uint32_t>(copySize);
+        m_filePos += copySize;
+        i += copySize;
+
+        if (m_writeBufferUsed == bufferEnd)
+        {
+            error = FlushWriteBuffer(false);
+            if (error != 0)
+            {
+                break;
+            }
+        }
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::FlushWriteBuffer(bool disable) noexcept
+{
+    int error = 0;
+
+    if (m_writeBufferUsed != 0)
+    {
+        auto const size = m_writeBufferUsed;
+        auto const bufferFilePos = m_filePos - size;
+        m_writeBufferUsed = 0;
+
+        if (m_async)
+        {
+            // Hands m_writeBuffer to the writer thread and replaces it with a
+            // free block (waits if all blocks are pending).
+            error = m_async->Submit(size, bufferFilePos);
+        }
+        else
+        {
+            size_t written;
+            error = WriteBlock(m_writeBuffer, size, bufferFilePos, &written);
+            m_filePos = bufferFilePos + written;
         }
     }
-    catch (...)
+
+    if (disable)
     {
-        error = ENOMEM;
+        if (m_async)
+        {
+            auto const asyncError = m_async->Stop();
+            if (error == 0)
+            {
+                error = asyncError;
+            }
+
+            m_async.reset();
+        }
+
+        if (m_writeDirectActive)
+        {
+            SetWriteDirect(false);
+        }
+
+        m_writeBufferStorage.reset();
+        m_writeBuffer = nullptr;
+        m_writeBlockSize = 0;
+        m_writeCache = PerfDataFileWriteCache::Normal;
     }
 
     return error;
 }
 
-bool
-PerfDataFileWriter::HasTracepointEventDesc(uint32_t common_type) const noexcept
-{
-    return 0 != m_tracepointInfoByCommonType.count(common_type);
-}
-
 _Success_(return == 0) int
-PerfDataFileWriter::AddTracepointEventDesc(PerfEventDesc const& desc) noexcept
+PerfDataFileWriter::WriteBlock(
+    _In_reads_bytes_(size) char const* data,
+    uint32_t size,
+    uint64_t filePos,
+    _Out_ size_t* pWritten) noexcept
 {
-    int error;
+    int error = 0;
+    *pWritten = 0;
 
-    assert(desc.attr != nullptr); // Precondition
-    assert(desc.name != nullptr); // Precondition
-    assert(desc.metadata != nullptr); // Precondition
-    try
+    // O_DIRECT requires the file offset and size to be aligned.
+    if (m_writeCache == PerfDataFileWriteCache::Direct)
     {
-        auto [it, inserted] = m_tracepointInfoByCommonType.try_emplace(
-            desc.metadata->Id(),
-            *desc.metadata,
-            m_eventDescs.size());
-        if (!inserted)
+        auto const alignMask = m_writeAlignment - 1u;
+        auto const aligned = 0 == (filePos & alignMask) && 0 == (size & alignMask);
+        error = SetWriteDirect(aligned);
+        if (error != 0 && aligned)
         {
-            error = EEXIST;
+            error = 0; // Could not enable O_DIRECT. Write through the cache.
         }
-        else
+    }
+
+    if (error == 0)
+    {
+        error = WriteAll(m_file, data, size, pWritten);
+    }
+
+#ifndef _WIN32
+    if (error == 0 && m_writeCache == PerfDataFileWriteCache::DropBehind)
+    {
+        static constexpr unsigned DropBehindBlocks = 4;
+        auto const endPos = filePos + size;
+
+        // Advisory: errors are ignored (the data has already been written).
+        // Start writeback of this block now instead of in a later burst.
+        sync_file_range(m_file, filePos, size, SYNC_FILE_RANGE_WRITE);
+
+        // Wait for older blocks to reach the disk, then drop them from the cache.
+        auto const window = uint64_t(DropBehindBlocks) * m_writeBlockSize;
+        if (endPos > m_dropBehindPos + window)
         {
-            // Added new metadata so add new EventDesc too.
-            error = AddEventDesc(desc);
-            if (error != 0)
+            auto const dropEnd = (endPos - window) & ~uint64_t(m_writeAlignment - 1u);
+            if (dropEnd > m_dropBehindPos)
             {
-                m_tracepointInfoByCommonType.erase(it);
+                auto const dropSize = dropEnd - m_dropBehindPos;
+                sync_file_range(m_file, m_dropBehindPos, dropSize,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(m_file, m_dropBehindPos, dropSize, POSIX_FADV_DONTNEED);
+                m_dropBehindPos = dropEnd;
             }
         }
     }
-    catch (...)
-    {
-        error = ENOMEM;
-    }
+#endif // !_WIN32
 
     return error;
 }
 
-bool
-PerfDataFileWriter::ValidFilePos() const noexcept
+_Success_(return == 0) int
+PerfDataFileWriter::SetWriteDirect(bool enable) noexcept
 {
-    if (m_file < 0)
+#ifdef _WIN32
+    return enable ? ENOTSUP : 0;
+#else // _WIN32
+    if (m_writeDirectActive == enable)
     {
-        // File is closed, m_filePos should be -1.
-        return m_filePos == InvalidFilePos;
+        return 0;
     }
 
-    auto const seekResult = LSEEK64(m_file, 0, SEEK_CUR);
-    if (seekResult < 0)
+    auto const flags = fcntl(m_file, F_GETFL);
+    if (flags < 0 ||
+        0 != fcntl(m_file, F_SETFL, enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT)))
     {
-        // File is in error condition, m_filePos is unknown.
-        return true;
+        return errno;
     }
 
-    return m_filePos == static_cast<uint64_t>(seekResult);
+    m_writeDirectActive = enable;
+    return 0;
+#endif // _WIN32
 }
 
 _Success_(return == 0) int
-PerfDataFileWriter::WriteData(
+PerfDataFileWriter::WriteFile(
+    _In_reads_bytes_(dataSize) void const* data,
+    size_t dataSize) noexcept
+{
+    size_t written;
+    int const error = WriteAll(m_file, data, dataSize, &written);
+    m_filePos += written;
+    return error;
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::CompressEventData(
     _In_reads_bytes_(dataSize) void const* data,
     size_t dataSize) noexcept
 {
     int error = 0;
 
+    // m_compressInput has capacity CompressionChunkSize (reserved by
+    // EnableCompression), so insert does not allocate.
     for (size_t i = 0; i < dataSize;)
     {
-        auto const writeSize = WRITE_SIZE(dataSize - i);
-        auto const writeResult = WRITE(
-            m_file,
-            static_cast<char const*>(data) + i,
-            writeSize);
-        if (writeResult < 0)
+        auto const copySize = std::min<size_t>(
+            dataSize - i,
+            CompressionChunkSize - m_compressInput.size());
+        auto const pbData = static_cast<char const*>(data) + i;
+        m_compressInput.insert(m_compressInput.end(), pbData, pbData + copySize);
+        i += copySize;
+
+        if (m_compressInput.size() == CompressionChunkSize)
         {
-            error = errno;
+            error = FlushCompression(false);
+            if (error != 0)
+            {
+                break;
+            }
+        }
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::FlushCompression(bool end) noexcept
+{
+#ifdef TRACEPOINT_DECODE_ZSTD
+    int error = 0;
+
+    assert(m_zstd != nullptr);
+    if (m_compressInput.empty() && !end)
+    {
+        return 0;
+    }
+
+    ZSTD_inBuffer input = { m_compressInput.data(), m_compressInput.size(), 0 };
+    for (;;)
+    {
+        // Each PERF_RECORD_COMPRESSED holds as much output as fits in a header.size.
+        ZSTD_outBuffer output = {
+            m_compressOutput.data() + sizeof(perf_event_header),
+            m_compressOutput.size() - sizeof(perf_event_header),
+            0 };
+        auto const remaining = ZSTD_compressStream2(
+            m_zstd, &output, &input, end ? ZSTD_e_end : ZSTD_e_flush);
+        if (ZSTD_isError(remaining))
+        {
+            error = EINVAL;
             break;
         }
 
-        m_filePos += writeResult;
-        i += writeResult;
+        if (output.pos != 0)
+        {
+            perf_event_header header = {
+                PERF_RECORD_COMPRESSED,
+                0,
+                static_cast<uint16_t>(sizeof(perf_event_header) + output.pos) };
+            memcpy(m_compressOutput.data(), &header, sizeof(header));
+            error = WriteData(m_compressOutput.data(), header.size);
+            if (error != 0)
+            {
+                break;
+            }
+
+            m_compressedBytes += header.size;
+        }
+
+        if (remaining == 0)
+        {
+            assert(input.pos == input.size);
+            break;
+        }
     }
 
+    m_compressInput.clear();
     return error;
+#else // TRACEPOINT_DECODE_ZSTD
+    (void)end;
+    return ENOTSUP; // EnableCompression would have failed.
+#endif // TRACEPOINT_DECODE_ZSTD
 }
 
 void
@@ -1011,3 +1944,243 @@ Done:
 
     return error;
 }
+
+_Success_(return == 0) int
+PerfDataFileWriter::CreateImpl(
+    _In_opt_z_ char const* filePath,
+    int file,
+    int mode,
+    bool pipeMode) noexcept
+{
+    int error;
+
+    CloseNoFinalize();
+    m_eventDescs.clear();
+    m_tracepointInfoByCommonType.clear();
+    for (auto& header : m_headers)
+    {
+        header.clear();
+    }
+
+    if (filePath != nullptr)
+    {
+        error = open_s(&m_file, filePath, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, mode);
+    }
+    else
+    {
+        m_file = DUP(file);
+        error = 0;
+    }
+
+    if (m_file < 0)
+    {
+        error = errno;
+    }
+    else if (pipeMode)
+    {
+        m_filePos = 0;
+        m_pipeMode = true;
+
+        // struct perf_pipe_header { uint64_t magic; uint64_t size; };
+        static constexpr uint64_t pipeHeader[] = { perf_file_header::Magic2, 2 * sizeof(uint64_t) };
+        error = WriteData(&pipeHeader, sizeof(pipeHeader));
+        if (error != 0)
+        {
+            CloseNoFinalize();
+        }
+    }
+    else
+    {
+        m_filePos = 0;
+        static constexpr perf_file_header zeroHeader = {};
+        error = WriteData(&zeroHeader, sizeof(zeroHeader));
+        if (error != 0)
+        {
+            CloseNoFinalize();
+        }
+    }
+
+    return error;
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::WritePipeAttr(EventDesc const& desc) noexcept
+{
+    int error = 0;
+
+    /*
+    struct perf_record_header_attr {
+        perf_event_header header;
+        perf_event_attr attr; // attr.size bytes
+        uint64_t id[];
+    };
+    */
+
+    // header.size is 16 bits, so large id lists are split across records.
+    static constexpr size_t IdsPerRecordMax =
+        (0xFFFF - sizeof(perf_event_header) - sizeof(perf_event_attr)) / sizeof(uint64_t);
+    auto const idsCount = desc.sampleIds.size();
+    size_t idsPos = 0;
+    do
+    {
+        auto const recordIds = std::min(idsCount - idsPos, IdsPerRecordMax);
+        perf_event_header header = {};
+        header.type = PERF_RECORD_HEADER_ATTR;
+        header.size = static_cast<uint16_t>(
+            sizeof(perf_event_header) + sizeof(perf_event_attr) + recordIds * sizeof(uint64_t));
+
+        error = WriteData(&header, sizeof(header));
+        if (error == 0)
+        {
+            error = WriteData(&desc.attr, sizeof(desc.attr)); // attr.size == sizeof(attr).
+        }
+
+        if (error == 0)
+        {
+            error = WriteData(desc.sampleIds.data() + idsPos, recordIds * sizeof(uint64_t));
+        }
+
+        idsPos += recordIds;
+    } while (error == 0 && idsPos != idsCount);
+
+    return error;
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::WritePipeMetadata() noexcept(false)
+{
+    int error = 0;
+
+    assert(m_pipeMode);
+
+    if (!m_pipeInitWritten)
+    {
+        for (auto const& desc : m_eventDescs)
+        {
+            error = WritePipeAttr(desc);
+            if (error != 0)
+            {
+                goto Done;
+            }
+        }
+
+        // Readers parse the first tracing data record, so don't write one
+        // until there is something in it.
+        if (m_headers[PERF_HEADER_TRACING_DATA].empty() &&
+            !m_tracepointInfoByCommonType.empty())
+        {
+            SynthesizeTracingData();
+        }
+
+        auto const& tracingData = m_headers[PERF_HEADER_TRACING_DATA];
+        if (!tracingData.empty())
+        {
+            /*
+            struct perf_record_header_tracing_data {
+                perf_event_header header; // header.size = 12
+                uint32_t size; // Size of the data that follows the record, multiple of 8.
+            };
+            */
+            assert(tracingData.size() < 0x80000000);
+            uint32_t const dataSize = static_cast<uint32_t>(tracingData.size());
+            uint32_t const paddedSize = (dataSize + 7) & ~7u;
+            perf_event_header const header = {
+                PERF_RECORD_HEADER_TRACING_DATA, 0, sizeof(perf_event_header) + sizeof(uint32_t) };
+
+            error = WriteData(&header, sizeof(header));
+            if (error == 0)
+            {
+                error = WriteData(&paddedSize, sizeof(paddedSize));
+            }
+
+            if (error == 0)
+            {
+                error = WriteData(tracingData.data(), dataSize);
+            }
+
+            if (error == 0)
+            {
+                error = WriteData(Zero64, paddedSize - dataSize);
+            }
+
+            if (error != 0)
+            {
+                goto Done;
+            }
+        }
+
+        if (m_headers[PERF_HEADER_EVENT_DESC].empty())
+        {
+            SynthesizeEventDesc();
+        }
+
+        error = WritePipeFeature(PERF_HEADER_EVENT_DESC);
+        if (error != 0)
+        {
+            goto Done;
+        }
+
+        m_pipeInitWritten = true;
+    }
+
+    for (uint32_t i = 0; i != PERF_HEADER_LAST_FEATURE; i += 1)
+    {
+        if (i != PERF_HEADER_TRACING_DATA &&
+            i != PERF_HEADER_EVENT_DESC)
+        {
+            error = WritePipeFeature(i);
+            if (error != 0)
+            {
+                goto Done;
+            }
+        }
+    }
+
+Done:
+
+    return error;
+}
+
+_Success_(return == 0) int
+PerfDataFileWriter::WritePipeFeature(uint32_t index) noexcept
+{
+    int error = 0;
+
+    /*
+    struct perf_record_header_feature {
+        perf_event_header header;
+        uint64_t feat_id;
+        char data[];
+    };
+    */
+
+    auto const& data = m_headers[index];
+    auto const dataSize = data.size();
+    auto const paddedSize = (dataSize + 7) & ~size_t(7);
+    if (dataSize != 0 &&
+        paddedSize <= 0xFFFF - sizeof(perf_event_header) - sizeof(uint64_t))
+    {
+        perf_event_header header = {};
+        header.type = PERF_RECORD_HEADER_FEATURE;
+        header.size = static_cast<uint16_t>(sizeof(perf_event_header) + sizeof(uint64_t) + paddedSize);
+        uint64_t const featId = index;
+
+        error = WriteData(&header, sizeof(header));
+        if (error == 0)
+        {
+            error = WriteData(&featId, sizeof(featId));
+        }
+
+        if (error == 0)
+        {
+            error = WriteData(data.data(), dataSize);
+        }
+
+        if (error == 0)
+        {
+            error = WriteData(Zero64, paddedSize - dataSize);
+        }
+    }
+
+    return error;
+}
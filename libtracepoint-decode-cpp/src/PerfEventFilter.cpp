@@ -0,0 +1,364 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <tracepoint/PerfEventFilter.h>
+#include <tracepoint/PerfDataFileDefs.h>
+#include <tracepoint/PerfEventInfo.h>
+#include <tracepoint/PerfEventMetadata.h>
+#include <tracepoint/PerfEventAbi.h>
+
+#include <algorithm>
+
+using namespace tracepoint_decode;
+
+// '*' matches any run of chars (including empty), '?' matches any one char.
+static bool
+GlobMatches(std::string_view glob, std::string_view str) noexcept
+{
+    size_t gi = 0;
+    size_t si = 0;
+    size_t starGi = std::string_view::npos; // Position after the last '*'.
+    size_t starSi = 0; // Position in str where the last '*' started matching.
+
+    while (si != str.size())
+    {
+        if (gi != glob.size() && glob[gi] == '*')
+        {
+            gi += 1;
+            starGi = gi;
+            starSi = si;
+        }
+        else if (gi != glob.size() && (glob[gi] == '?' || glob[gi] == str[si]))
+        {
+            gi += 1;
+            si += 1;
+        }
+        else if (starGi != std::string_view::npos)
+        {
+            // Backtrack: let the last '*' consume one more char.
+            gi = starGi;
+            starSi += 1;
+            si = starSi;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (gi != glob.size() && glob[gi] == '*')
+    {
+        gi += 1;
+    }
+
+    return gi == glob.size();
+}
+
+static bool
+AnyGlobMatches(std::vector<std::string> const& globs, std::string_view str) noexcept
+{
+    for (auto const& glob : globs)
+    {
+        if (GlobMatches(glob, str))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Parses lowercase hex digits. Returns the position after the last digit.
+static char const*
+ParseLowercaseHex(char const* p, char const* pEnd, uint64_t* value) noexcept
+{
+    uint64_t v = 0;
+    for (; p != pEnd; p += 1)
+    {
+        auto const ch = *p;
+        if (ch >= '0' && ch <= '9')
+        {
+            v = (v << 4) | static_cast<unsigned>(ch - '0');
+        }
+        else if (ch >= 'a' && ch <= 'f')
+        {
+            v = (v << 4) | static_cast<unsigned>(ch - 'a' + 10);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    *value = v;
+    return p;
+}
+
+// Given an event name like "MyProvider_L5K1Gmygroup", gets the provider name,
+// level, and keyword. Returns false if the name does not have the EventHeader
+// "_L<level>K<keyword>" suffix.
+static bool
+ParseEventHeaderName(
+    std::string_view eventName,
+    std::string_view* providerName,
+    uint8_t* level,
+    uint64_t* keyword) noexcept
+{
+    auto const underscore = eventName.rfind('_');
+    if (underscore == std::string_view::npos)
+    {
+        return false;
+    }
+
+    auto p = eventName.data() + underscore + 1;
+    auto const pEnd = eventName.data() + eventName.size();
+    if (p == pEnd || *p != 'L')
+    {
+        return false;
+    }
+
+    uint64_t levelVal;
+    auto const pLevel = p + 1;
+    p = ParseLowercaseHex(pLevel, pEnd, &levelVal);
+    if (p == pLevel || levelVal > 0xFF || p == pEnd || *p != 'K')
+    {
+        return false;
+    }
+
+    auto const pKeyword = p + 1;
+    p = ParseLowercaseHex(pKeyword, pEnd, keyword);
+    if (p == pKeyword)
+    {
+        return false;
+    }
+
+    *providerName = eventName.substr(0, underscore);
+    *level = static_cast<uint8_t>(levelVal);
+    return true;
+}
+
+PerfEventFilter::~PerfEventFilter()
+{
+    return;
+}
+
+PerfEventFilter::PerfEventFilter() noexcept
+    : m_eventNameGlobs()
+    , m_providerNameGlobs()
+    , m_pids()
+    , m_tids()
+    , m_keywordAny(0)
+    , m_keywordAll(0)
+    , m_timeMin(0)
+    , m_timeMax(UINT64_MAX)
+    , m_levelMax(0xFF)
+    , m_descFilterEnabled(false)
+    , m_descResults()
+    , m_lastDesc(nullptr)
+    , m_lastDescResult(false)
+{
+    return;
+}
+
+void
+PerfEventFilter::AddEventNameGlob(std::string_view glob)
+{
+    m_eventNameGlobs.emplace_back(glob);
+    m_descFilterEnabled = true;
+    ClearCache();
+}
+
+void
+PerfEventFilter::AddProviderNameGlob(std::string_view glob)
+{
+    m_providerNameGlobs.emplace_back(glob);
+    m_descFilterEnabled = true;
+    ClearCache();
+}
+
+void
+PerfEventFilter::SetLevelMax(uint8_t levelMax) noexcept
+{
+    m_levelMax = levelMax;
+    m_descFilterEnabled = true;
+    ClearCache();
+}
+
+void
+PerfEventFilter::SetKeywordMask(uint64_t any, uint64_t all) noexcept
+{
+    m_keywordAny = any;
+    m_keywordAll = all;
+    m_descFilterEnabled = true;
+    ClearCache();
+}
+
+void
+PerfEventFilter::AddPid(uint32_t pid)
+{
+    m_pids.insert(std::lower_bound(m_pids.begin(), m_pids.end(), pid), pid);
+}
+
+void
+PerfEventFilter::AddTid(uint32_t tid)
+{
+    m_tids.insert(std::lower_bound(m_tids.begin(), m_tids.end(), tid), tid);
+}
+
+void
+PerfEventFilter::SetTimeRange(uint64_t timeMin, uint64_t timeMax) noexcept
+{
+    m_timeMin = timeMin;
+    m_timeMax = timeMax;
+}
+
+bool
+PerfEventFilter::MatchesAll() const noexcept
+{
+    return !m_descFilterEnabled &&
+        m_pids.empty() &&
+        m_tids.empty() &&
+        m_timeMin == 0 &&
+        m_timeMax == UINT64_MAX;
+}
+
+bool
+PerfEventFilter::Matches(PerfSampleEventInfo const& sampleEventInfo)
+{
+    auto const sampleType = sampleEventInfo.SampleType();
+
+    if (m_timeMin != 0 || m_timeMax != UINT64_MAX)
+    {
+        if (!(sampleType & PERF_SAMPLE_TIME) ||
+            sampleEventInfo.time < m_timeMin ||
+            sampleEventInfo.time > m_timeMax)
+        {
+            return false;
+        }
+    }
+
+    if (!m_pids.empty() || !m_tids.empty())
+    {
+        if (!(sampleType & PERF_SAMPLE_TID))
+        {
+            return false;
+        }
+
+        if (!m_pids.empty() &&
+            !std::binary_search(m_pids.begin(), m_pids.end(), sampleEventInfo.pid))
+        {
+            return false;
+        }
+
+        if (!m_tids.empty() &&
+            !std::binary_search(m_tids.begin(), m_tids.end(), sampleEventInfo.tid))
+        {
+            return false;
+        }
+    }
+
+    if (!m_descFilterEnabled)
+    {
+        return true;
+    }
+
+    auto const desc = sampleEventInfo.event_desc;
+    if (desc != m_lastDesc)
+    {
+        auto const it = m_descResults.find(desc);
+        if (it != m_descResults.end())
+        {
+            m_lastDescResult = it->second;
+        }
+        else
+        {
+            m_lastDescResult = DescMatches(sampleEventInfo);
+            m_descResults.emplace(desc, m_lastDescResult);
+        }
+
+        m_lastDesc = desc;
+    }
+
+    return m_lastDescResult;
+}
+
+void
+PerfEventFilter::ClearCache() noexcept
+{
+    m_descResults.clear();
+    m_lastDesc = nullptr;
+    m_lastDescResult = false;
+}
+
+bool
+PerfEventFilter::DescMatches(PerfSampleEventInfo const& sampleEventInfo) const
+{
+    // Get system name and event name, preferring the metadata.
+    std::string_view systemName;
+    std::string_view eventName;
+    std::string_view const fullName = sampleEventInfo.Name();
+    if (auto const metadata = sampleEventInfo.Metadata(); metadata != nullptr)
+    {
+        systemName = metadata->SystemName();
+        eventName = metadata->Name();
+    }
+    else if (auto const colon = fullName.find(':'); colon != std::string_view::npos)
+    {
+        systemName = fullName.substr(0, colon);
+        eventName = fullName.substr(colon + 1);
+    }
+    else
+    {
+        eventName = fullName;
+    }
+
+    if (!m_eventNameGlobs.empty())
+    {
+        if (!fullName.empty())
+        {
+            if (!AnyGlobMatches(m_eventNameGlobs, fullName))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            // No EVENT_DESC name: match against "system:name" from metadata.
+            std::string name;
+            name.reserve(systemName.size() + 1 + eventName.size());
+            name += systemName;
+            name += ':';
+            name += eventName;
+            if (!AnyGlobMatches(m_eventNameGlobs, name))
+            {
+                return false;
+            }
+        }
+    }
+
+    std::string_view providerName;
+    uint8_t level;
+    uint64_t keyword;
+    bool const isEventHeader = ParseEventHeaderName(eventName, &providerName, &level, &keyword);
+
+    if (!m_providerNameGlobs.empty())
+    {
+        if (!AnyGlobMatches(m_providerNameGlobs, isEventHeader ? providerName : systemName))
+        {
+            return false;
+        }
+    }
+
+    if (m_levelMax != 0xFF || m_keywordAny != 0 || m_keywordAll != 0)
+    {
+        if (!isEventHeader ||
+            level > m_levelMax ||
+            (m_keywordAny != 0 && 0 == (keyword & m_keywordAny)) ||
+            (keyword & m_keywordAll) != m_keywordAll)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -700,7 +700,9 @@ PerfEventMetadata::PerfEventMetadata() noexcept
     , m_formatFileContents()
     , m_name()
     , m_printFmt()
+    , m_ownedFields()
     , m_fields()
+    , m_fieldCount()
     , m_id()
     , m_commonFieldCount()
     , m_commonFieldsSize()
@@ -709,13 +711,93 @@ PerfEventMetadata::PerfEventMetadata() noexcept
     return;
 }
 
+PerfEventMetadata::PerfEventMetadata(PerfEventMetadata const& other) noexcept(false)
+    : m_systemName(other.m_systemName)
+    , m_formatFileContents(other.m_formatFileContents)
+    , m_name(other.m_name)
+    , m_printFmt(other.m_printFmt)
+    , m_ownedFields(other.m_ownedFields) // may throw bad_alloc.
+    , m_fields(other.m_ownedFields.empty() ? other.m_fields : m_ownedFields.data())
+    , m_fieldCount(other.m_fieldCount)
+    , m_id(other.m_id)
+    , m_commonFieldCount(other.m_commonFieldCount)
+    , m_commonFieldsSize(other.m_commonFieldsSize)
+    , m_kind(other.m_kind)
+{
+    return;
+}
+
+PerfEventMetadata::PerfEventMetadata(PerfEventMetadata&& other) noexcept
+    : m_systemName(other.m_systemName)
+    , m_formatFileContents(other.m_formatFileContents)
+    , m_name(other.m_name)
+    , m_printFmt(other.m_printFmt)
+    , m_ownedFields(std::move(other.m_ownedFields)) // Keeps the buffer, so m_fields stays valid.
+    , m_fields(other.m_fields)
+    , m_fieldCount(other.m_fieldCount)
+    , m_id(other.m_id)
+    , m_commonFieldCount(other.m_commonFieldCount)
+    , m_commonFieldsSize(other.m_commonFieldsSize)
+    , m_kind(other.m_kind)
+{
+    other.m_fields = nullptr;
+    other.m_fieldCount = 0;
+}
+
+PerfEventMetadata&
+PerfEventMetadata::operator=(PerfEventMetadata const& other) noexcept(false)
+{
+    if (this != &other)
+    {
+        m_ownedFields = other.m_ownedFields; // may throw bad_alloc.
+        m_systemName = other.m_systemName;
+        m_formatFileContents = other.m_formatFileContents;
+        m_name = other.m_name;
+        m_printFmt = other.m_printFmt;
+        m_fields = other.m_ownedFields.empty() ? other.m_fields : m_ownedFields.data();
+        m_fieldCount = other.m_fieldCount;
+        m_id = other.m_id;
+        m_commonFieldCount = other.m_commonFieldCount;
+        m_commonFieldsSize = other.m_commonFieldsSize;
+        m_kind = other.m_kind;
+    }
+
+    return *this;
+}
+
+PerfEventMetadata&
+PerfEventMetadata::operator=(PerfEventMetadata&& other) noexcept
+{
+    if (this != &other)
+    {
+        m_ownedFields = std::move(other.m_ownedFields); // Keeps the buffer, so m_fields stays valid.
+        m_systemName = other.m_systemName;
+        m_formatFileContents = other.m_formatFileContents;
+        m_name = other.m_name;
+        m_printFmt = other.m_printFmt;
+        m_fields = other.m_fields;
+        m_fieldCount = other.m_fieldCount;
+        m_id = other.m_id;
+        m_commonFieldCount = other.m_commonFieldCount;
+        m_commonFieldsSize = other.m_commonFieldsSize;
+        m_kind = other.m_kind;
+        other.m_fields = nullptr;
+        other.m_fieldCount = 0;
+    }
+
+    return *this;
+}
+
 void
 PerfEventMetadata::Clear() noexcept
 {
     m_systemName = {};
+    m_formatFileContents = {};
     m_name = {};
     m_printFmt = {};
+    m_ownedFields.clear();
     m_fields = {};
+    m_fieldCount = {};
     m_id = {};
     m_commonFieldCount = {};
     m_commonFieldsSize = {};
@@ -819,7 +901,7 @@ PerfEventMetadata::Parse(
         else if (propName == "format"sv)
         {
             bool common = true;
-            m_fields.clear();
+            m_ownedFields.clear();
 
             // Search for lines like: " field:TYPE NAME; offset:N; size:N; signed:N;"
             while (p != pEnd)
@@ -857,11 +939,11 @@ PerfEventMetadata::Parse(
                     }
                 }
 
-                m_fields.push_back(PerfFieldMetadata::Parse(longSize64, std::string_view(pLine, p - pLine)));
-                if (m_fields.back().Field().empty())
+                m_ownedFields.push_back(PerfFieldMetadata::Parse(longSize64, std::string_view(pLine, p - pLine)));
+                if (m_ownedFields.back().Field().empty())
                 {
                     DEBUG_PRINTF("Field parse failure\n");
-                    m_fields.pop_back(); // Unexpected.
+                    m_ownedFields.pop_back(); // Unexpected.
                 }
                 else
                 {
@@ -873,6 +955,9 @@ PerfEventMetadata::Parse(
 
 Done:
 
+    m_fields = m_ownedFields.data();
+    m_fieldCount = static_cast<uint32_t>(m_ownedFields.size());
+
     if (m_commonFieldCount == 0)
     {
         m_commonFieldsSize = 0;
@@ -884,9 +969,184 @@ Done:
     }
 
     m_kind =
-        m_fields.size() > m_commonFieldCount &&
+        m_fieldCount > m_commonFieldCount &&
         m_fields[m_commonFieldCount].Name() == "eventheader_flags"sv
         ? PerfEventKind::EventHeader
         : PerfEventKind::Normal;
     return !m_name.empty() && foundId;
 }
+
+static constexpr size_t TextChunkSize = 64 * 1024; // Bytes.
+static constexpr size_t FieldChunkSize = 1024; // Fields.
+
+// If sv points into [oldBase, oldBase + size), returns the same range within
+// [newBase, newBase + size). Otherwise returns sv.
+static std::string_view
+Rebase(std::string_view sv, char const* oldBase, size_t size, char const* newBase) noexcept
+{
+    auto const svBegin = reinterpret_cast<uintptr_t>(sv.data());
+    auto const oldBegin = reinterpret_cast<uintptr_t>(oldBase);
+    return svBegin >= oldBegin && svBegin - oldBegin <= size && sv.size() <= size - (svBegin - oldBegin)
+        ? std::string_view(newBase + (svBegin - oldBegin), sv.size())
+        : sv;
+}
+
+PerfEventMetadataStore::~PerfEventMetadataStore()
+{
+    return;
+}
+
+PerfEventMetadataStore::PerfEventMetadataStore() noexcept
+    : m_textChunks()
+    , m_fieldChunks()
+    , m_events()
+    , m_systemNames()
+    , m_textNext()
+    , m_textLeft()
+    , m_fieldNext()
+    , m_fieldLeft()
+{
+    return;
+}
+
+size_t
+PerfEventMetadataStore::size() const noexcept
+{
+    return m_events.size();
+}
+
+void
+PerfEventMetadataStore::Clear() noexcept
+{
+    m_events.clear();
+    m_systemNames.clear();
+    m_fieldChunks.clear();
+    m_textChunks.clear();
+    m_textNext = nullptr;
+    m_textLeft = 0;
+    m_fieldNext = nullptr;
+    m_fieldLeft = 0;
+}
+
+PerfEventMetadata const&
+PerfEventMetadataStore::Add(PerfEventMetadata const& metadata, bool copyText) noexcept(false)
+{
+    auto& stored = m_events.emplace_back(); // may throw bad_alloc.
+    try
+    {
+        auto const oldFormat = metadata.m_formatFileContents;
+        if (copyText)
+        {
+            stored.m_systemName = InternSystemName(metadata.m_systemName); // may throw bad_alloc.
+            stored.m_formatFileContents = AddText(oldFormat); // may throw bad_alloc.
+        }
+        else
+        {
+            stored.m_systemName = metadata.m_systemName;
+            stored.m_formatFileContents = oldFormat;
+        }
+
+        auto const newFormat = stored.m_formatFileContents.data();
+        stored.m_name = Rebase(metadata.m_name, oldFormat.data(), oldFormat.size(), newFormat);
+        stored.m_printFmt = Rebase(metadata.m_printFmt, oldFormat.data(), oldFormat.size(), newFormat);
+
+        auto const fields = AllocFields(metadata.m_fieldCount); // may throw bad_alloc.
+        for (uint32_t i = 0; i != metadata.m_fieldCount; i += 1)
+        {
+            auto& field = fields[i];
+            field = metadata.m_fields[i];
+            field.m_name = Rebase(field.m_name, oldFormat.data(), oldFormat.size(), newFormat);
+            field.m_field = Rebase(field.m_field, oldFormat.data(), oldFormat.size(), newFormat);
+        }
+
+        stored.m_fields = fields;
+        stored.m_fieldCount = metadata.m_fieldCount;
+        stored.m_id = metadata.m_id;
+        stored.m_commonFieldCount = metadata.m_commonFieldCount;
+        stored.m_commonFieldsSize = metadata.m_commonFieldsSize;
+        stored.m_kind = metadata.m_kind;
+    }
+    catch (...)
+    {
+        m_events.pop_back();
+        throw;
+    }
+
+    return stored;
+}
+
+std::string_view
+PerfEventMetadataStore::AddText(std::string_view text) noexcept(false)
+{
+    char* p;
+    if (text.size() <= m_textLeft)
+    {
+        p = m_textNext;
+        m_textNext += text.size();
+        m_textLeft -= text.size();
+    }
+    else if (text.size() > TextChunkSize / 4)
+    {
+        // Large text gets its own chunk so the current chunk stays usable.
+        m_textChunks.reserve(m_textChunks.size() + 1); // may throw bad_alloc.
+        m_textChunks.push_back(std::make_unique<char[]>(text.size())); // may throw bad_alloc.
+        p = m_textChunks.back().get();
+    }
+    else
+    {
+        m_textChunks.reserve(m_textChunks.size() + 1); // may throw bad_alloc.
+        m_textChunks.push_back(std::make_unique<char[]>(TextChunkSize)); // may throw bad_alloc.
+        p = m_textChunks.back().get();
+        m_textNext = p + text.size();
+        m_textLeft = TextChunkSize - text.size();
+    }
+
+    if (!text.empty())
+    {
+        memcpy(p, text.data(), text.size());
+    }
+
+    return std::string_view(p, text.size());
+}
+
+std::string_view
+PerfEventMetadataStore::InternSystemName(std::string_view systemName) noexcept(false)
+{
+    auto it = m_systemNames.find(systemName);
+    if (it == m_systemNames.end())
+    {
+        m_systemNames.reserve(m_systemNames.size() + 1); // may throw bad_alloc.
+        it = m_systemNames.insert(AddText(systemName)).first; // may throw bad_alloc.
+    }
+
+    return *it;
+}
+
+PerfFieldMetadata*
+PerfEventMetadataStore::AllocFields(size_t count) noexcept(false)
+{
+    PerfFieldMetadata* p;
+    if (count <= m_fieldLeft)
+    {
+        p = m_fieldNext;
+        m_fieldNext += count;
+        m_fieldLeft -= count;
+    }
+    else if (count > FieldChunkSize / 4)
+    {
+        // Large field list gets its own chunk so the current chunk stays usable.
+        m_fieldChunks.reserve(m_fieldChunks.size() + 1); // may throw bad_alloc.
+        m_fieldChunks.push_back(std::make_unique<PerfFieldMetadata[]>(count)); // may throw bad_alloc.
+        p = m_fieldChunks.back().get();
+    }
+    else
+    {
+        m_fieldChunks.reserve(m_fieldChunks.size() + 1); // may throw bad_alloc.
+        m_fieldChunks.push_back(std::make_unique<PerfFieldMetadata[]>(FieldChunkSize)); // may throw bad_alloc.
+        p = m_fieldChunks.back().get();
+        m_fieldNext = p + count;
+        m_fieldLeft = FieldChunkSize - count;
+    }
+
+    return p;
+}
@@ -122,3 +122,17 @@ PerfEventSessionInfo::TimeToRealTime(uint64_t time) const noexcept
     }
     return { sec, nsec };
 }
+
+void
+PerfEventSessionInfo::TimesToRealTimeNs(
+    _In_reads_(count) uint64_t const* times,
+    _Out_writes_(count) int64_t* realTimeNs,
+    size_t count) const noexcept
+{
+    // Unsigned arithmetic so that out-of-range results wrap instead of overflowing.
+    uint64_t const offsetNs = static_cast<uint64_t>(m_clockOffsetSec) * Billion + m_clockOffsetNsec;
+    for (size_t i = 0; i != count; i += 1)
+    {
+        realTimeNs[i] = static_cast<int64_t>(times[i] + offsetNs);
+    }
+}
@@ -0,0 +1,858 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for PerfDataFile and related classes, using the perf.data files in
+TestOutput. Usage: tracepoint-decode-utest <dataDir> <testName>
+*/
+
+#include <tracepoint/PerfByteReader.h>
+#include <tracepoint/PerfCallchainTable.h>
+#include <tracepoint/PerfDataFile.h>
+#include <tracepoint/PerfDataFileWriter.h>
+#include <tracepoint/PerfEventAbi.h>
+#include <tracepoint/PerfEventFilter.h>
+#include <tracepoint/PerfEventInfo.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace tracepoint_decode;
+
+// Exit code for a test that does not apply to this build (ctest SKIP_RETURN_CODE).
+static int const SkipReturnCode = 77;
+
+// Thrown by a test that does not apply to this build.
+struct SkipTest : std::exception
+{
+};
+
+// Reports a failed check and aborts the test.
+static void
+Verify(bool condition, char const* what)
+{
+    if (!condition)
+    {
+        fprintf(stdout, "\n- Check failed: %s", what);
+        throw std::exception();
+    }
+}
+
+// A copy of an event read from a file, 8-byte aligned.
+struct EventCopy
+{
+    uint64_t filePos;
+    std::vector<uint64_t> data;
+
+    perf_event_header const*
+    Header() const noexcept
+    {
+        return reinterpret_cast<perf_event_header const*>(data.data());
+    }
+};
+
+// The parts of a sample's PerfSampleEventInfo that are compared between runs.
+struct SampleSummary
+{
+    std::string name;
+    uint64_t time;
+    uint32_t tid;
+    uintptr_t rawSize;
+    bool hasMetadata;
+
+    bool
+    operator==(SampleSummary const& other) const noexcept
+    {
+        return name == other.name &&
+            time == other.time &&
+            tid == other.tid &&
+            rawSize == other.rawSize &&
+            hasMetadata == other.hasMetadata;
+    }
+};
+
+static SampleSummary
+Summarize(PerfSampleEventInfo const& info)
+{
+    auto const sampleType = info.SampleType();
+    return {
+        info.Name(),
+        (sampleType & PERF_SAMPLE_TIME) ? info.time : 0u,
+        (sampleType & PERF_SAMPLE_TID) ? info.tid : 0u,
+        (sampleType & PERF_SAMPLE_RAW) ? info.raw_data_size : 0u,
+        info.Metadata() != nullptr };
+}
+
+// Reads all remaining events of file into events.
+static void
+ReadAllEvents(PerfDataFile& file, std::vector<EventCopy>& events)
+{
+    for (;;)
+    {
+        auto const filePos = file.FilePos();
+        perf_event_header const* header;
+        auto const err = file.ReadEvent(&header);
+        Verify(err == 0, "ReadEvent");
+        if (header == nullptr)
+        {
+            break;
+        }
+
+        EventCopy copy = { filePos, std::vector<uint64_t>((header->size + 7u) / 8u) };
+        memcpy(copy.data.data(), header, header->size);
+        events.push_back(std::move(copy));
+    }
+}
+
+// Returns the summary of each sample in events, in order.
+static std::vector<SampleSummary>
+SummarizeSamples(PerfDataFile const& file, std::vector<EventCopy> const& events)
+{
+    std::vector<SampleSummary> summaries;
+    for (auto const& event : events)
+    {
+        if (event.Header()->type == PERF_RECORD_SAMPLE)
+        {
+            PerfSampleEventInfo info;
+            Verify(0 == file.GetSampleEventInfo(event.Header(), &info), "GetSampleEventInfo");
+            summaries.push_back(Summarize(info));
+        }
+    }
+
+    return summaries;
+}
+
+// Returns the size of each header of file.
+static std::vector<size_t>
+HeaderSizes(PerfDataFile const& file)
+{
+    std::vector<size_t> sizes;
+    for (unsigned i = 0; i != PERF_HEADER_LAST_FEATURE; i += 1)
+    {
+        sizes.push_back(file.Header(static_cast<PerfHeaderIndex>(i)).size());
+    }
+
+    return sizes;
+}
+
+// Lazy and eager metadata loading give the same headers and sample infos.
+static void
+TestLazyMetadata(std::string const& dataDir)
+{
+    auto const path = dataDir + "/perf.data";
+
+    PerfDataFile eager;
+    Verify(!eager.LazyMetadata(), "eager by default");
+    Verify(0 == eager.Open(path.c_str()), "Open eager");
+    std::vector<EventCopy> eagerEvents;
+    ReadAllEvents(eager, eagerEvents);
+
+    PerfDataFile lazy;
+    lazy.SetLazyMetadata(true);
+    Verify(lazy.LazyMetadata(), "SetLazyMetadata");
+    Verify(0 == lazy.Open(path.c_str()), "Open lazy");
+    std::vector<EventCopy> lazyEvents;
+    ReadAllEvents(lazy, lazyEvents);
+
+    // Decode the samples before touching the headers so that the formats are
+    // loaded by GetSampleEventInfo, then check that the headers still load.
+    auto const eagerSamples = SummarizeSamples(eager, eagerEvents);
+    Verify(!eagerSamples.empty(), "file has samples");
+    Verify(eagerSamples == SummarizeSamples(lazy, lazyEvents), "lazy samples match");
+    Verify(HeaderSizes(eager) == HeaderSizes(lazy), "lazy headers match");
+    Verify(eager.TracingDataFtraceCount() == lazy.TracingDataFtraceCount(), "lazy tracing data matches");
+    Verify(!eager.Header(PERF_HEADER_TRACING_DATA).empty(), "file has TRACING_DATA");
+
+    // Lazy setting is kept across Close/Open.
+    lazy.Close();
+    Verify(lazy.LazyMetadata(), "LazyMetadata after Close");
+}
+
+// After a plain Open, const methods can be called from several threads.
+static void
+TestConcurrentReads(std::string const& dataDir)
+{
+    for (auto const name : { "/perf.data", "/pipe.data" })
+    {
+        auto const path = dataDir + name;
+        PerfDataFile file;
+        Verify(0 == file.Open(path.c_str()), "Open");
+        std::vector<EventCopy> events;
+        ReadAllEvents(file, events);
+
+        // Threads start with a fresh file (only Open + ReadEvent so far), then
+        // compare with the serial results computed afterwards.
+        unsigned const ThreadCount = 4;
+        std::vector<std::vector<SampleSummary>> threadSamples(ThreadCount);
+        std::vector<std::vector<size_t>> threadHeaders(ThreadCount);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i != ThreadCount; i += 1)
+        {
+            threads.emplace_back([&, i]()
+                {
+                    try
+                    {
+                        // Alternate the order so threads touch different data first.
+                        if (i & 1)
+                        {
+                            threadHeaders[i] = HeaderSizes(file);
+                            threadSamples[i] = SummarizeSamples(file, events);
+                        }
+                        else
+                        {
+                            threadSamples[i] = SummarizeSamples(file, events);
+                            threadHeaders[i] = HeaderSizes(file);
+                        }
+                    }
+                    catch (...)
+                    {
+                        threadSamples[i].clear();
+                    }
+                });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        auto const samples = SummarizeSamples(file, events);
+        auto const headers = HeaderSizes(file);
+        Verify(!samples.empty(), "file has samples");
+        for (unsigned i = 0; i != ThreadCount; i += 1)
+        {
+            Verify(threadSamples[i] == samples, "thread samples match");
+            Verify(threadHeaders[i] == headers, "thread headers match");
+        }
+    }
+}
+
+// Identical stacks share an id, and a saved table loads with the same ids and
+// expands references to the same stacks.
+static void
+TestCallchainTable(std::string const& dataDir)
+{
+    uint64_t const stackA[] = { 3, 0x1000, 0x2000, 0x3000 };
+    uint64_t const stackB[] = { 3, 0x1000, 0x2000, 0x3008 };
+    PerfCallchainTable stacks;
+    for (uint64_t i = 0; i != 100; i += 1)
+    {
+        uint64_t const stackN[] = { 1, i };
+        stacks.Add(stackN);
+    }
+
+    auto const idA = stacks.Add(stackA);
+    auto const idB = stacks.Add(stackB);
+    Verify(idA != idB, "different stacks get different ids");
+    Verify(stacks.Add(stackA) == idA, "same stack gets same id");
+    Verify(stacks.size() == 102, "size");
+    Verify(0 == memcmp(stacks.Get(idB), stackB, sizeof(stackB)), "Get");
+    Verify(stacks.Get(0) == nullptr && stacks.Get(103) == nullptr, "Get invalid id");
+
+    auto const stacksName = dataDir + "/callchain-table.stacks";
+    PerfCallchainTable loaded;
+    Verify(0 == stacks.Save(stacksName.c_str()), "Save");
+    Verify(0 == loaded.Load(stacksName.c_str()), "Load");
+    Verify(loaded.size() == stacks.size(), "loaded size");
+    Verify(loaded.Add(stackB) == idB, "loaded id");
+
+    uint64_t const referenceB[] = { 2, PerfCallchainTable::ReferenceContext, idB };
+    Verify(PerfCallchainTable::ReferenceId(referenceB) == idB, "ReferenceId");
+    Verify(0 == memcmp(loaded.Expand(referenceB), stackB, sizeof(stackB)), "Expand reference");
+    Verify(loaded.Expand(stackA) == stackA, "Expand non-reference");
+}
+
+// A file written with compression reads back with the same events and sample
+// infos. Skipped if the library was built without zstd.
+static void
+TestCompression(std::string const& dataDir)
+{
+    auto const inputPath = dataDir + "/perf.data";
+    auto const outputPath = dataDir + "/compression.data";
+
+    PerfDataFile input;
+    Verify(0 == input.Open(inputPath.c_str()), "Open input");
+    std::vector<EventCopy> inputEvents;
+    ReadAllEvents(input, inputEvents);
+
+    PerfDataFileWriter writer;
+    Verify(0 == writer.Create(outputPath.c_str()), "Create");
+    auto const enableError = writer.EnableCompression();
+    if (enableError == ENOTSUP)
+    {
+        writer.CloseNoFinalize();
+        throw SkipTest();
+    }
+
+    Verify(enableError == 0, "EnableCompression");
+
+    for (uintptr_t i = 0; i != input.EventDescCount(); i += 1)
+    {
+        auto const& desc = input.EventDesc(i);
+        auto error = desc.metadata == nullptr ? EEXIST : writer.AddTracepointEventDesc(desc);
+        if (error == EEXIST)
+        {
+            error = writer.AddEventDesc(desc);
+        }
+
+        Verify(error == 0, "AddEventDesc");
+    }
+
+    Verify(0 == writer.SetHeader(PERF_HEADER_TRACING_DATA,
+        input.Header(PERF_HEADER_TRACING_DATA).data(),
+        input.Header(PERF_HEADER_TRACING_DATA).size()), "SetHeader");
+
+    // Enough events to span several compressed records.
+    uint64_t eventDataBytes = 0;
+    unsigned const CopyCount = 64;
+    for (unsigned copy = 0; copy != CopyCount; copy += 1)
+    {
+        for (auto const& event : inputEvents)
+        {
+            Verify(0 == writer.WriteEventData(event.Header(), event.Header()->size), "WriteEventData");
+            eventDataBytes += event.Header()->size;
+        }
+    }
+
+    Verify(writer.EventDataBytes() == eventDataBytes, "EventDataBytes");
+    Verify(0 == writer.FinalizeAndClose(), "FinalizeAndClose");
+
+    PerfDataFile output;
+    Verify(0 == output.Open(outputPath.c_str()), "Open output");
+    Verify(!output.Header(PERF_HEADER_COMPRESSED).empty(), "PERF_HEADER_COMPRESSED");
+    Verify(output.DataEndFilePos() - output.DataBeginFilePos() < eventDataBytes, "data is compressed");
+
+    std::vector<EventCopy> outputEvents;
+    ReadAllEvents(output, outputEvents);
+    Verify(outputEvents.size() == inputEvents.size() * CopyCount, "event count");
+    for (size_t i = 0; i != outputEvents.size(); i += 1)
+    {
+        Verify(outputEvents[i].data == inputEvents[i % inputEvents.size()].data, "event data");
+    }
+
+    auto const inputSamples = SummarizeSamples(input, inputEvents);
+    auto const outputSamples = SummarizeSamples(output, outputEvents);
+    Verify(!inputSamples.empty(), "file has samples");
+    for (size_t i = 0; i != outputSamples.size(); i += 1)
+    {
+        Verify(outputSamples[i] == inputSamples[i % inputSamples.size()], "sample info");
+    }
+}
+
+// SeekToTime positions the file at the first segment (run of events ending
+// with FINISHED_ROUND) that has a sample with time >= T, for every sample time
+// T in the file, and ReadEvent then continues from that event.
+static void
+TestSeekToTime(std::string const& dataDir)
+{
+    auto const path = dataDir + "/perf.data";
+
+    PerfDataFile file;
+    Verify(0 == file.Open(path.c_str()), "Open");
+    std::vector<EventCopy> events;
+    ReadAllEvents(file, events);
+
+    // Sample time of each event, or UINT64_MAX for non-sample events.
+    std::vector<uint64_t> times;
+    std::vector<uint64_t> probes = { 0 };
+    size_t roundCount = 0;
+    for (auto const& event : events)
+    {
+        uint64_t time = UINT64_MAX;
+        if (event.Header()->type == PERF_RECORD_SAMPLE)
+        {
+            PerfSampleEventInfo info;
+            Verify(0 == file.GetSampleEventInfo(event.Header(), &info), "GetSampleEventInfo");
+            Verify(0 != (info.SampleType() & PERF_SAMPLE_TIME), "sample has time");
+            time = info.time;
+            probes.push_back(time);
+            probes.push_back(time + 1);
+        }
+        else if (event.Header()->type == PERF_RECORD_FINISHED_ROUND)
+        {
+            roundCount += 1;
+        }
+
+        times.push_back(time);
+    }
+
+    Verify(roundCount != 0, "file has rounds");
+
+    for (auto const minTime : probes)
+    {
+        Verify(0 == file.SeekToTime(minTime), "SeekToTime");
+
+        size_t index = 0;
+        while (index != events.size() && events[index].filePos != file.FilePos())
+        {
+            index += 1;
+        }
+
+        Verify(index != events.size() || file.FilePos() == file.DataEndFilePos(), "at an event or at end");
+
+        // Everything before the position is older than minTime.
+        for (size_t i = 0; i != index; i += 1)
+        {
+            Verify(times[i] == UINT64_MAX || times[i] < minTime, "earlier sample < minTime");
+        }
+
+        // The position is the start of a segment...
+        Verify(index == 0 || index == events.size() ||
+            events[index - 1].Header()->type == PERF_RECORD_FINISHED_ROUND, "at segment start");
+
+        // ... and that segment has a sample at or after minTime (if any sample does).
+        bool segmentHasMatch = false;
+        for (size_t i = index; i != events.size(); i += 1)
+        {
+            if (times[i] != UINT64_MAX && times[i] >= minTime)
+            {
+                segmentHasMatch = true;
+                break;
+            }
+            else if (events[i].Header()->type == PERF_RECORD_FINISHED_ROUND)
+            {
+                break;
+            }
+        }
+
+        Verify(segmentHasMatch == (index != events.size()), "segment has a sample >= minTime");
+
+        std::vector<EventCopy> rest;
+        ReadAllEvents(file, rest);
+        Verify(rest.size() == events.size() - index, "remaining event count");
+        for (size_t i = 0; i != rest.size(); i += 1)
+        {
+            Verify(rest[i].filePos == events[index + i].filePos, "remaining event pos");
+            Verify(rest[i].data == events[index + i].data, "remaining event data");
+        }
+    }
+
+    // Pipe-mode files have no index.
+    auto const pipePath = dataDir + "/pipe.data";
+    Verify(0 == file.Open(pipePath.c_str()), "Open pipe");
+    Verify(ENOTSUP == file.SeekToTime(0), "SeekToTime pipe");
+}
+
+// PerfEventFilter selects the expected samples of perf.data. Expected counts
+// are from TestOutput/perf.data.linux.json.
+static void
+TestEventFilter(std::string const& dataDir)
+{
+    auto const path = dataDir + "/perf.data";
+
+    PerfDataFile file;
+    Verify(0 == file.Open(path.c_str()), "Open");
+    std::vector<EventCopy> events;
+    ReadAllEvents(file, events);
+
+    std::vector<PerfSampleEventInfo> samples;
+    for (auto const& event : events)
+    {
+        if (event.Header()->type == PERF_RECORD_SAMPLE)
+        {
+            PerfSampleEventInfo info;
+            Verify(0 == file.GetSampleEventInfo(event.Header(), &info), "GetSampleEventInfo");
+            samples.push_back(info);
+        }
+    }
+
+    Verify(samples.size() == 539, "sample count");
+
+    // Returns the number of samples that match filter. Verifies that the
+    // samples that match are the ones for which expected returns true.
+    auto const count = [&samples](PerfEventFilter& filter, auto&& expected)
+    {
+        size_t matched = 0;
+        for (auto const& info : samples)
+        {
+            auto const matches = filter.Matches(info);
+            Verify(matches == expected(info), "Matches");
+            matched += matches;
+        }
+
+        return matched;
+    };
+
+    auto const startsWith = [](PerfSampleEventInfo const& info, std::string_view prefix)
+    {
+        return std::string_view(info.Name()).substr(0, prefix.size()) == prefix;
+    };
+
+    {
+        PerfEventFilter filter;
+        Verify(filter.MatchesAll(), "MatchesAll");
+        Verify(539 == count(filter, [](auto&) { return true; }), "no filter");
+    }
+
+    {
+        PerfEventFilter filter;
+        filter.AddEventNameGlob("sched:*");
+        Verify(!filter.MatchesAll(), "!MatchesAll");
+        Verify(285 == count(filter, [&](auto& info) { return startsWith(info, "sched:sched_switch"); }), "name glob");
+    }
+
+    {
+        PerfEventFilter filter;
+        filter.AddEventNameGlob("user_events:TestProviderC_L?K0*");
+        Verify(111 == count(filter, [&](auto& info) { return startsWith(info, "user_events:TestProviderC_L5K0"); }), "name glob ?");
+    }
+
+    {
+        PerfEventFilter filter;
+        filter.AddProviderNameGlob("TestProviderC");
+        Verify(113 == count(filter, [&](auto& info) { return startsWith(info, "user_events:TestProviderC_"); }), "provider");
+
+        filter.AddProviderNameGlob("sched");
+        Verify(113 + 285 == count(filter, [&](auto& info) {
+            return startsWith(info, "user_events:TestProviderC_") || startsWith(info, "sched:"); }), "provider or");
+    }
+
+    {
+        PerfEventFilter filter;
+        filter.SetLevelMax(4);
+        Verify(4 == count(filter, [&](auto& info) {
+            return startsWith(info, "user_events:TestProviderC_L1K") ||
+                startsWith(info, "user_events:TestProviderC_L4K") ||
+                startsWith(info, "user_events:TestProviderCpp_L1K") ||
+                startsWith(info, "user_events:TestProviderCpp_L4K"); }), "level");
+
+        filter.AddProviderNameGlob("TestProviderCpp");
+        Verify(2 == count(filter, [&](auto& info) {
+            return startsWith(info, "user_events:TestProviderCpp_L1K") ||
+                startsWith(info, "user_events:TestProviderCpp_L4K"); }), "level and provider");
+    }
+
+    {
+        // Keywords in the file: 0x0, 0x85, 0xf123456789abcdef.
+        PerfEventFilter filter;
+        filter.SetKeywordMask(0x20);
+        Verify(2 == count(filter, [&](auto& info) {
+            return std::string_view(info.Name()).find("_L1Kf123456789abcdef") != std::string_view::npos; }), "keyword any");
+
+        filter.SetKeywordMask(0, 0x85);
+        Verify(4 == count(filter, [&](auto& info) {
+            auto const name = std::string_view(info.Name());
+            return name.find("_L1Kf123456789abcdef") != std::string_view::npos ||
+                name.find("_L4K85") != std::string_view::npos; }), "keyword all");
+
+        filter.SetKeywordMask(0, 0xa1); // 0x85 has 0x81 but not 0x20.
+        Verify(2 == count(filter, [&](auto& info) {
+            return std::string_view(info.Name()).find("_L1Kf123456789abcdef") != std::string_view::npos; }), "keyword all partial");
+    }
+
+    {
+        PerfEventFilter filter;
+        filter.AddPid(2002);
+        Verify(28 == count(filter, [](auto& info) { return info.pid == 2002; }), "pid");
+
+        filter.AddPid(1220);
+        Verify(28 + 3 == count(filter, [](auto& info) { return info.pid == 2002 || info.pid == 1220; }), "pids");
+    }
+
+    {
+        PerfEventFilter filter;
+        filter.AddTid(2002);
+        Verify(25 == count(filter, [](auto& info) { return info.tid == 2002; }), "tid");
+    }
+
+    {
+        auto const timeMin = samples[100].time;
+        auto const timeMax = samples[200].time;
+        Verify(timeMin < timeMax, "time range");
+
+        PerfEventFilter filter;
+        filter.SetTimeRange(timeMin, timeMax);
+        Verify(0 != count(filter, [=](auto& info) { return timeMin <= info.time && info.time <= timeMax; }), "time");
+    }
+
+    {
+        // Cached results are per PerfEventDesc, so they must be cleared when
+        // the file is reopened.
+        PerfEventFilter filter;
+        filter.AddProviderNameGlob("sched");
+        Verify(285 == count(filter, [&](auto& info) { return startsWith(info, "sched:"); }), "before reopen");
+
+        Verify(0 == file.Open(path.c_str()), "Reopen");
+        filter.ClearCache();
+        events.clear();
+        ReadAllEvents(file, events);
+        samples.clear();
+        for (auto const& event : events)
+        {
+            if (event.Header()->type == PERF_RECORD_SAMPLE)
+            {
+                PerfSampleEventInfo info;
+                Verify(0 == file.GetSampleEventInfo(event.Header(), &info), "GetSampleEventInfo");
+                samples.push_back(info);
+            }
+        }
+
+        Verify(285 == count(filter, [&](auto& info) { return startsWith(info, "sched:"); }), "after reopen");
+    }
+}
+
+// The chunks from GetDataChunks cover the data section, and reading them with
+// PerfDataFileChunkReader on several threads returns the same events and
+// sample infos as a serial ReadEvent of the whole file.
+static void
+TestDataChunks(std::string const& dataDir)
+{
+    auto const path = dataDir + "/perf.data";
+
+    PerfDataFile serial;
+    Verify(0 == serial.Open(path.c_str()), "Open");
+    std::vector<EventCopy> events;
+    ReadAllEvents(serial, events);
+    auto const samples = SummarizeSamples(serial, events);
+    Verify(!samples.empty(), "file has samples");
+
+    for (auto const lazy : { false, true })
+    {
+        PerfDataFile file;
+        file.SetLazyMetadata(lazy);
+        Verify(0 == file.OpenMapped(path.c_str()), "OpenMapped");
+        Verify(file.Mapped(), "Mapped");
+        auto const beginFilePos = file.FilePos();
+
+        for (uint64_t const chunkSizeTarget : { 0u, 64u, 4096u, 65536u, 0x100000u })
+        {
+            std::vector<PerfDataFileChunk> chunks;
+            Verify(0 == file.GetDataChunks(chunkSizeTarget, &chunks), "GetDataChunks");
+            Verify(file.FilePos() == beginFilePos, "GetDataChunks does not move FilePos");
+            Verify(!chunks.empty(), "chunks");
+            Verify(chunks.front().beginFilePos == file.DataBeginFilePos(), "first chunk begin");
+            Verify(chunks.back().endFilePos == file.DataEndFilePos(), "last chunk end");
+
+            // Each chunk's events, read by ThreadCount threads taking chunks in turn.
+            unsigned const ThreadCount = 4;
+            std::vector<std::vector<EventCopy>> chunkEvents(chunks.size());
+            std::vector<std::vector<SampleSummary>> chunkSamples(chunks.size());
+            std::atomic<size_t> nextChunk(0);
+            std::atomic<bool> failed(false);
+            std::vector<std::thread> threads;
+            for (unsigned i = 0; i != ThreadCount; i += 1)
+            {
+                threads.emplace_back([&]()
+                    {
+                        PerfDataFileChunkReader reader;
+                        for (size_t chunk; (chunk = nextChunk++) < chunks.size();)
+                        {
+                            reader.Reset(file, chunks[chunk]);
+                            for (;;)
+                            {
+                                auto const filePos = reader.FilePos();
+                                perf_event_header const* header;
+                                if (0 != reader.ReadEvent(&header))
+                                {
+                                    failed = true;
+                                    return;
+                                }
+                                else if (header == nullptr)
+                                {
+                                    break;
+                                }
+
+                                EventCopy copy = { filePos, std::vector<uint64_t>((header->size + 7u) / 8u) };
+                                memcpy(copy.data.data(), header, header->size);
+                                chunkEvents[chunk].push_back(std::move(copy));
+                            }
+
+                            try
+                            {
+                                chunkSamples[chunk] = SummarizeSamples(file, chunkEvents[chunk]);
+                            }
+                            catch (...)
+                            {
+                                failed = true;
+                                return;
+                            }
+                        }
+                    });
+            }
+
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            Verify(!failed, "chunk reader");
+
+            size_t eventIndex = 0;
+            std::vector<SampleSummary> unionSamples;
+            for (size_t chunk = 0; chunk != chunks.size(); chunk += 1)
+            {
+                auto const& c = chunks[chunk];
+                auto const& ce = chunkEvents[chunk];
+                Verify(chunk == 0 || c.beginFilePos == chunks[chunk - 1].endFilePos, "chunks are contiguous");
+                Verify(!ce.empty(), "chunk has events");
+
+                // Chunks end after a FINISHED_ROUND unless they reach 4x the target.
+                auto const chunkSize = c.endFilePos - c.beginFilePos;
+                auto const target = chunkSizeTarget ? chunkSizeTarget : 1u;
+                Verify(chunk == chunks.size() - 1 ||
+                    (ce.back().Header()->type == PERF_RECORD_FINISHED_ROUND && chunkSize >= target) ||
+                    chunkSize >= target * 4, "chunk split");
+
+                for (auto const& event : ce)
+                {
+                    Verify(eventIndex != events.size(), "chunk event count");
+                    Verify(event.filePos == events[eventIndex].filePos, "chunk event pos");
+                    Verify(event.data == events[eventIndex].data, "chunk event data");
+                    eventIndex += 1;
+                }
+
+                unionSamples.insert(unionSamples.end(), chunkSamples[chunk].begin(), chunkSamples[chunk].end());
+            }
+
+            Verify(eventIndex == events.size(), "union of chunks is the whole file");
+            Verify(unionSamples == samples, "chunk samples match");
+        }
+    }
+
+    {
+        PerfDataFile file;
+        std::vector<PerfDataFileChunk> chunks;
+        Verify(0 == file.Open(path.c_str()), "Open");
+        Verify(ENOTSUP == file.GetDataChunks(4096, &chunks), "GetDataChunks not mapped");
+
+        auto const pipePath = dataDir + "/pipe.data";
+        Verify(0 == file.OpenMapped(pipePath.c_str()), "OpenMapped pipe");
+        Verify(ENOTSUP == file.GetDataChunks(4096, &chunks), "GetDataChunks pipe");
+    }
+}
+
+// Reads every value of data with both readers. They must agree.
+template<bool ByteSwap>
+static void
+VerifyByteReaders(PerfByteReader const& dynamic, std::vector<uint8_t> const& data)
+{
+    using StaticReader = PerfByteReaderT<ByteSwap>;
+    Verify(dynamic.ByteSwapNeeded() == StaticReader::ByteSwapNeeded(), "ByteSwapNeeded");
+    for (size_t i = 0; i + 8 <= data.size(); i += 1)
+    {
+        auto const p = data.data() + i;
+        Verify(dynamic.ReadAsU8(p) == StaticReader::ReadAsU8(p), "ReadAsU8");
+        Verify(dynamic.ReadAsU16(p) == StaticReader::ReadAsU16(p), "ReadAsU16");
+        Verify(dynamic.ReadAsU32(p) == StaticReader::ReadAsU32(p), "ReadAsU32");
+        Verify(dynamic.ReadAsU64(p) == StaticReader::ReadAsU64(p), "ReadAsU64");
+        for (uint8_t const size : { 1, 2, 4 })
+        {
+            Verify(dynamic.ReadAsDynU32(p, size) == StaticReader::ReadAsDynU32(p, size), "ReadAsDynU32");
+        }
+
+        for (uint8_t const size : { 1, 2, 4, 8 })
+        {
+            Verify(dynamic.ReadAsDynU64(p, size) == StaticReader::ReadAsDynU64(p, size), "ReadAsDynU64");
+        }
+
+        Verify(dynamic.ReadAs<int16_t>(p) == StaticReader::template ReadAs<int16_t>(p), "ReadAs<int16_t>");
+        Verify(dynamic.ReadAs<int32_t>(p) == StaticReader::template ReadAs<int32_t>(p), "ReadAs<int32_t>");
+        Verify(dynamic.ReadAs<int64_t>(p) == StaticReader::template ReadAs<int64_t>(p), "ReadAs<int64_t>");
+
+        // Compare bits (NaN != NaN).
+        auto const d = dynamic.ReadAs<double>(p);
+        auto const t = StaticReader::template ReadAs<double>(p);
+        Verify(0 == memcmp(&d, &t, sizeof(d)), "ReadAs<double>");
+    }
+}
+
+// PerfByteReaderT<ByteSwap> reads the same values as PerfByteReader for every
+// offset of the bytes of perf.data's events, in both byte orders, and the
+// file's reader (host byte order) matches PerfByteReaderT<false>.
+static void
+TestByteReader(std::string const& dataDir)
+{
+    auto const path = dataDir + "/perf.data";
+
+    PerfDataFile file;
+    Verify(0 == file.Open(path.c_str()), "Open");
+    std::vector<EventCopy> events;
+    ReadAllEvents(file, events);
+
+    std::vector<uint8_t> data;
+    for (auto const& event : events)
+    {
+        auto const bytes = reinterpret_cast<uint8_t const*>(event.data.data());
+        data.insert(data.end(), bytes, bytes + event.Header()->size);
+    }
+
+    Verify(data.size() > 8, "file has data");
+
+    uint16_t const one = 1;
+    bool const hostBigEndian = 0 == *reinterpret_cast<uint8_t const*>(&one);
+
+    Verify(!file.ByteReader().ByteSwapNeeded(), "host-endian file");
+    VerifyByteReaders<false>(file.ByteReader(), data);
+    VerifyByteReaders<false>(PerfByteReader(hostBigEndian), data);
+    VerifyByteReaders<true>(PerfByteReader(!hostBigEndian), data);
+
+    // Spot-check the swap.
+    uint8_t const bytes[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    uint8_t const reversed[] = { 8, 7, 6, 5, 4, 3, 2, 1 };
+    uint64_t host64, swapped64;
+    uint16_t swapped16;
+    memcpy(&host64, bytes, sizeof(host64));
+    memcpy(&swapped64, reversed, sizeof(swapped64));
+    memcpy(&swapped16, reversed + 6, sizeof(swapped16));
+    Verify(PerfByteReaderT<false>::ReadAsU64(bytes) == host64, "U64 no swap");
+    Verify(PerfByteReaderT<true>::ReadAsU64(bytes) == swapped64, "U64 swap");
+    Verify(PerfByteReaderT<true>::ReadAsU16(bytes) == swapped16, "U16 swap");
+}
+
+struct TestEntry
+{
+    char const* name;
+    void (*fn)(std::string const& dataDir);
+};
+
+static TestEntry const Tests[] = {
+    { "lazy-metadata", TestLazyMetadata },
+    { "concurrent-reads", TestConcurrentReads },
+    { "callchain-table", TestCallchainTable },
+    { "compression", TestCompression },
+    { "seek-to-time", TestSeekToTime },
+    { "event-filter", TestEventFilter },
+    { "data-chunks", TestDataChunks },
+    { "byte-reader", TestByteReader },
+};
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stdout, "Usage: %s <dataDir> <testName>\n", argv[0]);
+        return 1;
+    }
+
+    for (auto const& test : Tests)
+    {
+        if (0 == strcmp(test.name, argv[2]))
+        {
+            try
+            {
+                test.fn(argv[1]);
+                return 0;
+            }
+            catch (SkipTest const&)
+            {
+                fprintf(stdout, "SKIPPED: %s: not supported by this build\n", test.name);
+                return SkipReturnCode;
+            }
+            catch (std::exception const& ex)
+            {
+                fprintf(stdout, "\nERROR: %s: %s\n", test.name, ex.what());
+                return 1;
+            }
+        }
+    }
+
+    fprintf(stdout, "Unknown test: %s\n", argv[2]);
+    return 1;
+}
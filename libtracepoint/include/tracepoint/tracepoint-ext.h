@@ -0,0 +1,169 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Optional extensions to the tracepoint interface.
+
+The functions declared here are not part of the tracepoint.h interface, so an
+alternative implementation of tracepoint.h does not need to provide them.
+Code that uses them should include this header and can test for the
+TRACEPOINT_EXT macro. Code that needs to work with any implementation of
+tracepoint.h (e.g. TraceLoggingProvider.h, tracepoint-provider.h) uses these
+functions only if TRACEPOINT_EXT is defined and otherwise falls back to the
+tracepoint.h interface.
+
+These extensions are provided by libtracepoint and libtracepoint-shm.
+*/
+
+#pragma once
+#ifndef _included_tracepoint_ext_h
+#define _included_tracepoint_ext_h 1
+
+#include "tracepoint.h"
+#include <stdint.h>
+
+/*
+Defined if the tracepoint extension functions are available.
+*/
+#define TRACEPOINT_EXT 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+    /*
+    Writes the specified tracepoint from a single contiguous buffer, e.g. a
+    packed struct. Same as tracepoint_write with data_vecs[1] = { data + 4,
+    data_size - 4 }, except:
+
+    - The first 4 bytes of data are reserved for the use of
+      tracepoint_write_packed. The implementation will overwrite them.
+    - The event is written with a single iovec.
+    - If the event has no payload (data_size == 4), it is written as-is, i.e.
+      without the '\0' byte that tracepoint_write adds to empty events as a
+      workaround. Use this only with kernels and tools that accept empty
+      events.
+
+    PRECONDITION:
+    - data_size >= 4.
+    */
+    int
+    tracepoint_write_packed(
+        tracepoint_state const* tp_state,
+        void* data,
+        unsigned data_size);
+
+    /*
+    Starts asynchronous write mode for all tracepoints in this process. Returns
+    0 for success, EALREADY if asynchronous mode is already active, ENOTSUP if
+    the implementation or kernel does not support it, or another errno for
+    failure (e.g. EPERM if io_uring is not allowed).
+
+    While asynchronous mode is active, a tracepoint_write for an enabled
+    tracepoint copies the event into one of queue_depth slots of slot_size
+    bytes and queues it for submission by the kernel (io_uring with a kernel
+    submission thread on Linux), then returns without waiting for the write.
+    tracepoint_write returns 0 if the event was queued, EAGAIN if all slots are
+    busy, or E2BIG if the event (including the 4-byte write index) is larger
+    than slot_size. Events that are not queued, or that fail in the kernel, are
+    counted by tracepoint_async_dropped.
+
+    TRACEPOINT_ENABLED is not affected. Events written asynchronously are
+    recorded with the PID of this process, but the TID and timestamp are those
+    of the kernel submission thread at the time of the write, not those of the
+    thread that called tracepoint_write.
+
+    - queue_depth: number of events that may be in flight, 1..4096. May be
+      rounded up by the kernel.
+    - slot_size: maximum size of a queued event, 4..65536.
+    */
+    int
+    tracepoint_async_start(
+        unsigned queue_depth,
+        unsigned slot_size);
+
+    /*
+    Stops asynchronous write mode: waits for queued events to be written, then
+    releases the asynchronous write resources. Subsequent writes are
+    synchronous. Safe no-op if asynchronous mode is not active.
+    */
+    void
+    tracepoint_async_stop(void);
+
+    /*
+    Returns the number of events that were dropped or failed while
+    asynchronous mode was active (cumulative for the life of the process).
+    */
+    uint64_t
+    tracepoint_async_dropped(void);
+
+    /*
+    Enables (enable != 0) or disables (enable == 0) lazy connect mode for
+    subsequent calls to tracepoint_open_provider_with_tracepoints in this
+    process. Returns 0 for success, ENOTSUP if the implementation does not
+    support lazy connect mode.
+
+    In lazy connect mode, tracepoint_open_provider_with_tracepoints opens the
+    provider, sorts and de-duplicates the tracepoint definition list, and
+    returns without connecting the tracepoints. The tracepoints are then
+    connected in batches by a background thread. Until a tracepoint has been
+    connected, TRACEPOINT_ENABLED(tp_state) returns 0 and its events are not
+    written. Once connected, the tracepoint behaves exactly as if it had been
+    connected by tracepoint_connect (e.g. TRACEPOINT_ENABLED reflects whether
+    a session is collecting it).
+
+    Closing the provider cancels any of its connections that are still
+    pending. tracepoint_connect is not affected by this mode.
+    */
+    int
+    tracepoint_lazy_connect(int enable);
+
+    /*
+    Waits until all tracepoints queued by lazy connect mode have been
+    connected (or cancelled by tracepoint_close_provider). Returns immediately
+    if there is no pending work.
+    */
+    void
+    tracepoint_lazy_connect_wait(void);
+
+    /*
+    Registers an additional enable bit for a tracepoint: while the tracepoint
+    named by tp_name_args is enabled, bit enable_bit of *enable_word is set.
+    Several tracepoints can share one enable_word (each with its own bit) so
+    that "is any of these tracepoints enabled?" is a single relaxed load of
+    enable_word. This does not connect any tracepoint_state.
+
+    Returns 0 for success, EBADF if the provider is closed, EINVAL if
+    enable_bit >= 32, or another errno for failure (e.g. EADDRINUSE if the bit
+    is already registered). Implementations that do not get enable
+    notifications set the bit while it is registered.
+
+    The bit remains registered until tracepoint_unregister_enable_bit, even if
+    the provider is closed. Unregister it before enable_word's memory is
+    released.
+
+    PRECONDITION:
+    - enable_word is 4-byte aligned.
+    */
+    int
+    tracepoint_register_enable_bit(
+        tracepoint_provider_state const* provider_state,
+        char const* tp_name_args,
+        unsigned* enable_word,
+        unsigned enable_bit);
+
+    /*
+    Unregisters an enable bit that was registered by
+    tracepoint_register_enable_bit and clears the bit. Safe no-op if the bit
+    is not registered.
+    */
+    void
+    tracepoint_unregister_enable_bit(
+        unsigned* enable_word,
+        unsigned enable_bit);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif // __cplusplus
+
+#endif // _included_tracepoint_ext_h
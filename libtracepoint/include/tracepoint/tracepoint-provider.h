@@ -54,6 +54,8 @@ The following top-level macros are provided:
 - TPP_UNREGISTER_PROVIDER(ProviderSymbol) - deactivates all tracepoints in group
 - TPP_WRITE(ProviderSymbol, "tracepoint_name", field macros...)
 - TPP_FUNCTION(ProviderSymbol, "tracepoint_name", func_name, field macros...)
+- TPP_FUNCTION_PACKED(ProviderSymbol, "tracepoint_name", func_name, by-value field macros...)
+  (only if <tracepoint/tracepoint-ext.h> was included before this header)
 
 The following field macros are provided:
 
@@ -305,6 +307,49 @@ ignored for production code.
 #define TPP_FUNCTION(ProviderSymbol, TracepointNameString, FunctionName, ...) \
     _tppFunctionImpl(ProviderSymbol, TracepointNameString, FunctionName, __VA_ARGS__)
 
+/*
+Macro TPP_FUNCTION_PACKED(ProviderSymbol, "tracepoint_name", func_name, fields...):
+Same as TPP_FUNCTION, but for tracepoints where every field is a fixed-size
+by-value field (TPP_UINT8 ... TPP_INT64, TPP_UINTPTR, TPP_INTPTR, or
+TPP_CUSTOM_BYVAL). Using a by-ref or rel_loc field is a compile error.
+
+The generated func_name(fields...) function copies the field values into a
+packed struct and writes it with tracepoint_write_packed, i.e. with a single
+iovec. This is the lowest-cost way to write small fixed-layout events such as
+counters.
+
+An invocation of
+
+    TPP_FUNCTION_PACKED(MyProvider, "MyCounter", my_counter,
+        TPP_UINT32("id", id),
+        TPP_UINT64("value", value));
+
+can be thought of as expanding to something like this:
+
+    int my_counter(uint32_t id, uint64_t value)
+    {
+        if (!_tpp_enabled_MyCounter) return EBADF;
+        struct __attribute__((packed)) {
+            int32_t write_index; uint32_t id; uint64_t value;
+        } data = { 0, id, value };
+        return tracepoint_write_packed(&_tpp_state_MyCounter, &data, sizeof(data));
+    }
+
+Note that a tracepoint with no fields is written without the '\0' byte that
+TPP_FUNCTION adds to empty events (see tracepoint_write_packed), so use
+TPP_FUNCTION_PACKED with no fields only if the kernel and tools accept empty
+events.
+
+tracepoint_write_packed is a tracepoint-ext.h extension, so TPP_FUNCTION_PACKED
+is defined only if <tracepoint/tracepoint-ext.h> was included before this
+header (i.e. if TRACEPOINT_EXT is defined). Without the extensions, use
+TPP_FUNCTION.
+*/
+#ifdef TRACEPOINT_EXT
+#define TPP_FUNCTION_PACKED(ProviderSymbol, TracepointNameString, FunctionName, ...) \
+    _tppFunctionPackedImpl(ProviderSymbol, TracepointNameString, FunctionName, __VA_ARGS__)
+#endif // TRACEPOINT_EXT
+
 #define _tpp_NARGS(...) _tpp_NARGS_imp(_tpp_IS_EMPTY(__VA_ARGS__), (__VA_ARGS__))
 
 /*
@@ -774,6 +819,20 @@ _tppApplyArgsN(macro, n, (handler, ...)) --> macro##handler(n, ...)
 #define _tppFuncArg_tppArgRelLoc(FieldDeclString, Ctype, ValueSize, ValuePtr)    uint16_t ValueSize, Ctype const* ValuePtr
 #define _tppFuncArg_tppArgRelLocStr(FieldDeclString, Ctype, ValueSize, ValuePtr) Ctype const* ValuePtr
 
+// TPP_FUNCTION_PACKED struct members. Only by-value fields have a fixed layout.
+#define _tppPackedField(n, args) _tppApplyArgsN(_tppPackedField, n, args)
+#define _tppPackedField_tppArgByVal( N, FieldDeclString, Ctype, Value)               Ctype _tppVal##N;
+#define _tppPackedField_tppArgByRef( N, FieldDeclString, Ctype, ConstSize, ValuePtr) TPP_FUNCTION_PACKED_requires_by_value_fields _tppVal##N;
+#define _tppPackedField_tppArgRelLoc(N, FieldDeclString, Ctype, ValueSize, ValuePtr) TPP_FUNCTION_PACKED_requires_by_value_fields _tppVal##N;
+#define _tppPackedField_tppArgRelLocStr _tppPackedField_tppArgRelLoc
+
+// TPP_FUNCTION_PACKED struct member assignments.
+#define _tppPackedVal(n, args) _tppApplyArgsN(_tppPackedVal, n, args)
+#define _tppPackedVal_tppArgByVal( N, FieldDeclString, Ctype, Value)               _tppData._tppVal##N = (Value);
+#define _tppPackedVal_tppArgByRef( N, FieldDeclString, Ctype, ConstSize, ValuePtr)
+#define _tppPackedVal_tppArgRelLoc(N, FieldDeclString, Ctype, ValueSize, ValuePtr)
+#define _tppPackedVal_tppArgRelLocStr _tppPackedVal_tppArgRelLoc
+
 // Function parameter list cases: func(void) or func(arg0 [, args...])
 #define _tppFunctionArgs(IsEmpty, Args) _tpp_PASTE2(_tppFunctionArgs, IsEmpty) Args
 #define _tppFunctionArgs1(...)          void
@@ -790,13 +849,33 @@ _tppApplyArgsN(macro, n, (handler, ...)) --> macro##handler(n, ...)
         return _tppWriteErr; \
     } \
 
+// Implement TPP_FUNCTION_PACKED:
+#define _tppFunctionPackedImpl(ProviderSymbol, TracepointNameString, FunctionName, ...) \
+    static tracepoint_state _tpp_PASTE2(_tppState_, FunctionName) = TRACEPOINT_STATE_INIT; \
+    int _tpp_PASTE2(FunctionName, _enabled)(void) { \
+        return TRACEPOINT_ENABLED(&_tpp_PASTE2(_tppState_, FunctionName)); \
+    } \
+    int FunctionName(_tppFunctionArgs(_tpp_IS_EMPTY(__VA_ARGS__), (__VA_ARGS__))) { \
+        _tppDefinitionImpl(ProviderSymbol, TracepointNameString, _tpp_PASTE2(_tppState_, FunctionName), __VA_ARGS__) \
+        int _tppWriteErr = 9 /*EBADF*/; \
+        if (TRACEPOINT_ENABLED(&_tpp_PASTE2(_tppState_, FunctionName))) { \
+            struct __attribute__((packed)) { \
+                int32_t _tppWriteIndex; /* used by tracepoint_write_packed */ \
+                _tpp_FOREACH(_tppPackedField, __VA_ARGS__) \
+            } _tppData; \
+            _tpp_FOREACH(_tppPackedVal, __VA_ARGS__) \
+            _tppWriteErr = tracepoint_write_packed(&_tpp_PASTE2(_tppState_, FunctionName), &_tppData, sizeof(_tppData)); \
+        } \
+        return _tppWriteErr; \
+    } \
+
 // Implement TPP_WRITE:
 #define _tppWriteImpl(ProviderSymbol, TracepointNameString, ...) ({ \
     static tracepoint_state _tppState = TRACEPOINT_STATE_INIT; \
     _tppCommonImpl(ProviderSymbol, TracepointNameString, _tppState, __VA_ARGS__) \
     _tppWriteErr; }) \
 
-#define _tppCommonImpl(ProviderSymbol, TracepointNameString, TracepointState, ...) \
+#define _tppDefinitionImpl(ProviderSymbol, TracepointNameString, TracepointState, ...) \
     static tracepoint_definition const _tppEvt = { \
         &TracepointState, \
         "" TracepointNameString _tpp_FOREACH(_tppFieldString, __VA_ARGS__) \
@@ -804,6 +883,9 @@ _tppApplyArgsN(macro, n, (handler, ...)) --> macro##handler(n, ...)
     static tracepoint_definition const* _tppEvtPtr \
         __attribute__((section("_tppEventPtrs_" _tpp_STRINGIZE(ProviderSymbol)), used)) \
         = &_tppEvt; \
+
+#define _tppCommonImpl(ProviderSymbol, TracepointNameString, TracepointState, ...) \
+    _tppDefinitionImpl(ProviderSymbol, TracepointNameString, TracepointState, __VA_ARGS__) \
     int _tppWriteErr = 9 /*EBADF*/; \
     if (TRACEPOINT_ENABLED(&TracepointState)) { \
         struct iovec _tppVecs[1 _tpp_FOREACH(_tppDataDescCount, __VA_ARGS__)]; \
@@ -0,0 +1,158 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Layout of the shared-memory ring used by the tracepoint-shm library (an
+alternative implementation of the tracepoint.h interface) and by collectors
+such as perf-shm-collect.
+
+Usage:
+
+- The collector creates the ring file (usually in /dev/shm or another tmpfs
+  that is shared with the traced containers) and drains it.
+- Programs link against libtracepoint-shm instead of libtracepoint. When a
+  provider is opened, the library maps the ring file named by the
+  TRACEPOINT_SHM_PATH environment variable (default:
+  "/dev/shm/tracepoint-shm"). If the ring does not exist, the open fails and
+  the provider's tracepoints remain disabled (same as when user_events is not
+  available). Once mapped, the ring stays mapped until the process exits, so
+  the collector should re-attach to an existing ring file rather than replace
+  it.
+- Events are enabled while their provider is open. Events that do not fit in
+  the ring (or whose space was reclaimed, see below) are dropped and counted
+  in dropped_count.
+
+Ring file layout (all fields host-endian):
+
+- tracepoint_shm_header at offset 0.
+- Registry: registry_size bytes at registry_offset. Each tracepoint_connect
+  appends (or reuses) a tracepoint_shm_registration holding the
+  "EventName ArgList" string. The registration's offset within the registry is
+  the event_id used in the event records.
+- Data: data_size bytes (a power of 2) at data_offset, used as a ring of
+  tracepoint_shm_record. data_head and data_tail are free-running byte
+  positions; position P is at data_offset + (P & (data_size - 1)).
+- Claims: data_size / 8 uint32 claim words at claims_offset. Claim word i
+  belongs to the 8 bytes of the data ring at offset 8 * i. A claim word holds
+  TRACEPOINT_SHM_CLAIM_FREE(P) if a record starting at position P may claim
+  it, or TRACEPOINT_SHM_CLAIM_BUSY(P) once that record has been claimed. The
+  values are tagged with the lap (P / data_size) so that a claim for an old
+  lap fails. A new (zero-filled) ring is free for lap 0.
+
+Protocol:
+
+- Producers (any thread of any process) reserve space by advancing data_head
+  with compare-exchange, then claim each reserved record by changing its claim
+  word from CLAIM_FREE(P) to CLAIM_BUSY(P) with compare-exchange (acquire),
+  fill in the record, and commit it by storing its size with release
+  semantics. If a claim fails, the consumer has reclaimed the space (see
+  below), so the producer drops the event without writing anything. A record
+  that would straddle the end of the ring is preceded by a padding record
+  (event_id == TRACEPOINT_SHM_PAD_ID) that fills the rest of the ring and is
+  claimed and committed the same way.
+- The single consumer waits for the record at data_tail to be committed
+  (size != 0, loaded with acquire semantics), consumes it, zero-fills it, sets
+  the claim words of its bytes to CLAIM_FREE(P + data_size) (free for the next
+  lap), then advances data_tail with release semantics.
+- A producer that dies (or is stopped) between reserving a record (the
+  data_head compare-exchange) and claiming it leaves a record with size 0
+  that will not be committed. The consumer cannot find the end of that record,
+  so it stalls there. To recover, a consumer may treat the record as abandoned
+  if it stays uncommitted (with data_head != data_tail) for much longer than
+  any producer needs to claim a record. Starting at data_tail, it changes each
+  claim word from CLAIM_FREE(P) to CLAIM_FREE(P + data_size) with
+  compare-exchange, stopping at the first word that a producer has claimed (a
+  record starts there) or at the data_head that it saw when the stall began,
+  then advances data_tail to that point. Unclaimed records have not been
+  written, so the skipped space is still zero-filled. A producer that resumes
+  later fails its claim and drops its event, so it never writes into space
+  that has been reused. The other unclaimed records in the skipped range are
+  lost. A record that was claimed but never committed (the producer died while
+  filling it) cannot be skipped, because the consumer cannot tell whether the
+  producer is still writing. perf-shm-collect recovers after --stall-timeout.
+*/
+
+#pragma once
+#ifndef _included_tracepoint_shm_h
+#define _included_tracepoint_shm_h 1
+
+#include <stdint.h>
+
+/*
+Name of the environment variable that overrides the path of the ring file.
+*/
+#define TRACEPOINT_SHM_PATH_ENV "TRACEPOINT_SHM_PATH"
+
+/*
+Path of the ring file if TRACEPOINT_SHM_PATH is not set.
+*/
+#define TRACEPOINT_SHM_PATH_DEFAULT "/dev/shm/tracepoint-shm"
+
+#define TRACEPOINT_SHM_MAGIC   0x6D687354u // "Tshm" (little-endian)
+#define TRACEPOINT_SHM_VERSION 2u
+
+/*
+Claim word values for a record starting at position pos of a ring with
+data_size bytes. The lap (pos / data_size) is truncated to 31 bits.
+*/
+#define TRACEPOINT_SHM_CLAIM_FREE(pos, data_size) \
+    ((uint32_t)((uint64_t)(pos) / (uint64_t)(data_size)) << 1)
+#define TRACEPOINT_SHM_CLAIM_BUSY(pos, data_size) \
+    (TRACEPOINT_SHM_CLAIM_FREE(pos, data_size) | 1u)
+
+/*
+event_id of a padding record.
+*/
+#define TRACEPOINT_SHM_PAD_ID 0xFFFFFFFFu
+
+/*
+Maximum payload size of an event. Keeps the perf.data sample (which has a
+16-bit size) within limits after the collector adds its fields.
+*/
+#define TRACEPOINT_SHM_DATA_MAX 0xFF00u
+
+/*
+Header at offset 0 of the ring file.
+*/
+typedef struct tracepoint_shm_header {
+    uint32_t magic;             // TRACEPOINT_SHM_MAGIC. Set last (release) by the creator.
+    uint32_t version;           // TRACEPOINT_SHM_VERSION.
+    uint32_t header_size;       // sizeof(tracepoint_shm_header).
+    uint32_t registry_size;     // Size of the registry, multiple of 8.
+    uint64_t registry_offset;   // File offset of the registry, multiple of 64.
+    uint64_t data_offset;       // File offset of the data ring, multiple of 64.
+    uint64_t data_size;         // Size of the data ring, power of 2.
+    uint64_t dropped_count;     // Atomic: events dropped because the ring was full.
+    uint32_t registry_used;     // Atomic: bytes of the registry that have been reserved.
+    uint32_t reserved0;
+    uint64_t claims_offset;     // File offset of the claim words (data_size / 2 bytes), multiple of 64.
+
+    uint64_t data_head __attribute__((aligned(64))); // Atomic: next position to reserve (producers).
+    uint64_t data_tail __attribute__((aligned(64))); // Atomic: next position to consume (consumer).
+} __attribute__((aligned(64))) tracepoint_shm_header;
+
+/*
+Registry entry, 8-byte aligned within the registry. Followed by the
+NUL-terminated "EventName ArgList" string, then padding.
+*/
+typedef struct tracepoint_shm_registration {
+    uint32_t size;      // Atomic: entry size including name_args and padding, multiple of 8.
+    uint32_t ready;     // Atomic: set to 1 (release) after name_args is written.
+} tracepoint_shm_registration;
+
+/*
+Record in the data ring, 8-byte aligned. The payload (data_size bytes,
+the same bytes that would follow the write_index in a user_events write)
+follows the header. Padding records only use the size and event_id fields.
+*/
+typedef struct tracepoint_shm_record {
+    uint32_t size;      // Atomic: record size including padding, multiple of 8. 0 = not committed.
+    uint32_t event_id;  // Offset of the registration, or TRACEPOINT_SHM_PAD_ID.
+    uint32_t pid;       // getpid() of the writer.
+    uint32_t tid;       // gettid() of the writer.
+    uint64_t time;      // CLOCK_MONOTONIC nanoseconds.
+    uint32_t cpu;       // sched_getcpu() of the writer.
+    uint32_t data_size; // Payload size in bytes.
+} tracepoint_shm_record;
+
+#endif // _included_tracepoint_shm_h
@@ -0,0 +1,671 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+An implementation of the tracepoint.h interface.
+This implementation writes to a shared-memory ring (see tracepoint-shm.h) that
+is drained by a collector process, e.g. perf-shm-collect. It can be used where
+user_events is not available, e.g. in a container or on an older kernel.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sched_getcpu
+#endif // _GNU_SOURCE
+
+#include <tracepoint/tracepoint.h>
+#include <tracepoint/tracepoint-ext.h>
+#include <tracepoint/tracepoint-impl.h>
+#include <tracepoint/tracepoint-shm.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef _tp_FUNC_ATTRIBUTES
+#define _tp_FUNC_ATTRIBUTES
+#endif // _tp_FUNC_ATTRIBUTES
+
+// Smallest data ring that the library will use. Ensures that the largest
+// record (plus padding) always fits.
+#define SHM_DATA_SIZE_MIN 0x40000u
+
+/*
+Guards all stores to any tracepoint_provider_state or tracepoint_state.
+Also guards the mapping of the ring (s_ring, s_ring_file).
+*/
+static pthread_mutex_t s_providers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+The ring is mapped on the first successful tracepoint_open_provider and is
+never unmapped (intentionally leaked), so tracepoint_write can use it without
+taking a lock. s_ring may be loaded outside the lock via atomic_load.
+*/
+static tracepoint_shm_header* s_ring;
+static int s_ring_file = -1;
+
+// Cached process and thread ids. Reset in the child after fork.
+static uint32_t s_pid; // Updated via atomic_store.
+static __thread uint32_t t_tid;
+
+static int
+get_failure_errno(void)
+{
+    int err = errno;
+    assert(err > 0);
+    if (err <= 0)
+    {
+        err = ENOENT;
+    }
+
+    return err;
+}
+
+static void
+shm_atfork_child(void)
+{
+    __atomic_store_n(&s_pid, 0, __ATOMIC_RELAXED);
+    t_tid = 0;
+}
+
+// Returns 0 if the mapped ring's header is usable, errno otherwise.
+static int
+shm_ring_validate(tracepoint_shm_header const* ring, uint64_t file_size)
+{
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != TRACEPOINT_SHM_MAGIC)
+    {
+        return EINVAL;
+    }
+    else if (ring->version != TRACEPOINT_SHM_VERSION ||
+        ring->header_size != sizeof(tracepoint_shm_header))
+    {
+        return ENOTSUP;
+    }
+    else if (
+        ring->registry_offset < sizeof(tracepoint_shm_header) ||
+        ring->registry_offset > file_size ||
+        ring->registry_size > 0x7FFFFFFF ||
+        0 != (ring->registry_size & 7) ||
+        ring->registry_size > file_size - ring->registry_offset ||
+        ring->data_size < SHM_DATA_SIZE_MIN ||
+        0 != (ring->data_size & (ring->data_size - 1)) ||
+        0 != (ring->data_offset & 63) ||
+        ring->data_offset > file_size ||
+        ring->data_size > file_size - ring->data_offset ||
+        0 != (ring->claims_offset & 63) ||
+        ring->claims_offset > file_size ||
+        ring->data_size / 2 > file_size - ring->claims_offset)
+    {
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+// Requires: s_providers_mutex is held.
+// On success, returns 0 and sets s_ring and s_ring_file.
+static int
+shm_ring_get(void)
+{
+    int err;
+    int file;
+    struct stat st;
+    void* map;
+    char const* path;
+
+    if (s_ring != NULL)
+    {
+        return 0;
+    }
+
+    path = getenv(TRACEPOINT_SHM_PATH_ENV);
+    if (path == NULL || path[0] == 0)
+    {
+        path = TRACEPOINT_SHM_PATH_DEFAULT;
+    }
+
+    file = open(path, O_RDWR | O_CLOEXEC);
+    if (file < 0)
+    {
+        return get_failure_errno();
+    }
+
+    if (0 != fstat(file, &st))
+    {
+        err = get_failure_errno();
+        goto Error;
+    }
+
+    if (st.st_size < (off_t)sizeof(tracepoint_shm_header))
+    {
+        err = EINVAL;
+        goto Error;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (map == MAP_FAILED)
+    {
+        err = get_failure_errno();
+        goto Error;
+    }
+
+    err = shm_ring_validate((tracepoint_shm_header const*)map, (uint64_t)st.st_size);
+    if (err != 0)
+    {
+        munmap(map, (size_t)st.st_size);
+        goto Error;
+    }
+
+    pthread_atfork(NULL, NULL, shm_atfork_child);
+    s_ring_file = file;
+    __atomic_store_n(&s_ring, (tracepoint_shm_header*)map, __ATOMIC_RELEASE);
+    return 0;
+
+Error:
+
+    close(file);
+    return err;
+}
+
+/*
+Finds or adds the registration for name_args. On success, returns 0 and sets
+*pevent_id to the offset of the registration within the registry.
+*/
+static int
+shm_registry_add(
+    tracepoint_shm_header* ring,
+    char const* name_args,
+    uint32_t* pevent_id)
+{
+    char* const registry = (char*)ring + ring->registry_offset;
+    uint32_t const registry_size = ring->registry_size;
+    size_t const name_args_size = strlen(name_args) + 1; // Includes NUL.
+    uint32_t entry_size;
+    uint32_t pos;
+    uint32_t used;
+    tracepoint_shm_registration* entry;
+
+    if (name_args_size > registry_size - sizeof(tracepoint_shm_registration))
+    {
+        return E2BIG;
+    }
+
+    entry_size = (uint32_t)((sizeof(tracepoint_shm_registration) + name_args_size + 7) & ~(size_t)7);
+
+    // Reuse an existing registration if possible (e.g. provider reopened, or
+    // the same event registered by another process).
+    used = __atomic_load_n(&ring->registry_used, __ATOMIC_ACQUIRE);
+    if (used > registry_size)
+    {
+        used = registry_size;
+    }
+
+    for (pos = 0; registry_size - pos >= sizeof(tracepoint_shm_registration) && pos < used;)
+    {
+        entry = (tracepoint_shm_registration*)(registry + pos);
+        uint32_t const size = __atomic_load_n(&entry->size, __ATOMIC_ACQUIRE);
+        if (size < sizeof(tracepoint_shm_registration) || 0 != (size & 7) || size > registry_size - pos)
+        {
+            break; // Not yet initialized (or corrupt). Stop looking.
+        }
+
+        if (size == entry_size &&
+            __atomic_load_n(&entry->ready, __ATOMIC_ACQUIRE) &&
+            0 == memcmp(entry + 1, name_args, name_args_size))
+        {
+            *pevent_id = pos;
+            return 0;
+        }
+
+        pos += size;
+    }
+
+    // Reserve a new registration.
+    used = __atomic_load_n(&ring->registry_used, __ATOMIC_RELAXED);
+    do
+    {
+        if (used > registry_size || entry_size > registry_size - used)
+        {
+            return ENOSPC;
+        }
+    } while (!__atomic_compare_exchange_n(
+        &ring->registry_used,
+        &used,
+        used + entry_size,
+        0,
+        __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED));
+
+    entry = (tracepoint_shm_registration*)(registry + used);
+    memcpy(entry + 1, name_args, name_args_size);
+    __atomic_store_n(&entry->size, entry_size, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->ready, 1, __ATOMIC_RELEASE);
+    *pevent_id = used;
+    return 0;
+}
+
+/*
+Claims the record at position pos, which the caller has reserved. Returns 0 if
+the consumer reclaimed the space, in which case nothing may be written to it.
+*/
+static int
+shm_record_claim(
+    tracepoint_shm_header* ring,
+    uint64_t pos)
+{
+    uint64_t const data_size = ring->data_size;
+    uint32_t* const claims = (uint32_t*)((char*)ring + ring->claims_offset);
+    uint32_t expected = TRACEPOINT_SHM_CLAIM_FREE(pos, data_size);
+
+    // Acquire: the record must not be filled before the claim succeeds.
+    return __atomic_compare_exchange_n(
+        &claims[(pos & (data_size - 1)) / 8],
+        &expected,
+        TRACEPOINT_SHM_CLAIM_BUSY(pos, data_size),
+        0,
+        __ATOMIC_ACQUIRE,
+        __ATOMIC_RELAXED);
+}
+
+static int
+event_write(
+    tracepoint_state const* tp_state,
+    unsigned data_count,
+    struct iovec* data_vecs)
+{
+    assert((int)data_count >= 1);
+    assert(data_vecs[0].iov_len == 0);
+
+    if (!TRACEPOINT_ENABLED(tp_state))
+    {
+        return EBADF;
+    }
+
+    tracepoint_provider_state const* provider_state = __atomic_load_n(&tp_state->provider_state, __ATOMIC_RELAXED);
+    if (provider_state == NULL)
+    {
+        return EBADF;
+    }
+
+    int const event_id = __atomic_load_n(&tp_state->write_index, __ATOMIC_RELAXED);
+    if (0 > __atomic_load_n(&provider_state->data_file, __ATOMIC_RELAXED) ||
+        event_id < 0)
+    {
+        return 0;
+    }
+
+    tracepoint_shm_header* const ring = __atomic_load_n(&s_ring, __ATOMIC_ACQUIRE);
+    assert(ring != NULL); // Provider is open, so the ring is mapped.
+
+    size_t payload_size = 0;
+    unsigned i;
+    for (i = 1; i < data_count; i += 1)
+    {
+        payload_size += data_vecs[i].iov_len;
+        if (payload_size > TRACEPOINT_SHM_DATA_MAX)
+        {
+            return E2BIG;
+        }
+    }
+
+    uint32_t pid = __atomic_load_n(&s_pid, __ATOMIC_RELAXED);
+    if (pid == 0)
+    {
+        pid = (uint32_t)getpid();
+        __atomic_store_n(&s_pid, pid, __ATOMIC_RELAXED);
+    }
+
+    if (t_tid == 0)
+    {
+        t_tid = (uint32_t)syscall(SYS_gettid);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t const data_size = ring->data_size;
+    uint64_t const mask = data_size - 1;
+    uint32_t const record_size = (uint32_t)((sizeof(tracepoint_shm_record) + payload_size + 7) & ~(size_t)7);
+    uint64_t head = __atomic_load_n(&ring->data_head, __ATOMIC_RELAXED);
+    uint64_t offset;
+    uint64_t pad;
+
+    // Reserve space for the record (plus padding if it would wrap).
+    for (;;)
+    {
+        offset = head & mask;
+        pad = offset + record_size > data_size ? data_size - offset : 0;
+
+        // Acquire: the consumer's zero-fill must be visible before we write.
+        uint64_t const tail = __atomic_load_n(&ring->data_tail, __ATOMIC_ACQUIRE);
+        if (head - tail > data_size)
+        {
+            // Our head is older than the tail we just loaded. Reload.
+            head = __atomic_load_n(&ring->data_head, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (head - tail + pad + record_size > data_size)
+        {
+            __atomic_add_fetch(&ring->dropped_count, 1, __ATOMIC_RELAXED);
+            return EAGAIN;
+        }
+
+        if (__atomic_compare_exchange_n(
+            &ring->data_head,
+            &head,
+            head + pad + record_size,
+            0,
+            __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED))
+        {
+            break;
+        }
+
+        // The cmpxchg set head = ring->data_head. Try again.
+    }
+
+    char* const data = (char*)ring + ring->data_offset;
+    tracepoint_shm_record* record;
+
+    if (pad != 0)
+    {
+        if (!shm_record_claim(ring, head))
+        {
+            goto Reclaimed;
+        }
+
+        record = (tracepoint_shm_record*)(data + offset);
+        record->event_id = TRACEPOINT_SHM_PAD_ID;
+        __atomic_store_n(&record->size, (uint32_t)pad, __ATOMIC_RELEASE);
+        offset = 0;
+    }
+
+    if (!shm_record_claim(ring, head + pad))
+    {
+        goto Reclaimed;
+    }
+
+    record = (tracepoint_shm_record*)(data + offset);
+    record->event_id = (uint32_t)event_id;
+    record->pid = pid;
+    record->tid = t_tid;
+    record->time = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    record->cpu = (uint32_t)sched_getcpu();
+    record->data_size = (uint32_t)payload_size;
+
+    char* payload = (char*)(record + 1);
+    for (i = 1; i < data_count; i += 1)
+    {
+        memcpy(payload, data_vecs[i].iov_base, data_vecs[i].iov_len);
+        payload += data_vecs[i].iov_len;
+    }
+
+    // Commit.
+    __atomic_store_n(&record->size, record_size, __ATOMIC_RELEASE);
+    return 0;
+
+Reclaimed:
+
+    // We were stopped for so long that the consumer gave up on our
+    // reservation and reclaimed the space.
+    __atomic_add_fetch(&ring->dropped_count, 1, __ATOMIC_RELAXED);
+    return EAGAIN;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+    void
+    tracepoint_close_provider(
+        tracepoint_provider_state* provider_state) _tp_FUNC_ATTRIBUTES;
+    void
+    tracepoint_close_provider(
+        tracepoint_provider_state* provider_state)
+    {
+        // Registrations are never removed from the registry, so there is
+        // nothing to unregister.
+        pthread_mutex_lock(&s_providers_mutex);
+        tracepoint_close_provider_impl(provider_state);
+        pthread_mutex_unlock(&s_providers_mutex);
+    }
+
+    int
+    tracepoint_open_provider(
+        tracepoint_provider_state* provider_state) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_open_provider(
+        tracepoint_provider_state* provider_state)
+    {
+        int err;
+
+        pthread_mutex_lock(&s_providers_mutex);
+
+        if (provider_state->data_file != -1)
+        {
+            assert(provider_state->data_file == -1); // PRECONDITION
+            abort(); // PRECONDITION
+        }
+
+        err = shm_ring_get();
+        if (err == 0)
+        {
+            tracepoint_open_provider_impl(provider_state, s_ring_file);
+        }
+
+        pthread_mutex_unlock(&s_providers_mutex);
+
+        return err;
+    }
+
+    int
+    tracepoint_open_provider_with_tracepoints(
+        tracepoint_provider_state* provider_state,
+        tracepoint_definition const** tp_definition_start,
+        tracepoint_definition const** tp_definition_stop) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_open_provider_with_tracepoints(
+        tracepoint_provider_state* provider_state,
+        tracepoint_definition const** tp_definition_start,
+        tracepoint_definition const** tp_definition_stop)
+    {
+        return tracepoint_open_provider_with_tracepoints_impl(
+            provider_state,
+            tp_definition_start,
+            tp_definition_stop);
+    }
+
+    int
+    tracepoint_connect(
+        tracepoint_state* tp_state,
+        tracepoint_provider_state* provider_state,
+        char const* tp_name_args) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_connect(
+        tracepoint_state* tp_state,
+        tracepoint_provider_state* provider_state,
+        char const* tp_name_args)
+    {
+        int err;
+        int write_index = -1;
+
+        pthread_mutex_lock(&s_providers_mutex);
+
+        if (NULL == provider_state ||
+            -1 == provider_state->data_file)
+        {
+            err = 0;
+        }
+        else
+        {
+            uint32_t event_id;
+            assert(s_ring != NULL); // Provider is open, so the ring is mapped.
+            err = shm_registry_add(s_ring, tp_name_args, &event_id);
+            if (err == 0)
+            {
+                write_index = (int)event_id;
+            }
+        }
+
+        tracepoint_connect_impl(tp_state, provider_state, write_index);
+
+        // Events are enabled while connected to an open provider.
+        __atomic_store_n(&tp_state->status_word, write_index >= 0, __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&s_providers_mutex);
+        return err;
+    }
+
+    int
+    tracepoint_write(
+        tracepoint_state const* tp_state,
+        unsigned data_count,
+        struct iovec* data_vecs) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_write(
+        tracepoint_state const* tp_state,
+        unsigned data_count,
+        struct iovec* data_vecs)
+    {
+        return event_write(tp_state, data_count, data_vecs);
+    }
+
+    int
+    tracepoint_write_packed(
+        tracepoint_state const* tp_state,
+        void* data,
+        unsigned data_size) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_write_packed(
+        tracepoint_state const* tp_state,
+        void* data,
+        unsigned data_size)
+    {
+        assert(data_size >= sizeof(int32_t));
+
+        // Records carry their own size, so there is no empty-event workaround.
+        struct iovec data_vecs[2] = {
+            { NULL, 0 },
+            { (char*)data + sizeof(int32_t), data_size - sizeof(int32_t) },
+        };
+        return event_write(tp_state, 2, data_vecs);
+    }
+
+    int
+    tracepoint_async_start(
+        unsigned queue_depth,
+        unsigned slot_size) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_async_start(
+        unsigned queue_depth,
+        unsigned slot_size)
+    {
+        // Writes to the ring do not enter the kernel, so there is nothing to
+        // make asynchronous.
+        (void)queue_depth;
+        (void)slot_size;
+        return ENOTSUP;
+    }
+
+    void
+    tracepoint_async_stop(void) _tp_FUNC_ATTRIBUTES;
+    void
+    tracepoint_async_stop(void)
+    {
+        return;
+    }
+
+    uint64_t
+    tracepoint_async_dropped(void) _tp_FUNC_ATTRIBUTES;
+    uint64_t
+    tracepoint_async_dropped(void)
+    {
+        return 0;
+    }
+
+    int
+    tracepoint_lazy_connect(int enable) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_lazy_connect(int enable)
+    {
+        // Connecting to the ring does not enter the kernel, so there is
+        // nothing to defer.
+        return enable ? ENOTSUP : 0;
+    }
+
+    void
+    tracepoint_lazy_connect_wait(void) _tp_FUNC_ATTRIBUTES;
+    void
+    tracepoint_lazy_connect_wait(void)
+    {
+        return;
+    }
+
+    int
+    tracepoint_register_enable_bit(
+        tracepoint_provider_state const* provider_state,
+        char const* tp_name_args,
+        unsigned* enable_word,
+        unsigned enable_bit) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_register_enable_bit(
+        tracepoint_provider_state const* provider_state,
+        char const* tp_name_args,
+        unsigned* enable_word,
+        unsigned enable_bit)
+    {
+        int err;
+        (void)tp_name_args;
+
+        if (enable_bit >= sizeof(*enable_word) * 8)
+        {
+            return EINVAL;
+        }
+
+        pthread_mutex_lock(&s_providers_mutex);
+
+        if (-1 == provider_state->data_file)
+        {
+            err = EBADF;
+        }
+        else
+        {
+            // Events are enabled while their provider is open.
+            __atomic_or_fetch(enable_word, 1u << enable_bit, __ATOMIC_RELAXED);
+            err = 0;
+        }
+
+        pthread_mutex_unlock(&s_providers_mutex);
+        return err;
+    }
+
+    void
+    tracepoint_unregister_enable_bit(
+        unsigned* enable_word,
+        unsigned enable_bit) _tp_FUNC_ATTRIBUTES;
+    void
+    tracepoint_unregister_enable_bit(
+        unsigned* enable_word,
+        unsigned enable_bit)
+    {
+        if (enable_bit < sizeof(*enable_word) * 8)
+        {
+            __atomic_and_fetch(enable_word, ~(1u << enable_bit), __ATOMIC_RELAXED);
+        }
+    }
+
+#ifdef __cplusplus
+} // extern "C"
+#endif // __cplusplus
@@ -7,6 +7,7 @@ This implementation writes directly to user_events.
 */
 
 #include <tracepoint/tracepoint.h>
+#include <tracepoint/tracepoint-ext.h>
 #include <tracepoint/tracepoint-impl.h>
 
 #include <assert.h>
@@ -19,9 +20,16 @@ This implementation writes directly to user_events.
 
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <linux/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif // __NR_io_uring_setup
 
 #ifndef _tp_FUNC_ATTRIBUTES
 #define _tp_FUNC_ATTRIBUTES
@@ -99,9 +107,62 @@ Also guards loads from the tracepoint_provider_node Next/Prev fields.
 
 All other fields may be read outside the lock via atomic_load, so they must be
 updated within the lock via atomic_store.
+
+Not held during DIAG_IOCSREG/DIAG_IOCSUNREG (see s_tracepoint_mutexes).
 */
 static pthread_mutex_t s_providers_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+Striped locks that serialize changes to a tracepoint's kernel registration.
+tracepoint_state has no room for a lock, so the stripe is chosen by address
+(tracepoint_lock_index).
+
+- event_connect holds the tracepoint's stripe for the whole operation and
+  takes s_providers_mutex only to read the provider and to update the
+  tracepoint's fields and list links, so the ioctls run without the global
+  lock.
+- tracepoint_close_provider holds every stripe while it unregisters the
+  provider's tracepoints. No tracepoint can be connected or disconnected in
+  the meantime, so the provider's list is stable and can be walked without
+  s_providers_mutex.
+
+Lock order: stripes (in ascending index order), then s_providers_mutex.
+*/
+#define TRACEPOINT_LOCK_COUNT 64u
+static pthread_mutex_t s_tracepoint_mutexes[TRACEPOINT_LOCK_COUNT] = {
+#define TRACEPOINT_LOCK_INIT4 PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+#define TRACEPOINT_LOCK_INIT16 TRACEPOINT_LOCK_INIT4, TRACEPOINT_LOCK_INIT4, TRACEPOINT_LOCK_INIT4, TRACEPOINT_LOCK_INIT4
+    TRACEPOINT_LOCK_INIT16, TRACEPOINT_LOCK_INIT16, TRACEPOINT_LOCK_INIT16, TRACEPOINT_LOCK_INIT16
+#undef TRACEPOINT_LOCK_INIT16
+#undef TRACEPOINT_LOCK_INIT4
+};
+
+static unsigned
+tracepoint_lock_index(tracepoint_state const* tp_state)
+{
+    return (unsigned)(((uintptr_t)tp_state / sizeof(tracepoint_state)) % TRACEPOINT_LOCK_COUNT);
+}
+
+static void
+tracepoint_lock_all(void)
+{
+    unsigned i;
+    for (i = 0; i != TRACEPOINT_LOCK_COUNT; i += 1)
+    {
+        pthread_mutex_lock(&s_tracepoint_mutexes[i]);
+    }
+}
+
+static void
+tracepoint_unlock_all(void)
+{
+    unsigned i;
+    for (i = TRACEPOINT_LOCK_COUNT; i != 0; i -= 1)
+    {
+        pthread_mutex_unlock(&s_tracepoint_mutexes[i - 1]);
+    }
+}
+
 static int
 get_failure_errno(void)
 {
@@ -326,17 +387,727 @@ user_events_data_get()
 }
 
 static void
-event_unregister(tracepoint_state* tp_state)
+event_unregister(int data_file, tracepoint_state* tp_state)
+{
+    struct user_unreg unreg = { 0 };
+    unreg.size = sizeof(struct user_unreg);
+    unreg.disable_bit = 0;
+    unreg.disable_addr = (uintptr_t)&tp_state->status_word;
+    ioctl(data_file, DIAG_IOCSUNREG, &unreg);
+}
+
+// Requires: no locks are held.
+static int
+event_connect(
+    tracepoint_state* tp_state,
+    tracepoint_provider_state* provider_state,
+    char const* tp_name_args,
+    unsigned flags)
+{
+    int err;
+    pthread_mutex_t* const tp_mutex = &s_tracepoint_mutexes[tracepoint_lock_index(tp_state)];
+
+    pthread_mutex_lock(tp_mutex);
+
+    for (;;)
+    {
+        int write_index = -1;
+
+        // Detach from the old provider and snapshot the new one.
+        pthread_mutex_lock(&s_providers_mutex);
+        tracepoint_provider_state* const old_provider_state = (tracepoint_provider_state*)tp_state->provider_state;
+        int const old_write_index = tp_state->write_index;
+        int const old_data_file = old_write_index >= 0 ? old_provider_state->data_file : -1;
+        if (old_write_index >= 0)
+        {
+            old_provider_state->ref_count -= 1; // For debugging purposes.
+        }
+
+        int const data_file = provider_state != NULL ? provider_state->data_file : -1;
+        tracepoint_connect_impl(tp_state, NULL, -1);
+        pthread_mutex_unlock(&s_providers_mutex);
+
+        if (old_write_index >= 0)
+        {
+            event_unregister(old_data_file, tp_state);
+        }
+
+        if (-1 == data_file)
+        {
+            err = 0;
+        }
+        else
+        {
+            struct user_reg reg = { 0 };
+            reg.size = sizeof(reg);
+            reg.enable_bit = 0;
+            reg.enable_size = sizeof(tp_state->status_word);
+            reg.flags = (__u16)flags;
+            reg.enable_addr = (uintptr_t)&tp_state->status_word;
+            reg.name_args = (uintptr_t)tp_name_args;
+
+            if (0 > ioctl(data_file, DIAG_IOCSREG, &reg))
+            {
+                err = errno;
+            }
+            else
+            {
+                assert(reg.write_index <= 0x7fffffff);
+                write_index = (int)reg.write_index;
+                err = 0;
+            }
+        }
+
+        // Publish, unless the provider was opened or closed in the meantime.
+        pthread_mutex_lock(&s_providers_mutex);
+        int const changed = provider_state != NULL && provider_state->data_file != data_file;
+        if (!changed)
+        {
+            if (write_index >= 0)
+            {
+                provider_state->ref_count += 1; // For debugging purposes.
+            }
+
+            tracepoint_connect_impl(tp_state, provider_state, write_index);
+        }
+        pthread_mutex_unlock(&s_providers_mutex);
+
+        if (!changed)
+        {
+            break;
+        }
+
+        // Undo and try again with the provider's new state.
+        if (write_index >= 0)
+        {
+            event_unregister(data_file, tp_state);
+        }
+    }
+
+    pthread_mutex_unlock(tp_mutex);
+    return err;
+}
+
+/*
+State for lazy connect mode (tracepoint_lazy_connect).
+
+Each DIAG_IOCSREG is a round trip into the kernel, so connecting thousands of
+tracepoints at provider open is a significant part of process startup. In
+lazy connect mode, tracepoint_open_provider_with_tracepoints queues a lazy_job
+instead. A detached worker thread takes LAZY_BATCH_SIZE tracepoints at a time
+from the queue and connects them via event_connect (without holding
+s_providers_mutex). The worker exits when the queue is empty and is restarted
+when a job is queued.
+
+A job stays in the queue until its last batch completes. While a batch is in
+progress, s_lazy_batch_job points at its job. tracepoint_close_provider
+removes the provider's jobs (truncating the in-progress one) and waits for the
+in-progress batch, so the worker never touches a provider or its tracepoints
+after close returns.
+
+The queue, the jobs, s_lazy_worker_running, and s_lazy_batch_job are guarded
+by s_providers_mutex.
+*/
+#define LAZY_BATCH_SIZE 64u
+
+typedef struct lazy_job {
+    struct lazy_job* next;
+    tracepoint_provider_state* provider_state;
+    tracepoint_definition const** definitions; // Sorted, de-duplicated.
+    unsigned count;
+    unsigned pos;       // definitions[0..pos) have been handed to the worker.
+    unsigned done_pos;  // definitions[0..done_pos) have been connected.
+} lazy_job;
+
+static int s_lazy_enabled; // Updated via atomic_store.
+static int s_lazy_worker_running;
+static lazy_job* s_lazy_head;
+static lazy_job* s_lazy_batch_job; // Job of the batch in progress, or NULL.
+static pthread_cond_t s_lazy_cond = PTHREAD_COND_INITIALIZER; // Signaled when a batch completes or the queue becomes empty.
+static pthread_once_t s_lazy_once = PTHREAD_ONCE_INIT;
+
+static void
+lazy_atfork_prepare(void)
+{
+    tracepoint_lock_all();
+    pthread_mutex_lock(&s_providers_mutex);
+}
+
+static void
+lazy_atfork_parent(void)
+{
+    pthread_mutex_unlock(&s_providers_mutex);
+    tracepoint_unlock_all();
+}
+
+static void
+lazy_atfork_child(void)
+{
+    // The worker does not exist in the child. Pending jobs are picked up by
+    // the next tracepoint_open_provider_with_tracepoints or
+    // tracepoint_lazy_connect_wait.
+    s_lazy_worker_running = 0;
+    if (s_lazy_batch_job != NULL)
+    {
+        // Batch was interrupted by the fork. Redo it.
+        s_lazy_batch_job->pos = s_lazy_batch_job->done_pos;
+        s_lazy_batch_job = NULL;
+    }
+
+    pthread_mutex_unlock(&s_providers_mutex);
+    tracepoint_unlock_all();
+}
+
+static void
+lazy_init(void)
+{
+    // Worker holds the locks for a while, so make sure fork does not copy
+    // them in the locked state.
+    pthread_atfork(lazy_atfork_prepare, lazy_atfork_parent, lazy_atfork_child);
+}
+
+// Requires: s_providers_mutex is held, s_lazy_worker_running is set.
+// Connects all queued tracepoints. Releases s_providers_mutex while connecting
+// each batch.
+static void
+lazy_run(void)
+{
+    while (s_lazy_head != NULL)
+    {
+        lazy_job* const job = s_lazy_head;
+        tracepoint_provider_state* const provider_state = job->provider_state;
+        tracepoint_definition const* batch[LAZY_BATCH_SIZE];
+        unsigned const batch_count = job->count - job->pos > LAZY_BATCH_SIZE
+            ? LAZY_BATCH_SIZE
+            : job->count - job->pos;
+        memcpy(batch, job->definitions + job->pos, batch_count * sizeof(batch[0]));
+        job->pos += batch_count;
+        s_lazy_batch_job = job;
+        pthread_mutex_unlock(&s_providers_mutex);
+
+        unsigned i;
+        for (i = 0; i != batch_count; i += 1)
+        {
+            // Skip tracepoints that were already connected via tracepoint_connect.
+            tracepoint_definition const* const def = batch[i];
+            if (__atomic_load_n(&def->state->provider_state, __ATOMIC_RELAXED) != provider_state)
+            {
+                (void)event_connect(def->state, provider_state, def->tp_name_args, 0);
+            }
+        }
+
+        pthread_mutex_lock(&s_providers_mutex);
+        s_lazy_batch_job = NULL;
+
+        // Job is still at the head of the queue: lazy_cancel waits for the
+        // batch before removing it.
+        assert(s_lazy_head == job);
+        job->done_pos = job->pos;
+        if (job->done_pos == job->count)
+        {
+            s_lazy_head = job->next;
+            free(job);
+        }
+
+        pthread_cond_broadcast(&s_lazy_cond);
+    }
+}
+
+static void*
+lazy_worker(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&s_providers_mutex);
+    lazy_run();
+    s_lazy_worker_running = 0;
+    pthread_mutex_unlock(&s_providers_mutex);
+    return NULL;
+}
+
+// Requires: s_providers_mutex is held.
+// Makes sure somebody is processing the queue: starts the worker if needed,
+// or runs the queue on the calling thread if the worker cannot be started.
+static void
+lazy_worker_start(void)
+{
+    if (s_lazy_worker_running || s_lazy_head == NULL)
+    {
+        return;
+    }
+
+    // Worker should not receive the process's signals.
+    sigset_t all_signals;
+    sigset_t old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+
+    pthread_attr_t attr;
+    int err = pthread_attr_init(&attr);
+    if (err == 0)
+    {
+        pthread_t thread;
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        err = pthread_create(&thread, &attr, lazy_worker, NULL);
+        pthread_attr_destroy(&attr);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    s_lazy_worker_running = 1;
+    if (err != 0)
+    {
+        lazy_run();
+        s_lazy_worker_running = 0;
+    }
+}
+
+// Requires: s_providers_mutex is held. May release and re-acquire it.
+static void
+lazy_cancel(tracepoint_provider_state const* provider_state)
+{
+    lazy_job* const batch_job = s_lazy_batch_job;
+    if (batch_job != NULL && batch_job->provider_state == provider_state)
+    {
+        // No more batches. The worker removes the job when the batch is done.
+        batch_job->count = batch_job->pos;
+        do
+        {
+            pthread_cond_wait(&s_lazy_cond, &s_providers_mutex);
+        } while (s_lazy_batch_job == batch_job);
+    }
+
+    lazy_job** pjob = &s_lazy_head;
+    while (*pjob != NULL)
+    {
+        lazy_job* const job = *pjob;
+        if (job->provider_state == provider_state)
+        {
+            *pjob = job->next;
+            free(job);
+        }
+        else
+        {
+            pjob = &job->next;
+        }
+    }
+
+    if (s_lazy_head == NULL)
+    {
+        pthread_cond_broadcast(&s_lazy_cond);
+    }
+}
+
+static uint64_t s_async_dropped; // Updated via atomic_add.
+
+#ifdef __NR_io_uring_setup
+
+/*
+State for the optional asynchronous write mode (tracepoint_async_start).
+
+Each event is copied into a fixed-size slot and submitted to the user_events
+data file as an IORING_OP_WRITE on a per-process io_uring. The ring uses a
+kernel submission thread (IORING_SETUP_SQPOLL), so the writing thread does not
+enter the kernel unless the submission thread has gone idle. A slot is busy
+from submission until its completion is reaped. Completions are reaped by the
+next writer, so no extra thread is needed. Number of slots == number of SQEs,
+so the submission queue can never overflow.
+*/
+typedef struct async_ring {
+    int ring_file;
+    unsigned slot_size;
+    unsigned slot_count;
+    unsigned free_count;
+    unsigned* free_slots;   // free_slots[0..free_count) are available.
+    char* slot_data;        // slot_count * slot_size bytes.
+
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;           // May be the same as sq_map.
+    size_t cq_map_size;
+    void* sqes_map;
+    size_t sqes_map_size;
+
+    unsigned* sq_tail;
+    unsigned* sq_flags;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+} async_ring;
+
+/*
+Guards all access to *s_async_ring and all stores to s_async_ring.
+s_async_ring may be loaded outside the lock via atomic_load to check whether
+asynchronous mode might be active.
+*/
+static pthread_mutex_t s_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static async_ring* s_async_ring;
+
+static void
+async_ring_destroy(async_ring* ring)
+{
+    if (ring->sqes_map != NULL && ring->sqes_map != MAP_FAILED)
+    {
+        munmap(ring->sqes_map, ring->sqes_map_size);
+    }
+
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+    {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+    {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+
+    if (ring->ring_file >= 0)
+    {
+        close(ring->ring_file);
+    }
+
+    free(ring->slot_data);
+    free(ring->free_slots);
+    free(ring);
+}
+
+// Requires: s_async_mutex is held.
+static void
+async_ring_reap(async_ring* ring)
+{
+    unsigned head = *ring->cq_head; // Only modified by us (under lock).
+    unsigned const tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe const* cqe = &ring->cqes[head & ring->cq_mask];
+        assert(ring->free_count < ring->slot_count);
+        ring->free_slots[ring->free_count] = (unsigned)cqe->user_data;
+        ring->free_count += 1;
+        if (cqe->res < 0)
+        {
+            __atomic_add_fetch(&s_async_dropped, 1, __ATOMIC_RELAXED);
+        }
+
+        head += 1;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Requires: s_async_mutex is held.
+// Returns 0 if queued, EAGAIN if no free slot, E2BIG if event too large.
+static int
+async_ring_write(
+    async_ring* ring,
+    int data_file,
+    unsigned data_count,
+    struct iovec const* data_vecs)
+{
+    size_t size = 0;
+    unsigned i;
+    for (i = 0; i != data_count; i += 1)
+    {
+        size += data_vecs[i].iov_len;
+        if (size > ring->slot_size)
+        {
+            return E2BIG;
+        }
+    }
+
+    async_ring_reap(ring);
+    if (ring->free_count == 0)
+    {
+        return EAGAIN;
+    }
+
+    ring->free_count -= 1;
+    unsigned const slot = ring->free_slots[ring->free_count];
+    char* const slot_data = ring->slot_data + (size_t)slot * ring->slot_size;
+
+    size_t pos = 0;
+    for (i = 0; i != data_count; i += 1)
+    {
+        memcpy(slot_data + pos, data_vecs[i].iov_base, data_vecs[i].iov_len);
+        pos += data_vecs[i].iov_len;
+    }
+
+    unsigned const tail = *ring->sq_tail; // Only modified by us (under lock).
+    unsigned const index = tail & ring->sq_mask;
+    struct io_uring_sqe* const sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = data_file;
+    sqe->addr = (uintptr_t)slot_data;
+    sqe->len = (unsigned)size;
+    sqe->user_data = slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    // Tail store must be visible before we check whether the SQ thread is asleep.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+    {
+        syscall(__NR_io_uring_enter, ring->ring_file, 0, 0, IORING_ENTER_SQ_WAKEUP, NULL, 0);
+    }
+
+    return 0;
+}
+
+static int
+async_ring_create(
+    unsigned queue_depth,
+    unsigned slot_size,
+    async_ring** pring)
+{
+    int err;
+    unsigned i;
+    struct io_uring_params params;
+    async_ring* ring = (async_ring*)calloc(1, sizeof(async_ring));
+    if (ring == NULL)
+    {
+        err = ENOMEM;
+        goto Error;
+    }
+
+    ring->ring_file = -1;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = 100; // milliseconds
+    ring->ring_file = (int)syscall(__NR_io_uring_setup, queue_depth, &params);
+    if (ring->ring_file < 0)
+    {
+        err = get_failure_errno();
+        goto Error;
+    }
+
+    // IORING_FEAT_RW_CUR_POS arrived in the same release as IORING_OP_WRITE.
+    if (0 == (params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        err = ENOTSUP;
+        goto Error;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->sq_map_size < ring->cq_map_size)
+        {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_file, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        err = get_failure_errno();
+        goto Error;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_map = ring->sq_map;
+    }
+    else
+    {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->ring_file, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED)
+        {
+            err = get_failure_errno();
+            goto Error;
+        }
+    }
+
+    ring->sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes_map = mmap(NULL, ring->sqes_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_file, IORING_OFF_SQES);
+    if (ring->sqes_map == MAP_FAILED)
+    {
+        err = get_failure_errno();
+        goto Error;
+    }
+
+    ring->sq_tail = (unsigned*)((char*)ring->sq_map + params.sq_off.tail);
+    ring->sq_flags = (unsigned*)((char*)ring->sq_map + params.sq_off.flags);
+    ring->sq_array = (unsigned*)((char*)ring->sq_map + params.sq_off.array);
+    ring->sq_mask = *(unsigned*)((char*)ring->sq_map + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned*)((char*)ring->cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->cq_map + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)((char*)ring->cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_map + params.cq_off.cqes);
+    ring->sqes = (struct io_uring_sqe*)ring->sqes_map;
+
+    // Each slot has an SQE, so the SQ can never overflow. Kernel sizes the CQ
+    // to at least sq_entries, so the CQ can never overflow either.
+    ring->slot_size = slot_size;
+    ring->slot_count = params.sq_entries;
+    ring->slot_data = (char*)malloc((size_t)ring->slot_count * slot_size);
+    ring->free_slots = (unsigned*)malloc(ring->slot_count * sizeof(unsigned));
+    if (ring->slot_data == NULL || ring->free_slots == NULL)
+    {
+        err = ENOMEM;
+        goto Error;
+    }
+
+    for (i = 0; i != ring->slot_count; i += 1)
+    {
+        ring->free_slots[i] = i;
+    }
+
+    ring->free_count = ring->slot_count;
+    *pring = ring;
+    return 0;
+
+Error:
+
+    if (ring != NULL)
+    {
+        async_ring_destroy(ring);
+    }
+
+    *pring = NULL;
+    return err;
+}
+
+// Requires: s_async_mutex is held.
+static void
+async_ring_drain(async_ring* ring)
+{
+    for (;;)
+    {
+        async_ring_reap(ring);
+        if (ring->free_count == ring->slot_count)
+        {
+            break;
+        }
+
+        if (0 > syscall(__NR_io_uring_enter, ring->ring_file, 0, 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP, NULL, 0) &&
+            errno != EINTR)
+        {
+            break;
+        }
+    }
+}
+
+#endif // __NR_io_uring_setup
+
+static int
+event_writev(
+    int data_file,
+    unsigned data_count,
+    struct iovec* data_vecs)
 {
-    if (tp_state->write_index >= 0)
+#ifdef __NR_io_uring_setup
+    if (__atomic_load_n(&s_async_ring, __ATOMIC_RELAXED) != NULL)
     {
-        struct user_unreg unreg = { 0 };
-        unreg.size = sizeof(struct user_unreg);
-        unreg.disable_bit = 0;
-        unreg.disable_addr = (uintptr_t)&tp_state->status_word;
-        ioctl(tp_state->provider_state->data_file, DIAG_IOCSUNREG, &unreg);
-        ((tracepoint_provider_state*)tp_state->provider_state)->ref_count -= 1; // For debugging purposes.
+        pthread_mutex_lock(&s_async_mutex);
+        async_ring* const ring = s_async_ring;
+        int const async_err = ring != NULL
+            ? async_ring_write(ring, data_file, data_count, data_vecs)
+            : ENOENT;
+        pthread_mutex_unlock(&s_async_mutex);
+
+        if (ring != NULL)
+        {
+            if (async_err != 0)
+            {
+                __atomic_add_fetch(&s_async_dropped, 1, __ATOMIC_RELAXED);
+            }
+
+            return async_err;
+        }
+
+        // Asynchronous mode was stopped. Fall back to synchronous write.
     }
+#endif // __NR_io_uring_setup
+
+    int err = 0 <= writev(data_file, data_vecs, (int)data_count)
+        ? 0
+        : errno;
+    return err;
+}
+
+static int
+event_write(
+    tracepoint_state const* tp_state,
+    unsigned data_count,
+    struct iovec* data_vecs)
+{
+    assert((int)data_count >= 1);
+    assert(data_vecs[0].iov_len == 0);
+
+    if (!TRACEPOINT_ENABLED(tp_state))
+    {
+        return EBADF;
+    }
+
+    tracepoint_provider_state const* provider_state = __atomic_load_n(&tp_state->provider_state, __ATOMIC_RELAXED);
+    if (provider_state == NULL)
+    {
+        return EBADF;
+    }
+
+    // Workaround: Events don't show up correctly with 0 bytes of data.
+    // If event has 0 bytes of data, add a '\0' byte to avoid the problem.
+    struct {
+        int32_t write_index;
+        char workaround;
+    } data0 = {
+        __atomic_load_n(&tp_state->write_index, __ATOMIC_RELAXED),
+        0
+    };
+    data_vecs[0].iov_base = &data0;
+    data_vecs[0].iov_len = sizeof(int32_t) + (data_count == 1);
+
+    int data_file = __atomic_load_n(&provider_state->data_file, __ATOMIC_RELAXED);
+    if (0 > data_file)
+    {
+        return 0;
+    }
+
+    return event_writev(data_file, data_count, data_vecs);
+}
+
+static int
+event_write_packed(
+    tracepoint_state const* tp_state,
+    void* data,
+    unsigned data_size)
+{
+    assert(data_size >= sizeof(int32_t));
+
+    if (!TRACEPOINT_ENABLED(tp_state))
+    {
+        return EBADF;
+    }
+
+    tracepoint_provider_state const* provider_state = __atomic_load_n(&tp_state->provider_state, __ATOMIC_RELAXED);
+    if (provider_state == NULL)
+    {
+        return EBADF;
+    }
+
+    // No workaround byte: the caller opted in to writing the data as-is.
+    int32_t const write_index = __atomic_load_n(&tp_state->write_index, __ATOMIC_RELAXED);
+    memcpy(data, &write_index, sizeof(write_index));
+
+    int data_file = __atomic_load_n(&provider_state->data_file, __ATOMIC_RELAXED);
+    if (0 > data_file)
+    {
+        return 0;
+    }
+
+    struct iovec data_vec = { data, data_size };
+    return event_writev(data_file, 1, &data_vec);
 }
 
 #ifdef __cplusplus
@@ -351,10 +1122,17 @@ extern "C" {
         tracepoint_provider_state* provider_state)
     {
         pthread_mutex_lock(&s_providers_mutex);
+        lazy_cancel(provider_state);
+        pthread_mutex_unlock(&s_providers_mutex);
 
-        if (provider_state->data_file != -1)
+        // With every stripe held, the provider's list cannot change.
+        tracepoint_lock_all();
+
+        int const data_file = provider_state->data_file;
+        int unregister_count = 0;
+        if (data_file != -1)
         {
-            assert(provider_state->data_file > -1);
+            assert(data_file > -1);
 
             // Need to unregister events when we're done.
             tracepoint_list_node* node = provider_state->tracepoint_list_head.next;
@@ -368,15 +1146,22 @@ extern "C" {
                     assert(node->prev == &tp_state->tracepoint_list_link);
 
                     assert(provider_state == tp_state->provider_state);
-                    event_unregister(tp_state);
+                    if (tp_state->write_index >= 0)
+                    {
+                        event_unregister(data_file, tp_state);
+                        unregister_count += 1;
+                    }
                 }
             }
         }
 
+        pthread_mutex_lock(&s_providers_mutex);
+        provider_state->ref_count -= unregister_count; // For debugging purposes.
         assert(provider_state->ref_count == 0); // register count == unregister count?
         tracepoint_close_provider_impl(provider_state);
-
         pthread_mutex_unlock(&s_providers_mutex);
+
+        tracepoint_unlock_all();
     }
 
     int
@@ -425,10 +1210,66 @@ extern "C" {
         tracepoint_definition const** tp_definition_start,
         tracepoint_definition const** tp_definition_stop)
     {
-        return tracepoint_open_provider_with_tracepoints_impl(
-            provider_state,
-            tp_definition_start,
-            tp_definition_stop);
+        if (!__atomic_load_n(&s_lazy_enabled, __ATOMIC_RELAXED))
+        {
+            return tracepoint_open_provider_with_tracepoints_impl(
+                provider_state,
+                tp_definition_start,
+                tp_definition_stop);
+        }
+
+        int err = tracepoint_open_provider(provider_state);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        tracepoint_definition const** adjusted_stop = (tracepoint_definition const**)
+            tracepoint_fix_array((void const**)tp_definition_start, (void const**)tp_definition_stop);
+        unsigned const count = (unsigned)(adjusted_stop - tp_definition_start);
+        if (count == 0)
+        {
+            return 0;
+        }
+
+        lazy_job* const job = (lazy_job*)malloc(sizeof(lazy_job));
+        if (job == NULL)
+        {
+            // Connect now.
+            unsigned i;
+            for (i = 0; i != count; i += 1)
+            {
+                (void)event_connect(
+                    tp_definition_start[i]->state,
+                    provider_state,
+                    tp_definition_start[i]->tp_name_args,
+                    0);
+            }
+        }
+        else
+        {
+            pthread_mutex_lock(&s_providers_mutex);
+
+            job->next = NULL;
+            job->provider_state = provider_state;
+            job->definitions = tp_definition_start;
+            job->count = count;
+            job->pos = 0;
+            job->done_pos = 0;
+
+            lazy_job** pjob = &s_lazy_head;
+            while (*pjob != NULL)
+            {
+                pjob = &(*pjob)->next;
+            }
+
+            *pjob = job;
+            lazy_worker_start();
+
+            pthread_mutex_unlock(&s_providers_mutex);
+        }
+
+        return 0;
     }
 
     int
@@ -444,45 +1285,7 @@ extern "C" {
         char const* tp_name_args,
         unsigned flags)
     {
-        int err;
-        int write_index = -1;
-
-        pthread_mutex_lock(&s_providers_mutex);
-
-        event_unregister(tp_state);
-
-        if (NULL == provider_state ||
-            -1 == provider_state->data_file)
-        {
-            err = 0;
-        }
-        else
-        {
-            struct user_reg reg = { 0 };
-            reg.size = sizeof(reg);
-            reg.enable_bit = 0;
-            reg.enable_size = sizeof(tp_state->status_word);
-            reg.flags = (__u16)flags;
-            reg.enable_addr = (uintptr_t)&tp_state->status_word;
-            reg.name_args = (uintptr_t)tp_name_args;
-
-            if (0 > ioctl(provider_state->data_file, DIAG_IOCSREG, &reg))
-            {
-                err = errno;
-            }
-            else
-            {
-                assert(reg.write_index <= 0x7fffffff);
-                provider_state->ref_count += 1;
-                write_index = (int)reg.write_index;
-                err = 0;
-            }
-        }
-
-        tracepoint_connect_impl(tp_state, provider_state, write_index);
-
-        pthread_mutex_unlock(&s_providers_mutex);
-        return err;
+        return event_connect(tp_state, provider_state, tp_name_args, flags);
     }
 
     int
@@ -510,37 +1313,195 @@ extern "C" {
         unsigned data_count,
         struct iovec* data_vecs)
     {
-        assert((int)data_count >= 1);
-        assert(data_vecs[0].iov_len == 0);
+        return event_write(tp_state, data_count, data_vecs);
+    }
+
+    int
+    tracepoint_write_packed(
+        tracepoint_state const* tp_state,
+        void* data,
+        unsigned data_size) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_write_packed(
+        tracepoint_state const* tp_state,
+        void* data,
+        unsigned data_size)
+    {
+        return event_write_packed(tp_state, data, data_size);
+    }
+
+    int
+    tracepoint_async_start(
+        unsigned queue_depth,
+        unsigned slot_size) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_async_start(
+        unsigned queue_depth,
+        unsigned slot_size)
+    {
+#ifndef __NR_io_uring_setup
+        (void)queue_depth;
+        (void)slot_size;
+        return ENOTSUP;
+#else // __NR_io_uring_setup
+        int err;
+        async_ring* ring;
 
-        if (!TRACEPOINT_ENABLED(tp_state))
+        if (queue_depth == 0 || queue_depth > 4096 ||
+            slot_size < sizeof(int32_t) || slot_size > 0x10000)
         {
-            return EBADF;
+            return EINVAL;
         }
 
-        tracepoint_provider_state const* provider_state = __atomic_load_n(&tp_state->provider_state, __ATOMIC_RELAXED);
-        if (provider_state == NULL)
+        pthread_mutex_lock(&s_async_mutex);
+
+        if (s_async_ring != NULL)
         {
-            return EBADF;
+            err = EALREADY;
+        }
+        else
+        {
+            err = async_ring_create(queue_depth, slot_size, &ring);
+            if (err == 0)
+            {
+                __atomic_store_n(&s_async_ring, ring, __ATOMIC_RELEASE);
+            }
         }
 
-        // Workaround: Events don't show up correctly with 0 bytes of data.
-        // If event has 0 bytes of data, add a '\0' byte to avoid the problem.
-        struct {
-            int32_t write_index;
-            char workaround;
-        } data0 = {
-            __atomic_load_n(&tp_state->write_index, __ATOMIC_RELAXED),
-            0
-        };
-        data_vecs[0].iov_base = &data0;
-        data_vecs[0].iov_len = sizeof(int32_t) + (data_count == 1);
-
-        int data_file = __atomic_load_n(&provider_state->data_file, __ATOMIC_RELAXED);
-        int err = 0 > data_file || 0 <= writev(data_file, data_vecs, (int)data_count)
-            ? 0
-            : errno;
+        pthread_mutex_unlock(&s_async_mutex);
         return err;
+#endif // __NR_io_uring_setup
+    }
+
+    void
+    tracepoint_async_stop(void) _tp_FUNC_ATTRIBUTES;
+    void
+    tracepoint_async_stop(void)
+    {
+#ifdef __NR_io_uring_setup
+        pthread_mutex_lock(&s_async_mutex);
+
+        async_ring* const ring = s_async_ring;
+        if (ring != NULL)
+        {
+            __atomic_store_n(&s_async_ring, NULL, __ATOMIC_RELAXED);
+            async_ring_drain(ring);
+            async_ring_destroy(ring);
+        }
+
+        pthread_mutex_unlock(&s_async_mutex);
+#endif // __NR_io_uring_setup
+    }
+
+    uint64_t
+    tracepoint_async_dropped(void) _tp_FUNC_ATTRIBUTES;
+    uint64_t
+    tracepoint_async_dropped(void)
+    {
+        return __atomic_load_n(&s_async_dropped, __ATOMIC_RELAXED);
+    }
+
+    int
+    tracepoint_lazy_connect(int enable) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_lazy_connect(int enable)
+    {
+        if (enable)
+        {
+            pthread_once(&s_lazy_once, lazy_init);
+        }
+
+        __atomic_store_n(&s_lazy_enabled, enable != 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    void
+    tracepoint_lazy_connect_wait(void) _tp_FUNC_ATTRIBUTES;
+    void
+    tracepoint_lazy_connect_wait(void)
+    {
+        pthread_mutex_lock(&s_providers_mutex);
+
+        while (s_lazy_head != NULL)
+        {
+            lazy_worker_start(); // In case we are in a forked child.
+            if (s_lazy_head != NULL)
+            {
+                pthread_cond_wait(&s_lazy_cond, &s_providers_mutex);
+            }
+        }
+
+        pthread_mutex_unlock(&s_providers_mutex);
+    }
+
+    int
+    tracepoint_register_enable_bit(
+        tracepoint_provider_state const* provider_state,
+        char const* tp_name_args,
+        unsigned* enable_word,
+        unsigned enable_bit) _tp_FUNC_ATTRIBUTES;
+    int
+    tracepoint_register_enable_bit(
+        tracepoint_provider_state const* provider_state,
+        char const* tp_name_args,
+        unsigned* enable_word,
+        unsigned enable_bit)
+    {
+        if (enable_bit >= sizeof(*enable_word) * 8)
+        {
+            return EINVAL;
+        }
+
+        pthread_mutex_lock(&s_providers_mutex);
+        int const data_file = provider_state->data_file;
+        pthread_mutex_unlock(&s_providers_mutex);
+
+        if (-1 == data_file)
+        {
+            return EBADF;
+        }
+
+        // The kernel adds another enabler to the same event and keeps the bit
+        // up to date along with the event's other enablers.
+        struct user_reg reg = { 0 };
+        reg.size = sizeof(reg);
+        reg.enable_bit = (__u8)enable_bit;
+        reg.enable_size = sizeof(*enable_word);
+        reg.enable_addr = (uintptr_t)enable_word;
+        reg.name_args = (uintptr_t)tp_name_args;
+
+        return 0 > ioctl(data_file, DIAG_IOCSREG, &reg)
+            ? errno
+            : 0;
+    }
+
+    void
+    tracepoint_unregister_enable_bit(
+        unsigned* enable_word,
+        unsigned enable_bit) _tp_FUNC_ATTRIBUTES;
+    void
+    tracepoint_unregister_enable_bit(
+        unsigned* enable_word,
+        unsigned enable_bit)
+    {
+        if (enable_bit >= sizeof(*enable_word) * 8)
+        {
+            return;
+        }
+
+        // Enablers are registered with the shared user_events_data file, which
+        // stays open after the provider closes.
+        int const data_file = user_events_data_get();
+        if (data_file >= 0)
+        {
+            struct user_unreg unreg = { 0 };
+            unreg.size = sizeof(struct user_unreg);
+            unreg.disable_bit = (__u8)enable_bit;
+            unreg.disable_addr = (uintptr_t)enable_word;
+            ioctl(data_file, DIAG_IOCSUNREG, &unreg);
+        }
+
+        __atomic_and_fetch(enable_word, ~(1u << enable_bit), __ATOMIC_RELAXED);
     }
 
 #ifdef __cplusplus
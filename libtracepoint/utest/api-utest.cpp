@@ -7,6 +7,8 @@ Does not check whether the events ever get enabled or go anywhere.
 */
 
 #include <tracepoint/tracepoint.h>
+#include <tracepoint/tracepoint-ext.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
 
@@ -247,6 +249,41 @@ int main()
     verify_tp_disconnected(__LINE__, e0);
     verify_tp_disconnected(__LINE__, e1);
 
+    // Async mode: parameter validation, stop is a safe no-op when not started.
+    int err = tracepoint_async_start(0, 64);
+    verify_cond(__LINE__, EINVAL == err || ENOTSUP == err,
+        "tracepoint_async_start(0, 64): expected EINVAL, actual %d", err);
+    tracepoint_async_stop();
+    tracepoint_async_stop();
+
+    // Lazy connect mode: after wait, same result as an eager open.
+    err = tracepoint_lazy_connect(1);
+    verify_cond(__LINE__, 0 == err || ENOTSUP == err,
+        "tracepoint_lazy_connect(1): expected 0, actual %d", err);
+    {
+        tracepoint_definition const d0 = { &e0, "e0 " };
+        tracepoint_definition const d1 = { &e1, "e1 " };
+        tracepoint_definition const* defs[] = { &d1, &d0, &d1 };
+        err = tracepoint_open_provider_with_tracepoints(&p2, defs, defs + 3);
+        check_errno(__LINE__, err, "tracepoint_open_provider_with_tracepoints");
+        tracepoint_lazy_connect_wait();
+        if (err == 0)
+        {
+            verify_provider(__LINE__, p2, true);
+            verify_tp_open(__LINE__, e0, p2);
+            verify_tp_open(__LINE__, e1, p2);
+        }
+
+        tracepoint_close_provider(&p2);
+        verify_tp_disconnected(__LINE__, e0);
+        verify_tp_disconnected(__LINE__, e1);
+        tracepoint_lazy_connect_wait();
+    }
+
+    err = tracepoint_lazy_connect(0);
+    verify_cond(__LINE__, 0 == err,
+        "tracepoint_lazy_connect(0): expected 0, actual %d", err);
+
     fprintf(stderr, "%s\n", s_any_errors ? "FAIL" : "OK");
     return s_any_errors;
 }
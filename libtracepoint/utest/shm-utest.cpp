@@ -0,0 +1,395 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for libtracepoint-shm: creates a ring in a temporary file, points
+TRACEPOINT_SHM_PATH at it, writes events through the tracepoint.h interface,
+and drains the ring the same way as perf-shm-collect.
+*/
+
+#include <tracepoint/tracepoint.h>
+#include <tracepoint/tracepoint-shm.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <vector>
+
+static unsigned const RegistrySize = 0x1000;
+static unsigned const PageSize = 0x1000;
+static unsigned const DataSize = 0x40000; // Smallest ring the library accepts.
+static unsigned const PayloadSize = 1000;
+static unsigned const RecordSize = (sizeof(tracepoint_shm_record) + PayloadSize + 7) & ~7u;
+
+static bool s_any_errors = false;
+
+static void
+verify_cond(unsigned line, bool condition, char const* format, ...)
+{
+    if (!condition)
+    {
+        s_any_errors = true;
+
+        va_list args;
+        va_start(args, format);
+        fprintf(stderr, "shm-utest.cpp(%u) : error : ", line);
+        vfprintf(stderr, format, args);
+        fprintf(stderr, "\n");
+        va_end(args);
+    }
+}
+
+// A drained record: event_id and the payload's sequence number.
+struct drained_record
+{
+    uint32_t event_id;
+    uint32_t seq;
+};
+
+static uint32_t*
+claim_words(tracepoint_shm_header* ring)
+{
+    return reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(ring) + ring->claims_offset);
+}
+
+// Same protocol as perf-shm-collect's Collector::FreeClaims.
+static void
+free_claims(tracepoint_shm_header* ring, uint64_t pos, uint32_t size)
+{
+    auto const claims = claim_words(ring) + (pos & (ring->data_size - 1)) / 8;
+    for (uint32_t i = 0; i != size / 8; i += 1)
+    {
+        __atomic_store_n(&claims[i], TRACEPOINT_SHM_CLAIM_FREE(pos + ring->data_size, ring->data_size), __ATOMIC_RELAXED);
+    }
+}
+
+// Same protocol as perf-shm-collect's Collector::SkipStalled, without the
+// timeout. Returns the new data_tail.
+static uint64_t
+reclaim(tracepoint_shm_header* ring, uint64_t stall_head)
+{
+    auto const data_size = ring->data_size;
+    auto pos = __atomic_load_n(&ring->data_tail, __ATOMIC_RELAXED);
+    for (; pos != stall_head; pos += 8)
+    {
+        auto expected = TRACEPOINT_SHM_CLAIM_FREE(pos, data_size);
+        if (!__atomic_compare_exchange_n(
+            &claim_words(ring)[(pos & (data_size - 1)) / 8],
+            &expected,
+            TRACEPOINT_SHM_CLAIM_FREE(pos + data_size, data_size),
+            false,
+            __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    __atomic_store_n(&ring->data_tail, pos, __ATOMIC_RELEASE);
+    return pos;
+}
+
+// Same protocol as the claim in tracepoint-shm.c's event_write.
+static bool
+claim(tracepoint_shm_header* ring, uint64_t pos)
+{
+    auto const data_size = ring->data_size;
+    auto expected = TRACEPOINT_SHM_CLAIM_FREE(pos, data_size);
+    return __atomic_compare_exchange_n(
+        &claim_words(ring)[(pos & (data_size - 1)) / 8],
+        &expected,
+        TRACEPOINT_SHM_CLAIM_BUSY(pos, data_size),
+        false,
+        __ATOMIC_ACQUIRE,
+        __ATOMIC_RELAXED);
+}
+
+// Same protocol as perf-shm-collect's Collector::Drain.
+// Returns the number of padding records consumed.
+static unsigned
+drain(unsigned line, tracepoint_shm_header* ring, std::vector<drained_record>& records)
+{
+    auto const data = reinterpret_cast<char*>(ring) + ring->data_offset;
+    auto const mask = ring->data_size - 1;
+    auto tail = __atomic_load_n(&ring->data_tail, __ATOMIC_RELAXED);
+    unsigned pad_count = 0;
+
+    for (;;)
+    {
+        auto const offset = tail & mask;
+        auto const record = reinterpret_cast<tracepoint_shm_record*>(data + offset);
+        auto const size = __atomic_load_n(&record->size, __ATOMIC_ACQUIRE);
+        if (size == 0)
+        {
+            break;
+        }
+
+        verify_cond(line, 0 == (size & 7) && size <= ring->data_size - offset,
+            "record size: actual %u at 0x%llx", size, static_cast<unsigned long long>(tail));
+        if (record->event_id == TRACEPOINT_SHM_PAD_ID)
+        {
+            verify_cond(line, offset + size == ring->data_size,
+                "pad record should end at the end of the ring: 0x%llx + %u",
+                static_cast<unsigned long long>(offset), size);
+            pad_count += 1;
+        }
+        else
+        {
+            verify_cond(line, size == RecordSize,
+                "record size: expected %u, actual %u", RecordSize, size);
+            verify_cond(line, record->data_size == PayloadSize,
+                "data_size: expected %u, actual %u", PayloadSize, record->data_size);
+            verify_cond(line, record->pid == static_cast<uint32_t>(getpid()),
+                "pid: expected %u, actual %u", getpid(), record->pid);
+
+            auto const payload = reinterpret_cast<unsigned char const*>(record + 1);
+            drained_record drained = { record->event_id, 0 };
+            memcpy(&drained.seq, payload, sizeof(drained.seq));
+            for (unsigned i = sizeof(drained.seq); i != PayloadSize; i += 1)
+            {
+                if (payload[i] != static_cast<unsigned char>(drained.seq + i))
+                {
+                    verify_cond(line, false, "payload byte %u of event %u", i, drained.seq);
+                    break;
+                }
+            }
+
+            records.push_back(drained);
+        }
+
+        memset(record, 0, size);
+        free_claims(ring, tail, size);
+        tail += size;
+        __atomic_store_n(&ring->data_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return pad_count;
+}
+
+// Writes an event with a PayloadSize-byte payload starting with seq.
+static int
+write_event(tracepoint_state const& tp, uint32_t seq)
+{
+    unsigned char payload[PayloadSize];
+    memcpy(payload, &seq, sizeof(seq));
+    for (unsigned i = sizeof(seq); i != PayloadSize; i += 1)
+    {
+        payload[i] = static_cast<unsigned char>(seq + i);
+    }
+
+    iovec vecs[2] = {
+        { nullptr, 0 },
+        { payload, sizeof(payload) },
+    };
+    return tracepoint_write(&tp, 2, vecs);
+}
+
+int main()
+{
+    char path[] = "/tmp/tracepoint-shm-utest.XXXXXX";
+    int const file = mkstemp(path);
+    if (file < 0)
+    {
+        fprintf(stderr, "shm-utest.cpp : error : mkstemp errno %d\n", errno);
+        return 1;
+    }
+
+    size_t const file_size = PageSize + RegistrySize + DataSize + DataSize / 2;
+    void* map = MAP_FAILED;
+    if (0 == ftruncate(file, file_size))
+    {
+        map = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    }
+
+    close(file);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "shm-utest.cpp : error : creating ring errno %d\n", errno);
+        unlink(path);
+        return 1;
+    }
+
+    // Same layout as perf-shm-collect's CreateRing.
+    auto const ring = static_cast<tracepoint_shm_header*>(map);
+    ring->version = TRACEPOINT_SHM_VERSION;
+    ring->header_size = sizeof(tracepoint_shm_header);
+    ring->registry_size = RegistrySize;
+    ring->registry_offset = PageSize;
+    ring->data_offset = PageSize + RegistrySize;
+    ring->data_size = DataSize;
+    ring->claims_offset = PageSize + RegistrySize + DataSize;
+    __atomic_store_n(&ring->magic, TRACEPOINT_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    setenv(TRACEPOINT_SHM_PATH_ENV, path, 1);
+
+    tracepoint_provider_state provider = TRACEPOINT_PROVIDER_STATE_INIT;
+    tracepoint_state tp_a = TRACEPOINT_STATE_INIT;
+    tracepoint_state tp_b = TRACEPOINT_STATE_INIT;
+    tracepoint_state tp_a2 = TRACEPOINT_STATE_INIT;
+    int err;
+
+    err = tracepoint_open_provider(&provider);
+    verify_cond(__LINE__, err == 0, "tracepoint_open_provider: errno %d", err);
+
+    // Registry: distinct events get distinct ids, the same event reuses its id.
+
+    err = tracepoint_connect(&tp_a, &provider, "shm_utest_a u32 seq");
+    verify_cond(__LINE__, err == 0, "connect a: errno %d", err);
+    err = tracepoint_connect(&tp_b, &provider, "shm_utest_b u32 seq");
+    verify_cond(__LINE__, err == 0, "connect b: errno %d", err);
+    auto const registry_used = __atomic_load_n(&ring->registry_used, __ATOMIC_RELAXED);
+    verify_cond(__LINE__, tp_a.write_index >= 0 && tp_b.write_index > tp_a.write_index,
+        "write_index: a %d, b %d", tp_a.write_index, tp_b.write_index);
+    verify_cond(__LINE__, TRACEPOINT_ENABLED(&tp_a) && TRACEPOINT_ENABLED(&tp_b),
+        "events enabled while connected");
+
+    err = tracepoint_connect(&tp_a2, &provider, "shm_utest_a u32 seq");
+    verify_cond(__LINE__, err == 0, "connect a2: errno %d", err);
+    verify_cond(__LINE__, tp_a2.write_index == tp_a.write_index,
+        "reused write_index: expected %d, actual %d", tp_a.write_index, tp_a2.write_index);
+
+    tracepoint_close_provider(&provider);
+    err = tracepoint_open_provider(&provider);
+    verify_cond(__LINE__, err == 0, "reopen: errno %d", err);
+    err = tracepoint_connect(&tp_a, &provider, "shm_utest_a u32 seq");
+    verify_cond(__LINE__, err == 0, "reconnect a: errno %d", err);
+    err = tracepoint_connect(&tp_b, &provider, "shm_utest_b u32 seq");
+    verify_cond(__LINE__, err == 0, "reconnect b: errno %d", err);
+    verify_cond(__LINE__, tp_a2.write_index == -1, "a2 disconnected by close");
+    verify_cond(__LINE__, registry_used == __atomic_load_n(&ring->registry_used, __ATOMIC_RELAXED),
+        "registry_used after reuse: expected %u, actual %u",
+        registry_used, __atomic_load_n(&ring->registry_used, __ATOMIC_RELAXED));
+
+    auto const registry = reinterpret_cast<char const*>(ring) + ring->registry_offset;
+    auto const registration = reinterpret_cast<tracepoint_shm_registration const*>(registry + tp_b.write_index);
+    verify_cond(__LINE__, registration->ready == 1 &&
+        0 == strcmp(reinterpret_cast<char const*>(registration + 1), "shm_utest_b u32 seq"),
+        "registration of b");
+
+    // Fill the ring: writes fail with EAGAIN and are counted once it is full.
+
+    std::vector<drained_record> records;
+    unsigned const fit_count = DataSize / RecordSize;
+    uint32_t seq = 0;
+    for (; seq != fit_count; seq += 1)
+    {
+        err = write_event((seq & 1) ? tp_b : tp_a, seq);
+        verify_cond(__LINE__, err == 0, "write %u: errno %d", seq, err);
+    }
+
+    verify_cond(__LINE__, 0 == __atomic_load_n(&ring->dropped_count, __ATOMIC_RELAXED),
+        "dropped_count before full");
+    err = write_event(tp_a, seq);
+    verify_cond(__LINE__, err == EAGAIN, "write to full ring: expected EAGAIN, actual %d", err);
+    err = write_event(tp_b, seq);
+    verify_cond(__LINE__, err == EAGAIN, "write to full ring: expected EAGAIN, actual %d", err);
+    verify_cond(__LINE__, 2 == __atomic_load_n(&ring->dropped_count, __ATOMIC_RELAXED),
+        "dropped_count: expected 2, actual %llu",
+        static_cast<unsigned long long>(__atomic_load_n(&ring->dropped_count, __ATOMIC_RELAXED)));
+
+    auto pad_count = drain(__LINE__, ring, records);
+    verify_cond(__LINE__, pad_count == 0, "pad records before wrap: %u", pad_count);
+    verify_cond(__LINE__, records.size() == fit_count,
+        "drained: expected %u, actual %u", fit_count, static_cast<unsigned>(records.size()));
+
+    // Wrap: DataSize is not a multiple of RecordSize, so the next write needs
+    // a padding record at the end of the ring.
+
+    verify_cond(__LINE__, 0 != DataSize % RecordSize, "test needs a partial record at the end");
+    for (unsigned i = 0; i != 4; i += 1, seq += 1)
+    {
+        err = write_event((seq & 1) ? tp_b : tp_a, seq);
+        verify_cond(__LINE__, err == 0, "write after drain %u: errno %d", seq, err);
+    }
+
+    pad_count = drain(__LINE__, ring, records);
+    verify_cond(__LINE__, pad_count == 1, "pad records after wrap: expected 1, actual %u", pad_count);
+    verify_cond(__LINE__, records.size() == seq,
+        "drained: expected %u, actual %u", seq, static_cast<unsigned>(records.size()));
+    for (uint32_t i = 0; i != records.size(); i += 1)
+    {
+        auto const expected_id = static_cast<uint32_t>((i & 1) ? tp_b.write_index : tp_a.write_index);
+        verify_cond(__LINE__, records[i].seq == i && records[i].event_id == expected_id,
+            "record %u: seq %u, event_id %u", i, records[i].seq, records[i].event_id);
+    }
+
+    verify_cond(__LINE__,
+        __atomic_load_n(&ring->data_tail, __ATOMIC_RELAXED) == __atomic_load_n(&ring->data_head, __ATOMIC_RELAXED),
+        "ring empty after drain");
+
+    // Stall recovery: a producer reserves a record, then stops before claiming
+    // it. The consumer reclaims the record, and the producer's claim fails
+    // when it resumes, both before and after the space is reused.
+
+    auto const mask = ring->data_size - 1;
+    auto const stalled_pos = __atomic_fetch_add(&ring->data_head, RecordSize, __ATOMIC_RELAXED);
+    verify_cond(__LINE__, (stalled_pos & mask) + RecordSize <= DataSize, "stalled record should not wrap");
+    for (unsigned i = 0; i != 2; i += 1, seq += 1)
+    {
+        err = write_event((seq & 1) ? tp_b : tp_a, seq);
+        verify_cond(__LINE__, err == 0, "write after stall %u: errno %d", seq, err);
+    }
+
+    drain(__LINE__, ring, records);
+    verify_cond(__LINE__, records.size() == seq - 2,
+        "drain should stop at the stalled record: expected %u, actual %u",
+        seq - 2, static_cast<unsigned>(records.size()));
+
+    auto const new_tail = reclaim(ring, __atomic_load_n(&ring->data_head, __ATOMIC_RELAXED));
+    verify_cond(__LINE__, new_tail == stalled_pos + RecordSize,
+        "reclaim should stop at the first claimed record: expected 0x%llx, actual 0x%llx",
+        static_cast<unsigned long long>(stalled_pos + RecordSize),
+        static_cast<unsigned long long>(new_tail));
+
+    drain(__LINE__, ring, records);
+    verify_cond(__LINE__, records.size() == seq,
+        "drained after reclaim: expected %u, actual %u", seq, static_cast<unsigned>(records.size()));
+    verify_cond(__LINE__, !claim(ring, stalled_pos), "late claim should fail after reclaim");
+
+    // Reuse the stalled record's space for the next lap, leaving the records
+    // that cover it in the ring.
+    while (__atomic_load_n(&ring->data_head, __ATOMIC_RELAXED) < stalled_pos + DataSize + RecordSize)
+    {
+        err = write_event((seq & 1) ? tp_b : tp_a, seq);
+        if (err == EAGAIN)
+        {
+            auto const drained_count = records.size();
+            drain(__LINE__, ring, records);
+            if (records.size() != drained_count)
+            {
+                continue;
+            }
+        }
+
+        verify_cond(__LINE__, err == 0, "write after reclaim %u: errno %d", seq, err);
+        if (err != 0)
+        {
+            break;
+        }
+
+        seq += 1;
+    }
+
+    verify_cond(__LINE__, !claim(ring, stalled_pos), "late claim should fail after reuse");
+    drain(__LINE__, ring, records);
+    verify_cond(__LINE__, records.size() == seq,
+        "drained after reuse: expected %u, actual %u", seq, static_cast<unsigned>(records.size()));
+    for (uint32_t i = 0; i != records.size(); i += 1)
+    {
+        verify_cond(__LINE__, records[i].seq == i, "record %u: seq %u", i, records[i].seq);
+    }
+
+    tracepoint_close_provider(&provider);
+    unlink(path);
+
+    if (s_any_errors)
+    {
+        fprintf(stderr, "shm-utest.cpp : error : failed\n");
+    }
+
+    return s_any_errors;
+}
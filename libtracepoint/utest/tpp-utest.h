@@ -1,6 +1,7 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 
+#include <tracepoint/tracepoint-ext.h>
 #include <tracepoint/tracepoint-provider.h>
 
 #define PASTE2(a, b)        PASTE2_imp(a, b)
@@ -13,6 +14,8 @@
 #define FUNC1_ENABLED   PASTE2(FUNC1, _enabled)
 #define FUNC2           PASTE2(func2_, C_OR_CPP)
 #define FUNC2_ENABLED   PASTE2(FUNC2, _enabled)
+#define FUNC3           PASTE2(func3_, C_OR_CPP)
+#define FUNC3_ENABLED   PASTE2(FUNC3, _enabled)
 #define SUFFIX          "_" STRINGIZE(C_OR_CPP)
 
 #ifdef __cplusplus
@@ -41,6 +44,12 @@ TPP_FUNCTION(TestProvider, "func2" SUFFIX, FUNC2,
     TPP_CHAR_ARRAY("data5", 7, data5),
     TPP_STRUCT_PTR("data6", "MY_STRUCT", 8, data6));
 
+TPP_FUNCTION_PACKED(TestProvider, "func3" SUFFIX, FUNC3,
+    TPP_UINT8("data0", data0),
+    TPP_INT32("data1", data1),
+    TPP_UINT64("data2", data2),
+    TPP_INTPTR("data3", data3));
+
 static int TestCommon(void)
 {
     int ok = 1;
@@ -73,6 +82,12 @@ static int TestCommon(void)
         PrintErr("func2", err);
     }
 
+    if (FUNC3_ENABLED())
+    {
+        err = FUNC3(1, values[0], 0x3132333435363738, -1);
+        PrintErr("func3", err);
+    }
+
     return ok;
 }
 